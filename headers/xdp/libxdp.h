@@ -85,6 +85,8 @@ int xdp_program__set_chain_call_enabled(struct xdp_program *prog,
 int xdp_program__print_chain_call_actions(const struct xdp_program *prog,
 					  char *buf,
 					  size_t buf_len);
+bool xdp_program__xdp_frags_support(const struct xdp_program *xdp_prog);
+int xdp_program__set_xdp_frags_support(struct xdp_program *xdp_prog, bool frags);
 int xdp_program__pin(struct xdp_program *xdp_prog, const char *pin_path);
 int xdp_program__attach(struct xdp_program *xdp_prog,
 			int ifindex, enum xdp_attach_mode mode,
@@ -92,12 +94,18 @@ int xdp_program__attach(struct xdp_program *xdp_prog,
 int xdp_program__attach_multi(struct xdp_program **progs, size_t num_progs,
 			      int ifindex, enum xdp_attach_mode mode,
 			      unsigned int flags);
+int xdp_program__attach_ifaces(struct xdp_program **progs, size_t num_progs,
+			       const int *ifindexes, size_t num_ifaces,
+			       enum xdp_attach_mode mode, unsigned int flags);
 int xdp_program__detach(struct xdp_program *xdp_prog,
 			int ifindex, enum xdp_attach_mode mode,
 			unsigned int flags);
 int xdp_program__detach_multi(struct xdp_program **progs, size_t num_progs,
 			      int ifindex, enum xdp_attach_mode mode,
 			      unsigned int flags);
+int xdp_program__replace(struct xdp_program *old_prog,
+			 struct xdp_program *new_prog, int ifindex,
+			 enum xdp_attach_mode mode, unsigned int flags);
 
 struct xdp_multiprog *xdp_multiprog__get_from_ifindex(int ifindex);
 struct xdp_program *xdp_multiprog__next_prog(const struct xdp_program *prog,
@@ -109,6 +117,18 @@ struct xdp_program *xdp_multiprog__main_prog(const struct xdp_multiprog *mp);
 struct xdp_program *xdp_multiprog__hw_prog(const struct xdp_multiprog *mp);
 bool xdp_multiprog__is_legacy(const struct xdp_multiprog *mp);
 int xdp_multiprog__program_count(const struct xdp_multiprog *mp);
+bool xdp_multiprog__xdp_frags_support(const struct xdp_multiprog *mp);
+
+struct xdp_program_stats {
+	__u64 invocations;
+	__u64 run_time_ns;
+	__u64 verdicts[XDP_REDIRECT + 1];
+};
+
+bool xdp_multiprog__has_stats(const struct xdp_multiprog *mp);
+int xdp_multiprog__program_stats(const struct xdp_multiprog *mp,
+				 const struct xdp_program *prog,
+				 struct xdp_program_stats *stats);
 
 /* Only following members can be set at once:
  *
@@ -152,14 +172,38 @@ struct xdp_program_opts {
 	const char *pin_path;
 	__u32 id;
 	int fd;
+	/* The program handles multi-buffer packets (xdp.frags). Programs
+	 * opened from an xdp.frags section have this set already; the kernel
+	 * doesn't tell for programs that are already loaded.
+	 */
+	bool xdp_frags;
 	size_t :0;
 };
-#define xdp_program_opts__last_field fd
+#define xdp_program_opts__last_field xdp_frags
 
 #define DECLARE_LIBXDP_OPTS DECLARE_LIBBPF_OPTS
 
 struct xdp_program *xdp_program__create(struct xdp_program_opts *opts);
 
+/* What an interface supports, as reported by the kernel's netdev netlink
+ * family (Linux 6.3 and later): @xdp_features holds NETDEV_XDP_ACT_* flags,
+ * @xdp_rx_metadata_features NETDEV_XDP_RX_METADATA_* flags and @xsk_features
+ * NETDEV_XSK_FLAGS_* flags, from linux/netdev.h. Fields the running kernel
+ * doesn't report are zero. Returns -EOPNOTSUPP on kernels without the family.
+ * The features are only read once for each ifindex.
+ */
+struct xdp_iface_features {
+	size_t sz;
+	__u64 xdp_features;
+	__u64 xdp_rx_metadata_features;
+	__u64 xsk_features;
+	__u32 xdp_zc_max_segs;
+	size_t :0;
+};
+#define xdp_iface_features__last_field xdp_zc_max_segs
+
+int xdp_iface__get_features(int ifindex, struct xdp_iface_features *feat);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
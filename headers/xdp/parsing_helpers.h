@@ -276,4 +276,438 @@ static __always_inline int parse_tcphdr(struct hdr_cursor *nh,
 	return len;
 }
 
+/*
+ * Tunnel parsing, for programs that act on the inner headers of encapsulated
+ * packets. Define PARSE_TUNNELS to the set of encapsulations to look into
+ * before including this file; the code for the others is compiled out. The UDP
+ * ports are the IANA assigned ones, and can be redefined as well.
+ */
+#define PARSE_TUNNEL_IPIP	(1 << 0) /* IPv4 or IPv6 in IPv4 or IPv6 */
+#define PARSE_TUNNEL_GRE	(1 << 1)
+#define PARSE_TUNNEL_VXLAN	(1 << 2)
+#define PARSE_TUNNEL_GENEVE	(1 << 3)
+#define PARSE_TUNNEL_GTPU	(1 << 4)
+
+#ifndef PARSE_TUNNELS
+#define PARSE_TUNNELS (PARSE_TUNNEL_IPIP | PARSE_TUNNEL_GRE | \
+		       PARSE_TUNNEL_VXLAN | PARSE_TUNNEL_GENEVE | \
+		       PARSE_TUNNEL_GTPU)
+#endif
+
+#ifndef VXLAN_UDP_PORT
+#define VXLAN_UDP_PORT 4789
+#endif
+#ifndef GENEVE_UDP_PORT
+#define GENEVE_UDP_PORT 6081
+#endif
+#ifndef GTPU_UDP_PORT
+#define GTPU_UDP_PORT 2152
+#endif
+
+/* Longest chain of GTP-U extension headers to skip */
+#ifndef GTPU_EXT_MAX_CHAIN
+#define GTPU_EXT_MAX_CHAIN 4
+#endif
+
+/*
+ *	struct gre_hdr - GRE header (RFC 2784, RFC 2890), without the optional
+ *	checksum, key and sequence number fields that may follow it
+ */
+struct gre_hdr {
+	__be16	flags;
+	__be16	protocol;
+};
+
+/* Flags in network byte order, to test struct gre_hdr->flags with */
+#ifndef GRE_FLAG_CSUM
+#define GRE_FLAG_CSUM		bpf_htons(0x8000)
+#endif
+#ifndef GRE_FLAG_ROUTING
+#define GRE_FLAG_ROUTING	bpf_htons(0x4000)
+#endif
+#ifndef GRE_FLAG_KEY
+#define GRE_FLAG_KEY		bpf_htons(0x2000)
+#endif
+#ifndef GRE_FLAG_SEQ
+#define GRE_FLAG_SEQ		bpf_htons(0x1000)
+#endif
+#ifndef GRE_VERSION_MASK
+#define GRE_VERSION_MASK	bpf_htons(0x0007)
+#endif
+
+struct vxlan_hdr {
+	__be32	vx_flags;
+	__be32	vx_vni;
+};
+
+#define VXLAN_FLAG_VNI		bpf_htonl(0x08000000)
+
+/* The version is the top two bits of ver_opt_len, the length of the options
+ * following the header (in multiples of 4 bytes) the rest
+ */
+struct geneve_hdr {
+	__u8	ver_opt_len;
+	__u8	flags;
+	__be16	protocol;
+	__u8	vni[3];
+	__u8	reserved;
+};
+
+struct gtpu_hdr {
+	__u8	flags;
+	__u8	type;
+	__be16	length;
+	__be32	teid;
+};
+
+#define GTPU_FLAGS_VERSION	0xe0
+#define GTPU_V1			0x20
+#define GTPU_FLAG_PT		0x10
+#define GTPU_FLAG_EXT		0x04
+#define GTPU_FLAG_SEQ		0x02
+#define GTPU_FLAG_NPDU		0x01
+#define GTPU_TYPE_GPDU		0xff
+
+/*
+ * parse_grehdr: parse a GRE header along with its optional fields, and return
+ * the protocol of its payload (in network byte order). Only version 0 without
+ * source routing (which RFC 2784 deprecates) is supported.
+ */
+static __always_inline int parse_grehdr(struct hdr_cursor *nh,
+					void *data_end,
+					struct gre_hdr **grehdr)
+{
+	struct gre_hdr *greh = nh->pos;
+	int len = sizeof(*greh);
+
+	if (greh + 1 > data_end)
+		return -1;
+
+	if (greh->flags & (GRE_VERSION_MASK | GRE_FLAG_ROUTING))
+		return -1;
+
+	if (greh->flags & GRE_FLAG_CSUM)
+		len += 4;
+	if (greh->flags & GRE_FLAG_KEY)
+		len += 4;
+	if (greh->flags & GRE_FLAG_SEQ)
+		len += 4;
+
+	if (nh->pos + len > data_end)
+		return -1;
+
+	nh->pos += len;
+	*grehdr = greh;
+
+	return greh->protocol; /* network-byte-order */
+}
+
+/*
+ * parse_vxlanhdr: parse a VXLAN header and return the VNI; the payload is an
+ * Ethernet frame
+ */
+static __always_inline int parse_vxlanhdr(struct hdr_cursor *nh,
+					  void *data_end,
+					  struct vxlan_hdr **vxlanhdr)
+{
+	struct vxlan_hdr *vxh = nh->pos;
+
+	if (vxh + 1 > data_end || !(vxh->vx_flags & VXLAN_FLAG_VNI))
+		return -1;
+
+	nh->pos = vxh + 1;
+	*vxlanhdr = vxh;
+
+	return bpf_ntohl(vxh->vx_vni) >> 8;
+}
+
+/*
+ * parse_genevehdr: parse a Geneve header, skipping its options, and return the
+ * protocol of its payload (in network byte order)
+ */
+static __always_inline int parse_genevehdr(struct hdr_cursor *nh,
+					   void *data_end,
+					   struct geneve_hdr **genevehdr)
+{
+	struct geneve_hdr *gnvh = nh->pos;
+	int len;
+
+	if (gnvh + 1 > data_end || gnvh->ver_opt_len >> 6)
+		return -1;
+
+	len = sizeof(*gnvh) + (gnvh->ver_opt_len & 0x3f) * 4;
+	if (nh->pos + len > data_end)
+		return -1;
+
+	nh->pos += len;
+	*genevehdr = gnvh;
+
+	return gnvh->protocol; /* network-byte-order */
+}
+
+/*
+ * parse_gtpuhdr: parse a GTP-U header carrying user data (a G-PDU), skipping
+ * its optional fields and up to GTPU_EXT_MAX_CHAIN extension headers, and
+ * return the EtherType matching the IP version of the payload (in network byte
+ * order)
+ */
+static __always_inline int parse_gtpuhdr(struct hdr_cursor *nh,
+					 void *data_end,
+					 struct gtpu_hdr **gtpuhdr)
+{
+	struct gtpu_hdr *gtph = nh->pos;
+	__u8 *next, *pos;
+	int i;
+
+	if (gtph + 1 > data_end ||
+	    (gtph->flags & GTPU_FLAGS_VERSION) != GTPU_V1 ||
+	    !(gtph->flags & GTPU_FLAG_PT) || gtph->type != GTPU_TYPE_GPDU)
+		return -1;
+
+	pos = (void *)(gtph + 1);
+
+	/* The sequence number, N-PDU number and next extension type are there
+	 * if any of the flags for them is set
+	 */
+	if (gtph->flags & (GTPU_FLAG_EXT | GTPU_FLAG_SEQ | GTPU_FLAG_NPDU)) {
+		if (pos + 4 > data_end)
+			return -1;
+		next = pos + 3;
+		pos += 4;
+
+		#pragma unroll
+		for (i = 0; i < GTPU_EXT_MAX_CHAIN; i++) {
+			if (!(gtph->flags & GTPU_FLAG_EXT) || !*next)
+				break;
+
+			/* The length is in multiples of 4 bytes, and the
+			 * next extension type is the last byte
+			 */
+			if (pos + 1 > (__u8 *)data_end || !*pos)
+				return -1;
+			next = pos + *pos * 4 - 1;
+			if (next + 1 > (__u8 *)data_end)
+				return -1;
+			pos = next + 1;
+		}
+		if ((gtph->flags & GTPU_FLAG_EXT) && *next)
+			return -1;
+	}
+
+	if (pos + 1 > (__u8 *)data_end)
+		return -1;
+
+	nh->pos = pos;
+	*gtpuhdr = gtph;
+
+	switch (*pos >> 4) {
+	case 4:
+		return bpf_htons(ETH_P_IP);
+	case 6:
+		return bpf_htons(ETH_P_IPV6);
+	default:
+		return -1;
+	}
+}
+
+/*
+ * parse_tunnel: with nh at the payload of an IP header with protocol
+ * ip_proto, look past the encapsulation of the packet if it is one of
+ * PARSE_TUNNELS, and return the EtherType of the inner packet (in network byte
+ * order), with nh at its IP header. Returns 0, leaving nh as it is, for packets
+ * that are not (or not properly) encapsulated.
+ */
+static __always_inline int parse_tunnel(struct hdr_cursor *nh,
+					void *data_end,
+					int ip_proto)
+{
+	struct hdr_cursor inner = *nh;
+	struct geneve_hdr *gnvh;
+	struct vxlan_hdr *vxh;
+	struct gtpu_hdr *gtph;
+	struct gre_hdr *greh;
+	struct udphdr *udph;
+	struct ethhdr *eth;
+	int proto;
+
+	switch (ip_proto) {
+	case IPPROTO_IPIP:
+		if (!(PARSE_TUNNELS & PARSE_TUNNEL_IPIP))
+			return 0;
+		return bpf_htons(ETH_P_IP);
+	case IPPROTO_IPV6:
+		if (!(PARSE_TUNNELS & PARSE_TUNNEL_IPIP))
+			return 0;
+		return bpf_htons(ETH_P_IPV6);
+	case IPPROTO_GRE:
+		if (!(PARSE_TUNNELS & PARSE_TUNNEL_GRE))
+			return 0;
+		proto = parse_grehdr(&inner, data_end, &greh);
+		break;
+	case IPPROTO_UDP:
+		if (!(PARSE_TUNNELS & (PARSE_TUNNEL_VXLAN | PARSE_TUNNEL_GENEVE |
+				       PARSE_TUNNEL_GTPU)))
+			return 0;
+		if (parse_udphdr(&inner, data_end, &udph) < 0)
+			return 0;
+
+		if ((PARSE_TUNNELS & PARSE_TUNNEL_VXLAN) &&
+		    udph->dest == bpf_htons(VXLAN_UDP_PORT))
+			proto = parse_vxlanhdr(&inner, data_end, &vxh) < 0 ?
+				-1 : bpf_htons(ETH_P_TEB);
+		else if ((PARSE_TUNNELS & PARSE_TUNNEL_GENEVE) &&
+			 udph->dest == bpf_htons(GENEVE_UDP_PORT))
+			proto = parse_genevehdr(&inner, data_end, &gnvh);
+		else if ((PARSE_TUNNELS & PARSE_TUNNEL_GTPU) &&
+			 udph->dest == bpf_htons(GTPU_UDP_PORT))
+			proto = parse_gtpuhdr(&inner, data_end, &gtph);
+		else
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	/* Ethernet over GRE, VXLAN and Geneve */
+	if (proto == bpf_htons(ETH_P_TEB))
+		proto = parse_ethhdr(&inner, data_end, &eth);
+
+	if (proto <= 0)
+		return 0;
+
+	nh->pos = inner.pos;
+	return proto;
+}
+
+/*
+ * skip_tunnel: with nh at the L3 header of a packet with EtherType eth_type (as
+ * returned by parse_ethhdr()), look past one layer of encapsulation; returns the
+ * inner EtherType with nh at the inner L3 header, or 0 with nh unchanged if the
+ * packet is not encapsulated in any of PARSE_TUNNELS. Fragments and packets
+ * with malformed outer headers are left alone.
+ */
+static __always_inline int skip_tunnel(struct hdr_cursor *nh,
+				       void *data_end,
+				       int eth_type)
+{
+	struct hdr_cursor outer = *nh;
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+	int proto;
+
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		proto = parse_iphdr(&outer, data_end, &iph);
+		if (proto >= 0 && (iph->frag_off & bpf_htons(0x1fff)))
+			return 0;
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		proto = parse_ip6hdr(&outer, data_end, &ip6h);
+	} else {
+		return 0;
+	}
+
+	if (proto < 0)
+		return 0;
+
+	proto = parse_tunnel(&outer, data_end, proto);
+	if (proto)
+		nh->pos = outer.pos;
+	return proto;
+}
+
+/*
+ * Programs running in the parsing dispatcher of libxdp can skip parsing the
+ * Ethernet and IP headers themselves, by defining XDP_USE_PARSE_CTX before
+ * including this file. This declares the map the dispatcher leaves its parse
+ * context in, which libxdp shares with the program when linking it into such a
+ * dispatcher. Anywhere else, the map stays empty and parse_ctx_get() returns
+ * NULL, so programs keep the regular parse functions as a fallback:
+ *
+ *	pctx = parse_ctx_get(ctx);
+ *	if (pctx)
+ *		eth_type = parse_ctx_ethhdr(pctx, &nh, data_end, &eth);
+ *	else
+ *		eth_type = parse_ethhdr(&nh, data_end, &eth);
+ *
+ * The context describes the packet as the dispatcher received it, so it becomes
+ * invalid as soon as a program changes the packet headers.
+ */
+#ifdef XDP_USE_PARSE_CTX
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <xdp/prog_dispatcher.h>
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct xdp_parse_ctx);
+} xdp_parse_ctx SEC(".maps");
+
+static __always_inline struct xdp_parse_ctx *parse_ctx_get(struct xdp_md *ctx)
+{
+	struct xdp_parse_ctx *pctx;
+	__u32 key = 0;
+
+	pctx = bpf_map_lookup_elem(&xdp_parse_ctx, &key);
+	if (!pctx || !pctx->pkt_len ||
+	    pctx->pkt_len != ctx->data_end - ctx->data)
+		return NULL;
+
+	return pctx;
+}
+
+/* Like parse_ethhdr(), with nh->pos at the start of the packet */
+static __always_inline int parse_ctx_ethhdr(const struct xdp_parse_ctx *pctx,
+					    struct hdr_cursor *nh,
+					    void *data_end,
+					    struct ethhdr **ethhdr)
+{
+	struct ethhdr *eth = nh->pos;
+	__u16 off = pctx->l3_off;
+
+	/* Checked by the dispatcher already, but the verifier needs the bound */
+	if (eth + 1 > data_end || off >= XDP_PARSE_CTX_MAX_HDR)
+		return -1;
+
+	*ethhdr = eth;
+	nh->pos += off;
+	return pctx->l3_proto; /* network-byte-order */
+}
+
+/* Like parse_iphdr() and parse_ip6hdr(), with nh->pos at the IP header that
+ * parse_ctx_ethhdr() left it at
+ */
+static __always_inline int parse_ctx_iphdr(const struct xdp_parse_ctx *pctx,
+					   struct hdr_cursor *nh,
+					   void *data_end,
+					   struct iphdr **iphdr)
+{
+	struct iphdr *iph = nh->pos;
+	__u16 len = pctx->l3_len;
+
+	if (!len || len >= XDP_PARSE_CTX_MAX_HDR || iph + 1 > data_end)
+		return -1;
+
+	nh->pos += len;
+	*iphdr = iph;
+	return pctx->l4_proto;
+}
+
+static __always_inline int parse_ctx_ip6hdr(const struct xdp_parse_ctx *pctx,
+					    struct hdr_cursor *nh,
+					    void *data_end,
+					    struct ipv6hdr **ip6hdr)
+{
+	struct ipv6hdr *ip6h = nh->pos;
+	__u16 len = pctx->l3_len;
+
+	if (!len || len >= XDP_PARSE_CTX_MAX_HDR || ip6h + 1 > data_end)
+		return -1;
+
+	nh->pos += len;
+	*ip6hdr = ip6h;
+	return pctx->l4_proto;
+}
+#endif /* XDP_USE_PARSE_CTX */
+
 #endif /* __PARSING_HELPERS_H */
@@ -6,7 +6,7 @@
 #include <linux/types.h>
 
 #define XDP_METADATA_SECTION "xdp_metadata"
-#define XDP_DISPATCHER_VERSION 1
+#define XDP_DISPATCHER_VERSION 2
 /* default retval for dispatcher corresponds to the highest bit in the
  * chain_call_actions bitmap; we use this to make sure the dispatcher always
  * continues the calls chain if a function does not have an freplace program
@@ -18,10 +18,60 @@
 #define MAX_DISPATCHER_ACTIONS 10
 #endif
 
+/* is_xdp_frags was added in version 2, in what used to be padding, so it reads
+ * as zero in the config of older dispatchers.
+ */
 struct xdp_dispatcher_config {
 	__u8 num_progs_enabled;
+	__u8 is_xdp_frags;	/* loaded with BPF_F_XDP_HAS_FRAGS */
 	__u32 chain_call_actions[MAX_DISPATCHER_ACTIONS];
 	__u32 run_prios[MAX_DISPATCHER_ACTIONS];
 };
 
+/* The instrumented dispatcher (xdp-dispatcher-stats.o) keeps these for each
+ * slot in a per-CPU array map with this name, indexed by slot number.
+ * verdicts[] is indexed by XDP action, up to XDP_REDIRECT.
+ */
+#define XDP_DISPATCHER_STATS_MAP "xdp_disp_stats"
+#define XDP_DISPATCHER_NUM_VERDICTS 5
+
+struct xdp_dispatcher_stats {
+	__u64 invocations;
+	__u64 run_time_ns;
+	__u64 verdicts[XDP_DISPATCHER_NUM_VERDICTS];
+};
+
+/* The parsing dispatcher (xdp-dispatcher-parse.o) parses the Ethernet and IP
+ * headers of each packet once before running the component programs, and
+ * leaves the result for them in a single-entry per-CPU array map with this
+ * name. pkt_len is the packet length at parse time, and zero if there is no
+ * valid context; the dispatcher also leaves it at zero for packets with headers
+ * longer than XDP_PARSE_CTX_MAX_HDR, to keep the offsets small enough for the
+ * verifier. See parse_ctx_get() in parsing_helpers.h for how programs use it.
+ */
+#define XDP_DISPATCHER_PARSE_MAP "xdp_parse_ctx"
+#define XDP_PARSE_CTX_MAX_HDR 1024
+
+struct xdp_parse_ctx {
+	__u32 pkt_len;
+	__u16 l3_proto;	/* EtherType after any VLAN tags, network byte order */
+	__u16 l3_off;	/* from the start of the packet */
+	__u16 l3_len;	/* including IPv6 extension headers; zero if unparsed */
+	__u8 l4_proto;
+	__u8 pad;
+};
+
+/* The tail call dispatcher (xdp-dispatcher-tailcall.o), for kernels that can't
+ * attach freplace programs, jumps to the component programs through a program
+ * array map with this name, indexed by slot number, instead of calling them.
+ * A tail call doesn't return, so it is up to each program to carry on to the
+ * next slot according to the chain call actions kept in the array map named
+ * XDP_DISPATCHER_CHAIN_MAP, with the slot running on this CPU in the per-CPU
+ * map named XDP_DISPATCHER_SLOT_MAP. See xdp_tail_call_return() in
+ * xdp_helpers.h for how programs do this.
+ */
+#define XDP_DISPATCHER_PROGS_MAP "xdp_disp_progs"
+#define XDP_DISPATCHER_CHAIN_MAP "xdp_disp_chain"
+#define XDP_DISPATCHER_SLOT_MAP "xdp_disp_slot"
+
 #endif
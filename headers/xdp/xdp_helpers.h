@@ -9,4 +9,82 @@
 #define XDP_DEFAULT_RUN_PRIO 50
 #define XDP_DEFAULT_CHAIN_CALL_ACTIONS (1<<XDP_PASS)
 
+/*
+ * In the tail call dispatcher of libxdp, a program that returns ends the
+ * processing of the packet, as if none of its chain call actions were set. To
+ * chain call the programs after it, a program defines XDP_USE_TAIL_CALLS
+ * before including this file and returns its verdicts through
+ * xdp_tail_call_return():
+ *
+ *	return xdp_tail_call_return(ctx, XDP_PASS);
+ *
+ * This declares the maps of the dispatcher, which libxdp shares with the
+ * program when putting it in such a dispatcher. Anywhere else, the maps stay
+ * empty and xdp_tail_call_return() just returns the verdict.
+ *
+ * The maps are sized by MAX_DISPATCHER_ACTIONS, which has to be the same as the
+ * one libxdp is built with for them to be shared.
+ */
+#ifdef XDP_USE_TAIL_CALLS
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <xdp/prog_dispatcher.h>
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+	__uint(max_entries, MAX_DISPATCHER_ACTIONS);
+	__type(key, __u32);
+	__type(value, __u32);
+} xdp_disp_progs SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, MAX_DISPATCHER_ACTIONS);
+	__type(key, __u32);
+	__type(value, __u32);
+} xdp_disp_chain SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, __u32);
+} xdp_disp_slot SEC(".maps");
+
+/* Jump to the first program in a slot from first on; empty slots make the
+ * tail call fail, which moves on to the next one. Returns ret if there is no
+ * program left to run.
+ */
+static __always_inline int xdp_tail_call_from(struct xdp_md *ctx, __u32 *slot,
+					      __u32 first, int ret)
+{
+	__u32 i;
+
+#pragma unroll
+	for (i = 0; i < MAX_DISPATCHER_ACTIONS; i++) {
+		if (i < first)
+			continue;
+		*slot = i;
+		bpf_tail_call(ctx, &xdp_disp_progs, i);
+	}
+
+	return ret;
+}
+
+static __always_inline int xdp_tail_call_return(struct xdp_md *ctx, int ret)
+{
+	__u32 key = 0, *slot, *actions;
+
+	slot = bpf_map_lookup_elem(&xdp_disp_slot, &key);
+	if (!slot || ret < 0 || ret >= 32)
+		return ret;
+
+	actions = bpf_map_lookup_elem(&xdp_disp_chain, slot);
+	if (!actions || !((1U << ret) & *actions))
+		return ret;
+
+	return xdp_tail_call_from(ctx, slot, *slot + 1, ret);
+}
+#endif
+
 #endif
@@ -203,6 +203,44 @@ int BPF_PROG(tp_xdp_cpumap_compat, int map_id, unsigned int processed,
 	return 0;
 }
 
+/* The cpumap kthreads build skbs from the frames they dequeue, and on newer
+ * kernels run them through GRO before handing them to the stack. Count the
+ * skbs coming out of a kthread, and the segments they were merged from, in the
+ * second half of cpumap_kthread_cnt.
+ */
+SEC("tp_btf/netif_receive_skb")
+int BPF_PROG(tp_cpumap_gro, struct sk_buff *skb)
+{
+	static const char kthread_comm[] = "cpumap/";
+	struct skb_shared_info *shinfo;
+	struct datarec *rec;
+	char comm[8];
+	u32 cpu, idx;
+	u16 segs;
+	int i;
+
+	if (bpf_get_current_comm(comm, sizeof(comm)))
+		return 0;
+	for (i = 0; i < sizeof(kthread_comm) - 1; i++)
+		if (comm[i] != kthread_comm[i])
+			return 0;
+
+	if (!IN_SET(from_match, skb->dev->ifindex))
+		return 0;
+
+	shinfo = (void *)(skb->head + skb->end);
+	segs = BPF_CORE_READ(shinfo, gso_segs) ?: 1;
+
+	cpu = bpf_get_smp_processor_id();
+	idx = nr_cpus + cpu;
+	rec = bpf_map_lookup_elem(&cpumap_kthread_cnt, &idx);
+	if (!rec)
+		return 0;
+	NO_TEAR_INC(rec->processed);
+	NO_TEAR_ADD(rec->info, segs);
+	return 0;
+}
+
 SEC("tp_btf/xdp_exception")
 int BPF_PROG(tp_xdp_exception, const struct net_device *dev,
 	     const struct bpf_prog *xdp, u32 act)
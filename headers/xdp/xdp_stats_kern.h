@@ -12,10 +12,10 @@
 #include <../common/xdp_stats_kern_user.h>
 #endif
 
-/* Keeps stats per (enum) xdp_action */
+/* Keeps stats per (enum) xdp_action and receive queue */
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
-	__uint(max_entries, XDP_ACTION_MAX);
+	__uint(max_entries, XDP_STATS_MAX_RXQ * XDP_ACTION_MAX);
 	__type(key, __u32);
 	__type(value, struct datarec);
 	__uint(pinning, LIBBPF_PIN_BY_NAME);
@@ -25,11 +25,18 @@ struct {
 static __always_inline
 __u32 xdp_stats_record_action(struct xdp_md *ctx, __u32 action)
 {
+	__u32 rxq = ctx->rx_queue_index, key;
+	struct datarec *rec;
+
 	if (action >= XDP_ACTION_MAX)
 		return XDP_ABORTED;
 
+	if (rxq >= XDP_STATS_MAX_RXQ)
+		rxq = XDP_STATS_MAX_RXQ - 1;
+	key = rxq * XDP_ACTION_MAX + action;
+
 	/* Lookup in kernel BPF-side return pointer to actual data record */
-	struct datarec *rec = bpf_map_lookup_elem(&xdp_stats_map, &action);
+	rec = bpf_map_lookup_elem(&xdp_stats_map, &key);
 	if (!rec)
 		return XDP_ABORTED;
 
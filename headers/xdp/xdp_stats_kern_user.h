@@ -16,6 +16,13 @@ struct datarec {
 #define XDP_ACTION_MAX (XDP_REDIRECT + 1)
 #endif
 
+/* The stats map holds the records of each action for every receive queue, at
+ * key rxq * XDP_ACTION_MAX + action. Queues from XDP_STATS_MAX_RXQ - 1 and up
+ * share the last set of records. Maps pinned by older versions only have the
+ * XDP_ACTION_MAX records of queue 0.
+ */
+#define XDP_STATS_MAX_RXQ 64
+
 #define XDP_STATS_MAP_NAME xdp_stats_map
 
 #endif /* __XDP_STATS_KERN_USER_H */
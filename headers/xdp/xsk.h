@@ -14,6 +14,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <bpf/libbpf.h>
 #include <linux/if_xdp.h>
 
@@ -209,6 +210,17 @@ int xsk_socket__update_xskmap(struct xsk_socket *xsk, int xsks_map_fd);
  */
 #define XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD (1 << 0)
 #define XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD (1 << 0)
+/* Enable preferred busy polling on the socket using the busy_poll_usecs and
+ * busy_poll_budget fields below, which are only read when this flag is set.
+ */
+#define XSK_LIBXDP_FLAGS__BUSY_POLL (1 << 1)
+/* Load the variant of the default program that puts a struct xsk_rx_meta
+ * in front of every packet, see xsk_umem__get_rx_meta().
+ */
+#define XSK_LIBXDP_FLAGS__RX_METADATA (1 << 2)
+
+#define XSK_SOCKET__DEFAULT_BUSY_POLL_USECS 20
+#define XSK_SOCKET__DEFAULT_BUSY_POLL_BUDGET 64
 
 struct xsk_socket_config {
 	__u32 rx_size;
@@ -219,6 +231,8 @@ struct xsk_socket_config {
 	};
 	__u32 xdp_flags;
 	__u16 bind_flags;
+	__u16 busy_poll_budget;
+	__u32 busy_poll_usecs;
 };
 
 /* Set config to NULL to get the default configuration. */
@@ -256,11 +270,419 @@ void xsk_socket__delete(struct xsk_socket *xsk);
 #ifndef __LIBXDP_XSK_H
 #define __LIBXDP_XSK_H
 
+#include <xdp/xsk_rx_meta.h>
+
+/* Multi-buffer support, for building against older kernel headers */
+#ifndef XDP_USE_SG
+#define XDP_USE_SG (1 << 4)
+#endif
+
+#ifndef XDP_PKT_CONTD
+#define XDP_PKT_CONTD (1 << 0)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Batched ring accessors. These copy @nb entries starting at ring index @idx
+ * (as returned by xsk_ring_prod__reserve() or xsk_ring_cons__peek()) to or
+ * from a flat caller array. A wrap-around is handled by splitting the copy in
+ * at most two contiguous segments, so no per-entry index masking is needed.
+ */
+XDP_ALWAYS_INLINE __u32 xsk_ring__first_seg(__u32 mask, __u32 idx, __u32 nb)
+{
+	__u32 to_end = mask + 1 - (idx & mask);
+
+	return nb < to_end ? nb : to_end;
+}
+
+XDP_ALWAYS_INLINE void xsk_ring_prod__fill_addrs(struct xsk_ring_prod *fill,
+						 __u32 idx, const __u64 *addrs,
+						 __u32 nb)
+{
+	__u64 *ring = (__u64 *)fill->ring;
+	__u32 first = xsk_ring__first_seg(fill->mask, idx, nb);
+
+	memcpy(&ring[idx & fill->mask], addrs, first * sizeof(*ring));
+	memcpy(ring, addrs + first, (nb - first) * sizeof(*ring));
+}
+
+XDP_ALWAYS_INLINE void xsk_ring_cons__comp_addrs(const struct xsk_ring_cons *comp,
+						 __u32 idx, __u64 *addrs,
+						 __u32 nb)
+{
+	const __u64 *ring = (const __u64 *)comp->ring;
+	__u32 first = xsk_ring__first_seg(comp->mask, idx, nb);
+
+	memcpy(addrs, &ring[idx & comp->mask], first * sizeof(*ring));
+	memcpy(addrs + first, ring, (nb - first) * sizeof(*ring));
+}
+
+XDP_ALWAYS_INLINE void xsk_ring_prod__tx_descs(struct xsk_ring_prod *tx,
+					       __u32 idx,
+					       const struct xdp_desc *descs,
+					       __u32 nb)
+{
+	struct xdp_desc *ring = (struct xdp_desc *)tx->ring;
+	__u32 first = xsk_ring__first_seg(tx->mask, idx, nb);
+
+	memcpy(&ring[idx & tx->mask], descs, first * sizeof(*ring));
+	memcpy(ring, descs + first, (nb - first) * sizeof(*ring));
+}
+
+XDP_ALWAYS_INLINE void xsk_ring_cons__rx_descs(const struct xsk_ring_cons *rx,
+					       __u32 idx, struct xdp_desc *descs,
+					       __u32 nb)
+{
+	const struct xdp_desc *ring = (const struct xdp_desc *)rx->ring;
+	__u32 first = xsk_ring__first_seg(rx->mask, idx, nb);
+
+	memcpy(descs, &ring[idx & rx->mask], first * sizeof(*ring));
+	memcpy(descs + first, ring, (nb - first) * sizeof(*ring));
+}
+
+/* Return the buffers of up to @nb received descriptors straight to the fill
+ * ring, without looking at the packet data (the "rxdrop" fast path). Only as
+ * many descriptors as there is room for in the fill ring are consumed; the
+ * number of recycled buffers is returned.
+ */
+XDP_ALWAYS_INLINE __u32 xsk_ring_cons__recycle_rx(struct xsk_ring_cons *rx,
+						  struct xsk_ring_prod *fill,
+						  __u32 nb)
+{
+	const struct xdp_desc *descs = (const struct xdp_desc *)rx->ring;
+	__u64 *addrs = (__u64 *)fill->ring;
+	__u32 idx_rx, idx_fq, free_entries, done, seg, i;
+
+	nb = xsk_cons_nb_avail(rx, nb);
+	if (!nb)
+		return 0;
+
+	free_entries = xsk_prod_nb_free(fill, nb);
+	if (free_entries < nb)
+		nb = free_entries;
+	if (!nb)
+		return 0;
+
+	idx_rx = rx->cached_cons;
+	idx_fq = fill->cached_prod;
+
+	/* Walk both rings in segments that are contiguous in each of them */
+	for (done = 0; done < nb; done += seg) {
+		const struct xdp_desc *src = &descs[(idx_rx + done) & rx->mask];
+		__u64 *dst = &addrs[(idx_fq + done) & fill->mask];
+
+		seg = xsk_ring__first_seg(rx->mask, idx_rx + done, nb - done);
+		seg = xsk_ring__first_seg(fill->mask, idx_fq + done, seg);
+		for (i = 0; i < seg; i++)
+			dst[i] = src[i].addr;
+	}
+
+	rx->cached_cons += nb;
+	fill->cached_prod += nb;
+	xsk_ring_prod__submit(fill, nb);
+	xsk_ring_cons__release(rx, nb);
+
+	return nb;
+}
+
+/* Return the metadata the XSK_LIBXDP_FLAGS__RX_METADATA program stored in
+ * front of the packet at @data, as returned by xsk_umem__get_data(). The
+ * area is only written when the driver supports XDP metadata, so check that
+ * before relying on it.
+ */
+XDP_ALWAYS_INLINE const struct xsk_rx_meta *xsk_umem__get_rx_meta(const void *data)
+{
+	return (const struct xsk_rx_meta *)data - 1;
+}
+
+/* Multi-buffer packets. On a socket bound with XDP_USE_SG, a packet larger
+ * than a frame is spread over several consecutive descriptors, all but the
+ * last of which have XDP_PKT_CONTD set in their options. The kernel only
+ * makes whole packets visible on the Rx ring and only sends whole packets
+ * from the Tx ring, so a chain must be reserved and submitted in one go.
+ */
+
+/* Return the number of descriptors of the packet starting at Rx ring index
+ * @idx, looking at no more than the @nb descriptors peeked from there, and
+ * its total length in *@len. Returns 0 when the packet does not end within
+ * @nb descriptors. The descriptors stay in the ring, so the frames can be
+ * read in place through xsk_ring_cons__rx_desc() until they are released.
+ */
+XDP_ALWAYS_INLINE __u32 xsk_ring_cons__rx_pkt(const struct xsk_ring_cons *rx,
+					      __u32 idx, __u32 nb, __u32 *len)
+{
+	const struct xdp_desc *desc;
+	__u32 i, total = 0;
+
+	for (i = 0; i < nb; i++) {
+		desc = xsk_ring_cons__rx_desc(rx, idx + i);
+		total += desc->len;
+		if (!(desc->options & XDP_PKT_CONTD)) {
+			if (len)
+				*len = total;
+			return i + 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Write a packet made of the @nb buffers in @frags to the Tx ring at index
+ * @idx, as returned by xsk_ring_prod__reserve() for at least @nb entries,
+ * and chain them with XDP_PKT_CONTD. Only the addr and len fields of @frags
+ * are used. The descriptors are sent once they are submitted.
+ */
+XDP_ALWAYS_INLINE void xsk_ring_prod__tx_pkt(struct xsk_ring_prod *tx,
+					     __u32 idx,
+					     const struct xdp_desc *frags,
+					     __u32 nb)
+{
+	struct xdp_desc *desc;
+	__u32 i;
+
+	for (i = 0; i < nb; i++) {
+		desc = xsk_ring_prod__tx_desc(tx, idx + i);
+		desc->addr = frags[i].addr;
+		desc->len = frags[i].len;
+		desc->options = i + 1 < nb ? XDP_PKT_CONTD : 0;
+	}
+}
+
+/* Allocate and register a UMEM area of @size bytes. The area is backed by
+ * 1G or 2M hugepages when enough are reserved (normal pages otherwise) and
+ * preferably placed on the NUMA node of @ifname, which may be NULL. The
+ * area is returned in @umem_area and unmapped by xsk_umem__delete().
+ */
+int xsk_umem__create_hugepage(struct xsk_umem **umem, void **umem_area,
+			      __u64 size, const char *ifname,
+			      struct xsk_ring_prod *fill,
+			      struct xsk_ring_cons *comp,
+			      const struct xsk_umem_config *config);
+
+/* A UMEM can be shared with AF_XDP sockets in other processes when its area
+ * is allocated by xsk_umem__create_shareable(), from a memfd. The owner
+ * binds a first socket to the UMEM as usual, then sends the UMEM socket and
+ * the memfd over a connected AF_UNIX socket with xsk_umem__export(). Another
+ * process maps the same area with xsk_umem__import(), which returns its size
+ * in *@size. Each process owns the fill and completion rings of the queues
+ * it binds sockets to, so an importer creates its sockets with
+ * xsk_socket__create_shared(), with its own fill and completion rings, on
+ * queues (or devices) that no other process uses; the fill and completion
+ * rings passed to xsk_umem__create_shareable() belong to the owner's first
+ * queue. The processes have to split the frames of the UMEM between them,
+ * and must run the same version of libxdp.
+ */
+int xsk_umem__create_shareable(struct xsk_umem **umem, void **umem_area,
+			       __u64 size, struct xsk_ring_prod *fill,
+			       struct xsk_ring_cons *comp,
+			       const struct xsk_umem_config *config);
+int xsk_umem__export(const struct xsk_umem *umem, int sock);
+int xsk_umem__import(struct xsk_umem **umem, void **umem_area, __u64 *size,
+		     int sock);
+
+/* Kick the kernel to process the fill ring (and receive) or the Tx ring of
+ * @xsk. The syscall is only made when the ring needs a wakeup, or always
+ * when the socket was created with XSK_LIBXDP_FLAGS__BUSY_POLL, since the
+ * syscall is then what drives the driver's NAPI context. Transient errors
+ * are ignored; returns 0 or a negative errno.
+ */
+int xsk_socket__wakeup_rx(struct xsk_socket *xsk);
+int xsk_socket__wakeup_tx(struct xsk_socket *xsk);
+
+/* Kernel drop counters of a socket (from the XDP_STATISTICS socket option)
+ * and a snapshot of how many entries each of its rings holds, taken from the
+ * shared producer and consumer pointers. Counters the running kernel does
+ * not report are zero; the *_used fields of rings the socket does not have
+ * are zero too.
+ */
+struct xsk_socket_stats {
+	__u64 rx_dropped;
+	__u64 rx_invalid_descs;
+	__u64 tx_invalid_descs;
+	__u64 rx_ring_full;
+	__u64 rx_fill_ring_empty_descs;
+	__u64 tx_ring_empty_descs;
+	__u32 rx_ring_used;
+	__u32 tx_ring_used;
+	__u32 fill_ring_used;
+	__u32 comp_ring_used;
+};
+
+int xsk_socket__get_stats(const struct xsk_socket *xsk,
+			  struct xsk_socket_stats *stats);
+
+/* A socket group opens one AF_XDP socket per queue of an interface, with
+ * either one UMEM per queue or a single UMEM shared by all of them
+ * (XSK_SOCKET_GROUP_F_SHARED_UMEM). In the shared case, each queue's frames
+ * start at its frame_base and are umem_size bytes long. UMEMs are allocated
+ * with xsk_umem__create_hugepage(). For every queue the group also reports
+ * the IRQ of the queue and the CPU it is affine to, so the thread servicing
+ * a socket can be placed on (or next to) that CPU. irq and cpu are -1 when
+ * they can't be determined.
+ */
+struct xsk_socket_group;
+
+#define XSK_SOCKET_GROUP_F_SHARED_UMEM (1U << 0)
+#define XSK_SOCKET_GROUP_F_NO_RX (1U << 1)
+#define XSK_SOCKET_GROUP_F_NO_TX (1U << 2)
+
+struct xsk_socket_group_opts {
+	size_t sz;
+	__u32 num_queues;	/* 0: all queues of the interface */
+	__u32 flags;
+	__u64 umem_size;	/* per queue; 0: two ring sizes worth of frames */
+	const struct xsk_umem_config *umem_config;
+	const struct xsk_socket_config *socket_config;
+	size_t :0;
+};
+#define xsk_socket_group_opts__last_field socket_config
+
+struct xsk_queue_info {
+	__u32 queue_id;
+	int irq;
+	int cpu;
+	struct xsk_socket *xsk;
+	struct xsk_umem *umem;
+	void *umem_area;
+	__u64 frame_base;
+	struct xsk_ring_cons *rx;
+	struct xsk_ring_prod *tx;
+	struct xsk_ring_prod *fill;
+	struct xsk_ring_cons *comp;
+};
+
+int xsk_socket_group__create(struct xsk_socket_group **group,
+			     const char *ifname,
+			     const struct xsk_socket_group_opts *opts);
+void xsk_socket_group__delete(struct xsk_socket_group *group);
+__u32 xsk_socket_group__num_queues(const struct xsk_socket_group *group);
+const struct xsk_queue_info *
+xsk_socket_group__queue(const struct xsk_socket_group *group, __u32 idx);
+
+/* Optional frame allocator for a UMEM. A pool tracks every free frame of the
+ * UMEM; each thread allocates and frees through its own cache, which only
+ * goes back to the (locked) pool in bulk. Caches are not thread safe, so use
+ * one per thread. Frees accept any address inside a frame, such as the
+ * addresses found in Rx descriptors, in both aligned and unaligned mode.
+ */
+struct xsk_frame_pool;
+struct xsk_frame_cache;
+
+#define XSK_FRAME_CACHE__DEFAULT_SIZE 512
+
+/* Set cache_size to 0 to get the default. */
+int xsk_frame_pool__create(struct xsk_frame_pool **pool,
+			   struct xsk_umem *umem, __u32 cache_size);
+void xsk_frame_pool__delete(struct xsk_frame_pool *pool);
+__u32 xsk_frame_pool__num_free(struct xsk_frame_pool *pool);
+
+int xsk_frame_cache__create(struct xsk_frame_cache **cache,
+			    struct xsk_frame_pool *pool);
+/* Returns all frames still held by the cache to the pool. */
+void xsk_frame_cache__delete(struct xsk_frame_cache *cache);
+
+/* Returns the number of frames allocated, which can be less than nb. */
+__u32 xsk_frame_cache__alloc(struct xsk_frame_cache *cache, __u64 *addrs,
+			     __u32 nb);
+void xsk_frame_cache__free(struct xsk_frame_cache *cache, const __u64 *addrs,
+			   __u32 nb);
+/* The ring helpers below return the number of frames moved. Allocate up
+ * to nb frames and post them to the fill ring.
+ */
+__u32 xsk_frame_cache__fill(struct xsk_frame_cache *cache,
+			    struct xsk_ring_prod *fill, __u32 nb);
+/* Reap up to nb completed Tx frames and free them into the cache. */
+__u32 xsk_frame_cache__complete(struct xsk_frame_cache *cache,
+				struct xsk_ring_cons *comp, __u32 nb);
+
+/* Tx helper for a socket, allocating from a frame cache of its UMEM. Sent
+ * descriptors are submitted to the Tx ring straight away, but the kernel is
+ * only kicked once a batch of them has built up or the oldest one has waited
+ * for longer than the latency budget, and then only if the ring needs a
+ * wakeup. The batch adapts between 1 and max_batch: it grows while full
+ * batches build up within the budget and shrinks when the budget runs out
+ * first. Completions are reaped into the cache lazily, when it runs out of
+ * frames or when half the completion ring may be in use. The budget is only
+ * checked from the calls below, so call xsk_tx__flush() when there is
+ * nothing more to send for now. Not thread safe; one per socket and thread.
+ */
+struct xsk_tx;
+
+struct xsk_tx_opts {
+	size_t sz;
+	__u32 max_batch;	/* 0: XSK_TX__DEFAULT_MAX_BATCH */
+	__u32 budget_ns;	/* 0: XSK_TX__DEFAULT_BUDGET_NS */
+	size_t :0;
+};
+#define xsk_tx_opts__last_field budget_ns
+
+#define XSK_TX__DEFAULT_MAX_BATCH 64
+#define XSK_TX__DEFAULT_BUDGET_NS 20000
 
+int xsk_tx__create(struct xsk_tx **tx, struct xsk_socket *xsk,
+		   struct xsk_frame_cache *cache,
+		   const struct xsk_tx_opts *opts);
+void xsk_tx__delete(struct xsk_tx *tx);
+
+/* Returns the number of frames allocated, which can be less than nb. */
+__u32 xsk_tx__alloc(struct xsk_tx *tx, __u64 *addrs, __u32 nb);
+/* Returns the number of descriptors queued, which is less than nb when the
+ * Tx ring is full; the frames of the others still belong to the caller.
+ */
+__u32 xsk_tx__send(struct xsk_tx *tx, const struct xdp_desc *descs, __u32 nb);
+/* Kick the kernel for everything sent so far and reap completions. */
+int xsk_tx__flush(struct xsk_tx *tx);
+/* Frames sent and not reaped yet. */
+__u32 xsk_tx__outstanding(const struct xsk_tx *tx);
+
+/* Event loop helper for a set of sockets, built on epoll. xsk_poller__wait()
+ * scans the rings of all sockets, without any syscall, and reports every
+ * socket with Rx descriptors or completions to process or a ring that needs
+ * a kick, together with the number of entries ready. While there is traffic,
+ * it keeps scanning (busy spinning) for up to spin_usecs after the last
+ * event; once that long has passed without any, it blocks in epoll_wait()
+ * until a socket receives or the timeout expires, so idle queues don't use
+ * up a core. Completions don't wake up a blocked poller. The epoll fd can
+ * itself be added to an application's own event loop.
+ */
+struct xsk_poller;
+
+struct xsk_poller_opts {
+	size_t sz;
+	__u32 spin_usecs;	/* 0: XSK_POLLER__DEFAULT_SPIN_USECS */
+	size_t :0;
+};
+#define xsk_poller_opts__last_field spin_usecs
+
+#define XSK_POLLER__DEFAULT_SPIN_USECS 50
+
+/* The fill or Tx ring has entries and needs a wakeup */
+#define XSK_POLL_RX_KICK (1U << 0)	/* call xsk_socket__wakeup_rx() */
+#define XSK_POLL_TX_KICK (1U << 1)	/* call xsk_socket__wakeup_tx() */
+
+struct xsk_poll_event {
+	struct xsk_socket *xsk;
+	void *user_data;
+	__u32 rx_avail;
+	__u32 comp_avail;
+	__u32 tx_free;
+	__u32 flags;
+};
+
+int xsk_poller__create(struct xsk_poller **poller,
+		       const struct xsk_poller_opts *opts);
+void xsk_poller__delete(struct xsk_poller *poller);
+int xsk_poller__add(struct xsk_poller *poller, struct xsk_socket *xsk,
+		    void *user_data);
+int xsk_poller__remove(struct xsk_poller *poller, struct xsk_socket *xsk);
+int xsk_poller__fd(const struct xsk_poller *poller);
+/* Returns the number of events, or a negative errno. timeout_ms is as for
+ * epoll_wait(): -1 to wait forever, 0 to only scan once.
+ */
+int xsk_poller__wait(struct xsk_poller *poller, struct xsk_poll_event *events,
+		     int max_events, int timeout_ms);
 
 #ifdef __cplusplus
 } /* extern "C" */
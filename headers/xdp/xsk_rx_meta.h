@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause) */
+
+/* Layout of the per-packet metadata written in front of the packet data by
+ * the metadata variant of the default XSK program. Shared between that BPF
+ * program and userspace, so it only depends on linux/types.h.
+ */
+
+#ifndef __LIBXDP_XSK_RX_META_H
+#define __LIBXDP_XSK_RX_META_H
+
+#include <linux/types.h>
+
+/* Flags for the flags field, telling which of the other fields are valid */
+#define XSK_RX_META_F_HASH	(1 << 0)
+#define XSK_RX_META_F_TIMESTAMP	(1 << 1)
+#define XSK_RX_META_F_VLAN	(1 << 2)
+
+struct xsk_rx_meta {
+	__u64 timestamp;	/* CLOCK_MONOTONIC ns when the program ran */
+	__u32 hash;		/* Symmetric hash of the IP addresses and ports */
+	__u16 vlan_tci;		/* Outermost VLAN tag, host byte order */
+	__u16 flags;
+};
+
+#endif /* __LIBXDP_XSK_RX_META_H */
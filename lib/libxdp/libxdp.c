@@ -9,6 +9,7 @@
 #define _GNU_SOURCE
 
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -18,6 +19,8 @@
 #include <sys/vfs.h>
 #include <sys/types.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <dirent.h>
@@ -25,6 +28,9 @@
 #include <linux/err.h> /* ERR_PTR */
 #include <linux/if_link.h>
 #include <linux/magic.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/netdev.h>
 
 #include <bpf/libbpf.h>
 #include <bpf/btf.h>
@@ -36,6 +42,11 @@
 
 #define XDP_RUN_CONFIG_SEC ".xdp_run_config"
 #define XDP_SKIP_ENVVAR "LIBXDP_SKIP_DISPATCHER"
+#define XDP_STATS_ENVVAR "LIBXDP_DISPATCHER_STATS"
+#define XDP_PARSE_ENVVAR "LIBXDP_DISPATCHER_PARSE"
+#define XDP_TAILCALL_ENVVAR "LIBXDP_DISPATCHER_TAILCALL"
+#define XDP_LINK_ENVVAR "LIBXDP_ATTACH_LINK"
+#define XDP_INCREMENTAL_ENVVAR "LIBXDP_INCREMENTAL_UPDATE"
 
 /* When cloning BPF fds, we want to make sure they don't end up as any of the
  * standard stdin, stderr, stdout descriptors: fd 0 can confuse the kernel, and
@@ -48,6 +59,12 @@
 /* Max number of times we retry attachment */
 #define MAX_RETRY 10
 
+/* The kernel gives up on a chain of tail calls after this many, failed ones
+ * into empty slots included; so the tail call dispatcher can reach its first
+ * XDP_MAX_TAIL_CALLS slots at most.
+ */
+#define XDP_MAX_TAIL_CALLS 33
+
 static const char *dispatcher_feature_err =
 	"This means that the kernel does not support the features needed\n"
 	"by the multiprog dispatcher, either because it is too old entirely,\n"
@@ -66,6 +83,7 @@ struct xdp_program {
 	__u32 prog_id;
 	__u64 load_time;
 	bool from_external_obj;
+	bool is_frags;
 	unsigned int run_prio;
 	unsigned int chain_call_actions; /* bitmap */
 
@@ -83,10 +101,24 @@ struct xdp_multiprog {
 	bool is_legacy;
 	bool checked_compat;
 	enum xdp_attach_mode attach_mode;
+	__u32 stats_map_id;
+	__u32 parse_map_id;
+	__u32 progs_map_id; /* the maps of the tail call dispatcher */
+	__u32 chain_map_id;
+	__u32 slot_map_id;
+	int tail_call_map_fds[3]; /* opened from the pins, see xdp_multiprog__pin_maps() */
+	struct btf *main_btf; /* kernel BTF of main_prog, see find_prog_btf_id() */
 	int ifindex;
 };
 
 
+/* In the order of xdp_multiprog->tail_call_map_fds */
+static const char *tail_call_map_names[] = {
+	XDP_DISPATCHER_PROGS_MAP,
+	XDP_DISPATCHER_CHAIN_MAP,
+	XDP_DISPATCHER_SLOT_MAP,
+};
+
 static const char *xdp_action_names[] = {
 	[XDP_ABORTED] = "XDP_ABORTED",
 	[XDP_DROP] = "XDP_DROP",
@@ -113,11 +145,75 @@ extern const char _binary_xsk_def_xdp_prog_o_start;
 extern const char _binary_xsk_def_xdp_prog_o_end;
 extern const char _binary_xsk_def_xdp_prog_5_3_o_start;
 extern const char _binary_xsk_def_xdp_prog_5_3_o_end;
+extern const char _binary_xsk_def_xdp_prog_meta_o_start;
+extern const char _binary_xsk_def_xdp_prog_meta_o_end;
+
+#define EMBEDDED_OBJ_DECLARE(sym)                  \
+	extern const char _binary_##sym##_o_start; \
+	extern const char _binary_##sym##_o_end
+
+#define EMBEDDED_OBJ_ENTRY(file, sym) \
+	{file, &_binary_##sym##_o_start, &_binary_##sym##_o_end}
+
+/* The smaller dispatcher variants built for this MAX_DISPATCHER_ACTIONS, see
+ * DISPATCHER_VARIANTS in the Makefile.
+ */
+#if MAX_DISPATCHER_ACTIONS > 1
+EMBEDDED_OBJ_DECLARE(xdp_dispatcher_1);
+#endif
+#if MAX_DISPATCHER_ACTIONS > 2
+EMBEDDED_OBJ_DECLARE(xdp_dispatcher_2);
+#endif
+#if MAX_DISPATCHER_ACTIONS > 4
+EMBEDDED_OBJ_DECLARE(xdp_dispatcher_4);
+#endif
+#if MAX_DISPATCHER_ACTIONS > 8
+EMBEDDED_OBJ_DECLARE(xdp_dispatcher_8);
+#endif
+#if MAX_DISPATCHER_ACTIONS > 16
+EMBEDDED_OBJ_DECLARE(xdp_dispatcher_16);
+#endif
+#if MAX_DISPATCHER_ACTIONS > 32
+EMBEDDED_OBJ_DECLARE(xdp_dispatcher_32);
+#endif
+#if MAX_DISPATCHER_ACTIONS > 64
+EMBEDDED_OBJ_DECLARE(xdp_dispatcher_64);
+#endif
+EMBEDDED_OBJ_DECLARE(xdp_dispatcher_stats);
+EMBEDDED_OBJ_DECLARE(xdp_dispatcher_parse);
+EMBEDDED_OBJ_DECLARE(xdp_dispatcher_stats_parse);
+EMBEDDED_OBJ_DECLARE(xdp_dispatcher_tailcall);
 
 static struct xdp_embedded_obj embedded_objs[] = {
 	{"xdp-dispatcher.o", &_binary_xdp_dispatcher_o_start, &_binary_xdp_dispatcher_o_end},
 	{"xsk_def_xdp_prog.o", &_binary_xsk_def_xdp_prog_o_start, &_binary_xsk_def_xdp_prog_o_end},
 	{"xsk_def_xdp_prog_5.3.o", &_binary_xsk_def_xdp_prog_5_3_o_start, &_binary_xsk_def_xdp_prog_5_3_o_end},
+	{"xsk_def_xdp_prog_meta.o", &_binary_xsk_def_xdp_prog_meta_o_start, &_binary_xsk_def_xdp_prog_meta_o_end},
+#if MAX_DISPATCHER_ACTIONS > 1
+	EMBEDDED_OBJ_ENTRY("xdp-dispatcher-1.o", xdp_dispatcher_1),
+#endif
+#if MAX_DISPATCHER_ACTIONS > 2
+	EMBEDDED_OBJ_ENTRY("xdp-dispatcher-2.o", xdp_dispatcher_2),
+#endif
+#if MAX_DISPATCHER_ACTIONS > 4
+	EMBEDDED_OBJ_ENTRY("xdp-dispatcher-4.o", xdp_dispatcher_4),
+#endif
+#if MAX_DISPATCHER_ACTIONS > 8
+	EMBEDDED_OBJ_ENTRY("xdp-dispatcher-8.o", xdp_dispatcher_8),
+#endif
+#if MAX_DISPATCHER_ACTIONS > 16
+	EMBEDDED_OBJ_ENTRY("xdp-dispatcher-16.o", xdp_dispatcher_16),
+#endif
+#if MAX_DISPATCHER_ACTIONS > 32
+	EMBEDDED_OBJ_ENTRY("xdp-dispatcher-32.o", xdp_dispatcher_32),
+#endif
+#if MAX_DISPATCHER_ACTIONS > 64
+	EMBEDDED_OBJ_ENTRY("xdp-dispatcher-64.o", xdp_dispatcher_64),
+#endif
+	EMBEDDED_OBJ_ENTRY("xdp-dispatcher-stats.o", xdp_dispatcher_stats),
+	EMBEDDED_OBJ_ENTRY("xdp-dispatcher-parse.o", xdp_dispatcher_parse),
+	EMBEDDED_OBJ_ENTRY("xdp-dispatcher-stats-parse.o", xdp_dispatcher_stats_parse),
+	EMBEDDED_OBJ_ENTRY("xdp-dispatcher-tailcall.o", xdp_dispatcher_tailcall),
 	{},
 };
 static struct xdp_program *xdp_program__find_embedded(const char *filename,
@@ -206,9 +302,22 @@ static struct xdp_multiprog *xdp_multiprog__generate(struct xdp_program **progs,
 						     size_t num_progs,
 						     int ifindex,
 						     struct xdp_multiprog *old_mp,
-						     bool remove_progs);
+						     bool remove_progs,
+						     struct xdp_program *replace_prog);
 static int xdp_multiprog__pin(struct xdp_multiprog *mp);
 static int xdp_multiprog__unpin(struct xdp_multiprog *mp);
+static bool xdp_incremental_update(void);
+static int xdp_multiprog__fill_slot(struct xdp_multiprog *mp,
+				    struct xdp_program *prog,
+				    enum xdp_attach_mode mode);
+static int xdp_multiprog__unlink_progs(struct xdp_multiprog *mp,
+				       struct xdp_program **progs,
+				       size_t num_progs);
+static int xdp_get_ifindex_prog_id(int ifindex, __u32 *prog_id,
+				   __u32 *hw_prog_id, enum xdp_attach_mode *mode);
+static bool xdp_multiprog__is_shared(const struct xdp_multiprog *mp);
+static int xdp_multiprog__attach_shared(struct xdp_multiprog *mp, int ifindex,
+					enum xdp_attach_mode mode);
 
 
 /* On NULL, libxdp always sets errno to 0 for old APIs, so that their
@@ -256,6 +365,109 @@ static struct btf *btf__load_from_kernel_by_id(__u32 id)
 }
 #endif
 
+/* Programs loaded from the same object share their BTF, and the dispatcher's
+ * BTF is needed several times over when reading the programs attached to an
+ * interface and when linking programs into it. So share the BTF loaded from the
+ * kernel between users for as long as any of them still holds a reference.
+ * Users hold a reference to the program the BTF belongs to while using it, so
+ * the kernel can't reuse the ID for something else in the meantime. The list
+ * is shared by all threads, and protected by kernel_btfs_lock.
+ */
+struct kernel_btf {
+	struct kernel_btf *next;
+	struct btf *btf;
+	__u32 id;
+	int refcnt;
+};
+
+static struct kernel_btf *kernel_btfs = NULL;
+static bool kernel_btfs_lock;
+
+/* Must be called with kernel_btfs_lock held */
+static struct btf *__kernel_btf__get(__u32 id)
+{
+	struct kernel_btf *kb;
+
+	for (kb = kernel_btfs; kb; kb = kb->next) {
+		if (kb->id == id) {
+			kb->refcnt++;
+			return kb->btf;
+		}
+	}
+
+	return NULL;
+}
+
+static struct btf *kernel_btf__get(__u32 id)
+{
+	struct kernel_btf *kb;
+	struct btf *btf, *found;
+
+	libxdp_lock(&kernel_btfs_lock);
+	found = __kernel_btf__get(id);
+	libxdp_unlock(&kernel_btfs_lock);
+	if (found)
+		return found;
+
+	/* Don't hold the lock while loading, another thread may have added
+	 * the same BTF when we get back
+	 */
+	btf = btf__load_from_kernel_by_id(id);
+	if (!btf)
+		return NULL;
+
+	kb = calloc(1, sizeof(*kb));
+	if (!kb) {
+		btf__free(btf);
+		return NULL;
+	}
+
+	libxdp_lock(&kernel_btfs_lock);
+	found = __kernel_btf__get(id);
+	if (!found) {
+		kb->btf = btf;
+		kb->id = id;
+		kb->refcnt = 1;
+		kb->next = kernel_btfs;
+		kernel_btfs = kb;
+	}
+	libxdp_unlock(&kernel_btfs_lock);
+
+	if (found) {
+		btf__free(btf);
+		free(kb);
+		return found;
+	}
+	return btf;
+}
+
+static void kernel_btf__put(struct btf *btf)
+{
+	struct kernel_btf **pkb, *kb;
+
+	if (!btf)
+		return;
+
+	libxdp_lock(&kernel_btfs_lock);
+	for (pkb = &kernel_btfs; (kb = *pkb); pkb = &kb->next) {
+		if (kb->btf != btf)
+			continue;
+
+		if (--kb->refcnt) {
+			libxdp_unlock(&kernel_btfs_lock);
+			return;
+		}
+
+		*pkb = kb->next;
+		break;
+	}
+	libxdp_unlock(&kernel_btfs_lock);
+
+	/* Either the last reference, or not from the list at all */
+	btf__free(btf);
+	free(kb);
+}
+
 #ifndef HAVE_LIBBPF_BTF__TYPE_CNT
 static __u32 btf__type_cnt(const struct btf *btf)
 {
@@ -291,6 +503,31 @@ static size_t bpf_program__insn_cnt(const struct bpf_program *prog)
 }
 #endif
 
+#ifndef BPF_F_XDP_HAS_FRAGS
+#define BPF_F_XDP_HAS_FRAGS (1U << 5)
+#endif
+
+#ifndef BPF_F_XDP_DEV_BOUND_ONLY
+#define BPF_F_XDP_DEV_BOUND_ONLY (1U << 6)
+#endif
+
+/* Without program flags in libbpf, there is no way to load a program with
+ * BPF_F_XDP_HAS_FRAGS
+ */
+#ifndef HAVE_LIBBPF_BPF_PROGRAM__FLAGS
+static __u32 bpf_program__flags(const struct bpf_program *prog)
+{
+	(void)prog;
+	return 0;
+}
+
+static int bpf_program__set_flags(struct bpf_program *prog, __u32 flags)
+{
+	(void)prog;
+	return flags & BPF_F_XDP_HAS_FRAGS ? -EOPNOTSUPP : 0;
+}
+#endif
+
 /* This function has been deprecated in libbpf, but we expose an API that uses
  * section names, so we reimplement it to keep compatibility
  */
@@ -526,6 +763,227 @@ static int do_xdp_attach(int ifindex, int prog_fd, int old_fd, __u32 xdp_flags)
 #endif
 }
 
+static int xdp_mode_flags(enum xdp_attach_mode mode)
+{
+	switch (mode) {
+	case XDP_MODE_SKB:
+		return XDP_FLAGS_SKB_MODE;
+	case XDP_MODE_NATIVE:
+		return XDP_FLAGS_DRV_MODE;
+	case XDP_MODE_HW:
+		return XDP_FLAGS_HW_MODE;
+	case XDP_MODE_UNSPEC:
+		break;
+	}
+	return 0;
+}
+
+/* The features of an interface are read from the netdev generic netlink
+ * family, whose ID has to be looked up first. The features change at runtime
+ * (a veth gains some once its peer runs an XDP program, drivers lose some when
+ * reconfigured), so both are looked up again on every call.
+ */
+struct iface_features {
+	__u64 xdp_features;
+	__u64 xdp_rx_metadata_features;
+	__u64 xsk_features;
+	__u32 xdp_zc_max_segs;
+};
+
+struct genl_req {
+	struct nlmsghdr nh;
+	struct genlmsghdr gh;
+	char attrs[NLA_HDRLEN + GENL_NAMSIZ];
+};
+
+/* Send a generic netlink request with a single attribute, and receive the
+ * reply into buf. Returns the attributes of the reply in *attrs and their
+ * length, or a negative error.
+ */
+static int genl_query(int sock, __u16 family, __u8 cmd, __u16 attr_type,
+		      const void *data, __u16 data_len, char *buf,
+		      size_t buf_len, struct nlattr **attrs)
+{
+	struct genl_req req = {
+		.nh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN),
+		.nh.nlmsg_type = family,
+		.nh.nlmsg_flags = NLM_F_REQUEST,
+		.gh.cmd = cmd,
+		.gh.version = 1,
+	};
+	struct nlattr *nla = (struct nlattr *)req.attrs;
+	struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+	int len;
+
+	if (data_len > GENL_NAMSIZ)
+		return -EINVAL;
+
+	nla->nla_type = attr_type;
+	nla->nla_len = NLA_HDRLEN + data_len;
+	memcpy((char *)nla + NLA_HDRLEN, data, data_len);
+	req.nh.nlmsg_len += NLA_ALIGN(nla->nla_len);
+
+	if (send(sock, &req, req.nh.nlmsg_len, 0) < 0)
+		return -errno;
+
+	len = recv(sock, buf, buf_len, 0);
+	if (len < 0)
+		return -errno;
+
+	if (!NLMSG_OK(nh, len))
+		return -EPROTO;
+
+	if (nh->nlmsg_type == NLMSG_ERROR) {
+		struct nlmsgerr *nlerr = NLMSG_DATA(nh);
+
+		return nlerr->error ?: -EPROTO;
+	}
+
+	len = nh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	if (len < 0)
+		return -EPROTO;
+
+	*attrs = (struct nlattr *)((char *)NLMSG_DATA(nh) + GENL_HDRLEN);
+	return len;
+}
+
+#define for_each_nlattr(nla, len)					\
+	for (; (len) >= NLA_HDRLEN && (nla)->nla_len >= NLA_HDRLEN &&	\
+	       (nla)->nla_len <= (len);					\
+	     (len) -= NLA_ALIGN((nla)->nla_len),				\
+	     (nla) = (struct nlattr *)((char *)(nla) + NLA_ALIGN((nla)->nla_len)))
+
+/* Attributes are only aligned to four bytes */
+static __u64 nlattr_get_uint(const struct nlattr *nla)
+{
+	const char *data = (const char *)nla + NLA_HDRLEN;
+	__u64 val64 = 0;
+	__u32 val32 = 0;
+	__u16 val16 = 0;
+
+	switch (nla->nla_len - NLA_HDRLEN) {
+	case sizeof(val64):
+		memcpy(&val64, data, sizeof(val64));
+		return val64;
+	case sizeof(val32):
+		memcpy(&val32, data, sizeof(val32));
+		return val32;
+	case sizeof(val16):
+		memcpy(&val16, data, sizeof(val16));
+		return val16;
+	}
+	return 0;
+}
+
+static int netdev_get_family(int sock, char *buf, size_t buf_len)
+{
+	struct nlattr *nla;
+	int len;
+
+	len = genl_query(sock, GENL_ID_CTRL, CTRL_CMD_GETFAMILY,
+			 CTRL_ATTR_FAMILY_NAME, NETDEV_FAMILY_NAME,
+			 sizeof(NETDEV_FAMILY_NAME), buf, buf_len, &nla);
+	if (len < 0)
+		/* Kernels before 6.3 don't have the family */
+		return len == -ENOENT ? -EOPNOTSUPP : len;
+
+	for_each_nlattr(nla, len) {
+		if ((nla->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_FAMILY_ID)
+			return nlattr_get_uint(nla);
+	}
+
+	return -EOPNOTSUPP;
+}
+
+static int iface_features_get(int ifindex, struct iface_features *f)
+{
+	struct nlattr *nla;
+	__u32 idx = ifindex;
+	int sock, family, len;
+	char buf[4096];
+
+	sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (sock < 0)
+		return -errno;
+
+	family = netdev_get_family(sock, buf, sizeof(buf));
+	if (family < 0) {
+		len = family;
+		goto out;
+	}
+
+	len = genl_query(sock, family, NETDEV_CMD_DEV_GET, NETDEV_A_DEV_IFINDEX,
+			 &idx, sizeof(idx), buf, sizeof(buf), &nla);
+	if (len < 0)
+		goto out;
+
+	memset(f, 0, sizeof(*f));
+	for_each_nlattr(nla, len) {
+		switch (nla->nla_type & NLA_TYPE_MASK) {
+		case NETDEV_A_DEV_XDP_FEATURES:
+			f->xdp_features = nlattr_get_uint(nla);
+			break;
+		case NETDEV_A_DEV_XDP_RX_METADATA_FEATURES:
+			f->xdp_rx_metadata_features = nlattr_get_uint(nla);
+			break;
+		case NETDEV_A_DEV_XSK_FEATURES:
+			f->xsk_features = nlattr_get_uint(nla);
+			break;
+		case NETDEV_A_DEV_XDP_ZC_MAX_SEGS:
+			f->xdp_zc_max_segs = nlattr_get_uint(nla);
+			break;
+		}
+	}
+	len = 0;
+out:
+	close(sock);
+	return len;
+}
+
+int xdp_iface__get_features(int ifindex, struct xdp_iface_features *feat)
+{
+	struct iface_features f;
+	int err;
+
+	if (ifindex <= 0 || !OPTS_VALID(feat, xdp_iface_features))
+		return libxdp_err(-EINVAL);
+
+	err = iface_features_get(ifindex, &f);
+	if (err)
+		return libxdp_err(err);
+
+	OPTS_SET(feat, xdp_features, f.xdp_features);
+	OPTS_SET(feat, xdp_rx_metadata_features, f.xdp_rx_metadata_features);
+	OPTS_SET(feat, xsk_features, f.xsk_features);
+	OPTS_SET(feat, xdp_zc_max_segs, f.xdp_zc_max_segs);
+	return 0;
+}
+
+/* Without a mode, the kernel attaches in native mode if the driver implements
+ * XDP at all, and silently falls back to skb mode otherwise. Make that choice
+ * here from the features of the interface instead, so the fallback can be
+ * reported; on kernels that don't tell, keep leaving it to the kernel.
+ */
+static enum xdp_attach_mode xdp_iface_best_mode(int ifindex)
+{
+	struct iface_features f;
+	int err;
+
+	err = iface_features_get(ifindex, &f);
+	if (err) {
+		pr_debug("Couldn't get XDP features of ifindex %d: %s\n",
+			 ifindex, strerror(-err));
+		return XDP_MODE_UNSPEC;
+	}
+
+	if (f.xdp_features & NETDEV_XDP_ACT_BASIC)
+		return XDP_MODE_NATIVE;
+
+	pr_info("Driver of ifindex %d has no native XDP support, "
+		"attaching in skb mode\n", ifindex);
+	return XDP_MODE_SKB;
+}
+
 static int xdp_attach_fd(int prog_fd, int old_fd, int ifindex,
 			 enum xdp_attach_mode mode)
 {
@@ -539,19 +997,7 @@ static int xdp_attach_fd(int prog_fd, int old_fd, int ifindex,
 		old_fd = 0;
 	}
 
-	switch (mode) {
-	case XDP_MODE_SKB:
-		xdp_flags |= XDP_FLAGS_SKB_MODE;
-		break;
-	case XDP_MODE_NATIVE:
-		xdp_flags |= XDP_FLAGS_DRV_MODE;
-		break;
-	case XDP_MODE_HW:
-		xdp_flags |= XDP_FLAGS_HW_MODE;
-		break;
-	case XDP_MODE_UNSPEC:
-		break;
-	}
+	xdp_flags |= xdp_mode_flags(mode);
 again:
 	err = do_xdp_attach(ifindex, prog_fd, old_fd, xdp_flags);
 	if (err < 0) {
@@ -669,6 +1115,33 @@ int xdp_program__set_run_prio(struct xdp_program *prog, unsigned int run_prio)
 	return 0;
 }
 
+bool xdp_program__xdp_frags_support(const struct xdp_program *prog)
+{
+	return prog && prog->is_frags;
+}
+
+int xdp_program__set_xdp_frags_support(struct xdp_program *prog, bool frags)
+{
+	__u32 flags;
+	int err;
+
+	if (!prog || !prog->bpf_prog || prog->prog_fd >= 0)
+		return libxdp_err(-EINVAL);
+
+	flags = bpf_program__flags(prog->bpf_prog);
+	if (frags)
+		flags |= BPF_F_XDP_HAS_FRAGS;
+	else
+		flags &= ~BPF_F_XDP_HAS_FRAGS;
+
+	err = bpf_program__set_flags(prog->bpf_prog, flags);
+	if (err)
+		return libxdp_err(err);
+
+	prog->is_frags = frags;
+	return 0;
+}
+
 const char *xdp_program__name(const struct xdp_program *prog)
 {
 	if (!prog)
@@ -1052,8 +1525,8 @@ void xdp_program__close(struct xdp_program *xdp_prog)
 	if (!xdp_prog->from_external_obj) {
 		if (xdp_prog->bpf_obj)
 			bpf_object__close(xdp_prog->bpf_obj);
-		else if (xdp_prog->btf)
-			btf__free(xdp_prog->btf);
+		else
+			kernel_btf__put(xdp_prog->btf);
 	}
 
 	free(xdp_prog);
@@ -1102,6 +1575,8 @@ static struct xdp_program *xdp_program__create_from_obj(struct bpf_object *obj,
 	xdp_prog->bpf_obj = obj;
 	xdp_prog->btf = bpf_object__btf(obj);
 	xdp_prog->from_external_obj = external;
+	xdp_prog->is_frags = !!(bpf_program__flags(bpf_prog) &
+				BPF_F_XDP_HAS_FRAGS);
 
 	return xdp_prog;
 err:
@@ -1288,7 +1763,7 @@ static int xdp_program__fill_from_fd(struct xdp_program *xdp_prog, int fd)
 	}
 
 	if (info.btf_id && !xdp_prog->btf) {
-		btf = btf__load_from_kernel_by_id(info.btf_id);
+		btf = kernel_btf__get(info.btf_id);
 		if (!btf) {
 			pr_warn("Couldn't get BTF for ID %ul\n", info.btf_id);
 			goto err;
@@ -1305,7 +1780,7 @@ static int xdp_program__fill_from_fd(struct xdp_program *xdp_prog, int fd)
 	return 0;
 err:
 	close(prog_fd);
-	btf__free(btf);
+	kernel_btf__put(btf);
 	return err;
 }
 
@@ -1381,8 +1856,10 @@ struct xdp_program *xdp_program__create(struct xdp_program_opts *opts)
 	struct bpf_object_open_opts *obj_opts;
 	struct xdp_program *prog;
 	struct bpf_object *obj;
+	bool frags;
 	__u32 id;
 	int fd;
+	int err;
 
 	if (!opts || !OPTS_VALID(opts, xdp_program_opts))
 		goto err;
@@ -1395,6 +1872,7 @@ struct xdp_program *xdp_program__create(struct xdp_program_opts *opts)
 	pin_path      = OPTS_GET(opts, pin_path, NULL);
 	id            = OPTS_GET(opts, id, 0);
 	fd            = OPTS_GET(opts, fd, 0);
+	frags         = OPTS_GET(opts, xdp_frags, false);
 
 	if (obj) { /* prog_name is optional */
 		if (obj_opts || find_filename || open_filename || pin_path || id || fd)
@@ -1425,6 +1903,17 @@ struct xdp_program *xdp_program__create(struct xdp_program_opts *opts)
 	}
 	if (IS_ERR(prog))
 		return libxdp_err_ptr(PTR_ERR(prog), true);
+
+	/* A loaded program can only be taken at its word */
+	if (frags && prog->prog_fd >= 0) {
+		prog->is_frags = true;
+	} else if (frags) {
+		err = xdp_program__set_xdp_frags_support(prog, true);
+		if (err) {
+			xdp_program__close(prog);
+			return libxdp_err_ptr(err, true);
+		}
+	}
 	return prog;
 err:
 	return libxdp_err_ptr(-EINVAL, true);
@@ -1544,6 +2033,9 @@ static int xdp_program__attach_single(struct xdp_program *prog, int ifindex,
 	if (prog->prog_fd < 0)
 		return -EINVAL;
 
+	if (mode == XDP_MODE_UNSPEC)
+		mode = xdp_iface_best_mode(ifindex);
+
 	return xdp_attach_fd(xdp_program__fd(prog), -1, ifindex, mode);
 }
 
@@ -1660,9 +2152,43 @@ retry:
 			pr_debug("Skipping dispatcher due to environment setting\n");
 			return libxdp_err(xdp_program__attach_single(progs[0], ifindex, mode));
 		}
+
+		/* Device-bound programs (such as those reading RX metadata
+		 * through kfuncs) can't be loaded as extensions of the
+		 * dispatcher, so they can only be attached on their own.
+		 */
+		if (progs[0]->bpf_prog &&
+		    bpf_program__flags(progs[0]->bpf_prog) & BPF_F_XDP_DEV_BOUND_ONLY) {
+			pr_debug("Attaching device-bound program without dispatcher\n");
+			return libxdp_err(xdp_program__attach_single(progs[0], ifindex, mode));
+		}
+	}
+
+	/* A single program can often go into a slot emptied by an earlier
+	 * detach, without building a new dispatcher
+	 */
+	if (old_mp && num_progs == 1 && xdp_incremental_update()) {
+		err = xdp_multiprog__fill_slot(old_mp, progs[0], mode);
+		if (err == -EAGAIN) {
+			if (++retry_counter > MAX_RETRY) {
+				pr_warn("Retried more than %d times, giving up\n",
+					retry_counter);
+				err = -EBUSY;
+				goto out;
+			}
+
+			pr_debug("Existing dispatcher replaced while adding program, retrying.\n");
+			xdp_multiprog__close(old_mp);
+			usleep(1 << retry_counter); /* exponential backoff */
+			goto retry;
+		}
+		if (err != -ENOSPC)
+			goto out;
+		err = 0;
 	}
 
-	mp = xdp_multiprog__generate(progs, num_progs, ifindex, old_mp, false);
+	mp = xdp_multiprog__generate(progs, num_progs, ifindex, old_mp, false,
+				     NULL);
 	if (IS_ERR(mp)) {
 		err = PTR_ERR(mp);
 		mp = NULL;
@@ -1735,6 +2261,87 @@ int xdp_program__attach(struct xdp_program *prog, int ifindex,
 	return libxdp_err(xdp_program__attach_multi(&prog, 1, ifindex, mode, flags));
 }
 
+int xdp_program__attach_ifaces(struct xdp_program **progs, size_t num_progs,
+			       const int *ifindexes, size_t num_ifaces,
+			       enum xdp_attach_mode mode, unsigned int flags)
+{
+	struct xdp_multiprog *shared = NULL;
+	bool can_share = true;
+	size_t i;
+	int err;
+
+	if (!progs || !num_progs || !ifindexes || !num_ifaces || flags)
+		return libxdp_err(-EINVAL);
+
+	/* HW offloaded programs are bound to a single device */
+	if (mode == XDP_MODE_HW && num_ifaces > 1)
+		return libxdp_err(-EINVAL);
+
+	/* The component programs are loaded into the kernel (and verified)
+	 * while attaching to the first interface. Interfaces that have no
+	 * programs yet then share the dispatcher built for the first such
+	 * interface, so it isn't loaded again either; the others get a new
+	 * dispatcher and links for the already-loaded programs.
+	 */
+	for (i = 0; i < num_ifaces; i++) {
+		__u32 prog_id = 0, hw_prog_id = 0;
+		bool empty;
+
+		if (shared) {
+			err = xdp_multiprog__attach_shared(shared, ifindexes[i],
+							   mode);
+			if (!err)
+				continue;
+			if (err != -EEXIST) {
+				pr_warn("Failed to attach programs on ifindex %d: %s\n",
+					ifindexes[i], strerror(-err));
+				goto err;
+			}
+		}
+
+		empty = mode != XDP_MODE_HW &&
+			!xdp_get_ifindex_prog_id(ifindexes[i], &prog_id,
+						 &hw_prog_id, NULL) &&
+			!prog_id && !hw_prog_id;
+
+		err = xdp_program__attach_multi(progs, num_progs, ifindexes[i],
+						mode, 0);
+		if (err) {
+			pr_warn("Failed to attach programs on ifindex %d: %s\n",
+				ifindexes[i], strerror(-err));
+			goto err;
+		}
+
+		/* Only a dispatcher with just these programs can be shared */
+		if (!shared && empty && can_share) {
+			shared = xdp_multiprog__get_from_ifindex(ifindexes[i]);
+			if (IS_ERR_OR_NULL(shared) ||
+			    xdp_multiprog__is_legacy(shared)) {
+				if (!IS_ERR_OR_NULL(shared))
+					xdp_multiprog__close(shared);
+				shared = NULL;
+				can_share = false;
+			}
+		}
+	}
+
+	xdp_multiprog__close(shared);
+	return 0;
+
+err:
+	xdp_multiprog__close(shared);
+	while (i--) {
+		int ret;
+
+		ret = xdp_program__detach_multi(progs, num_progs, ifindexes[i],
+						mode, 0);
+		if (ret)
+			pr_warn("Failed to detach programs from ifindex %d: %s\n",
+				ifindexes[i], strerror(-ret));
+	}
+	return libxdp_err(err);
+}
+
 int xdp_program__detach_multi(struct xdp_program **progs, size_t num_progs,
 			      int ifindex, enum xdp_attach_mode mode,
 			      unsigned int flags)
@@ -1827,8 +2434,11 @@ int xdp_program__detach_multi(struct xdp_program **progs, size_t num_progs,
 		err = xdp_multiprog__unpin(mp);
 		if (err)
 			goto out;
+	} else if (xdp_incremental_update() && !xdp_multiprog__is_shared(mp)) {
+		err = xdp_multiprog__unlink_progs(mp, progs, num_progs);
 	} else {
-		new_mp = xdp_multiprog__generate(progs, num_progs, ifindex, mp, true);
+		new_mp = xdp_multiprog__generate(progs, num_progs, ifindex, mp,
+						 true, NULL);
 		if (IS_ERR(new_mp)) {
 			err = PTR_ERR(new_mp);
 			if (err == -EOPNOTSUPP) {
@@ -1887,19 +2497,154 @@ int xdp_program__detach(struct xdp_program *prog, int ifindex,
 	return libxdp_err(xdp_program__detach_multi(&prog, 1, ifindex, mode, flags));
 }
 
-void xdp_multiprog__close(struct xdp_multiprog *mp)
+int xdp_program__replace(struct xdp_program *old_prog,
+			 struct xdp_program *new_prog, int ifindex,
+			 enum xdp_attach_mode mode, unsigned int flags)
 {
-	struct xdp_program *p, *next = NULL;
+	struct xdp_multiprog *new_mp = NULL, *mp = NULL;
+	int err = 0, retry_counter = 0;
+	struct xdp_program *p = NULL;
+	bool found = false;
 
-	if (IS_ERR_OR_NULL(mp))
-		return;
+	if (IS_ERR_OR_NULL(old_prog) || IS_ERR_OR_NULL(new_prog) || flags)
+		return libxdp_err(-EINVAL);
 
-	xdp_program__close(mp->main_prog);
-	for (p = mp->first_prog; p; p = next) {
-		next = p->next;
+	if (mode == XDP_MODE_HW) {
+		pr_warn("Replacing HW mode programs not supported\n");
+		return libxdp_err(-EOPNOTSUPP);
+	}
+
+	if (!old_prog->prog_id) {
+		pr_warn("Program to replace not loaded\n");
+		return libxdp_err(-EINVAL);
+	}
+
+	if (new_prog->prog_fd >= 0) {
+		pr_warn("Replacement program must not be loaded yet\n");
+		return libxdp_err(-EINVAL);
+	}
+
+retry:
+	mp = xdp_multiprog__get_from_ifindex(ifindex);
+	if (IS_ERR_OR_NULL(mp)) {
+		pr_warn("No XDP program found on ifindex %d\n", ifindex);
+		return libxdp_err(-ENOENT);
+	}
+
+	if (mode != XDP_MODE_UNSPEC && mp->attach_mode != mode) {
+		pr_warn("XDP program attached in mode %d, requested %d\n",
+			mp->attach_mode, mode);
+		err = -ENOENT;
+		goto out;
+	}
+
+	/* Without a dispatcher, the kernel can swap the program directly */
+	if (mp->is_legacy) {
+		if (xdp_multiprog__main_id(mp) != old_prog->prog_id) {
+			pr_warn("Asked to replace prog %u but %u is loaded\n",
+				old_prog->prog_id, xdp_multiprog__main_id(mp));
+			err = -ENOENT;
+			goto out;
+		}
+
+		if (new_prog->prog_fd < 0) {
+			bpf_program__set_type(new_prog->bpf_prog,
+					      BPF_PROG_TYPE_XDP);
+			err = xdp_program__load(new_prog);
+			if (err)
+				goto out;
+		}
+
+		err = xdp_attach_fd(new_prog->prog_fd, xdp_multiprog__main_fd(mp),
+				    ifindex, mp->attach_mode);
+		goto out;
+	}
+
+	while ((p = xdp_multiprog__next_prog(p, mp))) {
+		if (p->prog_id == old_prog->prog_id)
+			found = true;
+	}
+
+	if (!found) {
+		pr_warn("Couldn't find program with id %d on ifindex %d\n",
+			old_prog->prog_id, ifindex);
+		err = -ENOENT;
+		goto out;
+	}
+
+	/* The kernel only allows one freplace program per dispatcher slot, and
+	 * can't swap it atomically, so build a new dispatcher holding the new
+	 * program in place of the old one, and replace the whole dispatcher
+	 * instead. Packets are processed by either the old or the new program
+	 * throughout.
+	 */
+	new_mp = xdp_multiprog__generate(&new_prog, 1, ifindex, mp, false,
+					 old_prog);
+	if (IS_ERR(new_mp)) {
+		err = PTR_ERR(new_mp);
+		new_mp = NULL;
+		goto out;
+	}
+
+	err = xdp_multiprog__pin(new_mp);
+	if (err) {
+		pr_warn("Failed to pin program: %s\n", strerror(-err));
+		goto out;
+	}
+
+	err = xdp_multiprog__attach(mp, new_mp, mp->attach_mode);
+	if (err) {
+		pr_debug("Failed to attach dispatcher on ifindex %d: %s\n",
+			 ifindex, strerror(-err));
+		xdp_multiprog__unpin(new_mp);
+		goto out;
+	}
+
+	err = xdp_multiprog__unpin(mp);
+	if (err) {
+		pr_warn("Failed to unpin old dispatcher: %s\n",
+			strerror(-err));
+		err = 0;
+	}
+
+out:
+	xdp_multiprog__close(mp);
+	xdp_multiprog__close(new_mp);
+	if (err == -EAGAIN) {
+		if (++retry_counter > MAX_RETRY) {
+			pr_warn("Retried more than %d times, giving up\n",
+				retry_counter);
+			return libxdp_err(-EBUSY);
+		}
+
+		pr_debug("Existing dispatcher replaced while building replacement, retrying.\n");
+		new_mp = NULL;
+		found = false;
+		p = NULL;
+		usleep(1 << retry_counter);  /* exponential backoff */
+		goto retry;
+	}
+	return libxdp_err(err);
+}
+
+void xdp_multiprog__close(struct xdp_multiprog *mp)
+{
+	struct xdp_program *p, *next = NULL;
+	size_t i;
+
+	if (IS_ERR_OR_NULL(mp))
+		return;
+
+	kernel_btf__put(mp->main_btf);
+	xdp_program__close(mp->main_prog);
+	for (p = mp->first_prog; p; p = next) {
+		next = p->next;
 		xdp_program__close(p);
 	}
 	xdp_program__close(mp->hw_prog);
+	for (i = 0; i < ARRAY_SIZE(mp->tail_call_map_fds); i++)
+		if (mp->tail_call_map_fds[i] >= 0)
+			close(mp->tail_call_map_fds[i]);
 
 	free(mp);
 }
@@ -1907,12 +2652,15 @@ void xdp_multiprog__close(struct xdp_multiprog *mp)
 static struct xdp_multiprog *xdp_multiprog__new(int ifindex)
 {
 	struct xdp_multiprog *mp;
+	size_t i;
 
 	mp = malloc(sizeof *mp);
 	if (!mp)
 		return ERR_PTR(-ENOMEM);
 	memset(mp, 0, sizeof(*mp));
 	mp->ifindex = ifindex;
+	for (i = 0; i < ARRAY_SIZE(mp->tail_call_map_fds); i++)
+		mp->tail_call_map_fds[i] = -1;
 
 	return mp;
 }
@@ -1984,13 +2732,14 @@ static int check_dispatcher_version(const char *prog_name, struct btf *btf)
 	return 0;
 }
 
-static int xdp_multiprog__link_pinned_progs(struct xdp_multiprog *mp)
+/* Must be called with the lock held */
+static int __xdp_multiprog__link_pinned_progs(struct xdp_multiprog *mp)
 {
 	char buf[PATH_MAX], pin_path[PATH_MAX];
 	struct xdp_program *prog, *p = NULL;
 	const char *bpffs_dir;
-	int err, lock_fd, i;
 	struct stat sb = {};
+	int err, i;
 
 	if (!mp || mp->first_prog)
 		return -EINVAL;
@@ -2004,10 +2753,6 @@ static int xdp_multiprog__link_pinned_progs(struct xdp_multiprog *mp)
 	if (err)
 		return err;
 
-	lock_fd = xdp_lock_acquire();
-	if (lock_fd < 0)
-		return lock_fd;
-
 	pr_debug("Reading multiprog component programs from pinned directory\n");
 	err = stat(pin_path, &sb);
 	if (err) {
@@ -2024,6 +2769,12 @@ static int xdp_multiprog__link_pinned_progs(struct xdp_multiprog *mp)
 		if (err)
 			goto err;
 
+		/* An incremental detach leaves the slot of the program empty */
+		if (access(buf, F_OK) && errno == ENOENT) {
+			pr_debug("Dispatcher slot %d is empty\n", i);
+			continue;
+		}
+
 		prog = xdp_program__from_pin(buf);
 		if (IS_ERR(prog)) {
 			err = PTR_ERR(prog);
@@ -2041,6 +2792,7 @@ static int xdp_multiprog__link_pinned_progs(struct xdp_multiprog *mp)
 		prog->chain_call_actions = (mp->config.chain_call_actions[i] &
 					    ~(1U << XDP_DISPATCHER_RETVAL));
 		prog->run_prio = mp->config.run_prios[i];
+		prog->is_frags = mp->config.is_xdp_frags;
 
 		if (!p) {
 			mp->first_prog = prog;
@@ -2052,8 +2804,13 @@ static int xdp_multiprog__link_pinned_progs(struct xdp_multiprog *mp)
 		mp->num_links++;
 	}
 
+	if (!mp->num_links) {
+		pr_debug("No component programs pinned for dispatcher\n");
+		err = -ENOENT;
+		goto err;
+	}
+
 out:
-	xdp_lock_release(lock_fd);
 	return err;
 err:
 	prog = mp->first_prog;
@@ -2063,27 +2820,93 @@ err:
 		prog = p;
 	}
 	mp->first_prog = NULL;
+	mp->num_links = 0;
 	goto out;
 }
 
+static int xdp_multiprog__link_pinned_progs(struct xdp_multiprog *mp)
+{
+	int err, lock_fd;
+
+	lock_fd = xdp_lock_acquire();
+	if (lock_fd < 0)
+		return lock_fd;
+
+	err = __xdp_multiprog__link_pinned_progs(mp);
+	xdp_lock_release(lock_fd);
+	return err;
+}
+
+/* The size of the config arrays depends on the MAX_DISPATCHER_ACTIONS the
+ * dispatcher was built with, so read configs of any size, as long as the
+ * programs in it fit into ours.
+ */
+static int dispatcher_config_read(int map_fd, __u32 value_size,
+				  struct xdp_dispatcher_config *config)
+{
+	size_t hdr_len = offsetof(struct xdp_dispatcher_config, chain_call_actions);
+	size_t num_slots, arr_len;
+	__u32 map_key = 0;
+	char *value;
+	int err = 0;
+
+	if (value_size < hdr_len ||
+	    (value_size - hdr_len) % (2 * sizeof(__u32))) {
+		pr_warn("Map value size mismatch\n");
+		return -EINVAL;
+	}
+	num_slots = (value_size - hdr_len) / (2 * sizeof(__u32));
+
+	value = calloc(1, value_size);
+	if (!value)
+		return -ENOMEM;
+
+	err = bpf_map_lookup_elem(map_fd, &map_key, value);
+	if (err) {
+		err = -errno;
+		pr_warn("Could not lookup map value: %s\n", strerror(-err));
+		goto out;
+	}
+
+	memset(config, 0, sizeof(*config));
+	memcpy(config, value, hdr_len);
+	if (config->num_progs_enabled > num_slots ||
+	    config->num_progs_enabled > MAX_DISPATCHER_ACTIONS) {
+		pr_warn("Dispatcher has %u programs, but only %d are supported\n",
+			config->num_progs_enabled, MAX_DISPATCHER_ACTIONS);
+		err = -E2BIG;
+		goto out;
+	}
+
+	arr_len = config->num_progs_enabled * sizeof(__u32);
+	memcpy(config->chain_call_actions, value + hdr_len, arr_len);
+	memcpy(config->run_prios, value + hdr_len + num_slots * sizeof(__u32),
+	       arr_len);
+
+out:
+	free(value);
+	return err;
+}
+
 static int xdp_multiprog__fill_from_fd(struct xdp_multiprog *mp,
 				       int prog_fd, int hw_fd)
 {
 	__u32 map_key = 0, map_info_len = sizeof(struct bpf_map_info);
 	struct bpf_map_info map_info = {};
 	struct bpf_prog_info info = {};
-	__u32 info_len, map_id = 0;
+	__u32 info_len, map_ids[4] = {};
 	struct xdp_program *prog;
 	struct btf *btf = NULL;
 	int map_fd = -1;
+	__u32 i;
 	int err = 0;
 
 	if (!mp)
 		return -EINVAL;
 
 	if (prog_fd > 0) {
-		info.nr_map_ids = 1;
-		info.map_ids = (uintptr_t)&map_id;
+		info.nr_map_ids = ARRAY_SIZE(map_ids);
+		info.map_ids = (uintptr_t)map_ids;
 		info_len = sizeof(info);
 		err = bpf_obj_get_info_by_fd(prog_fd, &info, &info_len);
 		if (err) {
@@ -2097,7 +2920,7 @@ static int xdp_multiprog__fill_from_fd(struct xdp_multiprog *mp,
 			goto legacy;
 		}
 
-		btf = btf__load_from_kernel_by_id(info.btf_id);
+		btf = kernel_btf__get(info.btf_id);
 		if (!btf) {
 			pr_warn("Couldn't get BTF for ID %ul\n", info.btf_id);
 			goto out;
@@ -2117,19 +2940,77 @@ static int xdp_multiprog__fill_from_fd(struct xdp_multiprog *mp,
 			}
 		}
 
-		if (info.nr_map_ids != 1) {
-			pr_warn("Expected a single map for dispatcher, found %d\n",
+		/* The instrumented and parsing dispatchers have a stats and a
+		 * parse context map next to the config, the tail call
+		 * dispatcher three maps to run the programs
+		 */
+		if (!info.nr_map_ids || info.nr_map_ids > ARRAY_SIZE(map_ids)) {
+			pr_warn("Expected one to four maps for dispatcher, found %d\n",
 				info.nr_map_ids);
 			err = -EINVAL;
 			goto out;
 		}
 
-		map_fd = bpf_map_get_fd_by_id(map_id);
+		for (i = 0; i < info.nr_map_ids; i++) {
+			int fd;
+
+			fd = bpf_map_get_fd_by_id(map_ids[i]);
+			if (fd < 0) {
+				err = -errno;
+				pr_warn("Could not get map fd for id %u: %s\n",
+					map_ids[i], strerror(-err));
+				goto out;
+			}
+
+			memset(&map_info, 0, sizeof(map_info));
+			err = bpf_obj_get_info_by_fd(fd, &map_info, &map_info_len);
+			if (err) {
+				err = -errno;
+				pr_warn("Couldn't get map info: %s\n", strerror(-err));
+				close(fd);
+				goto out;
+			}
+
+			if (map_info.type == BPF_MAP_TYPE_PERCPU_ARRAY &&
+			    !strcmp(map_info.name, XDP_DISPATCHER_STATS_MAP)) {
+				mp->stats_map_id = map_ids[i];
+				close(fd);
+			} else if (map_info.type == BPF_MAP_TYPE_PERCPU_ARRAY &&
+				   !strcmp(map_info.name,
+					   XDP_DISPATCHER_PARSE_MAP)) {
+				mp->parse_map_id = map_ids[i];
+				close(fd);
+			} else if (map_info.type == BPF_MAP_TYPE_PROG_ARRAY &&
+				   !strcmp(map_info.name,
+					   XDP_DISPATCHER_PROGS_MAP)) {
+				mp->progs_map_id = map_ids[i];
+				close(fd);
+			} else if (map_info.type == BPF_MAP_TYPE_ARRAY &&
+				   !strcmp(map_info.name,
+					   XDP_DISPATCHER_CHAIN_MAP)) {
+				mp->chain_map_id = map_ids[i];
+				close(fd);
+			} else if (map_info.type == BPF_MAP_TYPE_PERCPU_ARRAY &&
+				   !strcmp(map_info.name,
+					   XDP_DISPATCHER_SLOT_MAP)) {
+				mp->slot_map_id = map_ids[i];
+				close(fd);
+			} else if (map_fd < 0) {
+				map_fd = fd;
+			} else {
+				pr_warn("Found more than one config map for dispatcher\n");
+				close(fd);
+				err = -EINVAL;
+				goto out;
+			}
+		}
+
 		if (map_fd < 0) {
-			err = -errno;
-			pr_warn("Could not get config map fd for id %u: %s\n", map_id, strerror(-err));
+			pr_warn("Couldn't find config map for dispatcher\n");
+			err = -ENOENT;
 			goto out;
 		}
+
 		err = bpf_obj_get_info_by_fd(map_fd, &map_info, &map_info_len);
 		if (err) {
 			err = -errno;
@@ -2137,19 +3018,16 @@ static int xdp_multiprog__fill_from_fd(struct xdp_multiprog *mp,
 			goto out;
 		}
 
-		if (map_info.key_size != sizeof(map_key) ||
-		    map_info.value_size != sizeof(mp->config)) {
-			pr_warn("Map key or value size mismatch\n");
+		if (map_info.key_size != sizeof(map_key)) {
+			pr_warn("Map key size mismatch\n");
 			err = -EINVAL;
 			goto out;
 		}
 
-		err = bpf_map_lookup_elem(map_fd, &map_key, &mp->config);
-		if (err) {
-			err = -errno;
-			pr_warn("Could not lookup map value: %s\n", strerror(-err));
+		err = dispatcher_config_read(map_fd, map_info.value_size,
+					     &mp->config);
+		if (err)
 			goto out;
-		}
 
 legacy:
 		prog = xdp_program__from_fd(prog_fd);
@@ -2194,10 +3072,62 @@ legacy:
 out:
 	if (map_fd >= 0)
 		close(map_fd);
-	btf__free(btf);
+	kernel_btf__put(btf);
 	return err;
 }
 
+/* Open the maps of a tail call dispatcher from its pin directory, see
+ * xdp_multiprog__pin_maps(). Holding them keeps the program array filled while
+ * the pins are replaced.
+ */
+static int xdp_multiprog__open_maps(struct xdp_multiprog *mp)
+{
+	__u32 ids[] = { mp->progs_map_id, mp->chain_map_id, mp->slot_map_id };
+	struct bpf_map_info info = {};
+	__u32 len = sizeof(info);
+	const char *bpffs_dir;
+	char buf[PATH_MAX];
+	size_t i;
+	int err, fd;
+
+	bpffs_dir = get_bpffs_dir();
+	if (IS_ERR(bpffs_dir))
+		return PTR_ERR(bpffs_dir);
+
+	for (i = 0; i < ARRAY_SIZE(tail_call_map_names); i++) {
+		err = try_snprintf(buf, sizeof(buf), "%s/dispatch-%d-%d/%s",
+				   bpffs_dir, mp->ifindex,
+				   mp->main_prog->prog_id,
+				   tail_call_map_names[i]);
+		if (err)
+			return err;
+
+		fd = bpf_obj_get(buf);
+		if (fd < 0) {
+			err = -errno;
+			if (err != -ENOENT)
+				return err;
+			pr_warn("Map %s of the dispatcher is not pinned, its programs may not run\n",
+				tail_call_map_names[i]);
+			continue;
+		}
+
+		memset(&info, 0, sizeof(info));
+		err = bpf_obj_get_info_by_fd(fd, &info, &len);
+		if (err || info.id != ids[i]) {
+			err = err ? -errno : -EINVAL;
+			pr_warn("Pinned map %s doesn't belong to the dispatcher\n",
+				buf);
+			close(fd);
+			return err;
+		}
+
+		mp->tail_call_map_fds[i] = fd;
+	}
+
+	return 0;
+}
+
 static struct xdp_multiprog *xdp_multiprog__from_fd(int fd, int hw_fd,
 						    int ifindex)
 {
@@ -2212,6 +3142,12 @@ static struct xdp_multiprog *xdp_multiprog__from_fd(int fd, int hw_fd,
 	if (err)
 		goto err;
 
+	if (mp->progs_map_id) {
+		err = xdp_multiprog__open_maps(mp);
+		if (err)
+			goto err;
+	}
+
 	return mp;
 err:
 	xdp_multiprog__close(mp);
@@ -2362,18 +3298,44 @@ retry:
 	return mp;
 }
 
-static int xdp_multiprog__check_compat(struct xdp_multiprog *mp)
+/* The compatibility check only depends on the running kernel, so once it has
+ * passed, a marker directory is created in bpffs to let subsequent attaches
+ * (from this or other processes) skip loading the test program. The kernel
+ * release is part of the name, and bpffs doesn't survive a reboot anyway.
+ */
+static int compat_marker_path(char *buf, size_t buf_len, const char *bpffs_dir)
+{
+	struct utsname uts;
+
+	if (uname(&uts))
+		return -errno;
+
+	return try_snprintf(buf, buf_len, "%s/compat-%s-v%d", bpffs_dir,
+			    uts.release, XDP_DISPATCHER_VERSION);
+}
+
+/* Check that the kernel can link an extension program into the dispatcher.
+ * Returns -EOPNOTSUPP if it refuses to, which is what the tail call dispatcher
+ * is for, and other errors if the check itself couldn't be done.
+ */
+static int xdp_multiprog__check_freplace(struct xdp_multiprog *mp)
 {
+	static bool compat_cached = false;
 	struct xdp_program *test_prog;
+	char marker[PATH_MAX] = {};
 	const char *bpffs_dir;
 	char buf[PATH_MAX];
+	struct stat st;
 	int lock_fd;
 	int err;
 
 	if (mp->checked_compat)
 		return 0;
 
-	pr_debug("Checking dispatcher compatibility\n");
+	if (compat_cached) {
+		mp->checked_compat = true;
+		return 0;
+	}
 
 	bpffs_dir = get_bpffs_dir();
 	if (IS_ERR(bpffs_dir)) {
@@ -2382,6 +3344,15 @@ static int xdp_multiprog__check_compat(struct xdp_multiprog *mp)
 		return -EOPNOTSUPP;
 	}
 
+	if (!compat_marker_path(marker, sizeof(marker), bpffs_dir) &&
+	    !stat(marker, &st) && S_ISDIR(st.st_mode)) {
+		pr_debug("Dispatcher compatibility already verified for this kernel\n");
+		mp->checked_compat = compat_cached = true;
+		return 0;
+	}
+
+	pr_debug("Checking dispatcher compatibility\n");
+
 	test_prog = __xdp_program__find_file("xdp-dispatcher.o", NULL, "xdp_pass", NULL);
 	if (IS_ERR(test_prog)) {
 		err = PTR_ERR(test_prog);
@@ -2394,25 +3365,34 @@ static int xdp_multiprog__check_compat(struct xdp_multiprog *mp)
 					     "compat_test");
 	if (err) {
 		pr_debug("Failed to set attach target: %s\n", strerror(-err));
+		err = -EOPNOTSUPP;
 		goto out;
 	}
 
 	bpf_program__set_type(test_prog->bpf_prog, BPF_PROG_TYPE_EXT);
 	bpf_program__set_expected_attach_type(test_prog->bpf_prog, 0);
+	err = xdp_program__set_xdp_frags_support(test_prog,
+						 mp->config.is_xdp_frags);
+	if (err) {
+		pr_debug("Failed to set frags support of test program: %s\n",
+			 strerror(-err));
+		goto out;
+	}
 	err = xdp_program__load(test_prog);
 	if (err) {
 		char buf[100] = {};
 		libxdp_strerror(err, buf, sizeof(buf));
 		pr_debug("Failed to load program %s: %s\n",
 			xdp_program__name(test_prog), buf);
+		err = -EOPNOTSUPP;
 		goto out;
 	}
 
 	test_prog->link_fd = bpf_raw_tracepoint_open(NULL, test_prog->prog_fd);
 	if (test_prog->link_fd < 0) {
-		err = -errno;
 		pr_debug("Failed to attach test program to dispatcher: %s\n",
-			 strerror(-err));
+			 strerror(errno));
+		err = -EOPNOTSUPP;
 		goto out;
 	}
 
@@ -2440,12 +3420,23 @@ static int xdp_multiprog__check_compat(struct xdp_multiprog *mp)
 		goto out_locked;
 	}
 
-	mp->checked_compat = true;
+	if (*marker && mkdir(marker, S_IRWXU) && errno != EEXIST)
+		pr_debug("Couldn't create compat marker %s: %s\n", marker,
+			 strerror(errno));
+
+	mp->checked_compat = compat_cached = true;
 out_locked:
 	xdp_lock_release(lock_fd);
 out:
 	xdp_program__close(test_prog);
+	return err;
+}
+
+static int xdp_multiprog__check_compat(struct xdp_multiprog *mp)
+{
+	int err;
 
+	err = xdp_multiprog__check_freplace(mp);
 	if (err) {
 		pr_info("Compatibility check for dispatcher program failed: %s\n",
 			strerror(-err));
@@ -2455,75 +3446,326 @@ out:
 	return 0;
 }
 
-static int find_prog_btf_id(const char *name, __u32 attach_prog_fd)
+/* Linking each component program needs the BTF ID of its attach point in the
+ * loaded dispatcher, so keep the dispatcher's kernel BTF around in mp.
+ */
+static int find_prog_btf_id(struct xdp_multiprog *mp, const char *name)
 {
 	struct bpf_prog_info info = {};
 	__u32 info_size = sizeof(info);
+	int attach_prog_fd;
 	int err = -EINVAL;
-	struct btf *btf;
 
-	err = bpf_obj_get_info_by_fd(attach_prog_fd, &info, &info_size);
-	if (err) {
-		err = -errno;
-		pr_warn("failed get_prog_info for FD %d\n", attach_prog_fd);
-		return err;
-	}
-	if (!info.btf_id) {
-		pr_warn("The target program doesn't have BTF\n");
-		return -EINVAL;
-	}
-	btf = btf__load_from_kernel_by_id(info.btf_id);
-	if (!btf) {
-		pr_warn("Failed to get BTF of the program\n");
-		return -EINVAL;
+	if (!mp->main_btf) {
+		attach_prog_fd = mp->main_prog->prog_fd;
+		err = bpf_obj_get_info_by_fd(attach_prog_fd, &info, &info_size);
+		if (err) {
+			err = -errno;
+			pr_warn("failed get_prog_info for FD %d\n", attach_prog_fd);
+			return err;
+		}
+		if (!info.btf_id) {
+			pr_warn("The target program doesn't have BTF\n");
+			return -EINVAL;
+		}
+		mp->main_btf = kernel_btf__get(info.btf_id);
+		if (!mp->main_btf) {
+			pr_warn("Failed to get BTF of the program\n");
+			return -EINVAL;
+		}
 	}
-	err = btf__find_by_name_kind(btf, name, BTF_KIND_FUNC);
-	btf__free(btf);
+
+	err = btf__find_by_name_kind(mp->main_btf, name, BTF_KIND_FUNC);
 	if (err <= 0)
 		pr_warn("%s is not found in prog's BTF\n", name);
 
 	return err;
 }
 
-static int xdp_multiprog__link_prog(struct xdp_multiprog *mp,
-				    struct xdp_program *prog)
+/* Component programs replace the stub function named by their attach_name,
+ * which is "prog" followed by the number of the dispatcher slot.
+ */
+static int xdp_program__slot(const struct xdp_program *prog)
 {
-	DECLARE_LIBBPF_OPTS(bpf_link_create_opts, opts);
-	struct xdp_program *new_prog, *p;
-	bool was_loaded = false;
-	char buf[PATH_MAX];
-	int err, lfd = -1;
-	char *attach_func;
-	__s32 btf_id;
+	unsigned int slot;
 
-	if (!mp || !prog || !mp->is_loaded ||
-	    mp->num_links >= mp->config.num_progs_enabled)
+	if (!prog->attach_name || sscanf(prog->attach_name, "prog%u", &slot) != 1)
 		return -EINVAL;
 
-	err = xdp_multiprog__check_compat(mp);
-	if (err)
-		return err;
+	return slot;
+}
 
-	if (!prog->btf) {
-		pr_warn("Program %s has no BTF information, so we can't load it as multiprog\n",
-			xdp_program__name(prog));
+/* The kernel only links programs into a dispatcher, or puts them in its
+ * program array, if they were loaded with the same BPF_F_XDP_HAS_FRAGS setting
+ * as the dispatcher, so a frags capable program may have to give it up here
+ */
+static int xdp_multiprog__match_frags(const struct xdp_multiprog *mp,
+				      struct xdp_program *prog)
+{
+	if (prog->is_frags == !!mp->config.is_xdp_frags)
+		return 0;
+
+	return xdp_program__set_xdp_frags_support(prog,
+						  mp->config.is_xdp_frags);
+}
+
+/* Programs that use the parse context of the parsing dispatcher, or chain call
+ * in the tail call dispatcher, declare maps of the same name (see
+ * parsing_helpers.h and xdp_helpers.h), which have to be the dispatcher's own
+ * for them to see anything in them. Already loaded programs keep their own
+ * maps, and simply parse the packets themselves or end the chain.
+ */
+static int xdp_multiprog__share_map(struct xdp_program *prog, const char *name,
+				    __u32 map_id)
+{
+	struct bpf_map *map;
+	int map_fd, err;
+
+	if (!map_id || !prog->bpf_obj)
+		return 0;
+
+	map = bpf_object__find_map_by_name(prog->bpf_obj, name);
+	if (!map)
+		return 0;
+
+	map_fd = bpf_map_get_fd_by_id(map_id);
+	if (map_fd < 0) {
+		err = -errno;
+		pr_warn("Couldn't get map %s of dispatcher: %s\n", name,
+			strerror(-err));
+		return err;
+	}
+
+	err = bpf_map__reuse_fd(map, map_fd);
+	if (err)
+		pr_warn("Couldn't share map %s with program %s: %s\n", name,
+			xdp_program__name(prog), strerror(-err));
+	else
+		pr_debug("Sharing map %s with program %s\n", name,
+			 xdp_program__name(prog));
+
+	close(map_fd);
+	return err;
+}
+
+/* A program in the tail call dispatcher only hands packets on to the next one
+ * if it does the tail call itself, through the maps of that dispatcher; any
+ * other program ends the chain. A program yet to be loaded gets the maps if it
+ * declares them, a loaded one has to use the dispatcher's program array
+ * (progs_map_id) already.
+ */
+static bool xdp_program__can_tail_call(const struct xdp_program *prog,
+				       __u32 progs_map_id)
+{
+	struct bpf_prog_info info = {};
+	__u32 info_len = sizeof(info);
+	__u32 map_ids[64];
+	__u32 i;
+
+	if (prog->prog_fd < 0)
+		return prog->bpf_obj &&
+		       bpf_object__find_map_by_name(prog->bpf_obj,
+						    XDP_DISPATCHER_PROGS_MAP) &&
+		       bpf_object__find_map_by_name(prog->bpf_obj,
+						    XDP_DISPATCHER_CHAIN_MAP) &&
+		       bpf_object__find_map_by_name(prog->bpf_obj,
+						    XDP_DISPATCHER_SLOT_MAP);
+
+	if (!progs_map_id)
+		return false;
+
+	info.nr_map_ids = ARRAY_SIZE(map_ids);
+	info.map_ids = (uintptr_t)map_ids;
+	if (bpf_obj_get_info_by_fd(prog->prog_fd, &info, &info_len))
+		return false;
+
+	for (i = 0; i < info.nr_map_ids && i < ARRAY_SIZE(map_ids); i++)
+		if (map_ids[i] == progs_map_id)
+			return true;
+	return false;
+}
+
+/* With the tail call dispatcher, a component is a regular XDP program that the
+ * dispatcher jumps to through its slot in the program array, so putting it
+ * there is just a map update, and it holds the program for as long as the
+ * dispatcher lives. There is no link, so link_fd stays unset.
+ */
+static int xdp_multiprog__tail_call_prog(struct xdp_multiprog *mp,
+					 struct xdp_program *prog, size_t slot)
+{
+	struct xdp_program *new_prog, **p;
+	__u32 key = slot, actions;
+	char buf[PATH_MAX];
+	int err, map_fd;
+
+	pr_debug("Inserting prog %s as tail call entry %zu\n",
+		 xdp_program__name(prog), slot);
+
+	err = try_snprintf(buf, sizeof(buf), "prog%zu", slot);
+	if (err)
+		return err;
+
+	if (prog->prog_fd < 0) {
+		err = xdp_multiprog__match_frags(mp, prog);
+		if (!err)
+			err = xdp_multiprog__share_map(prog,
+						       XDP_DISPATCHER_PROGS_MAP,
+						       mp->progs_map_id);
+		if (!err)
+			err = xdp_multiprog__share_map(prog,
+						       XDP_DISPATCHER_CHAIN_MAP,
+						       mp->chain_map_id);
+		if (!err)
+			err = xdp_multiprog__share_map(prog,
+						       XDP_DISPATCHER_SLOT_MAP,
+						       mp->slot_map_id);
+		if (err)
+			return err;
+
+		err = xdp_program__load(prog);
+		if (err) {
+			libxdp_strerror(err, buf, sizeof(buf));
+			pr_debug("Failed to load program %s: %s\n",
+				 xdp_program__name(prog), buf);
+			return err;
+		}
+	}
+
+	new_prog = xdp_program__clone(prog, 0);
+	if (IS_ERR(new_prog)) {
+		err = PTR_ERR(new_prog);
+		pr_warn("Failed to clone xdp_program: %s\n", strerror(-err));
+		return err;
+	}
+
+	new_prog->attach_name = strdup(buf);
+	if (!new_prog->attach_name) {
+		err = -ENOMEM;
+		goto err_free;
+	}
+	/* The clone of a loaded program doesn't know how it was loaded */
+	new_prog->is_frags = prog->is_frags;
+
+	/* The chain call actions have to be in place before the program is
+	 * reachable
+	 */
+	actions = mp->config.chain_call_actions[slot] &
+		  ~(1U << XDP_DISPATCHER_RETVAL);
+	map_fd = bpf_map_get_fd_by_id(mp->chain_map_id);
+	if (map_fd < 0 || bpf_map_update_elem(map_fd, &key, &actions, 0)) {
+		err = -errno;
+		pr_warn("Couldn't set chain call actions of slot %zu: %s\n",
+			slot, strerror(-err));
+		goto err_close;
+	}
+	close(map_fd);
+
+	map_fd = bpf_map_get_fd_by_id(mp->progs_map_id);
+	if (map_fd < 0 ||
+	    bpf_map_update_elem(map_fd, &key, &new_prog->prog_fd, 0)) {
+		err = -errno;
+		pr_warn("Failed to insert program %s into dispatcher: %s\n",
+			xdp_program__name(new_prog), strerror(-err));
+		goto err_close;
+	}
+	close(map_fd);
+
+	pr_debug("Inserted prog '%s' with priority %d in dispatcher entry '%s'\n",
+		 xdp_program__name(new_prog), xdp_program__run_prio(new_prog),
+		 new_prog->attach_name);
+
+	/* keep the list in slot order */
+	for (p = &mp->first_prog; *p; p = &(*p)->next)
+		if (xdp_program__slot(*p) > (int)slot)
+			break;
+	new_prog->next = *p;
+	*p = new_prog;
+
+	mp->num_links++;
+	return 0;
+
+err_close:
+	if (map_fd >= 0)
+		close(map_fd);
+err_free:
+	xdp_program__close(new_prog);
+	return err;
+}
+
+/* Empty the tail call slots from first up to, but not including, last */
+static int xdp_multiprog__clear_tail_calls(const struct xdp_multiprog *mp,
+					   __u32 first, __u32 last)
+{
+	int map_fd, err = 0;
+	__u32 key;
+
+	map_fd = bpf_map_get_fd_by_id(mp->progs_map_id);
+	if (map_fd < 0) {
+		err = -errno;
+		pr_warn("Couldn't get program array of dispatcher: %s\n",
+			strerror(-err));
+		return err;
+	}
+
+	for (key = first; key < last; key++) {
+		if (bpf_map_delete_elem(map_fd, &key) && errno != ENOENT) {
+			err = -errno;
+			pr_warn("Couldn't empty tail call slot %u: %s\n", key,
+				strerror(-err));
+			break;
+		}
+	}
+
+	close(map_fd);
+	return err;
+}
+
+static int xdp_multiprog__link_prog(struct xdp_multiprog *mp,
+				    struct xdp_program *prog, size_t slot)
+{
+	DECLARE_LIBBPF_OPTS(bpf_link_create_opts, opts);
+	struct xdp_program *new_prog, **p;
+	bool was_loaded = false;
+	char buf[PATH_MAX];
+	int err, lfd = -1;
+	char *attach_func;
+	__s32 btf_id;
+
+	if (!mp || !prog || !mp->is_loaded ||
+	    slot >= mp->config.num_progs_enabled ||
+	    mp->num_links >= mp->config.num_progs_enabled)
+		return -EINVAL;
+
+	if (mp->progs_map_id)
+		return xdp_multiprog__tail_call_prog(mp, prog, slot);
+
+	err = xdp_multiprog__check_compat(mp);
+	if (err)
+		return err;
+
+	if (!prog->btf) {
+		pr_warn("Program %s has no BTF information, so we can't load it as multiprog\n",
+			xdp_program__name(prog));
 		return -EOPNOTSUPP;
 	}
 
 	pr_debug("Linking prog %s as multiprog entry %zu\n",
-		 xdp_program__name(prog), mp->num_links);
+		 xdp_program__name(prog), slot);
 
-	err = try_snprintf(buf, sizeof(buf), "prog%zu", mp->num_links);
+	err = try_snprintf(buf, sizeof(buf), "prog%zu", slot);
 	if (err)
 		goto err;
 
 
-	if (mp->config.num_progs_enabled == 1)
+	/* A single program replaces the whole dispatcher function, unless the
+	 * dispatcher is keeping stats for it
+	 */
+	if (mp->config.num_progs_enabled == 1 && !mp->stats_map_id)
 		attach_func = "xdp_dispatcher";
 	else
 		attach_func = buf;
 
-	btf_id = find_prog_btf_id(attach_func, mp->main_prog->prog_fd);
+	btf_id = find_prog_btf_id(mp, attach_func);
 	if (btf_id <= 0) {
 		err = btf_id;
 		pr_debug("Couldn't find BTF ID for %s: %d\n", attach_func, err);
@@ -2541,6 +3783,16 @@ static int xdp_multiprog__link_prog(struct xdp_multiprog *mp,
 
 		bpf_program__set_type(prog->bpf_prog, BPF_PROG_TYPE_EXT);
 		bpf_program__set_expected_attach_type(prog->bpf_prog, 0);
+
+		err = xdp_multiprog__match_frags(mp, prog);
+		if (err)
+			goto err;
+
+		err = xdp_multiprog__share_map(prog, XDP_DISPATCHER_PARSE_MAP,
+					       mp->parse_map_id);
+		if (err)
+			goto err;
+
 		err = xdp_program__load(prog);
 		if (err) {
 			if (err == -E2BIG) {
@@ -2608,6 +3860,8 @@ attach_ok:
 		err = -ENOMEM;
 		goto err_free;
 	}
+	/* The clone of a loaded program doesn't know how it was loaded */
+	new_prog->is_frags = prog->is_frags;
 
 	pr_debug(
 		"Attached prog '%s' with priority %d in dispatcher entry '%s' with fd %d\n",
@@ -2615,14 +3869,12 @@ attach_ok:
 		new_prog->attach_name, lfd);
 	new_prog->link_fd = lfd;
 
-	if (!mp->first_prog) {
-		mp->first_prog = new_prog;
-	} else {
-		p = mp->first_prog;
-		while (p->next)
-			p = p->next;
-		p->next = new_prog;
-	}
+	/* keep the list in slot order */
+	for (p = &mp->first_prog; *p; p = &(*p)->next)
+		if (xdp_program__slot(*p) > (int)slot)
+			break;
+	new_prog->next = *p;
+	*p = new_prog;
 
 	mp->num_links++;
 	return 0;
@@ -2635,6 +3887,92 @@ err:
 	return err;
 }
 
+/* Counterpart to dispatcher_config_read(): lay out the config to match the
+ * rodata of the dispatcher variant being loaded.
+ */
+static int dispatcher_config_set(struct bpf_map *map,
+				 const struct xdp_dispatcher_config *config)
+{
+	size_t hdr_len = offsetof(struct xdp_dispatcher_config, chain_call_actions);
+	size_t value_size = bpf_map__value_size(map);
+	size_t num_slots, arr_len;
+	char *value;
+	int err;
+
+	if (value_size < hdr_len ||
+	    (value_size - hdr_len) % (2 * sizeof(__u32)))
+		return -EINVAL;
+	num_slots = (value_size - hdr_len) / (2 * sizeof(__u32));
+	if (config->num_progs_enabled > num_slots)
+		return -E2BIG;
+
+	value = calloc(1, value_size);
+	if (!value)
+		return -ENOMEM;
+
+	arr_len = config->num_progs_enabled * sizeof(__u32);
+	memcpy(value, config, hdr_len);
+	memcpy(value + hdr_len, config->chain_call_actions, arr_len);
+	memcpy(value + hdr_len + num_slots * sizeof(__u32), config->run_prios,
+	       arr_len);
+
+	err = bpf_map__set_initial_value(map, value, value_size);
+	free(value);
+	return err;
+}
+
+static const char *default_dispatcher = "xdp-dispatcher.o";
+static const char *stats_dispatcher = "xdp-dispatcher-stats.o";
+static const char *parse_dispatcher = "xdp-dispatcher-parse.o";
+static const char *stats_parse_dispatcher = "xdp-dispatcher-stats-parse.o";
+static const char *tail_call_dispatcher = "xdp-dispatcher-tailcall.o";
+
+/* The dispatcher has a stub function for every program it can hold, and while
+ * the verifier removes the calls to the ones that are not used, the functions
+ * themselves are still loaded and JIT'ed along with it. So use the smallest of
+ * the variants with 1, 2, 4, ... stubs that fits, as built by the Makefile.
+ */
+static const char *dispatcher_file(char *buf, size_t buf_len, size_t num_progs,
+				   bool stats, bool parse)
+{
+	size_t slots = 1;
+
+	/* The instrumented and parsing dispatchers only come in the full size */
+	if (stats && parse)
+		return stats_parse_dispatcher;
+	if (stats)
+		return stats_dispatcher;
+	if (parse)
+		return parse_dispatcher;
+
+	while (slots < num_progs)
+		slots <<= 1;
+
+	if (slots >= MAX_DISPATCHER_ACTIONS || slots > 64 ||
+	    try_snprintf(buf, buf_len, "xdp-dispatcher-%zu.o", slots))
+		return default_dispatcher;
+
+	return buf;
+}
+
+/* Get the ID of a loaded map of obj, if it has one called name */
+static int obj_map_id(const struct bpf_object *obj, const char *name, __u32 *id)
+{
+	struct bpf_map_info map_info = {};
+	__u32 map_info_len = sizeof(map_info);
+	struct bpf_map *map;
+
+	map = bpf_object__find_map_by_name(obj, name);
+	if (!map)
+		return 0;
+
+	if (bpf_obj_get_info_by_fd(bpf_map__fd(map), &map_info, &map_info_len))
+		return -errno;
+
+	*id = map_info.id;
+	return 0;
+}
+
 /*
  * xdp_multiprog__generate - generate a new multiprog dispatcher
  *
@@ -2647,28 +3985,45 @@ err:
  *
  * When called with remove_progs set, the caller is responsible for checking
  * that all the programs in progs are actually present in old_mp.
+ *
+ * When called with replace_prog set, progs must hold a single program, which
+ * takes the place of replace_prog from old_mp in the new dispatcher. Again, the
+ * caller is responsible for checking that replace_prog is present in old_mp.
  */
 static struct xdp_multiprog *xdp_multiprog__generate(struct xdp_program **progs,
 						     size_t num_progs,
 						     int ifindex,
 						     struct xdp_multiprog *old_mp,
-						     bool remove_progs)
+						     bool remove_progs,
+						     struct xdp_program *replace_prog)
 {
 	size_t num_new_progs = old_mp ? old_mp->num_links : 0;
 	struct xdp_program *dispatcher;
 	struct xdp_program **new_progs;
 	struct xdp_multiprog *mp;
+	const char *filename;
+	bool stats, parse, tail_call, frags;
 	struct bpf_map *map;
+	char buf[PATH_MAX];
+	char *envval;
 	size_t i;
 	int err;
 
-	if (!progs || !num_progs || (!old_mp && remove_progs))
+	if (!progs || !num_progs || (!old_mp && (remove_progs || replace_prog)))
 		return ERR_PTR(-EINVAL);
 
-	num_new_progs += remove_progs ? -num_progs : num_progs;
+	if (replace_prog && (remove_progs || num_progs != 1))
+		return ERR_PTR(-EINVAL);
+
+	if (!replace_prog)
+		num_new_progs += remove_progs ? -num_progs : num_progs;
 
-	if (num_new_progs > MAX_DISPATCHER_ACTIONS)
+	if (num_new_progs > MAX_DISPATCHER_ACTIONS) {
+		pr_warn("Can't attach more than %d programs to an interface; "
+			"rebuild libxdp with a higher MAX_DISPATCHER_ACTIONS\n",
+			MAX_DISPATCHER_ACTIONS);
 		return ERR_PTR(-E2BIG);
+	}
 
 	pr_debug("Generating multi-prog dispatcher for %zu programs\n",
 		 num_new_progs);
@@ -2688,6 +4043,12 @@ static struct xdp_multiprog *xdp_multiprog__generate(struct xdp_program **progs,
 		}
 
 		for (i = 0, prog = old_mp->first_prog; prog; prog = prog->next) {
+			if (replace_prog &&
+			    prog->prog_id == replace_prog->prog_id) {
+				new_progs[i++] = progs[0];
+				continue;
+			}
+
 			if (remove_progs) {
 				/* remove_new means new_progs is an array of
 				 * programs we should remove from old_mp instead
@@ -2701,100 +4062,889 @@ static struct xdp_multiprog *xdp_multiprog__generate(struct xdp_program **progs,
 				if (found)
 					continue;
 
-				/* Sanity check: caller should ensure all
-				 * programs to remove actually exist; check here
-				 * anyway to ensure we don't overrun the array
-				 * if this is not done correctly.
-				 */
-				if (i >= num_new_progs) {
-					pr_warn("Not all programs to remove were found\n");
-					err = -EINVAL;
-					goto err;
-				}
-			}
-			new_progs[i++] = prog;
-		}
-		if (!remove_progs)
-			for (j = 0; i < num_new_progs; i++, j++)
-				new_progs[i] = progs[j];
-	} else {
-		new_progs = progs;
+				/* Sanity check: caller should ensure all
+				 * programs to remove actually exist; check here
+				 * anyway to ensure we don't overrun the array
+				 * if this is not done correctly.
+				 */
+				if (i >= num_new_progs) {
+					pr_warn("Not all programs to remove were found\n");
+					err = -EINVAL;
+					goto err;
+				}
+			}
+			new_progs[i++] = prog;
+		}
+		if (!remove_progs && !replace_prog)
+			for (j = 0; i < num_new_progs; i++, j++)
+				new_progs[i] = progs[j];
+	} else {
+		new_progs = progs;
+	}
+
+	if (num_new_progs > 1)
+		qsort(new_progs, num_new_progs, sizeof(*new_progs), cmp_xdp_programs);
+
+	/* Keep the stats going when changing the programs on an interface that
+	 * already runs the instrumented dispatcher
+	 */
+	envval = secure_getenv(XDP_STATS_ENVVAR);
+	stats = (envval && envval[0] == '1' && envval[1] == '\0') ||
+		(old_mp && old_mp->stats_map_id);
+
+	/* Likewise for parsing the packets once for all programs */
+	envval = secure_getenv(XDP_PARSE_ENVVAR);
+	parse = (envval && envval[0] == '1' && envval[1] == '\0') ||
+		(old_mp && old_mp->parse_map_id);
+
+	/* The tail call dispatcher is used when asked for, or when the kernel
+	 * can't link programs into the regular one, and then it stays on the
+	 * interface for as long as there are programs; programs loaded as
+	 * freplace can't go into a program array, or the other way around.
+	 */
+	if (old_mp && !old_mp->is_legacy) {
+		tail_call = !!old_mp->progs_map_id;
+	} else {
+		envval = secure_getenv(XDP_TAILCALL_ENVVAR);
+		tail_call = envval && envval[0] == '1' && envval[1] == '\0';
+	}
+	if (tail_call && (stats || parse)) {
+		pr_warn("The tail call dispatcher doesn't support %s\n",
+			stats ? "stats" : "parse context");
+		stats = parse = false;
+	}
+
+	/* Multi-buffer packets can only go through the dispatcher if every
+	 * program on the interface handles them
+	 */
+	for (i = 0, frags = true; i < num_new_progs; i++)
+		frags = frags && new_progs[i]->is_frags;
+
+open:
+	if (tail_call) {
+		if (num_new_progs > XDP_MAX_TAIL_CALLS) {
+			pr_warn("The tail call dispatcher can't run more than %d programs\n",
+				XDP_MAX_TAIL_CALLS);
+			err = -E2BIG;
+			goto err;
+		}
+
+		/* Only the last program can end the chain */
+		for (i = 0; i + 1 < num_new_progs; i++) {
+			if (xdp_program__can_tail_call(new_progs[i],
+						       old_mp ? old_mp->progs_map_id : 0))
+				continue;
+
+			pr_warn("Program %s can't chain call in the tail call dispatcher, "
+				"so it can only run last; build it with "
+				"XDP_USE_TAIL_CALLS (see xdp_helpers.h)\n",
+				xdp_program__name(new_progs[i]));
+			err = -EINVAL;
+			goto err;
+		}
+		filename = tail_call_dispatcher;
+	} else
+		filename = dispatcher_file(buf, sizeof(buf), num_new_progs,
+					   stats, parse);
+	dispatcher = __xdp_program__find_file(filename, NULL, "xdp_dispatcher",
+					      NULL);
+	if (IS_ERR(dispatcher) && filename != default_dispatcher &&
+	    !tail_call) {
+		if (stats || parse)
+			pr_warn("Couldn't open BPF file '%s'; dispatcher %s "
+				"will not be available\n", filename,
+				stats ? "stats" : "parse context");
+		else
+			pr_debug("Couldn't open BPF file '%s', falling back to '%s'\n",
+				 filename, default_dispatcher);
+		filename = default_dispatcher;
+		dispatcher = __xdp_program__find_file(filename, NULL,
+						      "xdp_dispatcher", NULL);
+	}
+	if (IS_ERR(dispatcher)) {
+		err = PTR_ERR(dispatcher);
+		pr_warn("Couldn't open BPF file '%s'\n", filename);
+		goto err;
+	}
+
+	err = check_dispatcher_version(bpf_program__name(dispatcher->bpf_prog),
+				       dispatcher->btf);
+	if (err) {
+		pr_warn("XDP dispatcher object version check failed: %s\n",
+			strerror(-err));
+		goto err;
+	}
+
+	mp->main_prog = dispatcher;
+
+	if (frags) {
+		err = xdp_program__set_xdp_frags_support(dispatcher, true);
+		if (err) {
+			pr_warn("Couldn't load dispatcher with frags support: %s\n",
+				strerror(-err));
+			goto err;
+		}
+	}
+
+	/* A tail call dispatcher replacing another one takes over its maps,
+	 * which the programs already in it jump through. The old dispatcher
+	 * runs the new layout as soon as it is written, which is no different
+	 * from running the new one, as both just start at the first slot.
+	 */
+	if (tail_call && old_mp && old_mp->progs_map_id) {
+		err = xdp_multiprog__share_map(dispatcher, XDP_DISPATCHER_PROGS_MAP,
+					       old_mp->progs_map_id);
+		if (!err)
+			err = xdp_multiprog__share_map(dispatcher,
+						       XDP_DISPATCHER_CHAIN_MAP,
+						       old_mp->chain_map_id);
+		if (!err)
+			err = xdp_multiprog__share_map(dispatcher,
+						       XDP_DISPATCHER_SLOT_MAP,
+						       old_mp->slot_map_id);
+		if (err)
+			goto err;
+	}
+
+	/* Likewise, the programs already linked into a parsing dispatcher read
+	 * the parse context from its map, so a new one has to write it there.
+	 */
+	if (parse && old_mp && old_mp->parse_map_id) {
+		err = xdp_multiprog__share_map(dispatcher, XDP_DISPATCHER_PARSE_MAP,
+					       old_mp->parse_map_id);
+		if (err)
+			goto err;
+	}
+
+	/* The instrumented, parsing and tail call dispatchers have more maps */
+	for (map = bpf_object__next_map(mp->main_prog->bpf_obj, NULL); map;
+	     map = bpf_object__next_map(mp->main_prog->bpf_obj, map))
+		if (strcmp(bpf_map__name(map), XDP_DISPATCHER_STATS_MAP) &&
+		    strcmp(bpf_map__name(map), XDP_DISPATCHER_PARSE_MAP) &&
+		    strcmp(bpf_map__name(map), XDP_DISPATCHER_PROGS_MAP) &&
+		    strcmp(bpf_map__name(map), XDP_DISPATCHER_CHAIN_MAP) &&
+		    strcmp(bpf_map__name(map), XDP_DISPATCHER_SLOT_MAP))
+			break;
+	if (!map) {
+		pr_warn("Couldn't find rodata map in object file '%s'\n",
+			filename);
+		err = -ENOENT;
+		goto err;
+	}
+
+	mp->config.num_progs_enabled = num_new_progs;
+	mp->config.is_xdp_frags = frags;
+	for (i = 0; i < num_new_progs; i++) {
+		mp->config.chain_call_actions[i] =
+			(new_progs[i]->chain_call_actions |
+			 (1U << XDP_DISPATCHER_RETVAL));
+		mp->config.run_prios[i] = new_progs[i]->run_prio;
+	}
+
+	err = dispatcher_config_set(map, &mp->config);
+	if (err) {
+		pr_warn("Failed to set rodata for object file '%s'\n",
+			filename);
+		goto err;
+	}
+
+	/* If the kernel can't link programs into the dispatcher, try again
+	 * with tail calls; this needs a bpffs for pinning the programs all the
+	 * same. Any other failure is an error like it would be without the
+	 * tail call dispatcher.
+	 */
+	err = xdp_multiprog__load(mp);
+	if (!err && !tail_call && (!old_mp || old_mp->is_legacy) &&
+	    !IS_ERR(get_bpffs_dir())) {
+		err = xdp_multiprog__check_freplace(mp);
+		if (err == -EOPNOTSUPP) {
+			pr_info("Kernel can't link programs into the dispatcher, "
+				"falling back to the tail call dispatcher\n");
+			xdp_program__close(mp->main_prog);
+			mp->main_prog = NULL;
+			mp->is_loaded = false;
+			tail_call = true;
+			stats = parse = false;
+			goto open;
+		}
+		if (err) {
+			pr_info("Compatibility check for dispatcher program failed: %s\n",
+				strerror(-err));
+			err = -EOPNOTSUPP;
+		}
+	}
+	if (err)
+		goto err;
+
+	err = obj_map_id(mp->main_prog->bpf_obj, XDP_DISPATCHER_STATS_MAP,
+			 &mp->stats_map_id);
+	if (!err)
+		err = obj_map_id(mp->main_prog->bpf_obj,
+				 XDP_DISPATCHER_PARSE_MAP, &mp->parse_map_id);
+	if (!err)
+		err = obj_map_id(mp->main_prog->bpf_obj,
+				 XDP_DISPATCHER_PROGS_MAP, &mp->progs_map_id);
+	if (!err)
+		err = obj_map_id(mp->main_prog->bpf_obj,
+				 XDP_DISPATCHER_CHAIN_MAP, &mp->chain_map_id);
+	if (!err)
+		err = obj_map_id(mp->main_prog->bpf_obj,
+				 XDP_DISPATCHER_SLOT_MAP, &mp->slot_map_id);
+	if (err)
+		goto err;
+
+	for (i = 0; i < num_new_progs; i++) {
+		err = xdp_multiprog__link_prog(mp, new_progs[i], i);
+		if (err)
+			goto err;
+	}
+
+	/* Programs removed from the end of the shared program array */
+	if (tail_call && old_mp && old_mp->progs_map_id) {
+		err = xdp_multiprog__clear_tail_calls(mp, num_new_progs,
+						      old_mp->config.num_progs_enabled);
+		if (err)
+			goto err;
+	}
+
+	if (old_mp)
+		free(new_progs);
+
+	return mp;
+
+err:
+	if (old_mp)
+		free(new_progs);
+	xdp_multiprog__close(mp);
+	return ERR_PTR(err);
+}
+
+/* Pin the link and program of one component beneath the dispatcher's pin
+ * directory; must be called with the lock held. Programs in the tail call
+ * dispatcher have no link, and only the program is pinned, so it can be found
+ * again.
+ */
+static int xdp_multiprog__pin_prog(const struct xdp_multiprog *mp,
+				   const char *pin_path,
+				   const struct xdp_program *prog)
+{
+	char buf[PATH_MAX];
+	int err;
+
+	if (mp->progs_map_id)
+		goto pin_prog;
+
+	if (prog->link_fd < 0) {
+		pr_warn("Prog %s not linked\n", xdp_program__name(prog));
+		return -EINVAL;
+	}
+
+	err = try_snprintf(buf, sizeof(buf), "%s/%s-link",
+			   pin_path, prog->attach_name);
+	if (err)
+		return err;
+
+	err = bpf_obj_pin(prog->link_fd, buf);
+	if (err) {
+		err = -errno;
+		pr_warn("Couldn't pin link FD at %s: %s\n", buf, strerror(-err));
+		return err;
+	}
+	pr_debug("Pinned link for prog %s at %s\n",
+		 xdp_program__name(prog), buf);
+
+pin_prog:
+	err = try_snprintf(buf, sizeof(buf), "%s/%s-prog",
+			   pin_path, prog->attach_name);
+	if (err)
+		return err;
+
+	err = bpf_obj_pin(prog->prog_fd, buf);
+	if (err) {
+		err = -errno;
+		pr_warn("Couldn't pin prog FD at %s: %s\n", buf, strerror(-err));
+		return err;
+	}
+
+	pr_debug("Pinned prog %s at %s\n", xdp_program__name(prog), buf);
+	return 0;
+}
+
+static void xdp_multiprog__unpin_prog_files(const char *pin_path,
+					    const struct xdp_program *prog)
+{
+	char buf[PATH_MAX];
+
+	if (!try_snprintf(buf, sizeof(buf), "%s/%s-link",
+			  pin_path, prog->attach_name))
+		unlink(buf);
+	if (!try_snprintf(buf, sizeof(buf), "%s/%s-prog",
+			  pin_path, prog->attach_name))
+		unlink(buf);
+}
+
+/* The kernel empties a program array once no file descriptor or pin refers to
+ * it; the references from the programs using it don't count. So the maps of
+ * the tail call dispatcher are pinned along with its programs, or the tail
+ * calls would stop working as soon as the process that loaded it exits.
+ */
+static int xdp_multiprog__pin_maps(const struct xdp_multiprog *mp,
+				   const char *pin_path)
+{
+	__u32 ids[] = { mp->progs_map_id, mp->chain_map_id, mp->slot_map_id };
+	char buf[PATH_MAX];
+	int err, fd;
+	size_t i;
+
+	if (!mp->progs_map_id)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(tail_call_map_names); i++) {
+		err = try_snprintf(buf, sizeof(buf), "%s/%s",
+				   pin_path, tail_call_map_names[i]);
+		if (err)
+			return err;
+
+		fd = bpf_map_get_fd_by_id(ids[i]);
+		if (fd < 0) {
+			err = -errno;
+			pr_warn("Couldn't get map %s: %s\n",
+				tail_call_map_names[i], strerror(-err));
+			return err;
+		}
+
+		err = bpf_obj_pin(fd, buf);
+		if (err)
+			err = -errno;
+		close(fd);
+		if (err) {
+			pr_warn("Couldn't pin map at %s: %s\n", buf,
+				strerror(-err));
+			return err;
+		}
+		pr_debug("Pinned map %s at %s\n", tail_call_map_names[i], buf);
+	}
+
+	return 0;
+}
+
+static void xdp_multiprog__unpin_map_files(const char *pin_path)
+{
+	char buf[PATH_MAX];
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(tail_call_map_names); i++)
+		if (!try_snprintf(buf, sizeof(buf), "%s/%s",
+				  pin_path, tail_call_map_names[i]))
+			unlink(buf);
+}
+
+static int xdp_multiprog__pin(struct xdp_multiprog *mp)
+{
+	char pin_path[PATH_MAX];
+	struct xdp_program *prog;
+	const char *bpffs_dir;
+	int err = 0, lock_fd;
+
+	if (!mp || mp->is_legacy)
+		return -EINVAL;
+
+	bpffs_dir = get_bpffs_dir();
+	if (IS_ERR(bpffs_dir))
+		return PTR_ERR(bpffs_dir);
+
+	err = try_snprintf(pin_path, sizeof(pin_path), "%s/dispatch-%d-%d",
+			   bpffs_dir, mp->ifindex, mp->main_prog->prog_id);
+	if (err)
+		return err;
+
+	lock_fd = xdp_lock_acquire();
+	if (lock_fd < 0)
+		return lock_fd;
+
+	pr_debug("Pinning multiprog fd %d beneath %s\n",
+		 mp->main_prog->prog_fd, pin_path);
+
+	err = mkdir(pin_path, S_IRWXU);
+	if (err && errno != EEXIST) {
+		err = -errno;
+		goto out;
+	}
+
+	err = xdp_multiprog__pin_maps(mp, pin_path);
+	if (err)
+		goto err_unpin;
+
+	for (prog = mp->first_prog; prog; prog = prog->next) {
+		err = xdp_multiprog__pin_prog(mp, pin_path, prog);
+		if (err)
+			goto err_unpin;
+	}
+out:
+	xdp_lock_release(lock_fd);
+	return err;
+
+err_unpin:
+	for (prog = mp->first_prog; prog; prog = prog->next)
+		xdp_multiprog__unpin_prog_files(pin_path, prog);
+	xdp_multiprog__unpin_map_files(pin_path);
+	rmdir(pin_path);
+	goto out;
+}
+
+static int xdp_multiprog__unpin(struct xdp_multiprog *mp)
+{
+	char pin_path[PATH_MAX], buf[PATH_MAX];
+	struct xdp_program *prog;
+	const char *bpffs_dir;
+	int err = 0, lock_fd;
+	size_t i;
+
+	if (!mp || mp->is_legacy)
+		return -EINVAL;
+
+	bpffs_dir = get_bpffs_dir();
+	if (IS_ERR(bpffs_dir))
+		return PTR_ERR(bpffs_dir);
+
+	err = try_snprintf(pin_path, sizeof(pin_path), "%s/dispatch-%d-%d",
+			   bpffs_dir, mp->ifindex, mp->main_prog->prog_id);
+	if (err)
+		return err;
+
+	lock_fd = xdp_lock_acquire();
+	if (lock_fd < 0)
+		return lock_fd;
+
+	pr_debug("Unpinning multiprog fd %d beneath %s\n",
+		 mp->main_prog->prog_fd, pin_path);
+
+	for (prog = mp->first_prog; prog; prog = prog->next) {
+		if (mp->progs_map_id)
+			goto unpin_prog;
+
+		err = try_snprintf(buf, sizeof(buf), "%s/%s-link",
+				   pin_path, prog->attach_name);
+		if (err)
+			goto out;
+
+		err = unlink(buf);
+		if (err) {
+			err = -errno;
+			pr_warn("Couldn't unlink file %s: %s\n",
+				buf, strerror(-err));
+			goto out;
+		}
+		pr_debug("Unpinned link for prog %s from %s\n",
+			 xdp_program__name(prog), buf);
+
+unpin_prog:
+		err = try_snprintf(buf, sizeof(buf), "%s/%s-prog",
+				   pin_path, prog->attach_name);
+		if (err)
+			goto out;
+
+		err = unlink(buf);
+		if (err) {
+			err = -errno;
+			pr_warn("Couldn't unlink file %s: %s\n",
+				buf, strerror(-err));
+			goto out;
+		}
+
+		pr_debug("Unpinned prog %s from %s\n",
+			 xdp_program__name(prog), buf);
+	}
+
+	for (i = 0; mp->progs_map_id && i < ARRAY_SIZE(tail_call_map_names); i++) {
+		err = try_snprintf(buf, sizeof(buf), "%s/%s",
+				   pin_path, tail_call_map_names[i]);
+		if (err)
+			goto out;
+
+		err = unlink(buf);
+		if (err) {
+			err = -errno;
+			pr_warn("Couldn't unlink file %s: %s\n",
+				buf, strerror(-err));
+			goto out;
+		}
+		pr_debug("Unpinned map %s from %s\n", tail_call_map_names[i], buf);
+	}
+
+	err = rmdir(pin_path);
+	if (err)
+		err = -errno;
+	pr_debug("Removed pin directory %s\n", pin_path);
+out:
+	xdp_lock_release(lock_fd);
+	return err;
+}
+
+/* A dispatcher attached to more than one interface (see
+ * xdp_program__attach_ifaces()) has a pin directory for each of them, and can't
+ * be changed in place, as that would change the programs on all of them
+ */
+static bool xdp_multiprog__is_shared(const struct xdp_multiprog *mp)
+{
+	__u32 dir_prog_id;
+	bool shared = false;
+	const char *dir;
+	int path_ifindex;
+	DIR *d;
+
+	dir = get_bpffs_dir();
+	if (IS_ERR(dir))
+		return false;
+
+	d = opendir(dir);
+	if (!d)
+		return false;
+
+	for (struct dirent *dent = readdir(d); dent; dent = readdir(d)) {
+		if (dent->d_type != DT_DIR ||
+		    sscanf(dent->d_name, "dispatch-%d-%"PRIu32"",
+			   &path_ifindex, &dir_prog_id) != 2)
+			continue;
+
+		if (dir_prog_id == mp->main_prog->prog_id &&
+		    path_ifindex != mp->ifindex) {
+			shared = true;
+			break;
+		}
+	}
+	closedir(d);
+	return shared;
+}
+
+/* Attach the dispatcher running on another interface to one that has no
+ * programs yet, so neither the dispatcher nor its programs are loaded again.
+ * The links of the component programs get pinned for this interface as well,
+ * which keeps them alive for as long as either interface uses them. Returns
+ * -EEXIST if the interface already has programs.
+ */
+static int xdp_multiprog__attach_shared(struct xdp_multiprog *mp, int ifindex,
+					enum xdp_attach_mode mode)
+{
+	__u32 prog_id = 0, hw_prog_id = 0;
+	char buf[PATH_MAX], pin_path[PATH_MAX];
+	struct xdp_program *prog;
+	const char *bpffs_dir;
+	int err;
+
+	if (mp->is_legacy || mode == XDP_MODE_HW)
+		return -EINVAL;
+
+	err = xdp_get_ifindex_prog_id(ifindex, &prog_id, &hw_prog_id, NULL);
+	if (err)
+		return err;
+	if (prog_id || hw_prog_id)
+		return -EEXIST;
+
+	bpffs_dir = get_bpffs_dir();
+	if (IS_ERR(bpffs_dir))
+		return PTR_ERR(bpffs_dir);
+
+	err = try_snprintf(pin_path, sizeof(pin_path), "%s/dispatch-%d-%d",
+			   bpffs_dir, mp->ifindex, mp->main_prog->prog_id);
+	if (err)
+		return err;
+
+	/* Programs read back from bpffs come without their links */
+	for (prog = mp->first_prog; prog && !mp->progs_map_id; prog = prog->next) {
+		if (prog->link_fd >= 0)
+			continue;
+
+		err = try_snprintf(buf, sizeof(buf), "%s/%s-link",
+				   pin_path, prog->attach_name);
+		if (err)
+			return err;
+
+		prog->link_fd = bpf_obj_get(buf);
+		if (prog->link_fd < 0) {
+			err = -errno;
+			pr_warn("Couldn't get link of prog %s from %s: %s\n",
+				xdp_program__name(prog), buf, strerror(-err));
+			return err;
+		}
+	}
+
+	mp->ifindex = ifindex;
+	err = xdp_multiprog__pin(mp);
+	if (err)
+		return err;
+
+	err = xdp_multiprog__attach(NULL, mp, mode);
+	if (err) {
+		xdp_multiprog__unpin(mp);
+		return err;
+	}
+
+	pr_debug("Sharing dispatcher %u with ifindex %d\n",
+		 mp->main_prog->prog_id, ifindex);
+	return 0;
+}
+
+static bool xdp_incremental_update(void)
+{
+	char *envval;
+
+	envval = secure_getenv(XDP_INCREMENTAL_ENVVAR);
+	return envval && envval[0] == '1' && envval[1] == '\0';
+}
+
+/* Changing the components of a dispatcher in place is only safe if it is
+ * still the one attached to the interface; must be called with the lock held
+ */
+static int xdp_multiprog__check_attached(const struct xdp_multiprog *mp)
+{
+	__u32 prog_id = 0;
+	int err;
+
+	err = xdp_get_ifindex_prog_id(mp->ifindex, &prog_id, NULL, NULL);
+	if (err)
+		return err;
+
+	return prog_id == mp->main_prog->prog_id ? 0 : -EAGAIN;
+}
+
+/* Detach a component from the running dispatcher, leaving its slot empty. The
+ * stub function of an empty slot returns XDP_DISPATCHER_RETVAL, which every
+ * slot chain calls on, so packets just carry on to the next slot. Must be
+ * called with the lock held.
+ */
+static int xdp_multiprog__unlink_prog(struct xdp_multiprog *mp,
+				      const char *pin_path,
+				      struct xdp_program *prog)
+{
+	struct xdp_program **p;
+	char buf[PATH_MAX];
+	int err, lfd, slot;
+	__u32 key;
+
+	for (p = &mp->first_prog; *p && *p != prog; p = &(*p)->next)
+		;
+	if (!*p)
+		return -ENOENT;
+
+	/* The tail call dispatcher skips a slot with no program in it */
+	if (mp->progs_map_id) {
+		slot = xdp_program__slot(prog);
+		if (slot < 0)
+			return slot;
+
+		key = slot;
+		lfd = bpf_map_get_fd_by_id(mp->progs_map_id);
+		if (lfd < 0 || (bpf_map_delete_elem(lfd, &key) && errno != ENOENT)) {
+			err = -errno;
+			pr_warn("Couldn't remove prog %s from dispatcher: %s\n",
+				xdp_program__name(prog), strerror(-err));
+			if (lfd >= 0)
+				close(lfd);
+			return err;
+		}
+		close(lfd);
+	}
+
+	err = try_snprintf(buf, sizeof(buf), "%s/%s-link",
+			   pin_path, prog->attach_name);
+	if (err)
+		return err;
+
+	/* Detaching works even if someone else holds a reference to the link,
+	 * but not all kernels support it for freplace links; those detach it
+	 * once the pin is gone
+	 */
+	lfd = bpf_obj_get(buf);
+	if (lfd >= 0) {
+		if (bpf_link_detach(lfd))
+			pr_debug("Couldn't detach link of prog %s: %s\n",
+				 xdp_program__name(prog), strerror(errno));
+		close(lfd);
+	}
+
+	err = unlink(buf);
+	if (err && errno != ENOENT) {
+		err = -errno;
+		pr_warn("Couldn't unlink file %s: %s\n", buf, strerror(-err));
+		return err;
+	}
+
+	err = try_snprintf(buf, sizeof(buf), "%s/%s-prog",
+			   pin_path, prog->attach_name);
+	if (!err && unlink(buf) && errno != ENOENT)
+		pr_warn("Couldn't unlink file %s: %s\n", buf, strerror(errno));
+
+	pr_debug("Emptied dispatcher slot %s of prog %s\n",
+		 prog->attach_name, xdp_program__name(prog));
+
+	*p = prog->next;
+	mp->num_links--;
+	xdp_program__close(prog);
+	return 0;
+}
+
+static int xdp_multiprog__unlink_progs(struct xdp_multiprog *mp,
+				       struct xdp_program **progs,
+				       size_t num_progs)
+{
+	struct xdp_program *p;
+	char pin_path[PATH_MAX];
+	const char *bpffs_dir;
+	int err, lock_fd;
+	size_t i;
+
+	if (!mp || mp->is_legacy || num_progs >= mp->num_links)
+		return -EINVAL;
+
+	bpffs_dir = get_bpffs_dir();
+	if (IS_ERR(bpffs_dir))
+		return PTR_ERR(bpffs_dir);
+
+	err = try_snprintf(pin_path, sizeof(pin_path), "%s/dispatch-%d-%d",
+			   bpffs_dir, mp->ifindex, mp->main_prog->prog_id);
+	if (err)
+		return err;
+
+	lock_fd = xdp_lock_acquire();
+	if (lock_fd < 0)
+		return lock_fd;
+
+	err = xdp_multiprog__check_attached(mp);
+	if (err)
+		goto out;
+
+	if (xdp_multiprog__is_shared(mp)) {
+		err = -EBUSY;
+		goto out;
 	}
 
-	if (num_new_progs > 1)
-		qsort(new_progs, num_new_progs, sizeof(*new_progs), cmp_xdp_programs);
+	for (i = 0; i < num_progs; i++) {
+		for (p = mp->first_prog; p; p = p->next)
+			if (p->prog_id == progs[i]->prog_id)
+				break;
 
-	dispatcher = __xdp_program__find_file("xdp-dispatcher.o",
-					      NULL, "xdp_dispatcher", NULL);
-	if (IS_ERR(dispatcher)) {
-		err = PTR_ERR(dispatcher);
-		pr_warn("Couldn't open BPF file 'xdp-dispatcher.o'\n");
-		goto err;
+		err = p ? xdp_multiprog__unlink_prog(mp, pin_path, p) : -ENOENT;
+		if (err)
+			goto out;
 	}
 
-	err = check_dispatcher_version(bpf_program__name(dispatcher->bpf_prog),
-				       dispatcher->btf);
-	if (err) {
-		pr_warn("XDP dispatcher object version check failed: %s\n",
-			strerror(-err));
-		goto err;
-	}
+	pr_debug("Detached %zu programs in place on ifindex %d\n",
+		 num_progs, mp->ifindex);
+out:
+	xdp_lock_release(lock_fd);
+	return err;
+}
 
-	mp->main_prog = dispatcher;
+/* A program fits into an empty slot if the configuration the dispatcher was
+ * loaded with for that slot is what the program would get in a new one, and
+ * sorting the programs would put it in the same place
+ */
+static bool xdp_multiprog__slot_fits(const struct xdp_multiprog *mp,
+				     int slot,
+				     const struct xdp_program *prog)
+{
+	const struct xdp_program *p;
+	int s;
 
-	map = bpf_object__next_map(mp->main_prog->bpf_obj, NULL);
-	if (!map) {
-		pr_warn("Couldn't find rodata map in object file 'xdp-dispatcher.o'\n");
-		err = -ENOENT;
-		goto err;
-	}
+	if (mp->config.chain_call_actions[slot] !=
+	    (prog->chain_call_actions | (1U << XDP_DISPATCHER_RETVAL)) ||
+	    mp->config.run_prios[slot] != prog->run_prio)
+		return false;
 
-	mp->config.num_progs_enabled = num_new_progs;
-	for (i = 0; i < num_new_progs; i++) {
-		mp->config.chain_call_actions[i] =
-			(new_progs[i]->chain_call_actions |
-			 (1U << XDP_DISPATCHER_RETVAL));
-		mp->config.run_prios[i] = new_progs[i]->run_prio;
+	for (p = mp->first_prog; p; p = p->next) {
+		s = xdp_program__slot(p);
+		if (s == slot ||
+		    (s < slot && cmp_xdp_programs(&p, &prog) > 0) ||
+		    (s > slot && cmp_xdp_programs(&p, &prog) < 0))
+			return false;
 	}
+	return true;
+}
 
-	err = bpf_map__set_initial_value(map, &mp->config, sizeof(mp->config));
-	if (err) {
-		pr_warn("Failed to set rodata for object file 'xdp-dispatcher.o'\n");
-		goto err;
-	}
+/* With the tail call dispatcher, every program but the last one has to chain
+ * call, see xdp_program__can_tail_call()
+ */
+static bool xdp_multiprog__tail_calls_fit(const struct xdp_multiprog *mp,
+					  int slot,
+					  const struct xdp_program *prog)
+{
+	const struct xdp_program *p;
+	int s, last = slot;
 
-	err = xdp_multiprog__load(mp);
-	if (err)
-		goto err;
+	if (!mp->progs_map_id)
+		return true;
 
-	for (i = 0; i < num_new_progs; i++) {
-		err = xdp_multiprog__link_prog(mp, new_progs[i]);
-		if (err)
-			goto err;
+	for (p = mp->first_prog; p; p = p->next) {
+		s = xdp_program__slot(p);
+		if (s > last)
+			last = s;
 	}
 
-	if (old_mp)
-		free(new_progs);
+	if (slot != last && !xdp_program__can_tail_call(prog, mp->progs_map_id))
+		return false;
 
-	return mp;
+	for (p = mp->first_prog; p; p = p->next)
+		if (xdp_program__slot(p) != last &&
+		    !xdp_program__can_tail_call(p, mp->progs_map_id))
+			return false;
+	return true;
+}
 
-err:
-	if (old_mp)
-		free(new_progs);
-	xdp_multiprog__close(mp);
-	return ERR_PTR(err);
+/* Counters left over from the previous occupant of a slot would otherwise be
+ * put down to the new one
+ */
+static int xdp_multiprog__reset_slot_stats(const struct xdp_multiprog *mp,
+					   __u32 slot)
+{
+	struct xdp_dispatcher_stats *values;
+	int map_fd, ncpus, err = 0;
+
+	if (!mp->stats_map_id)
+		return 0;
+
+	ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 0)
+		return ncpus;
+
+	values = calloc(ncpus, sizeof(*values));
+	if (!values)
+		return -ENOMEM;
+
+	map_fd = bpf_map_get_fd_by_id(mp->stats_map_id);
+	if (map_fd < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	if (bpf_map_update_elem(map_fd, &slot, values, 0))
+		err = -errno;
+	close(map_fd);
+out:
+	free(values);
+	return err;
 }
 
-static int xdp_multiprog__pin(struct xdp_multiprog *mp)
+/* Link a program into an empty slot of the running dispatcher, which only
+ * needs the program itself to be verified. Returns -ENOSPC if no slot fits,
+ * in which case a new dispatcher has to be generated.
+ */
+static int xdp_multiprog__fill_slot(struct xdp_multiprog *mp,
+				    struct xdp_program *prog,
+				    enum xdp_attach_mode mode)
 {
-	char pin_path[PATH_MAX], buf[PATH_MAX];
-	struct xdp_program *prog;
+	struct xdp_program *p = NULL, *next;
+	char pin_path[PATH_MAX];
 	const char *bpffs_dir;
-	int err = 0, lock_fd;
+	int err, lock_fd, slot;
 
-	if (!mp || mp->is_legacy)
+	if (!mp || !prog)
 		return -EINVAL;
 
+	if (mp->is_legacy ||
+	    (mode != XDP_MODE_UNSPEC && mode != mp->attach_mode))
+		return -ENOSPC;
+
 	bpffs_dir = get_bpffs_dir();
 	if (IS_ERR(bpffs_dir))
 		return PTR_ERR(bpffs_dir);
@@ -2808,130 +4958,177 @@ static int xdp_multiprog__pin(struct xdp_multiprog *mp)
 	if (lock_fd < 0)
 		return lock_fd;
 
-	pr_debug("Pinning multiprog fd %d beneath %s\n",
-		 mp->main_prog->prog_fd, pin_path);
+	err = xdp_multiprog__check_attached(mp);
+	if (err)
+		goto out;
 
-	err = mkdir(pin_path, S_IRWXU);
-	if (err && errno != EEXIST) {
-		err = -errno;
+	if (xdp_multiprog__is_shared(mp)) {
+		err = -ENOSPC;
 		goto out;
 	}
 
-	for (prog = mp->first_prog; prog; prog = prog->next) {
-		if (prog->link_fd < 0) {
-			err = -EINVAL;
-			pr_warn("Prog %s not linked\n", xdp_program__name(prog));
-			goto err_unpin;
-		}
+	/* Filling or emptying a slot leaves the dispatcher ID alone, so
+	 * another process may have done so since mp was read; pick the slot
+	 * from what is pinned now.
+	 */
+	for (p = mp->first_prog; p; p = next) {
+		next = p->next;
+		xdp_program__close(p);
+	}
+	mp->first_prog = NULL;
+	mp->num_links = 0;
 
-		err = try_snprintf(buf, sizeof(buf), "%s/%s-link",
-				   pin_path, prog->attach_name);
-		if (err)
-			goto err_unpin;
+	err = __xdp_multiprog__link_pinned_progs(mp);
+	if (err) {
+		pr_debug("Couldn't read pinned programs of dispatcher: %s\n",
+			 strerror(-err));
+		if (err == -ENOENT)
+			err = -ENOSPC;
+		goto out;
+	}
 
-		err = bpf_obj_pin(prog->link_fd, buf);
-		if (err) {
-			err = -errno;
-			pr_warn("Couldn't pin link FD at %s: %s\n", buf, strerror(-err));
-			goto err_unpin;
-		}
-		pr_debug("Pinned link for prog %s at %s\n",
-			 xdp_program__name(prog), buf);
+	for (slot = 0; slot < mp->config.num_progs_enabled; slot++)
+		if (xdp_multiprog__slot_fits(mp, slot, prog))
+			break;
+	if (mp->num_links >= mp->config.num_progs_enabled ||
+	    slot == mp->config.num_progs_enabled ||
+	    (mp->progs_map_id && slot >= XDP_MAX_TAIL_CALLS) ||
+	    !xdp_multiprog__tail_calls_fit(mp, slot, prog)) {
+		err = -ENOSPC;
+		goto out;
+	}
 
-		err = try_snprintf(buf, sizeof(buf), "%s/%s-prog",
-				   pin_path, prog->attach_name);
-		if (err)
-			goto err_unpin;
+	/* Should the slot be taken after all, generate a new dispatcher */
+	err = xdp_multiprog__link_prog(mp, prog, slot);
+	if (err == -EBUSY || err == -EEXIST)
+		err = -ENOSPC;
+	if (err)
+		goto out;
 
-		err = bpf_obj_pin(prog->prog_fd, buf);
-		if (err) {
-			err = -errno;
-			pr_warn("Couldn't pin prog FD at %s: %s\n", buf, strerror(-err));
-			goto err_unpin;
-		}
+	p = NULL;
+	while ((p = xdp_multiprog__next_prog(p, mp)))
+		if (xdp_program__slot(p) == slot)
+			break;
 
-		pr_debug("Pinned prog %s at %s\n", xdp_program__name(prog), buf);
+	err = xdp_multiprog__reset_slot_stats(mp, slot);
+	if (err)
+		pr_warn("Couldn't reset stats of dispatcher slot %d: %s\n",
+			slot, strerror(-err));
+
+	err = xdp_multiprog__pin_prog(mp, pin_path, p);
+	if (err) {
+		xdp_multiprog__unlink_prog(mp, pin_path, p);
+		goto out;
 	}
+
+	pr_debug("Attached prog %s in place in slot %d on ifindex %d\n",
+		 xdp_program__name(prog), slot, mp->ifindex);
 out:
 	xdp_lock_release(lock_fd);
 	return err;
-
-err_unpin:
-	for (prog = mp->first_prog; prog; prog = prog->next) {
-		if (!try_snprintf(buf, sizeof(buf), "%s/%s-link",
-				  pin_path, prog->attach_name))
-			unlink(buf);
-		if (!try_snprintf(buf, sizeof(buf), "%s/%s-prog",
-				  pin_path, prog->attach_name))
-			unlink(buf);
-	}
-	rmdir(pin_path);
-	goto out;
 }
 
-static int xdp_multiprog__unpin(struct xdp_multiprog *mp)
+static int xdp_link_pin_path(char *buf, size_t buf_len, int ifindex)
 {
-	char pin_path[PATH_MAX], buf[PATH_MAX];
-	struct xdp_program *prog;
 	const char *bpffs_dir;
-	int err = 0, lock_fd;
-
-	if (!mp || mp->is_legacy)
-		return -EINVAL;
 
 	bpffs_dir = get_bpffs_dir();
 	if (IS_ERR(bpffs_dir))
 		return PTR_ERR(bpffs_dir);
 
-	err = try_snprintf(pin_path, sizeof(pin_path), "%s/dispatch-%d-%d",
-			   bpffs_dir, mp->ifindex, mp->main_prog->prog_id);
+	return try_snprintf(buf, buf_len, "%s/link-%d", bpffs_dir, ifindex);
+}
+
+/* Attach, replace or detach the dispatcher through a bpf_link pinned in bpffs,
+ * instead of through netlink. A new link is only created if requested through
+ * the environment, but once it exists, all changes to the dispatcher go through
+ * it. Returns -ENOENT if the caller should fall back to netlink.
+ */
+static int xdp_link_attach(int prog_fd, int old_fd, int ifindex,
+			   enum xdp_attach_mode mode)
+{
+	DECLARE_LIBBPF_OPTS(bpf_link_update_opts, update_opts);
+	DECLARE_LIBBPF_OPTS(bpf_link_create_opts, create_opts);
+	int err = 0, link_fd, lock_fd;
+	char pin_path[PATH_MAX];
+	char *envval;
+
+	err = xdp_link_pin_path(pin_path, sizeof(pin_path), ifindex);
 	if (err)
-		return err;
+		return -ENOENT;
 
 	lock_fd = xdp_lock_acquire();
 	if (lock_fd < 0)
 		return lock_fd;
 
-	pr_debug("Unpinning multiprog fd %d beneath %s\n",
-		 mp->main_prog->prog_fd, pin_path);
-
-	for (prog = mp->first_prog; prog; prog = prog->next) {
-		err = try_snprintf(buf, sizeof(buf), "%s/%s-link",
-				   pin_path, prog->attach_name);
-		if (err)
+	link_fd = bpf_obj_get(pin_path);
+	if (link_fd < 0) {
+		envval = secure_getenv(XDP_LINK_ENVVAR);
+		if (prog_fd < 0 || old_fd >= 0 ||
+		    !envval || envval[0] != '1' || envval[1] != '\0') {
+			err = -ENOENT;
 			goto out;
+		}
 
-		err = unlink(buf);
-		if (err) {
+		create_opts.flags = xdp_mode_flags(mode);
+		link_fd = bpf_link_create(prog_fd, ifindex, BPF_XDP, &create_opts);
+		if (link_fd < 0) {
 			err = -errno;
-			pr_warn("Couldn't unlink file %s: %s\n",
-				buf, strerror(-err));
+			pr_debug("Couldn't create XDP link on ifindex %d: %s\n",
+				 ifindex, strerror(-err));
+			/* no kernel support, use netlink instead */
+			if (err == -EINVAL || err == -EOPNOTSUPP)
+				err = -ENOENT;
 			goto out;
 		}
-		pr_debug("Unpinned link for prog %s from %s\n",
-			 xdp_program__name(prog), buf);
 
-		err = try_snprintf(buf, sizeof(buf), "%s/%s-prog",
-				   pin_path, prog->attach_name);
-		if (err)
-			goto out;
+		/* closing the link on error detaches the program again */
+		err = bpf_obj_pin(link_fd, pin_path);
+		if (err) {
+			err = -errno;
+			pr_warn("Couldn't pin XDP link at %s: %s\n", pin_path,
+				strerror(-err));
+			goto out_close;
+		}
+		pr_debug("Attached XDP link on ifindex %d, pinned at %s\n",
+			 ifindex, pin_path);
+		goto out_close;
+	}
 
-		err = unlink(buf);
+	if (prog_fd < 0) {
+		err = unlink(pin_path);
 		if (err) {
 			err = -errno;
-			pr_warn("Couldn't unlink file %s: %s\n",
-				buf, strerror(-err));
-			goto out;
+			pr_warn("Couldn't unlink file %s: %s\n", pin_path,
+				strerror(-err));
+			goto out_close;
 		}
 
-		pr_debug("Unpinned prog %s from %s\n",
-			 xdp_program__name(prog), buf);
+		/* detach right away, even if someone else holds a reference */
+		if (bpf_link_detach(link_fd))
+			pr_debug("Couldn't detach XDP link: %s\n", strerror(errno));
+		pr_debug("Detached XDP link on ifindex %d\n", ifindex);
+		goto out_close;
 	}
 
-	err = rmdir(pin_path);
-	if (err)
+	if (old_fd >= 0) {
+		update_opts.old_prog_fd = old_fd;
+		update_opts.flags = BPF_F_REPLACE;
+	}
+
+	err = bpf_link_update(link_fd, prog_fd, &update_opts);
+	if (err) {
 		err = -errno;
-	pr_debug("Removed pin directory %s\n", pin_path);
+		pr_info("Error updating XDP link on ifindex %d: %s\n",
+			ifindex, strerror(-err));
+
+		/* We raced with another attach/detach, have to retry */
+		if (err == -EPERM && old_fd >= 0)
+			err = -EAGAIN;
+	}
+
+out_close:
+	close(link_fd);
 out:
 	xdp_lock_release(lock_fd);
 	return err;
@@ -2965,8 +5162,13 @@ static int xdp_multiprog__attach(struct xdp_multiprog *old_mp,
 		ifindex = old_mp->ifindex;
 	}
 
+	/* A replacement has to go where the old dispatcher is */
+	if (mp && !old_mp && mode == XDP_MODE_UNSPEC)
+		mode = xdp_iface_best_mode(ifindex);
 
-	err = xdp_attach_fd(prog_fd, old_fd, ifindex, mode);
+	err = xdp_link_attach(prog_fd, old_fd, ifindex, mode);
+	if (err == -ENOENT)
+		err = xdp_attach_fd(prog_fd, old_fd, ifindex, mode);
 	if (err < 0)
 		goto err;
 
@@ -3058,6 +5260,81 @@ int xdp_multiprog__program_count(const struct xdp_multiprog *mp)
 	return mp->num_links;
 }
 
+bool xdp_multiprog__xdp_frags_support(const struct xdp_multiprog *mp)
+{
+	return mp && !mp->is_legacy && mp->config.is_xdp_frags;
+}
+
+bool xdp_multiprog__has_stats(const struct xdp_multiprog *mp)
+{
+	return mp && mp->stats_map_id;
+}
+
+int xdp_multiprog__program_stats(const struct xdp_multiprog *mp,
+				 const struct xdp_program *prog,
+				 struct xdp_program_stats *stats)
+{
+	struct xdp_dispatcher_stats *values = NULL;
+	const struct xdp_program *p;
+	int map_fd, ncpus, err, i, j;
+	__u32 slot;
+
+	if (!mp || !prog || !stats)
+		return libxdp_err(-EINVAL);
+
+	if (!mp->stats_map_id)
+		return libxdp_err(-EOPNOTSUPP);
+
+	for (p = mp->first_prog; p; p = p->next)
+		if (p == prog)
+			break;
+	if (!p)
+		return libxdp_err(-ENOENT);
+
+	err = xdp_program__slot(p);
+	if (err < 0)
+		return libxdp_err(err);
+	slot = err;
+
+	ncpus = libbpf_num_possible_cpus();
+	if (ncpus < 0)
+		return libxdp_err(ncpus);
+
+	values = calloc(ncpus, sizeof(*values));
+	if (!values)
+		return libxdp_err(-ENOMEM);
+
+	map_fd = bpf_map_get_fd_by_id(mp->stats_map_id);
+	if (map_fd < 0) {
+		err = -errno;
+		pr_warn("Could not get stats map fd for id %u: %s\n",
+			mp->stats_map_id, strerror(-err));
+		goto out;
+	}
+
+	err = bpf_map_lookup_elem(map_fd, &slot, values);
+	if (err) {
+		err = -errno;
+		pr_warn("Could not lookup stats for slot %u: %s\n", slot,
+			strerror(-err));
+		goto out_close;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < ncpus; i++) {
+		stats->invocations += values[i].invocations;
+		stats->run_time_ns += values[i].run_time_ns;
+		for (j = 0; j < XDP_DISPATCHER_NUM_VERDICTS; j++)
+			stats->verdicts[j] += values[i].verdicts[j];
+	}
+
+out_close:
+	close(map_fd);
+out:
+	free(values);
+	return libxdp_err(err);
+}
+
 static int remove_pin_dir(const char *subdir)
 {
 	char prog_path[PATH_MAX], pin_path[PATH_MAX];
@@ -3131,8 +5408,25 @@ int libxdp_clean_references(int ifindex)
 	}
 
 	for (struct dirent *dent = readdir(d); dent; dent = readdir(d)) {
-		if (dent->d_type != DT_DIR)
+		if (dent->d_type != DT_DIR) {
+			/* XDP links are defunct once their interface goes away */
+			if (sscanf(dent->d_name, "link-%d", &path_ifindex) != 1 ||
+			    (ifindex && path_ifindex != ifindex))
+				continue;
+
+			prog_id = 0;
+			xdp_get_ifindex_prog_id(path_ifindex, &prog_id, NULL, NULL);
+			if (!prog_id) {
+				char buf[PATH_MAX];
+
+				pr_info("No program attached on ifindex %d, removing XDP link %s\n",
+					path_ifindex, dent->d_name);
+				if (!try_snprintf(buf, sizeof(buf), "%s/%s", dir,
+						  dent->d_name))
+					unlink(buf);
+			}
 			continue;
+		}
 
 		if (sscanf(dent->d_name, "dispatch-%d-%"PRIu32"",
 			   &path_ifindex, &dir_prog_id) != 2)
@@ -1,6 +1,6 @@
 # SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause)
 
-ALL_TESTS="test_link_so test_link_a test_xsk_prog_refcnt_bpffs test_xsk_prog_refcnt_legacy"
+ALL_TESTS="test_link_so test_link_a test_xsk_prog_refcnt_bpffs test_xsk_prog_refcnt_legacy test_xsk_ring_batch test_xsk_frame_pool test_xsk_socket_group test_xsk_stats test_xsk_tx test_xsk_umem_share test_xsk_poller"
 
 TESTS_DIR=$(dirname "${BASH_SOURCE[0]}")
 
@@ -39,6 +39,55 @@ test_refcnt_once()
         ip link delete xsk_veth0
 }
 
+test_xsk_ring_batch()
+{
+        check_run $TESTS_DIR/test_xsk_ring 2>&1
+}
+
+test_xsk_frame_pool()
+{
+        check_run $TESTS_DIR/test_xsk_frame_pool 2>&1
+}
+
+test_xsk_socket_group()
+{
+        ip link add xsk_veth0 numrxqueues 3 numtxqueues 3 type veth peer name xsk_veth1
+        check_run $TESTS_DIR/test_xsk_socket_group xsk_veth0 3 2>&1
+        ip link delete xsk_veth0
+}
+
+test_xsk_stats()
+{
+        ip link add xsk_veth0 type veth peer name xsk_veth1
+        check_run $TESTS_DIR/test_xsk_stats xsk_veth0 2>&1
+        ip link delete xsk_veth0
+}
+
+test_xsk_tx()
+{
+        ip link add xsk_veth0 type veth peer name xsk_veth1
+        ip link set xsk_veth1 up
+        ip link set xsk_veth0 up
+        check_run $TESTS_DIR/test_xsk_tx xsk_veth0 2>&1
+        ip link delete xsk_veth0
+}
+
+test_xsk_umem_share()
+{
+        ip link add xsk_veth0 numtxqueues 2 numrxqueues 2 type veth peer name xsk_veth1
+        check_run $TESTS_DIR/test_xsk_umem_share xsk_veth0 2>&1
+        ip link delete xsk_veth0
+}
+
+test_xsk_poller()
+{
+        ip link add xsk_veth0 type veth peer name xsk_veth1
+        ip link set xsk_veth1 up
+        ip link set xsk_veth0 up
+        check_run $TESTS_DIR/test_xsk_poller xsk_veth0 2>&1
+        ip link delete xsk_veth0
+}
+
 check_mount_bpffs()
 {
 	mount | grep -q /sys/fs/bpf || mount -t bpf bpf /sys/fs/bpf/ || echo "Unable to mount /sys/fs/bpf"
@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+
+/* Check that the UMEM frame pool hands out every frame exactly once, takes
+ * back descriptor-style addresses in aligned and unaligned mode, and does
+ * not lose frames when several threads allocate and free concurrently.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "test_utils.h"
+
+#include <xdp/xsk.h>
+
+#define NUM_FRAMES 4096
+#define NUM_THREADS 4
+#define ROUNDS 100000
+#define MAX_BATCH 300
+#define UNALIGNED_FRAME_SIZE 3000
+
+struct test_umem {
+	struct xsk_ring_prod fq;
+	struct xsk_ring_cons cq;
+	struct xsk_umem *umem;
+	void *buffer;
+	__u64 size;
+};
+
+static __u64 frames[NUM_FRAMES];
+static char seen[NUM_FRAMES];
+
+static int create_umem(struct test_umem *u, __u32 frame_size, __u32 flags)
+{
+	struct xsk_umem_config cfg = {
+		.fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+		.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.frame_size = frame_size,
+		.frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
+		.flags = flags,
+	};
+	long pagesize = getpagesize();
+	int ret;
+
+	u->size = (__u64)NUM_FRAMES * frame_size;
+	u->size = (u->size + pagesize - 1) / pagesize * pagesize;
+	if (posix_memalign(&u->buffer, pagesize, u->size))
+		return -ENOMEM;
+
+	ret = xsk_umem__create(&u->umem, u->buffer, u->size, &u->fq, &u->cq,
+			       &cfg);
+	if (ret)
+		free(u->buffer);
+	return ret;
+}
+
+static void destroy_umem(struct test_umem *u)
+{
+	xsk_umem__delete(u->umem);
+	free(u->buffer);
+}
+
+/* Drain the pool through one cache and check every frame comes out once */
+static bool drain_unique(struct xsk_frame_cache *cache, __u32 frame_size,
+			__u32 expected)
+{
+	__u32 got = 0, n, i;
+
+	memset(seen, 0, sizeof(seen));
+	while (got < NUM_FRAMES &&
+	       (n = xsk_frame_cache__alloc(cache, frames + got, 50)))
+		got += n;
+
+	if (got != expected) {
+		fprintf(stderr, "Allocated %u frames, expected %u\n", got, expected);
+		return false;
+	}
+
+	for (i = 0; i < got; i++) {
+		if (frames[i] % frame_size || seen[frames[i] / frame_size]++) {
+			fprintf(stderr, "Bad or duplicate frame 0x%llx\n",
+				(unsigned long long)frames[i]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool test_single(__u32 frame_size, __u32 flags)
+{
+	struct xsk_frame_cache *cache = NULL;
+	struct xsk_frame_pool *pool = NULL;
+	struct test_umem u = {};
+	bool ok = false;
+	__u32 num, i;
+
+	if (create_umem(&u, frame_size, flags)) {
+		fprintf(stderr, "Failed to create UMEM\n");
+		return false;
+	}
+
+	if (xsk_frame_pool__create(&pool, u.umem, 64) ||
+	    xsk_frame_cache__create(&cache, pool))
+		goto out;
+
+	num = u.size / frame_size;
+	if (!drain_unique(cache, frame_size, num))
+		goto out;
+
+	/* Free addresses the way the kernel hands them back in Rx descriptors */
+	for (i = 0; i < num; i++) {
+		frames[i] += 256;
+		if (flags & XDP_UMEM_UNALIGNED_CHUNK_FLAG)
+			frames[i] += (__u64)64 << XSK_UNALIGNED_BUF_OFFSET_SHIFT;
+	}
+	xsk_frame_cache__free(cache, frames, num);
+
+	if (!drain_unique(cache, frame_size, num))
+		goto out;
+	xsk_frame_cache__free(cache, frames, num);
+
+	xsk_frame_cache__delete(cache);
+	cache = NULL;
+	ok = xsk_frame_pool__num_free(pool) == num;
+	if (!ok)
+		fprintf(stderr, "Pool has %u free frames after cache delete, expected %u\n",
+			xsk_frame_pool__num_free(pool), num);
+
+out:
+	xsk_frame_cache__delete(cache);
+	xsk_frame_pool__delete(pool);
+	destroy_umem(&u);
+	return ok;
+}
+
+static void *worker(void *arg)
+{
+	struct xsk_frame_pool *pool = arg;
+	struct xsk_frame_cache *cache;
+	__u64 addrs[MAX_BATCH];
+	__u32 got, i, r;
+
+	if (xsk_frame_cache__create(&cache, pool))
+		return (void *)1;
+
+	for (r = 0; r < ROUNDS; r++) {
+		got = xsk_frame_cache__alloc(cache, addrs, r % MAX_BATCH + 1);
+		for (i = 0; i < got; i++)
+			addrs[i] += r % 128;
+		xsk_frame_cache__free(cache, addrs, got);
+	}
+
+	xsk_frame_cache__delete(cache);
+	return NULL;
+}
+
+static bool test_threads(void)
+{
+	struct xsk_frame_pool *pool = NULL;
+	pthread_t threads[NUM_THREADS];
+	struct test_umem u = {};
+	bool ok = true;
+	void *res;
+	int i;
+
+	if (create_umem(&u, XSK_UMEM__DEFAULT_FRAME_SIZE, 0) ||
+	    xsk_frame_pool__create(&pool, u.umem, 0)) {
+		fprintf(stderr, "Failed to set up UMEM frame pool\n");
+		return false;
+	}
+
+	for (i = 0; i < NUM_THREADS; i++)
+		if (pthread_create(&threads[i], NULL, worker, pool))
+			exit(EXIT_FAILURE);
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_join(threads[i], &res);
+		ok = ok && !res;
+	}
+
+	if (xsk_frame_pool__num_free(pool) != NUM_FRAMES) {
+		fprintf(stderr, "Lost frames: %u of %u free after threads exit\n",
+			xsk_frame_pool__num_free(pool), NUM_FRAMES);
+		ok = false;
+	}
+
+	xsk_frame_pool__delete(pool);
+	destroy_umem(&u);
+	return ok;
+}
+
+int main(void)
+{
+	struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+
+	if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+		fprintf(stderr, "ERROR: setrlimit(RLIMIT_MEMLOCK) \"%s\"\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	silence_libbpf_logging();
+
+	if (!test_single(XSK_UMEM__DEFAULT_FRAME_SIZE, 0) ||
+	    !test_single(UNALIGNED_FRAME_SIZE, XDP_UMEM_UNALIGNED_CHUNK_FLAG) ||
+	    !test_threads())
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
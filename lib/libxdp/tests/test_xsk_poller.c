@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+
+/* Check that the poller blocks on an idle socket until the timeout, and
+ * reports the Tx kicks and completions of a socket that is sending.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "test_utils.h"
+
+#include <xdp/libxdp.h>
+#include <xdp/xsk.h>
+
+#define NUM_FRAMES 64
+#define PKT_LEN 64
+#define IDLE_TIMEOUT_MS 100
+#define TIMEOUT_SEC 5
+
+static const unsigned char pkt_data[PKT_LEN] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* broadcast */
+	0x02, 0x00, 0x00, 0x00, 0x00, 0x01,
+	0x88, 0xb5, /* local experimental ethertype */
+};
+
+static __u64 now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+int main(int argc, char **argv)
+{
+	struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+	struct xsk_socket_config cfg = {
+		.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+		.libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD,
+		.bind_flags = XDP_USE_NEED_WAKEUP | XDP_COPY,
+	};
+	struct xsk_poller *poller = NULL;
+	struct xsk_ring_prod fill, txr;
+	struct xsk_ring_cons comp, rx;
+	struct xsk_socket *xsk = NULL;
+	struct xsk_umem *umem = NULL;
+	struct xsk_poll_event ev;
+	__u32 completed = 0, idx, i;
+	int ret = EXIT_FAILURE;
+	void *area = NULL;
+	time_t deadline;
+	__u64 start;
+	int n, err;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <ifname>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+		fprintf(stderr, "ERROR: setrlimit(RLIMIT_MEMLOCK) \"%s\"\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	silence_libbpf_logging();
+
+	if (posix_memalign(&area, getpagesize(),
+			   NUM_FRAMES * XSK_UMEM__DEFAULT_FRAME_SIZE))
+		return EXIT_FAILURE;
+
+	err = xsk_umem__create(&umem, area, NUM_FRAMES * XSK_UMEM__DEFAULT_FRAME_SIZE,
+			       &fill, &comp, NULL);
+	if (err) {
+		fprintf(stderr, "Failed to create UMEM: %s\n", strerror(-err));
+		goto out;
+	}
+
+	err = xsk_socket__create(&xsk, argv[1], 0, umem, &rx, &txr, &cfg);
+	if (err) {
+		fprintf(stderr, "Failed to create socket on %s: %s\n", argv[1],
+			strerror(-err));
+		goto out;
+	}
+
+	err = xsk_poller__create(&poller, NULL);
+	err = err ?: xsk_poller__add(poller, xsk, &rx);
+	if (err) {
+		fprintf(stderr, "Failed to set up poller: %s\n", strerror(-err));
+		goto out;
+	}
+
+	/* Nothing is received or sent, so the poller has to block */
+	start = now_ms();
+	n = xsk_poller__wait(poller, &ev, 1, IDLE_TIMEOUT_MS);
+	if (n || now_ms() - start < IDLE_TIMEOUT_MS / 2) {
+		fprintf(stderr, "Idle wait returned %d after %llu ms\n", n,
+			(unsigned long long)(now_ms() - start));
+		goto out;
+	}
+
+	if (xsk_ring_prod__reserve(&txr, NUM_FRAMES, &idx) != NUM_FRAMES) {
+		fprintf(stderr, "Failed to reserve Tx descriptors\n");
+		goto out;
+	}
+	for (i = 0; i < NUM_FRAMES; i++) {
+		struct xdp_desc *desc = xsk_ring_prod__tx_desc(&txr, idx + i);
+
+		desc->addr = i * XSK_UMEM__DEFAULT_FRAME_SIZE;
+		desc->len = PKT_LEN;
+		desc->options = 0;
+		memcpy(xsk_umem__get_data(area, desc->addr), pkt_data, PKT_LEN);
+	}
+	xsk_ring_prod__submit(&txr, NUM_FRAMES);
+
+	/* Copy mode always needs a kick to send, so that is reported first */
+	deadline = time(NULL) + TIMEOUT_SEC;
+	while (completed < NUM_FRAMES && time(NULL) < deadline) {
+		n = xsk_poller__wait(poller, &ev, 1, IDLE_TIMEOUT_MS);
+		if (n < 0) {
+			fprintf(stderr, "Wait failed: %s\n", strerror(-n));
+			goto out;
+		}
+		if (!n)
+			continue;
+
+		if (ev.xsk != xsk || ev.user_data != &rx) {
+			fprintf(stderr, "Event for an unknown socket\n");
+			goto out;
+		}
+		if (ev.flags & XSK_POLL_TX_KICK)
+			xsk_socket__wakeup_tx(xsk);
+		if (ev.comp_avail) {
+			i = xsk_ring_cons__peek(&comp, ev.comp_avail, &idx);
+			xsk_ring_cons__release(&comp, i);
+			completed += i;
+		}
+	}
+
+	if (completed != NUM_FRAMES) {
+		fprintf(stderr, "Got %u of %u completions\n", completed,
+			NUM_FRAMES);
+		goto out;
+	}
+
+	if (xsk_poller__remove(poller, xsk) ||
+	    xsk_poller__remove(poller, xsk) != -ENOENT) {
+		fprintf(stderr, "Removing the socket failed\n");
+		goto out;
+	}
+
+	ret = EXIT_SUCCESS;
+out:
+	xsk_poller__delete(poller);
+	xsk_socket__delete(xsk);
+	xsk_umem__delete(umem);
+	free(area);
+	return ret;
+}
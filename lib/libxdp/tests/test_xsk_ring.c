@@ -0,0 +1,259 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+
+/* Exercise the batched and multi-buffer ring accessors in xsk.h on rings
+ * that live in ordinary memory, with the producer and consumer pointers
+ * placed so that every batch wraps around the end of the ring at a
+ * different offset.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xdp/xsk.h>
+
+#define RING_SIZE 8
+#define ROUNDS (3 * RING_SIZE)
+
+struct test_ring {
+	__u32 producer;
+	__u32 consumer;
+	__u32 flags;
+};
+
+static void init_prod(struct xsk_ring_prod *r, struct test_ring *t,
+		      void *ring, __u32 start)
+{
+	t->producer = t->consumer = start;
+	r->mask = RING_SIZE - 1;
+	r->size = RING_SIZE;
+	r->producer = &t->producer;
+	r->consumer = &t->consumer;
+	r->flags = &t->flags;
+	r->ring = ring;
+	r->cached_prod = start;
+	r->cached_cons = start + RING_SIZE;
+}
+
+static void init_cons(struct xsk_ring_cons *r, struct test_ring *t,
+		      void *ring, __u32 start)
+{
+	t->producer = t->consumer = start;
+	r->mask = RING_SIZE - 1;
+	r->size = RING_SIZE;
+	r->producer = &t->producer;
+	r->consumer = &t->consumer;
+	r->flags = &t->flags;
+	r->ring = ring;
+	r->cached_prod = start;
+	r->cached_cons = start;
+}
+
+static bool test_addrs(__u32 start, __u32 nb)
+{
+	__u64 ring[RING_SIZE], in[RING_SIZE], out[RING_SIZE];
+	struct xsk_ring_prod fill;
+	struct xsk_ring_cons comp;
+	struct test_ring t;
+	__u32 idx, i;
+
+	init_prod(&fill, &t, ring, start);
+	for (i = 0; i < nb; i++)
+		in[i] = 0x1000 * (i + 1);
+
+	if (xsk_ring_prod__reserve(&fill, nb, &idx) != nb)
+		return false;
+	xsk_ring_prod__fill_addrs(&fill, idx, in, nb);
+	xsk_ring_prod__submit(&fill, nb);
+
+	for (i = 0; i < nb; i++)
+		if (*xsk_ring_prod__fill_addr(&fill, start + i) != in[i])
+			return false;
+
+	/* Read the same memory back through a consumer ring */
+	init_cons(&comp, &t, ring, start);
+	t.producer = start + nb;
+	if (xsk_ring_cons__peek(&comp, nb, &idx) != nb)
+		return false;
+	xsk_ring_cons__comp_addrs(&comp, idx, out, nb);
+	xsk_ring_cons__release(&comp, nb);
+
+	return !memcmp(in, out, nb * sizeof(*in)) && t.consumer == start + nb;
+}
+
+static bool test_descs(__u32 start, __u32 nb)
+{
+	struct xdp_desc ring[RING_SIZE], in[RING_SIZE], out[RING_SIZE];
+	struct xsk_ring_prod tx;
+	struct xsk_ring_cons rx;
+	struct test_ring t;
+	__u32 idx, i;
+
+	memset(in, 0, sizeof(in));
+	init_prod(&tx, &t, ring, start);
+	for (i = 0; i < nb; i++) {
+		in[i].addr = 0x1000 * (i + 1);
+		in[i].len = 60 + i;
+	}
+
+	if (xsk_ring_prod__reserve(&tx, nb, &idx) != nb)
+		return false;
+	xsk_ring_prod__tx_descs(&tx, idx, in, nb);
+	xsk_ring_prod__submit(&tx, nb);
+
+	for (i = 0; i < nb; i++)
+		if (xsk_ring_prod__tx_desc(&tx, start + i)->addr != in[i].addr)
+			return false;
+
+	init_cons(&rx, &t, ring, start);
+	t.producer = start + nb;
+	if (xsk_ring_cons__peek(&rx, nb, &idx) != nb)
+		return false;
+	xsk_ring_cons__rx_descs(&rx, idx, out, nb);
+	xsk_ring_cons__release(&rx, nb);
+
+	return !memcmp(in, out, nb * sizeof(*in));
+}
+
+static bool test_recycle(__u32 rx_start, __u32 fq_start, __u32 nb)
+{
+	struct xdp_desc rx_ring[RING_SIZE];
+	__u64 fq_ring[RING_SIZE];
+	struct test_ring trx, tfq;
+	struct xsk_ring_prod fill;
+	struct xsk_ring_cons rx;
+	__u32 i;
+
+	init_cons(&rx, &trx, rx_ring, rx_start);
+	init_prod(&fill, &tfq, fq_ring, fq_start);
+	memset(fq_ring, 0, sizeof(fq_ring));
+
+	for (i = 0; i < nb; i++) {
+		struct xdp_desc *d = &rx_ring[(rx_start + i) & (RING_SIZE - 1)];
+
+		d->addr = 0x1000 * (i + 1);
+		d->len = 64;
+	}
+	trx.producer = rx_start + nb;
+
+	/* Leave room for only part of the batch when it is a full ring */
+	if (nb == RING_SIZE) {
+		tfq.consumer = fq_start - 1;
+		fill.cached_cons = tfq.consumer + RING_SIZE;
+	}
+
+	i = xsk_ring_cons__recycle_rx(&rx, &fill, RING_SIZE);
+	if (i != (nb == RING_SIZE ? nb - 1 : nb))
+		return false;
+	nb = i;
+
+	if (trx.consumer != rx_start + nb || tfq.producer != fq_start + nb)
+		return false;
+
+	for (i = 0; i < nb; i++)
+		if (fq_ring[(fq_start + i) & (RING_SIZE - 1)] != 0x1000 * (i + 1))
+			return false;
+
+	return true;
+}
+
+/* Two chained packets of @nb and 1 buffers, written as Tx and read as Rx */
+static bool test_pkt(__u32 start, __u32 nb)
+{
+	struct xdp_desc ring[RING_SIZE], frags[RING_SIZE];
+	struct xsk_ring_prod tx;
+	struct xsk_ring_cons rx;
+	struct test_ring t;
+	__u32 idx, len, i;
+
+	if (nb == RING_SIZE)
+		nb--;
+
+	memset(ring, 0xff, sizeof(ring));
+	init_prod(&tx, &t, ring, start);
+	for (i = 0; i < nb; i++) {
+		frags[i].addr = 0x1000 * (i + 1);
+		frags[i].len = 100 + i;
+	}
+
+	if (xsk_ring_prod__reserve(&tx, nb + 1, &idx) != nb + 1)
+		return false;
+	xsk_ring_prod__tx_pkt(&tx, idx, frags, nb);
+	xsk_ring_prod__tx_pkt(&tx, idx + nb, frags, 1);
+	xsk_ring_prod__submit(&tx, nb + 1);
+
+	init_cons(&rx, &t, ring, start);
+	t.producer = start + nb + 1;
+	if (xsk_ring_cons__peek(&rx, RING_SIZE, &idx) != nb + 1)
+		return false;
+
+	/* A window that cuts the first packet short finds no packet */
+	if (xsk_ring_cons__rx_pkt(&rx, idx, nb - 1, &len))
+		return false;
+
+	if (xsk_ring_cons__rx_pkt(&rx, idx, nb + 1, &len) != nb ||
+	    len != nb * 100 + nb * (nb - 1) / 2)
+		return false;
+
+	for (i = 0; i < nb; i++) {
+		const struct xdp_desc *d = xsk_ring_cons__rx_desc(&rx, idx + i);
+
+		if (d->addr != frags[i].addr || d->len != frags[i].len)
+			return false;
+	}
+
+	if (xsk_ring_cons__rx_pkt(&rx, idx + nb, 1, &len) != 1 || len != 100)
+		return false;
+
+	xsk_ring_cons__release(&rx, nb + 1);
+	return true;
+}
+
+int main(void)
+{
+	__u32 start, start2, nb;
+	int failed = 0;
+
+	for (start = 0; start < ROUNDS; start++) {
+		for (nb = 1; nb <= RING_SIZE; nb++) {
+			if (!test_addrs(start, nb)) {
+				fprintf(stderr, "addr copy failed (start %u, nb %u)\n",
+					start, nb);
+				failed++;
+			}
+			if (!test_descs(start, nb)) {
+				fprintf(stderr, "desc copy failed (start %u, nb %u)\n",
+					start, nb);
+				failed++;
+			}
+			if (!test_pkt(start, nb)) {
+				fprintf(stderr, "packet chain failed (start %u, nb %u)\n",
+					start, nb);
+				failed++;
+			}
+			for (start2 = 0; start2 < RING_SIZE; start2++) {
+				if (!test_recycle(start, start2 + 1, nb)) {
+					fprintf(stderr, "recycle failed (rx %u, fq %u, nb %u)\n",
+						start, start2 + 1, nb);
+					failed++;
+				}
+			}
+		}
+	}
+
+	/* Wrap of the 32-bit ring indexes themselves */
+	if (!test_addrs(0xfffffffc, RING_SIZE) || !test_descs(0xfffffffc, RING_SIZE) ||
+	    !test_recycle(0xfffffffc, 0xfffffffe, 5) || !test_pkt(0xfffffffd, 6)) {
+		fprintf(stderr, "index wrap-around failed\n");
+		failed++;
+	}
+
+	if (failed) {
+		fprintf(stderr, "%d ring test(s) failed\n", failed);
+		return EXIT_FAILURE;
+	}
+
+	printf("All ring tests passed\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+
+/* Create socket groups on a multi-queue interface, with separate and with
+ * shared UMEMs, and check that every queue got a socket and its own rings.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "test_utils.h"
+
+#include <xdp/libxdp.h>
+#include <xdp/xsk.h>
+
+#define UMEM_SIZE (4096 * 4096)
+
+static bool check_group(const char *ifname, __u32 num_queues, __u32 flags)
+{
+	struct xsk_socket_config xsk_cfg = {
+		.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+		.libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD,
+	};
+	DECLARE_LIBXDP_OPTS(xsk_socket_group_opts, opts,
+			    .num_queues = num_queues,
+			    .flags = flags,
+			    .umem_size = UMEM_SIZE,
+			    .socket_config = &xsk_cfg);
+	const struct xsk_queue_info *first, *info;
+	struct xsk_socket_group *group;
+	bool shared = flags & XSK_SOCKET_GROUP_F_SHARED_UMEM;
+	bool ok = false;
+	__u32 i;
+	int err;
+
+	err = xsk_socket_group__create(&group, ifname, &opts);
+	if (err) {
+		fprintf(stderr, "Failed to create socket group on %s: %s\n",
+			ifname, strerror(-err));
+		return false;
+	}
+
+	if (xsk_socket_group__num_queues(group) != num_queues) {
+		fprintf(stderr, "Group has %u queues, expected %u\n",
+			xsk_socket_group__num_queues(group), num_queues);
+		goto out;
+	}
+
+	first = xsk_socket_group__queue(group, 0);
+	for (i = 0; i < num_queues; i++) {
+		info = xsk_socket_group__queue(group, i);
+		if (!info || info->queue_id != i || !info->xsk || !info->rx ||
+		    !info->tx || !info->fill || !info->comp) {
+			fprintf(stderr, "Queue %u not set up\n", i);
+			goto out;
+		}
+
+		if (i && (info->fill == first->fill ||
+			  (info->umem == first->umem) != shared ||
+			  info->frame_base != (shared ? i * (__u64)UMEM_SIZE : 0))) {
+			fprintf(stderr, "Queue %u has wrong UMEM setup\n", i);
+			goto out;
+		}
+	}
+
+	if (xsk_socket_group__queue(group, num_queues)) {
+		fprintf(stderr, "Got a queue past the end of the group\n");
+		goto out;
+	}
+
+	ok = true;
+out:
+	xsk_socket_group__delete(group);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+	__u32 num_queues;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <ifname> <num_queues>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	num_queues = atoi(argv[2]);
+
+	if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+		fprintf(stderr, "ERROR: setrlimit(RLIMIT_MEMLOCK) \"%s\"\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	silence_libbpf_logging();
+
+	if (!check_group(argv[1], num_queues, 0) ||
+	    !check_group(argv[1], num_queues, XSK_SOCKET_GROUP_F_SHARED_UMEM) ||
+	    !check_group(argv[1], 1, 0))
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+
+/* Check that xsk_socket__get_stats() reports the ring occupancy seen by the
+ * kernel: entries only become visible once they are submitted or released.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "test_utils.h"
+
+#include <xdp/libxdp.h>
+#include <xdp/xsk.h>
+
+#define NUM_FRAMES 4096
+#define NUM_FILL 1000
+
+static bool check_stats(struct xsk_socket *xsk, __u32 fill_used)
+{
+	struct xsk_socket_stats stats;
+	int err;
+
+	err = xsk_socket__get_stats(xsk, &stats);
+	if (err) {
+		fprintf(stderr, "Failed to get socket stats: %s\n", strerror(-err));
+		return false;
+	}
+
+	if (stats.fill_ring_used != fill_used || stats.rx_ring_used ||
+	    stats.tx_ring_used || stats.comp_ring_used) {
+		fprintf(stderr, "Rings hold fill %u rx %u tx %u comp %u, expected fill %u only\n",
+			stats.fill_ring_used, stats.rx_ring_used,
+			stats.tx_ring_used, stats.comp_ring_used, fill_used);
+		return false;
+	}
+
+	if (stats.rx_dropped || stats.rx_invalid_descs || stats.tx_invalid_descs) {
+		fprintf(stderr, "Unexpected drops on an idle socket\n");
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+	struct xsk_socket_config cfg = {
+		.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+		.libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD,
+	};
+	struct xsk_ring_prod fill, tx;
+	struct xsk_ring_cons comp, rx;
+	struct xsk_socket *xsk = NULL;
+	struct xsk_umem *umem = NULL;
+	int ret = EXIT_FAILURE;
+	void *area = NULL;
+	__u32 idx, i;
+	int err;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <ifname>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+		fprintf(stderr, "ERROR: setrlimit(RLIMIT_MEMLOCK) \"%s\"\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	silence_libbpf_logging();
+
+	if (posix_memalign(&area, getpagesize(),
+			   NUM_FRAMES * XSK_UMEM__DEFAULT_FRAME_SIZE))
+		return EXIT_FAILURE;
+
+	err = xsk_umem__create(&umem, area, NUM_FRAMES * XSK_UMEM__DEFAULT_FRAME_SIZE,
+			       &fill, &comp, NULL);
+	if (err) {
+		fprintf(stderr, "Failed to create UMEM: %s\n", strerror(-err));
+		goto out;
+	}
+
+	err = xsk_socket__create(&xsk, argv[1], 0, umem, &rx, &tx, &cfg);
+	if (err) {
+		fprintf(stderr, "Failed to create socket on %s: %s\n", argv[1],
+			strerror(-err));
+		goto out;
+	}
+
+	if (!check_stats(xsk, 0))
+		goto out;
+
+	if (xsk_ring_prod__reserve(&fill, NUM_FILL, &idx) != NUM_FILL)
+		goto out;
+	for (i = 0; i < NUM_FILL; i++)
+		*xsk_ring_prod__fill_addr(&fill, idx + i) =
+			(__u64)i * XSK_UMEM__DEFAULT_FRAME_SIZE;
+
+	/* Reserved but not yet submitted entries are not in the ring yet */
+	if (!check_stats(xsk, 0))
+		goto out;
+
+	xsk_ring_prod__submit(&fill, NUM_FILL);
+	if (!check_stats(xsk, NUM_FILL))
+		goto out;
+
+	ret = EXIT_SUCCESS;
+out:
+	xsk_socket__delete(xsk);
+	xsk_umem__delete(umem);
+	free(area);
+	return ret;
+}
@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+
+/* Check that the Tx helper gets every packet sent and every frame back into
+ * the frame pool, with the kernel only kicked through its batching and a
+ * final flush.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "test_utils.h"
+
+#include <xdp/libxdp.h>
+#include <xdp/xsk.h>
+
+#define NUM_FRAMES 1024
+#define NUM_PKTS 20000
+#define BATCH 32
+#define PKT_LEN 64
+#define TIMEOUT_SEC 5
+
+static const unsigned char pkt_data[PKT_LEN] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, /* broadcast */
+	0x02, 0x00, 0x00, 0x00, 0x00, 0x01,
+	0x88, 0xb5, /* local experimental ethertype */
+};
+
+int main(int argc, char **argv)
+{
+	struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+	struct xsk_socket_config cfg = {
+		.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+		.libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD,
+		.bind_flags = XDP_USE_NEED_WAKEUP | XDP_COPY,
+	};
+	struct xsk_frame_cache *cache = NULL;
+	struct xsk_frame_pool *pool = NULL;
+	struct xdp_desc descs[BATCH];
+	struct xsk_ring_prod fill, txr;
+	struct xsk_ring_cons comp, rx;
+	struct xsk_socket *xsk = NULL;
+	struct xsk_umem *umem = NULL;
+	struct xsk_tx *tx = NULL;
+	__u32 sent = 0, n, i;
+	int ret = EXIT_FAILURE;
+	__u64 addrs[BATCH];
+	void *area = NULL;
+	time_t deadline;
+	int err;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <ifname>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+		fprintf(stderr, "ERROR: setrlimit(RLIMIT_MEMLOCK) \"%s\"\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	silence_libbpf_logging();
+
+	if (posix_memalign(&area, getpagesize(),
+			   NUM_FRAMES * XSK_UMEM__DEFAULT_FRAME_SIZE))
+		return EXIT_FAILURE;
+
+	err = xsk_umem__create(&umem, area, NUM_FRAMES * XSK_UMEM__DEFAULT_FRAME_SIZE,
+			       &fill, &comp, NULL);
+	if (err) {
+		fprintf(stderr, "Failed to create UMEM: %s\n", strerror(-err));
+		goto out;
+	}
+
+	err = xsk_socket__create(&xsk, argv[1], 0, umem, &rx, &txr, &cfg);
+	if (err) {
+		fprintf(stderr, "Failed to create socket on %s: %s\n", argv[1],
+			strerror(-err));
+		goto out;
+	}
+
+	err = xsk_frame_pool__create(&pool, umem, 0);
+	err = err ?: xsk_frame_cache__create(&cache, pool);
+	err = err ?: xsk_tx__create(&tx, xsk, cache, NULL);
+	if (err) {
+		fprintf(stderr, "Failed to set up Tx helper: %s\n", strerror(-err));
+		goto out;
+	}
+
+	/* Far more packets than frames, so they have to be reaped to go on */
+	deadline = time(NULL) + TIMEOUT_SEC;
+	while (sent < NUM_PKTS && time(NULL) < deadline) {
+		n = NUM_PKTS - sent < BATCH ? NUM_PKTS - sent : BATCH;
+		n = xsk_tx__alloc(tx, addrs, n);
+		for (i = 0; i < n; i++) {
+			memcpy(xsk_umem__get_data(area, addrs[i]), pkt_data,
+			       PKT_LEN);
+			descs[i].addr = addrs[i];
+			descs[i].len = PKT_LEN;
+			descs[i].options = 0;
+		}
+
+		i = xsk_tx__send(tx, descs, n);
+		xsk_frame_cache__free(cache, addrs + i, n - i);
+		sent += i;
+		if (!n)
+			xsk_tx__flush(tx);
+	}
+
+	while (xsk_tx__outstanding(tx) && time(NULL) < deadline)
+		xsk_tx__flush(tx);
+
+	if (sent != NUM_PKTS || xsk_tx__outstanding(tx)) {
+		fprintf(stderr, "Sent %u of %u packets, %u not completed\n",
+			sent, NUM_PKTS, xsk_tx__outstanding(tx));
+		goto out;
+	}
+
+	xsk_frame_cache__delete(cache);
+	cache = NULL;
+	if (xsk_frame_pool__num_free(pool) != NUM_FRAMES) {
+		fprintf(stderr, "Pool holds %u frames after sending, expected %u\n",
+			xsk_frame_pool__num_free(pool), NUM_FRAMES);
+		goto out;
+	}
+
+	ret = EXIT_SUCCESS;
+out:
+	xsk_tx__delete(tx);
+	xsk_frame_cache__delete(cache);
+	xsk_frame_pool__delete(pool);
+	xsk_socket__delete(xsk);
+	xsk_umem__delete(umem);
+	free(area);
+	return ret;
+}
@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+
+/* Check that a UMEM exported to another process maps the same memory there,
+ * and that the importer can bind its own socket to the UMEM on another queue.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "test_utils.h"
+
+#include <xdp/libxdp.h>
+#include <xdp/xsk.h>
+
+#define NUM_FRAMES 1024
+#define UMEM_SIZE (NUM_FRAMES * XSK_UMEM__DEFAULT_FRAME_SIZE)
+
+static const struct xsk_socket_config cfg = {
+	.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+	.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+	.libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD,
+	.bind_flags = XDP_COPY,
+};
+
+static int run_importer(int sock, const char *ifname)
+{
+	struct xsk_ring_prod fill, tx;
+	struct xsk_ring_cons comp, rx;
+	struct xsk_socket *xsk = NULL;
+	struct xsk_umem *umem = NULL;
+	int ret = EXIT_FAILURE;
+	__u64 size = 0;
+	char *area;
+	int err;
+
+	err = xsk_umem__import(&umem, (void **)&area, &size, sock);
+	if (err) {
+		fprintf(stderr, "Failed to import UMEM: %s\n", strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	if (size != UMEM_SIZE || strcmp(area, "exported")) {
+		fprintf(stderr, "Imported UMEM of %llu bytes doesn't match\n",
+			(unsigned long long)size);
+		goto out;
+	}
+
+	err = xsk_socket__create_shared(&xsk, ifname, 1, umem, &rx, &tx, &fill,
+					&comp, &cfg);
+	if (err) {
+		fprintf(stderr, "Failed to bind to the imported UMEM: %s\n",
+			strerror(-err));
+		goto out;
+	}
+
+	strcpy(area + XSK_UMEM__DEFAULT_FRAME_SIZE, "imported");
+	ret = EXIT_SUCCESS;
+out:
+	xsk_socket__delete(xsk);
+	xsk_umem__delete(umem);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+	struct xsk_ring_prod fill, tx;
+	struct xsk_ring_cons comp, rx;
+	struct xsk_socket *xsk = NULL;
+	struct xsk_umem *umem = NULL;
+	int socks[2] = { -1, -1 };
+	int ret = EXIT_FAILURE;
+	int err, status;
+	char *area;
+	pid_t pid;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <ifname>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (setrlimit(RLIMIT_MEMLOCK, &r)) {
+		fprintf(stderr, "ERROR: setrlimit(RLIMIT_MEMLOCK) \"%s\"\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	silence_libbpf_logging();
+
+	err = xsk_umem__create_shareable(&umem, (void **)&area, UMEM_SIZE,
+					 &fill, &comp, NULL);
+	if (err) {
+		fprintf(stderr, "Failed to create UMEM: %s\n", strerror(-err));
+		goto out;
+	}
+	strcpy(area, "exported");
+
+	/* Others can only share the UMEM once its own socket is bound */
+	err = xsk_socket__create(&xsk, argv[1], 0, umem, &rx, &tx, &cfg);
+	if (err) {
+		fprintf(stderr, "Failed to create socket on %s: %s\n", argv[1],
+			strerror(-err));
+		goto out;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, socks)) {
+		fprintf(stderr, "socketpair: %s\n", strerror(errno));
+		goto out;
+	}
+
+	pid = fork();
+	if (pid < 0)
+		goto out;
+	if (!pid) {
+		close(socks[0]);
+		exit(run_importer(socks[1], argv[1]));
+	}
+	close(socks[1]);
+	socks[1] = -1;
+
+	err = xsk_umem__export(umem, socks[0]);
+	if (err) {
+		fprintf(stderr, "Failed to export UMEM: %s\n", strerror(-err));
+		kill(pid, SIGKILL);
+	}
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) || err)
+		goto out;
+
+	if (strcmp(area + XSK_UMEM__DEFAULT_FRAME_SIZE, "imported")) {
+		fprintf(stderr, "Importer's write is not visible in the UMEM\n");
+		goto out;
+	}
+
+	ret = EXIT_SUCCESS;
+out:
+	if (socks[0] >= 0)
+		close(socks[0]);
+	if (socks[1] >= 0)
+		close(socks[1]);
+	xsk_socket__delete(xsk);
+	xsk_umem__delete(umem);
+	return ret;
+}
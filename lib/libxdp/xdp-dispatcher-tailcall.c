@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Dispatcher for kernels without freplace support: instead of calling a stub
+ * function that each component program replaces, it tail calls the programs
+ * through the program array map, so adding a program to a slot is just a map
+ * update. Component programs carry on to the next slot themselves, see
+ * xdp_tail_call_return() in xdp_helpers.h.
+ */
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#define XDP_USE_TAIL_CALLS
+#include <xdp/xdp_helpers.h>
+#include <xdp/prog_dispatcher.h>
+
+/* Only read back by libxdp; the chain call actions the programs act on are in
+ * the xdp_disp_chain map. See xdp-dispatcher.c.in for the 'const volatile'.
+ */
+static volatile const struct xdp_dispatcher_config conf = {};
+
+SEC("xdp")
+int xdp_dispatcher(struct xdp_md *ctx)
+{
+        __u32 key = 0, *slot;
+
+        if (!conf.num_progs_enabled)
+                return XDP_PASS;
+
+        slot = bpf_map_lookup_elem(&xdp_disp_slot, &key);
+        if (!slot)
+                return XDP_PASS;
+
+        return xdp_tail_call_from(ctx, slot, 0, XDP_PASS);
+}
+
+char _license[] SEC("license") = "GPL";
+__uint(dispatcher_version, XDP_DISPATCHER_VERSION) SEC(XDP_METADATA_SECTION);
@@ -9,6 +9,7 @@
  */
 
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -24,12 +25,16 @@
 #include <linux/if_packet.h>
 #include <linux/if_xdp.h>
 #include <linux/list.h>
+#include <linux/netdev.h>
 #include <linux/sockios.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <xdp/xsk.h>
 
 #include "libxdp_internal.h"
@@ -52,18 +57,90 @@
  #define SO_NETNS_COOKIE 71
 #endif
 
+#ifndef SO_BUSY_POLL
+ #define SO_BUSY_POLL 46
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+ #define SO_PREFER_BUSY_POLL 69
+#endif
+
+#ifndef SO_BUSY_POLL_BUDGET
+ #define SO_BUSY_POLL_BUDGET 70
+#endif
+
+#ifndef MAP_HUGE_SHIFT
+ #define MAP_HUGE_SHIFT 26
+#endif
+
+#ifndef MAP_HUGE_2MB
+ #define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+#ifndef MAP_HUGE_1GB
+ #define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#ifndef MPOL_PREFERRED
+ #define MPOL_PREFERRED 1
+#endif
+
+#ifndef MFD_CLOEXEC
+ #define MFD_CLOEXEC 0x0001U
+#endif
+
 #define INIT_NS 1
 
+/* Frames moved per step when a frame cache drives the fill or comp ring */
+#define XSK_FRAME_CACHE__BATCH 64
+
 struct xsk_umem {
 	struct xsk_ring_prod *fill_save;
 	struct xsk_ring_cons *comp_save;
 	char *umem_area;
+	__u64 size;
+	__u64 area_map_size;
 	struct xsk_umem_config config;
 	int fd;
+	int area_fd;
 	int refcount;
 	struct list_head ctx_list;
 	bool rx_ring_setup_done;
 	bool tx_ring_setup_done;
+	bool imported;
+};
+
+/* Sent along with the UMEM socket and the memfd of its area by
+ * xsk_umem__export()
+ */
+#define XSK_UMEM_EXPORT_MAGIC 0x78736b75
+
+struct xsk_umem_export_msg {
+	__u32 magic;
+	__u32 pad;
+	__u64 size;
+	struct xsk_umem_config config;
+};
+
+/* The pool owns a stack of free frame addresses covering the whole UMEM.
+ * Threads never touch it per frame: each has a private LIFO cache that is
+ * refilled from, and flushed to, the shared stack in half-cache batches,
+ * so the lock is only taken once per cache_size / 2 frames.
+ */
+struct xsk_frame_pool {
+	__u64 *stack;
+	__u32 top;
+	__u32 num_frames;
+	__u32 frame_size;
+	__u32 cache_size;
+	bool unaligned;
+	bool lock;
+};
+
+struct xsk_frame_cache {
+	struct xsk_frame_pool *pool;
+	__u32 count;
+	__u64 addrs[];
 };
 
 struct xsk_ctx {
@@ -76,15 +153,34 @@ struct xsk_ctx {
 	__u64 netns_cookie;
 	int xsks_map_fd;
 	struct list_head list;
+	char ifname[IFNAMSIZ];
+};
+
+/* The default XDP program attached by libxdp and its maps, shared by all
+ * sockets of the process on one interface so that only the first of them
+ * has to look up, load or attach anything.
+ */
+struct xsk_prog_entry {
+	struct list_head list;
+	__u64 netns_cookie;
+	int ifindex;
+	int refcount;
+	__u32 xdp_flags;
+	bool rx_meta;
 	struct xdp_program *xdp_prog;
+	int xsks_map_fd;
 	int refcnt_map_fd;
-	char ifname[IFNAMSIZ];
 };
 
+/* Protects xsk_prog_list, see libxdp_lock() */
+static bool xsk_prog_lock;
+static LIST_HEAD(xsk_prog_list);
+
 struct xsk_socket {
 	struct xsk_ring_cons *rx;
 	struct xsk_ring_prod *tx;
 	struct xsk_ctx *ctx;
+	struct xsk_prog_entry *prog;
 	struct xsk_socket_config config;
 	int fd;
 };
@@ -182,7 +278,9 @@ static int xsk_set_xdp_socket_config(struct xsk_socket_config *cfg,
 		return 0;
 	}
 
-	if (usr_cfg->libbpf_flags & ~XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD)
+	if (usr_cfg->libbpf_flags & ~(XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD |
+				      XSK_LIBXDP_FLAGS__BUSY_POLL |
+				      XSK_LIBXDP_FLAGS__RX_METADATA))
 		return -EINVAL;
 
 	cfg->rx_size = usr_cfg->rx_size;
@@ -191,6 +289,39 @@ static int xsk_set_xdp_socket_config(struct xsk_socket_config *cfg,
 	cfg->xdp_flags = usr_cfg->xdp_flags;
 	cfg->bind_flags = usr_cfg->bind_flags;
 
+	/* The busy poll fields were added later, so callers built against an
+	 * older header may pass a shorter struct; only look at them when the
+	 * flag says they are there.
+	 */
+	if (usr_cfg->libxdp_flags & XSK_LIBXDP_FLAGS__BUSY_POLL) {
+		cfg->busy_poll_usecs = usr_cfg->busy_poll_usecs ?:
+			XSK_SOCKET__DEFAULT_BUSY_POLL_USECS;
+		cfg->busy_poll_budget = usr_cfg->busy_poll_budget ?:
+			XSK_SOCKET__DEFAULT_BUSY_POLL_BUDGET;
+	}
+
+	return 0;
+}
+
+/* Without SO_PREFER_BUSY_POLL the driver keeps taking interrupts and the
+ * busy poll loop in the syscalls mostly races with softirq processing.
+ */
+static int xsk_set_busy_poll(int fd, const struct xsk_socket_config *cfg)
+{
+	int val;
+
+	val = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof(val)))
+		return -errno;
+
+	val = cfg->busy_poll_usecs;
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)))
+		return -errno;
+
+	val = cfg->busy_poll_budget;
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &val, sizeof(val)))
+		return -errno;
+
 	return 0;
 }
 
@@ -331,6 +462,8 @@ int xsk_umem__create(struct xsk_umem **umem_ptr, void *umem_area,
 	}
 
 	umem->umem_area = umem_area;
+	umem->size = size;
+	umem->area_fd = -1;
 	INIT_LIST_HEAD(&umem->ctx_list);
 	xsk_set_umem_config(&umem->config, usr_config);
 
@@ -363,29 +496,287 @@ out_umem_alloc:
 	return err;
 }
 
-static int xsk_init_xsk_struct(struct xsk_socket *xsk, int ifindex)
+static int xsk_get_numa_node(const char *ifname)
 {
-	char ifname[IFNAMSIZ];
-	struct xsk_ctx *ctx;
-	char *interface;
+	char path[PATH_MAX];
+	int node = -1;
+	FILE *f;
+
+	if (!ifname ||
+	    try_snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+			 ifname))
+		return -1;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+
+	return node;
+}
 
-	ctx = calloc(1, sizeof(*ctx));
-	if (!ctx)
-		return -ENOMEM;
+/* Map an anonymous area of at least @size bytes, using the largest hugepage
+ * size that fits and falling back to normal pages (with a transparent
+ * hugepage hint) when no hugepages of the wanted size are reserved.
+ */
+static void *xsk_mmap_umem_area(__u64 size, __u64 *map_size)
+{
+	static const struct {
+		__u64 page_size;
+		int flags;
+	} hugepages[] = {
+		{ 1ULL << 30, MAP_HUGETLB | MAP_HUGE_1GB },
+		{ 1ULL << 21, MAP_HUGETLB | MAP_HUGE_2MB },
+	};
+	__u64 page_size, len;
+	void *area;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(hugepages); i++) {
+		page_size = hugepages[i].page_size;
+		if (size < page_size)
+			continue;
 
-	interface = if_indextoname(ifindex, &ifname[0]);
-	if (!interface) {
-		free(ctx);
+		len = (size + page_size - 1) & ~(page_size - 1);
+		area = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | hugepages[i].flags, -1, 0);
+		if (area != MAP_FAILED) {
+			pr_debug("Allocated %llu byte UMEM area using %llu kB pages\n",
+				 (unsigned long long)len,
+				 (unsigned long long)page_size / 1024);
+			*map_size = len;
+			return area;
+		}
+		pr_debug("Couldn't map UMEM with %llu kB pages: %s\n",
+			 (unsigned long long)page_size / 1024, strerror(errno));
+	}
+
+	page_size = getpagesize();
+	len = (size + page_size - 1) & ~(page_size - 1);
+	area = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED)
+		return NULL;
+
+	madvise(area, len, MADV_HUGEPAGE);
+	*map_size = len;
+	return area;
+}
+
+int xsk_umem__create_hugepage(struct xsk_umem **umem_ptr, void **umem_area,
+			      __u64 size, const char *ifname,
+			      struct xsk_ring_prod *fill,
+			      struct xsk_ring_cons *comp,
+			      const struct xsk_umem_config *usr_config)
+{
+	unsigned long nodemask[16] = {};
+	__u64 map_size;
+	void *area;
+	int node, err;
+
+	if (!umem_ptr || !umem_area || !fill || !comp)
+		return -EFAULT;
+	if (!size)
+		return -EINVAL;
+
+	area = xsk_mmap_umem_area(size, &map_size);
+	if (!area)
 		return -errno;
+
+	/* Nothing is faulted in until the kernel pins the area when the UMEM
+	 * is registered, so setting a preferred node here is enough to place
+	 * the pages close to the device.
+	 */
+	node = xsk_get_numa_node(ifname);
+	if (node >= 0 && node < (int)(sizeof(nodemask) * 8)) {
+		nodemask[node / (sizeof(nodemask[0]) * 8)] |=
+			1UL << (node % (sizeof(nodemask[0]) * 8));
+		if (syscall(__NR_mbind, area, map_size, MPOL_PREFERRED, nodemask,
+			    sizeof(nodemask) * 8, 0))
+			pr_debug("Couldn't bind UMEM area to NUMA node %d: %s\n",
+				 node, strerror(errno));
 	}
 
-	ctx->ifindex = ifindex;
-	memcpy(ctx->ifname, ifname, IFNAMSIZ -1);
-	ctx->ifname[IFNAMSIZ - 1] = 0;
+	err = xsk_umem__create(umem_ptr, area, size, fill, comp, usr_config);
+	if (err) {
+		munmap(area, map_size);
+		return err;
+	}
 
-	xsk->ctx = ctx;
+	(*umem_ptr)->area_map_size = map_size;
+	*umem_area = area;
+	return 0;
+}
+
+int xsk_umem__create_shareable(struct xsk_umem **umem_ptr, void **umem_area,
+			       __u64 size, struct xsk_ring_prod *fill,
+			       struct xsk_ring_cons *comp,
+			       const struct xsk_umem_config *usr_config)
+{
+	long pagesize = getpagesize();
+	__u64 map_size;
+	void *area;
+	int fd, err;
+
+	if (!umem_ptr || !umem_area || !fill || !comp)
+		return -EFAULT;
+	if (!size)
+		return -EINVAL;
+
+	map_size = (size + pagesize - 1) / pagesize * pagesize;
+	fd = syscall(__NR_memfd_create, "xsk_umem", MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, map_size)) {
+		err = -errno;
+		goto out_fd;
+	}
+
+	area = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (area == MAP_FAILED) {
+		err = -errno;
+		goto out_fd;
+	}
+
+	err = xsk_umem__create(umem_ptr, area, size, fill, comp, usr_config);
+	if (err) {
+		munmap(area, map_size);
+		goto out_fd;
+	}
+
+	(*umem_ptr)->area_map_size = map_size;
+	(*umem_ptr)->area_fd = fd;
+	*umem_area = area;
+	return 0;
+
+out_fd:
+	close(fd);
+	return err;
+}
+
+int xsk_umem__export(const struct xsk_umem *umem, int sock)
+{
+	char cbuf[CMSG_SPACE(2 * sizeof(int))] = {};
+	struct xsk_umem_export_msg msg = {};
+	struct iovec iov = {
+		.iov_base = &msg,
+		.iov_len = sizeof(msg),
+	};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	int fds[2];
+
+	if (!umem)
+		return -EFAULT;
+	/* Only the process that created the area hands it out */
+	if (umem->area_fd < 0 || umem->imported)
+		return -EINVAL;
+
+	msg.magic = XSK_UMEM_EXPORT_MAGIC;
+	msg.size = umem->size;
+	msg.config = umem->config;
+	fds[0] = umem->fd;
+	fds[1] = umem->area_fd;
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(sock, &mh, MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int xsk_umem__import(struct xsk_umem **umem_ptr, void **umem_area,
+		     __u64 *size, int sock)
+{
+	char cbuf[CMSG_SPACE(2 * sizeof(int))] = {};
+	struct xsk_umem_export_msg msg = {};
+	struct iovec iov = {
+		.iov_base = &msg,
+		.iov_len = sizeof(msg),
+	};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	long pagesize = getpagesize();
+	int fds[2] = { -1, -1 };
+	struct xsk_umem *umem;
+	struct cmsghdr *cmsg;
+	__u64 map_size;
+	ssize_t len;
+	void *area;
+	int err;
+
+	if (!umem_ptr || !umem_area)
+		return -EFAULT;
+
+	len = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+	if (len < 0)
+		return -errno;
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+	    cmsg->cmsg_type == SCM_RIGHTS &&
+	    cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	if (len != sizeof(msg) || msg.magic != XSK_UMEM_EXPORT_MAGIC ||
+	    (mh.msg_flags & MSG_CTRUNC) || fds[0] < 0 || fds[1] < 0) {
+		err = -EPROTO;
+		goto out_fds;
+	}
+
+	umem = calloc(1, sizeof(*umem));
+	if (!umem) {
+		err = -ENOMEM;
+		goto out_fds;
+	}
+
+	map_size = (msg.size + pagesize - 1) / pagesize * pagesize;
+	area = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[1],
+		    0);
+	if (area == MAP_FAILED) {
+		err = -errno;
+		free(umem);
+		goto out_fds;
+	}
 
+	umem->fd = fds[0];
+	umem->area_fd = fds[1];
+	umem->umem_area = area;
+	umem->size = msg.size;
+	umem->area_map_size = map_size;
+	umem->config = msg.config;
+	umem->imported = true;
+	INIT_LIST_HEAD(&umem->ctx_list);
+
+	*umem_ptr = umem;
+	*umem_area = area;
+	if (size)
+		*size = msg.size;
 	return 0;
+
+out_fds:
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	return err;
 }
 
 static enum xdp_attach_mode xsk_convert_xdp_flags(__u32 xdp_flags)
@@ -495,12 +886,6 @@ static int xsk_size_map(struct xdp_program *xdp_prog, char *ifname)
 	return 0;
 }
 
-static void xsk_delete_map_entry(int xsks_map_fd, __u32 queue_id)
-{
-	bpf_map_delete_elem(xsks_map_fd, &queue_id);
-	close(xsks_map_fd);
-}
-
 static int xsk_lookup_map_by_filter(int prog_fd,
 				    bool (*map_info_filter)(struct bpf_map_info *map_info))
 {
@@ -681,10 +1066,9 @@ static bool xsk_check_redirect_flags(void)
 	return detected;
 }
 
-static struct xdp_program *xsk_lookup_program(int ifindex)
+static struct xdp_program *xsk_lookup_program(int ifindex, const char *prog_name)
 {
 	const char *version_name = "xsk_prog_version";
-	const char *prog_name = "xsk_def_prog";
 	struct xdp_multiprog *multi_prog;
 	struct xdp_program *prog = NULL;
 	__u32 version;
@@ -784,34 +1168,38 @@ static int xsk_decr_prog_refcnt(int refcnt_map_fd)
 	return xsk_update_prog_refcnt(refcnt_map_fd, -1);
 }
 
-static int __xsk_setup_xdp_prog(struct xsk_socket *xsk, int *xsks_map_fd)
+/* Find or load and attach the default program on entry->ifindex, taking a
+ * reference on it, and look up its xsks_map.
+ */
+static int xsk_load_prog_entry(struct xsk_prog_entry *entry, char *ifname)
 {
 	const char *fallback_prog = "xsk_def_xdp_prog_5.3.o";
 	const char *default_prog = "xsk_def_xdp_prog.o";
-	struct xsk_ctx *ctx = xsk->ctx;
+	const char *meta_prog = "xsk_def_xdp_prog_meta.o";
 	const char *file_name = NULL;
 	bool attached = false;
 	int err;
 
-	ctx->xdp_prog = xsk_lookup_program(ctx->ifindex);
-	if (IS_ERR(ctx->xdp_prog))
-		return PTR_ERR(ctx->xdp_prog);
+	entry->xdp_prog = xsk_lookup_program(entry->ifindex, entry->rx_meta ?
+					     "xsk_def_prog_meta" : "xsk_def_prog");
+	if (IS_ERR(entry->xdp_prog))
+		return PTR_ERR(entry->xdp_prog);
 
-	ctx->refcnt_map_fd = -ENOENT;
+	entry->refcnt_map_fd = -ENOENT;
 
-	if (ctx->xdp_prog) {
+	if (entry->xdp_prog) {
 		int refcnt;
 
-		ctx->refcnt_map_fd = xsk_lookup_refcnt_map(xdp_program__fd(ctx->xdp_prog), NULL);
-		if (ctx->refcnt_map_fd == -ENOENT)
+		entry->refcnt_map_fd = xsk_lookup_refcnt_map(xdp_program__fd(entry->xdp_prog), NULL);
+		if (entry->refcnt_map_fd == -ENOENT)
 			goto map_lookup;
 
-		if (ctx->refcnt_map_fd < 0) {
-			err = ctx->refcnt_map_fd;
+		if (entry->refcnt_map_fd < 0) {
+			err = entry->refcnt_map_fd;
 			goto err_prog_load;
 		}
 
-		refcnt = xsk_incr_prog_refcnt(ctx->refcnt_map_fd);
+		refcnt = xsk_incr_prog_refcnt(entry->refcnt_map_fd);
 		if (refcnt < 0) {
 			err = refcnt;
 			pr_debug("Error occurred when incrementing xsk XDP prog refcount: %s\n",
@@ -821,69 +1209,175 @@ static int __xsk_setup_xdp_prog(struct xsk_socket *xsk, int *xsks_map_fd)
 
 		if (!refcnt) {
 			pr_warn("Current program is being detached, falling back on creating a new program\n");
-			close(ctx->refcnt_map_fd);
-			ctx->refcnt_map_fd = -ENOENT;
-			xdp_program__close(ctx->xdp_prog);
-			ctx->xdp_prog = NULL;
+			close(entry->refcnt_map_fd);
+			entry->refcnt_map_fd = -ENOENT;
+			xdp_program__close(entry->xdp_prog);
+			entry->xdp_prog = NULL;
 		}
 	}
 
-	if (!ctx->xdp_prog) {
-		file_name = xsk_check_redirect_flags() ? default_prog : fallback_prog;
-		ctx->xdp_prog = xdp_program__find_file(file_name, NULL, NULL);
-		if (IS_ERR(ctx->xdp_prog))
-			return PTR_ERR(ctx->xdp_prog);
+	if (!entry->xdp_prog) {
+		if (!xsk_check_redirect_flags()) {
+			/* The metadata program relies on the XDP_PASS fallback
+			 * of bpf_redirect_map() as well
+			 */
+			if (entry->rx_meta)
+				return -EOPNOTSUPP;
+			file_name = fallback_prog;
+		} else {
+			file_name = entry->rx_meta ? meta_prog : default_prog;
+		}
+		entry->xdp_prog = xdp_program__find_file(file_name, NULL, NULL);
+		if (IS_ERR(entry->xdp_prog))
+			return PTR_ERR(entry->xdp_prog);
 
-		err = xsk_size_map(ctx->xdp_prog, ctx->ifname);
+		err = xsk_size_map(entry->xdp_prog, ifname);
 		if (err)
 			goto err_prog_load;
 
-		err = xdp_program__attach(ctx->xdp_prog, ctx->ifindex,
-					  xsk_convert_xdp_flags(xsk->config.xdp_flags), 0);
+		err = xdp_program__attach(entry->xdp_prog, entry->ifindex,
+					  xsk_convert_xdp_flags(entry->xdp_flags), 0);
 		if (err)
 			goto err_prog_load;
 
 		attached = true;
 	}
 
-	if (ctx->refcnt_map_fd < 0) {
-		ctx->refcnt_map_fd = xsk_lookup_refcnt_map(xdp_program__fd(ctx->xdp_prog),
-							   file_name);
-		if (ctx->refcnt_map_fd < 0 && ctx->refcnt_map_fd != -ENOENT) {
-			err = ctx->refcnt_map_fd;
+	if (entry->refcnt_map_fd < 0) {
+		entry->refcnt_map_fd = xsk_lookup_refcnt_map(xdp_program__fd(entry->xdp_prog),
+							     file_name);
+		if (entry->refcnt_map_fd < 0 && entry->refcnt_map_fd != -ENOENT) {
+			err = entry->refcnt_map_fd;
 			goto err_prog_load;
 		}
 	}
 map_lookup:
-	ctx->xsks_map_fd = xsk_lookup_bpf_map(xdp_program__fd(ctx->xdp_prog));
-	if (ctx->xsks_map_fd < 0) {
-		err = ctx->xsks_map_fd;
+	entry->xsks_map_fd = xsk_lookup_bpf_map(xdp_program__fd(entry->xdp_prog));
+	if (entry->xsks_map_fd < 0) {
+		err = entry->xsks_map_fd;
 		goto err_lookup;
 	}
 
-	if (xsk->rx) {
-		err = bpf_map_update_elem(ctx->xsks_map_fd, &ctx->queue_id, &xsk->fd, 0);
-		if (err)
-			goto err_lookup;
-	}
-	if (xsks_map_fd)
-		*xsks_map_fd = ctx->xsks_map_fd;
-
 	return 0;
 
 err_lookup:
 	if (attached)
-		xdp_program__detach(ctx->xdp_prog, ctx->ifindex,
-				    xsk_convert_xdp_flags(xsk->config.xdp_flags), 0);
+		xdp_program__detach(entry->xdp_prog, entry->ifindex,
+				    xsk_convert_xdp_flags(entry->xdp_flags), 0);
 err_prog_load:
-	if (ctx->refcnt_map_fd >= 0)
-		close(ctx->refcnt_map_fd);
-	ctx->refcnt_map_fd = -ENOENT;
-	xdp_program__close(ctx->xdp_prog);
-	ctx->xdp_prog = NULL;
+	if (entry->refcnt_map_fd >= 0)
+		close(entry->refcnt_map_fd);
+	entry->refcnt_map_fd = -ENOENT;
+	xdp_program__close(entry->xdp_prog);
+	entry->xdp_prog = NULL;
 	return err;
 }
 
+/* Drop the program reference taken by xsk_load_prog_entry() and detach the
+ * program if no other socket, in this process or another one, uses it.
+ */
+static void xsk_release_prog_entry(struct xsk_prog_entry *entry)
+{
+	int value;
+
+	if (entry->refcnt_map_fd < 0)
+		goto out;
+
+	value = xsk_decr_prog_refcnt(entry->refcnt_map_fd);
+	if (value < 0)
+		pr_warn("Error occurred when decrementing xsk XDP prog refcount: %s, please detach program yourself\n",
+			strerror(-value));
+	if (value)
+		goto out;
+
+	xdp_program__detach(entry->xdp_prog, entry->ifindex,
+			    xsk_convert_xdp_flags(entry->xdp_flags), 0);
+out:
+	if (entry->refcnt_map_fd >= 0)
+		close(entry->refcnt_map_fd);
+	close(entry->xsks_map_fd);
+	xdp_program__close(entry->xdp_prog);
+}
+
+static struct xsk_prog_entry *xsk_get_prog_entry(struct xsk_socket *xsk)
+{
+	struct xsk_ctx *ctx = xsk->ctx;
+	struct xsk_prog_entry *entry;
+	int err;
+
+	libxdp_lock(&xsk_prog_lock);
+	list_for_each_entry(entry, &xsk_prog_list, list) {
+		if (entry->netns_cookie == ctx->netns_cookie &&
+		    entry->ifindex == ctx->ifindex &&
+		    entry->rx_meta == !!(xsk->config.libxdp_flags &
+					 XSK_LIBXDP_FLAGS__RX_METADATA)) {
+			entry->refcount++;
+			goto out;
+		}
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		entry = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+
+	entry->netns_cookie = ctx->netns_cookie;
+	entry->ifindex = ctx->ifindex;
+	entry->xdp_flags = xsk->config.xdp_flags;
+	entry->rx_meta = xsk->config.libxdp_flags & XSK_LIBXDP_FLAGS__RX_METADATA;
+	entry->refcount = 1;
+
+	err = xsk_load_prog_entry(entry, ctx->ifname);
+	if (err) {
+		free(entry);
+		entry = ERR_PTR(err);
+		goto out;
+	}
+
+	list_add(&entry->list, &xsk_prog_list);
+out:
+	libxdp_unlock(&xsk_prog_lock);
+	return entry;
+}
+
+static void xsk_put_prog_entry(struct xsk_prog_entry *entry)
+{
+	/* Release under the lock, so a socket created concurrently on the
+	 * same interface can't pick up a program that is being detached.
+	 */
+	libxdp_lock(&xsk_prog_lock);
+	if (!--entry->refcount) {
+		list_del(&entry->list);
+		xsk_release_prog_entry(entry);
+		free(entry);
+	}
+	libxdp_unlock(&xsk_prog_lock);
+}
+
+static int __xsk_setup_xdp_prog(struct xsk_socket *xsk)
+{
+	struct xsk_ctx *ctx = xsk->ctx;
+	struct xsk_prog_entry *entry;
+	int err;
+
+	entry = xsk_get_prog_entry(xsk);
+	if (IS_ERR(entry))
+		return PTR_ERR(entry);
+
+	ctx->xsks_map_fd = entry->xsks_map_fd;
+	if (xsk->rx) {
+		err = bpf_map_update_elem(ctx->xsks_map_fd, &ctx->queue_id, &xsk->fd, 0);
+		if (err) {
+			xsk_put_prog_entry(entry);
+			return err;
+		}
+	}
+
+	xsk->prog = entry;
+	return 0;
+}
+
 static struct xsk_ctx *xsk_get_ctx(struct xsk_umem *umem, __u64 netns_cookie, int ifindex, __u32 queue_id)
 {
 	struct xsk_ctx *ctx;
@@ -966,12 +1460,6 @@ static struct xsk_ctx *xsk_create_ctx(struct xsk_socket *xsk,
 	return ctx;
 }
 
-static void xsk_destroy_xsk_struct(struct xsk_socket *xsk)
-{
-	free(xsk->ctx);
-	free(xsk);
-}
-
 int xsk_socket__update_xskmap(struct xsk_socket *xsk, int fd)
 {
 	struct xsk_ctx *ctx = xsk->ctx;
@@ -980,26 +1468,68 @@ int xsk_socket__update_xskmap(struct xsk_socket *xsk, int fd)
 	return bpf_map_update_elem(ctx->xsks_map_fd, &ctx->queue_id, &xsk->fd, 0);
 }
 
+/* The program set up here is left to the caller, who owns the returned
+ * map fd, so it does not go into the per-process program list.
+ */
 int xsk_setup_xdp_prog(int ifindex, int *xsks_map_fd)
 {
-	struct xsk_socket *xsk;
-	int res;
-
-	xsk = calloc(1, sizeof(*xsk));
-	if (!xsk)
-		return -ENOMEM;
+	struct xsk_prog_entry entry = { .ifindex = ifindex };
+	char ifname[IFNAMSIZ];
+	int err;
 
-	res = xsk_init_xsk_struct(xsk, ifindex);
-	if (res) {
-		free(xsk);
+	if (!if_indextoname(ifindex, ifname))
 		return -EINVAL;
-	}
 
-	res = __xsk_setup_xdp_prog(xsk, xsks_map_fd);
+	err = xsk_load_prog_entry(&entry, ifname);
+	if (err)
+		return err;
+
+	if (xsks_map_fd)
+		*xsks_map_fd = entry.xsks_map_fd;
+
+	return 0;
+}
+
+/* Unless XDP_COPY or XDP_ZEROCOPY is given, the kernel binds in zero-copy
+ * mode where the driver can set it up for the queue, and falls back to the
+ * much slower copy mode otherwise, without saying so. Tell when that happens,
+ * and why asking for zero-copy failed, from the features the interface
+ * reports; kernels that don't report them get no explanation.
+ */
+static void xsk_report_mode(int fd, int ifindex, __u32 queue_id, __u16 flags,
+			    int err)
+{
+	DECLARE_LIBXDP_OPTS(xdp_iface_features, feat);
+	struct xdp_options opts = {};
+	socklen_t optlen = sizeof(opts);
+	bool zc_support;
+
+	if ((flags & (XDP_COPY | XDP_SHARED_UMEM)) ||
+	    (err && !(flags & XDP_ZEROCOPY)))
+		return;
+
+	if (xdp_iface__get_features(ifindex, &feat))
+		return;
+	zc_support = feat.xdp_features & NETDEV_XDP_ACT_XSK_ZEROCOPY;
+
+	if (err) {
+		if (!zc_support)
+			pr_warn("Driver of ifindex %d has no zero-copy AF_XDP support\n",
+				ifindex);
+		return;
+	}
 
-	xsk_destroy_xsk_struct(xsk);
+	if ((flags & XDP_ZEROCOPY) ||
+	    getsockopt(fd, SOL_XDP, XDP_OPTIONS, &opts, &optlen) ||
+	    (opts.flags & XDP_OPTIONS_ZEROCOPY))
+		return;
 
-	return res;
+	if (zc_support)
+		pr_info("Driver of ifindex %d couldn't set up zero-copy on queue %u, "
+			"AF_XDP socket uses copy mode\n", ifindex, queue_id);
+	else
+		pr_info("Driver of ifindex %d has no zero-copy AF_XDP support, "
+			"socket uses copy mode\n", ifindex);
 }
 
 int xsk_socket__create_shared(struct xsk_socket **xsk_ptr,
@@ -1039,7 +1569,8 @@ int xsk_socket__create_shared(struct xsk_socket **xsk_ptr,
 		goto out_xsk_alloc;
 	}
 
-	if (umem->refcount++ > 0) {
+	/* The socket of an imported UMEM is bound in the exporting process */
+	if (umem->refcount++ > 0 || umem->imported) {
 		xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
 		if (xsk->fd < 0) {
 			err = -errno;
@@ -1155,21 +1686,33 @@ int xsk_socket__create_shared(struct xsk_socket **xsk_ptr,
 	sxdp.sxdp_family = PF_XDP;
 	sxdp.sxdp_ifindex = ctx->ifindex;
 	sxdp.sxdp_queue_id = ctx->queue_id;
-	if (umem->refcount > 1) {
+	if (umem->refcount > 1 || umem->imported) {
 		sxdp.sxdp_flags |= XDP_SHARED_UMEM;
 		sxdp.sxdp_shared_umem_fd = umem->fd;
 	} else {
 		sxdp.sxdp_flags = xsk->config.bind_flags;
 	}
 
+	if (xsk->config.libxdp_flags & XSK_LIBXDP_FLAGS__BUSY_POLL) {
+		err = xsk_set_busy_poll(xsk->fd, &xsk->config);
+		if (err) {
+			pr_warn("Failed to enable busy polling on AF_XDP socket: %s\n",
+				strerror(-err));
+			goto out_mmap_tx;
+		}
+	}
+
 	err = bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp));
 	if (err) {
 		err = -errno;
+		xsk_report_mode(xsk->fd, ctx->ifindex, ctx->queue_id,
+				sxdp.sxdp_flags, err);
 		goto out_mmap_tx;
 	}
+	xsk_report_mode(xsk->fd, ctx->ifindex, ctx->queue_id, sxdp.sxdp_flags, 0);
 
 	if (!(xsk->config.libbpf_flags & XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD)) {
-		err = __xsk_setup_xdp_prog(xsk, NULL);
+		err = __xsk_setup_xdp_prog(xsk);
 		if (err)
 			goto out_mmap_tx;
 	}
@@ -1191,7 +1734,7 @@ out_put_ctx:
 	unmap = umem->fill_save != fill;
 	xsk_put_ctx(ctx, unmap);
 out_socket:
-	if (--umem->refcount)
+	if (--umem->refcount || umem->imported)
 		close(xsk->fd);
 out_xsk_alloc:
 	free(xsk);
@@ -1211,12 +1754,95 @@ int xsk_socket__create(struct xsk_socket **xsk_ptr, const char *ifname,
 					 umem->comp_save, usr_config);
 }
 
-int xsk_umem__delete(struct xsk_umem *umem)
+static bool xsk_busy_poll(const struct xsk_socket *xsk)
 {
-	struct xdp_mmap_offsets off;
-	int err;
+	return xsk->config.libxdp_flags & XSK_LIBXDP_FLAGS__BUSY_POLL;
+}
 
-	if (!umem)
+/* These errors only mean the kernel could not make progress right now */
+static int xsk_wakeup_err(int err)
+{
+	if (err == EAGAIN || err == EBUSY || err == ENOBUFS || err == ENETDOWN)
+		return 0;
+
+	return -err;
+}
+
+int xsk_socket__wakeup_rx(struct xsk_socket *xsk)
+{
+	if (!xsk)
+		return -EINVAL;
+
+	if (!xsk_busy_poll(xsk) && !xsk_ring_prod__needs_wakeup(xsk->ctx->fill))
+		return 0;
+
+	if (recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL) < 0)
+		return xsk_wakeup_err(errno);
+
+	return 0;
+}
+
+int xsk_socket__wakeup_tx(struct xsk_socket *xsk)
+{
+	if (!xsk || !xsk->tx)
+		return -EINVAL;
+
+	if (!xsk_busy_poll(xsk) && !xsk_ring_prod__needs_wakeup(xsk->tx))
+		return 0;
+
+	if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0)
+		return xsk_wakeup_err(errno);
+
+	return 0;
+}
+
+static __u32 xsk_ring_used(const __u32 *producer, const __u32 *consumer)
+{
+	return __atomic_load_n(producer, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(consumer, __ATOMIC_ACQUIRE);
+}
+
+int xsk_socket__get_stats(const struct xsk_socket *xsk,
+			  struct xsk_socket_stats *stats)
+{
+	struct xdp_statistics xdp_stats = {};
+	socklen_t optlen = sizeof(xdp_stats);
+
+	if (!xsk || !stats)
+		return -EINVAL;
+
+	/* Kernels before 5.9 only fill in the first three counters */
+	if (getsockopt(xsk->fd, SOL_XDP, XDP_STATISTICS, &xdp_stats, &optlen))
+		return -errno;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->rx_dropped = xdp_stats.rx_dropped;
+	stats->rx_invalid_descs = xdp_stats.rx_invalid_descs;
+	stats->tx_invalid_descs = xdp_stats.tx_invalid_descs;
+	stats->rx_ring_full = xdp_stats.rx_ring_full;
+	stats->rx_fill_ring_empty_descs = xdp_stats.rx_fill_ring_empty_descs;
+	stats->tx_ring_empty_descs = xdp_stats.tx_ring_empty_descs;
+
+	if (xsk->rx)
+		stats->rx_ring_used = xsk_ring_used(xsk->rx->producer,
+						    xsk->rx->consumer);
+	if (xsk->tx)
+		stats->tx_ring_used = xsk_ring_used(xsk->tx->producer,
+						    xsk->tx->consumer);
+	stats->fill_ring_used = xsk_ring_used(xsk->ctx->fill->producer,
+					      xsk->ctx->fill->consumer);
+	stats->comp_ring_used = xsk_ring_used(xsk->ctx->comp->producer,
+					      xsk->ctx->comp->consumer);
+
+	return 0;
+}
+
+int xsk_umem__delete(struct xsk_umem *umem)
+{
+	struct xdp_mmap_offsets off;
+	int err;
+
+	if (!umem)
 		return 0;
 
 	if (umem->refcount)
@@ -1231,32 +1857,15 @@ int xsk_umem__delete(struct xsk_umem *umem)
 	}
 
 	close(umem->fd);
+	if (umem->area_map_size)
+		munmap(umem->umem_area, umem->area_map_size);
+	if (umem->area_fd >= 0)
+		close(umem->area_fd);
 	free(umem);
 
 	return 0;
 }
 
-static void xsk_release_xdp_prog(struct xsk_socket *xsk)
-{
-	struct xsk_ctx *ctx = xsk->ctx;
-	int value;
-
-	if (xsk->ctx->refcnt_map_fd < 0)
-		goto out;
-
-	value = xsk_decr_prog_refcnt(ctx->refcnt_map_fd);
-	if (value < 0)
-		pr_warn("Error occurred when decrementing xsk XDP prog refcount: %s, please detach program yourself\n",
-			strerror(-value));
-	if (value)
-		goto out;
-
-	xdp_program__detach(ctx->xdp_prog, ctx->ifindex,
-			    xsk_convert_xdp_flags(xsk->config.xdp_flags), 0);
-out:
-	xdp_program__close(ctx->xdp_prog);
-}
-
 void xsk_socket__delete(struct xsk_socket *xsk)
 {
 	size_t desc_sz = sizeof(struct xdp_desc);
@@ -1270,9 +1879,9 @@ void xsk_socket__delete(struct xsk_socket *xsk)
 
 	ctx = xsk->ctx;
 	umem = ctx->umem;
-	if (ctx->xdp_prog) {
-		xsk_delete_map_entry(ctx->xsks_map_fd, ctx->queue_id);
-		xsk_release_xdp_prog(xsk);
+	if (xsk->prog) {
+		bpf_map_delete_elem(ctx->xsks_map_fd, &ctx->queue_id);
+		xsk_put_prog_entry(xsk->prog);
 	}
 
 	err = xsk_get_mmap_offsets(xsk->fd, &off);
@@ -1297,3 +1906,846 @@ void xsk_socket__delete(struct xsk_socket *xsk)
 		close(xsk->fd);
 	free(xsk);
 }
+
+static void xsk_frame_pool_lock(struct xsk_frame_pool *pool)
+{
+	while (__atomic_test_and_set(&pool->lock, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&pool->lock, __ATOMIC_RELAXED))
+			;
+}
+
+static void xsk_frame_pool_unlock(struct xsk_frame_pool *pool)
+{
+	__atomic_clear(&pool->lock, __ATOMIC_RELEASE);
+}
+
+static __u32 xsk_frame_pool_get(struct xsk_frame_pool *pool, __u64 *addrs,
+				__u32 nb)
+{
+	xsk_frame_pool_lock(pool);
+	if (nb > pool->top)
+		nb = pool->top;
+	pool->top -= nb;
+	memcpy(addrs, &pool->stack[pool->top], nb * sizeof(*addrs));
+	xsk_frame_pool_unlock(pool);
+
+	return nb;
+}
+
+static void xsk_frame_pool_put(struct xsk_frame_pool *pool,
+			       const __u64 *addrs, __u32 nb)
+{
+	xsk_frame_pool_lock(pool);
+	if (nb > pool->num_frames - pool->top) {
+		/* Only possible if frames were freed twice */
+		pr_warn("Frame pool overflow, dropping %u frames\n",
+			nb - (pool->num_frames - pool->top));
+		nb = pool->num_frames - pool->top;
+	}
+	memcpy(&pool->stack[pool->top], addrs, nb * sizeof(*addrs));
+	pool->top += nb;
+	xsk_frame_pool_unlock(pool);
+}
+
+int xsk_frame_pool__create(struct xsk_frame_pool **pool_ptr,
+			   struct xsk_umem *umem, __u32 cache_size)
+{
+	struct xsk_frame_pool *pool;
+	__u64 num_frames, i;
+
+	if (!pool_ptr || !umem)
+		return -EFAULT;
+
+	if (!cache_size)
+		cache_size = XSK_FRAME_CACHE__DEFAULT_SIZE;
+	if (cache_size < 2)
+		return -EINVAL;
+
+	num_frames = umem->size / umem->config.frame_size;
+	if (!num_frames || num_frames > UINT32_MAX)
+		return -EINVAL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+
+	pool->stack = calloc(num_frames, sizeof(*pool->stack));
+	if (!pool->stack) {
+		free(pool);
+		return -ENOMEM;
+	}
+
+	pool->num_frames = num_frames;
+	pool->frame_size = umem->config.frame_size;
+	pool->cache_size = cache_size;
+	pool->unaligned = !!(umem->config.flags & XDP_UMEM_UNALIGNED_CHUNK_FLAG);
+
+	/* Hand out low addresses first */
+	for (i = 0; i < num_frames; i++)
+		pool->stack[i] = (num_frames - 1 - i) * pool->frame_size;
+	pool->top = num_frames;
+
+	*pool_ptr = pool;
+	return 0;
+}
+
+void xsk_frame_pool__delete(struct xsk_frame_pool *pool)
+{
+	if (!pool)
+		return;
+
+	free(pool->stack);
+	free(pool);
+}
+
+__u32 xsk_frame_pool__num_free(struct xsk_frame_pool *pool)
+{
+	return __atomic_load_n(&pool->top, __ATOMIC_RELAXED);
+}
+
+int xsk_frame_cache__create(struct xsk_frame_cache **cache_ptr,
+			    struct xsk_frame_pool *pool)
+{
+	struct xsk_frame_cache *cache;
+
+	if (!cache_ptr || !pool)
+		return -EFAULT;
+
+	cache = calloc(1, sizeof(*cache) + pool->cache_size * sizeof(__u64));
+	if (!cache)
+		return -ENOMEM;
+
+	cache->pool = pool;
+	*cache_ptr = cache;
+	return 0;
+}
+
+void xsk_frame_cache__delete(struct xsk_frame_cache *cache)
+{
+	if (!cache)
+		return;
+
+	xsk_frame_pool_put(cache->pool, cache->addrs, cache->count);
+	free(cache);
+}
+
+/* Turn a descriptor address (which may point past the headroom, and in
+ * unaligned mode carry an offset in the upper bits) back into the address
+ * of the frame it belongs to.
+ */
+static __u64 xsk_frame_cache_base_addr(const struct xsk_frame_pool *pool,
+				       __u64 addr)
+{
+	if (pool->unaligned) {
+		addr = xsk_umem__add_offset_to_addr(addr);
+		return addr - addr % pool->frame_size;
+	}
+
+	return addr & ~((__u64)pool->frame_size - 1);
+}
+
+__u32 xsk_frame_cache__alloc(struct xsk_frame_cache *cache, __u64 *addrs,
+			     __u32 nb)
+{
+	struct xsk_frame_pool *pool = cache->pool;
+
+	if (cache->count < nb) {
+		__u32 want = nb - cache->count + pool->cache_size / 2;
+
+		if (want > pool->cache_size - cache->count)
+			want = pool->cache_size - cache->count;
+		cache->count += xsk_frame_pool_get(pool,
+						   &cache->addrs[cache->count],
+						   want);
+	}
+
+	if (nb > cache->count)
+		nb = cache->count;
+
+	cache->count -= nb;
+	memcpy(addrs, &cache->addrs[cache->count], nb * sizeof(*addrs));
+
+	return nb;
+}
+
+void xsk_frame_cache__free(struct xsk_frame_cache *cache, const __u64 *addrs,
+			   __u32 nb)
+{
+	struct xsk_frame_pool *pool = cache->pool;
+	__u32 half = pool->cache_size / 2, i;
+
+	for (i = 0; i < nb; i++) {
+		if (cache->count == pool->cache_size) {
+			/* Give back the coldest half, keep the recently freed */
+			xsk_frame_pool_put(pool, cache->addrs, half);
+			cache->count -= half;
+			memmove(cache->addrs, &cache->addrs[half],
+				cache->count * sizeof(*cache->addrs));
+		}
+		cache->addrs[cache->count++] = xsk_frame_cache_base_addr(pool, addrs[i]);
+	}
+}
+
+__u32 xsk_frame_cache__fill(struct xsk_frame_cache *cache,
+			    struct xsk_ring_prod *fill, __u32 nb)
+{
+	__u64 addrs[XSK_FRAME_CACHE__BATCH];
+	__u32 done = 0, n, got, idx = 0;
+
+	n = xsk_prod_nb_free(fill, nb);
+	if (nb > n)
+		nb = n;
+
+	while (done < nb) {
+		n = nb - done;
+		if (n > XSK_FRAME_CACHE__BATCH)
+			n = XSK_FRAME_CACHE__BATCH;
+
+		got = xsk_frame_cache__alloc(cache, addrs, n);
+		if (!got)
+			break;
+
+		/* Cannot fail, the space was checked above */
+		xsk_ring_prod__reserve(fill, got, &idx);
+		xsk_ring_prod__fill_addrs(fill, idx, addrs, got);
+		xsk_ring_prod__submit(fill, got);
+		done += got;
+		if (got < n)
+			break;
+	}
+
+	return done;
+}
+
+__u32 xsk_frame_cache__complete(struct xsk_frame_cache *cache,
+				struct xsk_ring_cons *comp, __u32 nb)
+{
+	__u64 addrs[XSK_FRAME_CACHE__BATCH];
+	__u32 done = 0, n, idx;
+
+	while (done < nb) {
+		n = nb - done;
+		if (n > XSK_FRAME_CACHE__BATCH)
+			n = XSK_FRAME_CACHE__BATCH;
+
+		n = xsk_ring_cons__peek(comp, n, &idx);
+		if (!n)
+			break;
+
+		xsk_ring_cons__comp_addrs(comp, idx, addrs, n);
+		xsk_ring_cons__release(comp, n);
+		xsk_frame_cache__free(cache, addrs, n);
+		done += n;
+	}
+
+	return done;
+}
+
+struct xsk_tx {
+	struct xsk_socket *xsk;
+	struct xsk_ring_prod *ring;
+	struct xsk_ring_cons *comp;
+	struct xsk_frame_cache *cache;
+	__u64 budget_ns;
+	__u64 first_ns;		/* when the oldest unkicked descriptor was sent */
+	__u32 max_batch;
+	__u32 batch;
+	__u32 unkicked;
+	__u32 outstanding;
+	bool need_wakeup;
+};
+
+int xsk_tx__create(struct xsk_tx **tx_ptr, struct xsk_socket *xsk,
+		   struct xsk_frame_cache *cache,
+		   const struct xsk_tx_opts *opts)
+{
+	struct xsk_tx *tx;
+
+	if (!tx_ptr || !xsk || !cache)
+		return -EFAULT;
+	if (!OPTS_VALID(opts, xsk_tx_opts))
+		return -EINVAL;
+	if (!xsk->tx)
+		return -EINVAL;
+
+	tx = calloc(1, sizeof(*tx));
+	if (!tx)
+		return -ENOMEM;
+
+	tx->xsk = xsk;
+	tx->ring = xsk->tx;
+	tx->comp = xsk->ctx->comp;
+	tx->cache = cache;
+	tx->max_batch = OPTS_GET(opts, max_batch, 0) ?: XSK_TX__DEFAULT_MAX_BATCH;
+	tx->budget_ns = OPTS_GET(opts, budget_ns, 0) ?: XSK_TX__DEFAULT_BUDGET_NS;
+	tx->batch = tx->max_batch;
+	/* Without it, the kernel never asks for a wakeup and every kick counts */
+	tx->need_wakeup = xsk->config.bind_flags & XDP_USE_NEED_WAKEUP;
+
+	*tx_ptr = tx;
+	return 0;
+}
+
+void xsk_tx__delete(struct xsk_tx *tx)
+{
+	free(tx);
+}
+
+static __u64 xsk_tx_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int xsk_tx_kick(struct xsk_tx *tx)
+{
+	tx->unkicked = 0;
+
+	if (tx->need_wakeup && !xsk_busy_poll(tx->xsk) &&
+	    !xsk_ring_prod__needs_wakeup(tx->ring))
+		return 0;
+
+	if (sendto(tx->xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0)
+		return xsk_wakeup_err(errno);
+
+	return 0;
+}
+
+/* Only kick for a full batch, or once the oldest descriptor has waited out
+ * the budget, and size the next batch by which came first.
+ */
+static int xsk_tx_maybe_kick(struct xsk_tx *tx)
+{
+	if (tx->unkicked < tx->batch) {
+		if (xsk_tx_now() - tx->first_ns < tx->budget_ns)
+			return 0;
+		if (tx->batch > 1)
+			tx->batch /= 2;
+	} else if (tx->batch < tx->max_batch) {
+		tx->batch *= 2;
+		if (tx->batch > tx->max_batch)
+			tx->batch = tx->max_batch;
+	}
+
+	return xsk_tx_kick(tx);
+}
+
+static void xsk_tx_reap(struct xsk_tx *tx)
+{
+	__u32 n;
+
+	n = xsk_frame_cache__complete(tx->cache, tx->comp, tx->comp->size);
+	/* Sockets sharing the UMEM on the same queue share the comp ring */
+	tx->outstanding -= n < tx->outstanding ? n : tx->outstanding;
+}
+
+__u32 xsk_tx__alloc(struct xsk_tx *tx, __u64 *addrs, __u32 nb)
+{
+	__u32 got;
+
+	got = xsk_frame_cache__alloc(tx->cache, addrs, nb);
+	if (got == nb || !tx->outstanding)
+		return got;
+
+	xsk_tx_reap(tx);
+	got += xsk_frame_cache__alloc(tx->cache, addrs + got, nb - got);
+
+	/* The frames in flight only complete once the kernel sends them */
+	if (got < nb && tx->unkicked)
+		xsk_tx_kick(tx);
+
+	return got;
+}
+
+__u32 xsk_tx__send(struct xsk_tx *tx, const struct xdp_desc *descs, __u32 nb)
+{
+	__u32 idx, n;
+
+	n = xsk_prod_nb_free(tx->ring, nb);
+	if (n < nb && tx->unkicked) {
+		xsk_tx_kick(tx);
+		n = xsk_prod_nb_free(tx->ring, nb);
+	}
+	if (nb > n)
+		nb = n;
+	if (!nb)
+		return 0;
+
+	/* Cannot fail, the space was checked above */
+	xsk_ring_prod__reserve(tx->ring, nb, &idx);
+	xsk_ring_prod__tx_descs(tx->ring, idx, descs, nb);
+	xsk_ring_prod__submit(tx->ring, nb);
+
+	if (!tx->unkicked)
+		tx->first_ns = xsk_tx_now();
+	tx->unkicked += nb;
+	tx->outstanding += nb;
+
+	/* Transmission stalls once the kernel can't post completions */
+	if (tx->outstanding >= tx->comp->size / 2)
+		xsk_tx_reap(tx);
+
+	xsk_tx_maybe_kick(tx);
+	return nb;
+}
+
+int xsk_tx__flush(struct xsk_tx *tx)
+{
+	int err = 0;
+
+	if (tx->unkicked)
+		err = xsk_tx_kick(tx);
+	xsk_tx_reap(tx);
+
+	return err;
+}
+
+__u32 xsk_tx__outstanding(const struct xsk_tx *tx)
+{
+	return tx->outstanding;
+}
+
+struct xsk_poller_entry {
+	struct xsk_socket *xsk;
+	void *user_data;
+};
+
+struct xsk_poller {
+	struct xsk_poller_entry **entries;
+	__u32 num;
+	__u32 max;
+	__u64 spin_ns;
+	__u64 idle_since;	/* 0 while there are events */
+	int epfd;
+};
+
+int xsk_poller__create(struct xsk_poller **poller_ptr,
+		       const struct xsk_poller_opts *opts)
+{
+	struct xsk_poller *poller;
+
+	if (!poller_ptr)
+		return -EFAULT;
+	if (!OPTS_VALID(opts, xsk_poller_opts))
+		return -EINVAL;
+
+	poller = calloc(1, sizeof(*poller));
+	if (!poller)
+		return -ENOMEM;
+
+	poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (poller->epfd < 0) {
+		free(poller);
+		return -errno;
+	}
+
+	poller->spin_ns = (OPTS_GET(opts, spin_usecs, 0) ?:
+			   XSK_POLLER__DEFAULT_SPIN_USECS) * 1000ULL;
+	*poller_ptr = poller;
+	return 0;
+}
+
+void xsk_poller__delete(struct xsk_poller *poller)
+{
+	__u32 i;
+
+	if (!poller)
+		return;
+
+	for (i = 0; i < poller->num; i++)
+		free(poller->entries[i]);
+	free(poller->entries);
+	close(poller->epfd);
+	free(poller);
+}
+
+int xsk_poller__add(struct xsk_poller *poller, struct xsk_socket *xsk,
+		    void *user_data)
+{
+	struct xsk_poller_entry *entry, **entries;
+	struct epoll_event ev = {};
+	__u32 max;
+
+	if (!poller || !xsk)
+		return -EFAULT;
+
+	if (poller->num == poller->max) {
+		max = poller->max ? poller->max * 2 : 8;
+		entries = realloc(poller->entries, max * sizeof(*entries));
+		if (!entries)
+			return -ENOMEM;
+		poller->entries = entries;
+		poller->max = max;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return -ENOMEM;
+	entry->xsk = xsk;
+	entry->user_data = user_data;
+
+	/* Only received packets wake up a blocked poller: the Tx ring of a
+	 * socket is writable nearly all the time.
+	 */
+	ev.events = xsk->rx ? EPOLLIN : 0;
+	ev.data.ptr = entry;
+	if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, xsk->fd, &ev)) {
+		free(entry);
+		return -errno;
+	}
+
+	poller->entries[poller->num++] = entry;
+	return 0;
+}
+
+int xsk_poller__remove(struct xsk_poller *poller, struct xsk_socket *xsk)
+{
+	__u32 i;
+
+	if (!poller || !xsk)
+		return -EFAULT;
+
+	for (i = 0; i < poller->num; i++) {
+		if (poller->entries[i]->xsk != xsk)
+			continue;
+
+		epoll_ctl(poller->epfd, EPOLL_CTL_DEL, xsk->fd, NULL);
+		free(poller->entries[i]);
+		poller->entries[i] = poller->entries[--poller->num];
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+int xsk_poller__fd(const struct xsk_poller *poller)
+{
+	return poller ? poller->epfd : -EINVAL;
+}
+
+static int xsk_poller_scan(struct xsk_poller *poller,
+			   struct xsk_poll_event *events, int max_events)
+{
+	struct xsk_poll_event *ev;
+	struct xsk_socket *xsk;
+	__u32 i, tx_used;
+	int n = 0;
+
+	for (i = 0; i < poller->num && n < max_events; i++) {
+		xsk = poller->entries[i]->xsk;
+		ev = &events[n];
+		memset(ev, 0, sizeof(*ev));
+
+		if (xsk->rx)
+			ev->rx_avail = xsk_ring_used(xsk->rx->producer,
+						     xsk->rx->consumer);
+		/* A kick only helps if the kernel has frames to receive into */
+		if (xsk->rx && xsk->ctx->fill &&
+		    xsk_ring_used(xsk->ctx->fill->producer,
+				  xsk->ctx->fill->consumer) &&
+		    xsk_ring_prod__needs_wakeup(xsk->ctx->fill))
+			ev->flags |= XSK_POLL_RX_KICK;
+		if (xsk->tx) {
+			tx_used = xsk_ring_used(xsk->tx->producer,
+						xsk->tx->consumer);
+			ev->tx_free = xsk->tx->size - tx_used;
+			ev->comp_avail = xsk_ring_used(xsk->ctx->comp->producer,
+						       xsk->ctx->comp->consumer);
+			if (tx_used && xsk_ring_prod__needs_wakeup(xsk->tx))
+				ev->flags |= XSK_POLL_TX_KICK;
+		}
+
+		if (!ev->rx_avail && !ev->comp_avail && !ev->flags)
+			continue;
+
+		ev->xsk = xsk;
+		ev->user_data = poller->entries[i]->user_data;
+		n++;
+	}
+
+	return n;
+}
+
+int xsk_poller__wait(struct xsk_poller *poller, struct xsk_poll_event *events,
+		     int max_events, int timeout_ms)
+{
+	struct epoll_event evs[16];
+	struct timespec ts;
+	__u64 now;
+	int n;
+
+	if (!poller || !events)
+		return -EFAULT;
+	if (max_events <= 0)
+		return -EINVAL;
+
+	for (;;) {
+		n = xsk_poller_scan(poller, events, max_events);
+		if (n) {
+			poller->idle_since = 0;
+			return n;
+		}
+		if (!timeout_ms)
+			return 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		if (!poller->idle_since)
+			poller->idle_since = now;
+		if (now - poller->idle_since >= poller->spin_ns)
+			break;
+	}
+
+	/* Idle for longer than the spin budget, so sleep until something is
+	 * received. epoll_wait() doesn't kick the sockets, but none needs one
+	 * here: the scan would have reported it to the caller to kick.
+	 */
+	if (epoll_wait(poller->epfd, evs, ARRAY_SIZE(evs), timeout_ms) < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	return xsk_poller_scan(poller, events, max_events);
+}
+
+struct xsk_group_queue {
+	struct xsk_ring_cons rx;
+	struct xsk_ring_prod tx;
+	struct xsk_ring_prod fill;
+	struct xsk_ring_cons comp;
+	struct xsk_queue_info info;
+};
+
+struct xsk_socket_group {
+	__u32 num_queues;
+	bool shared_umem;
+	struct xsk_group_queue queues[];
+};
+
+static int xsk_read_first_int(const char *path)
+{
+	int val = -1;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &val) != 1)
+		val = -1;
+	fclose(f);
+
+	return val;
+}
+
+/* Queue index encoded at the end of an IRQ action name, such as
+ * "eth0-TxRx-3" or "mlx5_comp3@pci:0000:01:00.0"; -1 if there is none.
+ */
+static int xsk_irq_name_queue(const char *name)
+{
+	const char *end = strchr(name, '@'), *p;
+
+	if (!end)
+		end = name + strlen(name);
+	p = end;
+
+	while (p > name && p[-1] >= '0' && p[-1] <= '9')
+		p--;
+	if (p == end)
+		return -1;
+
+	return atoi(p);
+}
+
+/* Map queues to the device's MSI interrupts and those to the CPU that
+ * services them. This relies on the common driver convention of ending the
+ * per-queue IRQ names in the queue number; queues that can't be matched are
+ * left at -1.
+ */
+static void xsk_socket_group_get_affinity(struct xsk_socket_group *group,
+					  const char *ifname)
+{
+	char path[PATH_MAX];
+	struct dirent *irq_ent, *act_ent;
+	DIR *irqs, *actions;
+	__u32 i;
+	int q;
+
+	for (i = 0; i < group->num_queues; i++)
+		group->queues[i].info.irq = group->queues[i].info.cpu = -1;
+
+	if (try_snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs",
+			 ifname))
+		return;
+
+	irqs = opendir(path);
+	if (!irqs)
+		return;
+
+	while ((irq_ent = readdir(irqs))) {
+		int irq = atoi(irq_ent->d_name);
+
+		if (irq <= 0 ||
+		    try_snprintf(path, sizeof(path), "/proc/irq/%d", irq))
+			continue;
+
+		actions = opendir(path);
+		if (!actions)
+			continue;
+
+		while ((act_ent = readdir(actions))) {
+			struct xsk_queue_info *info;
+
+			if (act_ent->d_type != DT_DIR || act_ent->d_name[0] == '.')
+				continue;
+
+			q = xsk_irq_name_queue(act_ent->d_name);
+			if (q < 0 || (__u32)q >= group->num_queues)
+				continue;
+
+			info = &group->queues[q].info;
+			if (info->irq >= 0)
+				continue;
+
+			info->irq = irq;
+			if (!try_snprintf(path, sizeof(path),
+					  "/proc/irq/%d/effective_affinity_list", irq))
+				info->cpu = xsk_read_first_int(path);
+			if (info->cpu < 0 &&
+			    !try_snprintf(path, sizeof(path),
+					  "/proc/irq/%d/smp_affinity_list", irq))
+				info->cpu = xsk_read_first_int(path);
+			break;
+		}
+		closedir(actions);
+	}
+	closedir(irqs);
+}
+
+void xsk_socket_group__delete(struct xsk_socket_group *group)
+{
+	__u32 i;
+
+	if (!group)
+		return;
+
+	for (i = 0; i < group->num_queues; i++)
+		xsk_socket__delete(group->queues[i].info.xsk);
+
+	/* With a shared UMEM every queue points at the one owned by queue 0 */
+	for (i = 0; i < group->num_queues; i++) {
+		if (group->shared_umem && i)
+			break;
+		xsk_umem__delete(group->queues[i].info.umem);
+	}
+
+	free(group);
+}
+
+int xsk_socket_group__create(struct xsk_socket_group **group_ptr,
+			     const char *ifname,
+			     const struct xsk_socket_group_opts *opts)
+{
+	const struct xsk_socket_config *xsk_config;
+	const struct xsk_umem_config *umem_config;
+	struct xsk_socket_group *group;
+	char ifname_buf[IFNAMSIZ];
+	__u32 num_queues, flags, i;
+	__u64 umem_size;
+	int max_queues, err;
+
+	if (!group_ptr || !ifname)
+		return -EFAULT;
+	if (!OPTS_VALID(opts, xsk_socket_group_opts))
+		return -EINVAL;
+
+	num_queues = OPTS_GET(opts, num_queues, 0);
+	umem_size = OPTS_GET(opts, umem_size, 0);
+	flags = OPTS_GET(opts, flags, 0);
+	umem_config = OPTS_GET(opts, umem_config, NULL);
+	xsk_config = OPTS_GET(opts, socket_config, NULL);
+
+	if ((flags & XSK_SOCKET_GROUP_F_NO_RX) &&
+	    (flags & XSK_SOCKET_GROUP_F_NO_TX))
+		return -EINVAL;
+
+	memcpy(ifname_buf, ifname, IFNAMSIZ - 1);
+	ifname_buf[IFNAMSIZ - 1] = '\0';
+	max_queues = xsk_get_max_queues(ifname_buf);
+	if (max_queues < 0)
+		return max_queues;
+	if (!num_queues)
+		num_queues = max_queues;
+	if (num_queues > (__u32)max_queues) {
+		pr_warn("Interface %s only has %d queues\n", ifname, max_queues);
+		return -EINVAL;
+	}
+
+	if (!umem_size)
+		umem_size = (__u64)XSK_RING_PROD__DEFAULT_NUM_DESCS * 2 *
+			(umem_config ? umem_config->frame_size :
+				       XSK_UMEM__DEFAULT_FRAME_SIZE);
+
+	group = calloc(1, sizeof(*group) + num_queues * sizeof(group->queues[0]));
+	if (!group)
+		return -ENOMEM;
+	group->num_queues = num_queues;
+	group->shared_umem = !!(flags & XSK_SOCKET_GROUP_F_SHARED_UMEM);
+
+	for (i = 0; i < num_queues; i++) {
+		struct xsk_group_queue *q = &group->queues[i];
+		struct xsk_queue_info *info = &q->info;
+
+		info->queue_id = i;
+		info->rx = (flags & XSK_SOCKET_GROUP_F_NO_RX) ? NULL : &q->rx;
+		info->tx = (flags & XSK_SOCKET_GROUP_F_NO_TX) ? NULL : &q->tx;
+		info->fill = &q->fill;
+		info->comp = &q->comp;
+
+		if (!group->shared_umem || !i) {
+			__u64 size = group->shared_umem ? umem_size * num_queues :
+				umem_size;
+
+			err = xsk_umem__create_hugepage(&info->umem, &info->umem_area,
+							size, ifname, &q->fill,
+							&q->comp, umem_config);
+			if (err)
+				goto err;
+		} else {
+			info->umem = group->queues[0].info.umem;
+			info->umem_area = group->queues[0].info.umem_area;
+			info->frame_base = i * umem_size;
+		}
+
+		err = xsk_socket__create_shared(&info->xsk, ifname, i, info->umem,
+						info->rx, info->tx, &q->fill,
+						&q->comp, xsk_config);
+		if (err) {
+			pr_warn("Failed to create AF_XDP socket on %s queue %u: %s\n",
+				ifname, i, strerror(-err));
+			goto err;
+		}
+	}
+
+	xsk_socket_group_get_affinity(group, ifname);
+
+	*group_ptr = group;
+	return 0;
+
+err:
+	xsk_socket_group__delete(group);
+	return err;
+}
+
+__u32 xsk_socket_group__num_queues(const struct xsk_socket_group *group)
+{
+	return group ? group->num_queues : 0;
+}
+
+const struct xsk_queue_info *
+xsk_socket_group__queue(const struct xsk_socket_group *group, __u32 idx)
+{
+	if (!group || idx >= group->num_queues)
+		return NULL;
+
+	return &group->queues[idx].info;
+}
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <xdp/xdp_helpers.h>
+#include <xdp/parsing_helpers.h>
+#include <xdp/xsk_rx_meta.h>
+
+#include "xsk_def_xdp_prog.h"
+
+#define DEFAULT_QUEUE_IDS 64
+
+struct {
+	__uint(type, BPF_MAP_TYPE_XSKMAP);
+	__uint(key_size, sizeof(int));
+	__uint(value_size, sizeof(int));
+	__uint(max_entries, DEFAULT_QUEUE_IDS);
+} xsks_map SEC(".maps");
+
+struct {
+	__uint(priority, 20);
+	__uint(XDP_PASS, 1);
+} XDP_RUN_CONFIG(xsk_def_prog_meta);
+
+/* Program refcount, in order to work properly,
+ * must be declared before any other global variables
+ * and initialized with '1'.
+ */
+volatile int refcnt = 1;
+
+/* Murmur3 finalizer */
+static __always_inline __u32 mix32(__u32 h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Hash the sorted addresses and ports, so both directions of a flow get the
+ * same value.
+ */
+static __always_inline __u32 flow_hash(__u32 saddr, __u32 daddr, __u16 sport,
+				       __u16 dport, __u8 proto)
+{
+	__u32 h;
+
+	h = mix32(0x9e3779b9 ^ (saddr < daddr ? saddr : daddr));
+	h = mix32(h ^ (saddr < daddr ? daddr : saddr));
+	if (sport > dport)
+		h ^= ((__u32)dport << 16) | sport;
+	else
+		h ^= ((__u32)sport << 16) | dport;
+	return mix32(h ^ proto);
+}
+
+static __always_inline __u32 fold_ip6(const struct in6_addr *addr)
+{
+	return addr->in6_u.u6_addr32[0] ^ addr->in6_u.u6_addr32[1] ^
+	       addr->in6_u.u6_addr32[2] ^ addr->in6_u.u6_addr32[3];
+}
+
+static __always_inline void parse_meta(struct xdp_md *ctx,
+				       struct xsk_rx_meta *meta)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct hdr_cursor nh = { .pos = data };
+	__u32 saddr, daddr, ports = 0;
+	struct vlan_hdr *vlh;
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+	struct ethhdr *eth;
+	int eth_type, proto;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type < 0)
+		return;
+
+	vlh = (void *)(eth + 1);
+	if (proto_is_vlan(eth->h_proto) && (void *)(vlh + 1) <= data_end) {
+		meta->vlan_tci = bpf_ntohs(vlh->h_vlan_TCI);
+		meta->flags |= XSK_RX_META_F_VLAN;
+	}
+
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		proto = parse_iphdr(&nh, data_end, &iph);
+		if (proto < 0)
+			return;
+		saddr = iph->saddr;
+		daddr = iph->daddr;
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		proto = parse_ip6hdr(&nh, data_end, &ip6h);
+		if (proto < 0)
+			return;
+		saddr = fold_ip6(&ip6h->saddr);
+		daddr = fold_ip6(&ip6h->daddr);
+	} else {
+		return;
+	}
+
+	/* TCP and UDP both start with the two port numbers */
+	if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+	    nh.pos + sizeof(ports) <= data_end)
+		ports = *(__u32 *)nh.pos;
+	else
+		proto = 0;
+
+	meta->hash = flow_hash(saddr, daddr, ports & 0xffff, ports >> 16, proto);
+	meta->flags |= XSK_RX_META_F_HASH;
+}
+
+/* Variant of the default program that puts a struct xsk_rx_meta in the
+ * metadata area in front of each packet it redirects.
+ */
+SEC("xdp")
+int xsk_def_prog_meta(struct xdp_md *ctx)
+{
+	struct xsk_rx_meta info = {}, *meta;
+	int index = ctx->rx_queue_index;
+	void *data;
+
+	/* Make sure refcount is referenced by the program */
+	if (!refcnt)
+		return XDP_PASS;
+
+	/* Skip the work for queues without an AF_XDP socket */
+	if (!bpf_map_lookup_elem(&xsks_map, &index))
+		return XDP_PASS;
+
+	info.timestamp = bpf_ktime_get_ns();
+	info.flags = XSK_RX_META_F_TIMESTAMP;
+	parse_meta(ctx, &info);
+
+	/* Drivers without metadata support fail this; redirect anyway */
+	if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(info)))
+		goto redirect;
+
+	meta = (void *)(long)ctx->data_meta;
+	data = (void *)(long)ctx->data;
+	if ((void *)(meta + 1) <= data)
+		*meta = info;
+
+redirect:
+	return bpf_redirect_map(&xsks_map, index, XDP_PASS);
+}
+
+char _license[] SEC("license") = "GPL";
+__uint(xsk_prog_version, XSK_PROG_VERSION) SEC(XDP_METADATA_SECTION);
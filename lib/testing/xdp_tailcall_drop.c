@@ -0,0 +1,18 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#define XDP_USE_TAIL_CALLS
+#include <xdp/xdp_helpers.h>
+
+struct {
+	__uint(priority, 20);
+	__uint(XDP_PASS, 1);
+} XDP_RUN_CONFIG(xdp_tailcall_drop);
+
+SEC("xdp")
+int xdp_tailcall_drop(struct xdp_md *ctx)
+{
+    return xdp_tail_call_return(ctx, XDP_DROP);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,18 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#define XDP_USE_TAIL_CALLS
+#include <xdp/xdp_helpers.h>
+
+struct {
+	__uint(priority, 10);
+	__uint(XDP_PASS, 1);
+} XDP_RUN_CONFIG(xdp_tailcall_pass);
+
+SEC("xdp")
+int xdp_tailcall_pass(struct xdp_md *ctx)
+{
+    return xdp_tail_call_return(ctx, XDP_PASS);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -82,6 +82,20 @@ static int handle_u32(char *optarg, void *tgt, __unused struct prog_option *opt)
 	return 0;
 }
 
+static int handle_u64(char *optarg, void *tgt, __unused struct prog_option *opt)
+{
+	__u64 *opt_set = tgt;
+	unsigned long long val;
+
+	errno = 0;
+	val = strtoull(optarg, NULL, 10);
+	if (errno)
+		return -EINVAL;
+
+	*opt_set = val;
+	return 0;
+}
+
 static int handle_u32_multi(char *optarg, void *tgt, struct prog_option *opt)
 {
 	struct u32_multi *opt_set = tgt;
@@ -283,6 +297,70 @@ static int handle_ipaddr(char *optarg, void *tgt, __unused struct prog_option *o
 	return 0;
 }
 
+void print_prefix(char *buf, size_t buf_len, const struct ip_prefix *prefix)
+{
+	size_t len;
+
+	print_addr(buf, buf_len, &prefix->addr);
+
+	/* Only print the prefix length for non-host prefixes */
+	if (prefix->prefixlen == (prefix->addr.af == AF_INET6 ? 128 : 32))
+		return;
+
+	len = strlen(buf);
+	if (len < buf_len)
+		snprintf(buf + len, buf_len - len, "/%u", prefix->prefixlen);
+}
+
+static int handle_ipprefix(char *optarg, void *tgt, struct prog_option *opt)
+{
+	char addrbuf[INET6_ADDRSTRLEN], *slash, *end;
+	struct ip_prefix *prefix = tgt;
+	unsigned long prefixlen;
+	unsigned int max_len, i;
+	size_t addr_len;
+	__u8 *bytes;
+	int err;
+
+	slash = strchr(optarg, '/');
+	addr_len = slash ? (size_t)(slash - optarg) : strlen(optarg);
+	if (addr_len >= sizeof(addrbuf)) {
+		pr_warn("Invalid IP prefix: %s\n", optarg);
+		return -ENOENT;
+	}
+	memcpy(addrbuf, optarg, addr_len);
+	addrbuf[addr_len] = '\0';
+
+	err = handle_ipaddr(addrbuf, &prefix->addr, opt);
+	if (err)
+		return err;
+
+	max_len = prefix->addr.af == AF_INET6 ? 128 : 32;
+	prefixlen = max_len;
+	if (slash) {
+		errno = 0;
+		prefixlen = strtoul(slash + 1, &end, 10);
+		if (errno || *end || end == slash + 1 || prefixlen > max_len) {
+			pr_warn("Invalid prefix length: %s\n", optarg);
+			return -ENOENT;
+		}
+	}
+	prefix->prefixlen = prefixlen;
+
+	/* Clear the host bits, so the prefix has a single representation */
+	bytes = (__u8 *)&prefix->addr.addr;
+	for (i = 0; i < max_len / 8; i++) {
+		if (prefixlen >= (i + 1) * 8)
+			continue;
+		if (prefixlen > i * 8)
+			bytes[i] &= 0xff << (8 - (prefixlen - i * 8));
+		else
+			bytes[i] = 0;
+	}
+
+	return 0;
+}
+
 static const struct enum_val *find_enum(const struct enum_val *enum_vals,
 					const char *chr)
 {
@@ -355,9 +433,22 @@ static const struct opthandler {
 			 {handle_ifname_multi},
 			 {handle_ipaddr},
 			 {handle_enum},
-			 {handle_multistring}
+			 {handle_multistring},
+			 {handle_ipprefix},
+			 {handle_u64}
 };
 
+int parse_option_value(enum option_type type, char *arg, void *tgt,
+		       void *typearg)
+{
+	struct prog_option opt = { .type = type, .typearg = typearg };
+
+	if (type <= OPT_NONE || type >= __OPT_MAX || !handlers[type].func)
+		return -EINVAL;
+
+	return handlers[type].func(arg, tgt, &opt);
+}
+
 void print_flags(char *buf, size_t buf_len, const struct flag_val *flags,
 		 unsigned long flags_set)
 {
@@ -423,6 +514,7 @@ static const struct helprinter {
 	{NULL},
 	{NULL},
 	{print_help_enum},
+	{NULL},
 	{NULL}
 };
 
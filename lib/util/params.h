@@ -25,6 +25,8 @@ enum option_type {
 	OPT_IPADDR,
 	OPT_ENUM,
 	OPT_MULTISTRING,
+	OPT_IPPREFIX,
+	OPT_U64,
 	__OPT_MAX
 };
 
@@ -79,6 +81,11 @@ struct ip_addr {
 	} addr;
 };
 
+struct ip_prefix {
+	struct ip_addr addr;
+	__u8 prefixlen;
+};
+
 struct mac_addr {
 	unsigned char addr[ETH_ALEN];
 };
@@ -131,8 +138,11 @@ const char *get_enum_name(const struct enum_val *vals, unsigned int value);
 void print_flags(char *buf, size_t buf_len, const struct flag_val *flags,
 		 unsigned long flags_val);
 void print_addr(char *buf, size_t buf_len, const struct ip_addr *addr);
+void print_prefix(char *buf, size_t buf_len, const struct ip_prefix *prefix);
 void print_macaddr(char *buf, size_t buf_len, const struct mac_addr *addr);
 bool is_prefix(const char *prefix, const char *string);
+int parse_option_value(enum option_type type, char *arg, void *tgt,
+		       void *typearg);
 void usage(const char *prog_name, const char *doc,
 	   const struct prog_option *long_options, bool full);
 
@@ -7,8 +7,11 @@
 #include <getopt.h>
 
 #include <locale.h>
+#include <poll.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
@@ -45,23 +48,65 @@ static double calc_period(struct record *r, struct record *p)
 	return period_;
 }
 
+/* Number of receive queues that saw any packets, up to the highest one */
+static int stats_num_rxqs(struct stats_record *stats_rec, int *active)
+{
+	int q, i, num = 0;
+
+	*active = 0;
+	for (q = 0; q < XDP_STATS_MAX_RXQ; q++) {
+		for (i = 0; i < XDP_ACTION_MAX; i++) {
+			if (stats_rec->rxq[q][i].rx_packets) {
+				(*active)++;
+				num = q + 1;
+				break;
+			}
+		}
+	}
+	return num;
+}
+
+static void stats_rxq_name(char *buf, size_t len, int rxq)
+{
+	snprintf(buf, len, "rxq:%d%s", rxq,
+		 rxq == XDP_STATS_MAX_RXQ - 1 ? "+" : "");
+}
+
 int stats_print_one(struct stats_record *stats_rec)
 {
+	char *fmt = "  %-35s %'11lld pkts %'11lld KiB\n";
+	int i, q, err, num_rxqs, active;
 	__u64 packets, bytes;
 	struct record *rec;
-	int i, err;
+	char str[64];
+
+	num_rxqs = stats_num_rxqs(stats_rec, &active);
 
 	/* Print for each XDP actions stats */
 	for (i = 0; i < XDP_ACTION_MAX; i++) {
-		char *fmt = "  %-35s %'11lld pkts %'11lld KiB\n";
 		const char *action = action2str(i);
 
 		rec = &stats_rec->stats[i];
 		packets = rec->total.rx_packets;
 		bytes = rec->total.rx_bytes;
 
-		if (rec->enabled) {
-			err = printf(fmt, action, packets, bytes / 1024);
+		if (!rec->enabled)
+			continue;
+
+		err = printf(fmt, action, packets, bytes / 1024);
+		if (err < 0)
+			return err;
+
+		/* Only break down the totals when they are spread out */
+		for (q = 0; active > 1 && q < num_rxqs; q++) {
+			packets = stats_rec->rxq[q][i].rx_packets;
+			bytes = stats_rec->rxq[q][i].rx_bytes;
+			if (!packets)
+				continue;
+
+			stats_rxq_name(str, sizeof(str), q);
+			err = printf("    %-33s %'11lld pkts %'11lld KiB\n", str,
+				     packets, bytes / 1024);
 			if (err < 0)
 				return err;
 		}
@@ -72,6 +117,7 @@ int stats_print_one(struct stats_record *stats_rec)
 
 int stats_print(struct stats_record *stats_rec, struct stats_record *stats_prev)
 {
+	int i, q, err, num_rxqs, active;
 	struct record *rec, *prev;
 	__u64 packets, bytes;
 	struct timespec t;
@@ -79,7 +125,7 @@ int stats_print(struct stats_record *stats_rec, struct stats_record *stats_prev)
 	double period;
 	double pps; /* packets per sec */
 	double bps; /* bits per sec */
-	int i, err;
+	char str[64];
 
 	err = clock_gettime(CLOCK_REALTIME, &t);
 	if (err < 0) {
@@ -87,6 +133,8 @@ int stats_print(struct stats_record *stats_rec, struct stats_record *stats_prev)
 		return err;
 	}
 
+	num_rxqs = stats_num_rxqs(stats_rec, &active);
+
 	/* Print for each XDP actions stats */
 	for (i = 0; i < XDP_ACTION_MAX; i++) {
 		char *fmt = "%-12s %'11lld pkts (%'10.0f pps)"
@@ -118,6 +166,18 @@ int stats_print(struct stats_record *stats_rec, struct stats_record *stats_prev)
 
 		printf(fmt, action, rec->total.rx_packets, pps,
 		       rec->total.rx_bytes / 1024, bps, period);
+
+		/* Queues that saw packets in this period, if more than one did */
+		for (q = 0; active > 1 && q < num_rxqs; q++) {
+			packets = stats_rec->rxq[q][i].rx_packets -
+				  stats_prev->rxq[q][i].rx_packets;
+			if (!packets)
+				continue;
+
+			stats_rxq_name(str, sizeof(str), q);
+			printf("  %-10s %'11lld pkts (%'10.0f pps)\n", str,
+			       stats_rec->rxq[q][i].rx_packets, packets / period);
+		}
 	}
 	printf("\n");
 
@@ -171,64 +231,260 @@ out:
 	return err;
 }
 
-static int map_collect(int fd, __u32 map_type, __u32 key, struct record *rec)
-{
-	struct datarec value = {};
-	int err;
-
-	/* Get time as close as possible to reading map contents */
-	err = gettime(&rec->timestamp);
-	if (err)
-		return err;
+#define STATS_NUM_KEYS (XDP_STATS_MAX_RXQ * XDP_ACTION_MAX)
 
+static int map_get_value(int fd, __u32 map_type, __u32 key,
+			 struct datarec *value)
+{
 	switch (map_type) {
 	case BPF_MAP_TYPE_ARRAY:
-		err = map_get_value_array(fd, key, &value);
-		break;
+		return map_get_value_array(fd, key, value);
 	case BPF_MAP_TYPE_PERCPU_ARRAY:
-		err = map_get_value_percpu_array(fd, key, &value);
-		break;
+		return map_get_value_percpu_array(fd, key, value);
 	default:
 		pr_warn("Unknown map_type: %u cannot handle\n", map_type);
-		err = -EINVAL;
-		break;
+		return -EINVAL;
 	}
+}
+
+/* Start a new reading of the enabled actions */
+static int stats_reset(struct stats_record *stats_rec)
+{
+	__u64 now;
+	int i, err;
 
+	/* Get time as close as possible to reading map contents */
+	err = gettime(&now);
 	if (err)
 		return err;
 
-	rec->total.rx_packets = value.rx_packets;
-	rec->total.rx_bytes   = value.rx_bytes;
+	for (i = 0; i < XDP_ACTION_MAX; i++) {
+		if (!stats_rec->stats[i].enabled)
+			continue;
+		stats_rec->stats[i].timestamp = now;
+		memset(&stats_rec->stats[i].total, 0,
+		       sizeof(stats_rec->stats[i].total));
+	}
+	memset(stats_rec->rxq, 0, sizeof(stats_rec->rxq));
 	return 0;
 }
 
+/* Account the value of one key to its receive queue and the action total */
+static void stats_add(struct stats_record *stats_rec, __u32 key,
+		      const struct datarec *value)
+{
+	__u32 action = key % XDP_ACTION_MAX, rxq = key / XDP_ACTION_MAX;
+	struct record *rec = &stats_rec->stats[action];
+
+	if (!rec->enabled || rxq >= XDP_STATS_MAX_RXQ)
+		return;
+
+	rec->total.rx_packets += value->rx_packets;
+	rec->total.rx_bytes += value->rx_bytes;
+	stats_rec->rxq[rxq][action] = *value;
+}
+
+/* Set once the kernel turned out not to support batched lookups */
+static bool stats_no_batch;
+
+/* Read the whole map with a single batched lookup. Returns -EOPNOTSUPP if the
+ * kernel can't do that, so the caller can fall back to one lookup per key.
+ */
+static int map_collect_batch(int fd, __u32 map_type, struct stats_record *stats_rec)
+{
+	int nr_cpus = map_type == BPF_MAP_TYPE_PERCPU_ARRAY ?
+			      libbpf_num_possible_cpus() : 1;
+	__u32 keys[STATS_NUM_KEYS], count = STATS_NUM_KEYS, i;
+	struct datarec *values, sum;
+	__u64 batch;
+	int cpu, err;
+
+	if (stats_no_batch)
+		return -EOPNOTSUPP;
+	if (map_type != BPF_MAP_TYPE_ARRAY && map_type != BPF_MAP_TYPE_PERCPU_ARRAY)
+		return -EINVAL;
+	if (nr_cpus < 0)
+		return nr_cpus;
+
+	values = calloc(STATS_NUM_KEYS * nr_cpus, sizeof(*values));
+	if (!values)
+		return -ENOMEM;
+
+	err = stats_reset(stats_rec);
+	if (err)
+		goto out;
+
+	/* ENOENT just means the whole map fit in this batch */
+	err = bpf_map_lookup_batch(fd, NULL, &batch, keys, values, &count, NULL);
+	if (err && errno != ENOENT) {
+		err = -errno;
+		if (err == -EINVAL || err == -EOPNOTSUPP) {
+			pr_debug("Batched map lookup not supported, using single lookups\n");
+			stats_no_batch = true;
+			err = -EOPNOTSUPP;
+		}
+		goto out;
+	}
+	err = 0;
+
+	for (i = 0; i < count; i++) {
+		memset(&sum, 0, sizeof(sum));
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			sum.rx_packets += values[i * nr_cpus + cpu].rx_packets;
+			sum.rx_bytes += values[i * nr_cpus + cpu].rx_bytes;
+		}
+		stats_add(stats_rec, keys[i], &sum);
+	}
+out:
+	free(values);
+	return err;
+}
+
+/* Maps pinned by older versions only have the keys of the first queue, and
+ * may be a plain array; both layouts are read the same way.
+ */
 int stats_collect(int map_fd, __u32 map_type, struct stats_record *stats_rec)
 {
 	/* Collect all XDP actions stats  */
+	struct datarec value;
 	__u32 key;
 	int err;
 
-	for (key = 0; key < XDP_ACTION_MAX; key++) {
-		if (!stats_rec->stats[key].enabled)
+	err = map_collect_batch(map_fd, map_type, stats_rec);
+	if (err != -EOPNOTSUPP)
+		return err;
+
+	err = stats_reset(stats_rec);
+	if (err)
+		return err;
+
+	for (key = 0; key < STATS_NUM_KEYS; key++) {
+		if (!stats_rec->stats[key % XDP_ACTION_MAX].enabled)
 			continue;
 
-		err = map_collect(map_fd, map_type, key,
-				  &stats_rec->stats[key]);
+		memset(&value, 0, sizeof(value));
+		err = map_get_value(map_fd, map_type, key, &value);
+		if (err == -ENOENT && key >= XDP_ACTION_MAX)
+			break; /* end of the map */
 		if (err)
 			return err;
+		stats_add(stats_rec, key, &value);
 	}
 
 	return 0;
 }
 
+/* Print the counters of a stats map in OpenMetrics text format, labelled with
+ * the program the map belongs to.
+ */
+int stats_print_openmetrics(FILE *f, int map_fd, const char *prog_name)
+{
+	struct stats_record rec = {};
+	struct bpf_map_info info = {};
+	__u32 info_len = sizeof(info);
+	int i, q, err, num_rxqs, active;
+
+	err = bpf_obj_get_info_by_fd(map_fd, &info, &info_len);
+	if (err)
+		return -errno;
+
+	for (i = 0; i < XDP_ACTION_MAX; i++)
+		rec.stats[i].enabled = true;
+	err = stats_collect(map_fd, info.type, &rec);
+	if (err)
+		return err;
+
+	fprintf(f, "# TYPE xdp_stats_packets counter\n"
+		   "# HELP xdp_stats_packets Packets seen by the program, by verdict\n");
+	for (i = 0; i < XDP_ACTION_MAX; i++)
+		fprintf(f, "xdp_stats_packets_total{program=\"%s\",action=\"%s\"} %llu\n",
+			prog_name, action2str(i), rec.stats[i].total.rx_packets);
+
+	fprintf(f, "# TYPE xdp_stats_bytes counter\n"
+		   "# HELP xdp_stats_bytes Bytes seen by the program, by verdict\n");
+	for (i = 0; i < XDP_ACTION_MAX; i++)
+		fprintf(f, "xdp_stats_bytes_total{program=\"%s\",action=\"%s\"} %llu\n",
+			prog_name, action2str(i), rec.stats[i].total.rx_bytes);
+
+	num_rxqs = stats_num_rxqs(&rec, &active);
+	fprintf(f, "# TYPE xdp_stats_rxq_packets counter\n"
+		   "# HELP xdp_stats_rxq_packets Packets seen by the program, by receive queue and verdict\n");
+	for (q = 0; q < num_rxqs; q++)
+		for (i = 0; i < XDP_ACTION_MAX; i++)
+			fprintf(f, "xdp_stats_rxq_packets_total{program=\"%s\",rxq=\"%d\",action=\"%s\"} %llu\n",
+				prog_name, q, action2str(i),
+				rec.rxq[q][i].rx_packets);
+
+	return 0;
+}
+
+/* Check that the pinned map is still the one being polled */
+static int stats_check_pinned(const char *pin_dir, const char *map_name,
+			      __u32 map_id)
+{
+	struct bpf_map_info info = {};
+	int other_fd;
+
+	other_fd = get_pinned_map_fd(pin_dir, map_name, &info);
+	if (other_fd < 0) {
+		if (other_fd == -ENOENT)
+			pr_warn("Stats map disappeared while polling\n");
+		else
+			pr_warn("Unable to re-open stats map\n");
+		return other_fd;
+	}
+	close(other_fd);
+
+	if (info.id != map_id) {
+		pr_warn("Stats map ID changed while polling\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* Drain the inotify events, returning true if any of them was about the map
+ * (or the directory itself).
+ */
+static bool stats_pin_changed(int inotify_fd, const char *map_name)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool changed = false;
+	ssize_t len;
+	char *ptr;
+
+	while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)ptr;
+			if (ev->mask & (IN_DELETE_SELF | IN_IGNORED | IN_Q_OVERFLOW) ||
+			    (ev->len && !strcmp(ev->name, map_name)))
+				changed = true;
+		}
+	}
+	return changed;
+}
+
+/* Poll on a timerfd, so the interval doesn't drift by the time spent reading
+ * and printing. Replacing the pinned map is caught with inotify on the pin
+ * directory instead of re-opening it every interval; if inotify is not
+ * available, the map is checked on every interval as before.
+ */
 int stats_poll(int map_fd, const char *pin_dir, const char *map_name,
 	       int interval)
 {
+	struct itimerspec its = {
+		/* Get the first reading after a quarter second */
+		.it_value = { 0, 250000000 },
+		.it_interval = { interval / 1000, (interval % 1000) * 1000000 },
+	};
 	struct bpf_map_info info = {};
 	struct stats_record prev, record = { 0 };
 	__u32 info_len = sizeof(info);
-	int err, other_fd;
+	int err, timer_fd, inotify_fd;
+	struct pollfd pfd[2] = {};
 	__u32 map_type, map_id;
+	__u64 expirations;
 
 	record.stats[XDP_DROP].enabled = true;
 	record.stats[XDP_PASS].enabled = true;
@@ -242,32 +498,72 @@ int stats_poll(int map_fd, const char *pin_dir, const char *map_name,
 	map_type = info.type;
 	map_id = info.id;
 
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timer_fd < 0)
+		return -errno;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd >= 0 &&
+	    inotify_add_watch(inotify_fd, pin_dir,
+			      IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+			      IN_MOVED_TO | IN_DELETE_SELF) < 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	if (inotify_fd < 0)
+		pr_debug("Can't watch %s, checking the map on every interval\n",
+			 pin_dir);
+
 	/* Get initial reading quickly */
 	stats_collect(map_fd, map_type, &record);
 
-	usleep(1000000 / 4);
+	if (timerfd_settime(timer_fd, 0, &its, NULL) < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	pfd[0].fd = timer_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = inotify_fd;
+	pfd[1].events = POLLIN;
 
 	while (1) {
-		memset(&info, 0, sizeof(info));
-		other_fd = get_pinned_map_fd(pin_dir, map_name, &info);
-		if (other_fd < 0) {
-			if (other_fd == -ENOENT)
-				pr_warn("Stats map disappeared while polling\n");
-			else
-				pr_warn("Unable to re-open stats map\n");
-			return other_fd;
-		} else if (info.id != map_id) {
-			pr_warn("Stats map ID changed while polling\n");
-			return -EINVAL;
+		err = poll(pfd, inotify_fd >= 0 ? 2 : 1, -1);
+		if (err < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			goto out;
+		}
+
+		if ((pfd[1].revents & POLLIN) &&
+		    stats_pin_changed(inotify_fd, map_name)) {
+			err = stats_check_pinned(pin_dir, map_name, map_id);
+			if (err)
+				goto out;
+		}
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+		if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+			continue;
+
+		if (inotify_fd < 0) {
+			err = stats_check_pinned(pin_dir, map_name, map_id);
+			if (err)
+				goto out;
 		}
-		close(other_fd);
+
 		prev = record; /* struct copy */
 		stats_collect(map_fd, map_type, &record);
 		err = stats_print(&record, &prev);
 		if (err)
-			return err;
-		usleep(interval * 1000);
+			goto out;
 	}
 
-	return 0;
+out:
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+	close(timer_fd);
+	return err;
 }
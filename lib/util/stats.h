@@ -3,6 +3,7 @@
 #ifndef __STATS_H
 #define __STATS_H
 
+#include <stdio.h>
 #include <bpf/libbpf.h>
 
 #include "xdp/xdp_stats_kern_user.h"
@@ -15,12 +16,15 @@ struct record {
 
 struct stats_record {
 	struct record stats[XDP_ACTION_MAX];
+	/* Totals of each action per receive queue, summed over all CPUs */
+	struct datarec rxq[XDP_STATS_MAX_RXQ][XDP_ACTION_MAX];
 };
 
 int stats_print_one(struct stats_record *stats_rec);
 int stats_print(struct stats_record *stats_rec,
 		struct stats_record *stats_prev);
 int stats_collect(int map_fd, __u32 map_type, struct stats_record *stats_rec);
+int stats_print_openmetrics(FILE *f, int map_fd, const char *prog_name);
 int stats_poll(int map_fd, const char *pin_dir, const char *map_name,
 	       int interval);
 
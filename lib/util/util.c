@@ -10,7 +10,10 @@
 #include <sys/resource.h>
 #include <sys/vfs.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <linux/if_link.h> /* Need XDP flags */
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <linux/magic.h> /* BPF FS magic */
 #include <linux/err.h> /* ERR_PTR */
 #include <bpf/bpf.h>
@@ -321,6 +324,57 @@ out:
 	return err;
 }
 
+/* Swap prog in for the running old_prog without detaching it from the
+ * interface first, and move the pin over to the new program.
+ */
+int replace_xdp_program(struct xdp_program *old_prog,
+			struct xdp_program *prog, const struct iface *iface,
+			enum xdp_attach_mode mode, const char *pin_root_path)
+{
+	char old_path[PATH_MAX], pin_path[PATH_MAX];
+	int err;
+
+	if (!old_prog || !prog || !pin_root_path)
+		return -EINVAL;
+
+	err = try_snprintf(old_path, sizeof(old_path), "%s/programs/%s/%s",
+			   pin_root_path, iface->ifname,
+			   xdp_program__name(old_prog));
+	if (err)
+		return err;
+
+	err = try_snprintf(pin_path, sizeof(pin_path), "%s/programs/%s/%s",
+			   pin_root_path, iface->ifname,
+			   xdp_program__name(prog));
+	if (err)
+		return err;
+
+	err = xdp_program__replace(old_prog, prog, iface->ifindex, mode, 0);
+	if (err)
+		return err;
+
+	pr_debug("Program '%s' replaced by '%s' on interface '%s'\n",
+		 xdp_program__name(old_prog), xdp_program__name(prog),
+		 iface->ifname);
+
+	err = unlink(old_path);
+	if (err && errno != ENOENT) {
+		err = -errno;
+		pr_warn("Unable to unlink pinned XDP program at %s: %s\n",
+			old_path, strerror(-err));
+		return err;
+	}
+
+	err = xdp_program__pin(prog, pin_path);
+	if (err) {
+		pr_warn("Unable to pin XDP program at %s: %s\n",
+			pin_path, strerror(-err));
+		return err;
+	}
+	pr_debug("XDP program pinned at %s\n", pin_path);
+	return 0;
+}
+
 int get_pinned_program(const struct iface *iface, const char *pin_root_path,
 		       enum xdp_attach_mode *mode,
 		       struct xdp_program **xdp_prog)
@@ -459,44 +513,213 @@ out:
 	return err;
 }
 
+struct xdp_link_state {
+	char ifname[IF_NAMESIZE];
+	int ifindex;
+	__u32 prog_id;
+	__u32 hw_prog_id;
+	bool skb_mode;
+	struct xdp_multiprog *mp;
+};
+
+static void parse_xdp_attrs(struct xdp_link_state *link, struct rtattr *rta,
+			    int len)
+{
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFLA_XDP_DRV_PROG_ID:
+			link->prog_id = *(__u32 *)RTA_DATA(rta);
+			link->skb_mode = false;
+			break;
+		case IFLA_XDP_SKB_PROG_ID:
+			/* The driver mode program is what runs, if both are there */
+			if (!link->prog_id) {
+				link->prog_id = *(__u32 *)RTA_DATA(rta);
+				link->skb_mode = true;
+			}
+			break;
+		case IFLA_XDP_HW_PROG_ID:
+			link->hw_prog_id = *(__u32 *)RTA_DATA(rta);
+			break;
+		}
+	}
+}
+
+static int parse_link_msg(struct nlmsghdr *nh, struct xdp_link_state *link)
+{
+	struct ifinfomsg *ifm = NLMSG_DATA(nh);
+	int len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifm));
+	struct rtattr *rta = IFLA_RTA(ifm);
+
+	if (len < 0)
+		return -EINVAL;
+
+	memset(link, 0, sizeof(*link));
+	link->ifindex = ifm->ifi_index;
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFLA_IFNAME:
+			strncpy(link->ifname, RTA_DATA(rta),
+				sizeof(link->ifname) - 1);
+			break;
+		case IFLA_XDP:
+			parse_xdp_attrs(link, RTA_DATA(rta), RTA_PAYLOAD(rta));
+			break;
+		}
+	}
+	return 0;
+}
+
+/* Interfaces report the IDs of their XDP programs in RTM_GETLINK dumps, so a
+ * single dump tells which of them need a closer look, instead of querying
+ * each of them on its own.
+ */
+static int dump_xdp_links(struct xdp_link_state **links, size_t *num_links)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifm;
+	} req = {
+		.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg)),
+		.nh.nlmsg_type = RTM_GETLINK,
+		.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+		.ifm.ifi_family = AF_UNSPEC,
+	};
+	struct xdp_link_state *l = NULL, *tmp;
+	size_t num = 0, buf_len = 65536;
+	int sock, err = 0, len;
+	struct nlmsghdr *nh;
+	bool done = false;
+	char *buf;
+
+	buf = malloc(buf_len);
+	if (!buf)
+		return -ENOMEM;
+
+	sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sock < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	if (send(sock, &req, req.nh.nlmsg_len, 0) < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	while (!done) {
+		len = recv(sock, buf, buf_len, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			goto out;
+		}
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				done = true;
+				break;
+			} else if (nh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *nlerr = NLMSG_DATA(nh);
+
+				err = nlerr->error ?: -EPROTO;
+				goto out;
+			} else if (nh->nlmsg_type != RTM_NEWLINK) {
+				continue;
+			}
+
+			tmp = realloc(l, (num + 1) * sizeof(*l));
+			if (!tmp) {
+				err = -ENOMEM;
+				goto out;
+			}
+			l = tmp;
+
+			if (!parse_link_msg(nh, &l[num]))
+				num++;
+		}
+	}
+
+	*links = l;
+	*num_links = num;
+	l = NULL;
+out:
+	if (sock >= 0)
+		close(sock);
+	free(buf);
+	free(l);
+	return err;
+}
+
+/* Interfaces sharing a dispatcher in the same mode show the same programs, so
+ * the multiprog read for the first of them is handed on to the next one,
+ * instead of opening all the programs and loading their BTF again. It is
+ * closed once no interface further down the list uses it, to keep the number
+ * of open programs down when there are many different ones.
+ */
+static bool hand_on_multiprog(struct xdp_link_state *links, size_t num_links,
+			      size_t cur, struct xdp_multiprog *mp)
+{
+	size_t i;
+
+	for (i = cur + 1; i < num_links; i++) {
+		if (links[i].prog_id == links[cur].prog_id &&
+		    links[i].hw_prog_id == links[cur].hw_prog_id &&
+		    links[i].skb_mode == links[cur].skb_mode) {
+			links[i].mp = mp;
+			return true;
+		}
+	}
+	return false;
+}
+
 int iterate_iface_multiprogs(multiprog_callback cb, void *arg)
 {
-	struct if_nameindex *idx, *indexes = NULL;
+	struct xdp_link_state *links = NULL;
+	size_t num_links = 0, i;
 	int err = 0;
 
-	indexes = if_nameindex();
-	if (!indexes) {
-		err = -errno;
+	err = dump_xdp_links(&links, &num_links);
+	if (err) {
 		pr_warn("Couldn't get list of interfaces: %s\n", strerror(-err));
 		return err;
 	}
 
-	for (idx = indexes; idx->if_index; idx++) {
-		struct xdp_multiprog *mp;
+	for (i = 0; i < num_links; i++) {
+		struct xdp_multiprog *mp = links[i].mp;
 		struct iface iface = {
-			.ifindex = idx->if_index,
-			.ifname = idx->if_name,
+			.ifindex = links[i].ifindex,
+			.ifname = links[i].ifname,
 		};
 
-		mp = xdp_multiprog__get_from_ifindex(iface.ifindex);
-		if (IS_ERR_OR_NULL(mp)) {
-			if (PTR_ERR(mp) != -ENOENT) {
-				err = PTR_ERR(mp);
-				pr_warn("Error getting XDP status for interface %s: %s\n",
-					idx->if_name, strerror(-err));
-				goto out;
+		links[i].mp = NULL;
+		if (!mp && (links[i].prog_id || links[i].hw_prog_id)) {
+			mp = xdp_multiprog__get_from_ifindex(iface.ifindex);
+			if (IS_ERR_OR_NULL(mp)) {
+				if (PTR_ERR(mp) != -ENOENT) {
+					err = PTR_ERR(mp);
+					pr_warn("Error getting XDP status for interface %s: %s\n",
+						iface.ifname, strerror(-err));
+					goto out;
+				}
+				mp = NULL;
 			}
-			mp = NULL;
 		}
 
 		err = cb(&iface, mp, arg);
-		xdp_multiprog__close(mp);
+		if (!mp || !hand_on_multiprog(links, num_links, i, mp))
+			xdp_multiprog__close(mp);
 		if (err)
 			goto out;
 	}
 
 out:
-	if_freenameindex(indexes);
+	for (; i < num_links; i++)
+		xdp_multiprog__close(links[i].mp);
+	free(links);
 	return err;
 }
 
@@ -858,13 +1081,35 @@ static char *print_bpf_tag(char buf[BPF_TAG_SIZE * 2 + 1],
 	return buf;
 }
 
+static void print_prog_stats(const struct xdp_multiprog *mp,
+			     const struct xdp_program *prog)
+{
+	struct xdp_program_stats stats;
+	int err;
+
+	err = xdp_multiprog__program_stats(mp, prog, &stats);
+	if (err) {
+		printf("%-16s <Couldn't read stats: %s>\n", "", strerror(-err));
+		return;
+	}
+
+	printf("%-16s %llu pkts, %llu ns/pkt, verdicts: aborted %llu drop %llu "
+	       "pass %llu tx %llu redirect %llu\n", "",
+	       stats.invocations,
+	       stats.invocations ? stats.run_time_ns / stats.invocations : 0,
+	       stats.verdicts[XDP_ABORTED], stats.verdicts[XDP_DROP],
+	       stats.verdicts[XDP_PASS], stats.verdicts[XDP_TX],
+	       stats.verdicts[XDP_REDIRECT]);
+}
+
 static int print_iface_status(const struct iface *iface,
 			      const struct xdp_multiprog *mp,
-			      __unused void *arg)
+			      void *arg)
 {
 	struct xdp_program *prog, *dispatcher, *hw_prog;
 	char tag[BPF_TAG_SIZE * 2 + 1];
 	char buf[STRERR_BUFSIZE];
+	bool stats = arg && *(bool *)arg;
 	int err;
 
 	if (!mp) {
@@ -874,7 +1119,7 @@ static int print_iface_status(const struct iface *iface,
 
 	hw_prog = xdp_multiprog__hw_prog(mp);
 	if (hw_prog) {
-		printf("%-16s %-5s %-17s %-8s %-4d %-17s\n",
+		printf("%-16s %-5s %-17s %-8s %-4d %s\n",
 		       iface->ifname,
 		       "",
 		       xdp_program__name(hw_prog),
@@ -885,14 +1130,19 @@ static int print_iface_status(const struct iface *iface,
 
 	dispatcher = xdp_multiprog__main_prog(mp);
 	if (dispatcher) {
-		printf("%-16s %-5s %-17s %-8s %-4d %-17s\n",
+		printf("%-16s %-5s %-17s %-8s %-4d %s%s\n",
 		iface->ifname,
 		"",
 		xdp_program__name(dispatcher),
 		get_enum_name(xdp_modes, xdp_multiprog__attach_mode(mp)),
 		xdp_program__id(dispatcher),
-		print_bpf_tag(tag, xdp_program__tag(dispatcher)));
+		print_bpf_tag(tag, xdp_program__tag(dispatcher)),
+		xdp_multiprog__xdp_frags_support(mp) ? "  xdp.frags" : "");
 
+		if (stats && !xdp_multiprog__has_stats(mp)) {
+			printf("%-16s <No stats; load with LIBXDP_DISPATCHER_STATS=1>\n", "");
+			stats = false;
+		}
 
 		for (prog = xdp_multiprog__next_prog(NULL, mp);
 		     prog;
@@ -909,13 +1159,15 @@ static int print_iface_status(const struct iface *iface,
 			       "", xdp_program__id(prog),
 			       print_bpf_tag(tag, xdp_program__tag(prog)),
 			       buf);
+			if (stats)
+				print_prog_stats(mp, prog);
 		}
 	}
 
 	return 0;
 }
 
-int iface_print_status(const struct iface *iface)
+int iface_print_status(const struct iface *iface, bool stats)
 {
 	int err = 0;
 
@@ -936,9 +1188,9 @@ int iface_print_status(const struct iface *iface)
 			}
 			mp = NULL;
 		}
-		print_iface_status(iface, mp, NULL);
+		print_iface_status(iface, mp, &stats);
 	} else {
-		err = iterate_iface_multiprogs(print_iface_status, NULL);
+		err = iterate_iface_multiprogs(print_iface_status, &stats);
 	}
 	printf("\n");
 out:
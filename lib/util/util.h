@@ -65,6 +65,9 @@ int attach_xdp_program(struct xdp_program *prog, const struct iface *iface,
 		       enum xdp_attach_mode mode, const char *pin_root_dir);
 int detach_xdp_program(struct xdp_program *prog, const struct iface *iface,
 		       enum xdp_attach_mode mode, const char *pin_root_dir);
+int replace_xdp_program(struct xdp_program *old_prog,
+			struct xdp_program *prog, const struct iface *iface,
+			enum xdp_attach_mode mode, const char *pin_root_dir);
 
 int find_bpf_file(char *buf, size_t buf_size, const char *progname);
 struct bpf_object *open_bpf_file(const char *progname,
@@ -92,6 +95,6 @@ int prog_lock_get(const char *progname);
 void prog_lock_release(int signal);
 
 const char *get_libbpf_version(void);
-int iface_print_status(const struct iface *iface);
+int iface_print_status(const struct iface *iface, bool stats);
 
 #endif
@@ -6,17 +6,21 @@
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
 #include <stdio.h>
 #include <getopt.h>
 #include <locale.h>
 #include <net/if.h>
 #include <signal.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <bpf/bpf.h>
 #include <stdbool.h>
 #include <sys/mman.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
 #include <bpf/libbpf.h>
@@ -24,12 +28,15 @@
 #include <sys/timerfd.h>
 #include <sys/utsname.h>
 #include <linux/limits.h>
+#include <sys/socket.h>
 #include <sys/resource.h>
 #include <sys/signalfd.h>
+#include <linux/netdev.h>
+#include <linux/netlink.h>
 #include <linux/ethtool.h>
 #include <linux/if_link.h>
 #include <linux/sockios.h>
-#include <linux/hashtable.h>
+#include <linux/genetlink.h>
 
 #include "xdp_sample.h"
 #include "logging.h"
@@ -98,8 +105,16 @@ struct record {
 	};
 };
 
+/* The devmap_xmit_multi pairs live in a fixed open-addressing table, whose
+ * slots index the entries in the order the pairs were first seen. This keeps
+ * the memory flat however long the tool runs, at the cost of ignoring pairs
+ * beyond SAMPLE_XMIT_PAIRS_MAX.
+ */
+#define SAMPLE_XMIT_SLOT_BITS 8
+#define SAMPLE_XMIT_SLOTS (1U << SAMPLE_XMIT_SLOT_BITS)
+#define SAMPLE_XMIT_PAIRS_MAX (SAMPLE_XMIT_SLOTS / 2)
+
 struct map_entry {
-	struct hlist_node node;
 	__u64 pair;
 	struct record val;
 };
@@ -107,14 +122,25 @@ struct map_entry {
 struct stats_record {
 	struct record rx_cnt;
 	struct record rxq_cnt;
+	struct record nic_rxq_cnt;
 	struct record redir_err[XDP_REDIRECT_ERR_MAX];
 	struct record kthread;
+	struct record kthread_gro;
 	struct record exception[XDP_ACTION_MAX];
 	struct record devmap_xmit;
-	DECLARE_HASHTABLE(xmit_map, 5);
+	/* Index + 1 into xmit_entries, 0 for an empty slot */
+	__u16 xmit_slots[SAMPLE_XMIT_SLOTS];
+	int xmit_num;
+	struct map_entry xmit_entries[SAMPLE_XMIT_PAIRS_MAX];
+	/* Backs the per-CPU arrays of all the records */
+	struct datarec *arena;
 	struct record enq[];
 };
 
+#define xmit_map_for_each(rec, e)                                   \
+	for ((e) = (rec)->xmit_entries;                             \
+	     (e) < (rec)->xmit_entries + (rec)->xmit_num; (e)++)
+
 struct sample_output {
 	struct {
 		__u64 rx;
@@ -152,7 +178,7 @@ struct bpf_map *sample_map[NUM_MAP];
 size_t sample_map_count[NUM_MAP];
 enum log_level sample_log_level;
 struct sample_output sample_out;
-unsigned long sample_interval;
+unsigned long sample_interval_ms;
 bool sample_err_exp;
 int sample_xdp_cnt;
 int sample_n_cpus;
@@ -160,6 +186,26 @@ int sample_n_rxqs;
 int sample_sig_fd;
 int sample_mask;
 int ifindex[2];
+enum sample_output_format sample_format;
+/* Extra statistics printed after the tables on every interval */
+#define SAMPLE_MAX_PRINT_CBS 4
+static struct {
+	void (*cb)(void *ctx);
+	void *ctx;
+} sample_print_cbs[SAMPLE_MAX_PRINT_CBS];
+static int sample_num_print_cbs;
+/* The records of the interval the print callbacks are called for */
+static struct stats_record *sample_cur_rec, *sample_prev_rec;
+
+/* Rates of the most recent intervals, for the spread in the summary */
+#define SAMPLE_HIST_SIZE 16384
+static struct {
+	__u64 rx[SAMPLE_HIST_SIZE];
+	__u64 err[SAMPLE_HIST_SIZE];
+	__u64 sorted[SAMPLE_HIST_SIZE];
+	size_t num;
+} sample_hist;
+bool sample_csv_header_done;
 
 static struct {
 	bool checked;
@@ -244,30 +290,29 @@ static const char *xdp_action2str(int action)
 	return NULL;
 }
 
-static struct datarec *alloc_records(int nr_entries)
+/* Find the entry of pair in rec; with add set, append it if it is new and
+ * there is room left.
+ */
+static struct map_entry *xmit_map_find(struct stats_record *rec, __u64 pair,
+				       bool add)
 {
-	struct datarec *array;
+	__u32 slot = (pair * 0x9E3779B97F4A7C15ULL) >> (64 - SAMPLE_XMIT_SLOT_BITS);
+	struct map_entry *e;
 
-	if (nr_entries <= 0)
-		return NULL;
+	/* There are twice as many slots as entries, so this ends at a free one */
+	for (; rec->xmit_slots[slot]; slot = (slot + 1) % SAMPLE_XMIT_SLOTS) {
+		e = &rec->xmit_entries[rec->xmit_slots[slot] - 1];
+		if (e->pair == pair)
+			return e;
+	}
 
-	array = calloc(nr_entries, sizeof(*array));
-	if (!array) {
-		pr_warn("Failed to allocate memory (nr_entries: %u)\n", nr_entries);
+	if (!add || rec->xmit_num == SAMPLE_XMIT_PAIRS_MAX)
 		return NULL;
-	}
-	return array;
-}
 
-static int map_entry_init(struct map_entry *e, __u64 pair)
-{
+	e = &rec->xmit_entries[rec->xmit_num++];
+	rec->xmit_slots[slot] = rec->xmit_num;
 	e->pair = pair;
-	INIT_HLIST_NODE(&e->node);
-	e->val.timestamp = gettime();
-	e->val.cpu = alloc_records(libbpf_num_possible_cpus());
-	if (!e->val.cpu)
-		return -ENOMEM;
-	return 0;
+	return e;
 }
 
 static void map_collect_rxqs(struct datarec *values, struct record *rec)
@@ -329,198 +374,390 @@ static void map_collect_percpu(struct datarec *values, struct record *rec)
 	rec->total.xdp_redirect = sum_xdp_redirect;
 }
 
+/* Batch buffers for map_collect_percpu_devmap(), allocated by
+ * __sample_init() and kept until teardown, so collecting doesn't allocate.
+ */
+#define DEVMAP_BATCH_SIZE 32
+static struct datarec *devmap_batch_values;
+static __u64 *devmap_batch_keys;
+
+static int devmap_batch_alloc(void)
+{
+	devmap_batch_keys = calloc(DEVMAP_BATCH_SIZE, sizeof(__u64));
+	devmap_batch_values = calloc(DEVMAP_BATCH_SIZE * libbpf_num_possible_cpus(),
+				     sizeof(struct datarec));
+	if (!devmap_batch_keys || !devmap_batch_values) {
+		free(devmap_batch_keys);
+		free(devmap_batch_values);
+		devmap_batch_keys = NULL;
+		devmap_batch_values = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
 static int map_collect_percpu_devmap(int map_fd, struct stats_record *rec)
 {
 	int nr_cpus = libbpf_num_possible_cpus();
-	int i, ret, count = 32;
 	struct datarec *values;
+	__u32 batch, count, i;
 	bool init = false;
-	__u32 batch;
 	__u64 *keys;
+	int ret;
 
-	keys = calloc(count, sizeof(__u64));
-	if (!keys)
+	if (!devmap_batch_keys)
 		return -ENOMEM;
-	values = calloc(count * nr_cpus, sizeof(struct datarec));
-	if (!values) {
-		free(keys);
-		return -ENOMEM;
-	}
+	keys = devmap_batch_keys;
+	values = devmap_batch_values;
 
 	for (;;) {
 		bool exit = false;
 
+		count = DEVMAP_BATCH_SIZE;
 		ret = bpf_map_lookup_batch(map_fd, init ? &batch : NULL, &batch,
-					   keys, values, (__u32 *)&count, NULL);
-		if (ret < 0 && errno != ENOENT)
-			break;
-		if (errno == ENOENT)
+					   keys, values, &count, NULL);
+		if (ret < 0) {
+			/* ENOENT marks the last batch, which may hold entries;
+			 * on other errors keep what was collected so far.
+			 */
+			if (errno != ENOENT)
+				break;
 			exit = true;
+		}
 
 		init = true;
 		for (i = 0; i < count; i++) {
-			struct map_entry *e, *x = NULL;
-			__u64 pair = keys[i];
-			struct datarec *arr;
-
-			arr = &values[i * nr_cpus];
-			hash_for_each_possible(rec->xmit_map, e, node, pair) {
-				if (e->pair == pair) {
-					x = e;
-					break;
-				}
-			}
+			static bool warned;
+			struct map_entry *x;
+
+			x = xmit_map_find(rec, keys[i], true);
 			if (!x) {
-				x = calloc(1, sizeof(*x));
-				if (!x)
-					goto cleanup;
-				if (map_entry_init(x, pair) < 0) {
-					free(x);
-					goto cleanup;
-				}
-				hash_add(rec->xmit_map, &x->node, pair);
+				if (!warned)
+					pr_warn("More than %d devmap_xmit_multi pairs, ignoring the rest\n",
+						SAMPLE_XMIT_PAIRS_MAX);
+				warned = true;
+				continue;
 			}
-			map_collect_percpu(arr, &x->val);
+			map_collect_percpu(&values[i * nr_cpus], &x->val);
 		}
 
 		if (exit)
 			break;
-		count = 32;
 	}
 
-	free(values);
-	free(keys);
 	return 0;
-cleanup:
-	free(values);
-	free(keys);
-	return -ENOMEM;
 }
 
-static struct stats_record *alloc_stats_record(void)
+/* Per-queue counters of the NIC come from the queue stats of the netdev
+ * generic netlink family, which the driver fills in from its own ring and
+ * hardware counters. Lining them up with the rxq stats tells drops by the
+ * NIC (out of descriptors, buffer allocation failures) apart from those of
+ * the XDP program.
+ */
+#define NL_BUF_SIZE 32768
+
+static int sample_nl_fd = -1;
+static __u16 sample_nl_family;
+static __u32 sample_nl_seq;
+static int sample_nic_ifindex;
+static int sample_n_nic_rxqs;
+
+struct nl_req {
+	struct nlmsghdr nlh;
+	struct genlmsghdr genl;
+	char attrs[64];
+};
+
+static void nl_req_init(struct nl_req *req, __u16 type, __u16 flags, __u8 cmd)
 {
-	struct stats_record *rec;
-	int i;
+	memset(req, 0, sizeof(*req));
+	req->nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	req->nlh.nlmsg_type = type;
+	req->nlh.nlmsg_flags = NLM_F_REQUEST | flags;
+	req->nlh.nlmsg_seq = ++sample_nl_seq;
+	req->genl.cmd = cmd;
+	req->genl.version = 1;
+}
 
-	rec = calloc(1, sizeof(*rec) + sample_n_cpus * sizeof(struct record));
-	if (!rec) {
-		pr_warn("Failed to allocate memory\n");
-		return NULL;
-	}
+static void nl_req_add_attr(struct nl_req *req, __u16 type, const void *data,
+			    __u16 len)
+{
+	struct nlattr *nla = (void *)&req->nlh + NLMSG_ALIGN(req->nlh.nlmsg_len);
 
-	if (sample_mask & SAMPLE_RX_CNT) {
-		rec->rx_cnt.cpu = alloc_records(libbpf_num_possible_cpus());
-		if (!rec->rx_cnt.cpu) {
-			pr_warn("Failed to allocate rx_cnt per-CPU array\n");
-			goto end_rec;
-		}
-	}
-	if (sample_mask & SAMPLE_RXQ_STATS) {
-		if (sample_n_rxqs <= 0) {
-			pr_warn("Invalid number of RXQs: %d\n", sample_n_rxqs);
-			goto end_rx_cnt;
-		}
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	memcpy((char *)nla + NLA_HDRLEN, data, len);
+	req->nlh.nlmsg_len = NLMSG_ALIGN(req->nlh.nlmsg_len) + NLA_ALIGN(nla->nla_len);
+}
+
+/* Send req, and call cb for each message of the reply, until the end of a
+ * dump or the ack of a single request.
+ */
+static int nl_request(struct nl_req *req,
+		      void (*cb)(struct nlattr *attrs, int len, void *ctx),
+		      void *ctx)
+{
+	static char buf[NL_BUF_SIZE];
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *err;
+	ssize_t len;
 
-		rec->rxq_cnt.rxq = alloc_records(sample_n_rxqs);
-		if (!rec->rxq_cnt.rxq) {
-			pr_warn("Failed to allocate rxq_cnt per RXQ array\n");
-			goto end_rx_cnt;
+	if (send(sample_nl_fd, req, req->nlh.nlmsg_len, 0) < 0)
+		return -errno;
+
+	for (;;) {
+		len = recv(sample_nl_fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
 		}
-	}
-	if (sample_mask & (SAMPLE_REDIRECT_CNT | SAMPLE_REDIRECT_ERR_CNT)) {
-		for (i = 0; i < XDP_REDIRECT_ERR_MAX; i++) {
-			rec->redir_err[i].cpu = alloc_records(libbpf_num_possible_cpus());
-			if (!rec->redir_err[i].cpu) {
-				pr_warn("Failed to allocate redir_err per-CPU array for \"%s\" case\n",
-					xdp_redirect_err_names[i]);
-				while (i--)
-					free(rec->redir_err[i].cpu);
-				goto end_rxq_cnt;
+
+		for (nlh = (void *)buf; NLMSG_OK(nlh, (size_t)len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != req->nlh.nlmsg_seq)
+				continue;
+
+			switch (nlh->nlmsg_type) {
+			case NLMSG_DONE:
+				/* Carries the error of a failed dump */
+				if (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(int)))
+					return *(int *)NLMSG_DATA(nlh);
+				return 0;
+			case NLMSG_ERROR:
+				err = NLMSG_DATA(nlh);
+				return err->error;
+			default:
+				cb(NLMSG_DATA(nlh) + GENL_HDRLEN,
+				   nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+				   ctx);
 			}
 		}
 	}
-	if (sample_mask & SAMPLE_CPUMAP_KTHREAD_CNT) {
-		rec->kthread.cpu = alloc_records(libbpf_num_possible_cpus());
-		if (!rec->kthread.cpu) {
-			pr_warn("Failed to allocate kthread per-CPU array\n");
-			goto end_redir;
+}
+
+#define nla_for_each(nla, attrs, len)                                   \
+	for ((nla) = (attrs); (len) >= (int)sizeof(*(nla)) &&           \
+	     (nla)->nla_len >= sizeof(*(nla)) && (nla)->nla_len <= (len); \
+	     (len) -= NLA_ALIGN((nla)->nla_len),                         \
+	     (nla) = (void *)(nla) + NLA_ALIGN((nla)->nla_len))
+
+/* Counters are sent as 32 or 64 bits, depending on their value */
+static __u64 nla_get_uint(const struct nlattr *nla)
+{
+	const void *data = (const char *)nla + NLA_HDRLEN;
+
+	if (nla->nla_len - NLA_HDRLEN >= (int)sizeof(__u64))
+		return *(const __u64 *)data;
+	return *(const __u32 *)data;
+}
+
+static void nl_family_cb(struct nlattr *attrs, int len, void *ctx)
+{
+	struct nlattr *nla;
+
+	nla_for_each(nla, attrs, len)
+		if (nla->nla_type == CTRL_ATTR_FAMILY_ID)
+			*(__u16 *)ctx = *(__u16 *)((char *)nla + NLA_HDRLEN);
+}
+
+struct nic_rxq_ctx {
+	struct record *rec;	/* NULL to only count the queues */
+	int num;
+};
+
+static void nic_rxq_cb(struct nlattr *attrs, int len, void *ctx)
+{
+	struct nic_rxq_ctx *c = ctx;
+	struct datarec val = {};
+	__u32 type = -1, id = -1;
+	struct nlattr *nla;
+
+	nla_for_each(nla, attrs, len) {
+		switch (nla->nla_type) {
+		case NETDEV_A_QSTATS_QUEUE_TYPE:
+			type = nla_get_uint(nla);
+			break;
+		case NETDEV_A_QSTATS_QUEUE_ID:
+			id = nla_get_uint(nla);
+			break;
+		case NETDEV_A_QSTATS_RX_PACKETS:
+			val.processed = nla_get_uint(nla);
+			break;
+		case NETDEV_A_QSTATS_RX_HW_DROPS:
+			val.dropped = nla_get_uint(nla);
+			break;
+		case NETDEV_A_QSTATS_RX_ALLOC_FAIL:
+			val.issue = nla_get_uint(nla);
+			break;
+		case NETDEV_A_QSTATS_RX_HW_DROP_OVERRUNS:
+			val.info = nla_get_uint(nla);
+			break;
 		}
 	}
-	if (sample_mask & SAMPLE_EXCEPTION_CNT) {
-		for (i = 0; i < XDP_ACTION_MAX; i++) {
-			rec->exception[i].cpu = alloc_records(libbpf_num_possible_cpus());
-			if (!rec->exception[i].cpu) {
-				pr_warn("Failed to allocate exception per-CPU array for \"%s\" case\n",
-					xdp_action2str(i));
-				while (i--)
-					free(rec->exception[i].cpu);
-				goto end_kthread;
-			}
-		}
+
+	if (type != NETDEV_QUEUE_TYPE_RX || id == (__u32)-1)
+		return;
+
+	if (!c->rec) {
+		if (id >= (__u32)c->num)
+			c->num = id + 1;
+		return;
 	}
-	if (sample_mask & SAMPLE_DEVMAP_XMIT_CNT) {
-		rec->devmap_xmit.cpu = alloc_records(libbpf_num_possible_cpus());
-		if (!rec->devmap_xmit.cpu) {
-			pr_warn("Failed to allocate devmap_xmit per-CPU array\n");
-			goto end_exception;
-		}
+
+	/* Queues added since the start are left out */
+	if (id >= (__u32)sample_n_nic_rxqs)
+		return;
+	c->rec->rxq[id] = val;
+	c->rec->total.processed += val.processed;
+	c->rec->total.dropped += val.dropped;
+	c->rec->total.issue += val.issue;
+	c->rec->total.info += val.info;
+}
+
+static int nic_rxq_dump(struct nic_rxq_ctx *ctx)
+{
+	__u32 scope = NETDEV_QSTATS_SCOPE_QUEUE;
+	__u32 ifidx = sample_nic_ifindex;
+	struct nl_req req;
+
+	nl_req_init(&req, sample_nl_family, NLM_F_DUMP, NETDEV_CMD_QSTATS_GET);
+	nl_req_add_attr(&req, NETDEV_A_QSTATS_IFINDEX, &ifidx, sizeof(ifidx));
+	nl_req_add_attr(&req, NETDEV_A_QSTATS_SCOPE, &scope, sizeof(scope));
+	return nl_request(&req, nic_rxq_cb, ctx);
+}
+
+static int nic_collect_rxqs(struct record *rec)
+{
+	struct nic_rxq_ctx ctx = { .rec = rec };
+
+	rec->timestamp = gettime();
+	memset(&rec->total, 0, sizeof(rec->total));
+	return nic_rxq_dump(&ctx);
+}
+
+int sample_nic_stats_init(int ifindex)
+{
+	struct nic_rxq_ctx ctx = {};
+	struct nl_req req;
+	int ret;
+
+	sample_nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+			      NETLINK_GENERIC);
+	if (sample_nl_fd < 0)
+		return -errno;
+
+	nl_req_init(&req, GENL_ID_CTRL, NLM_F_ACK, CTRL_CMD_GETFAMILY);
+	nl_req_add_attr(&req, CTRL_ATTR_FAMILY_NAME, NETDEV_FAMILY_NAME,
+			sizeof(NETDEV_FAMILY_NAME));
+	ret = nl_request(&req, nl_family_cb, &sample_nl_family);
+	if (!ret && !sample_nl_family)
+		ret = -ENOENT;
+	if (ret < 0) {
+		pr_debug("Couldn't find the %s netlink family: %s\n",
+			 NETDEV_FAMILY_NAME, strerror(-ret));
+		goto err;
 	}
-	if (sample_mask & SAMPLE_DEVMAP_XMIT_CNT_MULTI)
-		hash_init(rec->xmit_map);
-	if (sample_mask & SAMPLE_CPUMAP_ENQUEUE_CNT) {
-		for (i = 0; i < sample_n_cpus; i++) {
-			rec->enq[i].cpu = alloc_records(libbpf_num_possible_cpus());
-			if (!rec->enq[i].cpu) {
-				pr_warn("Failed to allocate enqueue per-CPU array for CPU %d\n", i);
-				while (i--)
-					free(rec->enq[i].cpu);
-				goto end_devmap_xmit;
-			}
-		}
+
+	/* Drivers without queue stats, or kernels before 6.9, fail the dump */
+	sample_nic_ifindex = ifindex;
+	ret = nic_rxq_dump(&ctx);
+	if (!ret && !ctx.num)
+		ret = -EOPNOTSUPP;
+	if (ret < 0) {
+		pr_debug("Couldn't get the queue stats of ifindex %d: %s\n",
+			 ifindex, strerror(-ret));
+		goto err;
 	}
 
-	return rec;
+	sample_n_nic_rxqs = ctx.num;
+	pr_debug("Got NIC stats for %d rx queues of ifindex %d\n",
+		 sample_n_nic_rxqs, ifindex);
+	return 0;
 
-end_devmap_xmit:
-	free(rec->devmap_xmit.cpu);
-end_exception:
-	for (i = 0; i < XDP_ACTION_MAX; i++)
-		free(rec->exception[i].cpu);
-end_kthread:
-	free(rec->kthread.cpu);
-end_redir:
-	for (i = 0; i < XDP_REDIRECT_ERR_MAX; i++)
-		free(rec->redir_err[i].cpu);
-end_rxq_cnt:
-	free(rec->rxq_cnt.rxq);
-end_rx_cnt:
-	free(rec->rx_cnt.cpu);
-end_rec:
-	free(rec);
-	return NULL;
+err:
+	close(sample_nl_fd);
+	sample_nl_fd = -1;
+	return ret;
 }
 
-static void free_stats_record(struct stats_record *r)
+/* Point the per-CPU arrays of the enabled records of rec into its arena, and
+ * return the number of entries they take. With rec NULL this only counts, so
+ * __sample_init() can size the arena once.
+ */
+static size_t stats_record_layout(struct stats_record *rec, int mask)
 {
-	struct hlist_node *tmp;
-	struct map_entry *e;
-	unsigned int bkt;
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct datarec *next = rec ? rec->arena : NULL;
+	size_t num = 0;
 	int i;
 
-	for (i = 0; i < sample_n_cpus; i++)
-		free(r->enq[i].cpu);
-	hash_for_each_safe(r->xmit_map, bkt, tmp, e, node) {
-		hash_del(&e->node);
-		free(e->val.cpu);
-		free(e);
-	}
-	free(r->devmap_xmit.cpu);
-	for (i = 0; i < XDP_ACTION_MAX; i++)
-		free(r->exception[i].cpu);
-	free(r->kthread.cpu);
-	for (i = 0; i < XDP_REDIRECT_ERR_MAX; i++)
-		free(r->redir_err[i].cpu);
-	free(r->rx_cnt.cpu);
+#define TAKE(field, n)                          \
+	({                                      \
+		if (rec) {                      \
+			(field) = next;         \
+			next += (n);            \
+		}                               \
+		num += (n);                     \
+	})
+
+	if (mask & SAMPLE_RX_CNT)
+		TAKE(rec->rx_cnt.cpu, nr_cpus);
+	if (mask & SAMPLE_RXQ_STATS)
+		TAKE(rec->rxq_cnt.rxq, sample_n_rxqs);
+	if (mask & SAMPLE_NIC_QUEUE_CNT)
+		TAKE(rec->nic_rxq_cnt.rxq, sample_n_nic_rxqs);
+	if (mask & (SAMPLE_REDIRECT_CNT | SAMPLE_REDIRECT_ERR_CNT))
+		for (i = 0; i < XDP_REDIRECT_ERR_MAX; i++)
+			TAKE(rec->redir_err[i].cpu, nr_cpus);
+	if (mask & SAMPLE_CPUMAP_KTHREAD_CNT)
+		TAKE(rec->kthread.cpu, nr_cpus);
+	if (mask & SAMPLE_CPUMAP_GRO_CNT)
+		TAKE(rec->kthread_gro.cpu, nr_cpus);
+	if (mask & SAMPLE_EXCEPTION_CNT)
+		for (i = 0; i < XDP_ACTION_MAX; i++)
+			TAKE(rec->exception[i].cpu, nr_cpus);
+	if (mask & SAMPLE_DEVMAP_XMIT_CNT)
+		TAKE(rec->devmap_xmit.cpu, nr_cpus);
+	if (mask & SAMPLE_DEVMAP_XMIT_CNT_MULTI)
+		for (i = 0; i < SAMPLE_XMIT_PAIRS_MAX; i++)
+			TAKE(rec->xmit_entries[i].val.cpu, nr_cpus);
+	if (mask & SAMPLE_CPUMAP_ENQUEUE_CNT)
+		for (i = 0; i < sample_n_cpus; i++)
+			TAKE(rec->enq[i].cpu, nr_cpus);
+
+#undef TAKE
+	return num;
+}
+
+/* Number of entries in the arena of each stats record */
+static size_t sample_arena_size;
+
+static struct stats_record *alloc_stats_record(void)
+{
+	struct stats_record *rec;
+
+	rec = calloc(1, sizeof(*rec) + sample_n_cpus * sizeof(struct record));
+	if (!rec) {
+		pr_warn("Failed to allocate memory\n");
+		return NULL;
+	}
+
+	rec->arena = calloc(sample_arena_size ?: 1, sizeof(*rec->arena));
+	if (!rec->arena) {
+		pr_warn("Failed to allocate %zu stats entries\n",
+			sample_arena_size);
+		free(rec);
+		return NULL;
+	}
+	stats_record_layout(rec, sample_mask);
+
+	return rec;
+}
+
+static void free_stats_record(struct stats_record *r)
+{
+	free(r->arena);
 	free(r);
 }
 
@@ -645,8 +882,40 @@ static void stats_get_rx_cnt(struct stats_record *stats_rec,
 	}
 }
 
+/* The NIC's counters of rx queue q; its drops show in terse mode too */
+static void stats_get_nic_rxq(struct stats_record *stats_rec,
+			      struct stats_record *stats_prev, int q)
+{
+	struct record *rec, *prev;
+	double t, pps, drop, nobuf, alloc;
+	struct datarec *r, *p;
+	char str[64];
+
+	if (q >= sample_n_nic_rxqs)
+		return;
+
+	rec = &stats_rec->nic_rxq_cnt;
+	prev = &stats_prev->nic_rxq_cnt;
+	r = &rec->rxq[q];
+	p = &prev->rxq[q];
+	t = calc_period(rec, prev);
+
+	pps = calc_pps(r, p, t);
+	drop = calc_drop_pps(r, p, t);
+	alloc = calc_errs_pps(r, p, t);
+	nobuf = calc_info_pps(r, p, t);
+	if (!pps && !drop && !nobuf && !alloc)
+		return;
+
+	snprintf(str, sizeof(str), "nic:%d", q);
+	print_err(drop || nobuf || alloc,
+		  "    %-18s " FMT_COLUMNf FMT_COLUMNf FMT_COLUMNf FMT_COLUMNf
+		  "\n", str, RX(pps), drop, "hw-drop/s", nobuf, "no-buf/s",
+		  alloc, "alloc-fail/s");
+}
+
 static void stats_get_rxq_cnt(struct stats_record *stats_rec,
-			      struct stats_record *stats_prev)
+			      struct stats_record *stats_prev, int mask)
 {
 	struct record *rec, *prev;
 	double t, pps, drop, err;
@@ -665,16 +934,44 @@ static void stats_get_rxq_cnt(struct stats_record *stats_rec,
 		pps = calc_pps(r, p, t);
 		drop = calc_drop_pps(r, p, t);
 		err = calc_errs_pps(r, p, t);
-		if (!pps && !drop && !err)
-			continue;
+		if (pps || drop || err) {
+			snprintf(str, sizeof(str), "rxq:%d", i);
+			print_default("    %-18s " FMT_COLUMNf FMT_COLUMNf
+				      FMT_COLUMNf "\n",
+				      str, PPS(pps), DROP(drop), ERR(err));
+		}
 
-		snprintf(str, sizeof(str), "rxq:%d", i);
-		print_default("    %-18s " FMT_COLUMNf FMT_COLUMNf FMT_COLUMNf
-			      "\n",
-			      str, PPS(pps), DROP(drop), ERR(err));
+		if (mask & SAMPLE_NIC_QUEUE_CNT)
+			stats_get_nic_rxq(stats_rec, stats_prev, i);
 	}
 }
 
+/* The NIC queue stats on their own, for tools without rxq stats */
+static void stats_get_nic_rxq_cnt(struct stats_record *stats_rec,
+				  struct stats_record *stats_prev)
+{
+	struct record *rec = &stats_rec->nic_rxq_cnt;
+	struct record *prev = &stats_prev->nic_rxq_cnt;
+	double t = calc_period(rec, prev);
+	double pps, drop, nobuf, alloc;
+	const char *str;
+	int i;
+
+	pps = calc_pps(&rec->total, &prev->total, t);
+	drop = calc_drop_pps(&rec->total, &prev->total, t);
+	alloc = calc_errs_pps(&rec->total, &prev->total, t);
+	nobuf = calc_info_pps(&rec->total, &prev->total, t);
+
+	str = (sample_log_level & LL_DEFAULT) && pps ? "nic rxq total" : "nic rxq";
+	print_err(drop || nobuf || alloc,
+		  "  %-20s " FMT_COLUMNf FMT_COLUMNf FMT_COLUMNf FMT_COLUMNf
+		  "\n", str, RX(pps), drop, "hw-drop/s", nobuf, "no-buf/s",
+		  alloc, "alloc-fail/s");
+
+	for (i = 0; i < sample_n_nic_rxqs; i++)
+		stats_get_nic_rxq(stats_rec, stats_prev, i);
+}
+
 static void stats_get_cpumap_enqueue(struct stats_record *stats_rec,
 				     struct stats_record *stats_prev,
 				     int nr_cpus)
@@ -768,6 +1065,48 @@ static void stats_get_cpumap_remote(struct stats_record *stats_rec,
 	}
 }
 
+/* skbs the kthreads passed to the stack, and the number of segments GRO merged
+ * into them
+ */
+static void stats_get_cpumap_gro(struct stats_record *stats_rec,
+				 struct stats_record *stats_prev,
+				 int nr_cpus)
+{
+	struct record *rec, *prev;
+	double t, skbs, segs;
+	int i;
+
+	rec = &stats_rec->kthread_gro;
+	prev = &stats_prev->kthread_gro;
+	t = calc_period(rec, prev);
+
+	skbs = calc_pps(&rec->total, &prev->total, t);
+	segs = calc_info_pps(&rec->total, &prev->total, t);
+	if (!skbs)
+		return;
+
+	print_default("    %-18s " FMT_COLUMNf FMT_COLUMNf __COLUMN(".2f") "\n",
+		      "gro", skbs, "skb/s", segs, "seg/s", segs / skbs,
+		      "seg-avg");
+
+	for (i = 0; i < nr_cpus; i++) {
+		struct datarec *r = &rec->cpu[i];
+		struct datarec *p = &prev->cpu[i];
+		char str[64];
+
+		skbs = calc_pps(r, p, t);
+		segs = calc_info_pps(r, p, t);
+		if (!skbs)
+			continue;
+
+		snprintf(str, sizeof(str), "cpu:%d", i);
+		print_default("      %-16s " FMT_COLUMNf FMT_COLUMNf
+			      __COLUMN(".2f") "\n",
+			      str, skbs, "skb/s", segs, "seg/s", segs / skbs,
+			      "seg-avg");
+	}
+}
+
 static void stats_get_cpumap_kthread(struct stats_record *stats_rec,
 				     struct stats_record *stats_prev,
 				     int nr_cpus)
@@ -804,6 +1143,9 @@ static void stats_get_cpumap_kthread(struct stats_record *stats_rec,
 			      "\n",
 			      str, PPS(pps), DROP(drop), err, "sched");
 	}
+
+	if (sample_mask & SAMPLE_CPUMAP_GRO_CNT)
+		stats_get_cpumap_gro(stats_rec, stats_prev, nr_cpus);
 }
 
 static void stats_get_redirect_cnt(struct stats_record *stats_rec,
@@ -992,11 +1334,10 @@ static void stats_get_devmap_xmit_multi(struct stats_record *stats_rec,
 	double pps, drop, info, err;
 	struct map_entry *entry;
 	struct record *r, *p;
-	unsigned int bkt;
 	double t;
 
-	hash_for_each(stats_rec->xmit_map, bkt, entry, node) {
-		struct map_entry *e, *x = NULL;
+	xmit_map_for_each(stats_rec, entry) {
+		struct map_entry *x;
 		char ifname_from[IFNAMSIZ];
 		char ifname_to[IFNAMSIZ];
 		const char *fstr, *tstr;
@@ -1007,7 +1348,7 @@ static void stats_get_devmap_xmit_multi(struct stats_record *stats_rec,
 		__u64 pair;
 		int i;
 
-		prev_time = sample_interval * NANOSEC_PER_SEC;
+		prev_time = sample_interval_ms * 1000000;
 
 		pair = entry->pair;
 		from_idx = pair >> 32;
@@ -1017,12 +1358,7 @@ static void stats_get_devmap_xmit_multi(struct stats_record *stats_rec,
 		beg.timestamp = r->timestamp - prev_time;
 
 		/* Find matching entry from stats_prev map */
-		hash_for_each_possible(stats_prev->xmit_map, e, node, pair) {
-			if (e->pair == pair) {
-				x = e;
-				break;
-			}
-		}
+		x = xmit_map_find(stats_prev, pair, false);
 		if (x)
 			p = &x->val;
 		else
@@ -1117,7 +1453,9 @@ static void stats_print(const char *prefix, int mask, struct stats_record *r,
 	}
 
 	if (mask & SAMPLE_RXQ_STATS)
-		stats_get_rxq_cnt(r, p);
+		stats_get_rxq_cnt(r, p, mask);
+	else if (mask & SAMPLE_NIC_QUEUE_CNT)
+		stats_get_nic_rxq_cnt(r, p);
 
 	if (mask & SAMPLE_CPUMAP_ENQUEUE_CNT)
 		stats_get_cpumap_enqueue(r, p, nr_cpus);
@@ -1180,67 +1518,465 @@ static void stats_print(const char *prefix, int mask, struct stats_record *r,
 	}
 }
 
-static int get_num_rxqs(const char *ifname)
+/* Machine-readable output: one row per statistic, key and CPU, with the
+ * per-second rate of every datarec field. Totals have no CPU, and rows for
+ * a single CPU or key are left out when all their rates are zero.
+ */
+static __u64 rate(__u64 cur, __u64 prev, double period_)
 {
-	struct ethtool_channels ch = {
-		.cmd = ETHTOOL_GCHANNELS,
-	};
+	if (period_ <= 0)
+		return 0;
+	return sample_round((cur - prev) / period_);
+}
 
-	struct ifreq ifr = {
-		.ifr_data = (void *)&ch,
-	};
-	int fd, ret;
+static void row_print_str(const char *str)
+{
+	const char *c;
 
-	if (!ifname || strlen(ifname) > sizeof(ifr.ifr_name) - 1)
-		return 0;
+	if (sample_format == SAMPLE_OUTPUT_CSV &&
+	    !strpbrk(str, ",\"\n")) {
+		fputs(str, stdout);
+		return;
+	}
 
-	strcpy(ifr.ifr_name, ifname);
-	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
-	if (fd < 0) {
-		ret = -errno;
-		pr_warn("Couldn't open socket socket: %s\n", strerror(-ret));
-		return ret;
+	putchar('"');
+	for (c = str; *c; c++) {
+		if (*c == '"')
+			fputs(sample_format == SAMPLE_OUTPUT_CSV ? "\"\"" : "\\\"", stdout);
+		else if (*c == '\\' && sample_format == SAMPLE_OUTPUT_JSON)
+			fputs("\\\\", stdout);
+		else
+			putchar(*c);
 	}
+	putchar('"');
+}
 
-	ret = ioctl(fd, SIOCETHTOOL, &ifr);
-	if (ret < 0) {
-		ret = -errno;
-		pr_debug("Error in ethtool ioctl: %s\n", strerror(-ret));
-		goto out;
+void sample_print_row(const char *stat, const char *key, int cpu,
+		      __u64 timestamp, const struct datarec *rates)
+{
+	const __u64 vals[] = { rates->processed, rates->dropped, rates->issue,
+			       rates->info, rates->xdp_drop,
+			       rates->xdp_redirect };
+	static const char *names[] = { "pkt", "drop", "issue", "info",
+				       "xdp_drop", "xdp_redirect" };
+	struct timespec mono, real;
+	size_t i;
+
+	/* Rows carry wall clock time, records are stamped with CLOCK_MONOTONIC */
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	timestamp += ((__u64)real.tv_sec - mono.tv_sec) * NANOSEC_PER_SEC +
+		     real.tv_nsec - mono.tv_nsec;
+
+	if (sample_format == SAMPLE_OUTPUT_CSV) {
+		if (!sample_csv_header_done) {
+			printf("timestamp,stat,key,cpu");
+			for (i = 0; i < sizeof(names) / sizeof(*names); i++)
+				printf(",%s", names[i]);
+			printf("\n");
+			sample_csv_header_done = true;
+		}
+
+		printf("%llu,%s,", timestamp, stat);
+		if (key)
+			row_print_str(key);
+		putchar(',');
+		if (cpu >= 0)
+			printf("%d", cpu);
+		for (i = 0; i < sizeof(vals) / sizeof(*vals); i++)
+			printf(",%llu", vals[i]);
+		printf("\n");
+		return;
 	}
 
-	ret = ch.rx_count + ch.combined_count;
-out:
-	close(fd);
-	pr_debug("Got %d queues for ifname %s\n", ret, ifname);
-	return ret;
+	printf("{\"timestamp\":%llu,\"stat\":\"%s\"", timestamp, stat);
+	if (key) {
+		printf(",\"key\":");
+		row_print_str(key);
+	}
+	if (cpu >= 0)
+		printf(",\"cpu\":%d", cpu);
+	for (i = 0; i < sizeof(vals) / sizeof(*vals); i++)
+		printf(",\"%s\":%llu", names[i], vals[i]);
+	printf("}\n");
 }
 
+static bool rates_calc(struct datarec *rates, const struct datarec *r,
+		       const struct datarec *p, double t)
+{
+	rates->processed = rate(r->processed, p->processed, t);
+	rates->dropped = rate(r->dropped, p->dropped, t);
+	rates->issue = rate(r->issue, p->issue, t);
+	rates->info = rate(r->info, p->info, t);
+	rates->xdp_drop = rate(r->xdp_drop, p->xdp_drop, t);
+	rates->xdp_redirect = rate(r->xdp_redirect, p->xdp_redirect, t);
+
+	return rates->processed || rates->dropped || rates->issue ||
+	       rates->info || rates->xdp_drop || rates->xdp_redirect;
+}
 
-int sample_setup_maps(struct bpf_map **maps, const char *ifname)
+/* Print the total of a record, and the CPUs that saw any traffic. With
+ * keyed set, an idle total is skipped too.
+ */
+static void rows_print_record(const char *stat, const char *key,
+			      struct record *r, struct record *p,
+			      bool keyed)
 {
-	sample_n_cpus = libbpf_num_possible_cpus();
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct datarec rates, empty = {};
+	double t = calc_period(r, p);
+	int i;
 
-	for (int i = 0; i < MAP_DEVMAP_XMIT_MULTI; i++) {
-		sample_map[i] = maps[i];
-		int n_cpus;
+	if (rates_calc(&rates, &r->total, &p->total, t) || !keyed)
+		sample_print_row(stat, key, -1, r->timestamp, &rates);
 
-		switch (i) {
-		case MAP_RX:
-		case MAP_CPUMAP_KTHREAD:
-		case MAP_DEVMAP_XMIT:
-			sample_map_count[i] = sample_n_cpus;
-			break;
-		case MAP_RXQ:
-			sample_n_rxqs = get_num_rxqs(ifname);
-			sample_map_count[i] = sample_n_rxqs > 0 ? sample_n_rxqs : 1;
-			break;
-		case MAP_REDIRECT_ERR:
-			sample_map_count[i] =
-				XDP_REDIRECT_ERR_MAX * sample_n_cpus;
-			break;
-		case MAP_EXCEPTION:
-			sample_map_count[i] = XDP_ACTION_MAX * sample_n_cpus;
+	for (i = 0; i < nr_cpus; i++)
+		if (rates_calc(&rates, &r->cpu[i], p->cpu ? &p->cpu[i] : &empty, t))
+			sample_print_row(stat, key, i, r->timestamp, &rates);
+}
+
+static void rows_print(int mask, struct stats_record *r, struct stats_record *p)
+{
+	struct datarec rates;
+	struct map_entry *entry;
+	char key[64];
+	int i;
+
+	if (mask & SAMPLE_RX_CNT)
+		rows_print_record("rx", NULL, &r->rx_cnt, &p->rx_cnt, false);
+
+	if (mask & SAMPLE_RXQ_STATS) {
+		double t = calc_period(&r->rxq_cnt, &p->rxq_cnt);
+
+		for (i = 0; i < sample_n_rxqs; i++) {
+			if (!rates_calc(&rates, &r->rxq_cnt.rxq[i],
+					&p->rxq_cnt.rxq[i], t))
+				continue;
+			snprintf(key, sizeof(key), "%d", i);
+			sample_print_row("rxq", key, -1, r->rxq_cnt.timestamp,
+					 &rates);
+		}
+	}
+
+	if (mask & SAMPLE_NIC_QUEUE_CNT) {
+		double t = calc_period(&r->nic_rxq_cnt, &p->nic_rxq_cnt);
+
+		for (i = 0; i < sample_n_nic_rxqs; i++) {
+			if (!rates_calc(&rates, &r->nic_rxq_cnt.rxq[i],
+					&p->nic_rxq_cnt.rxq[i], t))
+				continue;
+			snprintf(key, sizeof(key), "%d", i);
+			sample_print_row("nic_rxq", key, -1,
+					 r->nic_rxq_cnt.timestamp, &rates);
+		}
+	}
+
+	if (mask & SAMPLE_CPUMAP_ENQUEUE_CNT) {
+		for (i = 0; i < sample_n_cpus; i++) {
+			snprintf(key, sizeof(key), "%d", i);
+			rows_print_record("cpumap_enqueue", key, &r->enq[i],
+					  &p->enq[i], true);
+		}
+	}
+
+	if (mask & SAMPLE_CPUMAP_KTHREAD_CNT)
+		rows_print_record("cpumap_kthread", NULL, &r->kthread,
+				  &p->kthread, false);
+
+	if (mask & SAMPLE_CPUMAP_GRO_CNT)
+		rows_print_record("cpumap_gro", NULL, &r->kthread_gro,
+				  &p->kthread_gro, false);
+
+	if (mask & SAMPLE_REDIRECT_CNT)
+		rows_print_record("redirect", NULL, &r->redir_err[0],
+				  &p->redir_err[0], false);
+
+	if (mask & SAMPLE_REDIRECT_ERR_CNT)
+		for (i = 1; i < XDP_REDIRECT_ERR_MAX; i++)
+			rows_print_record("redirect_err", xdp_redirect_err_names[i],
+					  &r->redir_err[i], &p->redir_err[i], true);
+
+	if (mask & SAMPLE_EXCEPTION_CNT)
+		for (i = 0; i < XDP_ACTION_MAX; i++)
+			rows_print_record("exception", xdp_action2str(i),
+					  &r->exception[i], &p->exception[i], true);
+
+	if (mask & SAMPLE_DEVMAP_XMIT_CNT)
+		rows_print_record("devmap_xmit", NULL, &r->devmap_xmit,
+				  &p->devmap_xmit, false);
+
+	if (mask & SAMPLE_DEVMAP_XMIT_CNT_MULTI) {
+		xmit_map_for_each(r, entry) {
+			char ifname_from[IFNAMSIZ], ifname_to[IFNAMSIZ];
+			struct record beg = {}, *prev = &beg;
+			const char *fstr, *tstr;
+			struct map_entry *e;
+
+			/* A new pair counts from zero, one interval ago */
+			beg.timestamp = entry->val.timestamp -
+					sample_interval_ms * 1000000;
+			e = xmit_map_find(p, entry->pair, false);
+			if (e)
+				prev = &e->val;
+
+			fstr = if_indextoname(entry->pair >> 32, ifname_from);
+			tstr = if_indextoname(entry->pair & 0xFFFFFFFF, ifname_to);
+			snprintf(key, sizeof(key), "%s->%s", fstr ?: "?", tstr ?: "?");
+			rows_print_record("devmap_xmit_multi", key, &entry->val,
+					  prev, true);
+		}
+	}
+
+	fflush(stdout);
+}
+
+/* OpenMetrics output: the counters are the totals since the maps were
+ * created, so a scrape needs a single collection and no previous record.
+ */
+struct om_field {
+	const char *name;
+	const char *help;
+	size_t off;
+};
+
+#define OM_FIELD(_name, _help, _field) \
+	{ _name, _help, offsetof(struct datarec, _field) }
+
+static const struct om_field om_rx_fields[] = {
+	OM_FIELD("xdp_rx_packets", "Packets received by the XDP program", processed),
+	OM_FIELD("xdp_rx_drops", "Packets dropped by the XDP program", dropped),
+	OM_FIELD("xdp_rx_errors", "Packets the XDP program failed to handle", issue),
+};
+
+static const struct om_field om_enqueue_fields[] = {
+	OM_FIELD("xdp_cpumap_enqueue_packets", "Packets enqueued to a cpumap CPU", processed),
+	OM_FIELD("xdp_cpumap_enqueue_drops", "Packets dropped enqueueing to a cpumap CPU", dropped),
+	OM_FIELD("xdp_cpumap_enqueue_bulks", "Bulk enqueue events to a cpumap CPU", issue),
+};
+
+static const struct om_field om_kthread_fields[] = {
+	OM_FIELD("xdp_cpumap_kthread_packets", "Packets processed by the cpumap kthreads", processed),
+	OM_FIELD("xdp_cpumap_kthread_drops", "Packets dropped by the cpumap kthreads", dropped),
+	OM_FIELD("xdp_cpumap_kthread_schedules", "Times a cpumap kthread called schedule()", issue),
+	OM_FIELD("xdp_cpumap_kthread_pass", "XDP_PASS verdicts of cpumap programs", xdp_pass),
+	OM_FIELD("xdp_cpumap_kthread_xdp_drops", "XDP_DROP verdicts of cpumap programs", xdp_drop),
+	OM_FIELD("xdp_cpumap_kthread_redirects", "XDP_REDIRECT verdicts of cpumap programs", xdp_redirect),
+};
+
+static const struct om_field om_gro_fields[] = {
+	OM_FIELD("xdp_cpumap_gro_skbs", "skbs passed to the stack by the cpumap kthreads", processed),
+	OM_FIELD("xdp_cpumap_gro_segments", "Segments merged into the skbs of the cpumap kthreads", info),
+};
+
+static const struct om_field om_xmit_fields[] = {
+	OM_FIELD("xdp_devmap_xmit_packets", "Packets sent through a devmap", processed),
+	OM_FIELD("xdp_devmap_xmit_drops", "Packets that failed to send through a devmap", dropped),
+	OM_FIELD("xdp_devmap_xmit_errors", "Driver errors sending through a devmap", issue),
+	OM_FIELD("xdp_devmap_xmit_bulks", "Bulk send events through a devmap", info),
+};
+
+static const struct om_field om_xmit_multi_fields[] = {
+	OM_FIELD("xdp_devmap_xmit_multi_packets", "Packets sent from one interface to another", processed),
+	OM_FIELD("xdp_devmap_xmit_multi_drops", "Packets that failed to send from one interface to another", dropped),
+	OM_FIELD("xdp_devmap_xmit_multi_errors", "Driver errors sending from one interface to another", issue),
+	OM_FIELD("xdp_devmap_xmit_multi_bulks", "Bulk send events from one interface to another", info),
+};
+
+static void om_header(FILE *f, const char *name, const char *help)
+{
+	fprintf(f, "# TYPE %s counter\n# HELP %s %s\n", name, name, help);
+}
+
+static void om_sample(FILE *f, const char *name, const char *labels,
+		      const struct datarec *r, size_t off)
+{
+	__u64 val = *(const size_t *)((const char *)r + off);
+
+	if (labels)
+		fprintf(f, "%s_total{%s} %llu\n", name, labels, val);
+	else
+		fprintf(f, "%s_total %llu\n", name, val);
+}
+
+static void om_print_fields(FILE *f, const struct om_field *fields,
+			    size_t num, const struct datarec *r)
+{
+	size_t i;
+
+	for (i = 0; i < num; i++) {
+		om_header(f, fields[i].name, fields[i].help);
+		om_sample(f, fields[i].name, NULL, r, fields[i].off);
+	}
+}
+
+static void om_print(FILE *f, int mask, struct stats_record *r)
+{
+	char labels[128], ifname_from[IFNAMSIZ], ifname_to[IFNAMSIZ];
+	const char *fstr, *tstr;
+	struct map_entry *entry;
+	size_t j;
+	int i;
+
+	if (mask & SAMPLE_RX_CNT)
+		om_print_fields(f, om_rx_fields, ARRAY_SIZE(om_rx_fields),
+				&r->rx_cnt.total);
+
+	if (mask & SAMPLE_REDIRECT_CNT) {
+		om_header(f, "xdp_redirect_packets", "Packets redirected");
+		om_sample(f, "xdp_redirect_packets", NULL, &r->redir_err[0].total,
+			  offsetof(struct datarec, processed));
+	}
+
+	if (mask & SAMPLE_REDIRECT_ERR_CNT) {
+		om_header(f, "xdp_redirect_errors", "Failed redirects, by error");
+		for (i = 1; i < XDP_REDIRECT_ERR_MAX; i++) {
+			snprintf(labels, sizeof(labels), "error=\"%s\"",
+				 xdp_redirect_err_names[i]);
+			om_sample(f, "xdp_redirect_errors", labels,
+				  &r->redir_err[i].total,
+				  offsetof(struct datarec, dropped));
+		}
+	}
+
+	if (mask & SAMPLE_CPUMAP_ENQUEUE_CNT) {
+		for (j = 0; j < ARRAY_SIZE(om_enqueue_fields); j++) {
+			om_header(f, om_enqueue_fields[j].name,
+				  om_enqueue_fields[j].help);
+			for (i = 0; i < sample_n_cpus; i++) {
+				snprintf(labels, sizeof(labels), "cpu=\"%d\"", i);
+				om_sample(f, om_enqueue_fields[j].name, labels,
+					  &r->enq[i].total, om_enqueue_fields[j].off);
+			}
+		}
+	}
+
+	if (mask & SAMPLE_CPUMAP_KTHREAD_CNT)
+		om_print_fields(f, om_kthread_fields,
+				ARRAY_SIZE(om_kthread_fields), &r->kthread.total);
+
+	if (mask & SAMPLE_CPUMAP_GRO_CNT)
+		om_print_fields(f, om_gro_fields, ARRAY_SIZE(om_gro_fields),
+				&r->kthread_gro.total);
+
+	if (mask & SAMPLE_EXCEPTION_CNT) {
+		om_header(f, "xdp_exceptions", "xdp_exception events, by action");
+		for (i = 0; i < XDP_ACTION_MAX; i++) {
+			snprintf(labels, sizeof(labels), "action=\"%s\"",
+				 xdp_action2str(i));
+			om_sample(f, "xdp_exceptions", labels,
+				  &r->exception[i].total,
+				  offsetof(struct datarec, dropped));
+		}
+	}
+
+	if (mask & SAMPLE_DEVMAP_XMIT_CNT)
+		om_print_fields(f, om_xmit_fields, ARRAY_SIZE(om_xmit_fields),
+				&r->devmap_xmit.total);
+
+	if (mask & SAMPLE_DEVMAP_XMIT_CNT_MULTI) {
+		for (j = 0; j < ARRAY_SIZE(om_xmit_multi_fields); j++) {
+			om_header(f, om_xmit_multi_fields[j].name,
+				  om_xmit_multi_fields[j].help);
+			xmit_map_for_each(r, entry) {
+				fstr = if_indextoname(entry->pair >> 32, ifname_from);
+				tstr = if_indextoname(entry->pair & 0xFFFFFFFF,
+						      ifname_to);
+				snprintf(labels, sizeof(labels),
+					 "from=\"%s\",to=\"%s\"", fstr ?: "?",
+					 tstr ?: "?");
+				om_sample(f, om_xmit_multi_fields[j].name, labels,
+					  &entry->val.total,
+					  om_xmit_multi_fields[j].off);
+			}
+		}
+	}
+}
+
+void sample_set_output_format(enum sample_output_format format)
+{
+	sample_format = format;
+}
+
+int sample_add_print_cb(void (*print_cb)(void *ctx), void *ctx)
+{
+	if (sample_num_print_cbs == SAMPLE_MAX_PRINT_CBS)
+		return -E2BIG;
+
+	sample_print_cbs[sample_num_print_cbs].cb = print_cb;
+	sample_print_cbs[sample_num_print_cbs].ctx = ctx;
+	sample_num_print_cbs++;
+	return 0;
+}
+
+bool sample_output_is_text(void)
+{
+	return sample_format == SAMPLE_OUTPUT_TEXT;
+}
+
+int get_num_rxqs(const char *ifname)
+{
+	struct ethtool_channels ch = {
+		.cmd = ETHTOOL_GCHANNELS,
+	};
+
+	struct ifreq ifr = {
+		.ifr_data = (void *)&ch,
+	};
+	int fd, ret;
+
+	if (!ifname || strlen(ifname) > sizeof(ifr.ifr_name) - 1)
+		return 0;
+
+	strcpy(ifr.ifr_name, ifname);
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		ret = -errno;
+		pr_warn("Couldn't open socket socket: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	ret = ioctl(fd, SIOCETHTOOL, &ifr);
+	if (ret < 0) {
+		ret = -errno;
+		pr_debug("Error in ethtool ioctl: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	ret = ch.rx_count + ch.combined_count;
+out:
+	close(fd);
+	pr_debug("Got %d queues for ifname %s\n", ret, ifname);
+	return ret;
+}
+
+
+int sample_setup_maps(struct bpf_map **maps, const char *ifname)
+{
+	sample_n_cpus = libbpf_num_possible_cpus();
+
+	for (int i = 0; i < MAP_DEVMAP_XMIT_MULTI; i++) {
+		sample_map[i] = maps[i];
+		int n_cpus;
+
+		switch (i) {
+		case MAP_RX:
+		case MAP_DEVMAP_XMIT:
+			sample_map_count[i] = sample_n_cpus;
+			break;
+		case MAP_CPUMAP_KTHREAD:
+			/* The second half holds the GRO counters */
+			sample_map_count[i] = 2 * sample_n_cpus;
+			break;
+		case MAP_RXQ:
+			sample_n_rxqs = get_num_rxqs(ifname);
+			sample_map_count[i] = sample_n_rxqs > 0 ? sample_n_rxqs : 1;
+			break;
+		case MAP_REDIRECT_ERR:
+			sample_map_count[i] =
+				XDP_REDIRECT_ERR_MAX * sample_n_cpus;
+			break;
+		case MAP_EXCEPTION:
+			sample_map_count[i] = XDP_ACTION_MAX * sample_n_cpus;
 			break;
 		case MAP_CPUMAP_ENQUEUE:
 			if (__builtin_mul_overflow(sample_n_cpus, sample_n_cpus, &n_cpus))
@@ -1279,6 +2015,11 @@ int __sample_init(int mask, int ifindex_from, int ifindex_to)
 		return -EINVAL;
 	}
 
+	if (mask & SAMPLE_NIC_QUEUE_CNT && sample_n_nic_rxqs <= 0) {
+		pr_warn("NIC queue stats need sample_nic_stats_init()\n");
+		return -EINVAL;
+	}
+
 	sigemptyset(&st);
 	sigaddset(&st, SIGQUIT);
 	sigaddset(&st, SIGINT);
@@ -1295,9 +2036,60 @@ int __sample_init(int mask, int ifindex_from, int ifindex_to)
 	ifindex[0] = ifindex_from;
 	ifindex[1] = ifindex_to;
 
+	sample_arena_size = stats_record_layout(NULL, mask);
+	if (mask & SAMPLE_DEVMAP_XMIT_CNT_MULTI && devmap_batch_alloc() < 0)
+		return -ENOMEM;
+
 	return sample_setup_maps_mappings();
 }
 
+static int cmp_u64(const void *a, const void *b)
+{
+	__u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sort the recorded rates into sample_hist.sorted, returning how many */
+static size_t sample_hist_sort(const __u64 *vals)
+{
+	size_t n = sample_hist.num < SAMPLE_HIST_SIZE ? sample_hist.num :
+							SAMPLE_HIST_SIZE;
+
+	memcpy(sample_hist.sorted, vals, n * sizeof(*vals));
+	qsort(sample_hist.sorted, n, sizeof(*vals), cmp_u64);
+	return n;
+}
+
+static __u64 sample_hist_p99(size_t n)
+{
+	return sample_hist.sorted[(n * 99 + 99) / 100 - 1];
+}
+
+static void sample_summary_print_spread(void)
+{
+	size_t n;
+
+	if (sample_hist.num < 2)
+		return;
+
+	if (sample_out.totals.rx) {
+		n = sample_hist_sort(sample_hist.rx);
+		print_always("  Min/p99/max rx/s    : %'llu / %'llu / %'llu\n",
+			     sample_hist.sorted[0], sample_hist_p99(n),
+			     sample_hist.sorted[n - 1]);
+	}
+
+	n = sample_hist_sort(sample_hist.err);
+	if (sample_hist.sorted[n - 1])
+		print_always("  p99/max err,drop/s  : %'llu / %'llu\n",
+			     sample_hist_p99(n), sample_hist.sorted[n - 1]);
+
+	if (sample_hist.num > SAMPLE_HIST_SIZE)
+		print_always("  (spread over the last %d of %zu intervals)\n",
+			     SAMPLE_HIST_SIZE, sample_hist.num);
+}
+
 static void sample_summary_print(void)
 {
 	double num = sample_out.rx_cnt.num;
@@ -1335,65 +2127,311 @@ static void sample_summary_print(void)
 		print_always("  Average transmit/s  : %'-10.0f\n",
 			     sample_round(pkts / num));
 	}
+	sample_summary_print_spread();
 }
 
-void sample_teardown(void)
+/* Collection is split into jobs of one record each, so that with many CPUs
+ * (where the enqueue records alone are n_cpus * n_cpus entries) a few threads
+ * can read the maps in parallel, and the records are stamped closer to the
+ * start of the interval.
+ */
+enum collect_kind {
+	COLLECT_RX,
+	COLLECT_RXQ,
+	COLLECT_NIC_RXQ,
+	COLLECT_REDIRECT_ERR,
+	COLLECT_CPUMAP_ENQUEUE,
+	COLLECT_CPUMAP_KTHREAD,
+	COLLECT_CPUMAP_GRO,
+	COLLECT_EXCEPTION,
+	COLLECT_DEVMAP_XMIT,
+	COLLECT_DEVMAP_XMIT_MULTI,
+};
+
+struct collect_job {
+	enum collect_kind kind;
+	int idx;
+};
+
+/* One collector thread per this many CPUs, besides the polling thread */
+#define SAMPLE_COLLECT_CPUS_PER_THREAD 64
+#define SAMPLE_COLLECT_MAX_THREADS 4
+
+static struct {
+	struct collect_job *jobs;
+	int num_jobs;
+	pthread_t threads[SAMPLE_COLLECT_MAX_THREADS];
+	int num_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	/* Bumped for every collection, so workers know there's work */
+	unsigned int gen;
+	int busy;
+	bool stop;
+	struct stats_record *rec;
+	int next_job;
+	int ret;
+	bool started;
+} sample_collect = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static int collect_job_run(const struct collect_job *job,
+			   struct stats_record *rec)
 {
-	size_t size;
+	int i = job->idx;
 
-	for (int i = 0; i < NUM_MAP; i++) {
-		size = sample_map_count[i] * sizeof(**sample_mmap);
-		munmap(sample_mmap[i], size);
+	switch (job->kind) {
+	case COLLECT_RX:
+		map_collect_percpu(sample_mmap[MAP_RX], &rec->rx_cnt);
+		break;
+	case COLLECT_RXQ:
+		map_collect_rxqs(sample_mmap[MAP_RXQ], &rec->rxq_cnt);
+		break;
+	case COLLECT_NIC_RXQ:
+		return nic_collect_rxqs(&rec->nic_rxq_cnt);
+	case COLLECT_REDIRECT_ERR:
+		map_collect_percpu(&sample_mmap[MAP_REDIRECT_ERR][i * sample_n_cpus],
+				   &rec->redir_err[i]);
+		break;
+	case COLLECT_CPUMAP_ENQUEUE:
+		map_collect_percpu(&sample_mmap[MAP_CPUMAP_ENQUEUE][i * sample_n_cpus],
+				   &rec->enq[i]);
+		break;
+	case COLLECT_CPUMAP_KTHREAD:
+		map_collect_percpu(sample_mmap[MAP_CPUMAP_KTHREAD],
+				   &rec->kthread);
+		break;
+	case COLLECT_CPUMAP_GRO:
+		map_collect_percpu(&sample_mmap[MAP_CPUMAP_KTHREAD][sample_n_cpus],
+				   &rec->kthread_gro);
+		break;
+	case COLLECT_EXCEPTION:
+		map_collect_percpu(&sample_mmap[MAP_EXCEPTION][i * sample_n_cpus],
+				   &rec->exception[i]);
+		break;
+	case COLLECT_DEVMAP_XMIT:
+		map_collect_percpu(sample_mmap[MAP_DEVMAP_XMIT], &rec->devmap_xmit);
+		break;
+	case COLLECT_DEVMAP_XMIT_MULTI:
+		if (map_collect_percpu_devmap(bpf_map__fd(sample_map[MAP_DEVMAP_XMIT_MULTI]), rec) < 0)
+			return -EINVAL;
+		break;
 	}
-	sample_summary_print();
-	close(sample_sig_fd);
+	return 0;
 }
 
-static int sample_stats_collect(struct stats_record *rec)
+static int collect_jobs_add(enum collect_kind kind, int first, int last)
 {
-	int i;
+	struct collect_job *jobs;
+	int n = last - first;
 
-	if (sample_mask & SAMPLE_RX_CNT)
-		map_collect_percpu(sample_mmap[MAP_RX], &rec->rx_cnt);
+	jobs = reallocarray(sample_collect.jobs, sample_collect.num_jobs + n,
+			    sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
 
-	if (sample_mask & SAMPLE_RXQ_STATS)
-		map_collect_rxqs(sample_mmap[MAP_RXQ], &rec->rxq_cnt);
+	sample_collect.jobs = jobs;
+	for (; first < last; first++)
+		jobs[sample_collect.num_jobs++] = (struct collect_job){ kind, first };
+	return 0;
+}
 
+/* The devmap_xmit_multi and NIC jobs are added first, as they do syscalls and
+ * take the longest, then the enqueue records that make up most of the rest.
+ */
+static int collect_jobs_init(void)
+{
+	int ret = 0;
+
+	if (sample_mask & SAMPLE_DEVMAP_XMIT_CNT_MULTI)
+		ret = ret ?: collect_jobs_add(COLLECT_DEVMAP_XMIT_MULTI, 0, 1);
+	if (sample_mask & SAMPLE_NIC_QUEUE_CNT)
+		ret = ret ?: collect_jobs_add(COLLECT_NIC_RXQ, 0, 1);
+	if (sample_mask & SAMPLE_CPUMAP_ENQUEUE_CNT)
+		ret = ret ?: collect_jobs_add(COLLECT_CPUMAP_ENQUEUE, 0, sample_n_cpus);
+	if (sample_mask & SAMPLE_RX_CNT)
+		ret = ret ?: collect_jobs_add(COLLECT_RX, 0, 1);
+	if (sample_mask & SAMPLE_RXQ_STATS)
+		ret = ret ?: collect_jobs_add(COLLECT_RXQ, 0, 1);
 	if (sample_mask & SAMPLE_REDIRECT_CNT)
-		map_collect_percpu(sample_mmap[MAP_REDIRECT_ERR], &rec->redir_err[0]);
+		ret = ret ?: collect_jobs_add(COLLECT_REDIRECT_ERR, 0, 1);
+	if (sample_mask & SAMPLE_REDIRECT_ERR_CNT)
+		ret = ret ?: collect_jobs_add(COLLECT_REDIRECT_ERR, 1,
+					      XDP_REDIRECT_ERR_MAX);
+	if (sample_mask & SAMPLE_CPUMAP_KTHREAD_CNT)
+		ret = ret ?: collect_jobs_add(COLLECT_CPUMAP_KTHREAD, 0, 1);
+	if (sample_mask & SAMPLE_CPUMAP_GRO_CNT)
+		ret = ret ?: collect_jobs_add(COLLECT_CPUMAP_GRO, 0, 1);
+	if (sample_mask & SAMPLE_EXCEPTION_CNT)
+		ret = ret ?: collect_jobs_add(COLLECT_EXCEPTION, 0, XDP_ACTION_MAX);
+	if (sample_mask & SAMPLE_DEVMAP_XMIT_CNT)
+		ret = ret ?: collect_jobs_add(COLLECT_DEVMAP_XMIT, 0, 1);
 
-	if (sample_mask & SAMPLE_REDIRECT_ERR_CNT) {
-		for (i = 1; i < XDP_REDIRECT_ERR_MAX; i++)
-			map_collect_percpu(&sample_mmap[MAP_REDIRECT_ERR][i * sample_n_cpus],
-					   &rec->redir_err[i]);
+	return ret;
+}
+
+/* Run jobs until there are none left for this collection */
+static void collect_jobs_run(struct stats_record *rec)
+{
+	int job, ret;
+
+	while ((job = __atomic_fetch_add(&sample_collect.next_job, 1,
+					 __ATOMIC_RELAXED)) < sample_collect.num_jobs) {
+		ret = collect_job_run(&sample_collect.jobs[job], rec);
+		if (ret < 0)
+			__atomic_store_n(&sample_collect.ret, ret, __ATOMIC_RELAXED);
 	}
+}
 
-	if (sample_mask & SAMPLE_CPUMAP_ENQUEUE_CNT)
-		for (i = 0; i < sample_n_cpus; i++)
-			map_collect_percpu(&sample_mmap[MAP_CPUMAP_ENQUEUE][i * sample_n_cpus],
-					   &rec->enq[i]);
+static void *collect_thread(void *arg)
+{
+	unsigned int gen = 0;
 
-	if (sample_mask & SAMPLE_CPUMAP_KTHREAD_CNT)
-		map_collect_percpu(sample_mmap[MAP_CPUMAP_KTHREAD],
-				   &rec->kthread);
+	pthread_mutex_lock(&sample_collect.lock);
+	for (;;) {
+		while (!sample_collect.stop && sample_collect.gen == gen)
+			pthread_cond_wait(&sample_collect.start, &sample_collect.lock);
+		if (sample_collect.stop)
+			break;
+		gen = sample_collect.gen;
+		pthread_mutex_unlock(&sample_collect.lock);
 
-	if (sample_mask & SAMPLE_EXCEPTION_CNT)
-		for (i = 0; i < XDP_ACTION_MAX; i++)
-			map_collect_percpu(&sample_mmap[MAP_EXCEPTION][i * sample_n_cpus],
-					   &rec->exception[i]);
+		collect_jobs_run(sample_collect.rec);
 
-	if (sample_mask & SAMPLE_DEVMAP_XMIT_CNT)
-		map_collect_percpu(sample_mmap[MAP_DEVMAP_XMIT], &rec->devmap_xmit);
+		pthread_mutex_lock(&sample_collect.lock);
+		if (!--sample_collect.busy)
+			pthread_cond_signal(&sample_collect.done);
+	}
+	pthread_mutex_unlock(&sample_collect.lock);
+	return NULL;
+}
 
-	if (sample_mask & SAMPLE_DEVMAP_XMIT_CNT_MULTI) {
-		if (map_collect_percpu_devmap(bpf_map__fd(sample_map[MAP_DEVMAP_XMIT_MULTI]), rec) < 0)
-			return -EINVAL;
+static void collect_threads_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&sample_collect.lock);
+	sample_collect.stop = true;
+	pthread_cond_broadcast(&sample_collect.start);
+	pthread_mutex_unlock(&sample_collect.lock);
+
+	for (i = 0; i < sample_collect.num_threads; i++)
+		pthread_join(sample_collect.threads[i], NULL);
+	sample_collect.num_threads = 0;
+	sample_collect.stop = false;
+	sample_collect.started = false;
+
+	free(sample_collect.jobs);
+	sample_collect.jobs = NULL;
+	sample_collect.num_jobs = 0;
+}
+
+/* Set up the jobs, and the threads if there are enough CPUs to be worth it.
+ * Failing to start a thread isn't fatal, the polling thread collects on its
+ * own then.
+ */
+static int collect_threads_start(void)
+{
+	int n, ret;
+
+	ret = collect_jobs_init();
+	if (ret < 0)
+		return ret;
+
+	n = sample_n_cpus / SAMPLE_COLLECT_CPUS_PER_THREAD;
+	if (n > SAMPLE_COLLECT_MAX_THREADS)
+		n = SAMPLE_COLLECT_MAX_THREADS;
+
+	while (sample_collect.num_threads < n) {
+		ret = pthread_create(&sample_collect.threads[sample_collect.num_threads],
+				     NULL, collect_thread, NULL);
+		if (ret) {
+			pr_debug("Couldn't start stats collection thread: %s\n",
+				 strerror(ret));
+			break;
+		}
+		sample_collect.num_threads++;
 	}
+	pr_debug("Collecting %d stats records with %d extra threads\n",
+		 sample_collect.num_jobs, sample_collect.num_threads);
 	return 0;
 }
 
+static int sample_stats_collect(struct stats_record *rec)
+{
+	int ret;
+
+	if (!sample_collect.started) {
+		ret = collect_threads_start();
+		if (ret < 0)
+			return ret;
+		sample_collect.started = true;
+	}
+
+	sample_collect.ret = 0;
+	if (!sample_collect.num_threads) {
+		sample_collect.next_job = 0;
+		collect_jobs_run(rec);
+		return sample_collect.ret;
+	}
+
+	pthread_mutex_lock(&sample_collect.lock);
+	sample_collect.rec = rec;
+	sample_collect.next_job = 0;
+	sample_collect.busy = sample_collect.num_threads;
+	sample_collect.gen++;
+	pthread_cond_broadcast(&sample_collect.start);
+	pthread_mutex_unlock(&sample_collect.lock);
+
+	collect_jobs_run(rec);
+
+	pthread_mutex_lock(&sample_collect.lock);
+	while (sample_collect.busy)
+		pthread_cond_wait(&sample_collect.done, &sample_collect.lock);
+	pthread_mutex_unlock(&sample_collect.lock);
+
+	return sample_collect.ret;
+}
+
+void sample_teardown(void)
+{
+	size_t size;
+
+	for (int i = 0; i < NUM_MAP; i++) {
+		size = sample_map_count[i] * sizeof(**sample_mmap);
+		munmap(sample_mmap[i], size);
+	}
+	collect_threads_stop();
+	if (sample_nl_fd >= 0)
+		close(sample_nl_fd);
+	sample_nl_fd = -1;
+	sample_n_nic_rxqs = 0;
+	free(devmap_batch_keys);
+	free(devmap_batch_values);
+	sample_num_print_cbs = 0;
+	if (sample_output_is_text())
+		sample_summary_print();
+	close(sample_sig_fd);
+}
+
+static void sample_hist_add(__u64 rx, __u64 err)
+{
+	size_t idx = sample_hist.num++ % SAMPLE_HIST_SIZE;
+
+	sample_hist.rx[idx] = rx;
+	sample_hist.err[idx] = err;
+}
+
 static void sample_summary_update(struct sample_output *out)
 {
+	sample_hist_add(out->totals.rx,
+			out->totals.err + out->totals.drop_xmit +
+			(out->totals.drop * !(sample_mask & SAMPLE_DROP_OK)));
+
 	sample_out.totals.rx += out->totals.rx;
 	sample_out.totals.redir += out->totals.redir;
 	sample_out.totals.drop += out->totals.drop;
@@ -1442,10 +2480,12 @@ static int sample_signal_cb(void)
 	switch (si.ssi_signo) {
 	case SIGQUIT:
 		sample_switch_mode();
-		printf("\n");
+		if (sample_output_is_text())
+			printf("\n");
 		break;
 	default:
-		printf("\n");
+		if (sample_output_is_text())
+			printf("\n");
 		return 1;
 	}
 
@@ -1466,7 +2506,7 @@ static int sample_timer_cb(int timerfd, struct stats_record **rec,
 			   struct stats_record **prev)
 {
 	char line[64] = "Summary";
-	int ret;
+	int ret, i;
 	__u64 t;
 
 	ret = read(timerfd, &t, sizeof(t));
@@ -1492,31 +2532,66 @@ static int sample_timer_cb(int timerfd, struct stats_record **rec,
 		snprintf(line, sizeof(line), "%s->%s", f ?: "?", t ?: "?");
 	}
 
-	sample_stats_print(sample_mask, *rec, *prev, line);
+	if (sample_output_is_text())
+		sample_stats_print(sample_mask, *rec, *prev, line);
+	else
+		rows_print(sample_mask, *rec, *prev);
+
+	sample_cur_rec = *rec;
+	sample_prev_rec = *prev;
+	for (i = 0; i < sample_num_print_cbs; i++)
+		sample_print_cbs[i].cb(sample_print_cbs[i].ctx);
+	sample_cur_rec = sample_prev_rec = NULL;
 	return 0;
 }
 
-int sample_run(int interval, void (*post_cb)(void *), void *ctx)
+/* Packets each CPU received in the interval being printed, for the print
+ * callbacks that want to relate their own numbers to the traffic.
+ */
+int sample_get_rx_cpu_pkts(__u64 *pkts, int n)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct record *r, *p;
+	int i;
+
+	if (!(sample_mask & SAMPLE_RX_CNT) || !sample_cur_rec)
+		return -ENODATA;
+
+	r = &sample_cur_rec->rx_cnt;
+	p = &sample_prev_rec->rx_cnt;
+	for (i = 0; i < n; i++)
+		pkts[i] = i < nr_cpus ? r->cpu[i].processed - p->cpu[i].processed : 0;
+	return 0;
+}
+
+static bool sample_immediate_exit(void)
 {
-	struct timespec ts = { interval, 0 };
-	struct itimerspec its = { ts, ts };
-	struct stats_record *rec, *prev;
-	struct pollfd pfd[2] = {};
-	bool imm_exit = false;
 	const char *envval;
-	int timerfd, ret;
 
 	envval = secure_getenv("XDP_SAMPLE_IMMEDIATE_EXIT");
 	if (envval && envval[0] == '1' && envval[1] == '\0') {
 		pr_debug("XDP_SAMPLE_IMMEDIATE_EXIT envvar set, exiting immediately after setup\n");
-		imm_exit = true;
+		return true;
 	}
+	return false;
+}
+
+int sample_run(int interval_ms, void (*post_cb)(void *), void *ctx)
+{
+	struct timespec ts = { interval_ms / 1000, (interval_ms % 1000) * 1000000 };
+	struct itimerspec its = { ts, ts };
+	struct stats_record *rec, *prev;
+	struct pollfd pfd[2] = {};
+	int timerfd, ret;
+	bool imm_exit;
 
-	if (!interval) {
-		pr_warn("Incorrect interval 0\n");
+	imm_exit = sample_immediate_exit();
+
+	if (interval_ms <= 0) {
+		pr_warn("Incorrect interval %d ms\n", interval_ms);
 		return -EINVAL;
 	}
-	sample_interval = interval;
+	sample_interval_ms = interval_ms;
 	/* Pretty print numbers */
 	setlocale(LC_NUMERIC, "en_US.UTF-8");
 
@@ -1577,6 +2652,296 @@ end:
 	return ret;
 }
 
+#define SAMPLE_HTTP_MAX_REQ 4096
+#define SAMPLE_HTTP_TIMEOUT_S 2
+
+static int sample_listen(const char *addr)
+{
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM,
+				  .ai_flags = AI_PASSIVE };
+	char host[256] = "", *port;
+	struct addrinfo *res, *ai;
+	int fd = -1, ret, one = 1, zero = 0;
+
+	/* [host]:port, host:port, :port or just port */
+	if (addr[0] == '[') {
+		port = strchr(addr, ']');
+		if (!port || port[1] != ':' ||
+		    port - addr - 1 >= (long)sizeof(host))
+			goto err_addr;
+		memcpy(host, addr + 1, port - addr - 1);
+		port += 2;
+	} else if ((port = strrchr(addr, ':'))) {
+		if (port - addr >= (long)sizeof(host))
+			goto err_addr;
+		memcpy(host, addr, port - addr);
+		port++;
+	} else {
+		port = (char *)addr;
+	}
+	if (!*port)
+		goto err_addr;
+
+	ret = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+	if (ret) {
+		pr_warn("Couldn't resolve %s: %s\n", addr, gai_strerror(ret));
+		return -EINVAL;
+	}
+
+	/* Without a host, listening on :: also takes IPv4 connections */
+	for (ai = res; ai; ai = ai->ai_next)
+		if (!*host && ai->ai_family == AF_INET6)
+			break;
+	if (!ai)
+		ai = res;
+
+	for (; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (ai->ai_family == AF_INET6)
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero,
+				   sizeof(zero));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 16))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	ret = fd < 0 ? -errno : fd;
+	freeaddrinfo(res);
+	if (ret < 0)
+		pr_warn("Couldn't listen on %s: %s\n", addr, strerror(-ret));
+	return ret;
+
+err_addr:
+	pr_warn("Invalid address %s, expected [<addr>:]<port>\n", addr);
+	return -EINVAL;
+}
+
+static void sample_http_reply(int fd, const char *status, const char *type,
+			      const char *body, size_t len)
+{
+	char hdr[256];
+	int n;
+
+	n = snprintf(hdr, sizeof(hdr),
+		     "HTTP/1.1 %s\r\nContent-Type: %s\r\n"
+		     "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+		     status, type, len);
+	if (send(fd, hdr, n, MSG_NOSIGNAL) != n)
+		return;
+
+	while (len) {
+		ssize_t r = send(fd, body, len, MSG_NOSIGNAL);
+
+		if (r <= 0)
+			return;
+		body += r;
+		len -= r;
+	}
+}
+
+/* Handle one request; anything but a GET of /metrics gets an error */
+static void sample_http_serve(int fd, struct stats_record *rec,
+			      void (*metrics_cb)(FILE *f, void *ctx), void *ctx)
+{
+	struct timeval tv = { .tv_sec = SAMPLE_HTTP_TIMEOUT_S };
+	char req[SAMPLE_HTTP_MAX_REQ + 1];
+	size_t len = 0, body_len;
+	char *path, *end, *body;
+	ssize_t r;
+	FILE *f;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	do {
+		r = recv(fd, req + len, SAMPLE_HTTP_MAX_REQ - len, 0);
+		if (r <= 0)
+			return;
+		len += r;
+		req[len] = '\0';
+	} while (!strstr(req, "\r\n\r\n") && len < SAMPLE_HTTP_MAX_REQ);
+
+	if (strncmp(req, "GET ", 4)) {
+		sample_http_reply(fd, "405 Method Not Allowed", "text/plain",
+				  "Only GET is supported\n", 22);
+		return;
+	}
+
+	path = req + 4;
+	end = path + strcspn(path, " ?\r\n");
+	if (end - path != 8 || strncmp(path, "/metrics", 8)) {
+		sample_http_reply(fd, "404 Not Found", "text/plain",
+				  "Metrics are at /metrics\n", 24);
+		return;
+	}
+
+	f = open_memstream(&body, &body_len);
+	if (!f)
+		return;
+
+	if (sample_stats_collect(rec) < 0) {
+		fclose(f);
+		free(body);
+		sample_http_reply(fd, "500 Internal Server Error", "text/plain",
+				  "Failed to read the counters\n", 28);
+		return;
+	}
+
+	om_print(f, sample_mask, rec);
+	if (metrics_cb)
+		metrics_cb(f, ctx);
+	fprintf(f, "# EOF\n");
+	fclose(f);
+
+	sample_http_reply(fd, "200 OK",
+			  "application/openmetrics-text; version=1.0.0; charset=utf-8",
+			  body, body_len);
+	free(body);
+}
+
+/* Serve the counters in OpenMetrics text format on addr until a signal asks
+ * to stop, instead of printing them every interval. Each scrape reads the
+ * maps that are already open; metrics_cb can add more metric families.
+ */
+int sample_serve(const char *addr, void (*metrics_cb)(FILE *f, void *ctx),
+		 void *ctx)
+{
+	struct pollfd pfd[2] = {};
+	struct stats_record *rec;
+	int listen_fd, fd, ret;
+
+	listen_fd = sample_listen(addr);
+	if (listen_fd < 0)
+		return listen_fd;
+
+	ret = -ENOMEM;
+	rec = alloc_stats_record();
+	if (!rec)
+		goto end;
+
+	ret = 0;
+	if (sample_immediate_exit())
+		goto end_rec;
+
+	pfd[0].fd = sample_sig_fd;
+	pfd[0].events = POLLIN;
+
+	pfd[1].fd = listen_fd;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		ret = poll(pfd, 2, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+		ret = 0;
+
+		if (pfd[0].revents & POLLIN) {
+			ret = sample_signal_cb();
+			if (ret)
+				break;
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0)
+				continue;
+			sample_http_serve(fd, rec, metrics_cb, ctx);
+			close(fd);
+		}
+	}
+
+	/* A signal to stop is not an error */
+	if (ret > 0)
+		ret = 0;
+end_rec:
+	free_stats_record(rec);
+end:
+	close(listen_fd);
+	return ret;
+}
+
+/* Measure the cpumap rates over one interval without printing anything, for
+ * callers that change the setup between measurements. Returns 1 if a signal
+ * asked to stop before the interval was over.
+ */
+int sample_measure_cpumap(int interval, struct sample_cpumap_rates *rates)
+{
+	struct pollfd pfd = { .fd = sample_sig_fd, .events = POLLIN };
+	struct stats_record *rec, *prev;
+	__u64 now, end;
+	int i, ret;
+	double t;
+
+	if (!(sample_mask & SAMPLE_RX_CNT) ||
+	    !(sample_mask & SAMPLE_CPUMAP_ENQUEUE_CNT) ||
+	    !(sample_mask & SAMPLE_CPUMAP_KTHREAD_CNT))
+		return -EINVAL;
+
+	if (sample_immediate_exit())
+		return 1;
+
+	prev = alloc_stats_record();
+	if (!prev)
+		return -ENOMEM;
+	ret = -ENOMEM;
+	rec = alloc_stats_record();
+	if (!rec)
+		goto end_prev;
+
+	ret = sample_stats_collect(prev);
+	if (ret < 0)
+		goto end_rec;
+
+	end = gettime() + (__u64)interval * NANOSEC_PER_SEC;
+	while ((now = gettime()) < end) {
+		ret = poll(&pfd, 1, (end - now) / 1000000 + 1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			goto end_rec;
+		}
+		if (ret > 0) {
+			ret = sample_signal_cb();
+			if (ret)
+				goto end_rec;
+		}
+	}
+
+	ret = sample_stats_collect(rec);
+	if (ret < 0)
+		goto end_rec;
+
+	t = calc_period(&rec->rx_cnt, &prev->rx_cnt);
+	rates->rx = calc_pps(&rec->rx_cnt.total, &prev->rx_cnt.total, t);
+
+	t = calc_period(&rec->kthread, &prev->kthread);
+	rates->processed = calc_pps(&rec->kthread.total, &prev->kthread.total, t);
+	rates->drop = calc_drop_pps(&rec->kthread.total, &prev->kthread.total, t);
+	rates->sched = calc_errs_pps(&rec->kthread.total, &prev->kthread.total, t);
+
+	for (i = 0; i < sample_n_cpus; i++) {
+		t = calc_period(&rec->enq[i], &prev->enq[i]);
+		rates->drop += calc_drop_pps(&rec->enq[i].total,
+					     &prev->enq[i].total, t);
+	}
+	ret = 0;
+
+end_rec:
+	free_stats_record(rec);
+end_prev:
+	free_stats_record(prev);
+	return ret;
+}
+
 const char *get_driver_name(int ifindex)
 {
 	struct ethtool_drvinfo drv = {};
@@ -1640,3 +3005,49 @@ end:
 	close(fd);
 	return r;
 }
+
+static int ethtool_gro(int ifindex, struct ethtool_value *eval)
+{
+	char ifname[IF_NAMESIZE];
+	struct ifreq ifr = {};
+	int fd, r;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (!if_indextoname(ifindex, ifname)) {
+		r = -errno;
+		goto end;
+	}
+
+	safe_strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+	ifr.ifr_data = (void *)eval;
+
+	r = ioctl(fd, SIOCETHTOOL, &ifr);
+	if (r)
+		r = -errno;
+
+end:
+	close(fd);
+	return r;
+}
+
+/* Returns whether GRO is enabled on ifindex, or a negative error */
+int get_gro(int ifindex)
+{
+	struct ethtool_value eval = { .cmd = ETHTOOL_GGRO };
+	int r;
+
+	r = ethtool_gro(ifindex, &eval);
+	if (r)
+		return r;
+	return !!eval.data;
+}
+
+int set_gro(int ifindex, bool enable)
+{
+	struct ethtool_value eval = { .cmd = ETHTOOL_SGRO, .data = enable };
+
+	return ethtool_gro(ifindex, &eval);
+}
@@ -4,6 +4,7 @@
 
 #include <bpf/libbpf.h>
 #include <getopt.h>
+#include <stdio.h>
 
 #include <xdp/xdp_sample_shared.h>
 
@@ -22,6 +23,14 @@ enum stats_mask {
 	SAMPLE_SKIP_HEADING          = 1U << 9,
 	SAMPLE_RXQ_STATS             = 1U << 10,
 	SAMPLE_DROP_OK               = 1U << 11,
+	SAMPLE_CPUMAP_GRO_CNT        = 1U << 12,
+	SAMPLE_NIC_QUEUE_CNT         = 1U << 13,
+};
+
+enum sample_output_format {
+	SAMPLE_OUTPUT_TEXT,
+	SAMPLE_OUTPUT_JSON,
+	SAMPLE_OUTPUT_CSV,
 };
 
 enum sample_compat {
@@ -38,19 +47,40 @@ enum sample_compat {
 #define EXIT_FAIL_BPF		4
 #define EXIT_FAIL_MEM		5
 
+/* Rates in packets (or calls) per second */
+struct sample_cpumap_rates {
+	__u64 rx;		/* received by the XDP program */
+	__u64 processed;	/* dequeued by the cpumap kthreads */
+	__u64 drop;		/* dropped on enqueue or by the kthreads */
+	__u64 sched;		/* kthread calls to schedule() */
+};
+
 int sample_setup_maps(struct bpf_map **maps, const char *ifname);
+int sample_nic_stats_init(int ifindex);
 int __sample_init(int mask, int ifindex_from, int ifindex_to);
 void sample_teardown(void);
-int sample_run(int interval, void (*post_cb)(void *), void *ctx);
+int sample_run(int interval_ms, void (*post_cb)(void *), void *ctx);
+int sample_measure_cpumap(int interval, struct sample_cpumap_rates *rates);
+int sample_serve(const char *addr, void (*metrics_cb)(FILE *f, void *ctx),
+		 void *ctx);
 bool sample_is_compat(enum sample_compat compat_value);
 bool sample_probe_cpumap_compat(void);
 void sample_check_cpumap_compat(struct bpf_program *prog,
 				struct bpf_program *prog_compat);
 
 void sample_switch_mode(void);
+void sample_set_output_format(enum sample_output_format format);
+bool sample_output_is_text(void);
+int sample_add_print_cb(void (*print_cb)(void *ctx), void *ctx);
+int sample_get_rx_cpu_pkts(__u64 *pkts, int n);
+void sample_print_row(const char *stat, const char *key, int cpu,
+		      __u64 timestamp, const struct datarec *rates);
 
 const char *get_driver_name(int ifindex);
 int get_mac_addr(int ifindex, void *mac_addr);
+int get_num_rxqs(const char *ifname);
+int get_gro(int ifindex);
+int set_gro(int ifindex, bool enable);
 
 #pragma GCC diagnostic push
 #ifndef __clang__
@@ -121,6 +151,8 @@ static inline char *safe_strncpy(char *dst, const char *src, size_t size)
 			__attach_tp_compat(tp_xdp_cpumap_kthread,  \
 					   tp_xdp_cpumap_compat,   \
 					   CPUMAP_KTHREAD);        \
+		if (sample_mask & SAMPLE_CPUMAP_GRO_CNT)           \
+			__attach_tp(tp_cpumap_gro);                \
 		if (sample_mask & SAMPLE_EXCEPTION_CNT)            \
 			__attach_tp(tp_xdp_exception);             \
 		if (sample_mask & SAMPLE_DEVMAP_XMIT_CNT)          \
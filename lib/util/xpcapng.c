@@ -13,14 +13,25 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
 #include "xpcapng.h"
 
 /*****************************************************************************
@@ -41,8 +52,96 @@
 struct xpcapng_dumper {
 	int      pd_fd;
 	uint32_t pd_interfaces;
+	uint8_t *pd_buf;
+	size_t   pd_buf_size;
+	size_t   pd_buf_len;
+	uint64_t pd_size;
+	uint8_t *pd_map;
+	size_t   pd_map_size;
+	off_t    pd_map_offset;
+	uint64_t pd_map_synced;
+	bool     pd_map_need_fsync; /* written outside the current window */
+	struct pcapng_compressor *pd_comp;
+	struct pcapng_sender *pd_send;
+};
+
+#define PCAPNG_WRITE_ALIGN 4096
+#define PCAPNG_MAP_MIN     (4 * 1024 * 1024)
+
+/*****************************************************************************
+ * pcapng_page_size()
+ *
+ * The mapped file offsets and msync() addresses have to be aligned to the
+ * page size, which is larger than PCAPNG_WRITE_ALIGN on some systems.
+ *****************************************************************************/
+static uint64_t pcapng_page_size(void)
+{
+	long size = sysconf(_SC_PAGESIZE);
+
+	return size > 0 ? (uint64_t)size : PCAPNG_WRITE_ALIGN;
+}
+
+/*****************************************************************************
+ * pcapng_compressor structure
+ *
+ * The write buffer is one of a ring of chunks. A full chunk is queued to the
+ * compression thread, and the writer moves on to the next free one, so it
+ * only has to wait once all chunks are queued.
+ *****************************************************************************/
+#define PCAPNG_COMPRESS_CHUNKS     8
+#define PCAPNG_COMPRESS_CHUNK_SIZE (1024 * 1024)
+#define PCAPNG_ZSTD_LEVEL          1
+#define PCAPNG_LZ4_STEP            (64 * 1024)
+
+struct pcapng_compressor {
+	enum xpcapng_compression pc_type;
+	int                      pc_fd;
+	pthread_t                pc_thread;
+	pthread_mutex_t          pc_lock;
+	pthread_cond_t           pc_cond;
+	uint8_t                 *pc_chunk[PCAPNG_COMPRESS_CHUNKS];
+	size_t                   pc_chunk_len[PCAPNG_COMPRESS_CHUNKS];
+	unsigned int             pc_head;
+	unsigned int             pc_count;
+	bool                     pc_flush;
+	bool                     pc_stop;
+	int                      pc_error;
+	uint8_t                 *pc_out;
+	size_t                   pc_out_size;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx               *pc_zstd;
+#endif
+#ifdef HAVE_LZ4
+	LZ4F_cctx               *pc_lz4;
+#endif
 };
 
+/*****************************************************************************
+ * pcapng_sender structure
+ *
+ * A bounded queue of whole blocks, written out by a separate thread, so a
+ * slow reader on the other end of a socket never stalls the writer. Blocks
+ * that do not fit are refused rather than waited for.
+ *****************************************************************************/
+struct pcapng_sender {
+	int             ps_fd;
+	pthread_t       ps_thread;
+	pthread_mutex_t ps_lock;
+	pthread_cond_t  ps_cond;
+	uint8_t        *ps_buf;
+	size_t          ps_size;
+	size_t          ps_head;
+	size_t          ps_len;
+	bool            ps_stop;
+	int             ps_error;
+};
+
+#ifdef HAVE_LZ4
+static const LZ4F_preferences_t pcapng_lz4_prefs = {
+	.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled,
+};
+#endif
+
 /*****************************************************************************
  * general pcapng block and option definitions
  *****************************************************************************/
@@ -189,6 +288,713 @@ static struct pcapng_option *pcapng_add_option(struct pcapng_option *opt,
 		((uint8_t *)opt + pcapng_get_option_length(length));
 }
 
+/*****************************************************************************
+ * pcapng_write_all()
+ *****************************************************************************/
+static bool pcapng_write_all(int fd, const uint8_t *buf, size_t len)
+{
+	size_t  offset = 0;
+	ssize_t rc;
+
+	while (offset < len) {
+		rc = write(fd, buf + offset, len - offset);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		offset += rc;
+	}
+	return true;
+}
+
+/*****************************************************************************
+ * pcapng_compress_data()
+ *
+ * Compress len bytes of data and write out what the compressor produced.
+ * With flush set, everything buffered by the compressor is written out, and
+ * with end set also the end of the frame.
+ *****************************************************************************/
+static bool pcapng_compress_data(struct pcapng_compressor *pc,
+				 const uint8_t *data, size_t len,
+				 bool flush, bool end)
+{
+	switch (pc->pc_type) {
+#ifdef HAVE_ZSTD
+	case XPCAPNG_COMPRESS_ZSTD: {
+		ZSTD_EndDirective mode = end ? ZSTD_e_end :
+			flush ? ZSTD_e_flush : ZSTD_e_continue;
+		ZSTD_inBuffer     in = { data, len, 0 };
+		ZSTD_outBuffer    out;
+		size_t            rc;
+
+		do {
+			out.dst = pc->pc_out;
+			out.size = pc->pc_out_size;
+			out.pos = 0;
+
+			rc = ZSTD_compressStream2(pc->pc_zstd, &out, &in, mode);
+			if (ZSTD_isError(rc)) {
+				errno = EIO;
+				return false;
+			}
+			if (!pcapng_write_all(pc->pc_fd, pc->pc_out, out.pos))
+				return false;
+		} while (mode == ZSTD_e_continue ? in.pos < in.size : rc != 0);
+		return true;
+	}
+#endif
+#ifdef HAVE_LZ4
+	case XPCAPNG_COMPRESS_LZ4: {
+		size_t step, rc;
+
+		/* The output buffer is sized for PCAPNG_LZ4_STEP of input */
+		while (len) {
+			step = len < PCAPNG_LZ4_STEP ? len : PCAPNG_LZ4_STEP;
+			rc = LZ4F_compressUpdate(pc->pc_lz4, pc->pc_out,
+						 pc->pc_out_size, data, step,
+						 NULL);
+			if (LZ4F_isError(rc)) {
+				errno = EIO;
+				return false;
+			}
+			if (!pcapng_write_all(pc->pc_fd, pc->pc_out, rc))
+				return false;
+			data += step;
+			len -= step;
+		}
+
+		if (!flush && !end)
+			return true;
+
+		if (end)
+			rc = LZ4F_compressEnd(pc->pc_lz4, pc->pc_out,
+					      pc->pc_out_size, NULL);
+		else
+			rc = LZ4F_flush(pc->pc_lz4, pc->pc_out,
+					pc->pc_out_size, NULL);
+		if (LZ4F_isError(rc)) {
+			errno = EIO;
+			return false;
+		}
+		return pcapng_write_all(pc->pc_fd, pc->pc_out, rc);
+	}
+#endif
+	default:
+		/* Without any of the libraries, this is never called */
+		(void)data;
+		(void)len;
+		(void)flush;
+		(void)end;
+		errno = ENOTSUP;
+		return false;
+	}
+}
+
+/*****************************************************************************
+ * pcapng_compress_thread()
+ *
+ * Compress the queued chunks in order, and handle flush and stop requests
+ * once the queue is empty. After an error the chunks are still consumed, so
+ * the writer never waits forever, but nothing more is written.
+ *****************************************************************************/
+static void *pcapng_compress_thread(void *arg)
+{
+	struct pcapng_compressor *pc = arg;
+	unsigned int              idx;
+	bool                      stop;
+
+	pthread_mutex_lock(&pc->pc_lock);
+	for (;;) {
+		while (!pc->pc_count && !pc->pc_flush && !pc->pc_stop)
+			pthread_cond_wait(&pc->pc_cond, &pc->pc_lock);
+
+		if (pc->pc_count) {
+			idx = pc->pc_head;
+			pthread_mutex_unlock(&pc->pc_lock);
+
+			if (!pc->pc_error &&
+			    !pcapng_compress_data(pc, pc->pc_chunk[idx],
+						  pc->pc_chunk_len[idx],
+						  false, false))
+				pc->pc_error = errno ?: EIO;
+
+			pthread_mutex_lock(&pc->pc_lock);
+			pc->pc_head = (pc->pc_head + 1) % PCAPNG_COMPRESS_CHUNKS;
+			pc->pc_count--;
+			pthread_cond_broadcast(&pc->pc_cond);
+			continue;
+		}
+
+		stop = pc->pc_stop;
+		pthread_mutex_unlock(&pc->pc_lock);
+
+		if (!pc->pc_error &&
+		    !pcapng_compress_data(pc, NULL, 0, true, stop))
+			pc->pc_error = errno ?: EIO;
+
+		pthread_mutex_lock(&pc->pc_lock);
+		pc->pc_flush = false;
+		pthread_cond_broadcast(&pc->pc_cond);
+		if (stop)
+			break;
+	}
+	pthread_mutex_unlock(&pc->pc_lock);
+	return NULL;
+}
+
+/*****************************************************************************
+ * pcapng_compress_submit()
+ *
+ * Queue the write buffer for compression and switch to the next chunk.
+ *****************************************************************************/
+static bool pcapng_compress_submit(struct xpcapng_dumper *pd)
+{
+	struct pcapng_compressor *pc = pd->pd_comp;
+	unsigned int              idx;
+	int                       err;
+
+	if (!pd->pd_buf_len)
+		return true;
+
+	pthread_mutex_lock(&pc->pc_lock);
+	idx = (pc->pc_head + pc->pc_count) % PCAPNG_COMPRESS_CHUNKS;
+	pc->pc_chunk_len[idx] = pd->pd_buf_len;
+	pc->pc_count++;
+	pthread_cond_broadcast(&pc->pc_cond);
+
+	while (pc->pc_count == PCAPNG_COMPRESS_CHUNKS)
+		pthread_cond_wait(&pc->pc_cond, &pc->pc_lock);
+
+	idx = (pc->pc_head + pc->pc_count) % PCAPNG_COMPRESS_CHUNKS;
+	pd->pd_buf = pc->pc_chunk[idx];
+	pd->pd_buf_len = 0;
+	err = pc->pc_error;
+	pthread_mutex_unlock(&pc->pc_lock);
+
+	if (err) {
+		errno = err;
+		return false;
+	}
+	return true;
+}
+
+/*****************************************************************************
+ * pcapng_compress_wait()
+ *
+ * Queue the write buffer, and wait until the compression thread is done
+ * with all chunks. With flush set, also wait for the compressed data to be
+ * written out.
+ *****************************************************************************/
+static bool pcapng_compress_wait(struct xpcapng_dumper *pd, bool flush)
+{
+	struct pcapng_compressor *pc = pd->pd_comp;
+	int                       err;
+
+	if (!pcapng_compress_submit(pd))
+		return false;
+
+	pthread_mutex_lock(&pc->pc_lock);
+	if (flush) {
+		pc->pc_flush = true;
+		pthread_cond_broadcast(&pc->pc_cond);
+	}
+	while (pc->pc_count || pc->pc_flush)
+		pthread_cond_wait(&pc->pc_cond, &pc->pc_lock);
+	err = pc->pc_error;
+	pthread_mutex_unlock(&pc->pc_lock);
+
+	if (err) {
+		errno = err;
+		return false;
+	}
+	return true;
+}
+
+/*****************************************************************************
+ * pcapng_compress_alloc_chunks()
+ *
+ * (Re)allocate the chunks, which must all be free.
+ *****************************************************************************/
+static bool pcapng_compress_alloc_chunks(struct xpcapng_dumper *pd,
+					 size_t size)
+{
+	struct pcapng_compressor *pc = pd->pd_comp;
+	uint8_t                  *chunk[PCAPNG_COMPRESS_CHUNKS] = {};
+	int                       i;
+
+	size = roundup(size ?: PCAPNG_COMPRESS_CHUNK_SIZE, PCAPNG_WRITE_ALIGN);
+	for (i = 0; i < PCAPNG_COMPRESS_CHUNKS; i++) {
+		chunk[i] = malloc(size);
+		if (chunk[i] == NULL) {
+			while (i--)
+				free(chunk[i]);
+			errno = ENOMEM;
+			return false;
+		}
+	}
+
+	for (i = 0; i < PCAPNG_COMPRESS_CHUNKS; i++) {
+		free(pc->pc_chunk[i]);
+		pc->pc_chunk[i] = chunk[i];
+	}
+	pd->pd_buf = pc->pc_chunk[pc->pc_head];
+	pd->pd_buf_size = size;
+	pd->pd_buf_len = 0;
+	return true;
+}
+
+/*****************************************************************************
+ * pcapng_compress_free()
+ *****************************************************************************/
+static void pcapng_compress_free(struct pcapng_compressor *pc)
+{
+	for (int i = 0; i < PCAPNG_COMPRESS_CHUNKS; i++)
+		free(pc->pc_chunk[i]);
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(pc->pc_zstd);
+#endif
+#ifdef HAVE_LZ4
+	if (pc->pc_lz4)
+		LZ4F_freeCompressionContext(pc->pc_lz4);
+#endif
+	pthread_cond_destroy(&pc->pc_cond);
+	pthread_mutex_destroy(&pc->pc_lock);
+	free(pc->pc_out);
+	free(pc);
+}
+
+/*****************************************************************************
+ * pcapng_compress_start()
+ *
+ * Set up the compressor, write out the frame header if the format has one,
+ * and start the compression thread, with all signals blocked so they keep
+ * going to the application's threads.
+ *****************************************************************************/
+static bool pcapng_compress_start(struct xpcapng_dumper *pd,
+				  enum xpcapng_compression type)
+{
+	struct pcapng_compressor *pc;
+	sigset_t                  sigset, old_sigset;
+	int                       err;
+
+	pc = calloc(1, sizeof(*pc));
+	if (pc == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+	pc->pc_type = type;
+	pc->pc_fd = pd->pd_fd;
+	pthread_mutex_init(&pc->pc_lock, NULL);
+	pthread_cond_init(&pc->pc_cond, NULL);
+
+	switch (type) {
+#ifdef HAVE_ZSTD
+	case XPCAPNG_COMPRESS_ZSTD:
+		pc->pc_zstd = ZSTD_createCCtx();
+		if (pc->pc_zstd == NULL) {
+			errno = ENOMEM;
+			goto error_exit;
+		}
+		ZSTD_CCtx_setParameter(pc->pc_zstd, ZSTD_c_compressionLevel,
+				       PCAPNG_ZSTD_LEVEL);
+		ZSTD_CCtx_setParameter(pc->pc_zstd, ZSTD_c_checksumFlag, 1);
+		pc->pc_out_size = ZSTD_CStreamOutSize();
+		break;
+#endif
+#ifdef HAVE_LZ4
+	case XPCAPNG_COMPRESS_LZ4:
+		if (LZ4F_isError(LZ4F_createCompressionContext(&pc->pc_lz4,
+							       LZ4F_VERSION))) {
+			errno = ENOMEM;
+			goto error_exit;
+		}
+		pc->pc_out_size = LZ4F_compressBound(PCAPNG_LZ4_STEP,
+						     &pcapng_lz4_prefs);
+		if (pc->pc_out_size < LZ4F_HEADER_SIZE_MAX)
+			pc->pc_out_size = LZ4F_HEADER_SIZE_MAX;
+		break;
+#endif
+	default:
+		errno = ENOTSUP;
+		goto error_exit;
+	}
+
+	pc->pc_out = malloc(pc->pc_out_size);
+	if (pc->pc_out == NULL) {
+		errno = ENOMEM;
+		goto error_exit;
+	}
+
+#ifdef HAVE_LZ4
+	if (type == XPCAPNG_COMPRESS_LZ4) {
+		size_t rc = LZ4F_compressBegin(pc->pc_lz4, pc->pc_out,
+					       pc->pc_out_size,
+					       &pcapng_lz4_prefs);
+
+		if (LZ4F_isError(rc)) {
+			errno = EIO;
+			goto error_exit;
+		}
+		if (!pcapng_write_all(pc->pc_fd, pc->pc_out, rc))
+			goto error_exit;
+	}
+#endif
+
+	pd->pd_comp = pc;
+	if (!pcapng_compress_alloc_chunks(pd, 0))
+		goto error_exit;
+
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &old_sigset);
+	err = pthread_create(&pc->pc_thread, NULL, pcapng_compress_thread, pc);
+	pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+	if (err) {
+		errno = err;
+		goto error_exit;
+	}
+	return true;
+
+error_exit:
+	pd->pd_comp = NULL;
+	pd->pd_buf = NULL;
+	pd->pd_buf_size = 0;
+	pcapng_compress_free(pc);
+	return false;
+}
+
+/*****************************************************************************
+ * pcapng_compress_stop()
+ *
+ * Compress what is left, end the frame, and stop the thread.
+ *****************************************************************************/
+static void pcapng_compress_stop(struct xpcapng_dumper *pd)
+{
+	struct pcapng_compressor *pc = pd->pd_comp;
+
+	pcapng_compress_submit(pd);
+
+	pthread_mutex_lock(&pc->pc_lock);
+	pc->pc_stop = true;
+	pthread_cond_broadcast(&pc->pc_cond);
+	pthread_mutex_unlock(&pc->pc_lock);
+	pthread_join(pc->pc_thread, NULL);
+
+	pcapng_compress_free(pc);
+	pd->pd_comp = NULL;
+	pd->pd_buf = NULL;
+	pd->pd_buf_size = 0;
+	pd->pd_buf_len = 0;
+}
+
+/*****************************************************************************
+ * pcapng_compress_writev()
+ *
+ * Copy a block into the chunks, queueing each one that fills up. Blocks can
+ * span chunks, as the compressed stream does not care.
+ *****************************************************************************/
+static bool pcapng_compress_writev(struct xpcapng_dumper *pd,
+				   const struct iovec *iov, int iovcnt,
+				   size_t length)
+{
+	for (int i = 0; i < iovcnt; i++) {
+		const uint8_t *data = iov[i].iov_base;
+		size_t         len = iov[i].iov_len;
+		size_t         n;
+
+		while (len) {
+			n = pd->pd_buf_size - pd->pd_buf_len;
+			if (n > len)
+				n = len;
+
+			memcpy(pd->pd_buf + pd->pd_buf_len, data, n);
+			pd->pd_buf_len += n;
+			data += n;
+			len -= n;
+
+			if (pd->pd_buf_len == pd->pd_buf_size &&
+			    !pcapng_compress_submit(pd))
+				return false;
+		}
+	}
+
+	pd->pd_size += length;
+	return true;
+}
+
+/*****************************************************************************
+ * pcapng_send_thread()
+ *
+ * Write out the queued data in order until asked to stop, and the queue is
+ * empty. After an error the data is still consumed, but nothing more is
+ * written.
+ *****************************************************************************/
+static void *pcapng_send_thread(void *arg)
+{
+	struct pcapng_sender *ps = arg;
+	size_t                len;
+	int                   err;
+
+	pthread_mutex_lock(&ps->ps_lock);
+	for (;;) {
+		while (!ps->ps_len && !ps->ps_stop)
+			pthread_cond_wait(&ps->ps_cond, &ps->ps_lock);
+
+		if (!ps->ps_len)
+			break;
+
+		len = ps->ps_len;
+		if (len > ps->ps_size - ps->ps_head)
+			len = ps->ps_size - ps->ps_head;
+		pthread_mutex_unlock(&ps->ps_lock);
+
+		err = 0;
+		if (!ps->ps_error &&
+		    !pcapng_write_all(ps->ps_fd, ps->ps_buf + ps->ps_head, len))
+			err = errno ?: EIO;
+
+		pthread_mutex_lock(&ps->ps_lock);
+		if (err)
+			ps->ps_error = err;
+		ps->ps_head = (ps->ps_head + len) % ps->ps_size;
+		ps->ps_len -= len;
+	}
+	pthread_mutex_unlock(&ps->ps_lock);
+	return NULL;
+}
+
+/*****************************************************************************
+ * pcapng_send_stop()
+ *
+ * Send what is queued, and stop the thread.
+ *****************************************************************************/
+static void pcapng_send_stop(struct xpcapng_dumper *pd)
+{
+	struct pcapng_sender *ps = pd->pd_send;
+
+	pthread_mutex_lock(&ps->ps_lock);
+	ps->ps_stop = true;
+	pthread_cond_broadcast(&ps->ps_cond);
+	pthread_mutex_unlock(&ps->ps_lock);
+	pthread_join(ps->ps_thread, NULL);
+
+	pthread_cond_destroy(&ps->ps_cond);
+	pthread_mutex_destroy(&ps->ps_lock);
+	free(ps->ps_buf);
+	free(ps);
+	pd->pd_send = NULL;
+}
+
+/*****************************************************************************
+ * pcapng_send_writev()
+ *
+ * Queue a block as a whole, or fail with ENOBUFS if the queue has no room
+ * for it. Errors of the sending thread are reported on the next block.
+ *****************************************************************************/
+static bool pcapng_send_writev(struct xpcapng_dumper *pd,
+			       const struct iovec *iov, int iovcnt,
+			       size_t length)
+{
+	struct pcapng_sender *ps = pd->pd_send;
+	size_t                tail, n;
+
+	pthread_mutex_lock(&ps->ps_lock);
+	if (ps->ps_error || length > ps->ps_size - ps->ps_len) {
+		errno = ps->ps_error ?: ENOBUFS;
+		pthread_mutex_unlock(&ps->ps_lock);
+		return false;
+	}
+
+	tail = (ps->ps_head + ps->ps_len) % ps->ps_size;
+	for (int i = 0; i < iovcnt; i++) {
+		const uint8_t *data = iov[i].iov_base;
+		size_t         len = iov[i].iov_len;
+
+		while (len) {
+			n = ps->ps_size - tail;
+			if (n > len)
+				n = len;
+
+			memcpy(ps->ps_buf + tail, data, n);
+			tail = (tail + n) % ps->ps_size;
+			data += n;
+			len -= n;
+		}
+	}
+	ps->ps_len += length;
+	pthread_cond_broadcast(&ps->ps_cond);
+	pthread_mutex_unlock(&ps->ps_lock);
+
+	pd->pd_size += length;
+	return true;
+}
+
+/*****************************************************************************
+ * pcapng_drain_buffer()
+ *
+ * Write out the buffered blocks. Unless all data needs to be written, only
+ * whole PCAPNG_WRITE_ALIGN sized chunks are written, and the remainder is
+ * kept for the next write.
+ *****************************************************************************/
+static bool pcapng_drain_buffer(struct xpcapng_dumper *pd, bool all)
+{
+	size_t len = pd->pd_buf_len;
+
+	if (pd->pd_comp)
+		return pcapng_compress_submit(pd);
+
+	if (!all && len >= PCAPNG_WRITE_ALIGN)
+		len &= ~((size_t)PCAPNG_WRITE_ALIGN - 1);
+
+	if (!pcapng_write_all(pd->pd_fd, pd->pd_buf, len))
+		return false;
+
+	pd->pd_buf_len -= len;
+	if (pd->pd_buf_len)
+		memmove(pd->pd_buf, pd->pd_buf + len, pd->pd_buf_len);
+
+	return true;
+}
+
+/*****************************************************************************
+ * pcapng_unmap_window()
+ *
+ * Start writeback of the current window, and unmap it. If part of it was
+ * written since the last flush, the next flush has to sync the whole file.
+ *****************************************************************************/
+static void pcapng_unmap_window(struct xpcapng_dumper *pd)
+{
+	if (!pd->pd_map)
+		return;
+
+	if (pd->pd_map_synced < pd->pd_size)
+		pd->pd_map_need_fsync = true;
+	msync(pd->pd_map, pd->pd_map_size, MS_ASYNC);
+	munmap(pd->pd_map, pd->pd_map_size);
+	pd->pd_map = NULL;
+}
+
+/*****************************************************************************
+ * pcapng_map_window()
+ *
+ * Map the window holding the end of the file, preallocating its blocks
+ * first, so storing a block in it is a plain memory copy.
+ *****************************************************************************/
+static bool pcapng_map_window(struct xpcapng_dumper *pd)
+{
+	off_t offset = pd->pd_size & ~(pcapng_page_size() - 1);
+	void *map;
+	int   err;
+
+	pcapng_unmap_window(pd);
+
+	err = posix_fallocate(pd->pd_fd, offset, pd->pd_map_size);
+	if (err) {
+		errno = err;
+		return false;
+	}
+
+	map = mmap(NULL, pd->pd_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   pd->pd_fd, offset);
+	if (map == MAP_FAILED)
+		return false;
+
+	madvise(map, pd->pd_map_size, MADV_SEQUENTIAL);
+	pd->pd_map = map;
+	pd->pd_map_offset = offset;
+	return true;
+}
+
+/*****************************************************************************
+ * pcapng_map_writev()
+ *
+ * Copy a block straight into the mapped file. Blocks that are larger than the
+ * window are written to the file directly.
+ *****************************************************************************/
+static bool pcapng_map_writev(struct xpcapng_dumper *pd,
+			      const struct iovec *iov, int iovcnt,
+			      size_t length)
+{
+	uint8_t *dst;
+	ssize_t  rc;
+
+	if (!pd->pd_map ||
+	    pd->pd_size + length > pd->pd_map_offset + pd->pd_map_size) {
+		if (length > pd->pd_map_size / 2) {
+			rc = pwritev(pd->pd_fd, iov, iovcnt, pd->pd_size);
+			if (rc < 0 || (size_t)rc != length)
+				return false;
+
+			pd->pd_size += length;
+			pd->pd_map_need_fsync = true;
+			return true;
+		}
+
+		if (!pcapng_map_window(pd))
+			return false;
+	}
+
+	dst = pd->pd_map + (pd->pd_size - pd->pd_map_offset);
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+
+	pd->pd_size += length;
+	return true;
+}
+
+/*****************************************************************************
+ * pcapng_writev()
+ *
+ * Write a single block, described by the iov array, either directly to the
+ * file, to the write buffer if one is configured, to the mapped file, or to
+ * the compressor.
+ *****************************************************************************/
+static bool pcapng_writev(struct xpcapng_dumper *pd, const struct iovec *iov,
+			  int iovcnt, size_t length)
+{
+	int rc;
+
+	if (pd->pd_send)
+		return pcapng_send_writev(pd, iov, iovcnt, length);
+
+	if (pd->pd_comp)
+		return pcapng_compress_writev(pd, iov, iovcnt, length);
+
+	if (pd->pd_map_size)
+		return pcapng_map_writev(pd, iov, iovcnt, length);
+
+	if (pd->pd_buf) {
+		if (length > pd->pd_buf_size - pd->pd_buf_len &&
+		    !pcapng_drain_buffer(pd, false))
+			return false;
+
+		if (length <= pd->pd_buf_size - pd->pd_buf_len) {
+			for (int i = 0; i < iovcnt; i++) {
+				memcpy(pd->pd_buf + pd->pd_buf_len,
+				       iov[i].iov_base, iov[i].iov_len);
+				pd->pd_buf_len += iov[i].iov_len;
+			}
+			pd->pd_size += length;
+			return true;
+		}
+
+		/* The block does not fit the buffer, so write out all
+		 * buffered data, to keep the order, and the block itself.
+		 */
+		if (!pcapng_drain_buffer(pd, true))
+			return false;
+	}
+
+	rc = writev(pd->pd_fd, iov, iovcnt);
+	if (rc < 0 || (size_t)rc != length)
+		return false;
+
+	pd->pd_size += length;
+	return true;
+}
+
 /*****************************************************************************
  * pcapng_write_shb()
  *****************************************************************************/
@@ -196,10 +1002,11 @@ static bool pcapng_write_shb(struct xpcapng_dumper *pd, const char *comment,
 			     const char *hardware, const char *os,
 			     const char *user_application)
 {
-	int                                 rc;
+	bool                                rc;
 	size_t                              shb_length;
 	struct pcapng_section_header_block *shb;
 	struct pcapng_option               *opt;
+	struct iovec                        iov;
 
 	if (pd == NULL) {
 		errno = EINVAL;
@@ -266,13 +1073,12 @@ static bool pcapng_write_shb(struct xpcapng_dumper *pd, const char *comment,
 	memcpy(opt, &shb->shb_block_length, sizeof(shb->shb_block_length));
 
 	/* Write the SHB, and free its memory. */
-	rc = write(pd->pd_fd, shb, shb_length);
+	iov.iov_base = shb;
+	iov.iov_len = shb_length;
+	rc = pcapng_writev(pd, &iov, 1, shb_length);
 	free(shb);
 
-	if ((size_t)rc != shb_length)
-		return false;
-
-	return true;
+	return rc;
 }
 
 /*****************************************************************************
@@ -283,10 +1089,11 @@ static bool pcapng_write_idb(struct xpcapng_dumper *pd, const char *name,
 			     const uint8_t *mac, uint64_t speed,
 			     uint8_t ts_resolution, const char *hardware)
 {
-	int                                        rc;
+	bool                                       rc;
 	size_t                                     idb_length;
 	struct pcapng_interface_description_block *idb;
 	struct pcapng_option                      *opt;
+	struct iovec                               iov;
 
 	if (pd == NULL) {
 		errno = EINVAL;
@@ -363,13 +1170,12 @@ static bool pcapng_write_idb(struct xpcapng_dumper *pd, const char *name,
 	memcpy(opt, &idb->idb_block_length, sizeof(idb->idb_block_length));
 
 	/* Write the IDB, and free it's memory. */
-	rc = write(pd->pd_fd, idb, idb_length);
+	iov.iov_base = idb;
+	iov.iov_len = idb_length;
+	rc = pcapng_writev(pd, &iov, 1, idb_length);
 	free(idb);
 
-	if ((size_t)rc != idb_length)
-		return false;
-
-	return true;
+	return rc;
 }
 
 /*****************************************************************************
@@ -381,7 +1187,6 @@ static bool pcapng_write_epb(struct xpcapng_dumper *pd, uint32_t ifid,
 			     struct xpcapng_epb_options_s *epb_options)
 {
 	int                                  i = 0;
-	int                                  rc;
 	size_t                               pad_length;
 	size_t                               com_length = 0;
 	size_t                               epb_length;
@@ -526,11 +1331,8 @@ static bool pcapng_write_epb(struct xpcapng_dumper *pd, uint32_t ifid,
 		(epb_options->packetid ? 12 : 0) +
 		(epb_options->queue ? 8 : 0) +
 		(epb_options->xdp_verdict ? 16 : 0);
-	rc = writev(pd->pd_fd, iov, i);
-	if ((size_t)rc != epb_length)
-		return false;
 
-	return true;
+	return pcapng_writev(pd, iov, i, epb_length);
 }
 
 /*****************************************************************************
@@ -542,27 +1344,71 @@ struct xpcapng_dumper *xpcapng_dump_open(const char *file,
 					 const char *os,
 					 const char *user_application)
 {
-	struct xpcapng_dumper *pd = NULL;
+	return xpcapng_dump_open_compressed(file, XPCAPNG_COMPRESS_NONE,
+					    comment, hardware, os,
+					    user_application);
+}
+
+/*****************************************************************************
+ * xpcapng_dump_open_compressed()
+ *
+ * Like xpcapng_dump_open(), but the file is written as a zstd or lz4 frame,
+ * compressed on a separate thread. Compression uses the write buffer, so
+ * the buffer size sets the size of the chunks handed to the thread.
+ *****************************************************************************/
+struct xpcapng_dumper *xpcapng_dump_open_compressed(const char *file,
+						    enum xpcapng_compression compression,
+						    const char *comment,
+						    const char *hardware,
+						    const char *os,
+						    const char *user_application)
+{
+	int fd;
 
 	if (file == NULL) {
 		errno = EINVAL;
-		goto error_exit;
+		return NULL;
+	}
+
+	if (strcmp(file, "-") == 0) {
+		fd = STDOUT_FILENO;
+	} else {
+		/* Mapping the file for writing also needs read access */
+		fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0)
+			return NULL;
 	}
 
+	return xpcapng_dump_open_fd(fd, compression, comment, hardware, os,
+				    user_application);
+}
+
+/*****************************************************************************
+ * xpcapng_dump_open_fd()
+ *
+ * Like xpcapng_dump_open_compressed(), but write to an already open file
+ * descriptor, for example a connected socket. The dumper owns the file
+ * descriptor from here on, also when it fails.
+ *****************************************************************************/
+struct xpcapng_dumper *xpcapng_dump_open_fd(int fd,
+					    enum xpcapng_compression compression,
+					    const char *comment,
+					    const char *hardware,
+					    const char *os,
+					    const char *user_application)
+{
+	struct xpcapng_dumper *pd = NULL;
+
 	pd = calloc(sizeof(*pd), 1);
 	if (pd == NULL) {
 		errno = ENOMEM;
 		goto error_exit;
 	}
-	pd->pd_fd = -1;
+	pd->pd_fd = fd;
 
-	if (strcmp(file, "-") == 0) {
-		pd->pd_fd = STDOUT_FILENO;
-	} else {
-		pd->pd_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-		if (pd->pd_fd < 0)
-			goto error_exit;
-	}
+	if (compression != XPCAPNG_COMPRESS_NONE &&
+	    !pcapng_compress_start(pd, compression))
+		goto error_exit;
 
 	if (!pcapng_write_shb(pd, comment, hardware, os, user_application))
 		goto error_exit;
@@ -571,11 +1417,13 @@ struct xpcapng_dumper *xpcapng_dump_open(const char *file,
 
 error_exit:
 	if (pd) {
-		if (pd->pd_fd >= 0 && pd->pd_fd != STDOUT_FILENO)
-			close(pd->pd_fd);
+		if (pd->pd_comp)
+			pcapng_compress_stop(pd);
 
 		free(pd);
 	}
+	if (fd >= 0 && fd != STDOUT_FILENO)
+		close(fd);
 	return NULL;
 }
 
@@ -587,9 +1435,25 @@ void xpcapng_dump_close(struct xpcapng_dumper *pd)
 	if (pd == NULL)
 		return;
 
-	if (pd->pd_fd < 0 && pd->pd_fd != STDOUT_FILENO)
+	if (pd->pd_send)
+		pcapng_send_stop(pd);
+	else if (pd->pd_comp)
+		pcapng_compress_stop(pd);
+	else if (pd->pd_buf)
+		pcapng_drain_buffer(pd, true);
+
+	/* Drop the preallocated space past the last block */
+	if (pd->pd_map_size) {
+		pcapng_unmap_window(pd);
+		if (ftruncate(pd->pd_fd, pd->pd_size)) {
+			/* Readers will stop at the zeroed space */
+		}
+	}
+
+	if (pd->pd_fd >= 0 && pd->pd_fd != STDOUT_FILENO)
 		close(pd->pd_fd);
 
+	free(pd->pd_buf);
 	free(pd);
 }
 
@@ -598,13 +1462,200 @@ void xpcapng_dump_close(struct xpcapng_dumper *pd)
  *****************************************************************************/
 int xpcapng_dump_flush(struct xpcapng_dumper *pd)
 {
-	if (pd != NULL)
+	if (pd != NULL) {
+		/* The send queue drains by itself, without waiting for it */
+		if (pd->pd_send) {
+			pthread_mutex_lock(&pd->pd_send->ps_lock);
+			errno = pd->pd_send->ps_error;
+			pthread_mutex_unlock(&pd->pd_send->ps_lock);
+			return errno ? -1 : 0;
+		}
+
+		if (pd->pd_comp && !pcapng_compress_wait(pd, true))
+			return -1;
+
+		if (pd->pd_buf && !pcapng_drain_buffer(pd, true))
+			return -1;
+
+		/* Only sync the part of the window written since last time,
+		 * unless some of it went to the file some other way
+		 */
+		if (pd->pd_map && pd->pd_map_need_fsync) {
+			pd->pd_map_need_fsync = false;
+			pd->pd_map_synced = pd->pd_size;
+			if (msync(pd->pd_map, pd->pd_map_size, MS_SYNC))
+				return -1;
+			return fdatasync(pd->pd_fd);
+		}
+
+		if (pd->pd_map) {
+			uint64_t start = pd->pd_map_synced;
+
+			if (start < (uint64_t)pd->pd_map_offset)
+				start = pd->pd_map_offset;
+			start &= ~(pcapng_page_size() - 1);
+			pd->pd_map_synced = pd->pd_size;
+
+			if (pd->pd_size <= start)
+				return 0;
+
+			return msync(pd->pd_map + (start - pd->pd_map_offset),
+				     pd->pd_size - start, MS_SYNC);
+		}
+
 		return fsync(pd->pd_fd);
+	}
 
 	errno = EINVAL;
 	return -1;
 }
 
+/*****************************************************************************
+ * xpcapng_dump_size()
+ *
+ * Return the size of the file, including the data that is still buffered.
+ *****************************************************************************/
+uint64_t xpcapng_dump_size(struct xpcapng_dumper *pd)
+{
+	return pd ? pd->pd_size : 0;
+}
+
+/*****************************************************************************
+ * xpcapng_dump_set_buffer_size()
+ *****************************************************************************/
+int xpcapng_dump_set_buffer_size(struct xpcapng_dumper *pd, size_t size)
+{
+	uint8_t *buf = NULL;
+
+	if (pd == NULL || pd->pd_map_size || pd->pd_send) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Without a size the compressor falls back to its default chunks */
+	if (pd->pd_comp) {
+		if (!pcapng_compress_wait(pd, false) ||
+		    !pcapng_compress_alloc_chunks(pd, size))
+			return -1;
+		return 0;
+	}
+
+	if (pd->pd_buf && !pcapng_drain_buffer(pd, true))
+		return -1;
+
+	if (size) {
+		size = roundup(size, PCAPNG_WRITE_ALIGN);
+		buf = malloc(size);
+		if (buf == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	free(pd->pd_buf);
+	pd->pd_buf = buf;
+	pd->pd_buf_size = size;
+	pd->pd_buf_len = 0;
+	return 0;
+}
+
+/*****************************************************************************
+ * xpcapng_dump_set_mmap()
+ *
+ * Write the file through a shared mapping of window_size bytes, which moves
+ * along as the file grows. Space is preallocated a window at a time, and
+ * truncated to the actual size on close. Only regular files can be mapped,
+ * and any write buffer is released.
+ *****************************************************************************/
+int xpcapng_dump_set_mmap(struct xpcapng_dumper *pd, size_t window_size)
+{
+	struct stat st;
+
+	if (pd == NULL || pd->pd_map_size || pd->pd_comp || pd->pd_send ||
+	    fstat(pd->pd_fd, &st)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (xpcapng_dump_set_buffer_size(pd, 0))
+		return -1;
+
+	if (window_size < PCAPNG_MAP_MIN)
+		window_size = PCAPNG_MAP_MIN;
+
+	pd->pd_map_size = roundup(window_size, pcapng_page_size());
+	pd->pd_map_synced = pd->pd_size;
+	if (!pcapng_map_window(pd)) {
+		pd->pd_map_size = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ * xpcapng_dump_set_send_queue()
+ *
+ * Queue all further blocks, up to size bytes, for a separate thread to write
+ * out. Blocks that do not fit the queue are dropped, and writing them fails
+ * with ENOBUFS, so the caller can account for them. Can not be combined with
+ * compression, the write buffer, which is released, or a mapped file.
+ *****************************************************************************/
+int xpcapng_dump_set_send_queue(struct xpcapng_dumper *pd, size_t size)
+{
+	struct pcapng_sender *ps;
+	sigset_t              sigset, old_sigset;
+	int                   err;
+
+	if (pd == NULL || pd->pd_map_size || pd->pd_comp || pd->pd_send ||
+	    size == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (xpcapng_dump_set_buffer_size(pd, 0))
+		return -1;
+
+	ps = calloc(1, sizeof(*ps));
+	if (ps == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ps->ps_buf = malloc(size);
+	if (ps->ps_buf == NULL) {
+		free(ps);
+		errno = ENOMEM;
+		return -1;
+	}
+	ps->ps_fd = pd->pd_fd;
+	ps->ps_size = size;
+	pthread_mutex_init(&ps->ps_lock, NULL);
+	pthread_cond_init(&ps->ps_cond, NULL);
+
+	/* Like the compression thread, keep signals going to the application;
+	 * this also turns SIGPIPE into an EPIPE error of the write.
+	 */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &old_sigset);
+	err = pthread_create(&ps->ps_thread, NULL, pcapng_send_thread, ps);
+	pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+	if (err) {
+		pthread_cond_destroy(&ps->ps_cond);
+		pthread_mutex_destroy(&ps->ps_lock);
+		free(ps->ps_buf);
+		free(ps);
+		errno = err;
+		return -1;
+	}
+
+	pd->pd_send = ps;
+	return 0;
+}
+
 /*****************************************************************************
  * pcapng_dump_add_interface()
  *****************************************************************************/
@@ -19,6 +19,15 @@ enum xpcapng_epb_flags {
 	PCAPNG_EPB_FLAG_OUTBOUND = 0x2
 };
 
+/*****************************************************************************
+ * Compression of the output file
+ *****************************************************************************/
+enum xpcapng_compression {
+	XPCAPNG_COMPRESS_NONE,
+	XPCAPNG_COMPRESS_ZSTD,
+	XPCAPNG_COMPRESS_LZ4
+};
+
 /*****************************************************************************
  * EPB options structure
  *****************************************************************************/
@@ -39,8 +48,27 @@ extern struct xpcapng_dumper *xpcapng_dump_open(const char *file,
 						const char *hardware,
 						const char *os,
 						const char *user_application);
+extern struct xpcapng_dumper *xpcapng_dump_open_compressed(const char *file,
+							   enum xpcapng_compression compression,
+							   const char *comment,
+							   const char *hardware,
+							   const char *os,
+							   const char *user_application);
+extern struct xpcapng_dumper *xpcapng_dump_open_fd(int fd,
+						   enum xpcapng_compression compression,
+						   const char *comment,
+						   const char *hardware,
+						   const char *os,
+						   const char *user_application);
 extern void xpcapng_dump_close(struct xpcapng_dumper *pd);
 extern int xpcapng_dump_flush(struct xpcapng_dumper *pd);
+extern uint64_t xpcapng_dump_size(struct xpcapng_dumper *pd);
+extern int xpcapng_dump_set_buffer_size(struct xpcapng_dumper *pd,
+					size_t size);
+extern int xpcapng_dump_set_mmap(struct xpcapng_dumper *pd,
+				 size_t window_size);
+extern int xpcapng_dump_set_send_queue(struct xpcapng_dumper *pd,
+				       size_t size);
 extern int xpcapng_dump_add_interface(struct xpcapng_dumper *pd,
 				      uint16_t snap_len,
 				      const char *name, const char *description,
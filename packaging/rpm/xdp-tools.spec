@@ -99,6 +99,7 @@ make install V=1
 %{_libdir}/libxdp.so.1
 %{_libdir}/libxdp.so.%{_soversion}
 %{_libdir}/bpf/xdp-dispatcher.o
+%{_libdir}/bpf/xdp-dispatcher-*.o
 %{_libdir}/bpf/xsk_def_xdp_prog*.o
 %{_mandir}/man3/*
 %license LICENSES/*
@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef _LATENCY_HIST_BPF_H
+#define _LATENCY_HIST_BPF_H
+
+#include <bpf/vmlinux.h>
+#include <bpf/bpf_helpers.h>
+
+/* Slot n counts times in [2^n, 2^(n+1)) ns, the last one everything above */
+#define LATENCY_SLOTS 32
+
+typedef struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, LATENCY_SLOTS);
+	__type(key, u32);
+	__type(value, u64);
+} latency_hist_map;
+
+static __always_inline u32 log2_u32(u32 v)
+{
+	u32 r, shift;
+
+	r = (v > 0xFFFF) << 4; v >>= r;
+	shift = (v > 0xFF) << 3; v >>= shift; r |= shift;
+	shift = (v > 0xF) << 2; v >>= shift; r |= shift;
+	shift = (v > 0x3) << 1; v >>= shift; r |= shift;
+	r |= (v >> 1);
+	return r;
+}
+
+static __always_inline u32 log2_u64(u64 v)
+{
+	u32 hi = v >> 32;
+
+	return hi ? log2_u32(hi) + 32 : log2_u32(v);
+}
+
+static __always_inline void latency_hist_add(void *map, u64 delta)
+{
+	u32 key = log2_u64(delta);
+	u64 *slot;
+
+	if (key >= LATENCY_SLOTS)
+		key = LATENCY_SLOTS - 1;
+
+	slot = bpf_map_lookup_elem(map, &key);
+	if (slot)
+		*slot += 1;
+}
+
+/* Put the current time in front of the packet before it is redirected, for
+ * the program at the other end of the queue to pick up. Drivers without
+ * metadata support fail the adjust; those packets are just not measured.
+ */
+static __always_inline void queue_stamp(struct xdp_md *ctx)
+{
+	void *data;
+	u64 *meta;
+
+	if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(*meta)))
+		return;
+
+	meta = (void *)(long)ctx->data_meta;
+	data = (void *)(long)ctx->data;
+	if ((void *)(meta + 1) <= data)
+		*meta = bpf_ktime_get_ns();
+}
+
+/* Record how long ago a packet was stamped, and remove the stamp again */
+static __always_inline void queue_delay_record(struct xdp_md *ctx, void *map)
+{
+	void *data = (void *)(long)ctx->data;
+	u64 *meta = (void *)(long)ctx->data_meta;
+	u64 now, stamp;
+
+	if ((void *)(meta + 1) > data)
+		return;
+
+	stamp = *meta;
+	now = bpf_ktime_get_ns();
+	if (stamp && stamp <= now)
+		latency_hist_add(map, now - stamp);
+
+	bpf_xdp_adjust_meta(ctx, (int)sizeof(*meta));
+}
+
+#endif
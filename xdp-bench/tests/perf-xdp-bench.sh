@@ -0,0 +1,192 @@
+XDP_BENCH=${XDP_BENCH:-./xdp-bench}
+ALL_TESTS="perf_drop perf_pass perf_tx perf_redirect perf_redirect_cpu perf_redirect_cpu_touch perf_redirect_cpu_pass perf_redirect_map perf_redirect_multi perf_redirect_veth"
+
+# Performance suite, run with 'make perf'. Every test measures the receive rate
+# of one xdp-bench mode on the outside end of the test veth pair, while tx-gen
+# sends a fixed stream of 64-byte UDP packets from inside the namespace. The
+# median rate of each test is appended as a JSON line to $PERF_RESULTS. If
+# $PERF_BASELINE names a file of earlier results, a test fails when its rate
+# dropped by more than $PERF_THRESHOLD percent; tests missing from the baseline
+# are added to it, so the first run records a new baseline.
+PERF_RESULTS=${PERF_RESULTS:-perf-xdp-bench.json}
+PERF_BASELINE=${PERF_BASELINE:-}
+PERF_THRESHOLD=${PERF_THRESHOLD:-10}
+PERF_DURATION=${PERF_DURATION:-10}
+PERF_TXGEN_ARGS=${PERF_TXGEN_ARGS:--c copy -s 64}
+
+# perf_redirect_veth spreads the traffic over $PERF_VETH_COUNT containers, each
+# a namespace behind a veth pair. The inside end of each pair either runs
+# xdp-bench pass or has GRO enabled, as set by $PERF_VETH_NAPI (xdp or gro).
+PERF_VETH_COUNT=${PERF_VETH_COUNT:-4}
+PERF_VETH_NAPI=${PERF_VETH_NAPI:-xdp}
+PERF_VETH_PREFIX=xbveth
+
+TXGEN_PID=
+
+start_traffic()
+{
+    TXGEN_PID=$(start_background_no_stderr ip netns exec $NS env TESTENV_NAME=$NS \
+                $SETUP_SCRIPT $XDP_BENCH tx-gen veth0 $PERF_TXGEN_ARGS \
+                -D $OUTSIDE_MAC --src-ip $INSIDE_IP4 --dst-ip $OUTSIDE_IP4)
+}
+
+stop_traffic()
+{
+    [ -n "$TXGEN_PID" ] && stop_background $TXGEN_PID >/dev/null 2>&1
+    TXGEN_PID=
+}
+
+# Median of the total rx rates, leaving out the first interval as warm-up
+median_rx_pps()
+{
+    jq -s '[.[] | select(.stat == "rx" and (has("cpu") | not)) | .pkt][1:]
+           | sort | if length > 0 then .[length / 2 | floor] else 0 end' "$1"
+}
+
+perf_run()
+{
+    local name=$1
+    local output="${STATEDIR}/perf_${name}.json"
+    local pps base limit
+    shift
+
+    command -v jq >/dev/null || return "$SKIPPED_TEST"
+    [ "$ENABLE_IPV4" -eq "1" ] || return "$SKIPPED_TEST"
+
+    start_traffic
+    timeout -s INT $PERF_DURATION $XDP_BENCH "$@" -F json -i 1 > "$output"
+    stop_traffic
+
+    pps=$(median_rx_pps "$output")
+    echo "$name: $pps pps"
+    [ "$pps" -gt "0" ] || return 1
+
+    echo "{\"test\":\"$name\",\"pps\":$pps}" >> "$PERF_RESULTS"
+
+    [ -n "$PERF_BASELINE" ] || return 0
+
+    base=$(jq -s "[.[] | select(.test == \"$name\") | .pps][-1] // 0" "$PERF_BASELINE" 2>/dev/null || echo 0)
+    if [ "$base" -eq "0" ]; then
+        echo "No baseline for $name, recording $pps pps"
+        echo "{\"test\":\"$name\",\"pps\":$pps}" >> "$PERF_BASELINE"
+        return 0
+    fi
+
+    limit=$((base * (100 - PERF_THRESHOLD) / 100))
+    echo "Baseline $base pps, failing below $limit pps"
+    [ "$pps" -ge "$limit" ]
+}
+
+perf_drop()
+{
+    perf_run drop drop $NS
+}
+
+perf_pass()
+{
+    perf_run pass pass $NS
+}
+
+perf_tx()
+{
+    perf_run tx tx $NS
+}
+
+perf_redirect()
+{
+    perf_run redirect redirect $NS $NS
+}
+
+perf_redirect_cpu()
+{
+    skip_if_missing_cpumap_attach
+    perf_run redirect_cpu redirect-cpu $NS -c 0
+}
+
+perf_redirect_cpu_touch()
+{
+    skip_if_missing_cpumap_attach
+    perf_run redirect_cpu_touch redirect-cpu $NS -c 0 -p touch
+}
+
+perf_redirect_cpu_pass()
+{
+    skip_if_missing_cpumap_attach
+    is_progmap_supported || export LIBXDP_SKIP_DISPATCHER=1
+    perf_run redirect_cpu_pass redirect-cpu $NS -c 0 -r pass
+}
+
+perf_redirect_map()
+{
+    perf_run redirect_map redirect-map $NS $NS
+}
+
+perf_redirect_multi()
+{
+    perf_run redirect_multi redirect-multi $NS $NS
+}
+
+# The inside ends get the MAC address tx-gen sends to, so that the packets
+# make it into the network stack of the containers
+veth_containers_setup()
+{
+    local i ns
+
+    for i in $(seq $PERF_VETH_COUNT); do
+        ns="${PERF_VETH_PREFIX}-ns$i"
+        ip netns add "$ns" || return 1
+        ip link add dev "${PERF_VETH_PREFIX}$i" type veth peer name veth0 netns "$ns" || return 1
+        ip -n "$ns" link set dev veth0 address "$OUTSIDE_MAC" || return 1
+        ip -n "$ns" link set dev veth0 up || return 1
+        ip link set dev "${PERF_VETH_PREFIX}$i" up || return 1
+
+        if [ "$PERF_VETH_NAPI" == "gro" ]; then
+            ip netns exec "$ns" ethtool -K veth0 gro on >/dev/null || return 1
+        else
+            start_background_no_stderr ip netns exec "$ns" env TESTENV_NAME=$NS \
+                $SETUP_SCRIPT $XDP_BENCH pass veth0 >/dev/null
+        fi
+    done
+}
+
+veth_containers_cleanup()
+{
+    local i
+
+    for i in $(seq $PERF_VETH_COUNT); do
+        ip link del dev "${PERF_VETH_PREFIX}$i" >/dev/null 2>&1
+        ip netns del "${PERF_VETH_PREFIX}-ns$i" >/dev/null 2>&1
+    done
+}
+
+perf_redirect_veth()
+{
+    local ret i f devs=""
+
+    [ "$PERF_VETH_NAPI" == "xdp" ] || [ "$PERF_VETH_NAPI" == "gro" ] || return 1
+
+    veth_containers_setup || { veth_containers_cleanup; return 1; }
+    for i in $(seq $PERF_VETH_COUNT); do
+        devs="$devs ${PERF_VETH_PREFIX}$i"
+    done
+
+    perf_run "redirect_veth_${PERF_VETH_NAPI}" redirect-veth $NS $devs -S round-robin
+    ret=$?
+
+    for f in ${STATEDIR}/proc/*; do
+        [ -f "$f" ] && stop_background "${f/${STATEDIR}\/proc\//}" >/dev/null 2>&1
+    done
+    veth_containers_cleanup
+    return $ret
+}
+
+cleanup_tests()
+{
+    # The tests run in subshells, so find tx-gen through the runner state
+    for f in ${STATEDIR}/proc/*; do
+        [ -f "$f" ] && stop_background "${f/${STATEDIR}\/proc\//}" >/dev/null 2>&1
+    done
+    ip -n $NS link set dev veth0 xdp off >/dev/null 2>&1
+    ip link set dev $NS xdp off >/dev/null 2>&1
+    veth_containers_cleanup
+}
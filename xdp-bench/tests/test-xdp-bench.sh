@@ -1,6 +1,6 @@
 XDP_LOADER=${XDP_LOADER:-./xdp-loader}
 XDP_BENCH=${XDP_BENCH:-./xdp-bench}
-ALL_TESTS="test_drop test_pass test_tx test_rxq_stats test_redirect test_redirect_cpu test_redirect_map test_redirect_map_egress test_redirect_multi test_redirect_multi_egress"
+ALL_TESTS="test_drop test_pass test_tx test_rxq_stats test_rx_metadata test_tunnel test_perf_counters test_redirect test_redirect_cpu test_redirect_map test_redirect_map_egress test_redirect_multi test_redirect_multi_egress test_redirect_veth test_xsk test_redirect_xsk test_tx_gen test_prog_run test_prog_run_replay"
 
 test_basic()
 {
@@ -12,6 +12,10 @@ test_basic()
     check_run $XDP_BENCH $action $NS -p swap-macs -vv
     check_run $XDP_BENCH $action $NS -m skb -vv
     check_run $XDP_BENCH $action $NS -e -vv
+    check_run $XDP_BENCH $action $NS -F json -vv
+    check_run $XDP_BENCH $action $NS -F csv -vv
+    check_run $XDP_BENCH $action $NS --interval-ms 100 -vv
+    check_run $XDP_BENCH $action $NS -L -vv
 }
 
 test_drop()
@@ -35,6 +39,46 @@ test_rxq_stats()
     check_run $XDP_BENCH drop $NS -r -vv
 }
 
+test_rx_metadata()
+{
+    # veth implements the RX metadata kfuncs since they were added
+    skip_if_missing_kernel_symbol veth_xdp_rx_hash
+
+    export XDP_SAMPLE_IMMEDIATE_EXIT=1
+    check_run $XDP_BENCH drop $NS -p rx-metadata -vv
+    check_run $XDP_BENCH pass $NS -p rx-metadata --rx-meta hash,vlan -vv
+    check_run $XDP_BENCH drop $NS -p rx-metadata -F json -vv
+
+    # the other modes must not carry the kfunc calls, which only load in a
+    # device-bound program, now that the kernel resolves them
+    check_run $XDP_BENCH drop $NS -vv
+    check_run $XDP_BENCH pass $NS -p read-data -vv
+    check_run $XDP_BENCH tx $NS -p swap-macs -vv
+    check_run $XDP_BENCH drop $NS -m skb -vv
+}
+
+test_tunnel()
+{
+    export XDP_SAMPLE_IMMEDIATE_EXIT=1
+    check_run $XDP_BENCH tx $NS -p encap -vv
+    check_run $XDP_BENCH tx $NS -p decap --tunnel gre -vv
+    check_run $XDP_BENCH drop $NS -p encap --tunnel ipip -m skb -vv
+    check_run ip link add dev btest0 type veth peer name btest1
+    check_run $XDP_BENCH redirect btest0 btest1 -p encap --tunnel gre -vv
+    check_run $XDP_BENCH redirect btest0 btest1 -p decap -vv
+    ip link del dev btest0
+}
+
+test_perf_counters()
+{
+    # Most virtual machines have no hardware counters
+    [ -d /sys/bus/event_source/devices/cpu ] || exit "$SKIPPED_TEST"
+
+    export XDP_SAMPLE_IMMEDIATE_EXIT=1
+    check_run $XDP_BENCH drop $NS --perf-counters -vv
+    check_run $XDP_BENCH drop $NS --perf-counters -F json -vv
+}
+
 test_redirect()
 {
     export XDP_SAMPLE_IMMEDIATE_EXIT=1
@@ -59,10 +103,19 @@ test_redirect_cpu()
     check_run $XDP_BENCH redirect-cpu btest0 -c 0 -p l4-proto -vv
     check_run $XDP_BENCH redirect-cpu btest0 -c 0 -p l4-filter -vv
     check_run $XDP_BENCH redirect-cpu btest0 -c 0 -p l4-hash -vv
+    check_run $XDP_BENCH redirect-cpu btest0 -c 0 -p l4-sym-hash -vv
+    check_run $XDP_BENCH redirect-cpu btest0 -c 0 -p load-balance -vv
+    check_run $XDP_BENCH redirect-cpu btest0 -c 0 -p l4-tunnel-hash -vv
+    check_run $XDP_BENCH redirect-cpu btest0 -c 0 -S -vv
+    check_run $XDP_BENCH redirect-cpu btest0 -N -vv
+    check_run $XDP_BENCH redirect-cpu btest0 -c 0 -p touch -L -vv
 
     is_progmap_supported || export LIBXDP_SKIP_DISPATCHER=1
     check_run $XDP_BENCH redirect-cpu btest0 -c 0 -r drop -vv
     check_run $XDP_BENCH redirect-cpu btest0 -c 0 -r pass -vv
+    check_run $XDP_BENCH redirect-cpu btest0 -c 0 -r pass -Q -vv
+    check_run $XDP_BENCH redirect-cpu btest0 -c 0 -r pass -G keep -vv
+    check_run $XDP_BENCH redirect-cpu btest0 -c 0 -G off -vv
     check_run $XDP_BENCH redirect-cpu btest0 -c 0 -r redirect -D btest1  -vv
     ip link del dev btest0
 }
@@ -86,6 +139,7 @@ test_redirect_map_egress()
     check_run ip link add dev btest0 type veth peer name btest1
     is_progmap_supported || export LIBXDP_SKIP_DISPATCHER=1
     check_run $XDP_BENCH redirect-map btest0 btest1 -X -vv
+    check_run $XDP_BENCH redirect-map btest0 btest1 -X -Q -vv
     ip link del dev btest0
 }
 
@@ -98,6 +152,23 @@ test_redirect_multi()
     check_run $XDP_BENCH redirect-multi btest0 btest1 btest2 btest3 -s -vv
     check_run $XDP_BENCH redirect-multi btest0 btest1 btest2 btest3 -m skb -vv
     check_run $XDP_BENCH redirect-multi btest0 btest1 btest2 btest3 -e -vv
+    check_run $XDP_BENCH redirect-multi btest0 btest1 btest2 btest3 -E -I -vv
+    ip link del dev btest0
+    ip link del dev btest2
+}
+
+test_redirect_veth()
+{
+    export XDP_SAMPLE_IMMEDIATE_EXIT=1
+    $XDP_BENCH redirect-veth $NS $NS -vv && return 1
+    check_run ip link add dev btest0 type veth peer name btest1
+    check_run ip link add dev btest2 type veth peer name btest3
+    check_run $XDP_BENCH redirect-veth $NS btest0 btest2 -vv
+    check_run $XDP_BENCH redirect-veth $NS btest0 btest2 -S round-robin -vv
+    check_run $XDP_BENCH redirect-veth $NS btest0 btest2 -s -vv
+    check_run $XDP_BENCH redirect-veth $NS btest0 btest2 -m skb -vv
+    check_run $XDP_BENCH redirect-veth $NS btest0 btest2 -e -vv
+    check_run $XDP_BENCH redirect-veth $NS btest0 btest2 -F json -vv
     ip link del dev btest0
     ip link del dev btest2
 }
@@ -112,11 +183,91 @@ test_redirect_multi_egress()
     check_run ip link add dev btest2 type veth peer name btest3
 
     check_run $XDP_BENCH redirect-multi btest0 btest1 btest2 btest3 -X -vv
+    check_run $XDP_BENCH redirect-multi btest0 btest1 btest2 btest3 -X -E -G 1 -G 1 -G 2 -G 2 -vv
+    check_run $XDP_BENCH redirect-multi btest0 btest1 btest2 btest3 -X -G 0 -G 0 -G 0 -G 0 --vlan-groups -vv
 
     ip link del dev btest0
     ip link del dev btest2
 }
 
+test_xsk()
+{
+    export XDP_SAMPLE_IMMEDIATE_EXIT=1
+    check_run ip link add dev btest0 type veth peer name btest1
+    check_run ip link set dev btest0 up
+    check_run ip link set dev btest1 up
+    for cmd in xsk-drop xsk-tx xsk-fwd; do
+        check_run $XDP_BENCH $cmd btest0 -c copy -vv
+        check_run $XDP_BENCH $cmd btest0 -c copy -B 16 -vv
+        check_run $XDP_BENCH $cmd btest0 -c copy -m skb -vv
+    done
+    ip link del dev btest0
+}
+
+test_redirect_xsk()
+{
+    export XDP_SAMPLE_IMMEDIATE_EXIT=1
+    check_run ip link add dev btest0 numrxqueues 2 type veth peer name btest1
+    check_run ip link set dev btest0 up
+    check_run ip link set dev btest1 up
+    check_run $XDP_BENCH redirect-xsk btest0 -c copy -vv
+    check_run $XDP_BENCH redirect-xsk btest0 -c copy -q 1 -vv
+    check_run $XDP_BENCH redirect-xsk btest0 -c copy -F json -vv
+    ip link del dev btest0
+}
+
+test_tx_gen()
+{
+    export XDP_SAMPLE_IMMEDIATE_EXIT=1
+    check_run ip link add dev btest0 type veth peer name btest1
+    check_run ip link set dev btest0 up
+    check_run ip link set dev btest1 up
+    check_run $XDP_BENCH tx-gen btest0 -c copy -vv
+    check_run $XDP_BENCH tx-gen btest0 -c copy -f 16 -s 64 -s 1514 -r 10000 -vv
+    check_run $XDP_BENCH tx-gen btest0 -c copy -P tcp --dst-ip 192.0.2.10 -D 02:00:00:00:00:01 -vv
+    ip link del dev btest0
+
+    # The rate must leave every queue at least one packet per second
+    check_run ip link add dev btest0 numrxqueues 2 numtxqueues 2 type veth peer name btest1
+    check_run ip link set dev btest0 up
+    check_run ip link set dev btest1 up
+    $XDP_BENCH tx-gen btest0 -c copy -q 0 -q 1 -r 1 -vv && return 1
+    check_run $XDP_BENCH tx-gen btest0 -c copy -q 0 -q 1 -r 2 -vv
+    ip link del dev btest0
+}
+
+test_prog_run()
+{
+    check_run $XDP_BENCH prog-run $TEST_PROG_DIR/xdp_drop.o -r 1000 -vv
+    check_run $XDP_BENCH prog-run $TEST_PROG_DIR/xdp_pass.o -n xdp_pass -e -vv
+    check_run $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_drop.o $TEST_PROG_DIR/xdp_pass.o -vv
+    check_run $XDP_BENCH prog-run -d $NS -r 1000 -vv
+    check_run $XDP_LOADER unload $NS --all -vv
+}
+
+# A pcap file with two 60-byte packets, replayed into a pcapng file with the
+# verdicts, which is then read back in
+test_prog_run_replay()
+{
+    local pcap="${STATEDIR}/prog_run.pcap"
+    local pcapng="${STATEDIR}/prog_run.pcapng"
+    local pkt="\x00\x00\x00\x00\x3c\x00\x00\x00\x3c\x00\x00\x00$(printf '\\x00%.0s' $(seq 60))"
+    local output
+
+    printf "\xd4\xc3\xb2\xa1\x02\x00\x04\x00\x00\x00\x00\x00\x00\x00\x00\x00\xff\xff\x00\x00\x01\x00\x00\x00" > "$pcap"
+    printf "\x01\x00\x00\x00${pkt}\x02\x00\x00\x00${pkt}" >> "$pcap"
+
+    check_run $XDP_BENCH prog-run $TEST_PROG_DIR/xdp_drop.o -p "$pcap" -w "$pcapng" -r 1 -b 1 -e -vv
+    [ -s "$pcapng" ] || return 1
+
+    output=$($XDP_BENCH prog-run $TEST_PROG_DIR/xdp_pass.o -p "$pcapng" -r 10 2>&1)
+    echo "$output"
+    echo "$output" | grep -q "^2 packets" || return 1
+
+    $XDP_BENCH prog-run $TEST_PROG_DIR/xdp_pass.o -w "$pcapng" && return 1
+    rm -f "$pcap" "$pcapng"
+}
+
 cleanup_tests()
 {
     ip link del dev btest0 >/dev/null 2>&1
@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef _TUNNEL_BPF_H
+#define _TUNNEL_BPF_H
+
+/* Pushing and popping tunnel headers in front of the packet, the way a tunnel
+ * endpoint would, to measure what that costs in a driver.
+ *
+ * The outer header is always IPv4 without options, with the addresses of
+ * tunnel_saddr and tunnel_daddr and the MAC addresses of the inner frame
+ * swapped, so the packet goes back where it came from. VXLAN carries the
+ * whole Ethernet frame, GRE and IPIP only its IPv4 or IPv6 payload (IPIP
+ * becoming SIT for IPv6). Decapsulation takes any outer addresses, but only
+ * GRE without checksum or routing.
+ */
+#include <bpf/vmlinux.h>
+#include <bpf/bpf_helpers.h>
+#include <xdp/xdp_sample.bpf.h>
+
+#include "tunnel.h"
+
+#define IPPROTO_IPIP 4
+#define IPPROTO_GRE 47
+#define IPPROTO_IPV6 41
+#define ETH_P_TEB 0x6558
+#define VXLAN_PORT 4789
+#define VXLAN_VNI 1
+#define IP_DF 0x4000
+
+#define GRE_CSUM 0x8000
+#define GRE_ROUTING 0x4000
+#define GRE_KEY 0x2000
+#define GRE_SEQ 0x1000
+
+#ifndef bpf_htonl
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define bpf_htonl(x) __builtin_bswap32(x)
+#else
+#define bpf_htonl(x) (x)
+#endif
+#endif
+
+struct gre_base_hdr {
+	__be16 flags;
+	__be16 protocol;
+};
+
+struct vxlanhdr {
+	__be32 vx_flags;
+	__be32 vx_vni;
+};
+
+#define VXLAN_HF_VNI 0x08000000
+
+const volatile enum tunnel_op tunnel_op = TUNNEL_NONE;
+const volatile enum tunnel_type tunnel_type = TUNNEL_VXLAN;
+const volatile __be32 tunnel_saddr = bpf_htonl(0xc0000201); /* 192.0.2.1 */
+const volatile __be32 tunnel_daddr = bpf_htonl(0xc0000202); /* 192.0.2.2 */
+
+static __always_inline __u16 tunnel_csum_fold(__u32 sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum += sum >> 16;
+	return ~sum;
+}
+
+static __always_inline __u16 tunnel_ip_csum(struct iphdr *iph)
+{
+	__u16 *p = (__u16 *)iph;
+	__u32 sum = 0;
+	int i;
+
+#pragma unroll
+	for (i = 0; i < (int)sizeof(*iph) / 2; i++)
+		sum += p[i];
+	return tunnel_csum_fold(sum);
+}
+
+/* The UDP source port of VXLAN spreads flows like the kernel does, here from
+ * the addresses and ports of an inner IPv4 packet
+ */
+static __always_inline __u16 tunnel_sport(void *l3, void *data_end, __u16 proto)
+{
+	struct iphdr *iph = l3;
+	__u32 hash;
+
+	if (proto != bpf_htons(ETH_P_IP) || (void *)(iph + 1) + 4 > data_end)
+		return bpf_htons(49152);
+
+	hash = iph->saddr ^ iph->daddr ^ *(__u32 *)(iph + 1);
+	hash ^= hash >> 16;
+	return bpf_htons(49152 | (hash & 0x3fff));
+}
+
+static __always_inline int tunnel_encap(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct ethhdr *eth = data, orig;
+	int push, outer_len;
+	struct gre_base_hdr *gre;
+	struct vxlanhdr *vxh;
+	struct iphdr *iph;
+	struct udphdr *udp;
+	__u16 sport = 0;
+	__u8 proto;
+
+	if ((void *)(eth + 1) > data_end)
+		return -1;
+	orig = *eth;
+
+	switch (tunnel_type) {
+	case TUNNEL_VXLAN:
+		sport = tunnel_sport(eth + 1, data_end, orig.h_proto);
+		/* The whole frame, its Ethernet header included */
+		push = sizeof(*eth) + sizeof(*iph) + sizeof(*udp) + sizeof(*vxh);
+		proto = IPPROTO_UDP;
+		break;
+	case TUNNEL_GRE:
+		push = sizeof(*iph) + sizeof(*gre);
+		proto = IPPROTO_GRE;
+		break;
+	case TUNNEL_IPIP:
+		if (orig.h_proto == bpf_htons(ETH_P_IP))
+			proto = IPPROTO_IPIP;
+		else if (orig.h_proto == bpf_htons(ETH_P_IPV6))
+			proto = IPPROTO_IPV6;
+		else
+			return -1;
+		push = sizeof(*iph);
+		break;
+	default:
+		return -1;
+	}
+
+	if (bpf_xdp_adjust_head(ctx, -push))
+		return -1;
+
+	data_end = (void *)(long)ctx->data_end;
+	data = (void *)(long)ctx->data;
+	eth = data;
+	iph = (void *)(eth + 1);
+	if ((void *)(iph + 1) + sizeof(*udp) + sizeof(*vxh) > data_end)
+		return -1;
+	outer_len = data_end - (void *)iph;
+
+	__builtin_memcpy(eth->h_dest, orig.h_source, ETH_ALEN);
+	__builtin_memcpy(eth->h_source, orig.h_dest, ETH_ALEN);
+	eth->h_proto = bpf_htons(ETH_P_IP);
+
+	iph->version = 4;
+	iph->ihl = sizeof(*iph) / 4;
+	iph->tos = 0;
+	iph->tot_len = bpf_htons(outer_len);
+	iph->id = 0;
+	iph->frag_off = bpf_htons(IP_DF);
+	iph->ttl = 64;
+	iph->protocol = proto;
+	iph->check = 0;
+	iph->saddr = tunnel_saddr;
+	iph->daddr = tunnel_daddr;
+	iph->check = tunnel_ip_csum(iph);
+
+	if (tunnel_type == TUNNEL_VXLAN) {
+		udp = (void *)(iph + 1);
+		udp->source = sport;
+		udp->dest = bpf_htons(VXLAN_PORT);
+		udp->len = bpf_htons(outer_len - sizeof(*iph));
+		/* A zero checksum is what RFC 7348 recommends over IPv4 */
+		udp->check = 0;
+		vxh = (void *)(udp + 1);
+		vxh->vx_flags = bpf_htonl(VXLAN_HF_VNI);
+		vxh->vx_vni = bpf_htonl(VXLAN_VNI << 8);
+	} else if (tunnel_type == TUNNEL_GRE) {
+		gre = (void *)(iph + 1);
+		gre->flags = 0;
+		gre->protocol = orig.h_proto;
+	}
+
+	return 0;
+}
+
+static __always_inline int tunnel_decap(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct ethhdr *eth = data, outer;
+	struct gre_base_hdr *gre;
+	struct iphdr *iph;
+	struct udphdr *udp;
+	int pop, hdr_len;
+	__u16 proto = 0;
+
+	iph = (void *)(eth + 1);
+	if ((void *)(iph + 1) > data_end)
+		return -1;
+	if (eth->h_proto != bpf_htons(ETH_P_IP) || iph->ihl != sizeof(*iph) / 4 ||
+	    tunnel_ip_csum(iph))
+		return -1;
+	outer = *eth;
+	hdr_len = sizeof(*iph);
+
+	switch (tunnel_type) {
+	case TUNNEL_VXLAN:
+		udp = (void *)(iph + 1);
+		if ((void *)(udp + 1) + sizeof(struct vxlanhdr) > data_end ||
+		    iph->protocol != IPPROTO_UDP || udp->dest != bpf_htons(VXLAN_PORT))
+			return -1;
+		/* The inner frame brings its own Ethernet header */
+		pop = sizeof(*eth) + sizeof(*iph) + sizeof(*udp) +
+		      sizeof(struct vxlanhdr);
+		break;
+	case TUNNEL_GRE:
+		gre = (void *)(iph + 1);
+		if ((void *)(gre + 1) > data_end || iph->protocol != IPPROTO_GRE ||
+		    gre->flags & bpf_htons(GRE_CSUM | GRE_ROUTING) ||
+		    gre->protocol == bpf_htons(ETH_P_TEB))
+			return -1;
+		hdr_len += sizeof(*gre);
+		if (gre->flags & bpf_htons(GRE_KEY))
+			hdr_len += 4;
+		if (gre->flags & bpf_htons(GRE_SEQ))
+			hdr_len += 4;
+		proto = gre->protocol;
+		pop = hdr_len;
+		break;
+	case TUNNEL_IPIP:
+		if (iph->protocol == IPPROTO_IPIP)
+			proto = bpf_htons(ETH_P_IP);
+		else if (iph->protocol == IPPROTO_IPV6)
+			proto = bpf_htons(ETH_P_IPV6);
+		else
+			return -1;
+		pop = hdr_len;
+		break;
+	default:
+		return -1;
+	}
+
+	if (bpf_xdp_adjust_head(ctx, pop))
+		return -1;
+
+	data_end = (void *)(long)ctx->data_end;
+	data = (void *)(long)ctx->data;
+	eth = data;
+	if ((void *)(eth + 1) > data_end)
+		return -1;
+
+	/* GRE and IPIP keep the outer Ethernet header, moved up */
+	if (tunnel_type != TUNNEL_VXLAN) {
+		*eth = outer;
+		eth->h_proto = proto;
+	}
+	swap_src_dst_mac(data);
+
+	return 0;
+}
+
+/* Do the configured tunnel operation, returning 0 if the packet was
+ * rewritten (or there was nothing to do) and -1 if it couldn't be
+ */
+static __always_inline int tunnel_rewrite(struct xdp_md *ctx)
+{
+	if (tunnel_op == TUNNEL_ENCAP)
+		return tunnel_encap(ctx);
+	if (tunnel_op == TUNNEL_DECAP)
+		return tunnel_decap(ctx);
+	return 0;
+}
+
+#endif
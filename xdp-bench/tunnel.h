@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef _TUNNEL_H
+#define _TUNNEL_H
+
+/* Shared between the BPF programs and userspace */
+
+enum tunnel_op {
+	TUNNEL_NONE,
+	TUNNEL_ENCAP,
+	TUNNEL_DECAP,
+};
+
+enum tunnel_type {
+	TUNNEL_VXLAN,
+	TUNNEL_GRE,
+	TUNNEL_IPIP,
+};
+
+#endif
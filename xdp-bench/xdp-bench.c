@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "xdp-bench.h"
+#include "xdp_basic.h"
 #include "params.h"
 
 #define PROG_NAME "xdp-bench"
@@ -21,6 +22,13 @@ int do_help(__unused const void *cfg, __unused const char *pin_root_path)
 		"       redirect-cpu   - XDP CPU redirect using BPF_MAP_TYPE_CPUMAP\n"
 		"       redirect-map   - XDP redirect using BPF_MAP_TYPE_DEVMAP\n"
 		"       redirect-multi - XDP multi-redirect using BPF_MAP_TYPE_DEVMAP and the BPF_F_BROADCAST flag\n"
+		"       redirect-veth  - XDP redirect spreading traffic over veth devices using BPF_MAP_TYPE_DEVMAP\n"
+		"       xsk-drop       - Receive and drop packets on AF_XDP sockets\n"
+		"       xsk-tx         - Transmit generated packets from AF_XDP sockets\n"
+		"       xsk-fwd        - Swap MACs and send packets back out through AF_XDP sockets\n"
+		"       redirect-xsk   - XDP redirect using BPF_MAP_TYPE_XSKMAP, with per-queue statistics\n"
+		"       tx-gen         - Generate UDP or TCP traffic from AF_XDP sockets\n"
+		"       prog-run       - Time an XDP program on test packets or a capture using BPF_PROG_RUN\n"
 		"       help           - show this help message\n"
 		"\n"
 		"Use 'xdp-bench COMMAND --help' to see options for each command\n");
@@ -34,10 +42,60 @@ struct enum_val xdp_modes[] = {
        {NULL, 0}
 };
 
+struct enum_val output_formats[] = {
+       {"text", SAMPLE_OUTPUT_TEXT},
+       {"json", SAMPLE_OUTPUT_JSON},
+       {"csv", SAMPLE_OUTPUT_CSV},
+       {NULL, 0}
+};
+
 struct enum_val basic_program_modes[] = {
        {"no-touch", BASIC_NO_TOUCH},
        {"read-data", BASIC_READ_DATA},
        {"swap-macs", BASIC_SWAP_MACS},
+       {"rx-metadata", BASIC_RX_METADATA},
+       {"encap", BASIC_ENCAP},
+       {"decap", BASIC_DECAP},
+       {NULL, 0}
+};
+
+struct enum_val redirect_program_modes[] = {
+       {"swap-macs", BASIC_SWAP_MACS},
+       {"encap", BASIC_ENCAP},
+       {"decap", BASIC_DECAP},
+       {NULL, 0}
+};
+
+struct enum_val veth_spreads[] = {
+       {"hash", VETH_SPREAD_HASH},
+       {"round-robin", VETH_SPREAD_ROUND_ROBIN},
+       {NULL, 0}
+};
+
+struct enum_val tunnel_types[] = {
+       {"vxlan", TUNNEL_VXLAN},
+       {"gre", TUNNEL_GRE},
+       {"ipip", TUNNEL_IPIP},
+       {NULL, 0}
+};
+
+struct flag_val basic_rx_meta_items[] = {
+       {"hash", BASIC_RX_META_HASH},
+       {"timestamp", BASIC_RX_META_TIMESTAMP},
+       {"vlan", BASIC_RX_META_VLAN},
+       {NULL, 0}
+};
+
+struct enum_val xsk_copy_modes[] = {
+       {"auto", XSK_COPY_AUTO},
+       {"copy", XSK_COPY_COPY},
+       {"zero-copy", XSK_COPY_ZEROCOPY},
+       {NULL, 0}
+};
+
+struct enum_val txgen_protos[] = {
+       {"udp", TXGEN_UDP},
+       {"tcp", TXGEN_TCP},
        {NULL, 0}
 };
 
@@ -49,6 +107,13 @@ struct enum_val cpumap_remote_actions[] = {
        {NULL, 0}
 };
 
+struct enum_val cpumap_gro_modes[] = {
+       {"keep", CPUMAP_GRO_KEEP},
+       {"on", CPUMAP_GRO_ON},
+       {"off", CPUMAP_GRO_OFF},
+       {NULL, 0}
+};
+
 struct enum_val cpumap_program_modes[] = {
        {"no-touch", CPUMAP_NO_TOUCH},
        {"touch", CPUMAP_TOUCH_DATA},
@@ -56,6 +121,9 @@ struct enum_val cpumap_program_modes[] = {
        {"l4-proto", CPUMAP_CPU_L4_PROTO},
        {"l4-filter", CPUMAP_CPU_L4_PROTO_FILTER},
        {"l4-hash", CPUMAP_CPU_L4_HASH},
+       {"l4-sym-hash", CPUMAP_CPU_L4_SYM_HASH},
+       {"load-balance", CPUMAP_CPU_LOAD_BALANCE},
+       {"l4-tunnel-hash", CPUMAP_CPU_L4_TUNNEL_HASH},
        {NULL, 0}
 };
 
@@ -66,6 +134,14 @@ struct prog_option basic_options[] = {
 		      .metavar = "<mode>",
 		      .typearg = basic_program_modes,
 		      .help = "Action to take before dropping packet."),
+	DEFINE_OPTION("rx-meta", OPT_FLAGS, struct basic_opts, rx_meta,
+		      .metavar = "<items>",
+		      .typearg = basic_rx_meta_items,
+		      .help = "RX metadata to read in rx-metadata mode; default all"),
+	DEFINE_OPTION("tunnel", OPT_ENUM, struct basic_opts, tunnel,
+		      .metavar = "<type>",
+		      .typearg = tunnel_types,
+		      .help = "Tunnel of the encap and decap modes (vxlan, gre, ipip); default vxlan"),
 	DEFINE_OPTION("rxq-stats", OPT_BOOL, struct basic_opts, rxq_stats,
 		      .short_opt = 'r',
 		      .help = "Collect per-RXQ drop statistics"),
@@ -73,9 +149,22 @@ struct prog_option basic_options[] = {
 		      .short_opt = 'i',
 		      .metavar = "<seconds>",
 		      .help = "Polling interval (default 2)"),
+	DEFINE_OPTION("interval-ms", OPT_U32, struct basic_opts, interval_ms,
+		      .metavar = "<msecs>",
+		      .help = "Polling interval in milliseconds, instead of --interval"),
 	DEFINE_OPTION("extended", OPT_BOOL, struct basic_opts, extended,
 		      .short_opt = 'e',
 		      .help = "Start running in extended output mode (C^\\ to toggle)"),
+	DEFINE_OPTION("format", OPT_ENUM, struct basic_opts, format,
+		      .short_opt = 'F',
+		      .metavar = "<format>",
+		      .typearg = output_formats,
+		      .help = "Print statistics as <format> (text, json or csv); default text"),
+	DEFINE_OPTION("latency", OPT_BOOL, struct basic_opts, latency,
+		      .short_opt = 'L',
+		      .help = "Trace the XDP program and print a per-packet latency histogram"),
+	DEFINE_OPTION("perf-counters", OPT_BOOL, struct basic_opts, perf_counters,
+		      .help = "Print cycles/packet and IPC from hardware counters on the receiving CPUs"),
 	DEFINE_OPTION("xdp-mode", OPT_ENUM, struct basic_opts, mode,
 		      .short_opt = 'm',
 		      .typearg = xdp_modes,
@@ -90,16 +179,38 @@ struct prog_option basic_options[] = {
 };
 
 struct prog_option redirect_basic_options[] = {
+	DEFINE_OPTION("program-mode", OPT_ENUM, struct redirect_opts, program_mode,
+		      .short_opt = 'p',
+		      .metavar = "<mode>",
+		      .typearg = redirect_program_modes,
+		      .help = "Action to take before redirecting packet; default swap-macs"),
+	DEFINE_OPTION("tunnel", OPT_ENUM, struct redirect_opts, tunnel,
+		      .metavar = "<type>",
+		      .typearg = tunnel_types,
+		      .help = "Tunnel of the encap and decap modes (vxlan, gre, ipip); default vxlan"),
 	DEFINE_OPTION("interval", OPT_U32, struct redirect_opts, interval,
 		      .short_opt = 'i',
 		      .metavar = "<seconds>",
 		      .help = "Polling interval (default 2)"),
+	DEFINE_OPTION("interval-ms", OPT_U32, struct redirect_opts, interval_ms,
+		      .metavar = "<msecs>",
+		      .help = "Polling interval in milliseconds, instead of --interval"),
 	DEFINE_OPTION("stats", OPT_BOOL, struct redirect_opts, stats,
 		      .short_opt = 's',
 		      .help = "Enable statistics for transmitted packets (not just errors)"),
 	DEFINE_OPTION("extended", OPT_BOOL, struct redirect_opts, extended,
 		      .short_opt = 'e',
 		      .help = "Start running in extended output mode (C^\\ to toggle)"),
+	DEFINE_OPTION("format", OPT_ENUM, struct redirect_opts, format,
+		      .short_opt = 'F',
+		      .metavar = "<format>",
+		      .typearg = output_formats,
+		      .help = "Print statistics as <format> (text, json or csv); default text"),
+	DEFINE_OPTION("latency", OPT_BOOL, struct redirect_opts, latency,
+		      .short_opt = 'L',
+		      .help = "Trace the XDP program and print a per-packet latency histogram"),
+	DEFINE_OPTION("perf-counters", OPT_BOOL, struct redirect_opts, perf_counters,
+		      .help = "Print cycles/packet and IPC from hardware counters on the receiving CPUs"),
 	DEFINE_OPTION("mode", OPT_ENUM, struct redirect_opts, mode,
 		      .short_opt = 'm',
 		      .typearg = xdp_modes,
@@ -122,8 +233,10 @@ struct prog_option redirect_cpumap_options[] = {
 	DEFINE_OPTION("cpu", OPT_U32_MULTI, struct cpumap_opts, cpus,
 		      .short_opt = 'c',
 		      .metavar = "<cpu>",
-		      .required = true,
 		      .help = "Insert CPU <cpu> into CPUMAP (can be specified multiple times)"),
+	DEFINE_OPTION("numa-cpus", OPT_BOOL, struct cpumap_opts, numa_cpus,
+		      .short_opt = 'N',
+		      .help = "Insert the CPUs on the NUMA node of <ifname> that don't handle its IRQs, instead of --cpu"),
 	DEFINE_OPTION("dev", OPT_IFNAME, struct cpumap_opts, iface_in,
 		      .positional = true,
 		      .metavar = "<ifname>",
@@ -150,16 +263,43 @@ struct prog_option redirect_cpumap_options[] = {
 	DEFINE_OPTION("stress-mode", OPT_BOOL, struct cpumap_opts, stress_mode,
 		      .short_opt = 'x',
 		      .help = "Stress the kernel CPUMAP setup and teardown code while running"),
+	DEFINE_OPTION("queue-delay", OPT_BOOL, struct cpumap_opts, queue_delay,
+		      .short_opt = 'Q',
+		      .help = "Print a histogram of the time packets wait in the cpumap queue (needs -r)"),
+	DEFINE_OPTION("gro", OPT_ENUM, struct cpumap_opts, gro,
+		      .short_opt = 'G',
+		      .metavar = "<mode>",
+		      .typearg = cpumap_gro_modes,
+		      .help = "Report GRO on the remote CPUs; turn GRO 'on', 'off' or 'keep' it"),
+	DEFINE_OPTION("sweep", OPT_BOOL, struct cpumap_opts, sweep,
+		      .short_opt = 'S',
+		      .help = "Measure each queue size and CPU set in turn, then print the best"),
+	DEFINE_OPTION("sweep-qsize", OPT_U32_MULTI, struct cpumap_opts, sweep_qsize,
+		      .metavar = "<packets>",
+		      .help = "Queue size to try in --sweep (can be specified multiple times)"),
 	DEFINE_OPTION("interval", OPT_U32, struct cpumap_opts, interval,
 		      .short_opt = 'i',
 		      .metavar = "<seconds>",
 		      .help = "Polling interval (default 2)"),
+	DEFINE_OPTION("interval-ms", OPT_U32, struct cpumap_opts, interval_ms,
+		      .metavar = "<msecs>",
+		      .help = "Polling interval in milliseconds, instead of --interval"),
 	DEFINE_OPTION("stats", OPT_BOOL, struct cpumap_opts, stats,
 		      .short_opt = 's',
 		      .help = "Enable statistics for transmitted packets (not just errors)"),
 	DEFINE_OPTION("extended", OPT_BOOL, struct basic_opts, extended,
 		      .short_opt = 'e',
 		      .help = "Start running in extended output mode (C^\\ to toggle)"),
+	DEFINE_OPTION("format", OPT_ENUM, struct cpumap_opts, format,
+		      .short_opt = 'F',
+		      .metavar = "<format>",
+		      .typearg = output_formats,
+		      .help = "Print statistics as <format> (text, json or csv); default text"),
+	DEFINE_OPTION("latency", OPT_BOOL, struct cpumap_opts, latency,
+		      .short_opt = 'L',
+		      .help = "Trace the XDP program and print a per-packet latency histogram"),
+	DEFINE_OPTION("perf-counters", OPT_BOOL, struct cpumap_opts, perf_counters,
+		      .help = "Print cycles/packet and IPC from hardware counters on the receiving CPUs"),
 	DEFINE_OPTION("xdp-mode", OPT_ENUM, struct cpumap_opts, mode,
 		      .short_opt = 'm',
 		      .typearg = xdp_modes,
@@ -172,16 +312,32 @@ struct prog_option redirect_devmap_options[] = {
 	DEFINE_OPTION("load-egress", OPT_BOOL, struct devmap_opts, load_egress,
 		      .short_opt = 'X',
 		      .help = "Load an egress program into the devmap"),
+	DEFINE_OPTION("queue-delay", OPT_BOOL, struct devmap_opts, queue_delay,
+		      .short_opt = 'Q',
+		      .help = "Print a histogram of the time packets wait in the devmap queue (needs -X)"),
 	DEFINE_OPTION("interval", OPT_U32, struct devmap_opts, interval,
 		      .short_opt = 'i',
 		      .metavar = "<seconds>",
 		      .help = "Polling interval (default 2)"),
+	DEFINE_OPTION("interval-ms", OPT_U32, struct devmap_opts, interval_ms,
+		      .metavar = "<msecs>",
+		      .help = "Polling interval in milliseconds, instead of --interval"),
 	DEFINE_OPTION("stats", OPT_BOOL, struct devmap_opts, stats,
 		      .short_opt = 's',
 		      .help = "Enable statistics for transmitted packets (not just errors)"),
 	DEFINE_OPTION("extended", OPT_BOOL, struct devmap_opts, extended,
 		      .short_opt = 'e',
 		      .help = "Start running in extended output mode (C^\\ to toggle)"),
+	DEFINE_OPTION("format", OPT_ENUM, struct devmap_opts, format,
+		      .short_opt = 'F',
+		      .metavar = "<format>",
+		      .typearg = output_formats,
+		      .help = "Print statistics as <format> (text, json or csv); default text"),
+	DEFINE_OPTION("latency", OPT_BOOL, struct devmap_opts, latency,
+		      .short_opt = 'L',
+		      .help = "Trace the XDP program and print a per-packet latency histogram"),
+	DEFINE_OPTION("perf-counters", OPT_BOOL, struct devmap_opts, perf_counters,
+		      .help = "Print cycles/packet and IPC from hardware counters on the receiving CPUs"),
 	DEFINE_OPTION("mode", OPT_ENUM, struct devmap_opts, mode,
 		      .short_opt = 'm',
 		      .typearg = xdp_modes,
@@ -204,16 +360,41 @@ struct prog_option redirect_devmap_multi_options[] = {
 	DEFINE_OPTION("load-egress", OPT_BOOL, struct devmap_multi_opts, load_egress,
 		      .short_opt = 'X',
 		      .help = "Load an egress program into the devmap"),
+	DEFINE_OPTION("egress-stats", OPT_BOOL, struct devmap_multi_opts, egress_stats,
+		      .short_opt = 'E',
+		      .help = "Print transmit cost and bulk sizes of each egress interface"),
+	DEFINE_OPTION("include-ingress", OPT_BOOL, struct devmap_multi_opts, include_ingress,
+		      .short_opt = 'I',
+		      .help = "Also send packets back out of the interface they came in on"),
+	DEFINE_OPTION("group", OPT_U32_MULTI, struct devmap_multi_opts, groups,
+		      .short_opt = 'G',
+		      .metavar = "<group>",
+		      .help = "Put the interfaces in flood group <group>, once per interface in order (needs -X)"),
+	DEFINE_OPTION("vlan-groups", OPT_BOOL, struct devmap_multi_opts, vlan_groups,
+		      .help = "Flood packets to the group matching their VLAN ID instead of the ingress group"),
 	DEFINE_OPTION("interval", OPT_U32, struct devmap_multi_opts, interval,
 		      .short_opt = 'i',
 		      .metavar = "<seconds>",
 		      .help = "Polling interval (default 2)"),
+	DEFINE_OPTION("interval-ms", OPT_U32, struct devmap_multi_opts, interval_ms,
+		      .metavar = "<msecs>",
+		      .help = "Polling interval in milliseconds, instead of --interval"),
 	DEFINE_OPTION("stats", OPT_BOOL, struct devmap_multi_opts, stats,
 		      .short_opt = 's',
 		      .help = "Enable statistics for transmitted packets (not just errors)"),
 	DEFINE_OPTION("extended", OPT_BOOL, struct devmap_multi_opts, extended,
 		      .short_opt = 'e',
 		      .help = "Start running in extended output mode (C^\\ to toggle)"),
+	DEFINE_OPTION("format", OPT_ENUM, struct devmap_multi_opts, format,
+		      .short_opt = 'F',
+		      .metavar = "<format>",
+		      .typearg = output_formats,
+		      .help = "Print statistics as <format> (text, json or csv); default text"),
+	DEFINE_OPTION("latency", OPT_BOOL, struct devmap_multi_opts, latency,
+		      .short_opt = 'L',
+		      .help = "Trace the XDP program and print a per-packet latency histogram"),
+	DEFINE_OPTION("perf-counters", OPT_BOOL, struct devmap_multi_opts, perf_counters,
+		      .help = "Print cycles/packet and IPC from hardware counters on the receiving CPUs"),
 	DEFINE_OPTION("mode", OPT_ENUM, struct devmap_multi_opts, mode,
 		      .short_opt = 'm',
 		      .typearg = xdp_modes,
@@ -229,6 +410,215 @@ struct prog_option redirect_devmap_multi_options[] = {
 	END_OPTIONS
 };
 
+struct prog_option redirect_veth_options[] = {
+	DEFINE_OPTION("spread", OPT_ENUM, struct veth_opts, spread,
+		      .short_opt = 'S',
+		      .metavar = "<method>",
+		      .typearg = veth_spreads,
+		      .help = "Pick the veth device by flow <hash> or in <round-robin> order; default hash"),
+	DEFINE_OPTION("interval", OPT_U32, struct veth_opts, interval,
+		      .short_opt = 'i',
+		      .metavar = "<seconds>",
+		      .help = "Polling interval (default 2)"),
+	DEFINE_OPTION("interval-ms", OPT_U32, struct veth_opts, interval_ms,
+		      .metavar = "<msecs>",
+		      .help = "Polling interval in milliseconds, instead of --interval"),
+	DEFINE_OPTION("stats", OPT_BOOL, struct veth_opts, stats,
+		      .short_opt = 's',
+		      .help = "Enable statistics for transmitted packets (not just errors)"),
+	DEFINE_OPTION("extended", OPT_BOOL, struct veth_opts, extended,
+		      .short_opt = 'e',
+		      .help = "Start running in extended output mode (C^\\ to toggle)"),
+	DEFINE_OPTION("format", OPT_ENUM, struct veth_opts, format,
+		      .short_opt = 'F',
+		      .metavar = "<format>",
+		      .typearg = output_formats,
+		      .help = "Print statistics as <format> (text, json or csv); default text"),
+	DEFINE_OPTION("latency", OPT_BOOL, struct veth_opts, latency,
+		      .short_opt = 'L',
+		      .help = "Trace the XDP program and print a per-packet latency histogram"),
+	DEFINE_OPTION("perf-counters", OPT_BOOL, struct veth_opts, perf_counters,
+		      .help = "Print cycles/packet and IPC from hardware counters on the receiving CPUs"),
+	DEFINE_OPTION("mode", OPT_ENUM, struct veth_opts, mode,
+		      .short_opt = 'm',
+		      .typearg = xdp_modes,
+		      .metavar = "<mode>",
+		      .help = "Load XDP program in <mode>; default native"),
+	DEFINE_OPTION("dev_in", OPT_IFNAME, struct veth_opts, iface_in,
+		      .positional = true,
+		      .metavar = "<ifname_in>",
+		      .required = true,
+		      .help = "Redirect from device <ifname>"),
+	DEFINE_OPTION("devs_out", OPT_IFNAME_MULTI, struct veth_opts, ifaces_out,
+		      .positional = true,
+		      .metavar = "<ifname_out...>",
+		      .min_num = 1,
+		      .max_num = MAX_IFACE_NUM,
+		      .required = true,
+		      .help = "Redirect to veth devices <ifname_out...>"),
+	END_OPTIONS
+};
+
+struct prog_option xsk_options[] = {
+	DEFINE_OPTION("queue", OPT_U32_MULTI, struct xsk_opts, queues,
+		      .short_opt = 'q',
+		      .metavar = "<queue>",
+		      .help = "Bind a socket to queue <queue> (can be specified multiple times); default 0"),
+	DEFINE_OPTION("copy-mode", OPT_ENUM, struct xsk_opts, copy_mode,
+		      .short_opt = 'c',
+		      .metavar = "<mode>",
+		      .typearg = xsk_copy_modes,
+		      .help = "Bind sockets in <mode> (auto, copy, zero-copy); default auto"),
+	DEFINE_OPTION("busy-poll", OPT_BOOL, struct xsk_opts, busy_poll,
+		      .short_opt = 'b',
+		      .help = "Enable preferred busy polling on the sockets"),
+	DEFINE_OPTION("batch-size", OPT_U32, struct xsk_opts, batch_size,
+		      .short_opt = 'B',
+		      .metavar = "<packets>",
+		      .help = "Process up to <packets> descriptors per ring operation (default 64)"),
+	DEFINE_OPTION("interval", OPT_U32, struct xsk_opts, interval,
+		      .short_opt = 'i',
+		      .metavar = "<seconds>",
+		      .help = "Polling interval (default 2)"),
+	DEFINE_OPTION("interval-ms", OPT_U32, struct xsk_opts, interval_ms,
+		      .metavar = "<msecs>",
+		      .help = "Polling interval in milliseconds, instead of --interval"),
+	DEFINE_OPTION("extended", OPT_BOOL, struct xsk_opts, extended,
+		      .short_opt = 'e',
+		      .help = "Start running in extended output mode (C^\\ to toggle)"),
+	DEFINE_OPTION("format", OPT_ENUM, struct xsk_opts, format,
+		      .short_opt = 'F',
+		      .metavar = "<format>",
+		      .typearg = output_formats,
+		      .help = "Print statistics as <format> (text, json or csv); default text"),
+	DEFINE_OPTION("latency", OPT_BOOL, struct xsk_opts, latency,
+		      .short_opt = 'L',
+		      .help = "Trace the XDP program and print a per-packet latency histogram"),
+	DEFINE_OPTION("perf-counters", OPT_BOOL, struct xsk_opts, perf_counters,
+		      .help = "Print cycles/packet and IPC from hardware counters on the receiving CPUs"),
+	DEFINE_OPTION("xdp-mode", OPT_ENUM, struct xsk_opts, mode,
+		      .short_opt = 'm',
+		      .typearg = xdp_modes,
+		      .metavar = "<mode>",
+		      .help = "Load XDP program in <mode>; default native"),
+	DEFINE_OPTION("dev", OPT_IFNAME, struct xsk_opts, iface_in,
+		      .positional = true,
+		      .metavar = "<ifname>",
+		      .required = true,
+		      .help = "Open sockets on device <ifname>"),
+	END_OPTIONS
+};
+
+struct prog_option txgen_options[] = {
+	DEFINE_OPTION("queue", OPT_U32_MULTI, struct xsk_opts, queues,
+		      .short_opt = 'q',
+		      .metavar = "<queue>",
+		      .help = "Bind a socket to queue <queue> (can be specified multiple times); default 0"),
+	DEFINE_OPTION("copy-mode", OPT_ENUM, struct xsk_opts, copy_mode,
+		      .short_opt = 'c',
+		      .metavar = "<mode>",
+		      .typearg = xsk_copy_modes,
+		      .help = "Bind sockets in <mode> (auto, copy, zero-copy); default auto"),
+	DEFINE_OPTION("busy-poll", OPT_BOOL, struct xsk_opts, busy_poll,
+		      .short_opt = 'b',
+		      .help = "Enable preferred busy polling on the sockets"),
+	DEFINE_OPTION("batch-size", OPT_U32, struct xsk_opts, batch_size,
+		      .short_opt = 'B',
+		      .metavar = "<packets>",
+		      .help = "Process up to <packets> descriptors per ring operation (default 64)"),
+	DEFINE_OPTION("flows", OPT_U32, struct xsk_opts, flows,
+		      .short_opt = 'f',
+		      .metavar = "<num>",
+		      .help = "Spread packets over <num> flows by source port (default 1)"),
+	DEFINE_OPTION("size", OPT_U32_MULTI, struct xsk_opts, pkt_sizes,
+		      .short_opt = 's',
+		      .metavar = "<bytes>",
+		      .help = "Packet size; give several to cycle through them (default 64)"),
+	DEFINE_OPTION("rate", OPT_U32, struct xsk_opts, rate,
+		      .short_opt = 'r',
+		      .metavar = "<pps>",
+		      .help = "Limit the total rate to <pps> packets per second (default no limit)"),
+	DEFINE_OPTION("proto", OPT_ENUM, struct xsk_opts, proto,
+		      .short_opt = 'P',
+		      .typearg = txgen_protos,
+		      .metavar = "<proto>",
+		      .help = "Generate udp or tcp packets; default udp"),
+	DEFINE_OPTION("dst-mac", OPT_MACADDR, struct xsk_opts, dst_mac,
+		      .short_opt = 'D',
+		      .metavar = "<mac>",
+		      .help = "Destination MAC address (default broadcast)"),
+	DEFINE_OPTION("src-ip", OPT_IPADDR, struct xsk_opts, src_ip,
+		      .metavar = "<addr>",
+		      .help = "Source IPv4 address (default 192.0.2.1)"),
+	DEFINE_OPTION("dst-ip", OPT_IPADDR, struct xsk_opts, dst_ip,
+		      .metavar = "<addr>",
+		      .help = "Destination IPv4 address (default 192.0.2.2)"),
+	DEFINE_OPTION("interval", OPT_U32, struct xsk_opts, interval,
+		      .short_opt = 'i',
+		      .metavar = "<seconds>",
+		      .help = "Polling interval (default 2)"),
+	DEFINE_OPTION("interval-ms", OPT_U32, struct xsk_opts, interval_ms,
+		      .metavar = "<msecs>",
+		      .help = "Polling interval in milliseconds, instead of --interval"),
+	DEFINE_OPTION("extended", OPT_BOOL, struct xsk_opts, extended,
+		      .short_opt = 'e',
+		      .help = "Start running in extended output mode (C^\\ to toggle)"),
+	DEFINE_OPTION("format", OPT_ENUM, struct xsk_opts, format,
+		      .short_opt = 'F',
+		      .metavar = "<format>",
+		      .typearg = output_formats,
+		      .help = "Print statistics as <format> (text, json or csv); default text"),
+	DEFINE_OPTION("latency", OPT_BOOL, struct xsk_opts, latency,
+		      .short_opt = 'L',
+		      .help = "Trace the XDP program and print a per-packet latency histogram"),
+	DEFINE_OPTION("xdp-mode", OPT_ENUM, struct xsk_opts, mode,
+		      .short_opt = 'm',
+		      .typearg = xdp_modes,
+		      .metavar = "<mode>",
+		      .help = "Load XDP program in <mode>; default native"),
+	DEFINE_OPTION("dev", OPT_IFNAME, struct xsk_opts, iface_in,
+		      .positional = true,
+		      .metavar = "<ifname>",
+		      .required = true,
+		      .help = "Open sockets on device <ifname>"),
+	END_OPTIONS
+};
+
+struct prog_option prog_run_options[] = {
+	DEFINE_OPTION("repeat", OPT_U32, struct prog_run_opts, repeat,
+		      .short_opt = 'r',
+		      .metavar = "<count>",
+		      .help = "Run each packet through the program <count> times (default 100000)"),
+	DEFINE_OPTION("prog-name", OPT_STRING, struct prog_run_opts, prog_name,
+		      .short_opt = 'n',
+		      .metavar = "<prog_name>",
+		      .help = "BPF program name to run (default: first XDP program in file)"),
+	DEFINE_OPTION("pcap", OPT_STRING, struct prog_run_opts, pcap_file,
+		      .short_opt = 'p',
+		      .metavar = "<file>",
+		      .help = "Read test packets from pcap or pcapng <file> (default: one 64-byte UDP packet)"),
+	DEFINE_OPTION("write", OPT_STRING, struct prog_run_opts, write_file,
+		      .short_opt = 'w',
+		      .metavar = "<file>",
+		      .help = "Write the packets with their verdicts to pcapng <file> (needs --pcap)"),
+	DEFINE_OPTION("batch-size", OPT_U32, struct prog_run_opts, batch_size,
+		      .short_opt = 'b',
+		      .metavar = "<count>",
+		      .help = "Read and run <count> packets of the capture at a time (default 64)"),
+	DEFINE_OPTION("dev", OPT_IFNAME, struct prog_run_opts, iface,
+		      .short_opt = 'd',
+		      .metavar = "<ifname>",
+		      .help = "Run the program (or dispatcher) attached to <ifname> instead of a file"),
+	DEFINE_OPTION("extended", OPT_BOOL, struct prog_run_opts, extended,
+		      .short_opt = 'e',
+		      .help = "Print the verdict and run time of every packet"),
+	DEFINE_OPTION("filename", OPT_STRING, struct prog_run_opts, filename,
+		      .positional = true,
+		      .metavar = "[filename]",
+		      .help = "Load the program to run from BPF object [filename]"),
+	END_OPTIONS
+};
+
 static const struct prog_command cmds[] = {
 	{ .name = "drop",
 	  .func = do_drop,
@@ -254,6 +644,39 @@ static const struct prog_command cmds[] = {
 	DEFINE_COMMAND_NAME(
 		"redirect-multi", redirect_devmap_multi,
 		"XDP multi-redirect using BPF_MAP_TYPE_DEVMAP and the BPF_F_BROADCAST flag"),
+	DEFINE_COMMAND_NAME(
+		"redirect-veth", redirect_veth,
+		"XDP redirect spreading traffic over veth devices using BPF_MAP_TYPE_DEVMAP"),
+	{ .name = "xsk-drop",
+	  .func = do_xsk_drop,
+	  .options = xsk_options,
+	  .default_cfg = &defaults_xsk_drop,
+	  .doc = "Receive and drop packets on AF_XDP sockets" },
+	{ .name = "xsk-tx",
+	  .func = do_xsk_tx,
+	  .options = xsk_options,
+	  .default_cfg = &defaults_xsk_tx,
+	  .doc = "Transmit generated packets from AF_XDP sockets" },
+	{ .name = "xsk-fwd",
+	  .func = do_xsk_fwd,
+	  .options = xsk_options,
+	  .default_cfg = &defaults_xsk_fwd,
+	  .doc = "Swap MACs and send packets back out through AF_XDP sockets" },
+	{ .name = "redirect-xsk",
+	  .func = do_redirect_xsk,
+	  .options = xsk_options,
+	  .default_cfg = &defaults_redirect_xsk,
+	  .doc = "XDP redirect using BPF_MAP_TYPE_XSKMAP, with per-queue statistics" },
+	{ .name = "tx-gen",
+	  .func = do_tx_gen,
+	  .options = txgen_options,
+	  .default_cfg = &defaults_tx_gen,
+	  .doc = "Generate UDP or TCP traffic from AF_XDP sockets" },
+	{ .name = "prog-run",
+	  .func = do_prog_run,
+	  .options = prog_run_options,
+	  .default_cfg = &defaults_prog_run,
+	  .doc = "Time an XDP program on test packets or a capture using BPF_PROG_RUN" },
 	{ .name = "help", .func = do_help, .no_cfg = true },
 	END_COMMANDS
 };
@@ -263,6 +686,9 @@ union all_opts {
 	struct cpumap_opts cpumap;
 	struct devmap_opts devmap;
 	struct devmap_multi_opts devmap_multi;
+	struct veth_opts veth;
+	struct xsk_opts xsk;
+	struct prog_run_opts prog_run;
 };
 
 int main(int argc, char **argv)
@@ -5,6 +5,8 @@
 #include <xdp/libxdp.h>
 #include "params.h"
 #include "util.h"
+#include "xdp_sample.h"
+#include "tunnel.h"
 
 #define MAX_IFACE_NUM 32
 
@@ -15,27 +17,56 @@ int do_redirect_basic(const void *cfg, const char *pin_root_path);
 int do_redirect_cpumap(const void *cfg, const char *pin_root_path);
 int do_redirect_devmap(const void *cfg, const char *pin_root_path);
 int do_redirect_devmap_multi(const void *cfg, const char *pin_root_path);
+int do_redirect_veth(const void *cfg, const char *pin_root_path);
+int do_xsk_drop(const void *cfg, const char *pin_root_path);
+int do_xsk_tx(const void *cfg, const char *pin_root_path);
+int do_xsk_fwd(const void *cfg, const char *pin_root_path);
+int do_redirect_xsk(const void *cfg, const char *pin_root_path);
+int do_tx_gen(const void *cfg, const char *pin_root_path);
+int do_prog_run(const void *cfg, const char *pin_root_path);
+
+int latency_hist_add(const char *name, const char *stat, struct bpf_map *map);
+int latency_attach(struct xdp_program *prog);
+void latency_detach(void);
+
+int perf_counters_open(void);
+void perf_counters_close(void);
 
 enum basic_program_mode {
 	BASIC_NO_TOUCH,
 	BASIC_READ_DATA,
 	BASIC_SWAP_MACS,
+	BASIC_RX_METADATA,
+	BASIC_ENCAP,
+	BASIC_DECAP,
 };
 
 struct basic_opts {
 	bool extended;
+	bool latency;
+	bool perf_counters;
 	bool rxq_stats;
+	unsigned int rx_meta;
 	__u32 interval;
+	__u32 interval_ms;
 	enum xdp_attach_mode mode;
+	enum sample_output_format format;
 	enum basic_program_mode program_mode;
+	enum tunnel_type tunnel;
 	struct iface iface_in;
 };
 
 struct redirect_opts {
 	bool stats;
 	bool extended;
+	bool latency;
+	bool perf_counters;
 	__u32 interval;
+	__u32 interval_ms;
 	enum xdp_attach_mode mode;
+	enum sample_output_format format;
+	enum basic_program_mode program_mode;
+	enum tunnel_type tunnel;
 	struct iface iface_in;
 	struct iface iface_out;
 };
@@ -43,9 +74,14 @@ struct redirect_opts {
 struct devmap_opts {
 	bool stats;
 	bool extended;
+	bool latency;
+	bool perf_counters;
 	bool load_egress;
+	bool queue_delay;
 	__u32 interval;
+	__u32 interval_ms;
 	enum xdp_attach_mode mode;
+	enum sample_output_format format;
 	struct iface iface_in;
 	struct iface iface_out;
 };
@@ -53,12 +89,39 @@ struct devmap_opts {
 struct devmap_multi_opts {
 	bool stats;
 	bool extended;
+	bool latency;
+	bool perf_counters;
 	bool load_egress;
+	bool egress_stats;
+	bool include_ingress;
+	bool vlan_groups;
 	__u32 interval;
+	__u32 interval_ms;
+	struct u32_multi groups;
 	enum xdp_attach_mode mode;
+	enum sample_output_format format;
 	struct iface *ifaces;
 };
 
+enum veth_spread {
+	VETH_SPREAD_HASH,
+	VETH_SPREAD_ROUND_ROBIN,
+};
+
+struct veth_opts {
+	bool stats;
+	bool extended;
+	bool latency;
+	bool perf_counters;
+	__u32 interval;
+	__u32 interval_ms;
+	enum xdp_attach_mode mode;
+	enum sample_output_format format;
+	enum veth_spread spread;
+	struct iface iface_in;
+	struct iface *ifaces_out;
+};
+
 enum cpumap_remote_action {
 	ACTION_DISABLED,
 	ACTION_DROP,
@@ -66,6 +129,13 @@ enum cpumap_remote_action {
 	ACTION_REDIRECT,
 };
 
+enum cpumap_gro {
+	CPUMAP_GRO_UNSET,
+	CPUMAP_GRO_KEEP,
+	CPUMAP_GRO_ON,
+	CPUMAP_GRO_OFF,
+};
+
 enum cpumap_program_mode {
 	CPUMAP_NO_TOUCH,
 	CPUMAP_TOUCH_DATA,
@@ -73,22 +143,79 @@ enum cpumap_program_mode {
 	CPUMAP_CPU_L4_PROTO,
 	CPUMAP_CPU_L4_PROTO_FILTER,
 	CPUMAP_CPU_L4_HASH,
+	CPUMAP_CPU_L4_SYM_HASH,
+	CPUMAP_CPU_LOAD_BALANCE,
+	CPUMAP_CPU_L4_TUNNEL_HASH,
 };
 
 struct cpumap_opts {
 	bool stats;
 	bool extended;
+	bool latency;
+	bool perf_counters;
 	bool stress_mode;
+	bool sweep;
+	bool queue_delay;
+	bool numa_cpus;
 	__u32 interval;
+	__u32 interval_ms;
 	__u32 qsize;
 	struct u32_multi cpus;
+	struct u32_multi sweep_qsize;
 	enum xdp_attach_mode mode;
+	enum sample_output_format format;
 	enum cpumap_remote_action remote_action;
 	enum cpumap_program_mode program_mode;
+	enum cpumap_gro gro;
 	struct iface iface_in;
 	struct iface redir_iface;
 };
 
+enum xsk_copy_mode {
+	XSK_COPY_AUTO,
+	XSK_COPY_COPY,
+	XSK_COPY_ZEROCOPY,
+};
+
+enum txgen_proto {
+	TXGEN_UDP,
+	TXGEN_TCP,
+};
+
+struct xsk_opts {
+	bool extended;
+	bool latency;
+	bool perf_counters;
+	bool busy_poll;
+	__u32 interval;
+	__u32 interval_ms;
+	__u32 batch_size;
+	struct u32_multi queues;
+	enum xdp_attach_mode mode;
+	enum sample_output_format format;
+	enum xsk_copy_mode copy_mode;
+	struct iface iface_in;
+	/* Packets generated by xsk-tx and tx-gen */
+	__u32 flows;
+	__u32 rate;
+	struct u32_multi pkt_sizes;
+	enum txgen_proto proto;
+	struct mac_addr dst_mac;
+	struct ip_addr src_ip;
+	struct ip_addr dst_ip;
+};
+
+struct prog_run_opts {
+	bool extended;
+	__u32 repeat;
+	__u32 batch_size;
+	char *filename;
+	char *prog_name;
+	char *pcap_file;
+	char *write_file;
+	struct iface iface;
+};
+
 extern const struct basic_opts defaults_drop;
 extern const struct basic_opts defaults_pass;
 extern const struct basic_opts defaults_tx;
@@ -96,5 +223,15 @@ extern const struct redirect_opts defaults_redirect_basic;
 extern const struct cpumap_opts defaults_redirect_cpumap;
 extern const struct devmap_opts defaults_redirect_devmap;
 extern const struct devmap_multi_opts defaults_redirect_devmap_multi;
+extern const struct veth_opts defaults_redirect_veth;
+extern const struct xsk_opts defaults_xsk_drop;
+extern const struct xsk_opts defaults_xsk_tx;
+extern const struct xsk_opts defaults_xsk_fwd;
+extern const struct xsk_opts defaults_redirect_xsk;
+extern const struct xsk_opts defaults_tx_gen;
+extern const struct prog_run_opts defaults_prog_run;
+
+void xsk_gen_packet(void *buf, __u32 len, const __u8 *src_mac,
+		    const struct xsk_opts *opt, __u32 flow);
 
 #endif
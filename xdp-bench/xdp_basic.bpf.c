@@ -14,14 +14,56 @@
 #include <xdp/xdp_sample_shared.h>
 #include <xdp/xdp_sample.bpf.h>
 #include <xdp/xdp_sample_common.bpf.h>
+#include "xdp_basic.h"
+#include "tunnel.bpf.h"
+
+/* Only the enum itself has to match the kernel's for the kfunc to resolve */
+enum xdp_rss_hash_type {
+	XDP_RSS_TYPE_NONE = 0,
+};
+
+extern int bpf_xdp_metadata_rx_hash(const struct xdp_md *ctx, __u32 *hash,
+				    enum xdp_rss_hash_type *rss_type) __ksym __weak;
+extern int bpf_xdp_metadata_rx_timestamp(const struct xdp_md *ctx,
+					 __u64 *timestamp) __ksym __weak;
+extern int bpf_xdp_metadata_rx_vlan_tag(const struct xdp_md *ctx,
+					__be16 *vlan_proto, __u16 *vlan_tci) __ksym __weak;
 
 const volatile bool read_data = 0;
 const volatile bool swap_macs = 0;
 const volatile bool rxq_stats = 0;
+const volatile __u32 rx_meta = 0;
 const volatile enum xdp_action action = XDP_DROP;
 
-SEC("xdp")
-int xdp_basic_prog(struct xdp_md *ctx)
+/* Set by userspace on every other interval, to compare against not reading
+ * the metadata at all
+ */
+bool rx_meta_skip = false;
+
+/* Read the selected metadata items, returning how many weren't available */
+static __always_inline int read_rx_meta(struct xdp_md *ctx)
+{
+	enum xdp_rss_hash_type rss_type;
+	__u16 vlan_tci;
+	__be16 vlan_proto;
+	__u64 timestamp;
+	__u32 hash;
+	int err = 0;
+
+	if (rx_meta & BASIC_RX_META_HASH)
+		err += !!bpf_xdp_metadata_rx_hash(ctx, &hash, &rss_type);
+	if (rx_meta & BASIC_RX_META_TIMESTAMP)
+		err += !!bpf_xdp_metadata_rx_timestamp(ctx, &timestamp);
+	if (rx_meta & BASIC_RX_META_VLAN)
+		err += !!bpf_xdp_metadata_rx_vlan_tag(ctx, &vlan_proto, &vlan_tci);
+	return err;
+}
+
+/* The kernel only accepts calls to the metadata kfuncs, dead or not, in a
+ * program loaded bound to a device, so they are only in xdp_basic_rx_meta,
+ * and all other modes load xdp_basic_prog.
+ */
+static __always_inline int xdp_basic(struct xdp_md *ctx, bool meta)
 {
 	void *data_end = (void *)(long)ctx->data_end;
 	void *data = (void *)(long)ctx->data;
@@ -47,6 +89,9 @@ int xdp_basic_prog(struct xdp_md *ctx)
 		NO_TEAR_INC(rxq_rec->processed);
 	}
 
+	if (meta && !rx_meta_skip && read_rx_meta(ctx))
+		NO_TEAR_INC(rec->issue);
+
 	if (read_data) {
 		if (bpf_ntohs(eth->h_proto) < ETH_P_802_3_MIN)
 			return XDP_ABORTED;
@@ -55,6 +100,12 @@ int xdp_basic_prog(struct xdp_md *ctx)
 			swap_src_dst_mac(data);
 	}
 
+	/* The headers move, so nothing can touch the packet after this */
+	if (tunnel_rewrite(ctx)) {
+		NO_TEAR_INC(rec->issue);
+		return XDP_DROP;
+	}
+
 	if (action == XDP_DROP) {
 		NO_TEAR_INC(rec->dropped);
 		if (rxq_stats)
@@ -64,4 +115,16 @@ int xdp_basic_prog(struct xdp_md *ctx)
 	return action;
 }
 
+SEC("xdp")
+int xdp_basic_prog(struct xdp_md *ctx)
+{
+	return xdp_basic(ctx, false);
+}
+
+SEC("xdp")
+int xdp_basic_rx_meta(struct xdp_md *ctx)
+{
+	return xdp_basic(ctx, true);
+}
+
 char _license[] SEC("license") = "GPL";
@@ -10,6 +10,7 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <bpf/bpf.h>
 #include <stdbool.h>
@@ -17,35 +18,169 @@
 #include <bpf/libbpf.h>
 #include <sys/resource.h>
 #include <linux/if_link.h>
+#include <linux/netdev.h>
 #include <xdp/libxdp.h>
 
 #include "logging.h"
 
 #include "xdp-bench.h"
+#include "xdp_basic.h"
 #include "xdp_sample.h"
 #include "xdp_basic.skel.h"
 
+#ifndef BPF_F_XDP_DEV_BOUND_ONLY
+#define BPF_F_XDP_DEV_BOUND_ONLY (1U << 6)
+#endif
+
 static int mask = SAMPLE_RX_CNT | SAMPLE_EXCEPTION_CNT;
 
 DEFINE_SAMPLE_INIT(xdp_basic);
 
 const struct basic_opts defaults_drop = { .mode = XDP_MODE_NATIVE,
-					  .interval = 2 };
+					  .interval = 2,
+					  .rx_meta = BASIC_RX_META_ALL };
 const struct basic_opts defaults_pass = { .mode = XDP_MODE_NATIVE,
-					  .interval = 2 };
+					  .interval = 2,
+					  .rx_meta = BASIC_RX_META_ALL };
 const struct basic_opts defaults_tx = { .mode = XDP_MODE_NATIVE,
 					 .interval = 2,
-					 .program_mode = BASIC_SWAP_MACS };
+					 .program_mode = BASIC_SWAP_MACS,
+					 .rx_meta = BASIC_RX_META_ALL };
+
+static const struct {
+	unsigned int item;
+	__u64 feature;
+	const char *name;
+} rx_meta_items[] = {
+	{ BASIC_RX_META_HASH, NETDEV_XDP_RX_METADATA_HASH, "hash" },
+	{ BASIC_RX_META_TIMESTAMP, NETDEV_XDP_RX_METADATA_TIMESTAMP, "timestamp" },
+	{ BASIC_RX_META_VLAN, NETDEV_XDP_RX_METADATA_VLAN_TAG, "vlan" },
+};
+
+/* In rx-metadata mode the program skips reading the metadata on every other
+ * interval, and the rates of the two are compared after each pair.
+ */
+static struct {
+	struct xdp_basic *skel;
+	__u64 *pkts;
+	int n_cpus;
+	__u64 pps[2];		/* indexed by rx_meta_skip */
+	bool have[2];
+	struct timespec prev_ts;
+} rx_meta_cmp;
+
+static void rx_meta_print(__unused void *ctx)
+{
+	bool skip = rx_meta_cmp.skel->bss->rx_meta_skip;
+	double period, meta, base, cost;
+	__u64 pkts = 0, timestamp;
+	struct datarec rates = {};
+	struct timespec now;
+	int cpu, active = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	period = (now.tv_sec - rx_meta_cmp.prev_ts.tv_sec) +
+		 (now.tv_nsec - rx_meta_cmp.prev_ts.tv_nsec) / 1e9;
+	rx_meta_cmp.prev_ts = now;
+
+	/* The next interval does the opposite of the one that just ended */
+	rx_meta_cmp.skel->bss->rx_meta_skip = !skip;
+
+	if (sample_get_rx_cpu_pkts(rx_meta_cmp.pkts, rx_meta_cmp.n_cpus) < 0 ||
+	    period <= 0)
+		return;
+
+	for (cpu = 0; cpu < rx_meta_cmp.n_cpus; cpu++) {
+		pkts += rx_meta_cmp.pkts[cpu];
+		active += !!rx_meta_cmp.pkts[cpu];
+	}
+	rx_meta_cmp.pps[skip] = pkts / period;
+	rx_meta_cmp.have[skip] = true;
+
+	if (!sample_output_is_text()) {
+		timestamp = (__u64)now.tv_sec * 1000000000 + now.tv_nsec;
+		rates.processed = rx_meta_cmp.pps[skip];
+		sample_print_row("rx_meta", skip ? "off" : "on", -1, timestamp,
+				 &rates);
+		fflush(stdout);
+		return;
+	}
+
+	if (!skip || !rx_meta_cmp.have[false])
+		return;
+
+	meta = rx_meta_cmp.pps[false];
+	base = rx_meta_cmp.pps[true];
+	if (!meta || !base)
+		return;
+
+	/* Time per packet on one receiving CPU, which only shows the cost of
+	 * the metadata when those CPUs are saturated
+	 */
+	cost = (active ?: 1) * (1e9 / meta - 1e9 / base);
+	printf("  %-20s %'10.0f %-13s %'10.0f %-13s %10.1f %-13s %10.1f %-13s\n",
+	       "rx metadata", meta, "pkt/s", base, "no-touch/s",
+	       100.0 * (meta - base) / base, "% delta", cost, "ns/pkt");
+}
+
+/* Reading metadata needs a program bound to the device, and is done by the
+ * driver, so generic XDP and kernels before 6.3 can't do it.
+ */
+static int rx_meta_setup(struct xdp_basic *skel, const struct basic_opts *opt)
+{
+	struct bpf_program *prog = skel->progs.xdp_basic_rx_meta;
+	DECLARE_LIBXDP_OPTS(xdp_iface_features, feat);
+	size_t i;
+	int ret;
+
+	if (opt->mode == XDP_MODE_SKB) {
+		pr_warn("RX metadata can't be read in skb mode\n");
+		return -EINVAL;
+	}
+	if (!opt->rx_meta) {
+		pr_warn("No RX metadata items selected\n");
+		return -EINVAL;
+	}
+
+	ret = xdp_iface__get_features(opt->iface_in.ifindex, &feat);
+	if (ret == -EOPNOTSUPP) {
+		pr_warn("Reading RX metadata needs kernel 6.3 or newer\n");
+		return ret;
+	}
+	for (i = 0; !ret && i < sizeof(rx_meta_items) / sizeof(*rx_meta_items); i++)
+		if (opt->rx_meta & rx_meta_items[i].item &&
+		    !(feat.xdp_rx_metadata_features & rx_meta_items[i].feature))
+			pr_warn("%s doesn't report RX metadata item '%s', reads will fail\n",
+				opt->iface_in.ifname, rx_meta_items[i].name);
+
+	skel->rodata->rx_meta = opt->rx_meta;
+	bpf_program__set_ifindex(prog, opt->iface_in.ifindex);
+	ret = bpf_program__set_flags(prog, bpf_program__flags(prog) |
+				     BPF_F_XDP_DEV_BOUND_ONLY);
+	if (ret < 0)
+		return ret;
+
+	rx_meta_cmp.skel = skel;
+	rx_meta_cmp.n_cpus = libbpf_num_possible_cpus();
+	rx_meta_cmp.pkts = calloc(rx_meta_cmp.n_cpus, sizeof(*rx_meta_cmp.pkts));
+	if (!rx_meta_cmp.pkts)
+		return -ENOMEM;
+	clock_gettime(CLOCK_MONOTONIC, &rx_meta_cmp.prev_ts);
+
+	return sample_add_print_cb(rx_meta_print, NULL);
+}
 
 static int do_basic(const struct basic_opts *opt, enum xdp_action action)
 {
 	DECLARE_LIBBPF_OPTS(xdp_program_opts, opts);
 	struct xdp_program *xdp_prog = NULL;
+	struct bpf_program *prog = NULL;
 	int ret = EXIT_FAIL_OPTION;
 	struct xdp_basic *skel;
 
 	if (opt->extended)
 		sample_switch_mode();
+	sample_set_output_format(opt->format);
 
 	skel = xdp_basic__open();
 	if (!skel) {
@@ -54,6 +189,13 @@ static int do_basic(const struct basic_opts *opt, enum xdp_action action)
 		goto end;
 	}
 
+	/* Make sure we only load the one XDP program we are interested in */
+	while ((prog = bpf_object__next_program(skel->obj, prog)) != NULL)
+		if (bpf_program__type(prog) == BPF_PROG_TYPE_XDP &&
+		    bpf_program__expected_attach_type(prog) == BPF_XDP)
+			bpf_program__set_autoload(prog, false);
+	prog = skel->progs.xdp_basic_prog;
+
 	ret = sample_init_pre_load(skel, opt->iface_in.ifname);
 	if (ret < 0) {
 		pr_warn("Failed to sample_init_pre_load: %s\n", strerror(-ret));
@@ -65,17 +207,38 @@ static int do_basic(const struct basic_opts *opt, enum xdp_action action)
 	if (action == XDP_DROP)
 		mask |= SAMPLE_DROP_OK;
 
-	if (opt->program_mode >= BASIC_READ_DATA)
+	if (opt->program_mode == BASIC_READ_DATA ||
+	    opt->program_mode == BASIC_SWAP_MACS)
 		skel->rodata->read_data = true;
-	if (opt->program_mode >= BASIC_SWAP_MACS)
+	if (opt->program_mode == BASIC_SWAP_MACS)
 		skel->rodata->swap_macs = true;
+	if (opt->program_mode == BASIC_ENCAP) {
+		skel->rodata->tunnel_op = TUNNEL_ENCAP;
+		skel->rodata->tunnel_type = opt->tunnel;
+	} else if (opt->program_mode == BASIC_DECAP) {
+		skel->rodata->tunnel_op = TUNNEL_DECAP;
+		skel->rodata->tunnel_type = opt->tunnel;
+	}
+	if (opt->program_mode == BASIC_RX_METADATA) {
+		ret = rx_meta_setup(skel, opt);
+		if (ret < 0) {
+			pr_warn("Failed to set up RX metadata reads: %s\n",
+				strerror(-ret));
+			ret = EXIT_FAIL_OPTION;
+			goto end_destroy;
+		}
+		prog = skel->progs.xdp_basic_rx_meta;
+	}
 	if (opt->rxq_stats) {
 		skel->rodata->rxq_stats = true;
 		mask |= SAMPLE_RXQ_STATS;
+		/* Not all drivers have queue stats, show them when they do */
+		if (!sample_nic_stats_init(opt->iface_in.ifindex))
+			mask |= SAMPLE_NIC_QUEUE_CNT;
 	}
 
 	opts.obj = skel->obj;
-	opts.prog_name = bpf_program__name(skel->progs.xdp_basic_prog);
+	opts.prog_name = bpf_program__name(prog);
 	xdp_prog = xdp_program__create(&opts);
 	if (!xdp_prog) {
 		ret = -errno;
@@ -98,13 +261,29 @@ static int do_basic(const struct basic_opts *opt, enum xdp_action action)
 		goto end_detach;
 	}
 
+	if (opt->latency) {
+		ret = latency_attach(xdp_prog);
+		if (ret < 0) {
+			ret = EXIT_FAIL_BPF;
+			goto end_detach;
+		}
+	}
+
+	if (opt->perf_counters) {
+		ret = perf_counters_open();
+		if (ret < 0) {
+			ret = EXIT_FAIL;
+			goto end_detach;
+		}
+	}
+
 	ret = EXIT_FAIL;
 
 	pr_info("%s packets on %s (ifindex %d; driver %s)\n",
 		action == XDP_DROP ? "Dropping" : "Hairpinning (XDP_TX)",
 		opt->iface_in.ifname, opt->iface_in.ifindex, get_driver_name(opt->iface_in.ifindex));
 
-	ret = sample_run(opt->interval, NULL, NULL);
+	ret = sample_run(opt->interval_ms ?: opt->interval * 1000, NULL, NULL);
 	if (ret < 0) {
 		pr_warn("Failed during sample run: %s\n", strerror(-ret));
 		ret = EXIT_FAIL;
@@ -116,6 +295,10 @@ end_detach:
 end_destroy:
 	xdp_basic__destroy(skel);
 end:
+	free(rx_meta_cmp.pkts);
+	memset(&rx_meta_cmp, 0, sizeof(rx_meta_cmp));
+	perf_counters_close();
+	latency_detach();
 	sample_teardown();
 	return ret;
 }
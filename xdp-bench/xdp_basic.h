@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef _XDP_BASIC_H
+#define _XDP_BASIC_H
+
+/* RX metadata items the basic program reads, shared between the BPF program
+ * and userspace.
+ */
+enum basic_rx_meta {
+	BASIC_RX_META_HASH	= 1U << 0,
+	BASIC_RX_META_TIMESTAMP	= 1U << 1,
+	BASIC_RX_META_VLAN	= 1U << 2,
+	BASIC_RX_META_ALL	= (1U << 3) - 1,
+};
+
+#endif
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Per-packet run time of an XDP program, measured with an fentry/fexit pair
+ * on the program itself. Userspace sets the attach target before loading.
+ */
+#include <bpf/vmlinux.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_helpers.h>
+
+#include "latency_hist.bpf.h"
+
+struct xdp_buff;
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, __u64);
+} start_ns SEC(".maps");
+
+latency_hist_map latency_hist SEC(".maps");
+
+SEC("fentry/func")
+int BPF_PROG(xdp_latency_entry, struct xdp_buff *xdp)
+{
+	__u32 key = 0;
+	__u64 *start;
+
+	start = bpf_map_lookup_elem(&start_ns, &key);
+	if (start)
+		*start = bpf_ktime_get_ns();
+	return 0;
+}
+
+SEC("fexit/func")
+int BPF_PROG(xdp_latency_exit, struct xdp_buff *xdp, int ret)
+{
+	__u64 *start, delta;
+	__u32 key = 0;
+
+	start = bpf_map_lookup_elem(&start_ns, &key);
+	/* Nothing to measure if we got attached between entry and exit */
+	if (!start || !*start)
+		return 0;
+
+	delta = bpf_ktime_get_ns() - *start;
+	*start = 0;
+
+	latency_hist_add(&latency_hist, delta);
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,286 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Latency histograms printed next to the packet rates. Each histogram is a
+ * per-CPU array of log2 nanosecond slots filled by a BPF program; see
+ * latency_hist.bpf.h.
+ *
+ * For the per-packet run time of the benchmark program, this loads a
+ * separate object with an fentry/fexit pair targeting the already loaded
+ * program, like xdpdump does, so the benchmark programs themselves are
+ * unchanged.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <xdp/libxdp.h>
+
+#include "logging.h"
+
+#include "xdp-bench.h"
+#include "xdp_sample.h"
+#include "xdp_latency.skel.h"
+
+#define MAX_LATENCY_HISTS 2
+
+struct latency_hist {
+	const char *name;	/* label in text output */
+	const char *stat;	/* stat name of machine-readable rows */
+	int map_fd;
+	__u32 slots;
+	__u64 *cur;
+	__u64 *prev;		/* followed by the sums over all CPUs */
+	struct timespec prev_ts;
+};
+
+static struct latency_hist latency_hists[MAX_LATENCY_HISTS];
+static int latency_num_hists;
+static struct xdp_latency *latency_skel;
+static int latency_cpus;
+
+static int latency_collect(struct latency_hist *h)
+{
+	__u32 i;
+
+	for (i = 0; i < h->slots; i++)
+		if (bpf_map_lookup_elem(h->map_fd, &i, &h->cur[i * latency_cpus]) < 0)
+			return -errno;
+	return 0;
+}
+
+static __u64 slot_start(__u32 slot)
+{
+	return slot ? 1ULL << slot : 0;
+}
+
+/* Upper bound of the slot holding percentile pct of the total */
+static __u64 latency_percentile(const __u64 *counts, __u32 slots, __u64 total,
+				int pct)
+{
+	__u64 sum = 0;
+	__u32 i;
+
+	for (i = 0; i < slots; i++) {
+		sum += counts[i];
+		if (sum * 100 >= total * pct)
+			break;
+	}
+	return 1ULL << (i + 1);
+}
+
+static void latency_print_text(const struct latency_hist *h,
+			       const __u64 *counts, double period)
+{
+	__u64 total = 0;
+	char label[32];
+	__u32 i;
+
+	for (i = 0; i < h->slots; i++)
+		total += counts[i];
+	if (!total)
+		return;
+
+	printf("  %-20s %'10.0f %-13s p50 < %'llu ns, p99 < %'llu ns\n",
+	       h->name, total / period, "pkt/s",
+	       latency_percentile(counts, h->slots, total, 50),
+	       latency_percentile(counts, h->slots, total, 99));
+
+	for (i = 0; i < h->slots; i++) {
+		if (!counts[i])
+			continue;
+
+		if (i == h->slots - 1)
+			snprintf(label, sizeof(label), "%llu+ ns", slot_start(i));
+		else
+			snprintf(label, sizeof(label), "%llu-%llu ns",
+				 slot_start(i), slot_start(i + 1) - 1);
+		printf("    %-18s %'10.0f %-13s %5.1f %%\n", label,
+		       counts[i] / period, "pkt/s", 100.0 * counts[i] / total);
+	}
+}
+
+static void latency_print_rows(const struct latency_hist *h,
+			       const __u64 *delta, const __u64 *counts,
+			       double period, __u64 timestamp)
+{
+	struct datarec rates = {};
+	char key[24];
+	__u32 i;
+	int cpu;
+
+	/* The key is the lower bound of the slot, in ns */
+	for (i = 0; i < h->slots; i++) {
+		if (!counts[i])
+			continue;
+
+		snprintf(key, sizeof(key), "%llu", slot_start(i));
+		rates.processed = counts[i] / period;
+		sample_print_row(h->stat, key, -1, timestamp, &rates);
+
+		for (cpu = 0; cpu < latency_cpus; cpu++) {
+			if (!delta[i * latency_cpus + cpu])
+				continue;
+			rates.processed = delta[i * latency_cpus + cpu] / period;
+			sample_print_row(h->stat, key, cpu, timestamp, &rates);
+		}
+	}
+}
+
+static void latency_hist_print(struct latency_hist *h)
+{
+	__u64 *delta = h->prev, *counts;
+	struct timespec now;
+	double period;
+	__u32 i, n;
+	int cpu;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	period = (now.tv_sec - h->prev_ts.tv_sec) +
+		 (now.tv_nsec - h->prev_ts.tv_nsec) / 1e9;
+	h->prev_ts = now;
+
+	if (latency_collect(h) < 0 || period <= 0)
+		return;
+
+	/* Turn the previous totals into this interval's counts in place, and
+	 * keep the per-slot sums over all CPUs after them.
+	 */
+	n = h->slots * latency_cpus;
+	counts = &h->prev[n];
+	for (i = 0; i < h->slots; i++) {
+		counts[i] = 0;
+		for (cpu = 0; cpu < latency_cpus; cpu++) {
+			delta[i * latency_cpus + cpu] =
+				h->cur[i * latency_cpus + cpu] -
+				delta[i * latency_cpus + cpu];
+			counts[i] += delta[i * latency_cpus + cpu];
+		}
+	}
+
+	if (sample_output_is_text())
+		latency_print_text(h, counts, period);
+	else
+		latency_print_rows(h, delta, counts, period,
+				   (__u64)now.tv_sec * 1000000000 + now.tv_nsec);
+
+	memcpy(h->prev, h->cur, n * sizeof(*h->cur));
+}
+
+static void latency_print(__unused void *ctx)
+{
+	int i;
+
+	for (i = 0; i < latency_num_hists; i++)
+		latency_hist_print(&latency_hists[i]);
+	if (!sample_output_is_text())
+		fflush(stdout);
+}
+
+int latency_hist_add(const char *name, const char *stat, struct bpf_map *map)
+{
+	struct latency_hist *h;
+	int ret;
+
+	if (latency_num_hists == MAX_LATENCY_HISTS)
+		return -E2BIG;
+
+	latency_cpus = libbpf_num_possible_cpus();
+	h = &latency_hists[latency_num_hists];
+	h->name = name;
+	h->stat = stat;
+	h->map_fd = bpf_map__fd(map);
+	h->slots = bpf_map__max_entries(map);
+	h->cur = calloc(h->slots * latency_cpus, sizeof(*h->cur));
+	h->prev = calloc(h->slots * (latency_cpus + 1), sizeof(*h->prev));
+	if (!h->cur || !h->prev) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	/* Counters may already be running, only report what comes after */
+	latency_collect(h);
+	memcpy(h->prev, h->cur, h->slots * latency_cpus * sizeof(*h->cur));
+	clock_gettime(CLOCK_MONOTONIC, &h->prev_ts);
+
+	/* One callback prints all histograms */
+	if (!latency_num_hists) {
+		ret = sample_add_print_cb(latency_print, NULL);
+		if (ret < 0)
+			goto err;
+	}
+
+	latency_num_hists++;
+	return 0;
+
+err:
+	free(h->cur);
+	free(h->prev);
+	return ret;
+}
+
+int latency_attach(struct xdp_program *prog)
+{
+	struct xdp_latency *skel;
+	int ret;
+
+	skel = xdp_latency__open();
+	if (!skel) {
+		ret = -errno;
+		pr_warn("Failed to xdp_latency__open: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	/* The target must be set before load, so the verifier can check the
+	 * probes against the BTF of the program they trace.
+	 */
+	ret = bpf_program__set_attach_target(skel->progs.xdp_latency_entry,
+					     xdp_program__fd(prog),
+					     xdp_program__name(prog));
+	if (!ret)
+		ret = bpf_program__set_attach_target(skel->progs.xdp_latency_exit,
+						     xdp_program__fd(prog),
+						     xdp_program__name(prog));
+	if (ret < 0) {
+		pr_warn("Failed to set latency probe target: %s\n", strerror(-ret));
+		goto err;
+	}
+
+	ret = xdp_latency__load(skel);
+	if (ret < 0) {
+		pr_warn("Failed to load latency probes: %s\n", strerror(-ret));
+		goto err;
+	}
+
+	ret = xdp_latency__attach(skel);
+	if (ret < 0) {
+		pr_warn("Failed to attach latency probes: %s\n", strerror(-ret));
+		goto err;
+	}
+
+	ret = latency_hist_add("latency", "latency", skel->maps.latency_hist);
+	if (ret < 0)
+		goto err;
+
+	latency_skel = skel;
+	return 0;
+
+err:
+	xdp_latency__destroy(skel);
+	return ret;
+}
+
+void latency_detach(void)
+{
+	int i;
+
+	for (i = 0; i < latency_num_hists; i++) {
+		free(latency_hists[i].cur);
+		free(latency_hists[i].prev);
+	}
+	latency_num_hists = 0;
+
+	xdp_latency__destroy(latency_skel);
+	latency_skel = NULL;
+}
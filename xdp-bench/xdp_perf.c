@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Hardware counters printed next to the packet rates, to tell whether a
+ * mode is bound by compute or by memory.
+ *
+ * The counters count everything a CPU does (not just the XDP program), so
+ * they are opened on a CPU the first time it receives packets, which makes
+ * them follow the CPUs handling the NIC queues. Its numbers are reported from
+ * the interval after that on, and divided by the packets it received.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <bpf/libbpf.h>
+
+#include "logging.h"
+
+#include "xdp-bench.h"
+#include "xdp_sample.h"
+
+enum perf_counter {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_NUM_COUNTERS,
+};
+
+static const struct {
+	const char *name;	/* key of machine-readable rows */
+	__u64 config;
+	bool optional;
+} perf_counters[PERF_NUM_COUNTERS] = {
+	[PERF_CYCLES] = { "cycles", PERF_COUNT_HW_CPU_CYCLES },
+	[PERF_INSTRUCTIONS] = { "instructions", PERF_COUNT_HW_INSTRUCTIONS },
+	/* Last level cache misses on most CPUs */
+	[PERF_CACHE_MISSES] = { "llc_misses", PERF_COUNT_HW_CACHE_MISSES, true },
+	[PERF_BRANCH_MISSES] = { "branch_misses", PERF_COUNT_HW_BRANCH_MISSES, true },
+};
+
+struct perf_cpu {
+	int fd[PERF_NUM_COUNTERS];
+	int num;		/* counters in the group, as in perf_counters_used */
+	bool failed;
+	bool started;		/* prev holds a reading */
+	bool reported;		/* delta covers the interval being printed */
+	__u64 prev[PERF_NUM_COUNTERS];
+	/* Indexed by enum perf_counter, unlike fd and prev */
+	__u64 delta[PERF_NUM_COUNTERS];
+};
+
+static struct perf_cpu *perf_cpus;
+static int perf_num_cpus;
+/* The counters the hardware has, found when opening */
+static int perf_counters_used[PERF_NUM_COUNTERS];
+static int perf_num_used;
+static __u64 *perf_pkts;
+static struct timespec perf_prev_ts;
+
+static int perf_open(enum perf_counter c, int cpu, int group_fd)
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_HARDWARE,
+		.size = sizeof(attr),
+		.config = perf_counters[c].config,
+		.read_format = PERF_FORMAT_GROUP |
+			       PERF_FORMAT_TOTAL_TIME_ENABLED |
+			       PERF_FORMAT_TOTAL_TIME_RUNNING,
+		.exclude_idle = 1,
+	};
+	int fd;
+
+	fd = syscall(__NR_perf_event_open, &attr, -1, cpu, group_fd,
+		     PERF_FLAG_FD_CLOEXEC);
+	return fd < 0 ? -errno : fd;
+}
+
+static void perf_cpu_close(struct perf_cpu *pc)
+{
+	/* Close the members before the leader */
+	while (pc->num)
+		close(pc->fd[--pc->num]);
+}
+
+static int perf_cpu_open(struct perf_cpu *pc, int cpu)
+{
+	int i, fd;
+
+	for (i = 0; i < perf_num_used; i++) {
+		fd = perf_open(perf_counters_used[i], cpu, i ? pc->fd[0] : -1);
+		if (fd < 0) {
+			perf_cpu_close(pc);
+			return fd;
+		}
+		pc->fd[pc->num++] = fd;
+	}
+	return 0;
+}
+
+/* Read the group of a CPU, scaled up if it had to share the hardware */
+static int perf_cpu_read(struct perf_cpu *pc, __u64 *vals)
+{
+	__u64 buf[3 + PERF_NUM_COUNTERS];
+	double scale;
+	int i;
+
+	if (read(pc->fd[0], buf, sizeof(buf)) < (ssize_t)((3 + pc->num) * sizeof(*buf)))
+		return -EIO;
+	if (!buf[2])
+		return -EAGAIN;
+
+	scale = (double)buf[1] / buf[2];
+	for (i = 0; i < pc->num; i++)
+		vals[i] = buf[3 + i] * scale;
+	return 0;
+}
+
+static double per_pkt(__u64 val, __u64 pkts)
+{
+	return pkts ? (double)val / pkts : 0;
+}
+
+static void perf_print_text(const char *label, const __u64 *delta, __u64 pkts)
+{
+	int i;
+
+	printf("  %-20s %'10.0f %-13s %10.2f %-13s", label,
+	       per_pkt(delta[PERF_CYCLES], pkts), "cycles/pkt",
+	       delta[PERF_CYCLES] ? (double)delta[PERF_INSTRUCTIONS] / delta[PERF_CYCLES] : 0,
+	       "IPC");
+	for (i = 0; i < perf_num_used; i++) {
+		if (perf_counters_used[i] == PERF_CACHE_MISSES)
+			printf(" %10.2f %-13s", per_pkt(delta[PERF_CACHE_MISSES], pkts),
+			       "llc-miss/pkt");
+		else if (perf_counters_used[i] == PERF_BRANCH_MISSES)
+			printf(" %10.2f %-13s", per_pkt(delta[PERF_BRANCH_MISSES], pkts),
+			       "br-miss/pkt");
+	}
+	printf("\n");
+}
+
+static void perf_print_rows(int cpu, const __u64 *delta, double period,
+			    __u64 timestamp)
+{
+	struct datarec rates = {};
+	int i;
+
+	for (i = 0; i < perf_num_used; i++) {
+		rates.processed = delta[perf_counters_used[i]] / period;
+		sample_print_row("perf", perf_counters[perf_counters_used[i]].name,
+				 cpu, timestamp, &rates);
+	}
+}
+
+/* Read the CPUs that have counters, and open them on the ones that got
+ * their first packets. Returns the number of CPUs with a full interval.
+ */
+static int perf_collect(__u64 *total, __u64 *total_pkts)
+{
+	__u64 vals[PERF_NUM_COUNTERS];
+	int cpu, i, ret, num = 0;
+
+	for (cpu = 0; cpu < perf_num_cpus; cpu++) {
+		struct perf_cpu *pc = &perf_cpus[cpu];
+
+		pc->reported = false;
+		if (!pc->num) {
+			if (!perf_pkts[cpu] || pc->failed)
+				continue;
+
+			ret = perf_cpu_open(pc, cpu);
+			if (ret < 0) {
+				pr_warn("Couldn't open perf counters on CPU %d: %s\n",
+					cpu, strerror(-ret));
+				pc->failed = true;
+			}
+			continue;
+		}
+
+		if (perf_cpu_read(pc, vals) < 0)
+			continue;
+
+		for (i = 0; i < pc->num; i++)
+			pc->delta[perf_counters_used[i]] = vals[i] - pc->prev[i];
+		memcpy(pc->prev, vals, sizeof(pc->prev));
+		if (!pc->started) {
+			pc->started = true;
+			continue;
+		}
+
+		for (i = 0; i < PERF_NUM_COUNTERS; i++)
+			total[i] += pc->delta[i];
+		*total_pkts += perf_pkts[cpu];
+		pc->reported = true;
+		num++;
+	}
+	return num;
+}
+
+static void perf_print(__unused void *ctx)
+{
+	__u64 total[PERF_NUM_COUNTERS] = {}, total_pkts = 0, timestamp;
+	struct timespec now;
+	int cpu, num_cpus;
+	char label[32];
+	double period;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	period = (now.tv_sec - perf_prev_ts.tv_sec) +
+		 (now.tv_nsec - perf_prev_ts.tv_nsec) / 1e9;
+	perf_prev_ts = now;
+	timestamp = (__u64)now.tv_sec * 1000000000 + now.tv_nsec;
+
+	if (sample_get_rx_cpu_pkts(perf_pkts, perf_num_cpus) < 0 || period <= 0)
+		return;
+
+	num_cpus = perf_collect(total, &total_pkts);
+	if (!num_cpus)
+		return;
+
+	if (sample_output_is_text())
+		perf_print_text("perf counters", total, total_pkts);
+	else
+		perf_print_rows(-1, total, period, timestamp);
+
+	for (cpu = 0; cpu < perf_num_cpus; cpu++) {
+		if (!perf_cpus[cpu].reported)
+			continue;
+
+		if (!sample_output_is_text()) {
+			perf_print_rows(cpu, perf_cpus[cpu].delta, period, timestamp);
+		} else if (num_cpus > 1) {
+			snprintf(label, sizeof(label), "  cpu:%d", cpu);
+			perf_print_text(label, perf_cpus[cpu].delta, perf_pkts[cpu]);
+		}
+	}
+
+	if (!sample_output_is_text())
+		fflush(stdout);
+}
+
+/* Find out which counters the hardware has on the first CPU, so all CPUs
+ * get the same group; cycles and instructions are needed for anything to
+ * make sense.
+ */
+static int perf_probe(void)
+{
+	int c, fd, leader = -1, ret = 0;
+
+	for (c = 0; c < PERF_NUM_COUNTERS; c++) {
+		fd = perf_open(c, 0, leader);
+		if (fd < 0) {
+			if (perf_counters[c].optional) {
+				pr_debug("No %s perf counter: %s\n",
+					 perf_counters[c].name, strerror(-fd));
+				continue;
+			}
+			ret = fd;
+			break;
+		}
+		if (leader < 0)
+			leader = fd;
+		else
+			close(fd);
+		perf_counters_used[perf_num_used++] = c;
+	}
+	if (leader >= 0)
+		close(leader);
+
+	if (ret == -EACCES || ret == -EPERM)
+		pr_warn("Not allowed to open CPU-wide perf counters; "
+			"check the kernel.perf_event_paranoid sysctl\n");
+	else if (ret == -ENOENT || ret == -EOPNOTSUPP || ret == -ENODEV)
+		pr_warn("No hardware perf counters available (running in a VM?)\n");
+	else if (ret < 0)
+		pr_warn("Couldn't open perf counters: %s\n", strerror(-ret));
+
+	return ret;
+}
+
+int perf_counters_open(void)
+{
+	int ret;
+
+	perf_num_used = 0;
+	ret = perf_probe();
+	if (ret < 0)
+		return ret;
+
+	perf_num_cpus = libbpf_num_possible_cpus();
+	perf_cpus = calloc(perf_num_cpus, sizeof(*perf_cpus));
+	perf_pkts = calloc(perf_num_cpus, sizeof(*perf_pkts));
+	if (!perf_cpus || !perf_pkts) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	ret = sample_add_print_cb(perf_print, NULL);
+	if (ret < 0)
+		goto err;
+
+	clock_gettime(CLOCK_MONOTONIC, &perf_prev_ts);
+	return 0;
+
+err:
+	perf_counters_close();
+	return ret;
+}
+
+void perf_counters_close(void)
+{
+	int cpu;
+
+	for (cpu = 0; perf_cpus && cpu < perf_num_cpus; cpu++)
+		perf_cpu_close(&perf_cpus[cpu]);
+	free(perf_cpus);
+	free(perf_pkts);
+	perf_cpus = NULL;
+	perf_pkts = NULL;
+	perf_num_cpus = 0;
+}
@@ -0,0 +1,734 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <stdbool.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <bpf/libbpf.h>
+#include <xdp/libxdp.h>
+
+#include "logging.h"
+#include "xpcapng.h"
+
+#include "xdp-bench.h"
+#include "xdp_sample.h"
+
+#define PROG_RUN_MAX_BATCH 1024
+#define PROG_RUN_PKT_LEN 64
+#define PROG_RUN_MAX_LEN 4096
+/* Largest packet read from a capture file; longer ones are kept in the
+ * output file, but can't be run (the kernel takes about a page without
+ * fragments).
+ */
+#define PROG_RUN_MAX_CAPLEN (256 * 1024)
+#define PROG_RUN_MAX_IFACES 64
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+
+#define PCAPNG_BLOCK_SHB 0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB 1
+#define PCAPNG_BLOCK_SPB 3
+#define PCAPNG_BLOCK_EPB 6
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_MAX_BLOCK (PROG_RUN_MAX_CAPLEN + 4096)
+
+const struct prog_run_opts defaults_prog_run = { .repeat = 100000,
+						 .batch_size = 64 };
+
+struct pcap_file_hdr {
+	__u32 magic;
+	__u16 version_major;
+	__u16 version_minor;
+	__s32 thiszone;
+	__u32 sigfigs;
+	__u32 snaplen;
+	__u32 linktype;
+};
+
+struct pcap_pkt_hdr {
+	__u32 ts_sec;
+	__u32 ts_frac;
+	__u32 caplen;
+	__u32 len;
+};
+
+struct pcapng_block_hdr {
+	__u32 type;
+	__u32 len;
+};
+
+struct test_pkt {
+	void *data;
+	__u32 size;		/* of data */
+	__u32 len;
+	__u32 orig_len;		/* on the wire, len is what was captured */
+	__u32 ifid;		/* interface in the output file */
+	__u64 ts;		/* in the resolution of the interface */
+	__u32 retval;
+	__u32 duration;
+	bool skipped;
+};
+
+/* Reads classic pcap and pcapng files one packet at a time, and adds their
+ * interfaces to the output file as they are found. The interfaces of all
+ * pcapng sections are numbered in one sequence, as the output file has only
+ * one section.
+ */
+struct pcap_reader {
+	FILE *f;
+	const char *filename;
+	struct xpcapng_dumper *out;
+	bool pcapng;
+	bool swapped;
+	__u32 ts_units;		/* per second, for classic files */
+	__u32 section_base;	/* first interface of the current section */
+	__u32 num_ifaces;
+	__u32 snaplen[PROG_RUN_MAX_IFACES];
+	__u8 *block;
+	__u32 block_size;
+};
+
+struct run_stats {
+	__u64 pkts;
+	__u64 skipped;
+	__u64 sum_ns;
+	__u32 min_ns;
+	__u32 max_ns;
+	__u64 verdicts[XDP_REDIRECT + 2];
+	__u64 verdict_ns[XDP_REDIRECT + 2];
+};
+
+static const char *action_names[] = {
+	[XDP_ABORTED] = "XDP_ABORTED",
+	[XDP_DROP] = "XDP_DROP",
+	[XDP_PASS] = "XDP_PASS",
+	[XDP_TX] = "XDP_TX",
+	[XDP_REDIRECT] = "XDP_REDIRECT",
+};
+
+static __u32 swap32(__u32 v, bool swapped)
+{
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+static __u16 swap16(__u16 v, bool swapped)
+{
+	return swapped ? __builtin_bswap16(v) : v;
+}
+
+static int pkt_reserve(struct test_pkt *pkt, __u32 len)
+{
+	void *data;
+
+	if (len <= pkt->size)
+		return 0;
+
+	data = realloc(pkt->data, len);
+	if (!data)
+		return -ENOMEM;
+	pkt->data = data;
+	pkt->size = len;
+	return 0;
+}
+
+/* End of the file, or an error reading it */
+static int read_end(struct pcap_reader *r)
+{
+	if (feof(r->f))
+		return 0;
+
+	pr_warn("Couldn't read %s: %s\n", r->filename, strerror(errno));
+	return -EIO;
+}
+
+static int reader_add_iface(struct pcap_reader *r, __u32 linktype,
+			    __u32 snaplen, __u8 tsresol, const char *name)
+{
+	if (linktype != PCAP_LINKTYPE_ETHERNET) {
+		pr_warn("%s does not contain Ethernet frames (link type %u)\n",
+			r->filename, linktype);
+		return -EOPNOTSUPP;
+	}
+	if (r->num_ifaces == PROG_RUN_MAX_IFACES) {
+		pr_warn("%s has more than %d interfaces\n", r->filename,
+			PROG_RUN_MAX_IFACES);
+		return -E2BIG;
+	}
+
+	/* Timestamps are copied as they are, so keep their resolution */
+	if (r->out && xpcapng_dump_add_interface(r->out,
+						 snaplen > 0xffff ? 0 : snaplen,
+						 name, NULL, NULL, 0, tsresol,
+						 NULL) < 0) {
+		pr_warn("Couldn't add interface to the output file\n");
+		return -EIO;
+	}
+
+	r->snaplen[r->num_ifaces++] = snaplen;
+	return 0;
+}
+
+/* Interface name and timestamp resolution of an IDB; the resolution is kept
+ * in its pcapng encoding.
+ */
+static void parse_idb_options(struct pcap_reader *r, __u8 *opt, __u8 *end,
+			      char *name, size_t name_len, __u8 *tsresol)
+{
+	__u16 type, len;
+
+	while (opt + 4 <= end) {
+		type = swap16(*(__u16 *)opt, r->swapped);
+		len = swap16(*(__u16 *)(opt + 2), r->swapped);
+		opt += 4;
+		if (!type || opt + len > end)
+			break;
+
+		if (type == PCAPNG_OPT_IF_NAME && len < name_len) {
+			memcpy(name, opt, len);
+			name[len] = '\0';
+		} else if (type == PCAPNG_OPT_IF_TSRESOL && len == 1) {
+			*tsresol = *opt;
+		}
+		opt += (len + 3) & ~3;
+	}
+}
+
+/* Read the next block into r->block, leaving hdr->len as the length of what
+ * follows the header there.
+ */
+static int reader_read_block(struct pcap_reader *r, struct pcapng_block_hdr *hdr)
+{
+	__u32 len, first;
+	__u8 *block;
+
+	if (fread(hdr, sizeof(*hdr), 1, r->f) != 1)
+		return read_end(r);
+	/* Every block is at least 12 bytes long */
+	if (fread(&first, sizeof(first), 1, r->f) != 1)
+		return -EINVAL;
+
+	/* A section header tells the byte order of what follows */
+	if (hdr->type == PCAPNG_BLOCK_SHB) {
+		if (first == PCAPNG_BYTE_ORDER_MAGIC)
+			r->swapped = false;
+		else if (first == __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC))
+			r->swapped = true;
+		else
+			return -EINVAL;
+	}
+
+	hdr->type = swap32(hdr->type, r->swapped);
+	len = swap32(hdr->len, r->swapped);
+	if (len < 12 || len % 4 || len > PCAPNG_MAX_BLOCK)
+		return -EINVAL;
+	hdr->len = len - sizeof(*hdr);
+
+	if (hdr->len > r->block_size) {
+		block = realloc(r->block, hdr->len);
+		if (!block)
+			return -ENOMEM;
+		r->block = block;
+		r->block_size = hdr->len;
+	}
+	memcpy(r->block, &first, sizeof(first));
+	if (hdr->len > sizeof(first) &&
+	    fread(r->block + sizeof(first), hdr->len - sizeof(first), 1, r->f) != 1)
+		return -EINVAL;
+
+	return 1;
+}
+
+static int reader_next_pcapng(struct pcap_reader *r, struct test_pkt *pkt)
+{
+	struct pcapng_block_hdr hdr;
+	char name[64];
+	__u32 *b, ifid;
+	__u8 tsresol;
+	int ret;
+
+	while ((ret = reader_read_block(r, &hdr)) > 0) {
+		/* Leave out the trailing copy of the block length */
+		__u32 body = hdr.len - 4;
+
+		b = (__u32 *)r->block;
+		switch (hdr.type) {
+		case PCAPNG_BLOCK_SHB:
+			r->section_base = r->num_ifaces;
+			break;
+		case PCAPNG_BLOCK_IDB:
+			if (body < 8)
+				return -EINVAL;
+			name[0] = '\0';
+			tsresol = 6;
+			parse_idb_options(r, r->block + 8, r->block + body,
+					  name, sizeof(name), &tsresol);
+			ret = reader_add_iface(r, swap16(*(__u16 *)b, r->swapped),
+					       swap32(b[1], r->swapped), tsresol,
+					       name[0] ? name : NULL);
+			if (ret < 0)
+				return ret;
+			break;
+		case PCAPNG_BLOCK_EPB:
+			if (body < 20)
+				return -EINVAL;
+			ifid = r->section_base + swap32(b[0], r->swapped);
+			pkt->ts = (__u64)swap32(b[1], r->swapped) << 32 |
+				  swap32(b[2], r->swapped);
+			pkt->len = swap32(b[3], r->swapped);
+			pkt->orig_len = swap32(b[4], r->swapped);
+			if (ifid >= r->num_ifaces || pkt->len > body - 20)
+				return -EINVAL;
+			pkt->ifid = ifid;
+			if (pkt_reserve(pkt, pkt->len))
+				return -ENOMEM;
+			memcpy(pkt->data, &b[5], pkt->len);
+			return 1;
+		case PCAPNG_BLOCK_SPB:
+			/* No timestamp and always on the first interface */
+			if (body < 4 || r->section_base >= r->num_ifaces)
+				return -EINVAL;
+			pkt->ifid = r->section_base;
+			pkt->ts = 0;
+			pkt->orig_len = swap32(b[0], r->swapped);
+			pkt->len = min(pkt->orig_len, body - 4);
+			if (r->snaplen[pkt->ifid])
+				pkt->len = min(pkt->len, r->snaplen[pkt->ifid]);
+			if (pkt_reserve(pkt, pkt->len))
+				return -ENOMEM;
+			memcpy(pkt->data, &b[1], pkt->len);
+			return 1;
+		default:
+			/* Statistics, name resolution, obsolete packet blocks */
+			break;
+		}
+	}
+	return ret;
+}
+
+static int reader_next_pcap(struct pcap_reader *r, struct test_pkt *pkt)
+{
+	struct pcap_pkt_hdr phdr;
+	__u32 ts_sec, ts_frac;
+
+	if (fread(&phdr, sizeof(phdr), 1, r->f) != 1)
+		return read_end(r);
+
+	pkt->len = swap32(phdr.caplen, r->swapped);
+	pkt->orig_len = swap32(phdr.len, r->swapped);
+	if (pkt->len > PROG_RUN_MAX_CAPLEN)
+		return -EINVAL;
+	if (pkt_reserve(pkt, pkt->len))
+		return -ENOMEM;
+	if (pkt->len && fread(pkt->data, pkt->len, 1, r->f) != 1)
+		return -EINVAL;
+
+	/* The output interface has the resolution of the file */
+	ts_sec = swap32(phdr.ts_sec, r->swapped);
+	ts_frac = swap32(phdr.ts_frac, r->swapped);
+	pkt->ts = (__u64)ts_sec * r->ts_units + ts_frac;
+	pkt->ifid = 0;
+	return 1;
+}
+
+/* Returns 1 for a packet, and 0 at the end of the file */
+static int reader_next(struct pcap_reader *r, struct test_pkt *pkt)
+{
+	int ret;
+
+	ret = r->pcapng ? reader_next_pcapng(r, pkt) : reader_next_pcap(r, pkt);
+	if (ret == -EINVAL)
+		pr_warn("%s is truncated or not a valid pcap or pcapng file\n",
+			r->filename);
+	else if (ret == -ENOMEM)
+		pr_warn("Couldn't allocate memory for a packet from %s\n",
+			r->filename);
+	return ret;
+}
+
+static int reader_open(struct pcap_reader *r, const char *filename,
+		       struct xpcapng_dumper *out)
+{
+	struct pcap_file_hdr fhdr;
+	bool nsec;
+	int ret;
+
+	memset(r, 0, sizeof(*r));
+	r->filename = filename;
+	r->out = out;
+
+	r->f = fopen(filename, "r");
+	if (!r->f) {
+		ret = -errno;
+		pr_warn("Couldn't open %s: %s\n", filename, strerror(errno));
+		return ret;
+	}
+
+	if (fread(&fhdr.magic, sizeof(fhdr.magic), 1, r->f) != 1)
+		goto err_format;
+
+	if (fhdr.magic == PCAPNG_BLOCK_SHB) {
+		r->pcapng = true;
+		rewind(r->f);
+		return 0;
+	}
+
+	if (fread((void *)&fhdr + sizeof(fhdr.magic),
+		  sizeof(fhdr) - sizeof(fhdr.magic), 1, r->f) != 1)
+		goto err_format;
+
+	if (fhdr.magic == PCAP_MAGIC || fhdr.magic == PCAP_MAGIC_NS)
+		r->swapped = false;
+	else if (fhdr.magic == __builtin_bswap32(PCAP_MAGIC) ||
+		 fhdr.magic == __builtin_bswap32(PCAP_MAGIC_NS))
+		r->swapped = true;
+	else
+		goto err_format;
+
+	nsec = swap32(fhdr.magic, r->swapped) == PCAP_MAGIC_NS;
+	r->ts_units = nsec ? 1000000000 : 1000000;
+
+	ret = reader_add_iface(r, swap32(fhdr.linktype, r->swapped),
+			       swap32(fhdr.snaplen, r->swapped), nsec ? 9 : 6,
+			       NULL);
+	if (ret < 0)
+		goto err;
+	return 0;
+
+err_format:
+	pr_warn("%s is not a valid pcap or pcapng file\n", filename);
+	ret = -EINVAL;
+err:
+	fclose(r->f);
+	r->f = NULL;
+	return ret;
+}
+
+static void reader_close(struct pcap_reader *r)
+{
+	if (r->f)
+		fclose(r->f);
+	free(r->block);
+	r->f = NULL;
+	r->block = NULL;
+}
+
+/* Same packet xsk-tx sends by default: 64 bytes of broadcast UDP */
+static int gen_packet(struct test_pkt *pkt)
+{
+	static const __u8 src_mac[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 0x01 };
+
+	if (pkt_reserve(pkt, PROG_RUN_PKT_LEN))
+		return -ENOMEM;
+	pkt->len = PROG_RUN_PKT_LEN;
+	pkt->orig_len = pkt->len;
+
+	xsk_gen_packet(pkt->data, pkt->len, src_mac, &defaults_xsk_tx, 0);
+	return 1;
+}
+
+static struct bpf_program *find_prog(struct bpf_object *obj, const char *name)
+{
+	struct bpf_program *prog;
+
+	if (name)
+		return bpf_object__find_program_by_name(obj, name);
+
+	bpf_object__for_each_program(prog, obj)
+		if (bpf_program__type(prog) == BPF_PROG_TYPE_XDP)
+			return prog;
+	return NULL;
+}
+
+static int load_file(const struct prog_run_opts *opt, struct bpf_object **objp)
+{
+	struct bpf_program *prog, *p;
+	struct bpf_object *obj;
+	int ret;
+
+	obj = bpf_object__open_file(opt->filename, NULL);
+	ret = libbpf_get_error(obj);
+	if (ret) {
+		pr_warn("Couldn't open %s: %s\n", opt->filename, strerror(-ret));
+		return ret;
+	}
+
+	prog = find_prog(obj, opt->prog_name);
+	if (!prog) {
+		pr_warn("Couldn't find %s in %s\n",
+			opt->prog_name ?: "an XDP program", opt->filename);
+		ret = -ENOENT;
+		goto err;
+	}
+
+	/* Only load the program that is being measured */
+	bpf_object__for_each_program(p, obj)
+		bpf_program__set_autoload(p, p == prog);
+
+retry:
+	ret = bpf_object__load(obj);
+	if (ret == -EPERM && !double_rlimit())
+		goto retry;
+	if (ret) {
+		pr_warn("Couldn't load %s: %s\n", opt->filename, strerror(-ret));
+		goto err;
+	}
+
+	*objp = obj;
+	return bpf_program__fd(prog);
+
+err:
+	bpf_object__close(obj);
+	return ret;
+}
+
+static int run_packet(int prog_fd, struct test_pkt *pkt, __u32 repeat)
+{
+	char data_out[PROG_RUN_MAX_LEN + 256];
+	DECLARE_LIBBPF_OPTS(bpf_test_run_opts, opts,
+			    .data_in = pkt->data,
+			    .data_size_in = pkt->len,
+			    .data_out = data_out,
+			    .data_size_out = sizeof(data_out),
+			    .repeat = repeat);
+	int ret;
+
+	/* Packets cut short by the snap length are run as captured */
+	pkt->skipped = pkt->len < ETH_HLEN || pkt->len > PROG_RUN_MAX_LEN;
+	if (pkt->skipped)
+		return 0;
+
+	ret = bpf_prog_test_run_opts(prog_fd, &opts);
+	if (ret) {
+		ret = -errno;
+		/* Longer than what the kernel takes in one buffer */
+		if (ret == -EINVAL && pkt->len > ETH_FRAME_LEN) {
+			pkt->skipped = true;
+			return 0;
+		}
+		pr_warn("BPF_PROG_RUN failed: %s\n", strerror(errno));
+		return ret;
+	}
+
+	pkt->retval = opts.retval;
+	pkt->duration = opts.duration;
+	return 0;
+}
+
+static const char *verdict_name(__u32 verdict)
+{
+	return verdict <= XDP_REDIRECT ? action_names[verdict] : "unknown";
+}
+
+static void record_packet(const struct prog_run_opts *opt, struct run_stats *st,
+			  const struct test_pkt *pkt)
+{
+	__u32 v = min(pkt->retval, XDP_REDIRECT + 1);
+
+	if (opt->extended) {
+		if (pkt->skipped)
+			printf("  packet %-5llu %5u bytes %-13s\n",
+			       (unsigned long long)st->pkts, pkt->len, "skipped");
+		else
+			printf("  packet %-5llu %5u bytes %-13s %6u ns\n",
+			       (unsigned long long)st->pkts, pkt->len,
+			       verdict_name(pkt->retval), pkt->duration);
+	}
+
+	st->pkts++;
+	if (pkt->skipped) {
+		st->skipped++;
+		return;
+	}
+
+	st->verdicts[v]++;
+	st->verdict_ns[v] += pkt->duration;
+	st->sum_ns += pkt->duration;
+	st->min_ns = min(st->min_ns, pkt->duration);
+	st->max_ns = max(st->max_ns, pkt->duration);
+}
+
+/* The packet goes out as it was read, with the verdict of the program */
+static int write_packet(struct xpcapng_dumper *out, const struct test_pkt *pkt,
+			__u64 index)
+{
+	struct xpcapng_epb_options_s options = {};
+	int64_t action = pkt->retval;
+	uint64_t packetid = index;
+
+	options.flags = PCAPNG_EPB_FLAG_INBOUND;
+	options.packetid = &packetid;
+	options.xdp_verdict = pkt->skipped ? NULL : &action;
+
+	if (!xpcapng_dump_enhanced_pkt(out, pkt->ifid, pkt->data, pkt->orig_len,
+				       pkt->len, pkt->ts, &options)) {
+		pr_warn("Couldn't write to the output file: %s\n", strerror(errno));
+		return -EIO;
+	}
+	return 0;
+}
+
+static void print_results(const struct prog_run_opts *opt,
+			  const struct run_stats *st)
+{
+	__u64 run = st->pkts - st->skipped;
+	__u32 i;
+
+	printf("%llu packets, %u runs each\n", (unsigned long long)st->pkts,
+	       opt->repeat);
+	if (run)
+		printf("  ns/packet  avg %llu min %u max %u\n",
+		       (unsigned long long)(st->sum_ns / run), st->min_ns,
+		       st->max_ns);
+	for (i = 0; i <= XDP_REDIRECT + 1; i++) {
+		if (!st->verdicts[i])
+			continue;
+		printf("  %-13s %llu (%.1f%%) %llu ns/packet\n", verdict_name(i),
+		       (unsigned long long)st->verdicts[i],
+		       100.0 * st->verdicts[i] / st->pkts,
+		       (unsigned long long)(st->verdict_ns[i] / st->verdicts[i]));
+	}
+	if (st->skipped)
+		printf("  %-13s %llu (%.1f%%) shorter than an Ethernet header or too long\n",
+		       "skipped", (unsigned long long)st->skipped,
+		       100.0 * st->skipped / st->pkts);
+}
+
+/* Packets are read, run and written out a batch at a time, so that the
+ * timing isn't mixed up with the file handling and memory use doesn't grow
+ * with the size of the capture. Returns an exit code.
+ */
+static int replay(const struct prog_run_opts *opt, int prog_fd,
+		  struct pcap_reader *r, struct xpcapng_dumper *out,
+		  struct test_pkt *pkts, struct run_stats *st)
+{
+	__u32 num, i;
+	int ret;
+
+	do {
+		for (num = 0; num < opt->batch_size; num++) {
+			ret = reader_next(r, &pkts[num]);
+			if (ret < 0)
+				return ret == -ENOMEM ? EXIT_FAIL_MEM : EXIT_FAIL_OPTION;
+			if (!ret)
+				break;
+		}
+
+		for (i = 0; i < num; i++)
+			if (run_packet(prog_fd, &pkts[i], opt->repeat) < 0)
+				return EXIT_FAIL_BPF;
+
+		for (i = 0; i < num; i++) {
+			if (out && write_packet(out, &pkts[i], st->pkts) < 0)
+				return EXIT_FAIL;
+			record_packet(opt, st, &pkts[i]);
+		}
+	} while (num == opt->batch_size);
+
+	if (!st->pkts) {
+		pr_warn("No packets in %s\n", r->filename);
+		return EXIT_FAIL_OPTION;
+	}
+	return EXIT_OK;
+}
+
+int do_prog_run(const void *cfg, __unused const char *pin_root_path)
+{
+	const struct prog_run_opts *opt = cfg;
+	struct test_pkt pkts[PROG_RUN_MAX_BATCH] = {};
+	struct run_stats st = { .min_ns = -1U };
+	struct xpcapng_dumper *out = NULL;
+	struct xdp_multiprog *mp = NULL;
+	struct bpf_object *obj = NULL;
+	struct pcap_reader r = {};
+	int prog_fd, i, ret;
+
+	if (!opt->filename == !opt->iface.ifindex) {
+		pr_warn("Need exactly one of a BPF object file or --dev\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	if (!opt->repeat) {
+		pr_warn("Repeat count must be at least 1\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	if (!opt->batch_size || opt->batch_size > PROG_RUN_MAX_BATCH) {
+		pr_warn("Batch size must be between 1 and %d\n", PROG_RUN_MAX_BATCH);
+		return EXIT_FAIL_OPTION;
+	}
+
+	if (opt->write_file && !opt->pcap_file) {
+		pr_warn("Writing the verdicts needs a capture to read (--pcap)\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	if (opt->iface.ifindex) {
+		/* Measure whatever runs on the interface: a single legacy
+		 * program or the dispatcher with all its component programs.
+		 */
+		mp = xdp_multiprog__get_from_ifindex(opt->iface.ifindex);
+		if (IS_ERR_OR_NULL(mp)) {
+			pr_warn("No XDP program loaded on %s\n", opt->iface.ifname);
+			mp = NULL;
+			ret = EXIT_FAIL_XDP;
+			goto out;
+		}
+		prog_fd = xdp_program__fd(xdp_multiprog__main_prog(mp));
+	} else {
+		prog_fd = load_file(opt, &obj);
+	}
+	if (prog_fd < 0) {
+		ret = EXIT_FAIL_BPF;
+		goto out;
+	}
+
+	if (!opt->pcap_file) {
+		ret = EXIT_FAIL_BPF;
+		if (gen_packet(&pkts[0]) < 0 ||
+		    run_packet(prog_fd, &pkts[0], opt->repeat) < 0)
+			goto out;
+		record_packet(opt, &st, &pkts[0]);
+		print_results(opt, &st);
+		ret = EXIT_OK;
+		goto out;
+	}
+
+	if (opt->write_file) {
+		out = xpcapng_dump_open(opt->write_file,
+					"Verdicts from BPF_PROG_RUN", NULL, NULL,
+					"xdp-bench v" TOOLS_VERSION);
+		if (!out) {
+			pr_warn("Couldn't create %s: %s\n", opt->write_file,
+				strerror(errno));
+			ret = EXIT_FAIL;
+			goto out;
+		}
+	}
+
+	if (reader_open(&r, opt->pcap_file, out) < 0) {
+		ret = EXIT_FAIL_OPTION;
+		goto out;
+	}
+
+	ret = replay(opt, prog_fd, &r, out, pkts, &st);
+	if (ret == EXIT_OK)
+		print_results(opt, &st);
+out:
+	reader_close(&r);
+	if (out)
+		xpcapng_dump_close(out);
+	xdp_multiprog__close(mp);
+	bpf_object__close(obj);
+	for (i = 0; i < PROG_RUN_MAX_BATCH; i++)
+		free(pkts[i].data);
+	return ret;
+}
@@ -14,6 +14,7 @@
 #include <xdp/xdp_sample_shared.h>
 #include <xdp/xdp_sample.bpf.h>
 #include <xdp/xdp_sample_common.bpf.h>
+#include "tunnel.bpf.h"
 
 const volatile int ifindex_out;
 
@@ -36,7 +37,12 @@ int xdp_redirect_basic_prog(struct xdp_md *ctx)
 		return XDP_PASS;
 	NO_TEAR_INC(rec->processed);
 
-	swap_src_dst_mac(data);
+	if (tunnel_op == TUNNEL_NONE) {
+		swap_src_dst_mac(data);
+	} else if (tunnel_rewrite(ctx)) {
+		NO_TEAR_INC(rec->issue);
+		return XDP_DROP;
+	}
 	return bpf_redirect(ifindex_out, 0);
 }
 
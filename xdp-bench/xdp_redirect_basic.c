@@ -31,7 +31,8 @@ static int mask = SAMPLE_RX_CNT | SAMPLE_REDIRECT_ERR_CNT |
 DEFINE_SAMPLE_INIT(xdp_redirect_basic);
 
 const struct redirect_opts defaults_redirect_basic = { .mode = XDP_MODE_NATIVE,
-						    .interval = 2 };
+						    .interval = 2,
+						    .program_mode = BASIC_SWAP_MACS };
 
 int do_redirect_basic(const void *cfg, __unused const char *pin_root_path)
 {
@@ -45,6 +46,7 @@ int do_redirect_basic(const void *cfg, __unused const char *pin_root_path)
 
 	if (opt->extended)
 		sample_switch_mode();
+	sample_set_output_format(opt->format);
 
 	if (opt->mode == XDP_MODE_SKB)
 		/* devmap_xmit tracepoint not available */
@@ -72,6 +74,13 @@ int do_redirect_basic(const void *cfg, __unused const char *pin_root_path)
 	skel->rodata->from_match[0] = opt->iface_in.ifindex;
 	skel->rodata->to_match[0] = opt->iface_out.ifindex;
 	skel->rodata->ifindex_out = opt->iface_out.ifindex;
+	if (opt->program_mode == BASIC_ENCAP) {
+		skel->rodata->tunnel_op = TUNNEL_ENCAP;
+		skel->rodata->tunnel_type = opt->tunnel;
+	} else if (opt->program_mode == BASIC_DECAP) {
+		skel->rodata->tunnel_op = TUNNEL_DECAP;
+		skel->rodata->tunnel_type = opt->tunnel;
+	}
 
 	opts.obj = skel->obj;
 	opts.prog_name = bpf_program__name(skel->progs.xdp_redirect_basic_prog);
@@ -97,6 +106,22 @@ int do_redirect_basic(const void *cfg, __unused const char *pin_root_path)
 		goto end_detach;
 	}
 
+	if (opt->latency) {
+		ret = latency_attach(xdp_prog);
+		if (ret < 0) {
+			ret = EXIT_FAIL_BPF;
+			goto end_detach;
+		}
+	}
+
+	if (opt->perf_counters) {
+		ret = perf_counters_open();
+		if (ret < 0) {
+			ret = EXIT_FAIL;
+			goto end_detach;
+		}
+	}
+
 	opts.obj = NULL;
 	opts.prog_name = "xdp_pass";
 	opts.find_filename = "xdp-dispatcher.o";
@@ -121,7 +146,7 @@ int do_redirect_basic(const void *cfg, __unused const char *pin_root_path)
 		opt->iface_in.ifname, opt->iface_in.ifindex, str,
 		opt->iface_out.ifname, opt->iface_out.ifindex, get_driver_name(opt->iface_out.ifindex));
 
-	ret = sample_run(opt->interval, NULL, NULL);
+	ret = sample_run(opt->interval_ms ?: opt->interval * 1000, NULL, NULL);
 	if (ret < 0) {
 		pr_warn("Failed during sample run: %s\n", strerror(-ret));
 		ret = EXIT_FAIL;
@@ -135,6 +160,8 @@ end_detach:
 end_destroy:
 	xdp_redirect_basic__destroy(skel);
 end:
+	perf_counters_close();
+	latency_detach();
 	sample_teardown();
 	return ret;
 }
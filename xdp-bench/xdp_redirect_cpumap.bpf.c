@@ -6,7 +6,9 @@
 #include <xdp/xdp_sample_shared.h>
 #include <xdp/xdp_sample.bpf.h>
 #include <xdp/xdp_sample_common.bpf.h>
+#include <linux/jhash.h>
 #include "hash_func01.h"
+#include "latency_hist.bpf.h"
 
 /* Special map type that can XDP_REDIRECT frames to another CPU */
 struct {
@@ -38,6 +40,29 @@ struct {
 	__uint(max_entries, 1);
 } cpus_iterator SEC(".maps");
 
+/* Frames enqueued to each CPU's cpumap queue from all source CPUs, used
+ * with the kthread counters to estimate the queue backlog of a CPU.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, u64);
+} cpu_enqueued SEC(".maps");
+
+/* Flow hash to CPU index, so a flow sticks to the CPU it was given */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(map_flags, BPF_F_NO_COMMON_LRU);
+	__type(key, u32);
+	__type(value, u32);
+	__uint(max_entries, 16384);
+} flow_cpu SEC(".maps");
+
+/* Backlog above which a flow is moved off its CPU, set from userspace; not
+ * const, as --sweep changes it along with the queue size
+ */
+u32 cpu_backlog_high = 1024;
+
 struct {
 	__uint(type, BPF_MAP_TYPE_DEVMAP);
 	__uint(key_size, sizeof(int));
@@ -47,6 +72,19 @@ struct {
 
 char tx_mac_addr[ETH_ALEN];
 
+/* Stamp redirected packets so the cpumap program can measure how long they
+ * waited in the queue to the remote CPU.
+ */
+const volatile bool queue_delay = false;
+latency_hist_map queue_delay_hist SEC(".maps");
+
+static __always_inline long redirect_cpu(struct xdp_md *ctx, u32 cpu)
+{
+	if (queue_delay)
+		queue_stamp(ctx);
+	return bpf_redirect_map(&cpu_map, cpu, 0);
+}
+
 /* Helper parse functions */
 
 static __always_inline
@@ -162,7 +200,7 @@ int  cpumap_no_touch(struct xdp_md *ctx)
 		NO_TEAR_INC(rec->issue);
 		return XDP_ABORTED;
 	}
-	return bpf_redirect_map(&cpu_map, cpu_dest, 0);
+	return redirect_cpu(ctx, cpu_dest);
 }
 
 SEC("xdp")
@@ -204,7 +242,7 @@ int  cpumap_touch_data(struct xdp_md *ctx)
 		NO_TEAR_INC(rec->issue);
 		return XDP_ABORTED;
 	}
-	return bpf_redirect_map(&cpu_map, cpu_dest, 0);
+	return redirect_cpu(ctx, cpu_dest);
 }
 
 SEC("xdp")
@@ -247,7 +285,7 @@ int  cpumap_round_robin(struct xdp_md *ctx)
 		NO_TEAR_INC(rec->issue);
 		return XDP_ABORTED;
 	}
-	return bpf_redirect_map(&cpu_map, cpu_dest, 0);
+	return redirect_cpu(ctx, cpu_dest);
 }
 
 SEC("xdp")
@@ -313,7 +351,7 @@ int  cpumap_l4_proto(struct xdp_md *ctx)
 		NO_TEAR_INC(rec->issue);
 		return XDP_ABORTED;
 	}
-	return bpf_redirect_map(&cpu_map, cpu_dest, 0);
+	return redirect_cpu(ctx, cpu_dest);
 }
 
 SEC("xdp")
@@ -386,12 +424,15 @@ int  cpumap_l4_filter(struct xdp_md *ctx)
 		NO_TEAR_INC(rec->issue);
 		return XDP_ABORTED;
 	}
-	return bpf_redirect_map(&cpu_map, cpu_dest, 0);
+	return redirect_cpu(ctx, cpu_dest);
 }
 
 /* Hashing initval */
 #define INITVAL 15485863
 
+#define IP_MF		0x2000
+#define IP_OFFSET	0x1fff
+
 static __always_inline
 u32 get_ipv4_hash_ip_pair(struct xdp_md *ctx, u64 nh_off)
 {
@@ -487,17 +528,443 @@ int  cpumap_l4_hash(struct xdp_md *ctx)
 		NO_TEAR_INC(rec->issue);
 		return XDP_ABORTED;
 	}
-	return bpf_redirect_map(&cpu_map, cpu_dest, 0);
+	return redirect_cpu(ctx, cpu_dest);
 }
 
-SEC("xdp/cpumap")
-int cpumap_redirect(struct xdp_md *ctx)
+/* Both port numbers of a TCP or UDP header, sorted so that swapping source
+ * and destination gives the same value; 0 for other protocols.
+ */
+static __always_inline
+u32 get_sorted_ports(void *l4, void *data_end, u8 proto)
+{
+	struct udphdr *udph = l4;
+	u16 sport, dport;
+
+	if (proto != IPPROTO_TCP && proto != IPPROTO_UDP)
+		return 0;
+	if (udph + 1 > data_end)
+		return 0;
+
+	sport = bpf_ntohs(udph->source);
+	dport = bpf_ntohs(udph->dest);
+	if (sport > dport)
+		return ((u32)dport << 16) | sport;
+	return ((u32)sport << 16) | dport;
+}
+
+static __always_inline
+u32 get_ipv4_hash_5tuple(struct xdp_md *ctx, u64 nh_off)
 {
 	void *data_end = (void *)(long)ctx->data_end;
-	void *data = (void *)(long)ctx->data;
+	void *data     = (void *)(long)ctx->data;
+	struct iphdr *iph = data + nh_off;
+	u32 lo, hi, ports = 0;
+
+	if (iph + 1 > data_end)
+		return 0;
+
+	/* Keep all fragments of a datagram together by hashing them on the
+	 * addresses only, as only the first one carries the ports.
+	 */
+	if (!(iph->frag_off & bpf_htons(IP_MF | IP_OFFSET)))
+		ports = get_sorted_ports((void *)iph + iph->ihl * 4, data_end,
+					 iph->protocol);
+
+	lo = iph->saddr < iph->daddr ? iph->saddr : iph->daddr;
+	hi = iph->saddr < iph->daddr ? iph->daddr : iph->saddr;
+
+	return jhash_3words(lo, hi, ports, INITVAL + iph->protocol);
+}
+
+static __always_inline
+u32 get_ipv6_hash_5tuple(struct xdp_md *ctx, u64 nh_off)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data     = (void *)(long)ctx->data;
+	struct ipv6hdr *ip6h = data + nh_off;
+	u32 src, dst, ports;
+
+	if (ip6h + 1 > data_end)
+		return 0;
+
+	/* Extension headers are not followed, so such packets get ports 0 */
+	ports = get_sorted_ports(ip6h + 1, data_end, ip6h->nexthdr);
+
+	src = jhash2(ip6h->saddr.in6_u.u6_addr32, 4, INITVAL);
+	dst = jhash2(ip6h->daddr.in6_u.u6_addr32, 4, INITVAL);
+
+	return jhash_3words(src < dst ? src : dst, src < dst ? dst : src,
+			    ports, INITVAL + ip6h->nexthdr);
+}
+
+#define IPPROTO_GRE	47
+#define ETH_P_TEB	0x6558
+#define VXLAN_UDP_PORT	4789
+#define GENEVE_UDP_PORT	6081
+
+#define GRE_CSUM	0x8000
+#define GRE_ROUTING	0x4000
+#define GRE_KEY		0x2000
+#define GRE_SEQ		0x1000
+#define GRE_VERSION	0x0007
+
+/* Step into a VXLAN, Geneve or GRE tunnel: if the IP packet at l3_offset
+ * carries one, update eth_proto and l3_offset to the inner IP packet. Only
+ * one level of encapsulation is looked into, and only the outer IPv6 header
+ * itself (not its extension headers).
+ */
+static __always_inline
+bool parse_tunnel(struct xdp_md *ctx, u16 *eth_proto, u64 *l3_offset)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data     = (void *)(long)ctx->data;
+	u64 off = *l3_offset, inner_off;
+	u16 inner_proto;
+	__be16 proto;
+	u8 l4_proto;
+
+	if (*eth_proto == ETH_P_IP) {
+		struct iphdr *iph = data + off;
+
+		if (iph + 1 > data_end)
+			return false;
+		/* Only the first fragment has the tunnel header */
+		if (iph->frag_off & bpf_htons(IP_MF | IP_OFFSET))
+			return false;
+		l4_proto = iph->protocol;
+		off += iph->ihl * 4;
+	} else if (*eth_proto == ETH_P_IPV6) {
+		struct ipv6hdr *ip6h = data + off;
+
+		if (ip6h + 1 > data_end)
+			return false;
+		l4_proto = ip6h->nexthdr;
+		off += sizeof(*ip6h);
+	} else {
+		return false;
+	}
+
+	if (l4_proto == IPPROTO_UDP) {
+		struct udphdr *udph = data + off;
+		u8 *hdr;
+
+		if (udph + 1 > data_end)
+			return false;
+		off += sizeof(*udph);
+		hdr = data + off;
+
+		if (udph->dest == bpf_htons(VXLAN_UDP_PORT)) {
+			off += 8;
+			proto = bpf_htons(ETH_P_TEB);
+		} else if (udph->dest == bpf_htons(GENEVE_UDP_PORT)) {
+			/* Version in the top two bits, then the length of the
+			 * options in multiples of 4 bytes
+			 */
+			if (hdr + 8 > data_end || hdr[0] >> 6)
+				return false;
+			off += 8 + (hdr[0] & 0x3f) * 4;
+			proto = *(__be16 *)(hdr + 2);
+		} else {
+			return false;
+		}
+	} else if (l4_proto == IPPROTO_GRE) {
+		__be16 *greh = data + off;
+		u16 flags;
+
+		if (greh + 2 > data_end)
+			return false;
+		flags = bpf_ntohs(greh[0]);
+		if (flags & (GRE_VERSION | GRE_ROUTING))
+			return false;
+		proto = greh[1];
+		off += 4;
+		if (flags & GRE_CSUM)
+			off += 4;
+		if (flags & GRE_KEY)
+			off += 4;
+		if (flags & GRE_SEQ)
+			off += 4;
+	} else {
+		return false;
+	}
+
+	if (proto == bpf_htons(ETH_P_TEB)) {
+		if (!parse_eth(data + off, data_end, &inner_proto, &inner_off))
+			return false;
+		off += inner_off;
+	} else if (proto == bpf_htons(ETH_P_IP) ||
+		   proto == bpf_htons(ETH_P_IPV6)) {
+		inner_proto = bpf_ntohs(proto);
+	} else {
+		return false;
+	}
+
+	*eth_proto = inner_proto;
+	*l3_offset = off;
+	return true;
+}
+
+/* Load-Balance traffic based on a jhash of the IP-addrs, L4-ports and
+ * L4-proto. Addresses and ports are sorted before hashing, so the scheme
+ * is symmetric like cpumap_l4_hash, but different flows between the same
+ * two hosts can go to different CPUs.
+ */
+SEC("xdp")
+int  cpumap_l4_sym_hash(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data     = (void *)(long)ctx->data;
+	u32 key = bpf_get_smp_processor_id();
 	struct ethhdr *eth = data;
+	struct datarec *rec;
+	u16 eth_proto = 0;
+	u64 l3_offset = 0;
+	u32 cpu_dest = 0;
+	u32 cpu_idx = 0;
+	u32 *cpu_lookup;
+	u32 key0 = 0;
+	u32 *cpu_max;
+	u32 cpu_hash;
+
+	rec = bpf_map_lookup_elem(&rx_cnt, &key);
+	if (!rec)
+		return XDP_PASS;
+	NO_TEAR_INC(rec->processed);
+
+	cpu_max = bpf_map_lookup_elem(&cpus_count, &key0);
+	if (!cpu_max)
+		return XDP_ABORTED;
+
+	if (!(parse_eth(eth, data_end, &eth_proto, &l3_offset)))
+		return XDP_PASS; /* Just skip */
+
+	switch (eth_proto) {
+	case ETH_P_IP:
+		cpu_hash = get_ipv4_hash_5tuple(ctx, l3_offset);
+		break;
+	case ETH_P_IPV6:
+		cpu_hash = get_ipv6_hash_5tuple(ctx, l3_offset);
+		break;
+	case ETH_P_ARP: /* ARP packet handled on CPU idx 0 */
+	default:
+		cpu_hash = 0;
+	}
+
+	/* Choose CPU based on hash */
+	cpu_idx = cpu_hash % *cpu_max;
+
+	cpu_lookup = bpf_map_lookup_elem(&cpus_available, &cpu_idx);
+	if (!cpu_lookup)
+		return XDP_ABORTED;
+	cpu_dest = *cpu_lookup;
+
+	if (cpu_dest >= nr_cpus) {
+		NO_TEAR_INC(rec->issue);
+		return XDP_ABORTED;
+	}
+	return redirect_cpu(ctx, cpu_dest);
+}
+
+/* Load-Balance traffic like cpumap_l4_sym_hash, but hash encapsulated packets
+ * on the headers inside the tunnel, so the flows of an overlay network don't
+ * all land on one CPU because they share the tunnel endpoints.
+ */
+SEC("xdp")
+int  cpumap_l4_tunnel_hash(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data     = (void *)(long)ctx->data;
+	u32 key = bpf_get_smp_processor_id();
+	struct ethhdr *eth = data;
+	struct datarec *rec;
+	u16 eth_proto = 0;
+	u64 l3_offset = 0;
+	u32 cpu_dest = 0;
+	u32 cpu_idx = 0;
+	u32 *cpu_lookup;
+	u32 key0 = 0;
+	u32 *cpu_max;
+	u32 cpu_hash;
+
+	rec = bpf_map_lookup_elem(&rx_cnt, &key);
+	if (!rec)
+		return XDP_PASS;
+	NO_TEAR_INC(rec->processed);
+
+	cpu_max = bpf_map_lookup_elem(&cpus_count, &key0);
+	if (!cpu_max)
+		return XDP_ABORTED;
+
+	if (!(parse_eth(eth, data_end, &eth_proto, &l3_offset)))
+		return XDP_PASS; /* Just skip */
+
+	/* Packets outside tunnels are hashed on their own headers */
+	parse_tunnel(ctx, &eth_proto, &l3_offset);
+
+	switch (eth_proto) {
+	case ETH_P_IP:
+		cpu_hash = get_ipv4_hash_5tuple(ctx, l3_offset);
+		break;
+	case ETH_P_IPV6:
+		cpu_hash = get_ipv6_hash_5tuple(ctx, l3_offset);
+		break;
+	case ETH_P_ARP: /* ARP packet handled on CPU idx 0 */
+	default:
+		cpu_hash = 0;
+	}
+
+	/* Choose CPU based on hash */
+	cpu_idx = cpu_hash % *cpu_max;
+
+	cpu_lookup = bpf_map_lookup_elem(&cpus_available, &cpu_idx);
+	if (!cpu_lookup)
+		return XDP_ABORTED;
+	cpu_dest = *cpu_lookup;
+
+	if (cpu_dest >= nr_cpus) {
+		NO_TEAR_INC(rec->issue);
+		return XDP_ABORTED;
+	}
+	return redirect_cpu(ctx, cpu_dest);
+}
+
+SEC("tp_btf/xdp_cpumap_enqueue")
+int BPF_PROG(tp_cpumap_backlog, int map_id, unsigned int processed,
+	     unsigned int drops, int to_cpu)
+{
+	u32 cpu = to_cpu;
+	u64 *cnt;
+
+	if (cpumap_map_id && cpumap_map_id != map_id)
+		return 0;
+
+	cnt = bpf_map_lookup_elem(&cpu_enqueued, &cpu);
+	if (cnt)
+		__sync_fetch_and_add(cnt, processed - drops);
+	return 0;
+}
+
+/* Frames sitting in the cpumap queue of a CPU: enqueued by all source CPUs
+ * minus dequeued by the kthread of that CPU. The two counters are updated
+ * independently, so the difference can briefly go negative.
+ */
+static __always_inline
+u64 get_cpu_backlog(u32 cpu_idx)
+{
+	struct datarec *rec;
+	u32 *cpu_lookup;
+	u64 *enqueued;
+	s64 backlog;
+	u32 cpu;
+
+	cpu_lookup = bpf_map_lookup_elem(&cpus_available, &cpu_idx);
+	if (!cpu_lookup)
+		return 0;
+	cpu = *cpu_lookup;
+
+	enqueued = bpf_map_lookup_elem(&cpu_enqueued, &cpu);
+	rec = bpf_map_lookup_elem(&cpumap_kthread_cnt, &cpu);
+	if (!enqueued || !rec)
+		return 0;
+
+	backlog = READ_ONCE(*enqueued) - READ_ONCE(rec->processed);
+	return backlog > 0 ? backlog : 0;
+}
+
+/* Load-Balance traffic like cpumap_l4_sym_hash, but pick the less loaded of
+ * two hash-selected CPUs for each new flow, and remember the choice in an
+ * LRU table. A flow only moves to another CPU when the queue of its current
+ * one fills past cpu_backlog_high, which may reorder a few of its packets.
+ */
+SEC("xdp")
+int  cpumap_load_balance(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data     = (void *)(long)ctx->data;
+	u32 key = bpf_get_smp_processor_id();
+	struct ethhdr *eth = data;
+	u32 cpu_idx, alt_idx;
+	struct datarec *rec;
+	u16 eth_proto = 0;
+	u64 l3_offset = 0;
+	u32 cpu_dest = 0;
+	u32 *cpu_lookup;
+	u32 *flow_idx;
+	u32 key0 = 0;
+	u32 *cpu_max;
+	u32 cpu_hash;
+
+	rec = bpf_map_lookup_elem(&rx_cnt, &key);
+	if (!rec)
+		return XDP_PASS;
+	NO_TEAR_INC(rec->processed);
+
+	cpu_max = bpf_map_lookup_elem(&cpus_count, &key0);
+	if (!cpu_max || !*cpu_max)
+		return XDP_ABORTED;
+
+	if (!(parse_eth(eth, data_end, &eth_proto, &l3_offset)))
+		return XDP_PASS; /* Just skip */
+
+	switch (eth_proto) {
+	case ETH_P_IP:
+		cpu_hash = get_ipv4_hash_5tuple(ctx, l3_offset);
+		break;
+	case ETH_P_IPV6:
+		cpu_hash = get_ipv6_hash_5tuple(ctx, l3_offset);
+		break;
+	case ETH_P_ARP: /* ARP packet handled on CPU idx 0 */
+	default:
+		cpu_hash = 0;
+	}
+
+	flow_idx = bpf_map_lookup_elem(&flow_cpu, &cpu_hash);
+	if (flow_idx && *flow_idx < *cpu_max) {
+		cpu_idx = *flow_idx;
+		if (get_cpu_backlog(cpu_idx) < cpu_backlog_high)
+			goto redirect;
+	}
+
+	/* Two choices from independent hashes of the same flow, so a busy
+	 * CPU only sees the flows that have no better alternative.
+	 */
+	cpu_idx = cpu_hash % *cpu_max;
+	alt_idx = jhash_1word(cpu_hash, INITVAL) % *cpu_max;
+	if (alt_idx != cpu_idx &&
+	    get_cpu_backlog(alt_idx) < get_cpu_backlog(cpu_idx))
+		cpu_idx = alt_idx;
+
+	if (!flow_idx || *flow_idx != cpu_idx)
+		bpf_map_update_elem(&flow_cpu, &cpu_hash, &cpu_idx, BPF_ANY);
+
+redirect:
+	cpu_lookup = bpf_map_lookup_elem(&cpus_available, &cpu_idx);
+	if (!cpu_lookup)
+		return XDP_ABORTED;
+	cpu_dest = *cpu_lookup;
+
+	if (cpu_dest >= nr_cpus) {
+		NO_TEAR_INC(rec->issue);
+		return XDP_ABORTED;
+	}
+	return redirect_cpu(ctx, cpu_dest);
+}
+
+SEC("xdp/cpumap")
+int cpumap_redirect(struct xdp_md *ctx)
+{
+	void *data_end, *data;
+	struct ethhdr *eth;
 	u64 nh_off;
 
+	/* Removing the stamp invalidates packet pointers, so load them after */
+	if (queue_delay)
+		queue_delay_record(ctx, &queue_delay_hist);
+
+	data_end = (void *)(long)ctx->data_end;
+	data = (void *)(long)ctx->data;
+	eth = data;
+
 	nh_off = sizeof(*eth);
 	if (data + nh_off > data_end)
 		return XDP_DROP;
@@ -509,12 +976,16 @@ int cpumap_redirect(struct xdp_md *ctx)
 SEC("xdp/cpumap")
 int cpumap_pass(struct xdp_md *ctx)
 {
+	if (queue_delay)
+		queue_delay_record(ctx, &queue_delay_hist);
 	return XDP_PASS;
 }
 
 SEC("xdp/cpumap")
 int cpumap_drop(struct xdp_md *ctx)
 {
+	if (queue_delay)
+		queue_delay_record(ctx, &queue_delay_hist);
 	return XDP_DROP;
 }
 
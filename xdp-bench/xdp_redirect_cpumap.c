@@ -8,6 +8,7 @@
 #include <getopt.h>
 #include <locale.h>
 #include <net/if.h>
+#include <dirent.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,6 +24,7 @@
 #include <xdp/libxdp.h>
 
 #include "logging.h"
+#include "util.h"
 
 #include "xdp-bench.h"
 #include "xdp_sample.h"
@@ -50,6 +52,9 @@ static const char *cpumap_prog_names[] = {
 	"cpumap_l4_proto",
 	"cpumap_l4_filter",
 	"cpumap_l4_hash",
+	"cpumap_l4_sym_hash",
+	"cpumap_load_balance",
+	"cpumap_l4_tunnel_hash",
 };
 
 DEFINE_SAMPLE_INIT(xdp_redirect_cpumap);
@@ -104,6 +109,201 @@ static int create_cpu_entry(__u32 cpu, struct bpf_cpumap_val *value,
 	return 0;
 }
 
+/* NUMA node of a network device, or -1 if it has none (like virtual devices) */
+static int iface_numa_node(const char *ifname)
+{
+	char path[PATH_MAX];
+	int node = -1;
+	FILE *f;
+
+	if (try_snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+			 ifname))
+		return -1;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+
+	return node;
+}
+
+static int cpu_numa_node(__u32 cpu)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	int node = -1;
+	DIR *dir;
+
+	if (try_snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu))
+		return -1;
+
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while ((ent = readdir(dir))) {
+		if (!strncmp(ent->d_name, "node", 4) &&
+		    ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+			node = atoi(ent->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+
+	return node;
+}
+
+/* Set cpus[i] for each CPU in a list like "0-3,8,10-11" read from path */
+static int read_cpu_list(const char *path, bool *cpus, int n_cpus)
+{
+	unsigned int first, last;
+	char buf[4096], *p;
+	int i, ret = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	if (!fgets(buf, sizeof(buf), f))
+		ret = -EINVAL;
+	fclose(f);
+	if (ret)
+		return ret;
+
+	for (p = strtok(buf, ",\n"); p; p = strtok(NULL, ",\n")) {
+		switch (sscanf(p, "%u-%u", &first, &last)) {
+		case 1:
+			last = first;
+			break;
+		case 2:
+			break;
+		default:
+			return -EINVAL;
+		}
+		for (i = first; i <= (int)last && i < n_cpus; i++)
+			cpus[i] = true;
+	}
+	return 0;
+}
+
+/* Mark the CPUs that service the MSI interrupts of ifname */
+static void get_irq_cpus(const char *ifname, bool *cpus, int n_cpus)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	DIR *irqs;
+
+	if (try_snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs",
+			 ifname))
+		return;
+
+	irqs = opendir(path);
+	if (!irqs)
+		return;
+
+	while ((ent = readdir(irqs))) {
+		int irq = atoi(ent->d_name);
+
+		if (irq <= 0)
+			continue;
+
+		if (!try_snprintf(path, sizeof(path),
+				  "/proc/irq/%d/effective_affinity_list", irq) &&
+		    !read_cpu_list(path, cpus, n_cpus))
+			continue;
+		if (!try_snprintf(path, sizeof(path),
+				  "/proc/irq/%d/smp_affinity_list", irq))
+			read_cpu_list(path, cpus, n_cpus);
+	}
+	closedir(irqs);
+}
+
+/* Pick the online CPUs on the NUMA node of the device that don't service any
+ * of its interrupts, so the remote CPUs share the caches of the receiving
+ * ones without competing with them. If every CPU of the node handles
+ * interrupts, all of the node is used.
+ */
+static int select_numa_cpus(const char *ifname, struct u32_multi *cpus)
+{
+	int n_cpus = libbpf_num_possible_cpus();
+	bool *online, *irq, skip_irq = true;
+	int node, i, ret = 0;
+	__u32 *vals;
+	size_t num;
+
+	online = calloc(n_cpus, sizeof(*online));
+	irq = calloc(n_cpus, sizeof(*irq));
+	vals = calloc(n_cpus, sizeof(*vals));
+	if (!online || !irq || !vals) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (read_cpu_list("/sys/devices/system/cpu/online", online, n_cpus))
+		for (i = 0; i < n_cpus; i++)
+			online[i] = true;
+
+	node = iface_numa_node(ifname);
+	if (node < 0)
+		pr_info("%s has no NUMA node, picking from all CPUs\n", ifname);
+
+	get_irq_cpus(ifname, irq, n_cpus);
+
+retry:
+	for (i = 0, num = 0; i < n_cpus; i++) {
+		if (!online[i] || (skip_irq && irq[i]))
+			continue;
+		if (node >= 0 && cpu_numa_node(i) != node)
+			continue;
+		vals[num++] = i;
+	}
+
+	if (!num && skip_irq) {
+		skip_irq = false;
+		goto retry;
+	}
+	if (!num) {
+		pr_warn("Found no CPUs on NUMA node %d of %s\n", node, ifname);
+		ret = -ENOENT;
+		goto out;
+	}
+	if (!skip_irq)
+		pr_warn("All CPUs on NUMA node %d service interrupts of %s, using them anyway\n",
+			node, ifname);
+
+	cpus->vals = vals;
+	cpus->num_vals = num;
+	vals = NULL;
+
+out:
+	free(vals);
+	free(irq);
+	free(online);
+	return ret;
+}
+
+/* Redirecting to a CPU on another node moves every frame across the
+ * interconnect, so point out target CPUs that cost throughput.
+ */
+static void check_numa_cpus(const char *ifname, const struct u32_multi *cpus)
+{
+	int node = iface_numa_node(ifname), cpu_node;
+	size_t i;
+
+	if (node < 0)
+		return;
+
+	for (i = 0; i < cpus->num_vals; i++) {
+		cpu_node = cpu_numa_node(cpus->vals[i]);
+		if (cpu_node >= 0 && cpu_node != node)
+			pr_warn("CPU %u is on NUMA node %d, but %s is on node %d\n",
+				cpus->vals[i], cpu_node, ifname, node);
+	}
+}
+
 /* CPUs are zero-indexed. Thus, add a special sentinel default value
  * in map cpus_available to mark CPU index'es not configured
  */
@@ -142,6 +342,109 @@ static void stress_cpumap(void *ctx)
 	create_cpu_entry(1, value, 0, false);
 }
 
+/* Queue sizes tried by --sweep when no --sweep-qsize is given */
+static const __u32 sweep_qsizes[] = { 256, 512, 1024, 2048, 4096, 8192 };
+
+/* Point the first num_cpus indexes at the --cpu values with the queue size
+ * in value, and make the programs select between only those.
+ */
+static int set_cpu_entries(const struct cpumap_opts *opt,
+			   struct bpf_cpumap_val *value, __u32 num_cpus)
+{
+	__u32 key = 0;
+	__u32 i;
+	int ret;
+
+	for (i = 0; i < num_cpus; i++) {
+		ret = create_cpu_entry(opt->cpus.vals[i], value, i, false);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = bpf_map_update_elem(count_fd, &key, &num_cpus, 0);
+	if (ret < 0) {
+		pr_warn("Failed write curr cpus_count: %s\n", strerror(errno));
+		return ret;
+	}
+	return 0;
+}
+
+/* Rates within 1% of each other count as equal, so noise does not decide */
+static bool sweep_better(const struct sample_cpumap_rates *r,
+			 const struct sample_cpumap_rates *best)
+{
+	if (r->processed * 100 > best->processed * 101)
+		return true;
+	if (r->processed * 100 < best->processed * 99)
+		return false;
+	return r->drop < best->drop;
+}
+
+/* Step through the first 1..N of the --cpu values, and for each of those CPU
+ * sets through the queue sizes, measuring one interval per step. Earlier
+ * steps win ties, so the best setting uses as few CPUs and as small a queue
+ * as the results allow.
+ */
+static int sweep_cpumap(struct xdp_redirect_cpumap *skel,
+			const struct cpumap_opts *opt,
+			struct bpf_cpumap_val *value)
+{
+	const __u32 *qsizes = sweep_qsizes;
+	size_t num_qsizes = sizeof(sweep_qsizes) / sizeof(*sweep_qsizes);
+	struct sample_cpumap_rates rates = {}, best = {};
+	__u32 best_cpus = 0, best_qsize = 0, n;
+	int ret = 0;
+	size_t i;
+
+	if (opt->sweep_qsize.num_vals) {
+		qsizes = opt->sweep_qsize.vals;
+		num_qsizes = opt->sweep_qsize.num_vals;
+	}
+
+	printf("%-6s %-8s %14s %14s %14s %14s\n", "cpus", "qsize", "rx/s",
+	       "processed/s", "drop/s", "sched/s");
+
+	for (n = 1; n <= opt->cpus.num_vals; n++) {
+		for (i = 0; i < num_qsizes; i++) {
+			value->qsize = qsizes[i];
+			skel->data->cpu_backlog_high = qsizes[i] / 2;
+			ret = set_cpu_entries(opt, value, n);
+			if (ret < 0)
+				return ret;
+
+			ret = sample_measure_cpumap(opt->interval, &rates);
+			if (ret)
+				goto out;
+
+			printf("%-6u %-8u %14llu %14llu %14llu %14llu\n", n,
+			       qsizes[i], rates.rx, rates.processed, rates.drop,
+			       rates.sched);
+
+			if (!best_cpus || sweep_better(&rates, &best)) {
+				best = rates;
+				best_cpus = n;
+				best_qsize = qsizes[i];
+			}
+		}
+	}
+
+out:
+	if (ret < 0)
+		return ret;
+
+	if (!best_cpus) {
+		printf("Sweep stopped before the first measurement\n");
+		return 0;
+	}
+
+	printf("Best setting:");
+	for (n = 0; n < best_cpus; n++)
+		printf(" -c %u", opt->cpus.vals[n]);
+	printf(" -q %u (%llu processed/s, %llu drop/s)\n", best_qsize,
+	       best.processed, best.drop);
+	return 0;
+}
+
 static int set_cpumap_prog(struct xdp_redirect_cpumap *skel,
 			   enum cpumap_remote_action action,
 			   const struct iface *redir_iface)
@@ -188,6 +491,8 @@ int do_redirect_cpumap(const void *cfg, __unused const char *pin_root_path)
 	const struct cpumap_opts *opt = cfg;
 
 	DECLARE_LIBBPF_OPTS(xdp_program_opts, opts);
+	struct u32_multi numa_cpus = {};
+	struct cpumap_opts numa_opt;
 	struct xdp_program *xdp_prog = NULL;
 	struct xdp_redirect_cpumap *skel;
 	struct bpf_program *prog = NULL;
@@ -195,15 +500,49 @@ int do_redirect_cpumap(const void *cfg, __unused const char *pin_root_path)
 	struct bpf_cpumap_val value;
 	__u32 infosz = sizeof(info);
 	int ret = EXIT_FAIL_OPTION;
+	int gro_orig = -1;
 	int n_cpus, fd;
 	size_t i;
 
+	if (opt->queue_delay && opt->remote_action == ACTION_DISABLED) {
+		pr_warn("Measuring the queue delay needs a cpumap program (--remote-action)\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	if (opt->gro && (opt->remote_action == ACTION_DROP ||
+			 opt->remote_action == ACTION_REDIRECT)) {
+		pr_warn("GRO only applies to packets passed to the stack (--remote-action disabled or pass)\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	if (opt->numa_cpus == !!opt->cpus.num_vals) {
+		pr_warn("Specify either --cpu or --numa-cpus\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	if (opt->numa_cpus) {
+		ret = select_numa_cpus(opt->iface_in.ifname, &numa_cpus);
+		if (ret < 0)
+			return EXIT_FAIL;
+
+		numa_opt = *opt;
+		numa_opt.cpus = numa_cpus;
+		opt = &numa_opt;
+		ret = EXIT_FAIL_OPTION;
+	} else {
+		check_numa_cpus(opt->iface_in.ifname, &opt->cpus);
+	}
+
 	if (opt->extended)
 		sample_switch_mode();
+	sample_set_output_format(opt->format);
 
 	if (opt->stats)
 		mask |= SAMPLE_REDIRECT_MAP_CNT;
 
+	if (opt->gro)
+		mask |= SAMPLE_CPUMAP_GRO_CNT;
+
 	if (opt->redir_iface.ifindex)
 		mask |= SAMPLE_DEVMAP_XMIT_CNT_MULTI;
 
@@ -250,6 +589,10 @@ int do_redirect_cpumap(const void *cfg, __unused const char *pin_root_path)
 		goto end_destroy;
 	}
 
+	/* The backlog counter is only needed by the load-balance program */
+	if (opt->program_mode != CPUMAP_CPU_LOAD_BALANCE)
+		bpf_program__set_autoload(skel->progs.tp_cpumap_backlog, false);
+
 	ret = sample_init_pre_load(skel, opt->iface_in.ifname);
 	if (ret < 0) {
 		pr_warn("Failed to sample_init_pre_load: %s\n", strerror(-ret));
@@ -271,8 +614,18 @@ int do_redirect_cpumap(const void *cfg, __unused const char *pin_root_path)
 		goto end_destroy;
 	}
 
+	if (bpf_map__set_max_entries(skel->maps.cpu_enqueued, n_cpus) < 0) {
+		pr_warn("Failed to set max entries for cpu_enqueued map: %s",
+			strerror(errno));
+		ret = EXIT_FAIL_BPF;
+		goto end_destroy;
+	}
+
 	ret = EXIT_FAIL_OPTION;
 
+	/* Move flows off a CPU once its queue is half full */
+	skel->data->cpu_backlog_high = opt->qsize / 2;
+	skel->rodata->queue_delay = opt->queue_delay;
 	skel->rodata->from_match[0] = opt->iface_in.ifindex;
 	if (opt->redir_iface.ifindex)
 		skel->rodata->to_match[0] = opt->redir_iface.ifindex;
@@ -320,6 +673,70 @@ int do_redirect_cpumap(const void *cfg, __unused const char *pin_root_path)
 		goto end_detach;
 	}
 
+	if (opt->latency) {
+		ret = latency_attach(xdp_prog);
+		if (ret < 0) {
+			ret = EXIT_FAIL_BPF;
+			goto end_detach;
+		}
+	}
+
+	if (opt->queue_delay) {
+		ret = latency_hist_add("queue delay", "queue_delay",
+				       skel->maps.queue_delay_hist);
+		if (ret < 0) {
+			pr_warn("Failed to set up queue delay histogram: %s\n",
+				strerror(-ret));
+			ret = EXIT_FAIL;
+			goto end_detach;
+		}
+	}
+
+	if (opt->perf_counters) {
+		ret = perf_counters_open();
+		if (ret < 0) {
+			ret = EXIT_FAIL;
+			goto end_detach;
+		}
+	}
+
+	/* Attach before any CPU entry exists, so no frame can be counted as
+	 * dequeued by the kthread without having been counted as enqueued.
+	 */
+	if (opt->program_mode == CPUMAP_CPU_LOAD_BALANCE) {
+		skel->links.tp_cpumap_backlog =
+			bpf_program__attach(skel->progs.tp_cpumap_backlog);
+		if (!skel->links.tp_cpumap_backlog) {
+			pr_warn("Failed to attach backlog tracepoint: %s\n",
+				strerror(errno));
+			ret = EXIT_FAIL_BPF;
+			goto end_detach;
+		}
+	}
+
+	/* The kthreads only merge skbs when GRO is enabled on the device the
+	 * frames were received on, so this toggles it for the cpumap too.
+	 */
+	if (opt->gro == CPUMAP_GRO_ON || opt->gro == CPUMAP_GRO_OFF) {
+		gro_orig = get_gro(opt->iface_in.ifindex);
+		if (gro_orig < 0) {
+			pr_warn("Couldn't get GRO state of %s: %s\n",
+				opt->iface_in.ifname, strerror(-gro_orig));
+			ret = EXIT_FAIL;
+			goto end_detach;
+		}
+
+		ret = set_gro(opt->iface_in.ifindex, opt->gro == CPUMAP_GRO_ON);
+		if (ret < 0) {
+			pr_warn("Couldn't turn GRO %s on %s: %s\n",
+				opt->gro == CPUMAP_GRO_ON ? "on" : "off",
+				opt->iface_in.ifname, strerror(-ret));
+			gro_orig = -1;
+			ret = EXIT_FAIL;
+			goto end_detach;
+		}
+	}
+
 	fd = set_cpumap_prog(skel, opt->remote_action, &opt->redir_iface);
 	if (fd < 0) {
 		ret = EXIT_FAIL_BPF;
@@ -336,7 +753,11 @@ int do_redirect_cpumap(const void *cfg, __unused const char *pin_root_path)
 		}
 	}
 
-	ret = sample_run(opt->interval, opt->stress_mode ? stress_cpumap : NULL, &value);
+	if (opt->sweep)
+		ret = sweep_cpumap(skel, opt, &value);
+	else
+		ret = sample_run(opt->interval_ms ?: opt->interval * 1000,
+				 opt->stress_mode ? stress_cpumap : NULL, &value);
 	if (ret < 0) {
 		pr_warn("Failed during sample run: %s\n", strerror(-ret));
 		ret = EXIT_FAIL;
@@ -344,11 +765,16 @@ int do_redirect_cpumap(const void *cfg, __unused const char *pin_root_path)
 	}
 	ret = EXIT_OK;
 end_detach:
+	if (gro_orig >= 0)
+		set_gro(opt->iface_in.ifindex, gro_orig);
 	xdp_program__detach(xdp_prog, opt->iface_in.ifindex, opt->mode, 0);
 end_destroy:
 	xdp_program__close(xdp_prog);
 	xdp_redirect_cpumap__destroy(skel);
 end:
+	perf_counters_close();
+	latency_detach();
 	sample_teardown();
+	free(numa_cpus.vals);
 	return ret;
 }
@@ -13,6 +13,7 @@
 #include <xdp/xdp_sample_shared.h>
 #include <xdp/xdp_sample.bpf.h>
 #include <xdp/xdp_sample_common.bpf.h>
+#include "latency_hist.bpf.h"
 
 /* The 2nd xdp prog on egress does not support skb mode, so we define two
  * maps, tx_port_general and tx_port_native.
@@ -34,6 +35,12 @@ struct {
 /* store egress interface mac address */
 const volatile char tx_mac_addr[ETH_ALEN];
 
+/* Stamp redirected packets so the egress program can measure how long they
+ * waited in the devmap bulk queue.
+ */
+const volatile bool queue_delay = false;
+latency_hist_map queue_delay_hist SEC(".maps");
+
 static __always_inline int xdp_redirect_devmap(struct xdp_md *ctx, void *redirect_map)
 {
 	void *data_end = (void *)(long)ctx->data_end;
@@ -52,6 +59,8 @@ static __always_inline int xdp_redirect_devmap(struct xdp_md *ctx, void *redirec
 		return XDP_PASS;
 	NO_TEAR_INC(rec->processed);
 	swap_src_dst_mac(data);
+	if (queue_delay)
+		queue_stamp(ctx);
 	return bpf_redirect_map(redirect_map, 0, 0);
 }
 
@@ -70,11 +79,18 @@ int redir_devmap_native(struct xdp_md *ctx)
 SEC("xdp/devmap")
 int xdp_redirect_devmap_egress(struct xdp_md *ctx)
 {
-	void *data_end = (void *)(long)ctx->data_end;
-	void *data = (void *)(long)ctx->data;
-	struct ethhdr *eth = data;
+	void *data_end, *data;
+	struct ethhdr *eth;
 	u64 nh_off;
 
+	/* Removing the stamp invalidates packet pointers, so load them after */
+	if (queue_delay)
+		queue_delay_record(ctx, &queue_delay_hist);
+
+	data_end = (void *)(long)ctx->data_end;
+	data = (void *)(long)ctx->data;
+	eth = data;
+
 	nh_off = sizeof(*eth);
 	if (data + nh_off > data_end)
 		return XDP_DROP;
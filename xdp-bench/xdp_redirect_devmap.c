@@ -48,8 +48,14 @@ int do_redirect_devmap(const void *cfg, __unused const char *pin_root_path)
 	bool tried = false;
 	int key = 0;
 
+	if (opt->queue_delay && !opt->load_egress) {
+		pr_warn("Measuring the queue delay needs the egress program (--load-egress)\n");
+		return EXIT_FAIL_OPTION;
+	}
+
 	if (opt->extended)
 		sample_switch_mode();
+	sample_set_output_format(opt->format);
 
 	if (opt->mode == XDP_MODE_SKB)
 		/* devmap_xmit tracepoint not available */
@@ -109,6 +115,7 @@ restart:
 		}
 	}
 
+	skel->rodata->queue_delay = opt->queue_delay;
 	skel->rodata->from_match[0] = opt->iface_in.ifindex;
 	skel->rodata->to_match[0] = opt->iface_out.ifindex;
 
@@ -151,6 +158,33 @@ restart:
 		goto end_detach;
 	}
 
+	if (opt->latency) {
+		ret = latency_attach(xdp_prog);
+		if (ret < 0) {
+			ret = EXIT_FAIL_BPF;
+			goto end_detach;
+		}
+	}
+
+	if (opt->queue_delay) {
+		ret = latency_hist_add("queue delay", "queue_delay",
+				       skel->maps.queue_delay_hist);
+		if (ret < 0) {
+			pr_warn("Failed to set up queue delay histogram: %s\n",
+				strerror(-ret));
+			ret = EXIT_FAIL;
+			goto end_detach;
+		}
+	}
+
+	if (opt->perf_counters) {
+		ret = perf_counters_open();
+		if (ret < 0) {
+			ret = EXIT_FAIL;
+			goto end_detach;
+		}
+	}
+
 	opts.obj = NULL;
 	opts.prog_name = "xdp_pass";
 	opts.find_filename = "xdp-dispatcher.o";
@@ -186,7 +220,7 @@ restart:
 		opt->iface_in.ifname, opt->iface_in.ifindex, str,
 		opt->iface_out.ifname, opt->iface_out.ifindex, get_driver_name(opt->iface_out.ifindex));
 
-	ret = sample_run(opt->interval, NULL, NULL);
+	ret = sample_run(opt->interval_ms ?: opt->interval * 1000, NULL, NULL);
 	if (ret < 0) {
 		pr_warn("Failed during sample run: %s\n", strerror(-ret));
 		ret = EXIT_FAIL;
@@ -202,6 +236,8 @@ end_destroy:
 	xdp_program__close(dummy_prog);
 	xdp_redirect_devmap__destroy(skel);
 end:
+	perf_counters_close();
+	latency_detach();
 	sample_teardown();
 	return ret;
 }
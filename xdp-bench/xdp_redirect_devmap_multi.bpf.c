@@ -4,6 +4,13 @@
 #include <xdp/xdp_sample.bpf.h>
 #include <xdp/xdp_sample_common.bpf.h>
 
+#include "xdp_redirect_devmap_multi.h"
+
+const volatile bool exclude_ingress = true;
+const volatile bool egress_stats = false;
+const volatile bool group_filter = false;
+const volatile bool vlan_groups = false;
+
 struct {
 	__uint(type, BPF_MAP_TYPE_DEVMAP_HASH);
 	__uint(key_size, sizeof(int));
@@ -26,6 +33,49 @@ struct {
 	__uint(max_entries, 32);
 } mac_map SEC(".maps");
 
+/* Flood group of each interface: the egress program only lets a frame out
+ * of ports in the group of its ingress port, or of its VLAN ID.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u32);
+	__type(value, u32);
+	__uint(max_entries, 32);
+} port_group SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__type(key, u32);
+	__type(value, struct egress_rec);
+	__uint(max_entries, 32);
+} egress_cnt SEC(".maps");
+
+/* Time of the last redirect or flush on this CPU */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, u64);
+	__uint(max_entries, 1);
+} last_ns SEC(".maps");
+
+static __always_inline void stamp_now(void)
+{
+	u32 key = 0;
+	u64 *ts;
+
+	ts = bpf_map_lookup_elem(&last_ns, &key);
+	if (ts)
+		*ts = bpf_ktime_get_ns();
+}
+
+static __always_inline struct egress_rec *egress_rec_get(u32 ifindex)
+{
+	struct egress_rec empty = {};
+
+	bpf_map_update_elem(&egress_cnt, &ifindex, &empty, BPF_NOEXIST);
+	return bpf_map_lookup_elem(&egress_cnt, &ifindex);
+}
+
 static int xdp_redirect_devmap_multi(struct xdp_md *ctx, void *forward_map)
 {
 	u32 key = bpf_get_smp_processor_id();
@@ -36,8 +86,12 @@ static int xdp_redirect_devmap_multi(struct xdp_md *ctx, void *forward_map)
 		return XDP_PASS;
 	NO_TEAR_INC(rec->processed);
 
+	if (egress_stats)
+		stamp_now();
+
 	return bpf_redirect_map(forward_map, 0,
-				BPF_F_BROADCAST | BPF_F_EXCLUDE_INGRESS);
+				BPF_F_BROADCAST |
+				(exclude_ingress ? BPF_F_EXCLUDE_INGRESS : 0));
 }
 
 SEC("xdp")
@@ -52,6 +106,34 @@ int redir_multi_native(struct xdp_md *ctx)
 	return xdp_redirect_devmap_multi(ctx, &forward_map_native);
 }
 
+static __always_inline bool in_egress_group(struct xdp_md *ctx,
+					     struct ethhdr *eth, void *data_end)
+{
+	u32 out = ctx->egress_ifindex, in = ctx->ingress_ifindex;
+	u32 *group_out, *group_in, group = 0;
+	__be16 *tci;
+
+	group_out = bpf_map_lookup_elem(&port_group, &out);
+	if (!group_out)
+		return false;
+
+	if (vlan_groups) {
+		/* Untagged frames belong to group 0 */
+		tci = (void *)(eth + 1);
+		if ((eth->h_proto == bpf_htons(ETH_P_8021Q) ||
+		     eth->h_proto == bpf_htons(ETH_P_8021AD)) &&
+		    (void *)(tci + 1) <= data_end)
+			group = bpf_ntohs(*tci) & 0xfff;
+	} else {
+		group_in = bpf_map_lookup_elem(&port_group, &in);
+		if (!group_in)
+			return false;
+		group = *group_in;
+	}
+
+	return group == *group_out;
+}
+
 SEC("xdp/devmap")
 int xdp_devmap_prog(struct xdp_md *ctx)
 {
@@ -66,6 +148,16 @@ int xdp_devmap_prog(struct xdp_md *ctx)
 	if (data + nh_off > data_end)
 		return XDP_DROP;
 
+	if (group_filter && !in_egress_group(ctx, eth, data_end)) {
+		if (egress_stats) {
+			struct egress_rec *rec = egress_rec_get(key);
+
+			if (rec)
+				rec->filtered++;
+		}
+		return XDP_DROP;
+	}
+
 	mac = bpf_map_lookup_elem(&mac_map, &key);
 	if (mac)
 		__builtin_memcpy(eth->h_source, mac, ETH_ALEN);
@@ -73,4 +165,41 @@ int xdp_devmap_prog(struct xdp_md *ctx)
 	return XDP_PASS;
 }
 
+/* The tracepoint fires once the driver is done with a bulk, so the time since
+ * the previous flush (or, for the first one, the last redirect) on this CPU
+ * is what running the egress program and transmitting the bulk cost.
+ */
+SEC("tp_btf/xdp_devmap_xmit")
+int BPF_PROG(tp_egress_xmit, const struct net_device *from_dev,
+	     const struct net_device *to_dev, int sent, int drops, int err)
+{
+	u32 idx = to_dev->ifindex, slot, key = 0;
+	struct egress_rec *rec;
+	u64 now, *ts;
+
+	if (!IN_SET(to_match, idx))
+		return 0;
+
+	ts = bpf_map_lookup_elem(&last_ns, &key);
+	rec = egress_rec_get(idx);
+	if (!ts || !rec)
+		return 0;
+
+	now = bpf_ktime_get_ns();
+	if (*ts && *ts <= now)
+		rec->time_ns += now - *ts;
+	*ts = now;
+
+	rec->flushes++;
+	rec->sent += sent;
+	if (drops > 0)
+		rec->drops += drops;
+
+	slot = sent + (drops > 0 ? drops : 0);
+	if (slot >= EGRESS_BULK_SLOTS)
+		slot = EGRESS_BULK_SLOTS - 1;
+	rec->bulk[slot]++;
+	return 0;
+}
+
 char _license[] SEC("license") = "GPL";
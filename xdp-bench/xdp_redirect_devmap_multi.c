@@ -18,6 +18,7 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/resource.h>
+#include <time.h>
 #include <linux/if_link.h>
 #include <linux/if_ether.h>
 #include <xdp/libxdp.h>
@@ -26,10 +27,22 @@
 
 #include "xdp_sample.h"
 #include "xdp-bench.h"
+#include "xdp_redirect_devmap_multi.h"
 #include "xdp_redirect_devmap_multi.skel.h"
 
 static int ifaces[MAX_IFACE_NUM] = {};
 
+/* Per-egress breakdown of the devmap flushes, printed after the tables */
+static struct {
+	int map_fd;
+	int nr_cpus;
+	int num;
+	int ifindex[MAX_IFACE_NUM];
+	struct egress_rec prev[MAX_IFACE_NUM];
+	struct egress_rec *percpu;
+	struct timespec prev_ts;
+} egress;
+
 static int mask = SAMPLE_RX_CNT | SAMPLE_REDIRECT_ERR_MAP_CNT |
 		  SAMPLE_EXCEPTION_CNT | SAMPLE_DEVMAP_XMIT_CNT |
 		  SAMPLE_DEVMAP_XMIT_CNT_MULTI | SAMPLE_SKIP_HEADING;
@@ -64,6 +77,140 @@ static int update_mac_map(struct bpf_map *map)
 	return 0;
 }
 
+static void egress_collect(int ifindex, struct egress_rec *tot)
+{
+	struct egress_rec *r;
+	int cpu, i;
+
+	memset(tot, 0, sizeof(*tot));
+	if (bpf_map_lookup_elem(egress.map_fd, &ifindex, egress.percpu) < 0)
+		return;
+
+	for (cpu = 0; cpu < egress.nr_cpus; cpu++) {
+		r = &egress.percpu[cpu];
+		tot->flushes += r->flushes;
+		tot->sent += r->sent;
+		tot->drops += r->drops;
+		tot->filtered += r->filtered;
+		tot->time_ns += r->time_ns;
+		for (i = 0; i < EGRESS_BULK_SLOTS; i++)
+			tot->bulk[i] += r->bulk[i];
+	}
+}
+
+static void egress_print_one(int ifindex, const struct egress_rec *d,
+			     double period, __u64 timestamp)
+{
+	__u64 frames = d->sent + d->drops;
+	double ns_pkt = frames ? (double)d->time_ns / frames : 0;
+	double bulk_avg = d->flushes ? (double)frames / d->flushes : 0;
+	__u64 drops = d->drops > d->filtered ? d->drops - d->filtered : 0;
+	char ifname[IFNAMSIZ], key[IFNAMSIZ + 8];
+	struct datarec rates = {};
+	const char *name;
+	int i;
+
+	if (!d->flushes)
+		return;
+
+	name = if_indextoname(ifindex, ifname) ?: "?";
+
+	if (!sample_output_is_text()) {
+		rates.processed = d->sent / period;
+		rates.dropped = drops / period;
+		rates.issue = ns_pkt;
+		rates.info = d->flushes / period;
+		rates.xdp_drop = d->filtered / period;
+		sample_print_row("devmap_egress", name, -1, timestamp, &rates);
+
+		memset(&rates, 0, sizeof(rates));
+		for (i = 0; i < EGRESS_BULK_SLOTS; i++) {
+			if (!d->bulk[i])
+				continue;
+			snprintf(key, sizeof(key), "%s:%d", name, i);
+			rates.processed = d->bulk[i] / period;
+			sample_print_row("devmap_egress_bulk", key, -1, timestamp,
+					 &rates);
+		}
+		return;
+	}
+
+	printf("  egress %-13s %'10.0f %-13s %'10.0f drop/s %'10.0f filtered/s "
+	       "%8.1f ns/pkt %6.2f bulk-avg\n",
+	       name, d->sent / period, "pkt/s", drops / period,
+	       d->filtered / period, ns_pkt, bulk_avg);
+
+	for (i = 0; i < EGRESS_BULK_SLOTS; i++) {
+		if (!d->bulk[i])
+			continue;
+		snprintf(key, sizeof(key), "bulk %d", i);
+		printf("    %-18s %'10.0f %-13s %5.1f %%\n", key,
+		       d->bulk[i] / period, "flush/s",
+		       100.0 * d->bulk[i] / d->flushes);
+	}
+}
+
+static void egress_print(__unused void *ctx)
+{
+	struct egress_rec cur, delta;
+	struct timespec now;
+	double period;
+	int i, j;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	period = (now.tv_sec - egress.prev_ts.tv_sec) +
+		 (now.tv_nsec - egress.prev_ts.tv_nsec) / 1e9;
+	egress.prev_ts = now;
+	if (period <= 0)
+		return;
+
+	for (i = 0; i < egress.num; i++) {
+		egress_collect(egress.ifindex[i], &cur);
+
+		delta.flushes = cur.flushes - egress.prev[i].flushes;
+		delta.sent = cur.sent - egress.prev[i].sent;
+		delta.drops = cur.drops - egress.prev[i].drops;
+		delta.filtered = cur.filtered - egress.prev[i].filtered;
+		delta.time_ns = cur.time_ns - egress.prev[i].time_ns;
+		for (j = 0; j < EGRESS_BULK_SLOTS; j++)
+			delta.bulk[j] = cur.bulk[j] - egress.prev[i].bulk[j];
+		egress.prev[i] = cur;
+
+		egress_print_one(egress.ifindex[i], &delta, period,
+				 (__u64)now.tv_sec * 1000000000 + now.tv_nsec);
+	}
+	if (!sample_output_is_text())
+		fflush(stdout);
+}
+
+static int egress_init(struct xdp_redirect_devmap_multi *skel,
+		       const struct iface *ifaces_list)
+{
+	const struct iface *iface;
+	int ret;
+
+	skel->links.tp_egress_xmit = bpf_program__attach(skel->progs.tp_egress_xmit);
+	if (!skel->links.tp_egress_xmit) {
+		ret = -errno;
+		pr_warn("Failed to attach egress tracepoint: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	egress.map_fd = bpf_map__fd(skel->maps.egress_cnt);
+	egress.nr_cpus = libbpf_num_possible_cpus();
+	egress.percpu = calloc(egress.nr_cpus, sizeof(*egress.percpu));
+	if (!egress.percpu)
+		return -ENOMEM;
+
+	egress.num = 0;
+	for (iface = ifaces_list; iface; iface = iface->next)
+		egress.ifindex[egress.num++] = iface->ifindex;
+	memset(egress.prev, 0, sizeof(egress.prev));
+	clock_gettime(CLOCK_MONOTONIC, &egress.prev_ts);
+
+	return sample_add_print_cb(egress_print, NULL);
+}
+
 const struct devmap_multi_opts defaults_redirect_devmap_multi = { .mode = XDP_MODE_NATIVE,
 								  .interval = 2 };
 
@@ -86,6 +233,7 @@ int do_redirect_devmap_multi(const void *cfg, __unused const char *pin_root_path
 
 	if (opt->extended)
 		sample_switch_mode();
+	sample_set_output_format(opt->format);
 
 	if (opt->mode == XDP_MODE_SKB)
 		/* devmap_xmit tracepoint not available */
@@ -95,6 +243,28 @@ int do_redirect_devmap_multi(const void *cfg, __unused const char *pin_root_path
 	if (opt->stats)
 		mask |= SAMPLE_REDIRECT_CNT;
 
+	if (opt->egress_stats && opt->mode == XDP_MODE_SKB) {
+		pr_warn("Egress statistics need native mode\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	if (opt->groups.num_vals) {
+		for (i = 0, iface = opt->ifaces; iface; iface = iface->next)
+			i++;
+		if (opt->groups.num_vals != (size_t)i) {
+			pr_warn("Need one --group per interface (got %zu for %d interfaces)\n",
+				opt->groups.num_vals, i);
+			return EXIT_FAIL_OPTION;
+		}
+		if (!opt->load_egress) {
+			pr_warn("Flood groups need the egress program (--load-egress)\n");
+			return EXIT_FAIL_OPTION;
+		}
+	} else if (opt->vlan_groups) {
+		pr_warn("--vlan-groups needs the groups of the interfaces (--group)\n");
+		return EXIT_FAIL_OPTION;
+	}
+
 restart:
 	skel = xdp_redirect_devmap_multi__open();
 	if (!skel) {
@@ -127,6 +297,14 @@ restart:
 		forward_map = skel->maps.forward_map_native;
 	}
 
+	if (!opt->egress_stats)
+		bpf_program__set_autoload(skel->progs.tp_egress_xmit, false);
+
+	skel->rodata->exclude_ingress = !opt->include_ingress;
+	skel->rodata->egress_stats = opt->egress_stats;
+	skel->rodata->group_filter = opt->groups.num_vals > 0;
+	skel->rodata->vlan_groups = opt->vlan_groups;
+
 	ret = sample_init_pre_load(skel, NULL);
 	if (ret < 0) {
 		pr_warn("Failed to sample_init_pre_load: %s\n", strerror(-ret));
@@ -195,6 +373,18 @@ restart:
 		first = false;
 	}
 
+	for (i = 0, iface = opt->ifaces; i < (int)opt->groups.num_vals;
+	     i++, iface = iface->next) {
+		ret = bpf_map_update_elem(bpf_map__fd(skel->maps.port_group),
+					  &iface->ifindex, &opt->groups.vals[i], 0);
+		if (ret < 0) {
+			pr_warn("Failed to set group of %s: %s\n", iface->ifname,
+				strerror(errno));
+			ret = EXIT_FAIL_BPF;
+			goto end_detach;
+		}
+	}
+
 	if (opt->load_egress) {
 		/* Update mac_map with all egress interfaces' mac addr */
 		if (update_mac_map(skel->maps.mac_map) < 0) {
@@ -211,7 +401,31 @@ restart:
 		goto end_detach;
 	}
 
-	ret = sample_run(opt->interval, NULL, NULL);
+	if (opt->egress_stats) {
+		ret = egress_init(skel, opt->ifaces);
+		if (ret < 0) {
+			ret = EXIT_FAIL_BPF;
+			goto end_detach;
+		}
+	}
+
+	if (opt->latency) {
+		ret = latency_attach(xdp_prog);
+		if (ret < 0) {
+			ret = EXIT_FAIL_BPF;
+			goto end_detach;
+		}
+	}
+
+	if (opt->perf_counters) {
+		ret = perf_counters_open();
+		if (ret < 0) {
+			ret = EXIT_FAIL;
+			goto end_detach;
+		}
+	}
+
+	ret = sample_run(opt->interval_ms ?: opt->interval * 1000, NULL, NULL);
 	if (ret < 0) {
 		pr_warn("Failed during sample run: %s\n", strerror(-ret));
 		ret = EXIT_FAIL;
@@ -225,6 +439,10 @@ end_destroy:
 	xdp_program__close(xdp_prog);
 	xdp_redirect_devmap_multi__destroy(skel);
 end:
+	perf_counters_close();
+	latency_detach();
 	sample_teardown();
+	free(egress.percpu);
+	egress.percpu = NULL;
 	return ret;
 }
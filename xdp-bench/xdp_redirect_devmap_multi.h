@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef _XDP_REDIRECT_DEVMAP_MULTI_H
+#define _XDP_REDIRECT_DEVMAP_MULTI_H
+
+/* Shared between the BPF program and userspace, which each get __u64 from
+ * their own headers.
+ */
+
+/* Bulk sizes 0 to 16 (DEV_MAP_BULK_SIZE) */
+#define EGRESS_BULK_SLOTS 17
+
+/* Per-CPU counters of one egress interface */
+struct egress_rec {
+	__u64 flushes;		/* xdp_devmap_xmit events */
+	__u64 sent;
+	__u64 drops;		/* including frames the group filter removed */
+	__u64 filtered;		/* frames dropped by the group filter */
+	__u64 time_ns;		/* time spent on the flushes, see the BPF side */
+	__u64 bulk[EGRESS_BULK_SLOTS];
+};
+
+#endif
@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Spread the traffic of one interface over a set of veth devices, the way a
+ * host forwards into its containers. The ports sit in an array devmap
+ * indexed from 0, so each packet is sent to the port picked by its flow hash
+ * or to the next one in turn.
+ */
+#include <bpf/vmlinux.h>
+#include <xdp/xdp_sample_shared.h>
+#include <xdp/xdp_sample.bpf.h>
+#include <xdp/xdp_sample_common.bpf.h>
+#include <linux/jhash.h>
+
+#define INITVAL 15485863
+
+#define IP_MF		0x2000
+#define IP_OFFSET	0x1fff
+
+/* Number of ports in the devmaps, set from userspace */
+const volatile u32 num_ports = 1;
+const volatile bool round_robin = false;
+
+/* Kernels without struct bpf_devmap_val values in a devmap in some mode
+ * get tx_ports_general instead of tx_ports_native.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_DEVMAP);
+	__uint(key_size, sizeof(int));
+	__uint(value_size, sizeof(int));
+	__uint(max_entries, 32);
+} tx_ports_general SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_DEVMAP);
+	__uint(key_size, sizeof(int));
+	__uint(value_size, sizeof(struct bpf_devmap_val));
+	__uint(max_entries, 32);
+} tx_ports_native SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, u32);
+	__uint(max_entries, 1);
+} ports_iterator SEC(".maps");
+
+/* Hash of the address pair and the ports, the same in both directions; 0
+ * for anything that isn't IPv4 or IPv6, so that traffic goes to port 0.
+ */
+static __always_inline u32 flow_hash(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct ethhdr *eth = data;
+	struct ipv6hdr *ip6h;
+	struct udphdr *udph;
+	struct iphdr *iph;
+	u32 src, dst, ports = 0;
+	u8 proto;
+
+	if (eth + 1 > data_end)
+		return 0;
+
+	if (eth->h_proto == bpf_htons(ETH_P_IP)) {
+		iph = (void *)(eth + 1);
+		if (iph + 1 > data_end)
+			return 0;
+		src = iph->saddr;
+		dst = iph->daddr;
+		proto = iph->protocol;
+		udph = (void *)iph + iph->ihl * 4;
+		if (iph->frag_off & bpf_htons(IP_MF | IP_OFFSET))
+			udph = NULL;
+	} else if (eth->h_proto == bpf_htons(ETH_P_IPV6)) {
+		ip6h = (void *)(eth + 1);
+		if (ip6h + 1 > data_end)
+			return 0;
+		src = jhash2(ip6h->saddr.in6_u.u6_addr32, 4, INITVAL);
+		dst = jhash2(ip6h->daddr.in6_u.u6_addr32, 4, INITVAL);
+		proto = ip6h->nexthdr;
+		udph = (void *)(ip6h + 1);
+	} else {
+		return 0;
+	}
+
+	if (udph && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) &&
+	    udph + 1 <= data_end)
+		ports = udph->source ^ udph->dest;
+
+	return jhash_3words(src < dst ? src : dst, src < dst ? dst : src,
+			    ports, INITVAL + proto);
+}
+
+static __always_inline u32 next_port(void)
+{
+	u32 key = 0, port;
+	u32 *iter;
+
+	iter = bpf_map_lookup_elem(&ports_iterator, &key);
+	if (!iter)
+		return 0;
+
+	port = *iter;
+	if (++*iter >= num_ports)
+		*iter = 0;
+	return port;
+}
+
+static __always_inline int xdp_redirect_veth(struct xdp_md *ctx, void *redirect_map)
+{
+	u32 key = bpf_get_smp_processor_id();
+	struct datarec *rec;
+	u32 port;
+
+	rec = bpf_map_lookup_elem(&rx_cnt, &key);
+	if (!rec)
+		return XDP_PASS;
+	NO_TEAR_INC(rec->processed);
+
+	if (round_robin)
+		port = next_port();
+	else
+		port = flow_hash(ctx) % num_ports;
+
+	return bpf_redirect_map(redirect_map, port, 0);
+}
+
+SEC("xdp")
+int redir_veth_general(struct xdp_md *ctx)
+{
+	return xdp_redirect_veth(ctx, &tx_ports_general);
+}
+
+SEC("xdp")
+int redir_veth_native(struct xdp_md *ctx)
+{
+	return xdp_redirect_veth(ctx, &tx_ports_native);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,219 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* Redirect the traffic of one interface into a set of veth devices, as a host
+ * does for its containers. Per-veth transmit rates, drops and bulk sizes come
+ * from the devmap_xmit tracepoint; drops there mean the receive ring of the
+ * other end filled up before its NAPI instance got to run.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <net/if.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <stdbool.h>
+#include <linux/bpf.h>
+#include <bpf/libbpf.h>
+#include <xdp/libxdp.h>
+#include <linux/if_link.h>
+
+#include "logging.h"
+
+#include "xdp-bench.h"
+#include "xdp_sample.h"
+#include "xdp_redirect_veth.skel.h"
+
+static int mask = SAMPLE_RX_CNT | SAMPLE_REDIRECT_ERR_MAP_CNT |
+		  SAMPLE_EXCEPTION_CNT | SAMPLE_DEVMAP_XMIT_CNT |
+		  SAMPLE_DEVMAP_XMIT_CNT_MULTI | SAMPLE_SKIP_HEADING;
+
+DEFINE_SAMPLE_INIT(xdp_redirect_veth);
+
+const struct veth_opts defaults_redirect_veth = { .mode = XDP_MODE_NATIVE,
+						  .interval = 2 };
+
+/* Any device with ndo_xdp_xmit works as a port, but the numbers only mean
+ * what the documentation says for veth. Whether the other ends can take
+ * redirected frames (they need an XDP program or GRO enabled) can't be
+ * checked from here, as they usually live in another namespace.
+ */
+static void check_ports(const struct iface *ifaces)
+{
+	const struct iface *iface;
+
+	for (iface = ifaces; iface; iface = iface->next)
+		if (strcmp(get_driver_name(iface->ifindex), "veth"))
+			pr_warn("%s is not a veth device (driver %s)\n",
+				iface->ifname, get_driver_name(iface->ifindex));
+}
+
+int do_redirect_veth(const void *cfg, __unused const char *pin_root_path)
+{
+	const struct veth_opts *opt = cfg;
+
+	const char *prog_name = "redir_veth_native";
+	DECLARE_LIBBPF_OPTS(xdp_program_opts, opts);
+	struct bpf_devmap_val devmap_val = {};
+	struct xdp_program *xdp_prog = NULL;
+	struct bpf_map *tx_ports_map = NULL;
+	struct xdp_redirect_veth *skel;
+	struct bpf_program *prog = NULL;
+	int ret = EXIT_FAIL_OPTION;
+	struct iface *iface;
+	bool tried = false;
+	int i;
+
+	if (opt->extended)
+		sample_switch_mode();
+	sample_set_output_format(opt->format);
+
+	if (opt->mode == XDP_MODE_SKB)
+		/* devmap_xmit tracepoint not available */
+		mask &= ~(SAMPLE_DEVMAP_XMIT_CNT |
+			  SAMPLE_DEVMAP_XMIT_CNT_MULTI);
+
+	if (opt->stats)
+		mask |= SAMPLE_REDIRECT_CNT;
+
+	for (iface = opt->ifaces_out; iface; iface = iface->next)
+		if (iface->ifindex == opt->iface_in.ifindex) {
+			pr_warn("Can't redirect back into %s\n", iface->ifname);
+			return EXIT_FAIL_OPTION;
+		}
+
+	check_ports(opt->ifaces_out);
+
+restart:
+	skel = xdp_redirect_veth__open();
+	if (!skel) {
+		pr_warn("Failed to xdp_redirect_veth__open: %s\n",
+			strerror(errno));
+		ret = EXIT_FAIL_BPF;
+		goto end;
+	}
+
+	/* Make sure we only load the one XDP program we are interested in */
+	while ((prog = bpf_object__next_program(skel->obj, prog)) != NULL)
+		if (bpf_program__type(prog) == BPF_PROG_TYPE_XDP &&
+		    bpf_program__expected_attach_type(prog) == BPF_XDP)
+			bpf_program__set_autoload(prog, false);
+
+	if (tried) {
+		tx_ports_map = skel->maps.tx_ports_general;
+#ifdef HAVE_LIBBPF_BPF_MAP__SET_AUTOCREATE
+		bpf_map__set_autocreate(skel->maps.tx_ports_native, false);
+#else
+		pr_warn("Libbpf is missing bpf_map__set_autocreate(), fallback won't work\n");
+		ret = EXIT_FAIL_BPF;
+		goto end_destroy;
+#endif
+	} else {
+#ifdef HAVE_LIBBPF_BPF_MAP__SET_AUTOCREATE
+		bpf_map__set_autocreate(skel->maps.tx_ports_general, false);
+#endif
+		tx_ports_map = skel->maps.tx_ports_native;
+	}
+
+	ret = sample_init_pre_load(skel, opt->iface_in.ifname);
+	if (ret < 0) {
+		pr_warn("Failed to sample_init_pre_load: %s\n", strerror(-ret));
+		ret = EXIT_FAIL_BPF;
+		goto end_destroy;
+	}
+
+	skel->rodata->from_match[0] = opt->iface_in.ifindex;
+	/* opt parsing enforces num <= MAX_IFACES_NUM */
+	for (i = 0, iface = opt->ifaces_out; iface; i++, iface = iface->next)
+		skel->rodata->to_match[i] = iface->ifindex;
+	skel->rodata->num_ports = i;
+	skel->rodata->round_robin = opt->spread == VETH_SPREAD_ROUND_ROBIN;
+
+	opts.obj = skel->obj;
+	opts.prog_name = prog_name;
+	xdp_prog = xdp_program__create(&opts);
+	if (!xdp_prog) {
+		ret = -errno;
+		pr_warn("Couldn't open XDP program: %s\n",
+			strerror(-ret));
+		goto end_destroy;
+	}
+
+	ret = xdp_program__attach(xdp_prog, opt->iface_in.ifindex, opt->mode, 0);
+	if (ret < 0) {
+		/* First try with struct bpf_devmap_val as value for generic
+		 * mode, then fallback to sizeof(int) for older kernels.
+		 */
+		if (!tried) {
+			pr_warn("Attempting fallback to int-sized devmap\n");
+			prog_name = "redir_veth_general";
+			tried = true;
+
+			xdp_program__close(xdp_prog);
+			xdp_redirect_veth__destroy(skel);
+			sample_teardown();
+			xdp_prog = NULL;
+			goto restart;
+		}
+		pr_warn("Failed to attach XDP program: %s\n",
+			strerror(-ret));
+		ret = EXIT_FAIL_XDP;
+		goto end_destroy;
+	}
+
+	for (i = 0, iface = opt->ifaces_out; iface; i++, iface = iface->next) {
+		devmap_val.ifindex = iface->ifindex;
+		ret = bpf_map_update_elem(bpf_map__fd(tx_ports_map), &i, &devmap_val, 0);
+		if (ret < 0) {
+			pr_warn("Failed to add %s to the devmap: %s\n",
+				iface->ifname, strerror(errno));
+			ret = EXIT_FAIL_BPF;
+			goto end_detach;
+		}
+	}
+
+	ret = sample_init(skel, mask, opt->iface_in.ifindex, 0);
+	if (ret < 0) {
+		pr_warn("Failed to initialize sample: %s\n", strerror(-ret));
+		ret = EXIT_FAIL;
+		goto end_detach;
+	}
+
+	if (opt->latency) {
+		ret = latency_attach(xdp_prog);
+		if (ret < 0) {
+			ret = EXIT_FAIL_BPF;
+			goto end_detach;
+		}
+	}
+
+	if (opt->perf_counters) {
+		ret = perf_counters_open();
+		if (ret < 0) {
+			ret = EXIT_FAIL;
+			goto end_detach;
+		}
+	}
+
+	pr_info("Redirecting from %s (ifindex %d; driver %s) to %u veth devices by %s\n",
+		opt->iface_in.ifname, opt->iface_in.ifindex,
+		get_driver_name(opt->iface_in.ifindex), skel->rodata->num_ports,
+		opt->spread == VETH_SPREAD_ROUND_ROBIN ? "round-robin" : "flow hash");
+
+	ret = sample_run(opt->interval_ms ?: opt->interval * 1000, NULL, NULL);
+	if (ret < 0) {
+		pr_warn("Failed during sample run: %s\n", strerror(-ret));
+		ret = EXIT_FAIL;
+		goto end_detach;
+	}
+	ret = EXIT_OK;
+end_detach:
+	xdp_program__detach(xdp_prog, opt->iface_in.ifindex, opt->mode, 0);
+end_destroy:
+	xdp_program__close(xdp_prog);
+	xdp_redirect_veth__destroy(skel);
+end:
+	perf_counters_close();
+	latency_detach();
+	sample_teardown();
+	return ret;
+}
@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <bpf/vmlinux.h>
+#include <xdp/xdp_sample_shared.h>
+#include <xdp/xdp_sample.bpf.h>
+#include <xdp/xdp_sample_common.bpf.h>
+
+#define MAX_XSK_QUEUES 64
+
+struct {
+	__uint(type, BPF_MAP_TYPE_XSKMAP);
+	__uint(max_entries, MAX_XSK_QUEUES);
+	__type(key, u32);
+	__type(value, u32);
+} xsks_map SEC(".maps");
+
+/* Packets redirected to the socket of each queue, for redirect-xsk; the
+ * last entry counts the packets that found no socket.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, MAX_XSK_QUEUES + 1);
+	__type(key, u32);
+	__type(value, struct datarec);
+} xsk_queue_cnt SEC(".maps");
+
+const volatile bool queue_stats = false;
+
+SEC("xdp")
+int xdp_xsk_prog(struct xdp_md *ctx)
+{
+	u32 key = bpf_get_smp_processor_id();
+	u32 queue = ctx->rx_queue_index;
+	struct datarec *rec;
+	int ret;
+
+	rec = bpf_map_lookup_elem(&rx_cnt, &key);
+	if (!rec)
+		return XDP_PASS;
+	NO_TEAR_INC(rec->processed);
+
+	/* Packets arriving on a queue without a socket go to the stack */
+	ret = bpf_redirect_map(&xsks_map, queue, XDP_PASS);
+
+	if (queue_stats) {
+		if (ret != XDP_REDIRECT)
+			queue = MAX_XSK_QUEUES;
+		rec = bpf_map_lookup_elem(&xsk_queue_cnt, &queue);
+		if (rec)
+			NO_TEAR_INC(rec->processed);
+	}
+
+	return ret;
+}
+
+char _license[] SEC("license") = "GPL";
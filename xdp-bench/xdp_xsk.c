@@ -0,0 +1,932 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include <errno.h>
+#include <stdio.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <bpf/bpf.h>
+#include <stdbool.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_xdp.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <bpf/libbpf.h>
+#include <xdp/libxdp.h>
+#include <xdp/xsk.h>
+
+#include "logging.h"
+
+#include "xdp-bench.h"
+#include "xdp_sample.h"
+#include "xdp_xsk.skel.h"
+
+#define XSK_FRAMES_PER_QUEUE (XSK_RING_PROD__DEFAULT_NUM_DESCS * 2)
+#define XSK_FRAME_SIZE XSK_UMEM__DEFAULT_FRAME_SIZE
+#define XSK_TX_PKT_LEN 64
+#define XSK_TX_PKT_MIN 60
+#define XSK_TX_PKT_MAX 1514
+
+static int mask = SAMPLE_RX_CNT | SAMPLE_REDIRECT_ERR_CNT |
+		  SAMPLE_EXCEPTION_CNT;
+
+DEFINE_SAMPLE_INIT(xdp_xsk);
+
+const struct xsk_opts defaults_xsk_drop = { .mode = XDP_MODE_NATIVE,
+					    .interval = 2,
+					    .batch_size = 64 };
+const struct xsk_opts defaults_xsk_tx = { .mode = XDP_MODE_NATIVE,
+					  .interval = 2,
+					  .batch_size = 64 };
+const struct xsk_opts defaults_xsk_fwd = { .mode = XDP_MODE_NATIVE,
+					   .interval = 2,
+					   .batch_size = 64 };
+const struct xsk_opts defaults_redirect_xsk = { .mode = XDP_MODE_NATIVE,
+						.interval = 2,
+						.batch_size = 64 };
+const struct xsk_opts defaults_tx_gen = { .mode = XDP_MODE_NATIVE,
+					  .interval = 2,
+					  .batch_size = 64,
+					  .flows = 1 };
+
+enum xsk_bench_mode {
+	XSK_BENCH_RXDROP,
+	XSK_BENCH_TXONLY,
+	XSK_BENCH_L2FWD,
+	XSK_BENCH_REDIRECT,
+};
+
+struct xsk_queue {
+	struct xsk_ring_cons rx;
+	struct xsk_ring_prod tx;
+	struct xsk_ring_prod fill;
+	struct xsk_ring_cons comp;
+	struct xsk_socket *xsk;
+	struct xsk_bench *bench;
+	pthread_t thread;
+	bool thread_running;
+	__u64 frame_base;
+	__u32 queue_id;
+	__u32 outstanding_tx;
+	__u32 tx_frame;
+	__u64 tx_rate;		/* packets per second, 0 for no limit */
+	__u64 tx_submitted;
+	struct timespec tx_start;
+	__u64 rx_packets;
+	__u64 tx_packets;
+	__u64 prev_rx;
+	__u64 prev_tx;
+	/* Queue statistics of redirect-xsk */
+	__u64 prev_redirected;
+	struct xdp_statistics prev_xstats;
+};
+
+struct xsk_bench {
+	const struct xsk_opts *opt;
+	enum xsk_bench_mode mode;
+	struct xsk_umem *umem;
+	void *umem_area;
+	__u64 umem_size;
+	struct xsk_queue *queues;
+	size_t num_queues;
+	struct timespec prev_ts;
+	bool stop;
+	int queue_cnt_fd;
+	int nr_cpus;
+	struct datarec *queue_values;
+	__u32 no_socket_key;	/* entry of packets on queues without a socket */
+	__u64 prev_no_socket;
+};
+
+static __u32 csum_partial(const void *data, size_t len, __u32 sum)
+{
+	const __u16 *p = data;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+	if (len)
+		sum += *(const __u8 *)p;
+
+	return sum;
+}
+
+static __u16 csum_fold(__u32 sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+static __u16 ip_checksum(const void *data, size_t len)
+{
+	return csum_fold(csum_partial(data, len, 0));
+}
+
+static __u16 tcp_checksum(const struct iphdr *iph, const void *tcph,
+			  size_t len)
+{
+	struct {
+		__be32 saddr;
+		__be32 daddr;
+		__u8 zero;
+		__u8 proto;
+		__be16 len;
+	} pseudo = {
+		.saddr = iph->saddr,
+		.daddr = iph->daddr,
+		.proto = IPPROTO_TCP,
+		.len = htons(len),
+	};
+
+	return csum_fold(csum_partial(tcph, len,
+				      csum_partial(&pseudo, sizeof(pseudo), 0)));
+}
+
+static __u32 xsk_frame_len(const struct xsk_opts *opt, __u32 frame)
+{
+	if (!opt->pkt_sizes.num_vals)
+		return XSK_TX_PKT_LEN;
+	return opt->pkt_sizes.vals[frame % opt->pkt_sizes.num_vals];
+}
+
+/* Build an Ethernet/IPv4/UDP or TCP frame of len bytes with a zero payload.
+ * Flows differ by source port. The UDP checksum is left at zero, which is
+ * valid for IPv4.
+ */
+void xsk_gen_packet(void *buf, __u32 len, const __u8 *src_mac,
+		    const struct xsk_opts *opt, __u32 flow)
+{
+	static const __u8 zero_mac[ETH_ALEN];
+	struct ethhdr *eth = buf;
+	struct iphdr *iph = (struct iphdr *)(eth + 1);
+	size_t l4_len = len - sizeof(*eth) - sizeof(*iph);
+	__be16 sport = htons(9 + flow);
+
+	memset(buf, 0, len);
+
+	if (memcmp(opt->dst_mac.addr, zero_mac, ETH_ALEN))
+		memcpy(eth->h_dest, opt->dst_mac.addr, ETH_ALEN);
+	else
+		memset(eth->h_dest, 0xff, ETH_ALEN);
+	memcpy(eth->h_source, src_mac, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+
+	iph->version = 4;
+	iph->ihl = sizeof(*iph) / 4;
+	iph->ttl = 64;
+	iph->protocol = opt->proto == TXGEN_TCP ? IPPROTO_TCP : IPPROTO_UDP;
+	iph->tot_len = htons(len - sizeof(*eth));
+	iph->saddr = opt->src_ip.af ? opt->src_ip.addr.addr4.s_addr :
+				      htonl(0xc0000201); /* 192.0.2.1 */
+	iph->daddr = opt->dst_ip.af ? opt->dst_ip.addr.addr4.s_addr :
+				      htonl(0xc0000202); /* 192.0.2.2 */
+	iph->check = ip_checksum(iph, sizeof(*iph));
+
+	if (opt->proto == TXGEN_TCP) {
+		struct tcphdr *tcph = (struct tcphdr *)(iph + 1);
+
+		tcph->source = sport;
+		tcph->dest = htons(9);
+		tcph->doff = sizeof(*tcph) / 4;
+		tcph->ack = 1;
+		tcph->window = htons(65535);
+		tcph->check = tcp_checksum(iph, tcph, l4_len);
+	} else {
+		struct udphdr *udph = (struct udphdr *)(iph + 1);
+
+		udph->source = sport;
+		udph->dest = htons(9);
+		udph->len = htons(l4_len);
+	}
+}
+
+static void swap_macs(void *data)
+{
+	struct ethhdr *eth = data;
+	__u8 tmp[ETH_ALEN];
+
+	memcpy(tmp, eth->h_source, ETH_ALEN);
+	memcpy(eth->h_source, eth->h_dest, ETH_ALEN);
+	memcpy(eth->h_dest, tmp, ETH_ALEN);
+}
+
+static void kick_tx(struct xsk_queue *q)
+{
+	int ret = xsk_socket__wakeup_tx(q->xsk);
+
+	if (ret)
+		pr_debug("Tx wakeup failed on queue %u: %s\n", q->queue_id,
+			 strerror(-ret));
+}
+
+static void kick_rx(struct xsk_queue *q)
+{
+	xsk_socket__wakeup_rx(q->xsk);
+}
+
+static void xsk_populate_fill_ring(struct xsk_queue *q)
+{
+	__u32 idx, i;
+
+	if (xsk_ring_prod__reserve(&q->fill, XSK_FRAMES_PER_QUEUE, &idx) !=
+	    XSK_FRAMES_PER_QUEUE)
+		return;
+
+	for (i = 0; i < XSK_FRAMES_PER_QUEUE; i++)
+		*xsk_ring_prod__fill_addr(&q->fill, idx++) =
+			q->frame_base + (__u64)i * XSK_FRAME_SIZE;
+
+	xsk_ring_prod__submit(&q->fill, XSK_FRAMES_PER_QUEUE);
+}
+
+/* Move completed TX frames back to the fill ring (or simply release them
+ * in txonly mode, where the frames are reused in place).
+ */
+static void complete_tx(struct xsk_queue *q, bool refill)
+{
+	__u32 idx_cq = 0, idx_fq = 0;
+	unsigned int completed, i;
+
+	if (!q->outstanding_tx)
+		return;
+
+	kick_tx(q);
+
+	completed = xsk_ring_cons__peek(&q->comp, q->bench->opt->batch_size,
+					&idx_cq);
+	if (!completed)
+		return;
+
+	if (refill) {
+		while (xsk_ring_prod__reserve(&q->fill, completed, &idx_fq) !=
+		       completed)
+			kick_rx(q);
+
+		for (i = 0; i < completed; i++)
+			*xsk_ring_prod__fill_addr(&q->fill, idx_fq++) =
+				*xsk_ring_cons__comp_addr(&q->comp, idx_cq++);
+
+		xsk_ring_prod__submit(&q->fill, completed);
+	}
+
+	xsk_ring_cons__release(&q->comp, completed);
+	q->outstanding_tx -= completed;
+	__atomic_store_n(&q->tx_packets, q->tx_packets + completed,
+			 __ATOMIC_RELAXED);
+}
+
+static void rx_drop(struct xsk_queue *q)
+{
+	__u32 rcvd;
+
+	rcvd = xsk_ring_cons__recycle_rx(&q->rx, &q->fill, q->bench->opt->batch_size);
+	if (!rcvd) {
+		kick_rx(q);
+		return;
+	}
+
+	__atomic_store_n(&q->rx_packets, q->rx_packets + rcvd,
+			 __ATOMIC_RELAXED);
+}
+
+/* How many of the next batch of frames the rate limit lets through now */
+static __u32 tx_budget(struct xsk_queue *q, __u32 batch)
+{
+	struct timespec now;
+	double elapsed;
+	__u64 allowed;
+
+	if (!q->tx_rate)
+		return batch;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - q->tx_start.tv_sec) +
+		  (now.tv_nsec - q->tx_start.tv_nsec) / 1e9;
+	allowed = elapsed * q->tx_rate;
+	if (allowed <= q->tx_submitted)
+		return 0;
+
+	return allowed - q->tx_submitted < batch ? allowed - q->tx_submitted : batch;
+}
+
+static void tx_only(struct xsk_queue *q)
+{
+	const struct xsk_opts *opt = q->bench->opt;
+	__u32 batch = tx_budget(q, opt->batch_size), idx, i;
+
+	if (batch && q->outstanding_tx + batch <= XSK_FRAMES_PER_QUEUE &&
+	    xsk_ring_prod__reserve(&q->tx, batch, &idx) == batch) {
+		for (i = 0; i < batch; i++) {
+			struct xdp_desc *desc = xsk_ring_prod__tx_desc(&q->tx, idx++);
+
+			desc->addr = q->frame_base +
+				(__u64)q->tx_frame * XSK_FRAME_SIZE;
+			desc->len = xsk_frame_len(opt, q->tx_frame);
+			q->tx_frame = (q->tx_frame + 1) % XSK_FRAMES_PER_QUEUE;
+		}
+
+		xsk_ring_prod__submit(&q->tx, batch);
+		q->outstanding_tx += batch;
+		q->tx_submitted += batch;
+	}
+
+	complete_tx(q, false);
+}
+
+static void l2_fwd(struct xsk_queue *q)
+{
+	__u32 idx_rx = 0, idx_tx = 0;
+	unsigned int rcvd, i;
+
+	complete_tx(q, true);
+
+	rcvd = xsk_ring_cons__peek(&q->rx, q->bench->opt->batch_size, &idx_rx);
+	if (!rcvd) {
+		kick_rx(q);
+		return;
+	}
+
+	while (xsk_ring_prod__reserve(&q->tx, rcvd, &idx_tx) != rcvd) {
+		complete_tx(q, true);
+		if (__atomic_load_n(&q->bench->stop, __ATOMIC_RELAXED)) {
+			xsk_ring_cons__cancel(&q->rx, rcvd);
+			return;
+		}
+	}
+
+	for (i = 0; i < rcvd; i++) {
+		const struct xdp_desc *rx_desc = xsk_ring_cons__rx_desc(&q->rx, idx_rx++);
+		struct xdp_desc *tx_desc = xsk_ring_prod__tx_desc(&q->tx, idx_tx++);
+		__u64 addr = xsk_umem__add_offset_to_addr(rx_desc->addr);
+
+		swap_macs(xsk_umem__get_data(q->bench->umem_area, addr));
+
+		tx_desc->addr = rx_desc->addr;
+		tx_desc->len = rx_desc->len;
+	}
+
+	xsk_ring_prod__submit(&q->tx, rcvd);
+	xsk_ring_cons__release(&q->rx, rcvd);
+	q->outstanding_tx += rcvd;
+	__atomic_store_n(&q->rx_packets, q->rx_packets + rcvd,
+			 __ATOMIC_RELAXED);
+}
+
+static void *xsk_worker(void *arg)
+{
+	struct xsk_queue *q = arg;
+	struct xsk_bench *bench = q->bench;
+
+	while (!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+		switch (bench->mode) {
+		case XSK_BENCH_RXDROP:
+		case XSK_BENCH_REDIRECT:
+			rx_drop(q);
+			break;
+		case XSK_BENCH_TXONLY:
+			tx_only(q);
+			break;
+		case XSK_BENCH_L2FWD:
+			l2_fwd(q);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* Packets the XDP program redirected to the socket of a queue */
+static __u64 xsk_read_queue_cnt(struct xsk_bench *bench, __u32 queue)
+{
+	__u64 sum = 0;
+	int i;
+
+	if (bpf_map_lookup_elem(bench->queue_cnt_fd, &queue, bench->queue_values))
+		return 0;
+
+	for (i = 0; i < bench->nr_cpus; i++)
+		sum += bench->queue_values[i].processed;
+	return sum;
+}
+
+/* Kernels before 5.9 return the first three fields only, which leaves the
+ * ring full and fill ring empty counts at zero.
+ */
+static void xsk_read_xstats(struct xsk_queue *q, struct xdp_statistics *stats)
+{
+	socklen_t optlen = sizeof(*stats);
+
+	memset(stats, 0, sizeof(*stats));
+	if (getsockopt(xsk_socket__fd(q->xsk), SOL_XDP, XDP_STATISTICS, stats,
+		       &optlen))
+		pr_debug("Couldn't get statistics of queue %u: %s\n", q->queue_id,
+			 strerror(errno));
+}
+
+/* For each queue: the packets the XDP program redirected to its socket,
+ * those that made it to the RX ring and were consumed, those the kernel
+ * dropped because the RX ring was full, the times it found the fill ring
+ * empty, and the share of the redirected packets the queue got.
+ */
+static void xsk_print_queues(struct xsk_bench *bench, double period,
+			     __u64 timestamp)
+{
+	struct {
+		double redirected, delivered, ring_full, fill_empty;
+	} *rates;
+	double total = 0, no_socket;
+	__u64 val;
+	size_t i;
+
+	rates = calloc(bench->num_queues, sizeof(*rates));
+	if (!rates)
+		return;
+
+	for (i = 0; i < bench->num_queues; i++) {
+		struct xsk_queue *q = &bench->queues[i];
+		__u64 rx = __atomic_load_n(&q->rx_packets, __ATOMIC_RELAXED);
+		struct xdp_statistics xstats;
+
+		val = xsk_read_queue_cnt(bench, q->queue_id);
+		xsk_read_xstats(q, &xstats);
+
+		rates[i].redirected = (val - q->prev_redirected) / period;
+		rates[i].delivered = (rx - q->prev_rx) / period;
+		rates[i].ring_full = (xstats.rx_ring_full -
+				      q->prev_xstats.rx_ring_full) / period;
+		rates[i].fill_empty = (xstats.rx_fill_ring_empty_descs -
+				       q->prev_xstats.rx_fill_ring_empty_descs) / period;
+		total += rates[i].redirected;
+
+		q->prev_redirected = val;
+		q->prev_rx = rx;
+		q->prev_xstats = xstats;
+	}
+
+	val = xsk_read_queue_cnt(bench, bench->no_socket_key);
+	no_socket = (val - bench->prev_no_socket) / period;
+	bench->prev_no_socket = val;
+
+	for (i = 0; i < bench->num_queues; i++) {
+		struct xsk_queue *q = &bench->queues[i];
+		char prefix[32];
+
+		if (sample_output_is_text()) {
+			snprintf(prefix, sizeof(prefix), "  xsk queue %u", q->queue_id);
+			printf("%-23s%'10.0f %-13s%'10.0f %-13s%'10.0f %-13s%'10.0f %-13s%6.1f %%\n",
+			       prefix, rates[i].redirected, "redir/s",
+			       rates[i].delivered, "delivered/s",
+			       rates[i].ring_full, "ring-full/s",
+			       rates[i].fill_empty, "fill-empty/s",
+			       total ? rates[i].redirected * 100 / total : 0);
+		} else {
+			struct datarec row = {
+				.processed = rates[i].redirected,
+				.info = rates[i].delivered,
+				.dropped = rates[i].ring_full,
+				.issue = rates[i].fill_empty,
+			};
+
+			snprintf(prefix, sizeof(prefix), "%u", q->queue_id);
+			sample_print_row("xsk_queue", prefix, -1, timestamp, &row);
+		}
+	}
+
+	if (sample_output_is_text()) {
+		if (no_socket)
+			printf("%-23s%'10.0f %-13s\n", "  xsk no socket", no_socket,
+			       "pkt/s");
+	} else {
+		struct datarec row = { .processed = no_socket };
+
+		sample_print_row("xsk_queue", "none", -1, timestamp, &row);
+	}
+
+	free(rates);
+}
+
+static void xsk_print_stats(void *ctx)
+{
+	struct xsk_bench *bench = ctx;
+	struct timespec now;
+	double period;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	period = (now.tv_sec - bench->prev_ts.tv_sec) +
+		 (now.tv_nsec - bench->prev_ts.tv_nsec) / 1e9;
+	bench->prev_ts = now;
+	if (period <= 0)
+		return;
+
+	if (bench->mode == XSK_BENCH_REDIRECT) {
+		xsk_print_queues(bench, period,
+				 (__u64)now.tv_sec * 1000000000 + now.tv_nsec);
+		fflush(stdout);
+		return;
+	}
+
+	for (i = 0; i < bench->num_queues; i++) {
+		struct xsk_queue *q = &bench->queues[i];
+		__u64 rx = __atomic_load_n(&q->rx_packets, __ATOMIC_RELAXED);
+		__u64 tx = __atomic_load_n(&q->tx_packets, __ATOMIC_RELAXED);
+		char prefix[32];
+
+		if (sample_output_is_text()) {
+			snprintf(prefix, sizeof(prefix), "  xsk queue %u", q->queue_id);
+			printf("%-23s%'10.0f %-13s%'10.0f %-13s\n", prefix,
+			       (rx - q->prev_rx) / period, "rx/s",
+			       (tx - q->prev_tx) / period, "tx/s");
+		} else {
+			/* Rx goes in the packet column and Tx in the info one */
+			struct datarec rates = {
+				.processed = (rx - q->prev_rx) / period,
+				.info = (tx - q->prev_tx) / period,
+			};
+
+			snprintf(prefix, sizeof(prefix), "%u", q->queue_id);
+			sample_print_row("xsk", prefix, -1,
+					 (__u64)now.tv_sec * 1000000000 + now.tv_nsec,
+					 &rates);
+		}
+		q->prev_rx = rx;
+		q->prev_tx = tx;
+	}
+	fflush(stdout);
+}
+
+static void xsk_stop_workers(struct xsk_bench *bench)
+{
+	size_t i;
+
+	__atomic_store_n(&bench->stop, true, __ATOMIC_RELAXED);
+	for (i = 0; i < bench->num_queues; i++)
+		if (bench->queues[i].thread_running)
+			pthread_join(bench->queues[i].thread, NULL);
+}
+
+static void xsk_bench_cleanup(struct xsk_bench *bench)
+{
+	size_t i;
+
+	for (i = 0; i < bench->num_queues; i++)
+		if (bench->queues[i].xsk)
+			xsk_socket__delete(bench->queues[i].xsk);
+
+	if (bench->umem)
+		xsk_umem__delete(bench->umem);
+	if (bench->umem_area)
+		munmap(bench->umem_area, bench->umem_size);
+	free(bench->queues);
+	free(bench->queue_values);
+}
+
+static int xsk_bench_setup(struct xsk_bench *bench, struct xdp_xsk *skel)
+{
+	const struct xsk_opts *opt = bench->opt;
+	struct xsk_umem_config umem_cfg = {
+		.fill_size = XSK_FRAMES_PER_QUEUE,
+		.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.frame_size = XSK_FRAME_SIZE,
+		.frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
+		.flags = XSK_UMEM__DEFAULT_FLAGS,
+	};
+	struct xsk_socket_config xsk_cfg = {
+		.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+		.libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD,
+		.bind_flags = XDP_USE_NEED_WAKEUP,
+	};
+	int map_fd = bpf_map__fd(skel->maps.xsks_map);
+	bool use_rx = bench->mode != XSK_BENCH_TXONLY;
+	bool use_tx = bench->mode == XSK_BENCH_TXONLY ||
+		      bench->mode == XSK_BENCH_L2FWD;
+	__u8 mac[ETH_ALEN] = {};
+	size_t i;
+	int ret;
+
+	if (opt->copy_mode == XSK_COPY_COPY)
+		xsk_cfg.bind_flags |= XDP_COPY;
+	else if (opt->copy_mode == XSK_COPY_ZEROCOPY)
+		xsk_cfg.bind_flags |= XDP_ZEROCOPY;
+
+	if (opt->busy_poll) {
+		xsk_cfg.libxdp_flags |= XSK_LIBXDP_FLAGS__BUSY_POLL;
+		xsk_cfg.busy_poll_budget = opt->batch_size;
+	}
+
+	bench->num_queues = opt->queues.num_vals ?: 1;
+	/* redirect-xsk binds every RX queue by default, to show how the
+	 * traffic spreads over them
+	 */
+	if (bench->mode == XSK_BENCH_REDIRECT && !opt->queues.num_vals) {
+		ret = get_num_rxqs(opt->iface_in.ifname);
+		if (ret > (int)bpf_map__max_entries(skel->maps.xsks_map)) {
+			pr_warn("Only binding the first %u of %d queues\n",
+				bpf_map__max_entries(skel->maps.xsks_map), ret);
+			ret = bpf_map__max_entries(skel->maps.xsks_map);
+		}
+		if (ret > 0)
+			bench->num_queues = ret;
+	}
+
+	/* Every queue needs at least one packet per second, as a rate of 0
+	 * means no limit
+	 */
+	if (bench->mode == XSK_BENCH_TXONLY && opt->rate &&
+	    opt->rate < bench->num_queues) {
+		pr_warn("A rate of %u pps can't be split over %zu queues\n",
+			opt->rate, bench->num_queues);
+		return -EINVAL;
+	}
+
+	if (bench->mode == XSK_BENCH_REDIRECT) {
+		bench->queue_cnt_fd = bpf_map__fd(skel->maps.xsk_queue_cnt);
+		bench->no_socket_key = bpf_map__max_entries(skel->maps.xsks_map);
+		bench->nr_cpus = libbpf_num_possible_cpus();
+		bench->queue_values = calloc(bench->nr_cpus,
+					     sizeof(*bench->queue_values));
+		if (!bench->queue_values)
+			return -ENOMEM;
+	}
+
+	bench->queues = calloc(bench->num_queues, sizeof(*bench->queues));
+	if (!bench->queues)
+		return -ENOMEM;
+
+	for (i = 0; i < bench->num_queues; i++) {
+		struct xsk_queue *q = &bench->queues[i];
+
+		q->bench = bench;
+		q->queue_id = opt->queues.num_vals ? opt->queues.vals[i] : i;
+		q->frame_base = (__u64)i * XSK_FRAMES_PER_QUEUE * XSK_FRAME_SIZE;
+
+		if (q->queue_id >= bpf_map__max_entries(skel->maps.xsks_map)) {
+			pr_warn("Queue %u is out of range (max %u)\n", q->queue_id,
+				bpf_map__max_entries(skel->maps.xsks_map) - 1);
+			return -EINVAL;
+		}
+	}
+
+	bench->umem_size = (__u64)bench->num_queues * XSK_FRAMES_PER_QUEUE *
+			   XSK_FRAME_SIZE;
+	bench->umem_area = mmap(NULL, bench->umem_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bench->umem_area == MAP_FAILED) {
+		bench->umem_area = NULL;
+		return -errno;
+	}
+
+	/* The first socket uses the fill and completion rings created along
+	 * with the UMEM; the rest get their own through create_shared().
+	 */
+	ret = xsk_umem__create(&bench->umem, bench->umem_area, bench->umem_size,
+			       &bench->queues[0].fill, &bench->queues[0].comp,
+			       &umem_cfg);
+	if (ret) {
+		pr_warn("Failed to create UMEM: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	if (bench->mode == XSK_BENCH_TXONLY) {
+		ret = get_mac_addr(opt->iface_in.ifindex, mac);
+		if (ret < 0)
+			pr_debug("Couldn't get MAC address of %s, using zero source address\n",
+				 opt->iface_in.ifname);
+	}
+
+	for (i = 0; i < bench->num_queues; i++) {
+		struct xsk_queue *q = &bench->queues[i];
+		__u32 f;
+
+		ret = xsk_socket__create_shared(&q->xsk, opt->iface_in.ifname,
+						q->queue_id, bench->umem,
+						use_rx ? &q->rx : NULL,
+						use_tx ? &q->tx : NULL,
+						&q->fill, &q->comp, &xsk_cfg);
+		if (ret) {
+			pr_warn("Failed to create AF_XDP socket on %s queue %u: %s\n",
+				opt->iface_in.ifname, q->queue_id, strerror(-ret));
+			return ret;
+		}
+
+		if (bench->mode == XSK_BENCH_TXONLY) {
+			for (f = 0; f < XSK_FRAMES_PER_QUEUE; f++)
+				xsk_gen_packet(xsk_umem__get_data(bench->umem_area,
+								  q->frame_base + (__u64)f * XSK_FRAME_SIZE),
+					       xsk_frame_len(opt, f), mac, opt,
+					       f % (opt->flows ?: 1));
+
+			/* Split the rate evenly, the first queues get the rest */
+			q->tx_rate = opt->rate / bench->num_queues +
+				     (i < opt->rate % bench->num_queues);
+			clock_gettime(CLOCK_MONOTONIC, &q->tx_start);
+			continue;
+		}
+
+		xsk_populate_fill_ring(q);
+
+		ret = xsk_socket__update_xskmap(q->xsk, map_fd);
+		if (ret) {
+			pr_warn("Failed to insert socket for queue %u into XSKMAP: %s\n",
+				q->queue_id, strerror(-ret));
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int do_xsk(const struct xsk_opts *opt, enum xsk_bench_mode mode)
+{
+	DECLARE_LIBBPF_OPTS(xdp_program_opts, opts);
+	struct xsk_bench bench = { .opt = opt, .mode = mode };
+	struct xdp_program *xdp_prog = NULL;
+	int ret = EXIT_FAIL_OPTION;
+	struct xdp_xsk *skel;
+	size_t i;
+
+	if (!opt->batch_size || opt->batch_size > XSK_RING_CONS__DEFAULT_NUM_DESCS) {
+		pr_warn("Batch size must be between 1 and %u\n",
+			XSK_RING_CONS__DEFAULT_NUM_DESCS);
+		return EXIT_FAIL_OPTION;
+	}
+
+	if (opt->extended)
+		sample_switch_mode();
+	sample_set_output_format(opt->format);
+
+	skel = xdp_xsk__open();
+	if (!skel) {
+		pr_warn("Failed to xdp_xsk__open: %s\n", strerror(errno));
+		ret = EXIT_FAIL_BPF;
+		goto end;
+	}
+
+	ret = sample_init_pre_load(skel, opt->iface_in.ifname);
+	if (ret < 0) {
+		pr_warn("Failed to sample_init_pre_load: %s\n", strerror(-ret));
+		ret = EXIT_FAIL_BPF;
+		goto end_destroy;
+	}
+
+	skel->rodata->queue_stats = mode == XSK_BENCH_REDIRECT;
+
+	opts.obj = skel->obj;
+	opts.prog_name = bpf_program__name(skel->progs.xdp_xsk_prog);
+	xdp_prog = xdp_program__create(&opts);
+	if (!xdp_prog) {
+		ret = -errno;
+		pr_warn("Couldn't open XDP program: %s\n",
+			strerror(-ret));
+		goto end_destroy;
+	}
+
+	ret = xdp_program__attach(xdp_prog, opt->iface_in.ifindex, opt->mode, 0);
+	if (ret < 0) {
+		pr_warn("Failed to attach XDP program: %s\n", strerror(-ret));
+		ret = EXIT_FAIL_BPF;
+		goto end_destroy;
+	}
+
+	ret = sample_init(skel, mask, 0, 0);
+	if (ret < 0) {
+		pr_warn("Failed to initialize sample: %s\n", strerror(-ret));
+		ret = EXIT_FAIL;
+		goto end_detach;
+	}
+
+	if (opt->latency) {
+		ret = latency_attach(xdp_prog);
+		if (ret < 0) {
+			ret = EXIT_FAIL_BPF;
+			goto end_detach;
+		}
+	}
+
+	if (opt->perf_counters) {
+		ret = perf_counters_open();
+		if (ret < 0) {
+			ret = EXIT_FAIL;
+			goto end_detach;
+		}
+	}
+
+	ret = xsk_bench_setup(&bench, skel);
+	if (ret < 0) {
+		ret = EXIT_FAIL_XDP;
+		goto end_xsk;
+	}
+
+	/* sample_init() blocked the signals we exit on, so the workers
+	 * inherit that mask and only the stats loop ever sees them.
+	 */
+	for (i = 0; i < bench.num_queues; i++) {
+		struct xsk_queue *q = &bench.queues[i];
+
+		ret = pthread_create(&q->thread, NULL, xsk_worker, q);
+		if (ret) {
+			pr_warn("Failed to start worker for queue %u: %s\n",
+				q->queue_id, strerror(ret));
+			ret = EXIT_FAIL;
+			goto end_stop;
+		}
+		q->thread_running = true;
+	}
+
+	pr_info("%s on %s (ifindex %d; driver %s) using %zu AF_XDP socket%s\n",
+		mode == XSK_BENCH_RXDROP ? "Dropping packets" :
+		mode == XSK_BENCH_TXONLY ? "Transmitting packets" :
+		mode == XSK_BENCH_REDIRECT ? "Redirecting packets to sockets" :
+					     "Forwarding packets",
+		opt->iface_in.ifname, opt->iface_in.ifindex,
+		get_driver_name(opt->iface_in.ifindex),
+		bench.num_queues, bench.num_queues > 1 ? "s" : "");
+
+	clock_gettime(CLOCK_MONOTONIC, &bench.prev_ts);
+	ret = sample_run(opt->interval_ms ?: opt->interval * 1000, xsk_print_stats, &bench);
+	if (ret < 0) {
+		pr_warn("Failed during sample run: %s\n", strerror(-ret));
+		ret = EXIT_FAIL;
+		goto end_stop;
+	}
+	ret = EXIT_OK;
+end_stop:
+	xsk_stop_workers(&bench);
+end_xsk:
+	xsk_bench_cleanup(&bench);
+end_detach:
+	xdp_program__detach(xdp_prog, opt->iface_in.ifindex, opt->mode, 0);
+end_destroy:
+	xdp_xsk__destroy(skel);
+end:
+	perf_counters_close();
+	latency_detach();
+	sample_teardown();
+	return ret;
+}
+
+int do_xsk_drop(const void *cfg, __unused const char *pin_root_path)
+{
+	const struct xsk_opts *opt = cfg;
+
+	return do_xsk(opt, XSK_BENCH_RXDROP);
+}
+
+int do_xsk_tx(const void *cfg, __unused const char *pin_root_path)
+{
+	const struct xsk_opts *opt = cfg;
+
+	return do_xsk(opt, XSK_BENCH_TXONLY);
+}
+
+int do_xsk_fwd(const void *cfg, __unused const char *pin_root_path)
+{
+	const struct xsk_opts *opt = cfg;
+
+	return do_xsk(opt, XSK_BENCH_L2FWD);
+}
+
+int do_redirect_xsk(const void *cfg, __unused const char *pin_root_path)
+{
+	const struct xsk_opts *opt = cfg;
+
+	return do_xsk(opt, XSK_BENCH_REDIRECT);
+}
+
+int do_tx_gen(const void *cfg, __unused const char *pin_root_path)
+{
+	const struct xsk_opts *opt = cfg;
+	size_t i;
+
+	if (!opt->flows || opt->flows > XSK_FRAMES_PER_QUEUE) {
+		pr_warn("Number of flows must be between 1 and %u\n",
+			XSK_FRAMES_PER_QUEUE);
+		return EXIT_FAIL_OPTION;
+	}
+
+	for (i = 0; i < opt->pkt_sizes.num_vals; i++) {
+		if (opt->pkt_sizes.vals[i] < XSK_TX_PKT_MIN ||
+		    opt->pkt_sizes.vals[i] > XSK_TX_PKT_MAX) {
+			pr_warn("Packet size must be between %u and %u bytes\n",
+				XSK_TX_PKT_MIN, XSK_TX_PKT_MAX);
+			return EXIT_FAIL_OPTION;
+		}
+	}
+
+	if ((opt->src_ip.af && opt->src_ip.af != AF_INET) ||
+	    (opt->dst_ip.af && opt->dst_ip.af != AF_INET)) {
+		pr_warn("Only IPv4 addresses are supported\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	return do_xsk(opt, XSK_BENCH_TXONLY);
+}
@@ -3,10 +3,11 @@
 #
 # shellcheck disable=2039
 #
-ALL_TESTS="test_help test_interfaces test_capt_pcap test_capt_pcapng test_capt_term test_exitentry test_snap test_multi_pkt test_perf_wakeup test_promiscuous_selfload test_promiscuous_preload test_none_xdp test_pname_parse test_multi_prog test_xdp_load"
+ALL_TESTS="test_help test_interfaces test_capt_pcap test_capt_pcapng test_capt_term test_exitentry test_snap test_headers_only test_filter test_sampling test_multi_pkt test_perf_wakeup test_perf_buffer test_capture_buffer test_threads test_promiscuous_selfload test_promiscuous_preload test_none_xdp test_pname_parse test_multi_prog test_multi_iface test_rotate test_flight_recorder test_redirect_targets test_mmap_write test_compress test_remote_write test_timestamps test_stats_only test_dedup_exit test_xdp_load"
 
 XDPDUMP=${XDPDUMP:-./xdpdump}
 XDP_LOADER=${XDP_LOADER:-../xdp-loader/xdp-loader}
+XDP_BENCH=${XDP_BENCH:-../xdp-bench/xdp-bench}
 
 RESULT=""
 
@@ -33,16 +34,42 @@ Usage: xdpdump [options]
 
 Options:
      --rx-capture <mode>          Capture point for the rx direction (valid values: entry,exit)
+     --capture-buffer <type>      Kernel to user space transport, default auto (valid values: auto,perf,ringbuf)
+     --clock <clock>              Clock the timestamps are based on, default realtime (valid values: realtime,tai)
+     --compress <type>            Compress the PcapNG --write file, default none (valid values: none,zstd,lz4)
+     --dedup-exit                 Leave out the data of packets unchanged on exit
  -D, --list-interfaces            Print the list of available interfaces
+     --filter <expr>              Only capture packets matching the filter expression
+     --flight-recorder <MB>       Keep the last <MB> of packets in memory, write out on SIGUSR1 or XDP_ABORTED
+     --headers-only               Only capture up to the innermost L4 header
      --load-xdp-mode <mode>       Mode used for --load-xdp-mode, default native (valid values: native,skb,hw,unspecified)
      --load-xdp-program           Load XDP trace program if no XDP program is loaded
- -i, --interface <ifname>         Name of interface to capture on
+ -i, --interface <ifname>         Name of interface to capture on, can be repeated
+     --legacy-buffer-size <MB>    Size of the ring used for legacy capture
+     --legacy-immediate           Deliver legacy capture packets as they arrive
+     --legacy-timeout <ms>        Time to fill a block of the legacy capture ring, default 1000
+     --map-programs <id>          Also capture on the devmap or cpumap program <id>, can be repeated
+     --mmap-size <MB>             Write PcapNG files through a mapping of <MB> at a time
+     --payload-length <bytes>     Payload bytes to capture with --headers-only
+     --perf-buffer-size <KB>      Size of each per-CPU perf buffer, default based on link speed
      --perf-wakeup <events>       Wake up xdpdump every <events> packets
+     --perf-watermark <bytes>     Wake up xdpdump every <bytes> of perf buffer data
+     --poll-timeout <ms>          Drain partially filled buffers every <ms>, default 1000
  -p, --program-names <prog>       Specific program to attach to
  -P, --promiscuous-mode           Open interface in promiscuous mode
+     --rate-limit <pps>           Capture at most <pps> packets per second per CPU
+     --redirect-targets           Report where captured packets are redirected to
+ -W, --rotate-count <count>       Reuse the capture files after <count> files
+ -G, --rotate-seconds <seconds>   Start a new capture file every <seconds>
+ -C, --rotate-size <MB>           Start a new capture file after <MB> million bytes
+     --sample-rate <n>            Capture one out of every <n> packets
+     --send-queue-size <MB>       Queue up to <MB> of packets for a tcp:// --write destination
  -s, --snapshot-length <snaplen>  Minimum bytes of packet to capture
+     --threads <threads>          Number of threads draining the perf buffers
+     --stats-only                 Only count packets, and print the rates every second
      --use-pcap                   Use legacy pcap format for XDP traces
- -w, --write <file>               Write raw packets to pcap file
+ -w, --write <file>               Write raw packets to pcap file, or stream PcapNG to tcp://<host>:<port>
+     --write-buffer-size <bytes>  Buffer size used when writing PcapNG files
  -x, --hex                        Print the full packet in hex
  -v, --verbose                    Enable verbose logging (-vv: more verbose)
      --version                    Display version information
@@ -53,7 +80,12 @@ END
 
     $XDPDUMP --help | grep -q "\-\-perf-wakeup"
     if [ $? -eq 1 ]; then
-        XDPDUMP_HELP_TEXT=$(echo "$XDPDUMP_HELP_TEXT" | sed '/--perf-wakeup <events>/d')
+        XDPDUMP_HELP_TEXT=$(echo "$XDPDUMP_HELP_TEXT" | sed '/--perf-wakeup <events>/d;/--perf-watermark <bytes>/d')
+    fi
+
+    $XDPDUMP --help | grep -q "\-\-threads"
+    if [ $? -eq 1 ]; then
+        XDPDUMP_HELP_TEXT=$(echo "$XDPDUMP_HELP_TEXT" | sed '/--threads <threads>/d')
     fi
 
     RESULT=$($XDPDUMP --help)
@@ -339,6 +371,107 @@ test_snap()
     $XDP_LOADER unload "$NS" --all || return 1
 }
 
+test_headers_only()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local PASS_REGEX="(xdp_test_prog_with_a_long_name\(\)@entry: packet size 118 bytes, captured 62 bytes on if_index [0-9]+, rx queue [0-9]+, id [0-9]+)"
+    local PASS_II_REGEX="(xdp_test_prog_with_a_long_name\(\)@entry: packet size 118 bytes, captured 66 bytes on if_index [0-9]+, rx queue [0-9]+, id [0-9]+)"
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name -x --headers-only")
+    $PING6 -W 2 -c 1 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+
+    if ! [[ $RESULT =~ $PASS_REGEX ]]; then
+        print_result "IPv6 packet headers not received"
+        return 1
+    fi
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name -x --headers-only --payload-length 4")
+    $PING6 -W 2 -c 1 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+
+    if ! [[ $RESULT =~ $PASS_II_REGEX ]]; then
+        print_result "IPv6 packet headers with payload not received"
+        return 1
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
+test_filter()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local PASS_REGEX="(xdp_test_prog_with_a_long_name\(\)@entry: packet size 118 bytes on if_index [0-9]+, rx queue [0-9]+, id [0-9]+)"
+    local MATCHING_FILTERS=("icmp6" "ip6 and host $INSIDE_IP6" "src host $OUTSIDE_IP6 and dst host $INSIDE_IP6")
+    local NON_MATCHING_FILTERS=("ip" "udp and port 53" "src host $INSIDE_IP6")
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    for FILTER in "${MATCHING_FILTERS[@]}" ; do
+        PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --filter \"$FILTER\"")
+        $PING6 -W 2 -c 1 "$INSIDE_IP6" || return 1
+        RESULT=$(stop_background "$PID")
+        if ! [[ $RESULT =~ $PASS_REGEX ]]; then
+            print_result "IPv6 packet not received for filter \"$FILTER\""
+            return 1
+        fi
+    done
+
+    for FILTER in "${NON_MATCHING_FILTERS[@]}" ; do
+        PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --filter \"$FILTER\"")
+        $PING6 -W 2 -c 1 "$INSIDE_IP6" || return 1
+        RESULT=$(stop_background "$PID")
+        if [[ $RESULT =~ $PASS_REGEX ]]; then
+            print_result "IPv6 packet received for filter \"$FILTER\""
+            return 1
+        fi
+    done
+
+    RESULT=$($XDPDUMP -i "$NS" --filter "tcp or udp" 2>&1)
+    if [[ $RESULT != *"only \"and\" is supported"* ]]; then
+        print_result "Unsupported filter was accepted"
+        return 1
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
+test_sampling()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local PASS_REGEX="xdp_test_prog_with_a_long_name\(\)@entry: packet size 118 bytes on if_index [0-9]+, rx queue [0-9]+, id [0-9]+"
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --sample-rate 5")
+    $PING6 -W 2 -c 10 -i 0.2 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    if [[ $(echo "$RESULT" | grep -cE "$PASS_REGEX") -ne 2 ]] ||
+       [[ $RESULT != *"8 packets skipped by sampling"* ]]; then
+        print_result "Unexpected number of packets captured with a sample rate of 5"
+        return 1
+    fi
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --rate-limit 10")
+    timeout 20 "$PING6" -q -W 2 -c 1000 -f "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    if [[ $(echo "$RESULT" | grep -cE "$PASS_REGEX") -gt 50 ]] ||
+       [[ $RESULT != *"packets skipped by sampling"* ]]; then
+        print_result "Rate limit of 10 packets per second not applied"
+        return 1
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
 test_multi_pkt()
 {
     skip_if_missing_kernel_symbol bpf_xdp_output_proto
@@ -389,7 +522,7 @@ test_perf_wakeup()
     for WAKEUP in "${WAKEUPS[@]}" ; do
 
         # We send a single packet to make sure flushing of the buffer works!
-        PID=$(start_background_no_stderr "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --perf-wakeup=$WAKEUP")
+        PID=$(start_background_no_stderr "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --capture-buffer=perf --perf-wakeup=$WAKEUP")
         $PING6 -W 2 -c 1 "$INSIDE_IP6" || return 1
         RESULT=$(stop_background "$PID")
 
@@ -399,7 +532,7 @@ test_perf_wakeup()
         fi
 
         # We sent 10k packets and see if the all arrive
-        PID=$(start_background_no_stderr "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --perf-wakeup=$WAKEUP")
+        PID=$(start_background_no_stderr "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --capture-buffer=perf --perf-wakeup=$WAKEUP")
         timeout 20 "$PING6" -q -W 2 -c 10000 -f  "$INSIDE_IP6" || return 1
         RESULT=$(stop_background "$PID")
         if ! [[ $RESULT =~ $PASS_10K_REGEX ]]; then
@@ -411,6 +544,94 @@ test_perf_wakeup()
     $XDP_LOADER unload "$NS" --all || return 1
 }
 
+test_perf_buffer()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local PASS_REGEX="(xdp_test_prog_with_a_long_name\(\)@entry: packet size 118 bytes on if_index [0-9]+, rx queue [0-9]+)"
+    local PASS_10K_REGEX="(xdp_test_prog_with_a_long_name\(\)@entry: packet size 118 bytes on if_index [0-9]+, rx queue [0-9]+, id 10000)"
+    local OPTIONS=("--perf-buffer-size 512 --poll-timeout 100")
+
+    $XDPDUMP -i $NS --poll-timeout 0 && return 1
+
+    $XDPDUMP --help | grep -q "\-\-perf-watermark"
+    if [ $? -eq 0 ]; then
+        $XDPDUMP -i $NS --perf-watermark 4096 --perf-wakeup 32 && return 1
+        OPTIONS+=("--perf-buffer-size 512 --perf-watermark 4096 --poll-timeout 100")
+    fi
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    for OPTION in "${OPTIONS[@]}" ; do
+
+        # A single packet must show up after the poll timeout, well below
+        # the watermark.
+        PID=$(start_background_no_stderr "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --capture-buffer=perf $OPTION")
+        $PING6 -W 2 -c 1 "$INSIDE_IP6" || return 1
+        sleep 0.5
+        RESULT=$(stop_background "$PID")
+
+        if ! [[ $RESULT =~ $PASS_REGEX ]]; then
+            print_result "IPv6 packet not received for \"$OPTION\""
+            return 1
+        fi
+
+        PID=$(start_background_no_stderr "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --capture-buffer=perf $OPTION")
+        timeout 20 "$PING6" -q -W 2 -c 10000 -f  "$INSIDE_IP6" || return 1
+        RESULT=$(stop_background "$PID")
+        if ! [[ $RESULT =~ $PASS_10K_REGEX ]]; then
+            print_result "IPv6 10k packet not received for \"$OPTION\""
+            return 1
+        fi
+    done
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
+test_capture_buffer()
+{
+    skip_if_missing_kernel_symbol bpf_ringbuf_reserve
+    skip_if_missing_trace_attach
+
+    local PASS_REGEX="(xdp_test_prog_with_a_long_name\(\)@entry: packet size 118 bytes on if_index [0-9]+, rx queue [0-9]+)"
+    local PASS_EXIT_REGEX="(xdp_test_prog_with_a_long_name\(\)@exit\[PASS\]: packet size 118 bytes on if_index [0-9]+, rx queue [0-9]+, id 1)"
+    local PASS_10K_REGEX="(xdp_test_prog_with_a_long_name\(\)@entry: packet size 118 bytes on if_index [0-9]+, rx queue [0-9]+, id 10000)"
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --capture-buffer=ringbuf -vv")
+    $PING6 -W 2 -c 1 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    if [[ $RESULT == *"Ring buffer capture is not supported"* ]]; then
+        $XDP_LOADER unload "$NS" --all
+        return "$SKIPPED_TEST"
+    fi
+    if [[ $RESULT != *"Capturing using the ring buffer"* ]] ||
+       ! [[ $RESULT =~ $PASS_REGEX ]]; then
+        print_result "IPv6 packet not received using the ring buffer"
+        return 1
+    fi
+
+    PID=$(start_background_no_stderr "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --capture-buffer=ringbuf --rx-capture=entry,exit")
+    $PING6 -W 2 -c 1 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    if ! [[ $RESULT =~ $PASS_EXIT_REGEX ]]; then
+        print_result "IPv6 exit packet not received using the ring buffer"
+        return 1
+    fi
+
+    PID=$(start_background_no_stderr "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --capture-buffer=ringbuf")
+    timeout 20 "$PING6" -q -W 2 -c 10000 -f  "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    if ! [[ $RESULT =~ $PASS_10K_REGEX ]]; then
+        print_result "IPv6 10k packet not received using the ring buffer"
+        return 1
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
 test_none_xdp()
 {
     local PASS_PKT="packet size 118 bytes on if_name \"$NS\""
@@ -429,6 +650,70 @@ test_none_xdp()
         print_result "Missing warning message"
         return 1
     fi
+
+    $XDPDUMP -i $NS --legacy-buffer-size 4096 && return 1
+
+    PID=$(start_background "$XDPDUMP -i $NS --legacy-buffer-size 16 --legacy-timeout 100")
+    $PING6 -W 2 -c 4 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    if [[ $(echo "$RESULT" | grep -c "$PASS_PKT") -lt 4 ]]; then
+        print_result "IPv6 packets not received with a tuned ring"
+        return 1
+    fi
+
+    PID=$(start_background "$XDPDUMP -i $NS --legacy-immediate")
+    $PING6 -W 2 -c 4 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    if [[ $(echo "$RESULT" | grep -c "$PASS_PKT") -lt 4 ]]; then
+        print_result "IPv6 packets not received in immediate mode"
+        return 1
+    fi
+}
+
+test_threads()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    $XDPDUMP --help | grep -q "\-\-threads"
+    if [ $? -eq 1 ]; then
+        # No support for perf_buffer__consume_buffer(), so return SKIP
+        return "$SKIPPED_TEST"
+    fi
+
+    local PASS_10K_REGEX="(xdp_test_prog_with_a_long_name\(\)@entry: packet size 118 bytes on if_index [0-9]+, rx queue [0-9]+, id 10000)"
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    PID=$(start_background_no_stderr "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --threads 4")
+    timeout 20 "$PING6" -q -W 2 -c 10000 -f  "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    if ! [[ $RESULT =~ $PASS_10K_REGEX ]]; then
+        print_result "IPv6 10k packet not received using multiple threads"
+        return 1
+    fi
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --threads 2 -w - 2> /dev/null | tcpdump -r - -n")
+    $PING6 -W 2 -c 4 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    if [[ $(echo "$RESULT" | grep -c "ICMP6, echo request") -ne 4 ]]; then
+        print_result "IPv6 packets not written correctly using multiple threads"
+        return 1
+    fi
+
+    local PCAP_FILE="/tmp/${NS}_PID_$$_$RANDOM.pcap"
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --threads 4 -w $PCAP_FILE")
+    timeout 20 "$PING6" -q -W 2 -c 1000 -f "$INSIDE_IP6" || (rm "$PCAP_FILE" >& /dev/null; return 1)
+    RESULT=$(stop_background "$PID") || (rm "$PCAP_FILE" >& /dev/null; return 1)
+    RESULT=$(tcpdump -r "$PCAP_FILE" -n -tt 2> /dev/null | awk '$1 < last { print "out of order: " $1 } { last = $1 }')
+    rm "$PCAP_FILE" >& /dev/null
+    if [ -n "$RESULT" ]; then
+        print_result "Packets not written in timestamp order using multiple threads"
+        return 1
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
 }
 
 test_promiscuous_selfload()
@@ -707,6 +992,365 @@ test_multi_prog()
     return 0
 }
 
+test_multi_iface()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local PCAP_FILE="/tmp/${NS}_PID_$$_$RANDOM.pcap"
+    local PASS_REGEX="(xdp_pass\(\)@entry: packet size 118 bytes on if_index [0-9]+, rx queue [0-9]+, id [0-9]+)"
+    local LISTEN_REGEX="listening on $NS, ingress XDP program ID [0-9]+ func xdp_pass, .*listening on lo, ingress XDP program ID [0-9]+ func xdpdump, "
+    local INFOS_REGEX="Name = ${NS}:xdp_pass\(\)@fentry.*Name = ${NS}:xdp_pass\(\)@fexit.*Name = lo:xdpdump\(\)@fentry.*Name = lo:xdpdump\(\)@fexit"
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/xdp_pass.o" || return 1
+
+    $XDPDUMP -i $NS -i $NS && return 1
+    $XDPDUMP -i $NS -i lo && return 1
+    $XDPDUMP -i $NS -i lo -p xdp_pass && return 1
+
+    PID=$(start_background "$XDPDUMP -i $NS -i lo --load-xdp-program --load-xdp-mode skb")
+    $PING6 -W 2 -c 1 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    if ! [[ $RESULT =~ $LISTEN_REGEX ]]; then
+        print_result "Not listening on both interfaces"
+        return 1
+    fi
+    if ! [[ $RESULT =~ $PASS_REGEX ]]; then
+        print_result "IPv6 packet not received"
+        return 1
+    fi
+
+    if command -v capinfos >/dev/null; then
+        PID=$(start_background "$XDPDUMP -i $NS -i lo --load-xdp-program --load-xdp-mode skb -w $PCAP_FILE --rx-capture=entry,exit")
+        $PING6 -W 2 -c 1 "$INSIDE_IP6" || (rm "$PCAP_FILE" >& /dev/null; return 1)
+        RESULT=$(stop_background "$PID") || (print_result "xdpdump failed"; rm "$PCAP_FILE" >& /dev/null; return 1)
+
+        RESULT=$(capinfos "$PCAP_FILE")
+        rm "$PCAP_FILE" >& /dev/null
+        if ! [[ $RESULT =~ $INFOS_REGEX ]]; then
+            print_result "Missing interface description blocks"
+            return 1
+        fi
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
+test_rotate()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local PCAP_FILE="/tmp/${NS}_PID_$$_$RANDOM.pcap"
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    $XDPDUMP -i $NS -G 1 && return 1
+    $XDPDUMP -i $NS -G 1 -w - && return 1
+    $XDPDUMP -i $NS -W 2 -w "$PCAP_FILE" && return 1
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name -w $PCAP_FILE -G 1 -W 2")
+    $PING6 -W 2 -c 4 -i 1 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+
+    if ! [ -s "${PCAP_FILE}.0" ] || ! [ -s "${PCAP_FILE}.1" ]; then
+        print_result "Capture files not rotated"
+        rm -f "${PCAP_FILE}".* >& /dev/null
+        return 1
+    fi
+    if [ -e "${PCAP_FILE}.2" ] || [ -e "$PCAP_FILE" ]; then
+        print_result "Capture files not numbered correctly"
+        rm -f "$PCAP_FILE" "${PCAP_FILE}".* >& /dev/null
+        return 1
+    fi
+    rm -f "${PCAP_FILE}".* >& /dev/null
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
+test_flight_recorder()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local PCAP_FILE="/tmp/${NS}_PID_$$_$RANDOM.pcap"
+    local WRITE_REGEX="Flight recorder wrote [0-9]+ packets to ${PCAP_FILE}\.0"
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    $XDPDUMP -i $NS --flight-recorder 1 -w "$PCAP_FILE" -G 1 && return 1
+    $XDPDUMP -i $NS --flight-recorder 1 -w "$PCAP_FILE" --use-pcap && return 1
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name -w $PCAP_FILE --flight-recorder 1")
+    $PING6 -W 2 -c 4 "$INSIDE_IP6" || return 1
+    if [ -e "${PCAP_FILE}.0" ]; then
+        print_result "Flight recorder wrote packets without a trigger"
+        stop_background "$PID"
+        rm -f "${PCAP_FILE}".* >& /dev/null
+        return 1
+    fi
+
+    pkill -USR1 -s "$PID" xdpdump
+    sleep 2
+    RESULT=$(stop_background "$PID")
+    if ! [[ $RESULT =~ $WRITE_REGEX ]]; then
+        print_result "Flight recorder not written on SIGUSR1"
+        rm -f "${PCAP_FILE}".* >& /dev/null
+        return 1
+    fi
+
+    RESULT=$(tcpdump -r "${PCAP_FILE}.0" -n 2> /dev/null)
+    rm -f "${PCAP_FILE}".* >& /dev/null
+    if [[ $(echo "$RESULT" | grep -c "ICMP6, echo request") -ne 4 ]]; then
+        print_result "IPv6 packets not written by the flight recorder"
+        return 1
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
+test_redirect_targets()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+    [ -x "$XDP_BENCH" ] || return "$SKIPPED_TEST"
+
+    local REDIRECT_REGEX="xdp_redirect_basic_prog\(\)@redirect: redirect to if_index [0-9]+, if_index [0-9]+, id [0-9]+"
+    local COMPAT_MSG="do not report the map type and id"
+    local BENCH_PID
+
+    $XDPDUMP -i $NS --redirect-targets --use-pcap -w - && return 1
+
+    # Send everything received on the interface straight back out
+    BENCH_PID=$(start_background_no_stderr "$XDP_BENCH redirect $NS $NS -m skb")
+
+    PID=$(start_background "$XDPDUMP -i $NS --redirect-targets")
+    $PING6 -W 2 -c 1 "$INSIDE_IP6"
+    RESULT=$(stop_background "$PID")
+    stop_background "$BENCH_PID" >/dev/null
+
+    if [[ $RESULT == *"$COMPAT_MSG"* ]]; then
+        return "$SKIPPED_TEST"
+    fi
+    if ! [[ $RESULT =~ $REDIRECT_REGEX ]]; then
+        print_result "Redirect target not reported"
+        return 1
+    fi
+}
+
+test_mmap_write()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local PCAP_FILE="/tmp/${NS}_PID_$$_$RANDOM.pcap"
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    $XDPDUMP -i $NS --mmap-size 4 -w - && return 1
+    $XDPDUMP -i $NS --mmap-size 4 -w "$PCAP_FILE" --use-pcap && return 1
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name -w $PCAP_FILE --mmap-size 4")
+    $PING6 -W 2 -c 4 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID") || (print_result "xdpdump failed"; rm "$PCAP_FILE" >& /dev/null; return 1)
+
+    # The preallocated space must be gone once the file is closed
+    if [ "$(stat -c %s "$PCAP_FILE")" -ge 4000000 ]; then
+        print_result "Capture file not truncated"
+        rm "$PCAP_FILE" >& /dev/null
+        return 1
+    fi
+
+    RESULT=$(tcpdump -r "$PCAP_FILE" -n 2> /dev/null)
+    rm "$PCAP_FILE" >& /dev/null
+    if [[ $(echo "$RESULT" | grep -c "ICMP6, echo request") -ne 4 ]]; then
+        print_result "IPv6 packets not written through the mapping"
+        return 1
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
+test_compress()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local PCAP_FILE="/tmp/${NS}_PID_$$_$RANDOM.pcapng.zst"
+
+    command -v zstd >/dev/null || return "$SKIPPED_TEST"
+
+    $XDPDUMP -i $NS --compress zstd && return 1
+    $XDPDUMP -i $NS --compress zstd -w "$PCAP_FILE" --use-pcap && return 1
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name -w $PCAP_FILE --compress zstd")
+    $PING6 -W 2 -c 4 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    if [[ "$RESULT" == *"built without zstd support"* ]]; then
+        $XDP_LOADER unload "$NS" --all
+        rm "$PCAP_FILE" >& /dev/null
+        return "$SKIPPED_TEST"
+    fi
+
+    RESULT=$(zstd -dc "$PCAP_FILE" | tcpdump -r - -n 2> /dev/null)
+    rm "$PCAP_FILE" >& /dev/null
+    if [[ $(echo "$RESULT" | grep -c "ICMP6, echo request") -ne 4 ]]; then
+        print_result "IPv6 packets not in the compressed file"
+        return 1
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
+test_remote_write()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local PCAP_FILE="/tmp/${NS}_PID_$$_$RANDOM.pcapng"
+    local PORT=$((20000 + RANDOM % 10000))
+    local LISTEN_PID
+
+    command -v python3 >/dev/null || return "$SKIPPED_TEST"
+
+    $XDPDUMP -i $NS -w tcp://127.0.0.1:$PORT --use-pcap && return 1
+    $XDPDUMP -i $NS -w tcp://127.0.0.1:$PORT --rotate-size 1 && return 1
+    $XDPDUMP -i $NS -w tcp://127.0.0.1 && return 1
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    # A minimal collector, writing what it receives to a file
+    timeout 30 python3 -c '
+import socket, sys
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(("127.0.0.1", int(sys.argv[1])))
+s.listen(1)
+c, _ = s.accept()
+with open(sys.argv[2], "wb") as f:
+    for data in iter(lambda: c.recv(65536), b""):
+        f.write(data)
+' "$PORT" "$PCAP_FILE" &
+    LISTEN_PID=$!
+    sleep 1
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name -w tcp://127.0.0.1:$PORT")
+    $PING6 -W 2 -c 4 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    wait "$LISTEN_PID"
+
+    if ! echo "$RESULT" | grep -q "^0 packets dropped by send queue"; then
+        print_result "Packets dropped by the send queue"
+        rm "$PCAP_FILE" >& /dev/null
+        return 1
+    fi
+
+    RESULT=$(tcpdump -r "$PCAP_FILE" -n 2> /dev/null)
+    rm "$PCAP_FILE" >& /dev/null
+    if [[ $(echo "$RESULT" | grep -c "ICMP6, echo request") -ne 4 ]]; then
+        print_result "IPv6 packets not received by the collector"
+        return 1
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
+test_timestamps()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local START END TS
+
+    $XDPDUMP -i $NS --clock bogus && return 1
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    # The packet timestamps must fall between the wall clock times taken
+    # around the ping, which is off by almost a second when the clock offset
+    # is only calculated to the second.
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name")
+    START=$(date +%s%N)
+    $PING6 -W 2 -c 1 "$INSIDE_IP6" || return 1
+    END=$(date +%s%N)
+    RESULT=$(stop_background "$PID")
+
+    TS=$(echo "$RESULT" | grep -m 1 -oE "^[0-9]+\.[0-9]{9}: xdp_test_prog_with_a_long_name" | cut -d: -f1 | tr -d .)
+    if [ -z "$TS" ] || [ "$TS" -lt "$START" ] || [ "$TS" -gt "$END" ]; then
+        print_result "Timestamp $TS not between $START and $END"
+        return 1
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
+test_stats_only()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local PASS_REGEX="exit +XDP_PASS +rxq [0-9]+ +ipv6 +icmp6 +[0-9]+ pkt/s"
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    $XDPDUMP -i $NS --stats-only -w - && return 1
+    $XDPDUMP -i $NS --stats-only --sample-rate 2 && return 1
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --rx-capture=entry,exit --stats-only")
+    $PING6 -W 2 -c 4 "$INSIDE_IP6" || return 1
+    sleep 1
+    RESULT=$(stop_background "$PID")
+
+    if ! [[ $RESULT =~ $PASS_REGEX ]]; then
+        print_result "No XDP_PASS rate for the IPv6 packets"
+        return 1
+    fi
+
+    if [[ "$RESULT" == *"packets captured"* ]]; then
+        print_result "Packets captured in stats only mode"
+        return 1
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
+test_dedup_exit()
+{
+    skip_if_missing_kernel_symbol bpf_xdp_output_proto
+    skip_if_missing_trace_attach
+
+    local PCAP_FILE="/tmp/${NS}_PID_$$_$RANDOM.pcapng"
+    local UNCHANGED_REGEX="xdp_test_prog_with_a_long_name\(\)@exit\[PASS\]: packet size 118 bytes on if_index [0-9]+, rx queue [0-9]+, id [0-9]+, unchanged"
+
+    $XDPDUMP -i $NS --dedup-exit && return 1
+    $XDPDUMP -i $NS --dedup-exit --rx-capture=entry,exit --use-pcap -w "$PCAP_FILE" && return 1
+
+    $XDP_LOADER load "$NS" "$TEST_PROG_DIR/test_long_func_name.o" || return 1
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --rx-capture=entry,exit --dedup-exit")
+    $PING6 -W 2 -c 1 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+    if ! [[ $RESULT =~ $UNCHANGED_REGEX ]]; then
+        print_result "IPv6 exit packet not reported as unchanged"
+        return 1
+    fi
+
+    PID=$(start_background "$XDPDUMP -i $NS -p xdp_test_prog_with_a_long_name --rx-capture=entry,exit --dedup-exit -w $PCAP_FILE")
+    $PING6 -W 2 -c 4 "$INSIDE_IP6" || return 1
+    RESULT=$(stop_background "$PID")
+
+    RESULT=$(tcpdump -r "$PCAP_FILE" -n 2> /dev/null)
+    rm "$PCAP_FILE" >& /dev/null
+    if [[ $(echo "$RESULT" | grep -c "ICMP6, echo request") -ne 4 ]]; then
+        print_result "IPv6 entry packets not in the capture file"
+        return 1
+    fi
+
+    $XDP_LOADER unload "$NS" --all || return 1
+}
+
 test_xdp_load()
 {
     local PASS_REGEX="(xdpdump\(\)@entry: packet size 118 bytes on if_index [0-9]+, rx queue [0-9]+, id [0-9]+)"
@@ -728,4 +1372,5 @@ test_xdp_load()
 cleanup_tests()
 {
     $XDP_LOADER unload "$NS" --all >/dev/null 2>&1
+    $XDP_LOADER unload lo --all >/dev/null 2>&1
 }
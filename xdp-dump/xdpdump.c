@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -19,19 +20,27 @@
 #include <bpf/btf.h>
 #include <bpf/libbpf.h>
 
+#include <arpa/inet.h>
+
 #include <linux/err.h>
 #include <linux/ethtool.h>
+#include <linux/if_ether.h>
 #include <linux/perf_event.h>
 #include <linux/sockios.h>
 
 #include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
 
 #define PCAP_DONT_INCLUDE_PCAP_BPF_H
 #include <pcap/dlt.h>
 #include <pcap/pcap.h>
 
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/sysinfo.h>
 #include <sys/utsname.h>
 
@@ -49,6 +58,27 @@
  *****************************************************************************/
 #define PROG_NAME "xdpdump"
 #define DEFAULT_SNAP_LEN 262144
+#define DEFAULT_WRITE_BUFFER_SIZE (1024 * 1024)
+#define DEFAULT_SEND_QUEUE_SIZE 16
+#define REMOTE_PREFIX "tcp://"
+#define DEFAULT_LEGACY_TIMEOUT 1000
+#define DEFAULT_POLL_TIMEOUT 1000
+#define MAX_LEGACY_BUFFER_SIZE 2047
+#define MAX_CAPTURE_THREADS 64
+#define MERGE_SLACK_NS 1000000ULL
+#define CLOCK_CALIBRATE_INTERVAL 1000000000ULL
+#define CLOCK_CALIBRATE_TRIES    5
+
+/* PcapNG comment of --dedup-exit packets, stored without their data */
+#define UNCHANGED_COMMENT "unchanged since entry"
+
+/* We can not include pcap/bpf.h as its struct bpf_program clashes with the
+ * libbpf one, so use a layout compatible definition for pcap_compile().
+ */
+struct pcap_bpf_program {
+	unsigned int  bf_len;
+	void         *bf_insns;
+};
 
 #ifndef ENOTSUPP
 #define ENOTSUPP         524 /* Operation is not supported */
@@ -63,6 +93,32 @@ struct flag_val rx_capture_flags[] = {
 	{}
 };
 
+enum capture_buffer {
+	CAPTURE_BUFFER_AUTO,
+	CAPTURE_BUFFER_PERF,
+	CAPTURE_BUFFER_RINGBUF,
+};
+
+struct enum_val capture_buffers[] = {
+	{"auto", CAPTURE_BUFFER_AUTO},
+	{"perf", CAPTURE_BUFFER_PERF},
+	{"ringbuf", CAPTURE_BUFFER_RINGBUF},
+	{NULL, 0}
+};
+
+struct enum_val compressions[] = {
+	{"none", XPCAPNG_COMPRESS_NONE},
+	{"zstd", XPCAPNG_COMPRESS_ZSTD},
+	{"lz4", XPCAPNG_COMPRESS_LZ4},
+	{NULL, 0}
+};
+
+struct enum_val clocks[] = {
+	{"realtime", CLOCK_REALTIME},
+	{"tai", CLOCK_TAI},
+	{NULL, 0}
+};
+
 struct enum_val xdp_modes[] = {
 	{"native", XDP_MODE_NATIVE},
 	{"skb", XDP_MODE_SKB},
@@ -72,25 +128,63 @@ struct enum_val xdp_modes[] = {
 };
 
 static const struct dumpopt {
+	bool                  dedup_exit;
 	bool                  hex_dump;
 	bool                  list_interfaces;
 	bool                  load_xdp;
+	bool                  headers_only;
+	bool                  legacy_immediate;
 	bool                  promiscuous;
+	bool                  redirect_targets;
+	bool                  stats_only;
 	bool                  use_pcap;
-	struct iface          iface;
+	struct iface         *ifaces;
+	struct u32_multi      map_prog_ids;
+	uint32_t              flight_recorder;
+	uint32_t              legacy_buffer_size;
+	uint32_t              legacy_timeout;
+	uint32_t              mmap_size;
+	uint32_t              payload_len;
+	uint32_t              perf_buffer_size;
 	uint32_t              perf_wakeup;
+	uint32_t              perf_watermark;
+	uint32_t              poll_timeout;
+	uint32_t              rate_limit;
+	uint32_t              rotate_count;
+	uint32_t              rotate_seconds;
+	uint32_t              rotate_size;
+	uint32_t              sample_rate;
+	uint32_t              send_queue_size;
+	uint32_t              threads;
 	uint32_t              snaplen;
+	uint32_t              write_buffer_size;
+	char                 *filter;
 	char                 *pcap_file;
 	char                 *program_names;
+	unsigned int          capture_buffer;
+	unsigned int          clock;
+	unsigned int          compress;
 	unsigned int          load_xdp_mode;
 	unsigned int          rx_capture;
+	struct trace_filter   capture_filter;
 } defaults_dumpopt = {
+	.dedup_exit = false,
 	.hex_dump = false,
 	.list_interfaces = false,
 	.load_xdp = false,
+	.legacy_immediate = false,
 	.promiscuous = false,
+	.redirect_targets = false,
+	.stats_only = false,
 	.use_pcap = false,
+	.legacy_timeout = DEFAULT_LEGACY_TIMEOUT,
+	.poll_timeout = DEFAULT_POLL_TIMEOUT,
 	.snaplen = DEFAULT_SNAP_LEN,
+	.write_buffer_size = DEFAULT_WRITE_BUFFER_SIZE,
+	.send_queue_size = DEFAULT_SEND_QUEUE_SIZE,
+	.capture_buffer = CAPTURE_BUFFER_AUTO,
+	.clock = CLOCK_REALTIME,
+	.compress = XPCAPNG_COMPRESS_NONE,
 	.load_xdp_mode = XDP_MODE_NATIVE,
 	.rx_capture = RX_FLAG_FENTRY,
 };
@@ -101,25 +195,81 @@ static struct prog_option xdpdump_options[] = {
 		      .metavar = "<mode>",
 		      .typearg = rx_capture_flags,
 		      .help = "Capture point for the rx direction"),
+	DEFINE_OPTION("capture-buffer", OPT_ENUM, struct dumpopt,
+		      capture_buffer,
+		      .typearg = capture_buffers,
+		      .metavar = "<type>",
+		      .help = "Kernel to user space transport, default auto"),
+	DEFINE_OPTION("clock", OPT_ENUM, struct dumpopt, clock,
+		      .typearg = clocks,
+		      .metavar = "<clock>",
+		      .help = "Clock the timestamps are based on, default realtime"),
+	DEFINE_OPTION("compress", OPT_ENUM, struct dumpopt, compress,
+		      .typearg = compressions,
+		      .metavar = "<type>",
+		      .help = "Compress the PcapNG --write file, default none"),
+	DEFINE_OPTION("dedup-exit", OPT_BOOL, struct dumpopt, dedup_exit,
+		      .help = "Leave out the data of packets unchanged on exit"),
 	DEFINE_OPTION("list-interfaces", OPT_BOOL, struct dumpopt,
 		      list_interfaces,
 		      .short_opt = 'D',
 		      .help = "Print the list of available interfaces"),
+	DEFINE_OPTION("filter", OPT_STRING, struct dumpopt, filter,
+		      .metavar = "<expr>",
+		      .help = "Only capture packets matching the filter expression"),
+	DEFINE_OPTION("flight-recorder", OPT_U32, struct dumpopt,
+		      flight_recorder,
+		      .metavar = "<MB>",
+		      .help = "Keep the last <MB> of packets in memory, write out on SIGUSR1 or XDP_ABORTED"),
+	DEFINE_OPTION("headers-only", OPT_BOOL, struct dumpopt, headers_only,
+		      .help = "Only capture up to the innermost L4 header"),
 	DEFINE_OPTION("load-xdp-mode", OPT_ENUM, struct dumpopt, load_xdp_mode,
 		      .typearg = xdp_modes,
 		      .metavar = "<mode>",
 		      .help = "Mode used for --load-xdp-mode, default native"),
 	DEFINE_OPTION("load-xdp-program", OPT_BOOL, struct dumpopt, load_xdp,
 		      .help = "Load XDP trace program if no XDP program is loaded"),
-	DEFINE_OPTION("interface", OPT_IFNAME, struct dumpopt, iface,
+	DEFINE_OPTION("interface", OPT_IFNAME_MULTI, struct dumpopt, ifaces,
 		      .short_opt = 'i',
 		      .metavar = "<ifname>",
-		      .help = "Name of interface to capture on"),
+		      .help = "Name of interface to capture on, can be repeated"),
+	DEFINE_OPTION("legacy-buffer-size", OPT_U32, struct dumpopt,
+		      legacy_buffer_size,
+		      .metavar = "<MB>",
+		      .help = "Size of the ring used for legacy capture"),
+	DEFINE_OPTION("legacy-immediate", OPT_BOOL, struct dumpopt,
+		      legacy_immediate,
+		      .help = "Deliver legacy capture packets as they arrive"),
+	DEFINE_OPTION("legacy-timeout", OPT_U32, struct dumpopt,
+		      legacy_timeout,
+		      .metavar = "<ms>",
+		      .help = "Time to fill a block of the legacy capture ring, default 1000"),
+	DEFINE_OPTION("map-programs", OPT_U32_MULTI, struct dumpopt,
+		      map_prog_ids,
+		      .metavar = "<id>",
+		      .help = "Also capture on the devmap or cpumap program <id>, can be repeated"),
+	DEFINE_OPTION("mmap-size", OPT_U32, struct dumpopt, mmap_size,
+		      .metavar = "<MB>",
+		      .help = "Write PcapNG files through a mapping of <MB> at a time"),
+	DEFINE_OPTION("payload-length", OPT_U32, struct dumpopt, payload_len,
+		      .metavar = "<bytes>",
+		      .help = "Payload bytes to capture with --headers-only"),
+	DEFINE_OPTION("perf-buffer-size", OPT_U32, struct dumpopt,
+		      perf_buffer_size,
+		      .metavar = "<KB>",
+		      .help = "Size of each per-CPU perf buffer, default based on link speed"),
 #ifdef HAVE_LIBBPF_PERF_BUFFER__CONSUME
 	DEFINE_OPTION("perf-wakeup", OPT_U32, struct dumpopt, perf_wakeup,
 		      .metavar = "<events>",
 		      .help = "Wake up xdpdump every <events> packets"),
+	DEFINE_OPTION("perf-watermark", OPT_U32, struct dumpopt,
+		      perf_watermark,
+		      .metavar = "<bytes>",
+		      .help = "Wake up xdpdump every <bytes> of perf buffer data"),
 #endif
+	DEFINE_OPTION("poll-timeout", OPT_U32, struct dumpopt, poll_timeout,
+		      .metavar = "<ms>",
+		      .help = "Drain partially filled buffers every <ms>, default 1000"),
 	DEFINE_OPTION("program-names", OPT_STRING, struct dumpopt,
 		      program_names,
 		      .short_opt = 'p',
@@ -129,16 +279,53 @@ static struct prog_option xdpdump_options[] = {
 		      promiscuous,
 		      .short_opt = 'P',
 		      .help = "Open interface in promiscuous mode"),
+	DEFINE_OPTION("rate-limit", OPT_U32, struct dumpopt, rate_limit,
+		      .metavar = "<pps>",
+		      .help = "Capture at most <pps> packets per second per CPU"),
+	DEFINE_OPTION("redirect-targets", OPT_BOOL, struct dumpopt,
+		      redirect_targets,
+		      .help = "Report where captured packets are redirected to"),
+	DEFINE_OPTION("rotate-count", OPT_U32, struct dumpopt, rotate_count,
+		      .short_opt = 'W',
+		      .metavar = "<count>",
+		      .help = "Reuse the capture files after <count> files"),
+	DEFINE_OPTION("rotate-seconds", OPT_U32, struct dumpopt,
+		      rotate_seconds,
+		      .short_opt = 'G',
+		      .metavar = "<seconds>",
+		      .help = "Start a new capture file every <seconds>"),
+	DEFINE_OPTION("rotate-size", OPT_U32, struct dumpopt, rotate_size,
+		      .short_opt = 'C',
+		      .metavar = "<MB>",
+		      .help = "Start a new capture file after <MB> million bytes"),
+	DEFINE_OPTION("sample-rate", OPT_U32, struct dumpopt, sample_rate,
+		      .metavar = "<n>",
+		      .help = "Capture one out of every <n> packets"),
+	DEFINE_OPTION("send-queue-size", OPT_U32, struct dumpopt,
+		      send_queue_size,
+		      .metavar = "<MB>",
+		      .help = "Queue up to <MB> of packets for a tcp:// --write destination"),
 	DEFINE_OPTION("snapshot-length", OPT_U32, struct dumpopt, snaplen,
 		      .short_opt = 's',
 		      .metavar = "<snaplen>",
 		      .help = "Minimum bytes of packet to capture"),
+#ifdef HAVE_LIBBPF_PERF_BUFFER__CONSUME_BUFFER
+	DEFINE_OPTION("threads", OPT_U32, struct dumpopt, threads,
+		      .metavar = "<threads>",
+		      .help = "Number of threads draining the perf buffers"),
+#endif
+	DEFINE_OPTION("stats-only", OPT_BOOL, struct dumpopt, stats_only,
+		      .help = "Only count packets, and print the rates every second"),
 	DEFINE_OPTION("use-pcap", OPT_BOOL, struct dumpopt, use_pcap,
 		      .help = "Use legacy pcap format for XDP traces"),
 	DEFINE_OPTION("write", OPT_STRING, struct dumpopt, pcap_file,
 		      .short_opt = 'w',
 		      .metavar = "<file>",
-		      .help = "Write raw packets to pcap file"),
+		      .help = "Write raw packets to pcap file, or stream PcapNG to tcp://<host>:<port>"),
+	DEFINE_OPTION("write-buffer-size", OPT_U32, struct dumpopt,
+		      write_buffer_size,
+		      .metavar = "<bytes>",
+		      .help = "Buffer size used when writing PcapNG files"),
 	DEFINE_OPTION("hex", OPT_BOOL, struct dumpopt, hex_dump,
 		      .short_opt = 'x',
 		      .help = "Print the full packet in hex"),
@@ -146,41 +333,116 @@ static struct prog_option xdpdump_options[] = {
 };
 
 #define MAX_LOADED_XDP_PROGRAMS  (MAX_DISPATCHER_ACTIONS + 1)
+#define MAX_CAPTURE_INTERFACES   16
+#define MAX_CAPTURE_PROGRAMS     (MAX_CAPTURE_INTERFACES * \
+				  MAX_LOADED_XDP_PROGRAMS)
+#define NR_REDIRECT_TRACEPOINTS  4
 
 struct capture_programs {
 	/* Contains a list of programs to capture on, with the respective
 	 * program names. The order MUST be the same as the loaded order!
+	 * When capturing on multiple interfaces, the programs of each
+	 * interface follow each other, all sharing the same buffer.
 	 */
 	unsigned int nr_of_progs;
+	bool         use_ringbuf;
 	struct prog_info {
 		struct xdp_program *prog;
 		const char         *func;
 		unsigned int        rx_capture;
+		struct iface       *iface;
+		/* First program run for a packet on this interface. */
+		bool                first;
+		/* Program run from a devmap or cpumap entry. */
+		bool                map_prog;
+		/* Capture only XDP program loaded by xdpdump. */
+		bool                load_xdp;
 		/* Fields used by the actual loader. */
 		bool                attached;
 		int                 perf_map_fd;
+		int                 ringbuf_map_fd;
+		int                 ringbuf_lost_fd;
+		int                 stats_map_fd;
 		struct bpf_object  *prog_obj;
 		struct bpf_link    *fentry_link;
 		struct bpf_link    *fexit_link;
-	} progs[MAX_LOADED_XDP_PROGRAMS];
+		struct bpf_link    *redirect_links[NR_REDIRECT_TRACEPOINTS];
+	} progs[MAX_CAPTURE_PROGRAMS];
+};
+
+/* In flight recorder mode the captured packets are kept in a ring in memory,
+ * with the oldest ones dropped to make room, until a trigger writes them
+ * all out to a new capture file.
+ */
+struct recorder_entry {
+	uint32_t size;		/* Entry size, 0 marks the end of the data */
+	uint32_t if_idx;
+	uint64_t ts;
+	uint64_t packet_id;
+	uint64_t dropcount;
+	uint32_t queue;
+	uint32_t pkt_len;
+	uint32_t cap_len;
+	int32_t  action;
+	bool     fexit;
+	bool     comment;	/* packet holds a comment, no packet data */
+	bool     unchanged;	/* fexit packet, same data as on fentry */
+	uint8_t  packet[] __attribute__((aligned(8)));
+};
+
+/* With --threads, the drain threads pass the samples of each CPU on to the
+ * main thread through one of these single producer, single consumer queues.
+ */
+struct queued_sample {
+	uint64_t                  len;	/* 0 marks a wrap to the start */
+	uint64_t                  time;
+	uint64_t                  lost;
+	struct pkt_trace_metadata metadata;
+	uint8_t                   packet[] __attribute__((aligned(8)));
+};
+
+struct sample_queue {
+	uint8_t  *buf;
+	size_t    size;
+	uint64_t  head;		/* Advanced by the main thread */
+	uint64_t  tail;		/* Advanced by the drain thread */
+	uint64_t  lost;		/* Owned by the drain thread */
+};
+
+struct flight_recorder {
+	uint8_t *buf;
+	size_t   size;
+	size_t   head;		/* Oldest entry */
+	size_t   tail;		/* Where the next entry goes */
+	size_t   entries;
 };
 
 struct perf_handler_ctx {
 	uint64_t                 missed_events;
 	uint64_t                 last_missed_events;
 	uint64_t                 captured_packets;
+	uint64_t                 sampled_out_packets;
 	uint64_t                 epoch_delta;
+	uint64_t                 epoch_calibrated;
 	uint64_t                 packet_id;
 	uint64_t                 cpu_packet_id[MAX_CPUS];
+	uint64_t                 ringbuf_lost;
+	uint64_t                 queue_dropped;
+	struct sample_queue     *queues;
 	struct dumpopt          *cfg;
 	struct capture_programs *xdp_progs;
 	pcap_t                  *pcap;
 	pcap_dumper_t           *pcap_dumper;
 	struct xpcapng_dumper   *pcapng_dumper;
+	unsigned int             file_index;
+	uint64_t                 file_start_ts;
+	char                     file_name[PATH_MAX];
+	struct flight_recorder   recorder;
 };
 
-bool    exit_xdpdump;
-pcap_t *exit_pcap;
+bool          exit_xdpdump;
+volatile bool dump_recorder;
+pcap_t       *exit_pcap;
 
 /*****************************************************************************
  * get_if_speed()
@@ -431,366 +693,1899 @@ static int snprinth(char *str, size_t size,
 }
 
 /*****************************************************************************
- * handle_perf_event()
+ * Capture file handling
  *****************************************************************************/
-static enum bpf_perf_event_ret handle_perf_event(void *private_data,
-						 int cpu,
-						 struct perf_event_header *event)
-{
-	uint64_t                  ts;
-	bool                      fexit;
-	unsigned int              if_idx, prog_idx;
-	const char               *xdp_func;
-	struct perf_handler_ctx  *ctx = private_data;
-	struct perf_sample_event *e = container_of(event,
-						   struct perf_sample_event,
-						   header);
-	struct perf_lost_event   *lost = container_of(event,
-						      struct perf_lost_event,
-						      header);
-
-	switch(e->header.type) {
-	case PERF_RECORD_SAMPLE:
+static char *get_loaded_program_info(struct dumpopt *cfg);
+static bool add_interfaces_to_pcapng(struct dumpopt *cfg,
+				     struct xpcapng_dumper *pcapng_dumper,
+				     struct capture_programs *progs);
 
-		if (cpu >= MAX_CPUS ||
-		    e->header.size < sizeof(struct perf_sample_event) ||
-		    e->size < (sizeof(struct pkt_trace_metadata) + e->metadata.cap_len) ||
-		    e->metadata.prog_index >= ctx->xdp_progs->nr_of_progs)
-			return LIBBPF_PERF_EVENT_CONT;
+/*****************************************************************************
+ * is_remote_capture()
+ *
+ * A --write destination of tcp://<host>:<port> streams the PcapNG blocks to
+ * a remote collector instead of a file.
+ *****************************************************************************/
+static bool is_remote_capture(const struct dumpopt *cfg)
+{
+	return cfg->pcap_file &&
+		!strncmp(cfg->pcap_file, REMOTE_PREFIX, strlen(REMOTE_PREFIX));
+}
 
-		fexit = e->metadata.flags & MDF_DIRECTION_FEXIT;
-		prog_idx = e->metadata.prog_index;
-		if_idx = prog_idx * 2 + (fexit ? 1 : 0);
-		xdp_func = ctx->xdp_progs->progs[prog_idx].func;
-
-		if (prog_idx == 0 &&
-		    (!fexit ||
-		     ctx->xdp_progs->progs[prog_idx].rx_capture == RX_FLAG_FEXIT))
-			ctx->cpu_packet_id[cpu] = ++ctx->packet_id;
-
-		ts = e->time + ctx->epoch_delta;
-
-		if (ctx->pcapng_dumper) {
-			struct xpcapng_epb_options_s options = {};
-			int64_t  action = e->metadata.action;
-			uint32_t queue = e->metadata.rx_queue;
-
-			options.flags = PCAPNG_EPB_FLAG_INBOUND;
-			options.dropcount = ctx->last_missed_events;
-			options.packetid = &ctx->cpu_packet_id[cpu];
-			options.queue = &queue;
-			options.xdp_verdict = fexit ? &action : NULL;
-
-			xpcapng_dump_enhanced_pkt(ctx->pcapng_dumper,
-						  if_idx,
-						  e->packet,
-						  e->metadata.pkt_len,
-						  min(e->metadata.cap_len,
-						      ctx->cfg->snaplen),
-						  ts,
-						  &options);
+/*****************************************************************************
+ * connect_remote()
+ *
+ * Connect to <host>:<port>, where an IPv6 host address is in brackets.
+ * Returns the socket, or -1 after reporting the error.
+ *****************************************************************************/
+static int connect_remote(const char *dest)
+{
+	struct addrinfo  hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res, *ai;
+	char             host[256];
+	const char      *port;
+	size_t           len;
+	int              fd = -1, err;
+
+	if (dest[0] == '[') {
+		port = strchr(dest, ']');
+		if (port == NULL || port[1] != ':')
+			goto invalid;
+		dest++;
+		len = port - dest;
+		port += 2;
+	} else {
+		port = strrchr(dest, ':');
+		if (port == NULL)
+			goto invalid;
+		len = port - dest;
+		port++;
+	}
+	if (!len || len >= sizeof(host) || !*port)
+		goto invalid;
+	memcpy(host, dest, len);
+	host[len] = 0;
 
-			ctx->last_missed_events = 0;
-			if (ctx->cfg->pcap_file[0] == '-' &&
-			    ctx->cfg->pcap_file[1] == 0)
-				xpcapng_dump_flush(ctx->pcapng_dumper);
-		} else if (ctx->pcap_dumper) {
-			struct pcap_pkthdr h;
-
-			h.ts.tv_sec = ts / 1000000000ULL;
-			h.ts.tv_usec = ts % 1000000000ULL / 1000;
-			h.caplen = min(e->metadata.cap_len, ctx->cfg->snaplen);
-			h.len = e->metadata.pkt_len;
-			pcap_dump((u_char *) ctx->pcap_dumper, &h,
-				  e->packet);
-
-			if (ctx->cfg->pcap_file[0] == '-' &&
-			    ctx->cfg->pcap_file[1] == 0)
-				pcap_dump_flush(ctx->pcap_dumper);
-		} else {
-			int  i;
-			char hline[SNPRINTH_MIN_BUFFER_SIZE];
-
-			if (ctx->cfg->hex_dump) {
-				printf("%llu.%09lld: %s()@%s%s: packet size %u "
-				       "bytes, captured %u bytes on if_index "
-				       "%u, rx queue %u, id %"PRIu64"\n",
-				       ts / 1000000000ULL,
-				       ts % 1000000000ULL,
-				       xdp_func,
-				       fexit ? "exit" : "entry",
-				       fexit ? get_xdp_action_string(
-					       e->metadata.action) : "",
-				       e->metadata.pkt_len,
-				       e->metadata.cap_len,
-				       e->metadata.ifindex,
-				       e->metadata.rx_queue,
-				       ctx->cpu_packet_id[cpu]);
-
-				for (i = 0; i < e->metadata.cap_len; i += 16) {
-					snprinth(hline, sizeof(hline),
-						 e->packet,
-						 e->metadata.cap_len, i);
-					printf("  %s\n", hline);
-				}
-			} else {
-				printf("%llu.%09lld: %s()@%s%s: packet size %u "
-				       "bytes on if_index %u, rx queue %u, "
-				       "id %"PRIu64"\n",
-				       ts / 1000000000ULL,
-				       ts % 1000000000ULL,
-				       xdp_func,
-				       fexit ? "exit" : "entry",
-				       fexit ? get_xdp_action_string(
-					       e->metadata.action) : "",
-				       e->metadata.pkt_len,e->metadata.ifindex,
-				       e->metadata.rx_queue,
-				       ctx->cpu_packet_id[cpu]);
-			}
-		}
-		ctx->captured_packets++;
-		break;
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err) {
+		pr_warn("ERROR: Can't resolve %s: %s\n", host, gai_strerror(err));
+		return -1;
+	}
 
-	case PERF_RECORD_LOST:
-		ctx->missed_events += lost->lost;
-		ctx->last_missed_events += lost->lost;
-		break;
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		err = errno;
+		close(fd);
+		fd = -1;
+		errno = err;
 	}
+	freeaddrinfo(res);
 
-	return LIBBPF_PERF_EVENT_CONT;
+	if (fd < 0)
+		pr_warn("ERROR: Can't connect to %s port %s: %s\n", host, port,
+			strerror(errno));
+	return fd;
+
+invalid:
+	pr_warn("ERROR: Remote destination must be %s<host>:<port>!\n",
+		REMOTE_PREFIX);
+	return -1;
 }
 
 /*****************************************************************************
- * get_epoch_to_uptime_delta()
+ * numbered_capture_files()
+ *
+ * When rotating, or writing out the flight recorder, each capture file gets
+ * a .<n> suffix, with <n> wrapping at --rotate-count.
  *****************************************************************************/
-static uint64_t get_epoch_to_uptime_delta(void)
+static bool numbered_capture_files(struct dumpopt *cfg)
 {
-	/* This function will calculate the rough delta between uptime
-	 * seconds and the epoch time. This is not a precise delta as there is
-	 * a delay between calling the two functions below (and time() being in
-	 * seconds), but it's good enough to get a general offset. The delta
-	 * between packets is still based on the timestamps from the trace
-	 * infrastructure.
-	 */
-	struct timespec ts;
-	uint64_t        uptime;
-	uint64_t        epoch = time(NULL) * 1000000000ULL;
-
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	uptime = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
-
-	return epoch - uptime;
+	return cfg->rotate_size || cfg->rotate_seconds || cfg->flight_recorder;
 }
 
 /*****************************************************************************
- * capture_on_legacy_interface()
+ * open_capture_file()
  *****************************************************************************/
-static bool capture_on_legacy_interface(struct dumpopt *cfg)
+static bool open_capture_file(struct perf_handler_ctx *ctx)
 {
-	bool              rc = false;
-	char              errbuf[PCAP_ERRBUF_SIZE];
-	uint64_t          captured_packets = 0;
-	pcap_t           *pcap = NULL;
-	pcap_dumper_t    *pcap_dumper = NULL;
-	struct pcap_stat  ps;
-
-	/* Open pcap handle for live capture. */
-	if (cfg->rx_capture != RX_FLAG_FENTRY) {
-		pr_warn("ERROR: For legacy capture only \"--rx-capture entry\""
-			" is supported!\n");
-		goto error_exit;
-	}
+	struct dumpopt *cfg = ctx->cfg;
+	char           *program_info;
+	struct utsname  utinfo;
+	char            os_info[260];
+
+	if (!numbered_capture_files(cfg)) {
+		snprintf(ctx->file_name, sizeof(ctx->file_name), "%s",
+			 cfg->pcap_file);
+	} else {
+		if (try_snprintf(ctx->file_name, sizeof(ctx->file_name),
+				 "%s.%u", cfg->pcap_file, ctx->file_index)) {
+			pr_warn("ERROR: Could not format capture file name!\n");
+			return false;
+		}
 
-	pcap = pcap_open_live(cfg->iface.ifname, cfg->snaplen,
-			      cfg->promiscuous, 1000, errbuf);
-	if (pcap == NULL) {
-		pr_warn("ERROR: Can't open pcap live interface: %s\n", errbuf);
-		goto error_exit;
+		ctx->file_index++;
+		if (cfg->rotate_count && ctx->file_index >= cfg->rotate_count)
+			ctx->file_index = 0;
 	}
+	ctx->file_start_ts = 0;
 
-	/* Open the pcap handle for pcap file. */
-	if (cfg->pcap_file) {
-		pcap_dumper = pcap_dump_open(pcap, cfg->pcap_file);
-		if (!pcap_dumper) {
+	if (cfg->use_pcap) {
+		ctx->pcap_dumper = pcap_dump_open(ctx->pcap, ctx->file_name);
+		if (!ctx->pcap_dumper) {
 			pr_warn("ERROR: Can't open pcap file for writing!\n");
-			goto error_exit;
+			return false;
 		}
+		return true;
 	}
 
-	/* No more error conditions, display some capture information */
-	fprintf(stderr, "listening on %s, link-type %s (%s), "
-		"capture size %d bytes\n", cfg->iface.ifname,
-		pcap_datalink_val_to_name(pcap_datalink(pcap)),
-		pcap_datalink_val_to_description(pcap_datalink(pcap)),
-		cfg->snaplen);
+	memset(&utinfo, 0, sizeof(utinfo));
+	uname(&utinfo);
 
-	/* Loop for receive packets on live interface. */
-	exit_pcap = pcap;
-	while (!exit_xdpdump) {
-		const uint8_t      *packet;
-		struct pcap_pkthdr  h;
+	os_info[0] = 0;
+	if (try_snprintf(os_info, sizeof(os_info), "%s %s %s %s",
+			 utinfo.sysname, utinfo.nodename,
+			 utinfo.release, utinfo.version)) {
+		pr_warn("ERROR: Could not format OS information!\n");
+		return false;
+	}
 
-		packet = pcap_next(pcap, &h);
-		if (!packet)
-			continue;
+	program_info = get_loaded_program_info(cfg);
+	if (!program_info) {
+		pr_warn("ERROR: Could not format program information!\n");
+		return false;
+	}
 
-		if (pcap_dumper) {
-			pcap_dump((u_char *) pcap_dumper, &h, packet);
+	if (is_remote_capture(cfg)) {
+		int fd = connect_remote(cfg->pcap_file + strlen(REMOTE_PREFIX));
 
-			if (cfg->pcap_file[0] == '-' && cfg->pcap_file[1] == 0)
-				pcap_dump_flush(pcap_dumper);
-		} else {
-			size_t i;
-			char hline[SNPRINTH_MIN_BUFFER_SIZE];
-
-			if (cfg->hex_dump) {
-				printf("%ld.%06ld: packet size %u bytes, "
-				       "captured %u bytes on if_name \"%s\"\n",
-				       (long) h.ts.tv_sec, (long) h.ts.tv_usec,
-				       h.len, h.caplen, cfg->iface.ifname);
-
-				for (i = 0; i < h.caplen; i += 16) {
-					snprinth(hline, sizeof(hline),
-						 packet, h.caplen, i);
-					printf("  %s\n", hline);
-				}
-			} else {
-				printf("%ld.%06ld: packet size %u bytes on "
-				       "if_name \"%s\"\n",
-				       (long) h.ts.tv_sec, (long) h.ts.tv_usec,
-				       h.len, cfg->iface.ifname);
-			}
+		if (fd < 0) {
+			free(program_info);
+			return false;
 		}
-		captured_packets++;
+		ctx->pcapng_dumper = xpcapng_dump_open_fd(fd, cfg->compress,
+							  program_info,
+							  utinfo.machine,
+							  os_info,
+							  "xdpdump v"
+							  TOOLS_VERSION);
+	} else {
+		ctx->pcapng_dumper = xpcapng_dump_open_compressed(ctx->file_name,
+								  cfg->compress,
+								  program_info,
+								  utinfo.machine,
+								  os_info,
+								  "xdpdump v"
+								  TOOLS_VERSION);
 	}
-	exit_pcap = NULL;
-	rc = true;
-
-	fprintf(stderr, "\n%"PRIu64" packets captured\n", captured_packets);
-	if (pcap_stats(pcap, &ps) == 0) {
-		fprintf(stderr, "%u packets dropped by kernel\n", ps.ps_drop);
-		if (ps.ps_ifdrop != 0)
-			fprintf(stderr, "%u packets dropped by interface\n",
-				ps.ps_ifdrop);
+	free(program_info);
+	if (!ctx->pcapng_dumper) {
+		if (errno == ENOTSUP)
+			pr_warn("ERROR: xdpdump was built without %s support!\n",
+				get_enum_name(compressions, cfg->compress));
+		else
+			pr_warn("ERROR: Can't open PcapNG file for writing!\n");
+		return false;
 	}
 
-error_exit:
+	if (is_remote_capture(cfg)) {
+		if (xpcapng_dump_set_send_queue(ctx->pcapng_dumper,
+						cfg->send_queue_size * 1000000ULL)) {
+			pr_warn("ERROR: Can't allocate PcapNG send queue: %s\n",
+				strerror(errno));
+			return false;
+		}
+	} else if (cfg->mmap_size) {
+		if (xpcapng_dump_set_mmap(ctx->pcapng_dumper,
+					  cfg->mmap_size * 1000000ULL)) {
+			pr_warn("ERROR: Can't map PcapNG file %s: %s\n",
+				ctx->file_name, strerror(errno));
+			return false;
+		}
+	} else if (xpcapng_dump_set_buffer_size(ctx->pcapng_dumper,
+						cfg->write_buffer_size)) {
+		pr_warn("ERROR: Can't allocate PcapNG write buffer: %s\n",
+			strerror(errno));
+		return false;
+	}
 
-	if (pcap_dumper)
-		pcap_dump_close(pcap_dumper);
+	if (!add_interfaces_to_pcapng(cfg, ctx->pcapng_dumper,
+				      ctx->xdp_progs)) {
+		/* Error output is handled in add_interfaces_to_pcapng() */
+		return false;
+	}
+	return true;
+}
 
-	if (pcap)
-		pcap_close(pcap);
+/*****************************************************************************
+ * close_capture_file()
+ *****************************************************************************/
+static void close_capture_file(struct perf_handler_ctx *ctx)
+{
+	xpcapng_dump_close(ctx->pcapng_dumper);
+	ctx->pcapng_dumper = NULL;
 
-	return rc;
+	if (ctx->pcap_dumper)
+		pcap_dump_close(ctx->pcap_dumper);
+	ctx->pcap_dumper = NULL;
 }
 
 /*****************************************************************************
- * append_snprintf()
+ * rotate_capture_file()
+ *
+ * Called before writing a packet with timestamp ts. Once the current file
+ * is too large, or too old, it gets closed and the next one is opened. Just
+ * the file is replaced, the trace programs keep running.
  *****************************************************************************/
-int append_snprintf(char **buf, size_t *buf_len, size_t *offset,
-		    const char *format, ...)
+static bool rotate_capture_file(struct perf_handler_ctx *ctx, uint64_t ts)
 {
-	int     len;
-	va_list args;
+	struct dumpopt *cfg = ctx->cfg;
+	bool            rotate = false;
 
-	if (buf == NULL || *buf == NULL || buf_len == NULL || *buf_len <= 0 ||
-	    offset == NULL || *buf_len - *offset <= 0)
-		return -EINVAL;
+	if (!cfg->rotate_size && !cfg->rotate_seconds)
+		return true;
 
-	while (true) {
-		char   *new_buf;
-		size_t  new_buf_len;
+	if (cfg->rotate_seconds && ctx->file_start_ts &&
+	    ts - ctx->file_start_ts >= cfg->rotate_seconds * 1000000000ULL)
+		rotate = true;
 
-		va_start(args, format);
-		len = vsnprintf(*buf + *offset, *buf_len - *offset, format, args);
-		va_end(args);
+	if (cfg->rotate_size) {
+		uint64_t size = 0;
 
-		if ((size_t)len < (*buf_len - *offset)) {
-			*offset += len;
-			len = 0;
-			break;
+		if (ctx->pcapng_dumper)
+			size = xpcapng_dump_size(ctx->pcapng_dumper);
+		else if (pcap_dump_ftell(ctx->pcap_dumper) > 0)
+			size = pcap_dump_ftell(ctx->pcap_dumper);
+
+		if (size >= cfg->rotate_size * 1000000ULL)
+			rotate = true;
+	}
+
+	if (rotate) {
+		close_capture_file(ctx);
+		if (!open_capture_file(ctx)) {
+			/* Errors are reported in open_capture_file() */
+			close_capture_file(ctx);
+			exit_xdpdump = true;
+			return false;
 		}
+		pr_debug("Rotated to capture file %s\n", ctx->file_name);
+	}
 
-		if (*buf_len >= 2048)
-			return -ENOMEM;
+	if (!ctx->file_start_ts)
+		ctx->file_start_ts = ts;
+	return true;
+}
 
-		new_buf_len = *buf_len * 2;
-		new_buf = realloc(*buf, new_buf_len);
+/*****************************************************************************
+ * Flight recorder
+ *
+ * Entries are stored back to back in the ring. If an entry does not fit
+ * before the end of the ring, the end of the data is marked by a zero size,
+ * and the entry is stored at the start. The oldest entries are dropped
+ * until there is enough room.
+ *****************************************************************************/
+static struct recorder_entry *recorder_entry_at(struct flight_recorder *fr,
+						size_t offset)
+{
+	return (struct recorder_entry *)(fr->buf + offset);
+}
 
-		if (!new_buf)
-			return -ENOMEM;
+/*****************************************************************************
+ * flight_recorder_init()
+ *****************************************************************************/
+static bool flight_recorder_init(struct flight_recorder *fr, size_t size)
+{
+	void *buf;
 
-		*buf = new_buf;
-		*buf_len = new_buf_len;
+	/* Lazily backed by the kernel, so only the part of the ring that was
+	 * used takes up memory.
+	 */
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (buf == MAP_FAILED) {
+		pr_warn("ERROR: Can't allocate flight recorder memory: %s\n",
+			strerror(errno));
+		return false;
 	}
-	return len;
+
+	memset(fr, 0, sizeof(*fr));
+	fr->buf = buf;
+	fr->size = size & ~(size_t)7;
+	return true;
 }
 
 /*****************************************************************************
- * get_program_names_all()
+ * flight_recorder_free()
  *****************************************************************************/
-static char *get_program_names_all(struct capture_programs *progs, int skip_index)
+static void flight_recorder_free(struct flight_recorder *fr)
 {
-	char   *program_names;
-	size_t  size = 128;
-	size_t  offset = 0;
+	if (fr->buf)
+		munmap(fr->buf, fr->size);
 
-	program_names = malloc(size);
-	if (!program_names)
-		return NULL;
+	memset(fr, 0, sizeof(*fr));
+}
 
-	for (unsigned int i = 0; i < progs->nr_of_progs; i++) {
-		const char *kname = xdp_program__name(progs->progs[i].prog);
-		const char *fname = progs->progs[i].func;
-		uint32_t id = xdp_program__id(progs->progs[i].prog);
+/*****************************************************************************
+ * flight_recorder_drop()
+ *****************************************************************************/
+static void flight_recorder_drop(struct flight_recorder *fr)
+{
+	fr->head += recorder_entry_at(fr, fr->head)->size;
+	fr->entries--;
 
-		if (skip_index != (int)i) {
-			if (append_snprintf(&program_names, &size, &offset,
-					    "%s%s@%d", i == 0 ? "" : ",",
-					    fname ? fname : kname, id) < 0) {
-				free(program_names);
-				return NULL;
-			}
-		} else {
-			if (append_snprintf(&program_names, &size, &offset,
-					    "%s%s@%d", i == 0 ? "" : ",",
-					    "<function_name>", id) < 0) {
-				free(program_names);
-				return NULL;
-			}
-		}
-	}
-	return program_names;
+	if (fr->entries &&
+	    (fr->head >= fr->size || recorder_entry_at(fr, fr->head)->size == 0))
+		fr->head = 0;
 }
 
 /*****************************************************************************
- * find_func_matches()
+ * flight_recorder_reserve()
  *****************************************************************************/
-static size_t find_func_matches(const struct btf *btf,
-				const char *func_name,
-				const char **found_name,
-				bool print, int print_id, bool exact)
+static struct recorder_entry *flight_recorder_reserve(struct flight_recorder *fr,
+						      size_t cap_len)
 {
-	const struct btf_type *t, *match;
-	size_t len, matches = 0;
-	const char *name;
-	int nr_types, i;
+	struct recorder_entry *entry;
+	size_t                 need;
 
-	if (!btf) {
-		pr_debug("No BTF found for program\n");
-		return 0;
-	}
+	need = roundup(sizeof(*entry) + cap_len, 8);
+	if (need > fr->size)
+		return NULL;
 
-	len = strlen(func_name);
+	for (;;) {
+		if (!fr->entries)
+			fr->head = fr->tail = 0;
 
-	nr_types = btf__type_cnt(btf);
-	for (i = 1; i < nr_types; i++) {
-		t = btf__type_by_id(btf, i);
-		if (!btf_is_func(t))
-			continue;
+		/* Not wrapped, free space is at the end, and the start */
+		if (!fr->entries || fr->head < fr->tail) {
+			if (fr->size - fr->tail >= need)
+				break;
 
-		name = btf__name_by_offset(btf, t->name_off);
+			if (fr->size - fr->tail >= sizeof(entry->size))
+				memset(fr->buf + fr->tail, 0, sizeof(entry->size));
+			fr->tail = 0;
+		}
+
+		/* Wrapped, free space is between the newest and oldest */
+		if (fr->head - fr->tail >= need)
+			break;
+
+		flight_recorder_drop(fr);
+	}
+
+	entry = recorder_entry_at(fr, fr->tail);
+	entry->size = need;
+	fr->tail += need;
+	fr->entries++;
+	return entry;
+}
+
+/*****************************************************************************
+ * flight_recorder_dump()
+ *
+ * Write all packets held by the flight recorder to a new capture file, and
+ * start over with an empty recorder.
+ *****************************************************************************/
+static bool flight_recorder_dump(struct perf_handler_ctx *ctx)
+{
+	struct flight_recorder *fr = &ctx->recorder;
+	size_t                  packets = fr->entries;
+	bool                    rc = true;
+
+	if (!packets) {
+		fprintf(stderr, "Flight recorder is empty, nothing written\n");
+		return true;
+	}
+
+	if (!open_capture_file(ctx)) {
+		close_capture_file(ctx);
+		return false;
+	}
+
+	while (fr->entries) {
+		struct recorder_entry        *e = recorder_entry_at(fr, fr->head);
+		struct xpcapng_epb_options_s  options = {};
+		int64_t                       action = e->action;
+
+		options.flags = PCAPNG_EPB_FLAG_INBOUND;
+		options.dropcount = e->dropcount;
+		options.packetid = &e->packet_id;
+		options.queue = &e->queue;
+		options.xdp_verdict = e->fexit ? &action : NULL;
+		if (e->unchanged)
+			options.comment = UNCHANGED_COMMENT;
+		if (e->comment) {
+			options.flags = PCAPNG_EPB_FLAG_OUTBOUND;
+			options.dropcount = 0;
+			options.queue = NULL;
+			options.comment = (const char *)e->packet;
+		}
+
+		if (rc && !xpcapng_dump_enhanced_pkt(ctx->pcapng_dumper,
+						     e->if_idx, e->packet,
+						     e->pkt_len, e->cap_len,
+						     e->ts, &options)) {
+			pr_warn("ERROR: Can't write flight recorder to %s: %s\n",
+				ctx->file_name, strerror(errno));
+			rc = false;
+		}
+		flight_recorder_drop(fr);
+	}
+	close_capture_file(ctx);
+
+	if (rc)
+		fprintf(stderr, "Flight recorder wrote %zu packets to %s\n",
+			packets, ctx->file_name);
+	return rc;
+}
+
+/*****************************************************************************
+ * check_flight_recorder()
+ *
+ * Write out the flight recorder if this was requested by a signal.
+ *****************************************************************************/
+static void check_flight_recorder(struct perf_handler_ctx *ctx)
+{
+	if (!dump_recorder)
+		return;
+
+	dump_recorder = false;
+	if (!flight_recorder_dump(ctx))
+		exit_xdpdump = true;
+}
+
+/*****************************************************************************
+ * format_redirect_target()
+ *****************************************************************************/
+static void format_redirect_target(char *buf, size_t len,
+				   const struct pkt_trace_metadata *metadata)
+{
+	size_t n;
+
+	switch (metadata->redirect_map_type) {
+	case BPF_MAP_TYPE_UNSPEC:
+		n = snprintf(buf, len, "redirect to if_index %u",
+			     metadata->redirect_index);
+		break;
+	case BPF_MAP_TYPE_DEVMAP:
+	case BPF_MAP_TYPE_DEVMAP_HASH:
+		if (metadata->redirect_index)
+			n = snprintf(buf, len, "redirect to if_index %u via devmap %u",
+				     metadata->redirect_index,
+				     metadata->redirect_map_id);
+		else
+			n = snprintf(buf, len, "broadcast via devmap %u",
+				     metadata->redirect_map_id);
+		break;
+	case BPF_MAP_TYPE_CPUMAP:
+		n = snprintf(buf, len, "redirect to cpu %u via cpumap %u",
+			     metadata->redirect_index,
+			     metadata->redirect_map_id);
+		break;
+	case BPF_MAP_TYPE_XSKMAP:
+		n = snprintf(buf, len, "redirect to queue %u via xskmap %u",
+			     metadata->redirect_index,
+			     metadata->redirect_map_id);
+		break;
+	default:
+		n = snprintf(buf, len, "redirect to index %u via map %u",
+			     metadata->redirect_index,
+			     metadata->redirect_map_id);
+		break;
+	}
+
+	if (metadata->redirect_err && n < len)
+		snprintf(buf + n, len - n, " failed: %s",
+			 strerror(-metadata->redirect_err));
+}
+
+/*****************************************************************************
+ * get_clock_delta()
+ *
+ * Return the offset of the selected clock to CLOCK_MONOTONIC, which is what
+ * the capture timestamps are based on. The clock is read between two
+ * CLOCK_MONOTONIC reads, and the tightest of a few tries is used, which
+ * keeps the error well below a microsecond.
+ *****************************************************************************/
+static uint64_t get_clock_delta(clockid_t clock)
+{
+	struct timespec before, ts, after;
+	uint64_t        window, best_window = UINT64_MAX;
+	uint64_t        mono, delta = 0;
+
+	for (int i = 0; i < CLOCK_CALIBRATE_TRIES; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		clock_gettime(clock, &ts);
+		clock_gettime(CLOCK_MONOTONIC, &after);
+
+		window = (after.tv_sec - before.tv_sec) * 1000000000ULL +
+			 after.tv_nsec - before.tv_nsec;
+		if (window >= best_window)
+			continue;
+
+		best_window = window;
+		mono = before.tv_sec * 1000000000ULL + before.tv_nsec +
+		       window / 2;
+		delta = ts.tv_sec * 1000000000ULL + ts.tv_nsec - mono;
+	}
+	return delta;
+}
+
+/*****************************************************************************
+ * get_timestamp()
+ *
+ * Convert a CLOCK_MONOTONIC capture time to the selected clock. The offset
+ * is redone every CLOCK_CALIBRATE_INTERVAL, so adjustments of the clock,
+ * like NTP or PTP corrections, show up in the timestamps.
+ *****************************************************************************/
+static uint64_t get_timestamp(struct perf_handler_ctx *ctx, uint64_t time)
+{
+	if (time > ctx->epoch_calibrated + CLOCK_CALIBRATE_INTERVAL) {
+		ctx->epoch_calibrated = time;
+		ctx->epoch_delta = get_clock_delta(ctx->cfg->clock);
+	}
+
+	return time + ctx->epoch_delta;
+}
+
+/*****************************************************************************
+ * pcapng_write_failed()
+ *
+ * A packet that did not fit the send queue is dropped, and the next packet
+ * written carries it in its dropcount. Any other error while streaming means
+ * the collector is gone, so the capture stops.
+ *****************************************************************************/
+static void pcapng_write_failed(struct perf_handler_ctx *ctx,
+				uint64_t dropcount)
+{
+	if (errno == ENOBUFS) {
+		ctx->last_missed_events = dropcount + 1;
+		ctx->queue_dropped++;
+		return;
+	}
+
+	ctx->last_missed_events = 0;
+	if (is_remote_capture(ctx->cfg) && !exit_xdpdump) {
+		pr_warn("ERROR: Can't send packets to %s: %s\n",
+			ctx->cfg->pcap_file, strerror(errno));
+		exit_xdpdump = true;
+	}
+}
+
+/*****************************************************************************
+ * handle_redirect_event()
+ *
+ * Redirect events belong to the last packet captured on the same CPU. They
+ * are stored as an empty outbound packet with a comment in PcapNG files, and
+ * not at all in legacy pcap files.
+ *****************************************************************************/
+static void handle_redirect_event(struct perf_handler_ctx *ctx, int cpu,
+				  uint64_t time,
+				  const struct pkt_trace_metadata *metadata)
+{
+	unsigned int  if_idx = metadata->prog_index * 2 + 1;
+	uint64_t      ts = get_timestamp(ctx, time);
+	char          target[128];
+
+	format_redirect_target(target, sizeof(target), metadata);
+
+	if (!rotate_capture_file(ctx, ts))
+		return;
+
+	if (ctx->recorder.buf) {
+		struct recorder_entry *e;
+		size_t                 len = strlen(target) + 1;
+
+		e = flight_recorder_reserve(&ctx->recorder, len);
+		if (e) {
+			e->if_idx = if_idx;
+			e->ts = ts;
+			e->packet_id = ctx->cpu_packet_id[cpu];
+			e->dropcount = 0;
+			e->queue = 0;
+			e->pkt_len = 0;
+			e->cap_len = 0;
+			e->action = XDP_REDIRECT;
+			e->fexit = true;
+			e->comment = true;
+			memcpy(e->packet, target, len);
+		}
+	} else if (ctx->pcapng_dumper) {
+		struct xpcapng_epb_options_s options = {};
+		int64_t action = XDP_REDIRECT;
+
+		options.flags = PCAPNG_EPB_FLAG_OUTBOUND;
+		options.packetid = &ctx->cpu_packet_id[cpu];
+		options.xdp_verdict = &action;
+		options.comment = target;
+
+		xpcapng_dump_enhanced_pkt(ctx->pcapng_dumper, if_idx,
+					  (const uint8_t *)target, 0, 0, ts,
+					  &options);
+
+		if (ctx->cfg->pcap_file[0] == '-' &&
+		    ctx->cfg->pcap_file[1] == 0)
+			xpcapng_dump_flush(ctx->pcapng_dumper);
+	} else if (!ctx->pcap_dumper) {
+		printf("%llu.%09lld: %s()@redirect: %s, if_index %u, "
+		       "id %"PRIu64"\n",
+		       ts / 1000000000ULL,
+		       ts % 1000000000ULL,
+		       ctx->xdp_progs->progs[metadata->prog_index].func,
+		       target, metadata->ifindex, ctx->cpu_packet_id[cpu]);
+	}
+}
+
+/*****************************************************************************
+ * handle_trace_sample()
+ *****************************************************************************/
+static void handle_trace_sample(struct perf_handler_ctx *ctx, int cpu,
+				uint64_t time,
+				const struct pkt_trace_metadata *metadata,
+				const uint8_t *packet)
+{
+	uint64_t                  ts;
+	bool                      fexit, unchanged;
+	unsigned int              if_idx, prog_idx;
+	const char               *xdp_func;
+
+	if (metadata->flags & MDF_REDIRECT) {
+		handle_redirect_event(ctx, cpu, time, metadata);
+		return;
+	}
+
+	fexit = metadata->flags & MDF_DIRECTION_FEXIT;
+	unchanged = metadata->flags & MDF_UNCHANGED;
+	prog_idx = metadata->prog_index;
+	if_idx = prog_idx * 2 + (fexit ? 1 : 0);
+	xdp_func = ctx->xdp_progs->progs[prog_idx].func;
+
+	if (ctx->xdp_progs->progs[prog_idx].first &&
+	    (!fexit ||
+	     ctx->xdp_progs->progs[prog_idx].rx_capture == RX_FLAG_FEXIT))
+		ctx->cpu_packet_id[cpu] = ++ctx->packet_id;
+
+	ts = get_timestamp(ctx, time);
+
+	if (!rotate_capture_file(ctx, ts))
+		return;
+
+	if (ctx->recorder.buf) {
+		struct recorder_entry *e;
+		uint32_t               cap_len = min(metadata->cap_len,
+						     ctx->cfg->snaplen);
+
+		e = flight_recorder_reserve(&ctx->recorder, cap_len);
+		if (e) {
+			e->if_idx = if_idx;
+			e->ts = ts;
+			e->packet_id = ctx->cpu_packet_id[cpu];
+			e->dropcount = ctx->last_missed_events +
+				metadata->sampled_out;
+			e->queue = metadata->rx_queue;
+			e->pkt_len = metadata->pkt_len;
+			e->cap_len = cap_len;
+			e->action = metadata->action;
+			e->fexit = fexit;
+			e->comment = false;
+			e->unchanged = unchanged;
+			memcpy(e->packet, packet, cap_len);
+			ctx->last_missed_events = 0;
+		}
+
+		if (dump_recorder ||
+		    (fexit && metadata->action == XDP_ABORTED)) {
+			dump_recorder = false;
+			if (!flight_recorder_dump(ctx))
+				exit_xdpdump = true;
+		}
+	} else if (ctx->pcapng_dumper) {
+		struct xpcapng_epb_options_s options = {};
+		int64_t  action = metadata->action;
+		uint32_t queue = metadata->rx_queue;
+
+		options.flags = PCAPNG_EPB_FLAG_INBOUND;
+		options.dropcount = ctx->last_missed_events +
+			metadata->sampled_out;
+		options.packetid = &ctx->cpu_packet_id[cpu];
+		options.queue = &queue;
+		options.xdp_verdict = fexit ? &action : NULL;
+		if (unchanged)
+			options.comment = UNCHANGED_COMMENT;
+
+		if (xpcapng_dump_enhanced_pkt(ctx->pcapng_dumper,
+					      if_idx,
+					      packet,
+					      metadata->pkt_len,
+					      min(metadata->cap_len,
+						  ctx->cfg->snaplen),
+					      ts,
+					      &options))
+			ctx->last_missed_events = 0;
+		else
+			pcapng_write_failed(ctx, options.dropcount);
+		if (ctx->cfg->pcap_file[0] == '-' &&
+		    ctx->cfg->pcap_file[1] == 0)
+			xpcapng_dump_flush(ctx->pcapng_dumper);
+	} else if (ctx->pcap_dumper) {
+		struct pcap_pkthdr h;
+
+		h.ts.tv_sec = ts / 1000000000ULL;
+		h.ts.tv_usec = ts % 1000000000ULL / 1000;
+		h.caplen = min(metadata->cap_len, ctx->cfg->snaplen);
+		h.len = metadata->pkt_len;
+		pcap_dump((u_char *) ctx->pcap_dumper, &h, packet);
+
+		if (ctx->cfg->pcap_file[0] == '-' &&
+		    ctx->cfg->pcap_file[1] == 0)
+			pcap_dump_flush(ctx->pcap_dumper);
+	} else {
+		int  i;
+		char hline[SNPRINTH_MIN_BUFFER_SIZE];
+
+		if (ctx->cfg->hex_dump) {
+			printf("%llu.%09lld: %s()@%s%s: packet size %u "
+			       "bytes, captured %u bytes on if_index "
+			       "%u, rx queue %u, id %"PRIu64"%s\n",
+			       ts / 1000000000ULL,
+			       ts % 1000000000ULL,
+			       xdp_func,
+			       fexit ? "exit" : "entry",
+			       fexit ? get_xdp_action_string(
+				       metadata->action) : "",
+			       metadata->pkt_len,
+			       metadata->cap_len,
+			       metadata->ifindex,
+			       metadata->rx_queue,
+			       ctx->cpu_packet_id[cpu],
+			       unchanged ? ", unchanged" : "");
+
+			for (i = 0; i < metadata->cap_len; i += 16) {
+				snprinth(hline, sizeof(hline),
+					 packet,
+					 metadata->cap_len, i);
+				printf("  %s\n", hline);
+			}
+		} else {
+			printf("%llu.%09lld: %s()@%s%s: packet size %u "
+			       "bytes on if_index %u, rx queue %u, "
+			       "id %"PRIu64"%s\n",
+			       ts / 1000000000ULL,
+			       ts % 1000000000ULL,
+			       xdp_func,
+			       fexit ? "exit" : "entry",
+			       fexit ? get_xdp_action_string(
+				       metadata->action) : "",
+			       metadata->pkt_len, metadata->ifindex,
+			       metadata->rx_queue,
+			       ctx->cpu_packet_id[cpu],
+			       unchanged ? ", unchanged" : "");
+		}
+	}
+	ctx->captured_packets++;
+	ctx->sampled_out_packets += metadata->sampled_out;
+}
+
+#ifdef HAVE_LIBBPF_PERF_BUFFER__CONSUME_BUFFER
+/*****************************************************************************
+ * sample_queue_push()
+ *
+ * Called by the drain thread owning the CPU's perf buffer. Samples that do
+ * not fit are counted as lost, and reported with the next one that does.
+ *****************************************************************************/
+static void sample_queue_push(struct sample_queue *q, uint64_t time,
+			      const struct pkt_trace_metadata *metadata,
+			      const uint8_t *packet)
+{
+	struct queued_sample *s;
+	uint64_t              head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	uint64_t              tail = q->tail;
+	size_t                len, room;
+
+	if (!q->buf) {
+		q->lost++;
+		return;
+	}
+
+	len = sizeof(*s) + metadata->cap_len;
+	len = (len + 7) & ~7UL;
+	room = q->size - tail % q->size;
+
+	if (tail + len + (room < len ? room : 0) - head > q->size) {
+		q->lost++;
+		return;
+	}
+
+	if (room < len) {
+		((struct queued_sample *)(q->buf + tail % q->size))->len = 0;
+		tail += room;
+	}
+
+	s = (struct queued_sample *)(q->buf + tail % q->size);
+	s->len = len;
+	s->time = time;
+	s->lost = q->lost;
+	s->metadata = *metadata;
+	memcpy(s->packet, packet, metadata->cap_len);
+	q->lost = 0;
+
+	__atomic_store_n(&q->tail, tail + len, __ATOMIC_RELEASE);
+}
+
+/*****************************************************************************
+ * sample_queue_peek()
+ *
+ * Return the oldest sample in the queue, or NULL if it is empty. Only called
+ * by the main thread.
+ *****************************************************************************/
+static struct queued_sample *sample_queue_peek(struct sample_queue *q)
+{
+	struct queued_sample *s;
+	uint64_t              tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+	if (q->head == tail)
+		return NULL;
+
+	s = (struct queued_sample *)(q->buf + q->head % q->size);
+	if (s->len)
+		return s;
+
+	/* Skip the unused space at the end of the buffer. */
+	__atomic_store_n(&q->head, q->head + q->size - q->head % q->size,
+			 __ATOMIC_RELEASE);
+	return (struct queued_sample *)q->buf;
+}
+
+/*****************************************************************************
+ * sample_queue_pop()
+ *****************************************************************************/
+static void sample_queue_pop(struct sample_queue *q, struct queued_sample *s)
+{
+	__atomic_store_n(&q->head, q->head + s->len, __ATOMIC_RELEASE);
+}
+#endif
+
+/*****************************************************************************
+ * handle_perf_event()
+ *****************************************************************************/
+static enum bpf_perf_event_ret handle_perf_event(void *private_data,
+						 int cpu,
+						 struct perf_event_header *event)
+{
+	struct perf_handler_ctx  *ctx = private_data;
+	struct perf_sample_event *e = container_of(event,
+						   struct perf_sample_event,
+						   header);
+	struct perf_lost_event   *lost = container_of(event,
+						      struct perf_lost_event,
+						      header);
+
+	switch(e->header.type) {
+	case PERF_RECORD_SAMPLE:
+
+		if (cpu >= MAX_CPUS ||
+		    e->header.size < sizeof(struct perf_sample_event) ||
+		    e->size < (sizeof(struct pkt_trace_metadata) + e->metadata.cap_len) ||
+		    e->metadata.prog_index >= ctx->xdp_progs->nr_of_progs)
+			return LIBBPF_PERF_EVENT_CONT;
+
+#ifdef HAVE_LIBBPF_PERF_BUFFER__CONSUME_BUFFER
+		if (ctx->queues) {
+			sample_queue_push(&ctx->queues[cpu], e->time,
+					  &e->metadata, e->packet);
+			break;
+		}
+#endif
+		handle_trace_sample(ctx, cpu, e->time, &e->metadata,
+				    e->packet);
+		break;
+
+	case PERF_RECORD_LOST:
+#ifdef HAVE_LIBBPF_PERF_BUFFER__CONSUME_BUFFER
+		if (ctx->queues) {
+			if (cpu < MAX_CPUS)
+				ctx->queues[cpu].lost += lost->lost;
+			break;
+		}
+#endif
+		ctx->missed_events += lost->lost;
+		ctx->last_missed_events += lost->lost;
+		break;
+	}
+
+	return LIBBPF_PERF_EVENT_CONT;
+}
+
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+/*****************************************************************************
+ * handle_ringbuf_event()
+ *****************************************************************************/
+static int handle_ringbuf_event(void *private_data, void *data, size_t size)
+{
+	struct perf_handler_ctx     *ctx = private_data;
+	struct ringbuf_sample_event *e = data;
+
+	if (size < sizeof(*e) ||
+	    size < sizeof(*e) + e->metadata.cap_len ||
+	    e->cpu >= MAX_CPUS ||
+	    e->metadata.prog_index >= ctx->xdp_progs->nr_of_progs)
+		return 0;
+
+	handle_trace_sample(ctx, e->cpu, e->time, &e->metadata, e->packet);
+	return 0;
+}
+
+/*****************************************************************************
+ * update_ringbuf_lost()
+ *****************************************************************************/
+static void update_ringbuf_lost(struct perf_handler_ctx *ctx, int lost_fd)
+{
+	unsigned int nr_cpus = libbpf_num_possible_cpus();
+	uint64_t     values[nr_cpus];
+	uint64_t     total = 0;
+	uint32_t     key = 0;
+
+	if (bpf_map_lookup_elem(lost_fd, &key, values))
+		return;
+
+	for (unsigned int i = 0; i < nr_cpus; i++)
+		total += values[i];
+
+	if (total > ctx->ringbuf_lost) {
+		ctx->missed_events += total - ctx->ringbuf_lost;
+		ctx->last_missed_events += total - ctx->ringbuf_lost;
+		ctx->ringbuf_lost = total;
+	}
+}
+
+/*****************************************************************************
+ * get_perf_buffer_pages()
+ *
+ * Return the number of pages of each per-CPU perf buffer. Unless set with
+ * --perf-buffer-size, size them to hold PERF_AUTO_BUFFER_MSEC of full-sized
+ * frames at the combined link speed of the interfaces, spread over all CPUs.
+ * The old fixed PERF_MMAP_PAGE_COUNT is used as the minimum, and when the
+ * link speed is unknown.
+ *****************************************************************************/
+static uint32_t get_perf_buffer_pages(struct dumpopt *cfg)
+{
+	uint64_t      want = 0, speed = 0;
+	uint32_t      pages = 1;
+	uint32_t      page_size = getpagesize();
+	struct iface *iface;
+
+	if (cfg->perf_buffer_size) {
+		want = (uint64_t) cfg->perf_buffer_size * 1024;
+	} else {
+		for (iface = cfg->ifaces; iface; iface = iface->next)
+			speed += get_if_speed(iface);
+
+		if (speed) {
+			/* Frames per second on the wire, including the FCS,
+			 * preamble and inter-frame gap, times the bytes each
+			 * one takes up in the perf buffer.
+			 */
+			want = speed / 8 / (ETH_FRAME_LEN + ETH_FCS_LEN + 20);
+			want *= min(cfg->snaplen, (uint32_t) ETH_FRAME_LEN) +
+				PERF_SAMPLE_OVERHEAD;
+			want = want * PERF_AUTO_BUFFER_MSEC / 1000 /
+				(libbpf_num_possible_cpus() ?: 1);
+			want = min(want, PERF_AUTO_MAX_SIZE);
+		}
+		want = max(want, (uint64_t) PERF_MMAP_PAGE_COUNT * page_size);
+	}
+
+	/* libbpf requires a power of two number of pages. */
+	while ((uint64_t) pages * page_size < want && pages < (1U << 31))
+		pages <<= 1;
+
+	pr_debug("Using %u KB perf buffers%s\n", pages * (page_size / 1024),
+		 cfg->perf_buffer_size ? "" :
+		 speed ? ", based on the link speed" : "");
+	return pages;
+}
+
+/*****************************************************************************
+ * get_ringbuf_size()
+ *****************************************************************************/
+static uint32_t get_ringbuf_size(void)
+{
+	/* Size the shared ring buffer to hold the same amount of data as the
+	 * per-CPU perf buffers would, rounded to the power of two the kernel
+	 * requires.
+	 */
+	uint64_t want = (uint64_t) PERF_MMAP_PAGE_COUNT * getpagesize() *
+		(libbpf_num_possible_cpus() ?: 1);
+	uint64_t size = getpagesize();
+
+	while (size < want && size < RINGBUF_MAX_SIZE)
+		size <<= 1;
+
+	return size;
+}
+#endif
+
+#ifdef HAVE_LIBBPF_PERF_BUFFER__CONSUME_BUFFER
+/*****************************************************************************
+ * Perf buffer drain threads
+ *
+ * The drain threads only move the samples of their CPUs to per-CPU queues.
+ * The main thread merges these queues in timestamp order and does all the
+ * output, so the pcap, PcapNG and console output need no locking, and look
+ * the same as when capturing from a single thread.
+ *
+ * A CPU's samples are in timestamp order, but other threads may still be
+ * about to queue older samples of their CPUs. Each thread therefore records
+ * the time just before it last drained all of its buffers, and the main
+ * thread only writes out samples older than the earliest of these times,
+ * minus MERGE_SLACK_NS for samples that were timestamped but not yet in the
+ * perf buffer. Packets can thus be written up to --poll-timeout later than
+ * with a single thread.
+ *****************************************************************************/
+struct capture_thread {
+	pthread_t                thread;
+	int                      epoll_fd;
+	struct perf_buffer      *perf_buf;
+	struct perf_handler_ctx *ctx;
+	unsigned int             index;
+	unsigned int             nr_threads;
+	uint64_t                 drained;
+	bool                     started;
+};
+
+static pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  merge_wake = PTHREAD_COND_INITIALIZER;
+static uint64_t        merge_gen;
+static bool            merge_flush;
+
+/*****************************************************************************
+ * capture_thread_drain()
+ *
+ * Drain all of the thread's buffers, not only the ones that woke it up, so
+ * the time it records holds for all of them, and wake up the main thread.
+ *****************************************************************************/
+static void capture_thread_drain(struct capture_thread *ct)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (size_t i = ct->index; i < perf_buffer__buffer_cnt(ct->perf_buf);
+	     i += ct->nr_threads)
+		perf_buffer__consume_buffer(ct->perf_buf, i);
+
+	__atomic_store_n(&ct->drained, now.tv_sec * 1000000000ULL + now.tv_nsec,
+			 __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&merge_lock);
+	merge_gen++;
+	pthread_cond_signal(&merge_wake);
+	pthread_mutex_unlock(&merge_lock);
+}
+
+/*****************************************************************************
+ * capture_thread_main()
+ *****************************************************************************/
+static void *capture_thread_main(void *arg)
+{
+	struct capture_thread *ct = arg;
+	struct epoll_event     events[MAX_CPUS];
+	int                    cnt;
+
+	while (!exit_xdpdump) {
+		cnt = epoll_wait(ct->epoll_fd, events, ARRAY_SIZE(events),
+				 ct->ctx->cfg->poll_timeout);
+		if (cnt < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_warn("ERROR: Perf buffer polling failed: %s(%d)\n",
+				strerror(errno), errno);
+			exit_xdpdump = true;
+			break;
+		}
+		/* Write out buffered packets while the link is idle. */
+		if (cnt == 0)
+			__atomic_store_n(&merge_flush, true, __ATOMIC_RELAXED);
+
+		capture_thread_drain(ct);
+	}
+
+	capture_thread_drain(ct);
+	return NULL;
+}
+
+/*****************************************************************************
+ * merge_samples()
+ *
+ * Write out all queued samples older than limit, oldest first.
+ *****************************************************************************/
+static void merge_samples(struct perf_handler_ctx *ctx, unsigned int nr_cpus,
+			  uint64_t limit)
+{
+	struct queued_sample *heads[MAX_CPUS];
+	unsigned int          cpus[MAX_CPUS];
+	unsigned int          nr_busy = 0;
+
+	for (unsigned int cpu = 0; cpu < nr_cpus; cpu++) {
+		struct queued_sample *s = sample_queue_peek(&ctx->queues[cpu]);
+
+		if (s && s->time < limit) {
+			heads[nr_busy] = s;
+			cpus[nr_busy++] = cpu;
+		}
+	}
+
+	while (nr_busy) {
+		struct sample_queue  *q;
+		struct queued_sample *s;
+		unsigned int          oldest = 0;
+
+		for (unsigned int i = 1; i < nr_busy; i++) {
+			if (heads[i]->time < heads[oldest]->time)
+				oldest = i;
+		}
+
+		q = &ctx->queues[cpus[oldest]];
+		s = heads[oldest];
+
+		ctx->missed_events += s->lost;
+		ctx->last_missed_events += s->lost;
+		handle_trace_sample(ctx, cpus[oldest], s->time, &s->metadata,
+				    s->packet);
+		sample_queue_pop(q, s);
+
+		s = sample_queue_peek(q);
+		if (s && s->time < limit) {
+			heads[oldest] = s;
+		} else {
+			nr_busy--;
+			heads[oldest] = heads[nr_busy];
+			cpus[oldest] = cpus[nr_busy];
+		}
+	}
+}
+
+/*****************************************************************************
+ * run_capture_threads()
+ *
+ * Shard the per-CPU perf buffers over cfg->threads threads, each running its
+ * own epoll loop, and merge their samples until the capture is stopped.
+ *****************************************************************************/
+static bool run_capture_threads(struct dumpopt *cfg,
+				struct perf_handler_ctx *ctx,
+				struct perf_buffer *perf_buf,
+				size_t queue_size)
+{
+	struct capture_thread threads[MAX_CAPTURE_THREADS] = {};
+	unsigned int          nr_threads = min(cfg->threads,
+					       MAX_CAPTURE_THREADS);
+	size_t                nr_bufs = perf_buffer__buffer_cnt(perf_buf);
+	int                   nr_cpus = libbpf_num_possible_cpus();
+	struct sample_queue  *queues;
+	sigset_t              sigset, old_sigset;
+	bool                  rc = false;
+	int                   err;
+
+	if (nr_threads > nr_bufs)
+		nr_threads = nr_bufs;
+	if (nr_cpus <= 0 || nr_cpus > MAX_CPUS)
+		nr_cpus = MAX_CPUS;
+
+	for (unsigned int i = 0; i < nr_threads; i++)
+		threads[i].epoll_fd = -1;
+
+	queues = calloc(MAX_CPUS, sizeof(*queues));
+	if (!queues) {
+		pr_warn("ERROR: Failed to allocate sample queues\n");
+		return false;
+	}
+
+	for (int i = 0; i < nr_cpus; i++) {
+		queues[i].size = queue_size;
+		queues[i].buf = malloc(queue_size);
+		if (!queues[i].buf) {
+			pr_warn("ERROR: Failed to allocate sample queues\n");
+			goto out;
+		}
+	}
+
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		threads[i].perf_buf = perf_buf;
+		threads[i].ctx = ctx;
+		threads[i].index = i;
+		threads[i].nr_threads = nr_threads;
+		threads[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (threads[i].epoll_fd < 0) {
+			pr_warn("ERROR: Failed to create epoll instance: %s(%d)\n",
+				strerror(errno), errno);
+			goto out;
+		}
+	}
+
+	for (size_t i = 0; i < nr_bufs; i++) {
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.u32 = i,
+		};
+
+		if (epoll_ctl(threads[i % nr_threads].epoll_fd, EPOLL_CTL_ADD,
+			      perf_buffer__buffer_fd(perf_buf, i), &ev)) {
+			pr_warn("ERROR: Failed to add perf buffer to epoll: %s(%d)\n",
+				strerror(errno), errno);
+			goto out;
+		}
+	}
+
+	ctx->queues = queues;
+
+	/* Leave signal handling to the main thread. */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, &old_sigset);
+
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		err = pthread_create(&threads[i].thread, NULL,
+				     capture_thread_main, &threads[i]);
+		if (err) {
+			pr_warn("ERROR: Failed to create capture thread: %s(%d)\n",
+				strerror(err), err);
+			exit_xdpdump = true;
+			break;
+		}
+		threads[i].started = true;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+	pr_debug("Draining %zu perf buffers using %u threads\n",
+		 nr_bufs, nr_threads);
+
+	while (!exit_xdpdump) {
+		uint64_t        limit = UINT64_MAX;
+		uint64_t        gen;
+		struct timespec timeout;
+
+		pthread_mutex_lock(&merge_lock);
+		gen = merge_gen;
+		pthread_mutex_unlock(&merge_lock);
+
+		for (unsigned int i = 0; i < nr_threads; i++) {
+			uint64_t drained = __atomic_load_n(&threads[i].drained,
+							   __ATOMIC_ACQUIRE);
+
+			limit = min(limit, drained);
+		}
+
+		merge_samples(ctx, nr_cpus,
+			      limit > MERGE_SLACK_NS ? limit - MERGE_SLACK_NS : 0);
+
+		if (__atomic_exchange_n(&merge_flush, false, __ATOMIC_RELAXED) &&
+		    ctx->pcapng_dumper)
+			xpcapng_dump_flush(ctx->pcapng_dumper);
+		check_flight_recorder(ctx);
+
+		/* Wait for a thread to drain its buffers, or a second for the
+		 * signal handlers to run.
+		 */
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec++;
+		pthread_mutex_lock(&merge_lock);
+		while (gen == merge_gen && !exit_xdpdump) {
+			if (pthread_cond_timedwait(&merge_wake, &merge_lock,
+						   &timeout))
+				break;
+		}
+		pthread_mutex_unlock(&merge_lock);
+	}
+
+	rc = true;
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		if (threads[i].started)
+			pthread_join(threads[i].thread, NULL);
+		else
+			rc = false;
+	}
+
+	/* All threads are done, so everything left can be written out. */
+	merge_samples(ctx, nr_cpus, UINT64_MAX);
+	for (int i = 0; i < nr_cpus; i++) {
+		ctx->missed_events += queues[i].lost;
+		ctx->last_missed_events += queues[i].lost;
+	}
+	ctx->queues = NULL;
+
+out:
+	for (unsigned int i = 0; i < nr_threads; i++)
+		if (threads[i].epoll_fd >= 0)
+			close(threads[i].epoll_fd);
+
+	for (int i = 0; i < nr_cpus; i++)
+		free(queues[i].buf);
+	free(queues);
+
+	return rc;
+}
+#endif
+
+/*****************************************************************************
+ * use_ringbuf_capture()
+ *****************************************************************************/
+static bool use_ringbuf_capture(struct dumpopt *cfg, bool load_xdp)
+{
+	bool supported = false;
+
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+	supported = libbpf_probe_bpf_map_type(BPF_MAP_TYPE_RINGBUF, NULL) == 1;
+#endif
+	/* The capture only XDP program always uses the perf buffer, and
+	 * the ring buffer can only be drained by a single thread.
+	 */
+	if (load_xdp || cfg->threads > 1 || cfg->stats_only)
+		supported = false;
+
+	switch (cfg->capture_buffer) {
+	case CAPTURE_BUFFER_PERF:
+		return false;
+	case CAPTURE_BUFFER_RINGBUF:
+		if (!supported)
+			pr_warn("WARNING: Ring buffer capture is not supported%s, "
+				"falling back to perf buffer!\n",
+				cfg->threads > 1 ? " with multiple threads" : "");
+		return supported;
+	}
+
+	return supported;
+}
+
+/*****************************************************************************
+ * Capture filter expression parsing
+ *****************************************************************************/
+static const struct filter_proto {
+	const char *name;
+	uint16_t    eth_proto;
+	uint8_t     ip_proto;
+} filter_protos[] = {
+	{"ip", ETH_P_IP, 0},
+	{"ip6", ETH_P_IPV6, 0},
+	{"tcp", 0, IPPROTO_TCP},
+	{"udp", 0, IPPROTO_UDP},
+	{"sctp", 0, IPPROTO_SCTP},
+	{"icmp", ETH_P_IP, IPPROTO_ICMP},
+	{"icmp6", ETH_P_IPV6, IPPROTO_ICMPV6},
+	{}
+};
+
+/*****************************************************************************
+ * filter_set_eth_proto()
+ *****************************************************************************/
+static bool filter_set_eth_proto(struct trace_filter *filter,
+				 uint16_t eth_proto)
+{
+	if ((filter->flags & TRACE_FILTER_ETH_PROTO) &&
+	    filter->eth_proto != htons(eth_proto)) {
+		pr_warn("ERROR: Capture filter can not match both IPv4 and "
+			"IPv6!\n");
+		return false;
+	}
+
+	filter->flags |= TRACE_FILTER_ETH_PROTO;
+	filter->eth_proto = htons(eth_proto);
+	return true;
+}
+
+/*****************************************************************************
+ * filter_set_proto()
+ *****************************************************************************/
+static bool filter_set_proto(struct trace_filter *filter,
+			     const struct filter_proto *proto)
+{
+	if (proto->eth_proto && !filter_set_eth_proto(filter, proto->eth_proto))
+		return false;
+
+	if (!proto->ip_proto)
+		return true;
+
+	if ((filter->flags & TRACE_FILTER_IP_PROTO) &&
+	    filter->ip_proto != proto->ip_proto) {
+		pr_warn("ERROR: Capture filter can only match a single "
+			"protocol!\n");
+		return false;
+	}
+
+	filter->flags |= TRACE_FILTER_IP_PROTO;
+	filter->ip_proto = proto->ip_proto;
+	return true;
+}
+
+/*****************************************************************************
+ * filter_set_host()
+ *****************************************************************************/
+static bool filter_set_host(struct trace_filter *filter, uint32_t flag,
+			    const char *str)
+{
+	uint32_t *addr;
+
+	if (filter->flags & flag) {
+		pr_warn("ERROR: Capture filter can only contain a single "
+			"instance of each host primitive!\n");
+		return false;
+	}
+
+	if (flag == TRACE_FILTER_SRC_HOST)
+		addr = filter->src_host;
+	else if (flag == TRACE_FILTER_DST_HOST)
+		addr = filter->dst_host;
+	else
+		addr = filter->host;
+
+	if (inet_pton(AF_INET, str, addr) == 1) {
+		if (!filter_set_eth_proto(filter, ETH_P_IP))
+			return false;
+	} else if (inet_pton(AF_INET6, str, addr) == 1) {
+		if (!filter_set_eth_proto(filter, ETH_P_IPV6))
+			return false;
+	} else {
+		pr_warn("ERROR: Invalid address \"%s\" in capture filter!\n",
+			str);
+		return false;
+	}
+
+	filter->flags |= flag;
+	return true;
+}
+
+/*****************************************************************************
+ * filter_set_port()
+ *****************************************************************************/
+static bool filter_set_port(struct trace_filter *filter, uint32_t flag,
+			    const char *str)
+{
+	unsigned long  port;
+	char          *end;
+
+	if (filter->flags & flag) {
+		pr_warn("ERROR: Capture filter can only contain a single "
+			"instance of each port primitive!\n");
+		return false;
+	}
+
+	errno = 0;
+	port = strtoul(str, &end, 10);
+	if (errno || *end || end == str || port > 65535) {
+		pr_warn("ERROR: Invalid port \"%s\" in capture filter!\n", str);
+		return false;
+	}
+
+	if (flag == TRACE_FILTER_SRC_PORT)
+		filter->src_port = htons(port);
+	else if (flag == TRACE_FILTER_DST_PORT)
+		filter->dst_port = htons(port);
+	else
+		filter->port = htons(port);
+
+	filter->flags |= flag;
+	return true;
+}
+
+/*****************************************************************************
+ * parse_capture_filter()
+ *
+ * Only a restricted subset of the pcap-filter(7) syntax is supported, so it
+ * can be evaluated in the trace program without compiling a full filter. The
+ * expression is one or more of the following primitives joined by "and":
+ *
+ *   ip | ip6 | tcp | udp | sctp | icmp | icmp6
+ *   [src|dst] host <addr>
+ *   [src|dst] port <port>
+ *****************************************************************************/
+static bool parse_capture_filter(const char *expr, struct trace_filter *filter)
+{
+	bool   rc = false;
+	bool   need_primitive = true;
+	char  *saveptr = NULL;
+	char  *str, *token;
+
+	memset(filter, 0, sizeof(*filter));
+
+	str = strdup(expr);
+	if (!str) {
+		pr_warn("ERROR: Out of memory parsing capture filter!\n");
+		return false;
+	}
+
+	for (token = strtok_r(str, " \t", &saveptr); token;
+	     token = strtok_r(NULL, " \t", &saveptr)) {
+		const struct filter_proto *proto;
+		uint32_t                   host_flag = TRACE_FILTER_HOST;
+		uint32_t                   port_flag = TRACE_FILTER_PORT;
+		char                      *arg;
+
+		if (!need_primitive) {
+			if (strcmp(token, "and") && strcmp(token, "&&")) {
+				pr_warn("ERROR: Unsupported capture filter "
+					"operator \"%s\", only \"and\" is "
+					"supported!\n", token);
+				goto error_exit;
+			}
+			need_primitive = true;
+			continue;
+		}
+
+		for (proto = filter_protos; proto->name; proto++)
+			if (!strcmp(token, proto->name))
+				break;
+
+		if (proto->name) {
+			if (!filter_set_proto(filter, proto))
+				goto error_exit;
+			need_primitive = false;
+			continue;
+		}
+
+		if (!strcmp(token, "src") || !strcmp(token, "dst")) {
+			bool src = token[0] == 's';
+
+			host_flag = src ? TRACE_FILTER_SRC_HOST :
+					  TRACE_FILTER_DST_HOST;
+			port_flag = src ? TRACE_FILTER_SRC_PORT :
+					  TRACE_FILTER_DST_PORT;
+
+			token = strtok_r(NULL, " \t", &saveptr);
+			if (!token)
+				break;
+		}
+
+		arg = strtok_r(NULL, " \t", &saveptr);
+		if (!arg) {
+			pr_warn("ERROR: Missing argument for \"%s\" in capture "
+				"filter!\n", token);
+			goto error_exit;
+		}
+
+		if (!strcmp(token, "host")) {
+			if (!filter_set_host(filter, host_flag, arg))
+				goto error_exit;
+		} else if (!strcmp(token, "port")) {
+			if (!filter_set_port(filter, port_flag, arg))
+				goto error_exit;
+		} else {
+			pr_warn("ERROR: Unsupported capture filter primitive "
+				"\"%s\"!\n", token);
+			goto error_exit;
+		}
+		need_primitive = false;
+	}
+
+	if (need_primitive) {
+		pr_warn("ERROR: Incomplete capture filter expression!\n");
+		goto error_exit;
+	}
+
+	if ((filter->flags & TRACE_FILTER_ANY_PORT) &&
+	    (filter->flags & TRACE_FILTER_IP_PROTO) &&
+	    filter->ip_proto != IPPROTO_TCP && filter->ip_proto != IPPROTO_UDP &&
+	    filter->ip_proto != IPPROTO_SCTP) {
+		pr_warn("ERROR: Capture filter matches on ports for a protocol "
+			"without ports!\n");
+		goto error_exit;
+	}
+
+	rc = true;
+
+error_exit:
+	free(str);
+	return rc;
+}
+
+/*****************************************************************************
+ * sampling_enabled()
+ *****************************************************************************/
+static bool sampling_enabled(struct dumpopt *cfg)
+{
+	return cfg->sample_rate > 1 || cfg->rate_limit;
+}
+
+/*****************************************************************************
+ * handle_legacy_packet()
+ *****************************************************************************/
+struct legacy_handler_ctx {
+	struct dumpopt *cfg;
+	pcap_dumper_t  *pcap_dumper;
+	uint64_t        captured_packets;
+};
+
+static void handle_legacy_packet(u_char *user, const struct pcap_pkthdr *h,
+				 const u_char *packet)
+{
+	struct legacy_handler_ctx *ctx = (struct legacy_handler_ctx *)user;
+	struct dumpopt            *cfg = ctx->cfg;
+
+	if (ctx->pcap_dumper) {
+		pcap_dump((u_char *) ctx->pcap_dumper, h, packet);
+	} else {
+		size_t i;
+		char hline[SNPRINTH_MIN_BUFFER_SIZE];
+
+		if (cfg->hex_dump) {
+			printf("%ld.%06ld: packet size %u bytes, "
+			       "captured %u bytes on if_name \"%s\"\n",
+			       (long) h->ts.tv_sec, (long) h->ts.tv_usec,
+			       h->len, h->caplen, cfg->ifaces->ifname);
+
+			for (i = 0; i < h->caplen; i += 16) {
+				snprinth(hline, sizeof(hline),
+					 packet, h->caplen, i);
+				printf("  %s\n", hline);
+			}
+		} else {
+			printf("%ld.%06ld: packet size %u bytes on "
+			       "if_name \"%s\"\n",
+			       (long) h->ts.tv_sec, (long) h->ts.tv_usec,
+			       h->len, cfg->ifaces->ifname);
+		}
+	}
+	ctx->captured_packets++;
+}
+
+/*****************************************************************************
+ * capture_on_legacy_interface()
+ *
+ * On Linux libpcap captures through a PACKET_MMAP ring of TPACKET_V3 blocks,
+ * which are handed to user space once full, or once the timeout expires.
+ * All packets of a block are processed in one go by pcap_dispatch().
+ *****************************************************************************/
+static bool capture_on_legacy_interface(struct dumpopt *cfg)
+{
+	bool                      rc = false;
+	char                      errbuf[PCAP_ERRBUF_SIZE];
+	pcap_t                   *pcap = NULL;
+	struct legacy_handler_ctx ctx = { .cfg = cfg };
+	struct pcap_stat          ps;
+	int                       err;
+
+	/* Open pcap handle for live capture. */
+	if (cfg->rx_capture != RX_FLAG_FENTRY) {
+		pr_warn("ERROR: For legacy capture only \"--rx-capture entry\""
+			" is supported!\n");
+		goto error_exit;
+	}
+
+	if (sampling_enabled(cfg) || cfg->headers_only) {
+		pr_warn("ERROR: Sampling and headers only capture are not "
+			"supported for legacy capture!\n");
+		goto error_exit;
+	}
+
+	if (numbered_capture_files(cfg)) {
+		pr_warn("ERROR: Capture file rotation and the flight recorder "
+			"are not supported for legacy capture!\n");
+		goto error_exit;
+	}
+
+	if (is_remote_capture(cfg)) {
+		pr_warn("ERROR: Streaming to a %s destination is not supported "
+			"for legacy capture!\n", REMOTE_PREFIX);
+		goto error_exit;
+	}
+
+	if (cfg->legacy_buffer_size > MAX_LEGACY_BUFFER_SIZE) {
+		pr_warn("ERROR: The --legacy-buffer-size can be at most %u MB!\n",
+			MAX_LEGACY_BUFFER_SIZE);
+		goto error_exit;
+	}
+
+	pcap = pcap_create(cfg->ifaces->ifname, errbuf);
+	if (pcap == NULL) {
+		pr_warn("ERROR: Can't open pcap live interface: %s\n", errbuf);
+		goto error_exit;
+	}
+
+	if (pcap_set_snaplen(pcap, cfg->snaplen) ||
+	    pcap_set_promisc(pcap, cfg->promiscuous) ||
+	    pcap_set_timeout(pcap, cfg->legacy_timeout) ||
+	    pcap_set_immediate_mode(pcap, cfg->legacy_immediate) ||
+	    (cfg->legacy_buffer_size &&
+	     pcap_set_buffer_size(pcap, cfg->legacy_buffer_size * 1024 * 1024))) {
+		pr_warn("ERROR: Can't configure pcap live interface!\n");
+		goto error_exit;
+	}
+
+	err = pcap_activate(pcap);
+	if (err < 0) {
+		pr_warn("ERROR: Can't open pcap live interface: %s\n",
+			err == PCAP_ERROR ? pcap_geterr(pcap) :
+			pcap_statustostr(err));
+		goto error_exit;
+	} else if (err > 0) {
+		pr_warn("WARNING: %s\n", err == PCAP_WARNING ?
+			pcap_geterr(pcap) : pcap_statustostr(err));
+	}
+
+	/* The capture filter is a subset of libpcap's, so hand it over. */
+	if (cfg->filter) {
+		struct pcap_bpf_program fp;
+
+		if (pcap_compile(pcap, (struct bpf_program *)&fp, cfg->filter,
+				 1, PCAP_NETMASK_UNKNOWN)) {
+			pr_warn("ERROR: Can't compile capture filter: %s\n",
+				pcap_geterr(pcap));
+			goto error_exit;
+		}
+
+		/* The handle keeps its own copy of the filter */
+		err = pcap_setfilter(pcap, (struct bpf_program *)&fp);
+		pcap_freecode((struct bpf_program *)&fp);
+		if (err) {
+			pr_warn("ERROR: Can't set capture filter: %s\n",
+				pcap_geterr(pcap));
+			goto error_exit;
+		}
+	}
+
+	/* Open the pcap handle for pcap file. */
+	if (cfg->pcap_file) {
+		ctx.pcap_dumper = pcap_dump_open(pcap, cfg->pcap_file);
+		if (!ctx.pcap_dumper) {
+			pr_warn("ERROR: Can't open pcap file for writing!\n");
+			goto error_exit;
+		}
+	}
+
+	/* No more error conditions, display some capture information */
+	fprintf(stderr, "listening on %s, link-type %s (%s), "
+		"capture size %d bytes\n", cfg->ifaces->ifname,
+		pcap_datalink_val_to_name(pcap_datalink(pcap)),
+		pcap_datalink_val_to_description(pcap_datalink(pcap)),
+		cfg->snaplen);
+
+	/* Loop for receive packets on live interface, a batch at a time. */
+	exit_pcap = pcap;
+	while (!exit_xdpdump) {
+		err = pcap_dispatch(pcap, -1, handle_legacy_packet,
+				    (u_char *)&ctx);
+		if (err == PCAP_ERROR) {
+			pr_warn("ERROR: Can't read from pcap live interface: %s\n",
+				pcap_geterr(pcap));
+			break;
+		}
+
+		if (ctx.pcap_dumper && err > 0 &&
+		    cfg->pcap_file[0] == '-' && cfg->pcap_file[1] == 0)
+			pcap_dump_flush(ctx.pcap_dumper);
+	}
+	exit_pcap = NULL;
+	rc = err != PCAP_ERROR;
+
+	fprintf(stderr, "\n%"PRIu64" packets captured\n", ctx.captured_packets);
+	if (pcap_stats(pcap, &ps) == 0) {
+		fprintf(stderr, "%u packets dropped by kernel\n", ps.ps_drop);
+		if (ps.ps_ifdrop != 0)
+			fprintf(stderr, "%u packets dropped by interface\n",
+				ps.ps_ifdrop);
+	}
+
+error_exit:
+
+	if (ctx.pcap_dumper)
+		pcap_dump_close(ctx.pcap_dumper);
+
+	if (pcap)
+		pcap_close(pcap);
+
+	return rc;
+}
+
+/*****************************************************************************
+ * append_snprintf()
+ *****************************************************************************/
+int append_snprintf(char **buf, size_t *buf_len, size_t *offset,
+		    const char *format, ...)
+{
+	int     len;
+	va_list args;
+
+	if (buf == NULL || *buf == NULL || buf_len == NULL || *buf_len <= 0 ||
+	    offset == NULL || *buf_len - *offset <= 0)
+		return -EINVAL;
+
+	while (true) {
+		char   *new_buf;
+		size_t  new_buf_len;
+
+		va_start(args, format);
+		len = vsnprintf(*buf + *offset, *buf_len - *offset, format, args);
+		va_end(args);
+
+		if ((size_t)len < (*buf_len - *offset)) {
+			*offset += len;
+			len = 0;
+			break;
+		}
+
+		if (*buf_len >= 2048)
+			return -ENOMEM;
+
+		new_buf_len = *buf_len * 2;
+		new_buf = realloc(*buf, new_buf_len);
+
+		if (!new_buf)
+			return -ENOMEM;
+
+		*buf = new_buf;
+		*buf_len = new_buf_len;
+	}
+	return len;
+}
+
+/*****************************************************************************
+ * get_program_names_all()
+ *****************************************************************************/
+static char *get_program_names_all(struct capture_programs *progs, int skip_index)
+{
+	char   *program_names;
+	size_t  size = 128;
+	size_t  offset = 0;
+
+	program_names = malloc(size);
+	if (!program_names)
+		return NULL;
+
+	for (unsigned int i = 0; i < progs->nr_of_progs; i++) {
+		const char *kname = xdp_program__name(progs->progs[i].prog);
+		const char *fname = progs->progs[i].func;
+		uint32_t id = xdp_program__id(progs->progs[i].prog);
+
+		if (skip_index != (int)i) {
+			if (append_snprintf(&program_names, &size, &offset,
+					    "%s%s@%d", i == 0 ? "" : ",",
+					    fname ? fname : kname, id) < 0) {
+				free(program_names);
+				return NULL;
+			}
+		} else {
+			if (append_snprintf(&program_names, &size, &offset,
+					    "%s%s@%d", i == 0 ? "" : ",",
+					    "<function_name>", id) < 0) {
+				free(program_names);
+				return NULL;
+			}
+		}
+	}
+	return program_names;
+}
+
+/*****************************************************************************
+ * find_func_matches()
+ *****************************************************************************/
+static size_t find_func_matches(const struct btf *btf,
+				const char *func_name,
+				const char **found_name,
+				bool print, int print_id, bool exact)
+{
+	const struct btf_type *t, *match;
+	size_t len, matches = 0;
+	const char *name;
+	int nr_types, i;
+
+	if (!btf) {
+		pr_debug("No BTF found for program\n");
+		return 0;
+	}
+
+	len = strlen(func_name);
+
+	nr_types = btf__type_cnt(btf);
+	for (i = 1; i < nr_types; i++) {
+		t = btf__type_by_id(btf, i);
+		if (!btf_is_func(t))
+			continue;
+
+		name = btf__name_by_offset(btf, t->name_off);
 		if (!strncmp(name, func_name, len)) {
 			pr_debug("Found func %s matching %s\n",
 				 name, func_name);
@@ -1187,39 +2982,46 @@ static char *get_loaded_program_info(struct dumpopt *cfg)
 	char                *info;
 	size_t               info_size = 128;
 	size_t               info_offset = 0;
+	struct iface        *iface;
 	struct xdp_multiprog *mp = NULL;
 
 	info = malloc(info_size);
 	if (!info)
 		return NULL;
 
-	if (append_snprintf(&info, &info_size, &info_offset,
-			    "Capture was taken on interface %s, with the "
-			    "following XDP programs loaded:\n",
-			    cfg->iface.ifname) < 0)
-		goto error_out;
-
-	mp = xdp_multiprog__get_from_ifindex(cfg->iface.ifindex);
-	if (IS_ERR_OR_NULL(mp)) {
+	for (iface = cfg->ifaces; iface; iface = iface->next) {
 		if (append_snprintf(&info, &info_size, &info_offset,
-				    "  %s()\n", "<No XDP program loaded!>"))
+				    "Capture was taken on interface %s, with "
+				    "the following XDP programs loaded:\n",
+				    iface->ifname) < 0)
 			goto error_out;
-	} else {
-		struct xdp_program *prog = NULL;
 
-		if (append_snprintf(&info, &info_size, &info_offset, "  %s()\n",
-				    xdp_program__name(
-					    xdp_multiprog__main_prog(mp))) < 0)
-			goto error_out;
+		mp = xdp_multiprog__get_from_ifindex(iface->ifindex);
+		if (IS_ERR_OR_NULL(mp)) {
+			mp = NULL;
+			if (append_snprintf(&info, &info_size, &info_offset,
+					    "  %s()\n",
+					    "<No XDP program loaded!>") < 0)
+				goto error_out;
+		} else {
+			struct xdp_program *prog = NULL;
 
-		while ((prog = xdp_multiprog__next_prog(prog, mp))) {
 			if (append_snprintf(&info, &info_size, &info_offset,
-					    "    %s()\n",
-					    xdp_program__name(prog)) < 0)
+					    "  %s()\n",
+					    xdp_program__name(
+						    xdp_multiprog__main_prog(mp))) < 0)
 				goto error_out;
-		}
 
-		xdp_multiprog__close(mp);
+			while ((prog = xdp_multiprog__next_prog(prog, mp))) {
+				if (append_snprintf(&info, &info_size,
+						    &info_offset, "    %s()\n",
+						    xdp_program__name(prog)) < 0)
+					goto error_out;
+			}
+
+			xdp_multiprog__close(mp);
+			mp = NULL;
+		}
 	}
 	return info;
 
@@ -1236,20 +3038,27 @@ static bool add_interfaces_to_pcapng(struct dumpopt *cfg,
 				     struct xpcapng_dumper *pcapng_dumper,
 				     struct capture_programs *progs)
 {
-	uint64_t if_speed;
-	char     if_drv[260];
-
-	if_speed = get_if_speed(&cfg->iface);
-	if_drv[0] = 0;
-	get_if_drv_info(&cfg->iface, if_drv, sizeof(if_drv));
+	uint64_t      if_speed = 0;
+	char          if_drv[260];
+	struct iface *iface = NULL;
 
+	/* Every program gets an fentry and fexit IDB, named after the
+	 * interface it was captured on, in the order of the prog_index.
+	 */
 	for (unsigned int i = 0; i < progs->nr_of_progs; i++) {
 		char if_name[128];
 
+		if (progs->progs[i].iface != iface) {
+			iface = progs->progs[i].iface;
+			if_speed = get_if_speed(iface);
+			if_drv[0] = 0;
+			get_if_drv_info(iface, if_drv, sizeof(if_drv));
+		}
+
 		if (try_snprintf(if_name, sizeof(if_name), "%s:%s()@fentry",
-				 cfg->iface.ifname, progs->progs[i].func)) {
+				 iface->ifname, progs->progs[i].func)) {
 			pr_warn("ERROR: Could not format interface name, %s:%s()@fentry!\n",
-				cfg->iface.ifname, progs->progs[i].func);
+				iface->ifname, progs->progs[i].func);
 			return false;
 		}
 
@@ -1265,9 +3074,9 @@ static bool add_interfaces_to_pcapng(struct dumpopt *cfg,
 		}
 
 		if (try_snprintf(if_name, sizeof(if_name), "%s:%s()@fexit",
-				 cfg->iface.ifname, progs->progs[i].func)) {
+				 iface->ifname, progs->progs[i].func)) {
 			pr_warn("ERROR: Could not format interface name, %s:%s()@fexit!\n",
-				cfg->iface.ifname, progs->progs[i].func);
+				iface->ifname, progs->progs[i].func);
 			return false;
 		}
 
@@ -1296,37 +3105,112 @@ static void print_compat_error(const char *what)
 #endif
 }
 
+/*****************************************************************************
+ * redirect_tracepoints_supported()
+ *
+ * The redirect trace programs expect the xdp_redirect tracepoints to report
+ * the map type and id, older kernels passed a map pointer instead. Tell them
+ * apart by the number of arguments, seven plus the context pointer.
+ *****************************************************************************/
+static bool redirect_tracepoints_supported(void)
+{
+	const struct btf_type *t;
+	struct btf            *btf;
+	bool                   rc = false;
+	int                    id;
+
+	btf = btf__load_vmlinux_btf();
+	if (libbpf_get_error(btf))
+		return false;
+
+	id = btf__find_by_name_kind(btf, "btf_trace_xdp_redirect",
+				    BTF_KIND_TYPEDEF);
+	if (id > 0) {
+		t = btf__type_by_id(btf, btf__type_by_id(btf, id)->type);
+		if (t && btf_is_ptr(t)) {
+			t = btf__type_by_id(btf, t->type);
+			rc = t && btf_is_func_proto(t) && btf_vlen(t) == 8;
+		}
+	}
+
+	btf__free(btf);
+	return rc;
+}
+
+/*****************************************************************************
+ * find_trace_program()
+ *****************************************************************************/
+static struct bpf_program *find_trace_program(struct bpf_object *obj,
+					      const char *direction,
+					      const char *transport,
+					      unsigned int slot)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "trace_on_%s%s_%u", direction, transport,
+		 slot);
+	return bpf_object__find_program_by_name(obj, name);
+}
+
 /*****************************************************************************
  * load_and_attach_trace()
+ *
+ * Trace the count programs starting at first, loading a single trace object
+ * for all of them. Each program gets a slot in the object, i.e. its own
+ * configuration and copy of the fentry and fexit programs, while the maps are
+ * shared.
  *****************************************************************************/
 static bool load_and_attach_trace(struct dumpopt *cfg,
 				  struct capture_programs *progs,
-				  unsigned int idx)
+				  unsigned int first, unsigned int count)
 {
 	int                          err;
 	struct bpf_object           *trace_obj = NULL;
-	struct bpf_program          *trace_prog_fentry;
-	struct bpf_program          *trace_prog_fexit;
-	struct bpf_link             *trace_link_fentry = NULL;
-	struct bpf_link             *trace_link_fexit = NULL;
+	struct bpf_program          *trace_prog_fentry[TRACE_MAX_SLOTS] = {};
+	struct bpf_program          *trace_prog_fexit[TRACE_MAX_SLOTS] = {};
+	struct bpf_program          *prog;
+	struct bpf_link             *trace_link_fentry[TRACE_MAX_SLOTS] = {};
+	struct bpf_link             *trace_link_fexit[TRACE_MAX_SLOTS] = {};
+	struct bpf_link             *redirect_links[NR_REDIRECT_TRACEPOINTS] = {};
+	unsigned int                 nr_redirect_links = 0;
 	struct bpf_map              *perf_map;
 	struct bpf_map              *data_map;
-	struct trace_configuration   trace_cfg;
+	struct bpf_map              *stats_map;
+	struct trace_configuration   trace_cfg[TRACE_MAX_SLOTS] = {};
+	bool                         trace_redirect = false;
+	const char                  *transport;
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+	struct bpf_map              *ringbuf_map;
+	struct bpf_map              *ringbuf_lost_map;
+#endif
 
-	if (idx >= progs->nr_of_progs || progs->nr_of_progs == 0) {
+	if (count == 0 || count > TRACE_MAX_SLOTS ||
+	    first + count > progs->nr_of_progs) {
 		pr_warn("ERROR: Attach program ID invalid!\n");
 		return false;
 	}
 
-	progs->progs[idx].attached = false;
+	for (unsigned int slot = 0; slot < count; slot++) {
+		progs->progs[first + slot].attached = false;
 
-	if (progs->progs[idx].rx_capture == 0) {
-		pr_warn("ERROR: No RX capture mode to attach to!\n");
-		return false;
+		if (progs->progs[first + slot].rx_capture == 0) {
+			pr_warn("ERROR: No RX capture mode to attach to!\n");
+			return false;
+		}
 	}
 
 	silence_libbpf_logging();
 
+	/* In stats only mode the counting programs replace the perf buffer
+	 * ones, and in ring buffer mode the ring buffer ones.
+	 */
+	if (cfg->stats_only)
+		transport = "_stats";
+	else if (progs->use_ringbuf)
+		transport = "_rb";
+	else
+		transport = "";
+
 rlimit_loop:
 	/* Load the trace program object */
 	trace_obj = open_bpf_file("xdpdump_bpf.o", NULL);
@@ -1338,7 +3222,7 @@ rlimit_loop:
 		goto error_exit;
 	}
 
-	/* Set the ifIndex in the DATA map */
+	/* Set the per slot configuration in the DATA map */
 	data_map = bpf_object__find_map_by_name(trace_obj, "xdpdump_.data");
 	if (!data_map) {
 		pr_warn("ERROR: Can't find the .data MAP in the trace "
@@ -1352,43 +3236,134 @@ rlimit_loop:
 		goto error_exit;
 	}
 
-	trace_cfg.capture_if_ifindex = cfg->iface.ifindex;
-	trace_cfg.capture_snaplen = cfg->snaplen;
-	trace_cfg.capture_prog_index = idx;
-	if (bpf_map__set_initial_value(data_map, &trace_cfg,
+	for (unsigned int slot = 0; slot < count; slot++) {
+		struct prog_info           *info = &progs->progs[first + slot];
+		struct trace_configuration *slot_cfg = &trace_cfg[slot];
+
+		slot_cfg->capture_if_ifindex = info->iface->ifindex;
+		slot_cfg->capture_snaplen = cfg->snaplen;
+		slot_cfg->capture_prog_index = first + slot;
+		slot_cfg->capture_filter = cfg->capture_filter;
+		slot_cfg->capture_sample_rate = cfg->sample_rate;
+		if (cfg->rate_limit)
+			slot_cfg->capture_rate_interval =
+				max(1000000000U / cfg->rate_limit, 1U);
+		if (info->rx_capture == (RX_FLAG_FENTRY | RX_FLAG_FEXIT))
+			slot_cfg->capture_sample_flags |=
+				TRACE_SAMPLE_FOLLOW_ENTRY;
+		if (cfg->headers_only) {
+			slot_cfg->capture_flags |= TRACE_CAPTURE_HEADERS_ONLY;
+			slot_cfg->capture_payload_len = cfg->payload_len;
+		}
+		/* The redirect tracepoints are attached once per object, and
+		 * report for the first program run for each packet on the
+		 * interfaces traced by it.
+		 */
+		if (cfg->redirect_targets && info->first && !info->map_prog) {
+			slot_cfg->capture_flags |= TRACE_CAPTURE_REDIRECT;
+			trace_redirect = true;
+		}
+		if (info->map_prog)
+			slot_cfg->capture_flags |= TRACE_CAPTURE_MAP_PROG;
+		if (cfg->dedup_exit &&
+		    info->rx_capture == (RX_FLAG_FENTRY | RX_FLAG_FEXIT))
+			slot_cfg->capture_flags |= TRACE_CAPTURE_DEDUP_EXIT;
+	}
+
+	if (bpf_map__set_initial_value(data_map, trace_cfg,
 				       sizeof(trace_cfg))) {
 		pr_warn("ERROR: Can't set initial .data MAP in the trace "
 			"program!\n");
 		goto error_exit;
 	}
 
-	/* Locate the fentry and fexit functions */
-	trace_prog_fentry = bpf_object__find_program_by_name(trace_obj,
-							     "trace_on_entry");
-	if (!trace_prog_fentry) {
-		pr_warn("ERROR: Can't find XDP trace fentry function!\n");
+	/* Only load the programs of the selected capture transport, for the
+	 * slots and directions in use.
+	 */
+	bpf_object__for_each_program(prog, trace_obj) {
+		const char *name = bpf_program__name(prog);
+		size_t      len = strlen(name);
+
+		if (!strncmp(name, "trace_on_", strlen("trace_on_")))
+			bpf_program__set_autoload(prog, false);
+		else if (!strncmp(name, "trace_redirect",
+				  strlen("trace_redirect")))
+			bpf_program__set_autoload(prog, trace_redirect &&
+						  progs->use_ringbuf ==
+						  (len > 3 &&
+						   !strcmp(name + len - 3,
+							   "_rb")));
+	}
+
+	for (unsigned int slot = 0; slot < count; slot++) {
+		struct prog_info *info = &progs->progs[first + slot];
+
+		trace_prog_fentry[slot] = find_trace_program(trace_obj, "entry",
+							     transport, slot);
+		trace_prog_fexit[slot] = find_trace_program(trace_obj, "exit",
+							    transport, slot);
+		if (!trace_prog_fentry[slot] || !trace_prog_fexit[slot]) {
+			pr_warn("ERROR: Can't find XDP trace functions!\n");
+			goto error_exit;
+		}
+
+		/* Before we can load the object in memory we need to set the
+		 * attach point to our function. */
+		if (info->rx_capture & RX_FLAG_FENTRY) {
+			prog = trace_prog_fentry[slot];
+			bpf_program__set_autoload(prog, true);
+			bpf_program__set_expected_attach_type(prog,
+							      BPF_TRACE_FENTRY);
+			bpf_program__set_attach_target(prog,
+						       xdp_program__fd(info->prog),
+						       info->func);
+		}
+		if (info->rx_capture & RX_FLAG_FEXIT) {
+			prog = trace_prog_fexit[slot];
+			bpf_program__set_autoload(prog, true);
+			bpf_program__set_expected_attach_type(prog,
+							      BPF_TRACE_FEXIT);
+			bpf_program__set_attach_target(prog,
+						       xdp_program__fd(info->prog),
+						       info->func);
+		}
+	}
+
+	/* Share the counters of all programs, and only size the map for real
+	 * when used.
+	 */
+	stats_map = bpf_object__find_map_by_name(trace_obj, "xdpdump_stats");
+	if (!stats_map) {
+		pr_warn("ERROR: Can't find XDP trace stats objects!\n");
 		goto error_exit;
 	}
+	if (!cfg->stats_only) {
+		bpf_map__set_max_entries(stats_map, 1);
+	} else if (first != 0) {
+		err = bpf_map__reuse_fd(stats_map, progs->progs[0].stats_map_fd);
+		if (err) {
+			pr_warn("ERROR: Can't reuse xdpdump_stats: %s\n",
+				strerror(-err));
+			goto error_exit;
+		}
+	}
 
-	trace_prog_fexit = bpf_object__find_program_by_name(trace_obj,
-							    "trace_on_exit");
-	if (!trace_prog_fexit) {
-		pr_warn("ERROR: Can't find XDP trace fexit function!\n");
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+	ringbuf_map = bpf_object__find_map_by_name(trace_obj,
+						   "xdpdump_ringbuf");
+	ringbuf_lost_map = bpf_object__find_map_by_name(trace_obj,
+							"xdpdump_ringbuf_lost");
+	if (!ringbuf_map || !ringbuf_lost_map) {
+		pr_warn("ERROR: Can't find XDP trace ring buffer objects!\n");
 		goto error_exit;
 	}
 
-	/* Before we can load the object in memory we need to set the attach
-	 * point to our function. */
-	bpf_program__set_expected_attach_type(trace_prog_fentry,
-					      BPF_TRACE_FENTRY);
-	bpf_program__set_expected_attach_type(trace_prog_fexit,
-					      BPF_TRACE_FEXIT);
-	bpf_program__set_attach_target(trace_prog_fentry,
-				       xdp_program__fd(progs->progs[idx].prog),
-				       progs->progs[idx].func);
-	bpf_program__set_attach_target(trace_prog_fexit,
-				       xdp_program__fd(progs->progs[idx].prog),
-				       progs->progs[idx].func);
+	if (!progs->use_ringbuf) {
+		/* Also the stats only mode, which needs none of them */
+		bpf_map__set_autocreate(ringbuf_map, false);
+		bpf_map__set_autocreate(ringbuf_lost_map, false);
+	}
+#endif
 
 	/* Reuse the xdpdump_perf_map for all programs */
 	perf_map = bpf_object__find_map_by_name(trace_obj,
@@ -1397,7 +3372,28 @@ rlimit_loop:
 		pr_warn("ERROR: Can't find xdpdump_perf_map in trace program!\n");
 		goto error_exit;
 	}
-	if (idx != 0) {
+	if (progs->use_ringbuf) {
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+		bpf_map__set_autocreate(perf_map, false);
+
+		/* Same for the ring buffer, and its lost counters */
+		if (first != 0) {
+			err = bpf_map__reuse_fd(ringbuf_map,
+						progs->progs[0].ringbuf_map_fd);
+			if (!err)
+				err = bpf_map__reuse_fd(ringbuf_lost_map,
+							progs->progs[0].ringbuf_lost_fd);
+			if (err) {
+				pr_warn("ERROR: Can't reuse xdpdump_ringbuf: %s\n",
+					strerror(-err));
+				goto error_exit;
+			}
+		} else {
+			bpf_map__set_max_entries(ringbuf_map,
+						 get_ringbuf_size());
+		}
+#endif
+	} else if (first != 0) {
 		err = bpf_map__reuse_fd(perf_map, progs->progs[0].perf_map_fd);
 		if (err) {
 			pr_warn("ERROR: Can't reuse xdpdump_perf_map: %s\n",
@@ -1425,64 +3421,268 @@ rlimit_loop:
 	}
 
 	/* Attach trace programs only in the direction(s) needed */
-	if (progs->progs[idx].rx_capture & RX_FLAG_FENTRY) {
-		trace_link_fentry = bpf_program__attach_trace(trace_prog_fentry);
-		err = libbpf_get_error(trace_link_fentry);
-		if (err) {
-			if (err == -ENOTSUPP)
-				print_compat_error("function attach");
-			else
-				pr_warn("ERROR: Can't attach XDP trace fentry "
-					"function: %s\n",
+	for (unsigned int slot = 0; slot < count; slot++) {
+		struct prog_info *info = &progs->progs[first + slot];
+
+		if (info->rx_capture & RX_FLAG_FENTRY) {
+			trace_link_fentry[slot] =
+				bpf_program__attach_trace(trace_prog_fentry[slot]);
+			err = libbpf_get_error(trace_link_fentry[slot]);
+			if (err) {
+				trace_link_fentry[slot] = NULL;
+				if (err == -ENOTSUPP)
+					print_compat_error("function attach");
+				else
+					pr_warn("ERROR: Can't attach XDP trace "
+						"fentry function: %s\n",
+						strerror(-err));
+				goto error_exit;
+			}
+		}
+
+		if (info->rx_capture & RX_FLAG_FEXIT) {
+			trace_link_fexit[slot] =
+				bpf_program__attach_trace(trace_prog_fexit[slot]);
+			err = libbpf_get_error(trace_link_fexit[slot]);
+			if (err) {
+				trace_link_fexit[slot] = NULL;
+				pr_warn("ERROR: Can't attach XDP trace fexit function: %s\n",
 					strerror(-err));
-			goto error_exit;
+				goto error_exit;
+			}
 		}
 	}
 
-	if (progs->progs[idx].rx_capture & RX_FLAG_FEXIT) {
-		trace_link_fexit = bpf_program__attach_trace(trace_prog_fexit);
-		err = libbpf_get_error(trace_link_fexit);
+	bpf_object__for_each_program(prog, trace_obj) {
+		if (!trace_redirect || !bpf_program__autoload(prog) ||
+		    strncmp(bpf_program__name(prog), "trace_redirect",
+			    strlen("trace_redirect")))
+			continue;
+
+		if (nr_redirect_links >= NR_REDIRECT_TRACEPOINTS) {
+			pr_warn("ERROR: Too many redirect trace programs!\n");
+			goto error_exit;
+		}
+
+		redirect_links[nr_redirect_links] = bpf_program__attach_trace(prog);
+		err = libbpf_get_error(redirect_links[nr_redirect_links]);
 		if (err) {
-			pr_warn("ERROR: Can't attach XDP trace fexit function: %s\n",
-				strerror(-err));
+			redirect_links[nr_redirect_links] = NULL;
+			pr_warn("ERROR: Can't attach XDP redirect trace program %s: %s\n",
+				bpf_program__name(prog), strerror(-err));
 			goto error_exit;
 		}
+		nr_redirect_links++;
 	}
 
-	/* Figure out the fd for the BPF_MAP_TYPE_PERF_EVENT_ARRAY trace map. */
-	if (idx == 0) {
-		progs->progs[idx].perf_map_fd = bpf_map__fd(perf_map);
-		if (progs->progs[idx].perf_map_fd < 0) {
+	/* Figure out the fd for the BPF_MAP_TYPE_PERF_EVENT_ARRAY trace map,
+	 * or the BPF_MAP_TYPE_RINGBUF map in ring buffer mode.
+	 */
+	if (progs->use_ringbuf) {
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+		if (first == 0) {
+			progs->progs[0].ringbuf_map_fd = bpf_map__fd(ringbuf_map);
+			progs->progs[0].ringbuf_lost_fd = bpf_map__fd(ringbuf_lost_map);
+			if (progs->progs[0].ringbuf_map_fd < 0 ||
+			    progs->progs[0].ringbuf_lost_fd < 0) {
+				pr_warn("ERROR: Can't get xdpdump_ringbuf file descriptor: %s\n",
+					strerror(errno));
+				goto error_exit;
+			}
+		}
+#endif
+	} else if (first == 0) {
+		progs->progs[0].perf_map_fd = bpf_map__fd(perf_map);
+		if (progs->progs[0].perf_map_fd < 0) {
 			pr_warn("ERROR: Can't get xdpdump_perf_map file descriptor: %s\n",
 				strerror(errno));
-			return false;
+			goto error_exit;
 		}
-	} else {
-		progs->progs[idx].perf_map_fd = progs->progs[0].perf_map_fd;
 	}
 
-	progs->progs[idx].attached = true;
-	progs->progs[idx].fentry_link = trace_link_fentry;
-	progs->progs[idx].fexit_link = trace_link_fexit;
-	progs->progs[idx].prog_obj = trace_obj;
+	for (unsigned int slot = 0; slot < count; slot++) {
+		struct prog_info *info = &progs->progs[first + slot];
+
+		info->perf_map_fd = progs->progs[0].perf_map_fd;
+		info->ringbuf_map_fd = progs->progs[0].ringbuf_map_fd;
+		info->ringbuf_lost_fd = progs->progs[0].ringbuf_lost_fd;
+		info->stats_map_fd = bpf_map__fd(stats_map);
+		info->fentry_link = trace_link_fentry[slot];
+		info->fexit_link = trace_link_fexit[slot];
+		info->attached = true;
+	}
+
+	/* The object, and the links shared by all slots, are owned by the
+	 * first program.
+	 */
+	memcpy(progs->progs[first].redirect_links, redirect_links,
+	       sizeof(redirect_links));
+	progs->progs[first].prog_obj = trace_obj;
 	return true;
 
 error_exit:
-	bpf_link__destroy(trace_link_fentry);
-	bpf_link__destroy(trace_link_fexit);
+	for (unsigned int slot = 0; slot < count; slot++) {
+		bpf_link__destroy(trace_link_fentry[slot]);
+		bpf_link__destroy(trace_link_fexit[slot]);
+	}
+	for (unsigned int i = 0; i < nr_redirect_links; i++)
+		bpf_link__destroy(redirect_links[i]);
 	bpf_object__close(trace_obj);
 	return false;
 }
 
+/*****************************************************************************
+ * load_xdp_trace_program()
+ *****************************************************************************/
+static bool load_xdp_trace_program(struct dumpopt *cfg,
+				   struct capture_programs *progs,
+				   unsigned int idx)
+{
+	DECLARE_LIBXDP_OPTS(xdp_program_opts, opts, 0);
+	int                         fd, rc;
+	char                        errmsg[STRERR_BUFSIZE];
+	struct xdp_program         *prog;
+	struct bpf_map             *perf_map;
+	struct bpf_map             *data_map;
+	struct iface               *iface = progs->progs[idx].iface;
+	struct trace_configuration  trace_cfg = {};
+
+	if (!cfg || !progs)
+		return false;
+
+	silence_libbpf_logging();
+	silence_libxdp_logging();
+
+	opts.find_filename = "xdpdump_xdp.o";
+	opts.prog_name = "xdpdump";
+
+	prog = xdp_program__create(&opts);
+	if (libxdp_get_error(prog)) {
+		int err = libxdp_get_error(prog);
+
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		pr_warn("ERROR: Can't open XDP trace program: %s(%d)\n",
+			errmsg, err);
+		return false;
+	}
+
+	perf_map = bpf_object__find_map_by_name(xdp_program__bpf_obj(prog),
+						"xdpdump_perf_map");
+	if (!perf_map) {
+		pr_warn("ERROR: Can't find xdpdump_perf_map in the xdp program!\n");
+		goto error_exit;
+	}
+
+	/* Share the perf map with the programs on the other interfaces */
+	if (idx != 0) {
+		rc = bpf_map__reuse_fd(perf_map, progs->progs[0].perf_map_fd);
+		if (rc) {
+			pr_warn("ERROR: Can't reuse xdpdump_perf_map: %s\n",
+				strerror(-rc));
+			goto error_exit;
+		}
+	}
+
+	/* Set the trace configuration in the DATA map */
+	data_map = bpf_object__find_map_by_name(xdp_program__bpf_obj(prog),
+						"xdpdump_.data");
+	if (!data_map) {
+		pr_warn("ERROR: Can't find the .data MAP in the xdp program!\n");
+		goto error_exit;
+	}
+
+	if (bpf_map__value_size(data_map) != sizeof(trace_cfg)) {
+		pr_warn("ERROR: Can't find the correct sized .data MAP in the xdp program!\n");
+		goto error_exit;
+	}
+
+	trace_cfg.capture_if_ifindex = iface->ifindex;
+	trace_cfg.capture_snaplen = cfg->snaplen;
+	trace_cfg.capture_prog_index = idx;
+	if (bpf_map__set_initial_value(data_map, &trace_cfg,
+				       sizeof(trace_cfg))) {
+		pr_warn("ERROR: Can't set initial .data MAP in the xdp program!\n");
+		goto error_exit;
+	}
+
+	do {
+		rc = xdp_program__attach(prog, iface->ifindex,
+					 cfg->load_xdp_mode, 0);
+
+	} while (rc == -EPERM && !double_rlimit());
+
+	if (rc) {
+		libxdp_strerror(rc, errmsg, sizeof(errmsg));
+		pr_warn("ERROR: Can't attach XDP trace program to %s: %s(%d)\n",
+			iface->ifname, errmsg, rc);
+		goto error_exit;
+	}
+
+	fd = bpf_map__fd(perf_map);
+	if (fd < 0) {
+		pr_warn("ERROR: Can't get xdpdump_perf_map file descriptor: %s\n",
+			strerror(fd));
+
+		xdp_program__detach(prog, iface->ifindex,
+				    cfg->load_xdp_mode, 0);
+		goto error_exit;
+	}
+
+	progs->progs[idx].prog = prog;
+	progs->progs[idx].func = xdp_program__name(prog);
+	progs->progs[idx].perf_map_fd = fd;
+	progs->progs[idx].attached = true;
+
+	return true;
+
+error_exit:
+	xdp_program__close(prog);
+	return false;
+}
+
+/*****************************************************************************
+ * unload_xdp_trace_program()
+ *****************************************************************************/
+static void unload_xdp_trace_program(struct dumpopt *cfg,
+				     struct capture_programs *progs,
+				     unsigned int idx)
+{
+	xdp_program__detach(progs->progs[idx].prog,
+			    progs->progs[idx].iface->ifindex,
+			    cfg->load_xdp_mode, 0);
+	xdp_program__close(progs->progs[idx].prog);
+
+	progs->progs[idx].prog = NULL;
+	progs->progs[idx].attached = false;
+}
+
 /*****************************************************************************
  * load_and_attach_traces()
  *****************************************************************************/
 static bool load_and_attach_traces(struct dumpopt *cfg,
 				   struct capture_programs *progs)
 {
-	for (unsigned int i = 0; i < progs->nr_of_progs; i++)
-		if (!load_and_attach_trace(cfg, progs, i))
+	unsigned int count;
+
+	for (unsigned int i = 0; i < progs->nr_of_progs; i += count) {
+		count = 1;
+		if (progs->progs[i].load_xdp) {
+			if (!load_xdp_trace_program(cfg, progs, i))
+				return false;
+			continue;
+		}
+
+		/* Trace as many of the following programs as possible from a
+		 * single object, this saves loading it, and its BTF and maps,
+		 * over and over again for a long chain of programs.
+		 */
+		while (count < TRACE_MAX_SLOTS && i + count < progs->nr_of_progs &&
+		       !progs->progs[i + count].load_xdp)
+			count++;
+
+		if (!load_and_attach_trace(cfg, progs, i, count))
 			return false;
+	}
 
 	return true;
 }
@@ -1490,140 +3690,329 @@ static bool load_and_attach_traces(struct dumpopt *cfg,
 /*****************************************************************************
  * detach_trace()
  *****************************************************************************/
-static void detach_trace(struct capture_programs *progs, unsigned int idx)
+static void detach_trace(struct dumpopt *cfg, struct capture_programs *progs,
+			 unsigned int idx)
 {
 	if (idx >= progs->nr_of_progs || progs->nr_of_progs == 0 ||
 	    !progs->progs[idx].attached)
 		return;
 
+	if (progs->progs[idx].load_xdp) {
+		unload_xdp_trace_program(cfg, progs, idx);
+		return;
+	}
+
 	bpf_link__destroy(progs->progs[idx].fentry_link);
 	bpf_link__destroy(progs->progs[idx].fexit_link);
-	bpf_object__close(progs->progs[idx].prog_obj);
+	for (unsigned int i = 0; i < NR_REDIRECT_TRACEPOINTS; i++) {
+		bpf_link__destroy(progs->progs[idx].redirect_links[i]);
+		progs->progs[idx].redirect_links[i] = NULL;
+	}
 	progs->progs[idx].attached = false;
 }
 
 /*****************************************************************************
  * detach_traces()
  *****************************************************************************/
-static void detach_traces(struct capture_programs *progs)
+static void detach_traces(struct dumpopt *cfg, struct capture_programs *progs)
 {
 	for (unsigned int i = 0; i < progs->nr_of_progs; i++)
-		detach_trace(progs, i);
+		detach_trace(cfg, progs, i);
+
+	/* A trace object can be shared by several programs, so only close
+	 * them once all links are gone.
+	 */
+	for (unsigned int i = 0; i < progs->nr_of_progs; i++) {
+		bpf_object__close(progs->progs[i].prog_obj);
+		progs->progs[i].prog_obj = NULL;
+	}
 }
 
 /*****************************************************************************
- * load_xdp_trace_program()
+ * add_capture_programs()
+ *
+ * Append the programs found on an interface to the list of all programs to
+ * capture on.
  *****************************************************************************/
-static bool load_xdp_trace_program(struct dumpopt *cfg,
-				   struct capture_programs *progs)
+static bool add_capture_programs(struct capture_programs *all_progs,
+				 struct capture_programs *progs,
+				 struct iface *iface)
 {
-	DECLARE_LIBXDP_OPTS(xdp_program_opts, opts, 0);
-	int                         fd, rc;
-	char                        errmsg[STRERR_BUFSIZE];
-	struct xdp_program         *prog;
-	struct bpf_map             *perf_map;
-	struct bpf_map             *data_map;
-	struct trace_configuration  trace_cfg;
-
-	if (!cfg || !progs)
+	if (all_progs->nr_of_progs + progs->nr_of_progs > MAX_CAPTURE_PROGRAMS) {
+		pr_warn("ERROR: Can't capture on more than %d programs!\n",
+			MAX_CAPTURE_PROGRAMS);
 		return false;
+	}
 
-	silence_libbpf_logging();
-	silence_libxdp_logging();
+	for (unsigned int i = 0; i < progs->nr_of_progs; i++) {
+		struct prog_info *info;
+
+		info = &all_progs->progs[all_progs->nr_of_progs++];
+		info->prog = progs->progs[i].prog;
+		info->func = progs->progs[i].func;
+		info->rx_capture = progs->progs[i].rx_capture;
+		info->load_xdp = progs->progs[i].load_xdp;
+		info->map_prog = progs->progs[i].map_prog;
+		info->iface = iface;
+		/* Map programs run on their own, from the devmap flush or
+		 * the cpumap kthread, so each of their packets is new.
+		 */
+		info->first = i == 0 || info->map_prog;
+	}
+	return true;
+}
 
-	opts.find_filename = "xdpdump_xdp.o";
-	opts.prog_name = "xdpdump";
+/*****************************************************************************
+ * open_map_programs()
+ *
+ * Programs run from devmap or cpumap entries are not attached to any
+ * interface, so they are looked up by the ids given with --map-programs.
+ *****************************************************************************/
+static bool open_map_programs(struct dumpopt *cfg,
+			      struct capture_programs *map_progs)
+{
+	for (unsigned int i = 0; i < cfg->map_prog_ids.num_vals; i++) {
+		__u32               id = cfg->map_prog_ids.vals[i];
+		struct xdp_program *prog;
+		const char         *func;
+		int                 err;
+
+		if (map_progs->nr_of_progs >= MAX_LOADED_XDP_PROGRAMS) {
+			pr_warn("ERROR: Can't capture on more than %d map programs!\n",
+				MAX_LOADED_XDP_PROGRAMS);
+			return false;
+		}
+
+		prog = xdp_program__from_id(id);
+		err = libxdp_get_error(prog);
+		if (err) {
+			pr_warn("ERROR: Can't open map program with id %u: %s\n",
+				id, strerror(-err));
+			return false;
+		}
+
+		map_progs->progs[map_progs->nr_of_progs].prog = prog;
+		map_progs->nr_of_progs++;
 
-	prog = xdp_program__create(&opts);
-	if (libxdp_get_error(prog)) {
-		int err = libxdp_get_error(prog);
+		if (!check_btf(prog))
+			return false;
 
-		libxdp_strerror(err, errmsg, sizeof(errmsg));
-		pr_warn("ERROR: Can't open XDP trace program: %s(%d)\n",
-			errmsg, err);
-		return false;
-	}
+		if (find_func_matches(xdp_program__btf(prog),
+				      xdp_program__name(prog), &func,
+				      false, -1, false) != 1) {
+			pr_warn("ERROR: Can't identify the full XDP main function "
+				"of map program %u, %s()!\n", id,
+				xdp_program__name(prog));
+			return false;
+		}
 
-	perf_map = bpf_object__find_map_by_name(xdp_program__bpf_obj(prog),
-						"xdpdump_perf_map");
-	if (!perf_map) {
-		pr_warn("ERROR: Can't find xdpdump_perf_map in the xdp program!\n");
-		goto error_exit;
+		map_progs->progs[map_progs->nr_of_progs - 1].func = func;
+		map_progs->progs[map_progs->nr_of_progs - 1].rx_capture =
+			cfg->rx_capture;
+		map_progs->progs[map_progs->nr_of_progs - 1].map_prog = true;
 	}
+	return true;
+}
 
-	/* Set the trace configuration in the DATA map */
-	data_map = bpf_object__find_map_by_name(xdp_program__bpf_obj(prog),
-						"xdpdump_.data");
-	if (!data_map) {
-		pr_warn("ERROR: Can't find the .data MAP in the xdp program!\n");
-		goto error_exit;
-	}
+/*****************************************************************************
+ * --stats-only mode
+ *****************************************************************************/
+struct stats_entry {
+	struct trace_stats_key   key;
+	struct trace_stats_value value;
+};
 
-	if (bpf_map__value_size(data_map) != sizeof(trace_cfg)) {
-		pr_warn("ERROR: Can't find the correct sized .data MAP in the xdp program!\n");
-		goto error_exit;
-	}
+/*****************************************************************************
+ * stats_drain()
+ *
+ * Move the counters of one program out of its map, summing the CPUs. If the
+ * kernel can't atomically look up and delete per-CPU hash entries, packets
+ * counted between the lookup and the delete are lost.
+ *****************************************************************************/
+static unsigned int stats_drain(int fd, struct stats_entry *entries,
+				struct trace_stats_key *keys,
+				struct trace_stats_value *percpu, int nr_cpus)
+{
+	unsigned int num = 0, n = 0;
+
+	while (num < STATS_MAP_SIZE &&
+	       !bpf_map_get_next_key(fd, num ? &keys[num - 1] : NULL,
+				     &keys[num]))
+		num++;
+
+	for (unsigned int i = 0; i < num; i++) {
+		if (bpf_map_lookup_and_delete_elem(fd, &keys[i], percpu)) {
+			if (bpf_map_lookup_elem(fd, &keys[i], percpu))
+				continue;
+			bpf_map_delete_elem(fd, &keys[i]);
+		}
 
-	trace_cfg.capture_if_ifindex = cfg->iface.ifindex;
-	trace_cfg.capture_snaplen = cfg->snaplen;
-	trace_cfg.capture_prog_index = 0;
-	if (bpf_map__set_initial_value(data_map, &trace_cfg,
-				       sizeof(trace_cfg))) {
-		pr_warn("ERROR: Can't set initial .data MAP in the xdp program!\n");
-		goto error_exit;
+		entries[n].key = keys[i];
+		memset(&entries[n].value, 0, sizeof(entries[n].value));
+		for (int cpu = 0; cpu < nr_cpus; cpu++) {
+			entries[n].value.packets += percpu[cpu].packets;
+			entries[n].value.bytes += percpu[cpu].bytes;
+		}
+		if (entries[n].value.packets)
+			n++;
 	}
+	return n;
+}
 
-	do {
-		rc = xdp_program__attach(prog, cfg->iface.ifindex,
-					 cfg->load_xdp_mode, 0);
-
-	} while (rc == -EPERM && !double_rlimit());
+/*****************************************************************************
+ * cmp_stats_entries()
+ *****************************************************************************/
+static int cmp_stats_entries(const void *a, const void *b)
+{
+	const struct stats_entry *x = a, *y = b;
 
-	if (rc) {
-		libxdp_strerror(rc, errmsg, sizeof(errmsg));
-		pr_warn("ERROR: Can't attach XDP trace program: %s(%d)\n",
-			errmsg, rc);
-		goto error_exit;
-	}
+	if (x->value.packets != y->value.packets)
+		return x->value.packets < y->value.packets ? 1 : -1;
+	return 0;
+}
 
-	fd = bpf_map__fd(perf_map);
-	if (fd < 0) {
-		pr_warn("ERROR: Can't get xdpdump_perf_map file descriptor: %s\n",
-			strerror(fd));
+/*****************************************************************************
+ * format_stats_key()
+ *****************************************************************************/
+static void format_stats_key(char *buf, size_t len,
+			     const struct trace_stats_key *key)
+{
+	char        l3[16], l4[16];
+	const char *l4_name = NULL;
 
-		xdp_program__detach(prog, cfg->iface.ifindex,
-				    cfg->load_xdp_mode, 0);
-		goto error_exit;
+	switch (ntohs(key->l3_proto)) {
+	case 0:
+		snprintf(l3, sizeof(l3), "-");
+		break;
+	case ETH_P_IP:
+		snprintf(l3, sizeof(l3), "ipv4");
+		break;
+	case ETH_P_IPV6:
+		snprintf(l3, sizeof(l3), "ipv6");
+		break;
+	case ETH_P_ARP:
+		snprintf(l3, sizeof(l3), "arp");
+		break;
+	default:
+		snprintf(l3, sizeof(l3), "0x%04x", ntohs(key->l3_proto));
+		break;
 	}
 
-	progs->progs[0].prog = prog;
-	progs->progs[0].func = xdp_program__name(prog);
-	progs->progs[0].rx_capture = RX_FLAG_FENTRY;
-	progs->progs[0].perf_map_fd = fd;
-	progs->nr_of_progs = 1;
+	switch (key->l4_proto) {
+	case IPPROTO_TCP:
+		l4_name = "tcp";
+		break;
+	case IPPROTO_UDP:
+		l4_name = "udp";
+		break;
+	case IPPROTO_SCTP:
+		l4_name = "sctp";
+		break;
+	case IPPROTO_ICMP:
+		l4_name = "icmp";
+		break;
+	case IPPROTO_ICMPV6:
+		l4_name = "icmp6";
+		break;
+	case IPPROTO_GRE:
+		l4_name = "gre";
+		break;
+	}
 
-	return true;
+	if (l4_name)
+		snprintf(l4, sizeof(l4), "%s", l4_name);
+	else if (key->l3_proto == htons(ETH_P_IP) ||
+		 key->l3_proto == htons(ETH_P_IPV6))
+		snprintf(l4, sizeof(l4), "proto %u", key->l4_proto);
+	else
+		snprintf(l4, sizeof(l4), "-");
 
-error_exit:
-	xdp_program__close(prog);
-	return false;
+	snprintf(buf, len, "%-13s rxq %-4u %-6s %-8s",
+		 key->fexit ? get_xdp_action_string(key->action) : "",
+		 key->rx_queue, l3, l4);
 }
 
 /*****************************************************************************
- * unload_xdp_trace_program()
+ * run_stats_loop()
+ *
+ * Print the packet rates of every traced program once a second, until
+ * xdpdump is stopped.
  *****************************************************************************/
-static void unload_xdp_trace_program(struct dumpopt *cfg,
-				     struct capture_programs *progs)
+static bool run_stats_loop(struct capture_programs *progs)
 {
-	if (!progs || progs->nr_of_progs != 1)
-		return;
+	int                       nr_cpus = libbpf_num_possible_cpus();
+	struct trace_stats_value *percpu = NULL;
+	struct trace_stats_key   *keys = NULL;
+	struct stats_entry       *entries = NULL;
+	struct timespec           prev, now;
+	bool                      rc = false;
+	char                      line[64];
+	unsigned int              num;
+	double                    period;
+
+	if (nr_cpus < 0) {
+		pr_warn("ERROR: Can't get the number of CPUs: %s\n",
+			strerror(-nr_cpus));
+		return false;
+	}
 
-	xdp_program__detach(progs->progs[0].prog, cfg->iface.ifindex,
-			    cfg->load_xdp_mode, 0);
-	xdp_program__close(progs->progs[0].prog);
+	percpu = calloc(nr_cpus, sizeof(*percpu));
+	keys = calloc(STATS_MAP_SIZE, sizeof(*keys));
+	entries = calloc(STATS_MAP_SIZE, sizeof(*entries));
+	if (!percpu || !keys || !entries) {
+		pr_warn("ERROR: Can't allocate the stats buffers!\n");
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &prev);
+	while (!exit_xdpdump) {
+		sleep(1);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		period = (now.tv_sec - prev.tv_sec) +
+			 (now.tv_nsec - prev.tv_nsec) / 1e9;
+		prev = now;
+		if (period <= 0)
+			continue;
+
+		/* All programs share the counters, keyed by program index */
+		num = stats_drain(progs->progs[0].stats_map_fd, entries, keys,
+				  percpu, nr_cpus);
+		qsort(entries, num, sizeof(*entries), cmp_stats_entries);
+
+		for (unsigned int i = 0; i < progs->nr_of_progs; i++) {
+			struct prog_info *info = &progs->progs[i];
+			bool              seen = false;
+
+			printf("%s %s():\n", info->iface->ifname, info->func);
+
+			for (unsigned int j = 0; j < num; j++) {
+				if (entries[j].key.prog_index != i)
+					continue;
+
+				seen = true;
+				format_stats_key(line, sizeof(line),
+						 &entries[j].key);
+				printf("  %-5s %-38s %12.0f pkt/s "
+				       "%10.1f Mbit/s\n",
+				       entries[j].key.fexit ? "exit" : "entry",
+				       line, entries[j].value.packets / period,
+				       entries[j].value.bytes * 8 / period /
+				       1000000);
+			}
+			if (!seen)
+				printf("  no packets\n");
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+	rc = true;
 
-	progs->progs[0].prog = NULL;
-	progs->nr_of_progs = 0;
+out:
+	free(percpu);
+	free(keys);
+	free(entries);
+	return rc;
 }
 
 /*****************************************************************************
@@ -1634,155 +4023,245 @@ static bool capture_on_interface(struct dumpopt *cfg)
 	int                          err, cnt;
 	bool                         rc = false;
 	bool                         load_xdp = false;
-	bool                         promiscuous = false;
-	pcap_t                      *pcap = NULL;
-	pcap_dumper_t               *pcap_dumper = NULL;
-	struct xpcapng_dumper       *pcapng_dumper = NULL;
+	unsigned int                 nr_ifaces = 0;
+	uint32_t                     perf_pages;
+	struct iface                *iface;
 	struct perf_buffer          *perf_buf = NULL;
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+	struct ring_buffer          *ring_buf = NULL;
+#endif
 	struct perf_event_attr       perf_attr = {
 		.sample_type = PERF_SAMPLE_RAW | PERF_SAMPLE_TIME,
 		.type = PERF_TYPE_SOFTWARE,
 		.config = PERF_COUNT_SW_BPF_OUTPUT,
 		.sample_period = 1,
 		.wakeup_events = 1,
+		/* The default perf clock is not CLOCK_MONOTONIC, which the
+		 * ring buffer samples and the clock offset are based on.
+		 */
+		.use_clockid = 1,
+		.clockid = CLOCK_MONOTONIC,
 	};
-	struct perf_handler_ctx      perf_ctx;
-	struct xdp_multiprog         *mp;
+	struct perf_handler_ctx      perf_ctx = {};
 	struct capture_programs      tgt_progs = {};
+	struct capture_programs      map_progs = {};
+	struct {
+		struct iface         *iface;
+		struct xdp_multiprog *mp;
+		bool                  promiscuous;
+	} ifaces[MAX_CAPTURE_INTERFACES] = {};
+
+	/* Find the programs to capture on for each of the interfaces. All
+	 * of them are traced into the same buffer, and written to the same
+	 * capture file.
+	 */
+	if (!open_map_programs(cfg, &map_progs))
+		goto error_exit;
 
-	mp = xdp_multiprog__get_from_ifindex(cfg->iface.ifindex);
-	if (IS_ERR_OR_NULL(mp) || xdp_multiprog__main_prog(mp) == NULL) {
+	for (iface = cfg->ifaces; iface; iface = iface->next) {
+		struct capture_programs  iface_progs = {};
+		struct xdp_multiprog    *mp;
 
-		if (!cfg->load_xdp) {
-			pr_warn("WARNING: Specified interface does not have an XDP program loaded%s,"
-				"\n         capturing in legacy mode!\n",
-				IS_ERR_OR_NULL(mp) ? "" : " in software");
+		if (nr_ifaces >= MAX_CAPTURE_INTERFACES) {
+			pr_warn("ERROR: Can't capture on more than %d interfaces!\n",
+				MAX_CAPTURE_INTERFACES);
+			goto error_exit;
+		}
 
-			xdp_multiprog__close(mp);
-			return capture_on_legacy_interface(cfg);
+		for (unsigned int i = 0; i < nr_ifaces; i++) {
+			if (ifaces[i].iface->ifindex == iface->ifindex) {
+				pr_warn("ERROR: Interface %s specified more than once!\n",
+					iface->ifname);
+				goto error_exit;
+			}
 		}
-		pr_warn("WARNING: Specified interface does not have an XDP program loaded%s!\n"
-			"         Will load a capture only XDP program!\n",
-			IS_ERR_OR_NULL(mp) ? "" : " in software");
-		load_xdp = true;
-	}
 
-	if (!load_xdp) {
-		if (find_target(cfg, mp, &tgt_progs))
-			goto error_exit;
+		mp = xdp_multiprog__get_from_ifindex(iface->ifindex);
+		ifaces[nr_ifaces].iface = iface;
+		ifaces[nr_ifaces].mp = IS_ERR_OR_NULL(mp) ? NULL : mp;
+		nr_ifaces++;
+
+		if (IS_ERR_OR_NULL(mp) || xdp_multiprog__main_prog(mp) == NULL) {
+
+			/* Only the map programs are captured on. */
+			if (map_progs.nr_of_progs) {
+				pr_debug("No XDP program loaded on %s, only "
+					 "capturing on map programs\n",
+					 iface->ifname);
+			} else if (cfg->stats_only) {
+				pr_warn("ERROR: Interface %s does not have an XDP program "
+					"loaded%s, which --stats-only needs!\n",
+					iface->ifname,
+					IS_ERR_OR_NULL(mp) ? "" : " in software");
+				goto error_exit;
+			} else if (!cfg->load_xdp) {
+				if (cfg->ifaces->next) {
+					pr_warn("ERROR: Interface %s does not have an XDP program loaded%s,\n"
+						"       legacy mode can only capture on a single interface!\n",
+						iface->ifname,
+						IS_ERR_OR_NULL(mp) ? "" : " in software");
+					goto error_exit;
+				}
+				pr_warn("WARNING: Specified interface does not have an XDP program loaded%s,"
+					"\n         capturing in legacy mode!\n",
+					IS_ERR_OR_NULL(mp) ? "" : " in software");
 
-		if (tgt_progs.nr_of_progs == 0) {
-			pr_warn("ERROR: Failed finding any attached XDP program!\n");
-			goto error_exit;
+				xdp_multiprog__close(ifaces[0].mp);
+				return capture_on_legacy_interface(cfg);
+			} else {
+				pr_warn("WARNING: Specified interface does not have an XDP program loaded%s!\n"
+					"         Will load a capture only XDP program!\n",
+					IS_ERR_OR_NULL(mp) ? "" : " in software");
+				if (cfg->filter || sampling_enabled(cfg) ||
+				    cfg->headers_only) {
+					pr_warn("ERROR: The capture only XDP program does not "
+						"support capture filters, sampling or headers "
+						"only capture!\n");
+					goto error_exit;
+				}
+				load_xdp = true;
+
+				iface_progs.nr_of_progs = 1;
+				iface_progs.progs[0].rx_capture = RX_FLAG_FENTRY;
+				iface_progs.progs[0].load_xdp = true;
+			}
+		} else {
+			if (find_target(cfg, mp, &iface_progs))
+				goto error_exit;
+
+			if (iface_progs.nr_of_progs == 0) {
+				pr_warn("ERROR: Failed finding any attached XDP program on %s!\n",
+					iface->ifname);
+				goto error_exit;
+			}
 		}
+
+		if (!add_capture_programs(&tgt_progs, &iface_progs, iface) ||
+		    !add_capture_programs(&tgt_progs, &map_progs, iface))
+			goto error_exit;
 	}
 
 	/* Enable promiscuous mode if requested. */
-	if (cfg->promiscuous) {
-		err = set_if_promiscuous_mode(&cfg->iface, true,
-					      &cfg->promiscuous);
+	for (unsigned int i = 0; cfg->promiscuous && i < nr_ifaces; i++) {
+		err = set_if_promiscuous_mode(ifaces[i].iface, true,
+					      &ifaces[i].promiscuous);
 		if (err) {
-			pr_warn("ERROR: Failed setting promiscuous mode: %s(%d)\n",
-				strerror(-err), -err);
+			pr_warn("ERROR: Failed setting promiscuous mode on %s: %s(%d)\n",
+				ifaces[i].iface->ifname, strerror(-err), -err);
 			goto error_exit;
 		}
-		promiscuous = true;
 	}
 
 	/* Load and attach programs */
-	if (!load_xdp) {
-		if (!load_and_attach_traces(cfg, &tgt_progs)) {
-			/* Actual errors are reported in the above function. */
-			goto error_exit;
-		}
-	} else {
-		if (!load_xdp_trace_program(cfg, &tgt_progs)) {
-			/* Actual errors are reported in the above function. */
-			goto error_exit;
-		}
+	tgt_progs.use_ringbuf = use_ringbuf_capture(cfg, load_xdp);
+	pr_debug("Capturing using the %s buffer\n",
+		 tgt_progs.use_ringbuf ? "ring" : "perf");
+
+	if (!load_and_attach_traces(cfg, &tgt_progs)) {
+		/* Actual errors are reported in the above function. */
+		goto error_exit;
 	}
 
+	/* Setup perf context */
+	perf_ctx.cfg = cfg;
+	perf_ctx.xdp_progs = &tgt_progs;
+	perf_ctx.epoch_delta = get_clock_delta(cfg->clock);
+
         /* Open the pcap handle */
 	if (cfg->pcap_file) {
 
 		if (cfg->use_pcap) {
-			pcap = pcap_open_dead(DLT_EN10MB, cfg->snaplen);
-			if (!pcap) {
+			perf_ctx.pcap = pcap_open_dead(DLT_EN10MB, cfg->snaplen);
+			if (!perf_ctx.pcap) {
 				pr_warn("ERROR: Can't open pcap dead handler!\n");
 				goto error_exit;
 			}
+		}
 
-			pcap_dumper = pcap_dump_open(pcap, cfg->pcap_file);
-			if (!pcap_dumper) {
-				pr_warn("ERROR: Can't open pcap file for writing!\n");
-				goto error_exit;
-			}
-		} else {
-			char           *program_info;
-			struct utsname  utinfo;
-			char            os_info[260];
-
-			memset(&utinfo, 0, sizeof(utinfo));
-			uname(&utinfo);
-
-			os_info[0] = 0;
-			if (try_snprintf(os_info, sizeof(os_info), "%s %s %s %s",
-					 utinfo.sysname, utinfo.nodename,
-					 utinfo.release, utinfo.version)) {
-				pr_warn("ERROR: Could not format OS information!\n");
+		if (cfg->flight_recorder) {
+			if (!flight_recorder_init(&perf_ctx.recorder,
+						  cfg->flight_recorder * 1000000ULL))
 				goto error_exit;
-			}
+		} else if (!open_capture_file(&perf_ctx)) {
+			/* Error output is handled in open_capture_file() */
+			goto error_exit;
+		}
+	}
 
-			program_info = get_loaded_program_info(cfg);
-			if (!program_info) {
-				pr_warn("ERROR: Could not format program information!\n");
-				goto error_exit;
-			}
+	/* No more error conditions, display some capture information */
+	for (unsigned int i = 0; i < nr_ifaces; i++) {
+		fprintf(stderr, "listening on %s, ingress XDP program ",
+			ifaces[i].iface->ifname);
 
-			pcapng_dumper = xpcapng_dump_open(cfg->pcap_file,
-							  program_info,
-							  utinfo.machine,
-							  os_info,
-							  "xdpdump v" TOOLS_VERSION);
+		for (unsigned int j = 0; j < tgt_progs.nr_of_progs; j++) {
+			if (tgt_progs.progs[j].iface != ifaces[i].iface)
+				continue;
 
-			free(program_info);
-			if (!pcapng_dumper) {
-				pr_warn("ERROR: Can't open PcapNG file for writing!\n");
-				goto error_exit;
-			}
+			fprintf(stderr, "ID %u func %s, ",
+				xdp_program__id(tgt_progs.progs[j].prog),
+				tgt_progs.progs[j].func);
+		}
+
+		fprintf(stderr, "capture mode %s, capture size %d bytes\n",
+			get_capture_mode_string(tgt_progs.progs[0].rx_capture),
+			cfg->snaplen);
+	}
+
+	if (cfg->flight_recorder)
+		fprintf(stderr, "flight recorder keeps the last %u MB of packets, "
+			"send SIGUSR1 to write them to %s.<n>\n",
+			cfg->flight_recorder, cfg->pcap_file);
+
+	if (cfg->stats_only) {
+		rc = run_stats_loop(&tgt_progs);
+		goto error_exit;
+	}
 
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+	if (tgt_progs.use_ringbuf) {
+		ring_buf = ring_buffer__new(tgt_progs.progs[0].ringbuf_map_fd,
+					    handle_ringbuf_event, &perf_ctx,
+					    NULL);
+		if (ring_buf == NULL) {
+			pr_warn("ERROR: Failed to allocate ring buffer: %s(%d)",
+				strerror(errno), errno);
+			goto error_exit;
+		}
 
-			if (!add_interfaces_to_pcapng(cfg, pcapng_dumper,
-						     &tgt_progs)) {
-				/* Error output is handled in
-				 * add_interfaces_to_pcapng()
-				 */
+		while (!exit_xdpdump) {
+			cnt = ring_buffer__poll(ring_buf, cfg->poll_timeout);
+			if (cnt < 0 && cnt != -EINTR) {
+				pr_warn("ERROR: Ring buffer polling failed: %s(%d)",
+					strerror(-cnt), -cnt);
 				goto error_exit;
 			}
+			if (cnt == 0 && perf_ctx.pcapng_dumper)
+				xpcapng_dump_flush(perf_ctx.pcapng_dumper);
+			check_flight_recorder(&perf_ctx);
+			update_ringbuf_lost(&perf_ctx,
+					    tgt_progs.progs[0].ringbuf_lost_fd);
 		}
+		ring_buffer__consume(ring_buf);
+		update_ringbuf_lost(&perf_ctx,
+				    tgt_progs.progs[0].ringbuf_lost_fd);
+
+		fprintf(stderr, "\n%"PRIu64" packets captured\n",
+			perf_ctx.captured_packets);
+		fprintf(stderr, "%"PRIu64" packets dropped by ring buffer\n",
+			perf_ctx.missed_events);
+		if (is_remote_capture(cfg))
+			fprintf(stderr, "%"PRIu64" packets dropped by send queue\n",
+				perf_ctx.queue_dropped);
+		if (sampling_enabled(cfg))
+			fprintf(stderr, "%"PRIu64" packets skipped by sampling\n",
+				perf_ctx.sampled_out_packets);
+
+		rc = true;
+		goto error_exit;
 	}
+#endif
 
-	/* No more error conditions, display some capture information */
-	fprintf(stderr, "listening on %s, ingress XDP program ",
-		cfg->iface.ifname);
-
-	for (unsigned int i = 0; i < tgt_progs.nr_of_progs; i++)
-		fprintf(stderr, "ID %u func %s, ",
-			xdp_program__id(tgt_progs.progs[i].prog),
-			tgt_progs.progs[i].func);
-
-	fprintf(stderr, "capture mode %s, capture size %d bytes\n",
-		get_capture_mode_string(tgt_progs.progs[0].rx_capture),
-		cfg->snaplen);
-
-	/* Setup perf context */
-	memset(&perf_ctx, 0, sizeof(perf_ctx));
-	perf_ctx.cfg = cfg;
-	perf_ctx.xdp_progs = &tgt_progs;
-	perf_ctx.pcap = pcap;
-	perf_ctx.pcap_dumper = pcap_dumper;
-	perf_ctx.pcapng_dumper = pcapng_dumper;
-	perf_ctx.epoch_delta = get_epoch_to_uptime_delta();
+	perf_pages = get_perf_buffer_pages(cfg);
 
 	/* Determine the perf wakeup_events value to use */
 #ifdef HAVE_LIBBPF_PERF_BUFFER__CONSUME
@@ -1798,7 +4277,7 @@ static bool capture_on_interface(struct dumpopt *cfg)
 			 * an average packet size of 2K we would like to
 			 * fill without losing any packets.
 			 */
-			uint32_t events = PERF_MMAP_PAGE_COUNT * getpagesize() /
+			uint32_t events = perf_pages * getpagesize() /
 				(libbpf_num_possible_cpus() ?: 1) / 2048;
 
 			if (events > 0)
@@ -1815,10 +4294,27 @@ static bool capture_on_interface(struct dumpopt *cfg)
 #endif
 	pr_debug("perf-wakeup value uses is %u\n", perf_attr.wakeup_events);
 
+#ifdef HAVE_LIBBPF_PERF_BUFFER__CONSUME
+	/* Or wake up after a number of bytes with --perf-watermark */
+	if (cfg->perf_watermark) {
+		if ((uint64_t) cfg->perf_watermark >=
+		    (uint64_t) perf_pages * getpagesize()) {
+			pr_warn("ERROR: The --perf-watermark must be smaller "
+				"than the %u KB perf buffers!\n",
+				perf_pages * (getpagesize() / 1024));
+			goto error_exit;
+		}
+		perf_attr.watermark = 1;
+		perf_attr.wakeup_watermark = cfg->perf_watermark;
+		pr_debug("perf-watermark value used is %u\n",
+			 perf_attr.wakeup_watermark);
+	}
+#endif
+
 #ifdef HAVE_LIBBPF_PERF_BUFFER__NEW_RAW
 	/* the configure check looks for the 6-argument variant of the function */
 	perf_buf = perf_buffer__new_raw(tgt_progs.progs[0].perf_map_fd,
-					PERF_MMAP_PAGE_COUNT,
+					perf_pages,
 					&perf_attr, handle_perf_event,
 					&perf_ctx, NULL);
 #else
@@ -1829,7 +4325,7 @@ static bool capture_on_interface(struct dumpopt *cfg)
 	perf_opts.event_cb = handle_perf_event;
 	perf_opts.ctx = &perf_ctx;
 	perf_buf = perf_buffer__new_raw(tgt_progs.progs[0].perf_map_fd,
-					PERF_MMAP_PAGE_COUNT,
+					perf_pages,
 					&perf_opts);
 #endif
 
@@ -1839,14 +4335,31 @@ static bool capture_on_interface(struct dumpopt *cfg)
 		goto error_exit;
 	}
 
+#ifdef HAVE_LIBBPF_PERF_BUFFER__CONSUME_BUFFER
+	if (cfg->threads > 1) {
+		if (!run_capture_threads(cfg, &perf_ctx, perf_buf,
+					 (size_t) perf_pages * getpagesize()))
+			goto error_exit;
+	}
+#endif
+
 	/* Loop trough the dumper */
 	while (!exit_xdpdump) {
-		cnt = perf_buffer__poll(perf_buf, 1000);
+		cnt = perf_buffer__poll(perf_buf, cfg->poll_timeout);
 		if (cnt < 0 && errno != EINTR) {
 			pr_warn("ERROR: Perf buffer polling failed: %s(%d)",
 				strerror(errno), errno);
 			goto error_exit;
 		}
+#ifdef HAVE_LIBBPF_PERF_BUFFER__CONSUME
+		/* Drain the samples still below the wakeup threshold. */
+		if (cnt == 0)
+			perf_buffer__consume(perf_buf);
+#endif
+		/* Write out buffered packets while the link is idle. */
+		if (cnt == 0 && perf_ctx.pcapng_dumper)
+			xpcapng_dump_flush(perf_ctx.pcapng_dumper);
+		check_flight_recorder(&perf_ctx);
 	}
 #ifdef HAVE_LIBBPF_PERF_BUFFER__CONSUME
 	perf_buffer__consume(perf_buf);
@@ -1856,34 +4369,49 @@ static bool capture_on_interface(struct dumpopt *cfg)
 		perf_ctx.captured_packets);
 	fprintf(stderr, "%"PRIu64" packets dropped by perf ring\n",
 		perf_ctx.missed_events);
+	if (is_remote_capture(cfg))
+		fprintf(stderr, "%"PRIu64" packets dropped by send queue\n",
+			perf_ctx.queue_dropped);
+	if (sampling_enabled(cfg))
+		fprintf(stderr, "%"PRIu64" packets skipped by sampling\n",
+			perf_ctx.sampled_out_packets);
 
 
 	rc = true;
 
 error_exit:
 	/* Cleanup all our resources */
-	if (promiscuous && cfg->promiscuous) {
-		err = set_if_promiscuous_mode(&cfg->iface, false, NULL);
+	for (unsigned int i = 0; i < nr_ifaces; i++) {
+		if (!ifaces[i].promiscuous)
+			continue;
+
+		err = set_if_promiscuous_mode(ifaces[i].iface, false, NULL);
 		if (err)
-			pr_warn("ERROR: Failed disabling promiscuous mode: "
-				"%s(%d)\n", strerror(-err), -err);
+			pr_warn("ERROR: Failed disabling promiscuous mode on %s: "
+				"%s(%d)\n", ifaces[i].iface->ifname,
+				strerror(-err), -err);
 	}
 
 	perf_buffer__free(perf_buf);
-	xpcapng_dump_close(pcapng_dumper);
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+	ring_buffer__free(ring_buf);
+#endif
+	if (rc && perf_ctx.recorder.entries)
+		fprintf(stderr, "%zu packets in the flight recorder were not "
+			"written\n", perf_ctx.recorder.entries);
 
-	if (pcap_dumper)
-		pcap_dump_close(pcap_dumper);
+	close_capture_file(&perf_ctx);
+	flight_recorder_free(&perf_ctx.recorder);
 
-	if (pcap)
-		pcap_close(pcap);
+	if (perf_ctx.pcap)
+		pcap_close(perf_ctx.pcap);
 
-	if (load_xdp)
-		unload_xdp_trace_program(cfg, &tgt_progs);
-	else
-		detach_traces(&tgt_progs);
+	detach_traces(cfg, &tgt_progs);
 
-	xdp_multiprog__close(mp);
+	for (unsigned int i = 0; i < nr_ifaces; i++)
+		xdp_multiprog__close(ifaces[i].mp);
+	for (unsigned int i = 0; i < map_progs.nr_of_progs; i++)
+		xdp_program__close(map_progs.progs[i].prog);
 	return rc;
 }
 
@@ -1897,6 +4425,14 @@ static void signal_handler(__unused int signo)
 		pcap_breakloop(exit_pcap);
 }
 
+/*****************************************************************************
+ * recorder_signal_handler()
+ *****************************************************************************/
+static void recorder_signal_handler(__unused int signo)
+{
+	dump_recorder = true;
+}
+
 /*****************************************************************************
  * main()
  *****************************************************************************/
@@ -1918,9 +4454,114 @@ int main(int argc, char **argv)
 	if (cfg_dumpopt.rx_capture == 0)
 		cfg_dumpopt.rx_capture = RX_FLAG_FENTRY;
 
+	if (cfg_dumpopt.payload_len && !cfg_dumpopt.headers_only) {
+		pr_warn("ERROR: The --payload-length option requires "
+			"--headers-only!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (numbered_capture_files(&cfg_dumpopt) &&
+	    (!cfg_dumpopt.pcap_file || !strcmp(cfg_dumpopt.pcap_file, "-"))) {
+		pr_warn("ERROR: Capture file rotation and the flight recorder "
+			"require a --write file!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (is_remote_capture(&cfg_dumpopt) &&
+	    (numbered_capture_files(&cfg_dumpopt) || cfg_dumpopt.mmap_size ||
+	     cfg_dumpopt.use_pcap ||
+	     cfg_dumpopt.compress != XPCAPNG_COMPRESS_NONE)) {
+		pr_warn("ERROR: A %s --write destination can not be combined with "
+			"file rotation, the flight recorder, --mmap-size, "
+			"--use-pcap or --compress!\n", REMOTE_PREFIX);
+		return EXIT_FAILURE;
+	}
+
+	if (is_remote_capture(&cfg_dumpopt) && !cfg_dumpopt.send_queue_size) {
+		pr_warn("ERROR: The --send-queue-size can not be 0!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (cfg_dumpopt.perf_watermark && cfg_dumpopt.perf_wakeup) {
+		pr_warn("ERROR: The --perf-watermark and --perf-wakeup options "
+			"can not be combined!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!cfg_dumpopt.poll_timeout) {
+		pr_warn("ERROR: The --poll-timeout can not be 0!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (cfg_dumpopt.rotate_count && !numbered_capture_files(&cfg_dumpopt)) {
+		pr_warn("ERROR: The --rotate-count option requires --rotate-size, "
+			"--rotate-seconds or --flight-recorder!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (cfg_dumpopt.flight_recorder &&
+	    (cfg_dumpopt.rotate_size || cfg_dumpopt.rotate_seconds ||
+	     cfg_dumpopt.use_pcap)) {
+		pr_warn("ERROR: The --flight-recorder option can not be combined "
+			"with file rotation or --use-pcap!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (cfg_dumpopt.mmap_size &&
+	    (!cfg_dumpopt.pcap_file || !strcmp(cfg_dumpopt.pcap_file, "-") ||
+	     cfg_dumpopt.use_pcap)) {
+		pr_warn("ERROR: The --mmap-size option requires a PcapNG "
+			"--write file!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (cfg_dumpopt.stats_only &&
+	    (cfg_dumpopt.pcap_file || cfg_dumpopt.flight_recorder ||
+	     cfg_dumpopt.redirect_targets || sampling_enabled(&cfg_dumpopt))) {
+		pr_warn("ERROR: The --stats-only option can not be combined with "
+			"--write, --flight-recorder, --redirect-targets or "
+			"sampling!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (cfg_dumpopt.compress != XPCAPNG_COMPRESS_NONE &&
+	    (!cfg_dumpopt.pcap_file || cfg_dumpopt.use_pcap ||
+	     cfg_dumpopt.mmap_size)) {
+		pr_warn("ERROR: The --compress option requires a PcapNG --write "
+			"file, and can not be combined with --mmap-size!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (cfg_dumpopt.dedup_exit &&
+	    (cfg_dumpopt.rx_capture != (RX_FLAG_FENTRY | RX_FLAG_FEXIT) ||
+	     cfg_dumpopt.use_pcap || cfg_dumpopt.stats_only)) {
+		pr_warn("ERROR: The --dedup-exit option requires "
+			"--rx-capture=entry,exit, and can not be combined with "
+			"--use-pcap or --stats-only!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (cfg_dumpopt.redirect_targets && cfg_dumpopt.use_pcap) {
+		pr_warn("ERROR: Redirect targets can not be stored with "
+			"--use-pcap!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (cfg_dumpopt.redirect_targets && !redirect_tracepoints_supported()) {
+		pr_warn("ERROR: The kernel's xdp_redirect tracepoints do not "
+			"report the map type and id, which --redirect-targets "
+			"requires!\n");
+		return EXIT_FAILURE;
+	}
+
+	if (cfg_dumpopt.filter &&
+	    !parse_capture_filter(cfg_dumpopt.filter,
+				  &cfg_dumpopt.capture_filter))
+		return EXIT_FAILURE;
+
 	/* See if we need to dump interfaces and exit */
 	if (cfg_dumpopt.list_interfaces) {
-		if (iface_print_status(NULL))
+		if (iface_print_status(NULL, false))
 			return EXIT_SUCCESS;
 		return EXIT_FAILURE;
 	}
@@ -1942,11 +4583,28 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	if (cfg_dumpopt.iface.ifname == NULL) {
+	if (cfg_dumpopt.flight_recorder &&
+	    signal(SIGUSR1, recorder_signal_handler) == SIG_ERR) {
+		pr_warn("ERROR: Failed assigning signal handler: %s\n",
+			strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (cfg_dumpopt.ifaces == NULL) {
 		pr_warn("ERROR: You must specific an interface to capture on!\n");
 		return EXIT_FAILURE;
 	}
 
+	/* Program names and IDs are looked up on a single interface, only
+	 * "all" has a meaning for each of them.
+	 */
+	if (cfg_dumpopt.ifaces->next && cfg_dumpopt.program_names &&
+	    strcmp(cfg_dumpopt.program_names, "all")) {
+		pr_warn("ERROR: With multiple interfaces --program-names only "
+			"supports \"all\"!\n");
+		return EXIT_FAILURE;
+	}
+
 	if (!capture_on_interface(&cfg_dumpopt))
 		return EXIT_FAILURE;
 
@@ -11,8 +11,20 @@
  ******************************************************************************/
 #define PERF_MAX_WAKEUP_EVENTS   64
 #define PERF_MMAP_PAGE_COUNT	256
+#define PERF_AUTO_BUFFER_MSEC	100
+#define PERF_AUTO_MAX_SIZE	(16 * 1024 * 1024)
+#define PERF_SAMPLE_OVERHEAD	56
 #define MAX_CPUS		256
 
+/* Ring buffer capture needs bpf_map__set_autocreate() so the ring buffer map
+ * can be skipped on kernels that do not support it.
+ */
+#ifdef HAVE_LIBBPF_BPF_MAP__SET_AUTOCREATE
+#define XDPDUMP_RINGBUF_SUPPORT
+#endif
+#define RINGBUF_MAX_CAP_LEN	16384
+#define RINGBUF_MAX_SIZE	(256 * 1024 * 1024)
+
 /******************************************************************************
  * General used macros
  ******************************************************************************/
@@ -23,25 +35,150 @@
 /*****************************************************************************
  * trace configuration structure
  *****************************************************************************/
+#define TRACE_FILTER_ETH_PROTO	(1 << 0)
+#define TRACE_FILTER_IP_PROTO	(1 << 1)
+#define TRACE_FILTER_HOST	(1 << 2)
+#define TRACE_FILTER_SRC_HOST	(1 << 3)
+#define TRACE_FILTER_DST_HOST	(1 << 4)
+#define TRACE_FILTER_PORT	(1 << 5)
+#define TRACE_FILTER_SRC_PORT	(1 << 6)
+#define TRACE_FILTER_DST_PORT	(1 << 7)
+
+#define TRACE_FILTER_ANY_PORT	(TRACE_FILTER_PORT | TRACE_FILTER_SRC_PORT | \
+				 TRACE_FILTER_DST_PORT)
+
+/* Restricted capture filter evaluated by the trace programs. All primitives
+ * present in flags must match. Protocols, addresses and ports are stored in
+ * network byte order, IPv4 addresses only use the first word.
+ */
+struct trace_filter {
+	__u32 flags;
+	__u16 eth_proto;
+	__u8  ip_proto;
+	__u8  reserved;
+	__u16 port;
+	__u16 src_port;
+	__u16 dst_port;
+	__u16 reserved2;
+	__u32 host[4];
+	__u32 src_host[4];
+	__u32 dst_host[4];
+};
+
+/* The sampling decision taken by the fentry program is reused by the fexit
+ * program, so both directions of a packet are either captured or not.
+ */
+#define TRACE_SAMPLE_FOLLOW_ENTRY (1 << 0)
+
+/* Only capture up to the end of the innermost L4 header plus
+ * capture_payload_len bytes, still limited by the capture_snaplen.
+ */
+#define TRACE_CAPTURE_HEADERS_ONLY (1 << 0)
+
+/* Report the target of packets sent out with XDP_REDIRECT, set in the slot
+ * of the first program run on the interface. The object holding it has the
+ * redirect tracepoints loaded.
+ */
+#define TRACE_CAPTURE_REDIRECT     (1 << 1)
+
+/* The traced program is run from a devmap or cpumap entry, so besides the
+ * receiving interface, also match packets sent out of the capture interface.
+ */
+#define TRACE_CAPTURE_MAP_PROG     (1 << 2)
+
+/* The fexit program only reports the verdict if the packet looks the same as
+ * when the fentry program captured it. They compare the packet length, start
+ * and a hash of the captured bytes, so packets with more than
+ * TRACE_DEDUP_MAX_LEN captured bytes are always reported in full.
+ */
+#define TRACE_CAPTURE_DEDUP_EXIT   (1 << 3)
+#define TRACE_DEDUP_MAX_LEN        4096
+
 struct trace_configuration {
 	__u32 capture_if_ifindex;
 	__u32 capture_snaplen;
 	__u32 capture_prog_index;
+	__u32 capture_sample_rate;	/* Capture 1 in N, 0 captures all */
+	__u32 capture_rate_interval;	/* Minimum ns between captured packets */
+	__u32 capture_sample_flags;
+	__u32 capture_flags;
+	__u32 capture_payload_len;
+	struct trace_filter capture_filter;
+};
+
+/* The trace object holds this many instances of each trace program, each
+ * using its own entry of the trace_configuration array, so the programs of a
+ * whole dispatcher chain, and the dispatcher itself, are traced by loading a
+ * single object.
+ */
+#define TRACE_MAX_SLOTS 11
+
+/*****************************************************************************
+ * --stats-only counters, kept per traced program
+ *****************************************************************************/
+#define STATS_MAP_SIZE 1024
+
+/* The action is only set for packets counted on fexit. The protocols are
+ * zero if the packet is too short to tell, the l4_proto also for non IP
+ * packets.
+ */
+struct trace_stats_key {
+	__u32 prog_index;
+	__u32 rx_queue;
+	int   action;
+	__u16 l3_proto;		/* network byte order */
+	__u8  l4_proto;
+	__u8  fexit;
+};
+
+struct trace_stats_value {
+	__u64 packets;
+	__u64 bytes;
 };
 
 /*****************************************************************************
  * perf data structures
  *****************************************************************************/
 #define MDF_DIRECTION_FEXIT 1
+#define MDF_REDIRECT        2
+#define MDF_UNCHANGED       4
 
+/* Events with MDF_REDIRECT set carry no packet data, they report where the
+ * last packet captured on the CPU was redirected to. The redirect_index is
+ * the target interface for bpf_redirect() and devmaps, the CPU for cpumaps,
+ * and the queue for xskmaps.
+ *
+ * Fexit events with MDF_UNCHANGED set carry no packet data either, the packet
+ * is the same as in the preceding fentry event on the CPU.
+ */
 struct pkt_trace_metadata {
 	__u32 ifindex;
-	__u32 rx_queue;
-	__u16 pkt_len;
+	union {
+		__u32 rx_queue;
+		__u32 redirect_index;
+	};
+	union {
+		__u16 pkt_len;
+		__u16 redirect_map_type;
+	};
 	__u16 cap_len;
 	__u16 flags;
 	__u16 prog_index;
-	int   action;
+	union {
+		int   action;
+		int   redirect_err;
+	};
+	union {
+		__u32 sampled_out;
+		__u32 redirect_map_id;
+	};
+} __packed;
+
+struct ringbuf_sample_event {
+	__u64 time;
+	__u32 cpu;
+	struct pkt_trace_metadata metadata;
+	unsigned char packet[];
 } __packed;
 
 #ifndef __bpf__
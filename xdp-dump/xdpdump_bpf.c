@@ -6,7 +6,9 @@
 #include <stdbool.h>
 #include <linux/bpf.h>
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_core_read.h>
 #include <bpf/bpf_trace_helpers.h>
+#include <xdp/parsing_helpers.h>
 #include "xdpdump.h"
 
 /*****************************************************************************
@@ -14,6 +16,12 @@
  *****************************************************************************/
 #define min(x,y) ((x)<(y) ? x : y)
 
+#define NSEC_PER_SEC        1000000000ULL
+#define IP_FRAG_OFFSET_MASK 0x1fff
+#define FILTER_VLAN_DEPTH   2
+#define HDR_MAX_LAYERS      10
+#define VXLAN_UDP_PORT      4789
+
 /*****************************************************************************
  * (re)definition of kernel data structures for use with BTF
  *****************************************************************************/
@@ -32,6 +40,13 @@ struct xdp_rxq_info {
 	__u32 queue_index;
 } __attribute__((preserve_access_index));
 
+struct xdp_txq_info {
+	/* Structure does not need to contain all entries,
+	 * as "preserve_access_index" will use BTF to fix this...
+	 */
+	struct net_device *dev;
+} __attribute__((preserve_access_index));
+
 struct xdp_buff {
 	void *data;
 	void *data_end;
@@ -39,6 +54,16 @@ struct xdp_buff {
 	void *data_hard_start;
 	unsigned long handle;
 	struct xdp_rxq_info *rxq;
+	struct xdp_txq_info *txq;
+} __attribute__((preserve_access_index));
+
+struct bpf_prog;
+
+struct bpf_dtab_netdev {
+	/* Structure does not need to contain all entries,
+	 * as "preserve_access_index" will use BTF to fix this...
+	 */
+	struct net_device *dev;
 } __attribute__((preserve_access_index));
 
 /*****************************************************************************
@@ -51,36 +76,666 @@ struct {
 	__type(value, __u32);
 } xdpdump_perf_map SEC(".maps");
 
+struct trace_sample_state {
+	__u64 next_capture_ns;
+	__u32 sample_count;
+	__u32 sampled_out;
+	__u32 entry_captured;
+	__u32 redirect_pending;
+	__u64 dedup_hash;
+	__u64 dedup_data;
+	__u32 dedup_len;
+	__u32 dedup_valid;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, TRACE_MAX_SLOTS);
+	__type(key, __u32);
+	__type(value, struct trace_sample_state);
+} xdpdump_sample_state SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(max_entries, STATS_MAP_SIZE);
+	__type(key, struct trace_stats_key);
+	__type(value, struct trace_stats_value);
+} xdpdump_stats SEC(".maps");
+
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 4096 * 1024);
+} xdpdump_ringbuf SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, __u64);
+} xdpdump_ringbuf_lost SEC(".maps");
+#endif
 
 /*****************************************************************************
- * .data section value storing the capture configuration
+ * Header layers walked for headers only capture
  *****************************************************************************/
-struct trace_configuration trace_cfg SEC(".data");
+enum hdr_layer {
+	HDR_DONE = 0,
+	HDR_ETH,
+	HDR_IPV4,
+	HDR_IPV6,
+	HDR_IPV6_OPT,
+	HDR_IPV6_FRAG,
+	HDR_GRE,
+	HDR_UDP,
+	HDR_VXLAN,
+	HDR_TCP,
+	HDR_SCTP,
+	HDR_ICMP,
+};
+
+struct gre_base_hdr {
+	__be16 flags;
+	__be16 protocol;
+};
+
+struct ipv6_frag_hdr {
+	__u8   nexthdr;
+	__u8   reserved;
+	__be16 frag_off;
+	__be32 identification;
+};
 
 /*****************************************************************************
- * trace_to_perf_buffer()
+ * .data section value storing the capture configuration of each slot
  *****************************************************************************/
-static inline void trace_to_perf_buffer(struct xdp_buff *xdp, bool fexit,
-					int action)
+struct trace_configuration trace_cfg[TRACE_MAX_SLOTS] SEC(".data");
+
+/*****************************************************************************
+ * filter_addr_equal()
+ *****************************************************************************/
+static __always_inline bool filter_addr_equal(const __u32 *a, const __u32 *b)
 {
-	void *data_end = (void *)(long)xdp->data_end;
-	void *data = (void *)(long)xdp->data;
-	struct pkt_trace_metadata metadata;
+	return a[0] == b[0] && a[1] == b[1] && a[2] == b[2] && a[3] == b[3];
+}
 
-	if (data >= data_end ||
-	    trace_cfg.capture_if_ifindex != xdp->rxq->dev->ifindex)
+/*****************************************************************************
+ * filter_match()
+ *
+ * Evaluate the restricted capture filter against the packet. As the packet
+ * data is kernel memory from the tracing program's point of view, all headers
+ * are copied out using bpf_probe_read_kernel().
+ *****************************************************************************/
+static __always_inline bool filter_match(const struct trace_configuration *cfg,
+					 struct xdp_buff *xdp, __u32 pkt_len)
+{
+	const struct trace_filter *filter = &cfg->capture_filter;
+	unsigned char             *data = xdp->data;
+	__u32                      saddr[4] = {};
+	__u32                      daddr[4] = {};
+	__u16                      ports[2] = {};
+	__u16                      eth_proto;
+	__u8                       ip_proto;
+	__u32                      offset;
+	bool                       first_frag = true;
+	struct ethhdr              eth;
+
+	if (!filter->flags)
+		return true;
+
+	if (pkt_len < sizeof(eth) ||
+	    bpf_probe_read_kernel(&eth, sizeof(eth), data))
+		return false;
+
+	eth_proto = eth.h_proto;
+	offset = sizeof(eth);
+
+	for (int i = 0; i < FILTER_VLAN_DEPTH; i++) {
+		struct vlan_hdr vlh;
+
+		if (!proto_is_vlan(eth_proto))
+			break;
+
+		if (offset + sizeof(vlh) > pkt_len ||
+		    bpf_probe_read_kernel(&vlh, sizeof(vlh), data + offset))
+			return false;
+
+		eth_proto = vlh.h_vlan_encapsulated_proto;
+		offset += sizeof(vlh);
+	}
+
+	if (eth_proto == bpf_htons(ETH_P_IP)) {
+		struct iphdr iph;
+
+		if (offset + sizeof(iph) > pkt_len ||
+		    bpf_probe_read_kernel(&iph, sizeof(iph), data + offset))
+			return false;
+
+		ip_proto = iph.protocol;
+		saddr[0] = iph.saddr;
+		daddr[0] = iph.daddr;
+		first_frag = !(iph.frag_off & bpf_htons(IP_FRAG_OFFSET_MASK));
+		offset += iph.ihl * 4;
+	} else if (eth_proto == bpf_htons(ETH_P_IPV6)) {
+		struct ipv6hdr ip6h;
+
+		if (offset + sizeof(ip6h) > pkt_len ||
+		    bpf_probe_read_kernel(&ip6h, sizeof(ip6h), data + offset))
+			return false;
+
+		/* Extension headers are not walked, so only packets carrying
+		 * the transport header directly will match on it.
+		 */
+		ip_proto = ip6h.nexthdr;
+		__builtin_memcpy(saddr, &ip6h.saddr, sizeof(saddr));
+		__builtin_memcpy(daddr, &ip6h.daddr, sizeof(daddr));
+		offset += sizeof(ip6h);
+	} else {
+		/* All primitives we support require an IP packet. */
+		return false;
+	}
+
+	if ((filter->flags & TRACE_FILTER_ETH_PROTO) &&
+	    filter->eth_proto != eth_proto)
+		return false;
+
+	if ((filter->flags & TRACE_FILTER_IP_PROTO) &&
+	    filter->ip_proto != ip_proto)
+		return false;
+
+	if ((filter->flags & TRACE_FILTER_HOST) &&
+	    !filter_addr_equal(filter->host, saddr) &&
+	    !filter_addr_equal(filter->host, daddr))
+		return false;
+
+	if ((filter->flags & TRACE_FILTER_SRC_HOST) &&
+	    !filter_addr_equal(filter->src_host, saddr))
+		return false;
+
+	if ((filter->flags & TRACE_FILTER_DST_HOST) &&
+	    !filter_addr_equal(filter->dst_host, daddr))
+		return false;
+
+	if (!(filter->flags & TRACE_FILTER_ANY_PORT))
+		return true;
+
+	if (!first_frag ||
+	    (ip_proto != IPPROTO_TCP && ip_proto != IPPROTO_UDP &&
+	     ip_proto != IPPROTO_SCTP) ||
+	    offset + sizeof(ports) > pkt_len ||
+	    bpf_probe_read_kernel(ports, sizeof(ports), data + offset))
+		return false;
+
+	if ((filter->flags & TRACE_FILTER_PORT) &&
+	    filter->port != ports[0] && filter->port != ports[1])
+		return false;
+
+	if ((filter->flags & TRACE_FILTER_SRC_PORT) &&
+	    filter->src_port != ports[0])
+		return false;
+
+	if ((filter->flags & TRACE_FILTER_DST_PORT) &&
+	    filter->dst_port != ports[1])
+		return false;
+
+	return true;
+}
+
+/*****************************************************************************
+ * read_header()
+ *****************************************************************************/
+static __always_inline bool read_header(void *dst, __u32 size,
+					unsigned char *data, __u32 offset,
+					__u32 pkt_len)
+{
+	return offset + size <= pkt_len &&
+		!bpf_probe_read_kernel(dst, size, data + offset);
+}
+
+/*****************************************************************************
+ * eth_proto_to_layer()
+ *****************************************************************************/
+static __always_inline int eth_proto_to_layer(__be16 proto)
+{
+	switch (bpf_ntohs(proto)) {
+	case ETH_P_IP:
+		return HDR_IPV4;
+	case ETH_P_IPV6:
+		return HDR_IPV6;
+	case ETH_P_TEB:
+		return HDR_ETH;
+	}
+	return HDR_DONE;
+}
+
+/*****************************************************************************
+ * ip_proto_to_layer()
+ *****************************************************************************/
+static __always_inline int ip_proto_to_layer(__u8 proto)
+{
+	switch (proto) {
+	case IPPROTO_IPIP:
+		return HDR_IPV4;
+	case IPPROTO_IPV6:
+		return HDR_IPV6;
+	case IPPROTO_HOPOPTS:
+	case IPPROTO_ROUTING:
+	case IPPROTO_DSTOPTS:
+		return HDR_IPV6_OPT;
+	case IPPROTO_FRAGMENT:
+		return HDR_IPV6_FRAG;
+	case IPPROTO_GRE:
+		return HDR_GRE;
+	case IPPROTO_UDP:
+		return HDR_UDP;
+	case IPPROTO_TCP:
+		return HDR_TCP;
+	case IPPROTO_SCTP:
+		return HDR_SCTP;
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		return HDR_ICMP;
+	}
+	return HDR_DONE;
+}
+
+/*****************************************************************************
+ * get_headers_len()
+ *
+ * Walk the packet headers, including VLAN tags, IP-in-IP, GRE and VXLAN
+ * encapsulations, and return the offset of the innermost L4 payload. If an
+ * unknown or truncated header is found, the offset reached so far is
+ * returned, i.e., everything up to the unknown header is captured.
+ *****************************************************************************/
+static __always_inline __u32 get_headers_len(struct xdp_buff *xdp,
+					     __u32 pkt_len)
+{
+	unsigned char *data = xdp->data;
+	int            layer = HDR_ETH;
+	__u32          offset = 0;
+
+	for (int i = 0; i < HDR_MAX_LAYERS && layer != HDR_DONE; i++) {
+		switch (layer) {
+		case HDR_ETH: {
+			struct ethhdr eth;
+			__be16        proto;
+
+			if (!read_header(&eth, sizeof(eth), data, offset,
+					 pkt_len))
+				return offset;
+
+			offset += sizeof(eth);
+			proto = eth.h_proto;
+
+			for (int j = 0; j < FILTER_VLAN_DEPTH; j++) {
+				struct vlan_hdr vlh;
+
+				if (!proto_is_vlan(proto))
+					break;
+
+				if (!read_header(&vlh, sizeof(vlh), data,
+						 offset, pkt_len))
+					return offset;
+
+				offset += sizeof(vlh);
+				proto = vlh.h_vlan_encapsulated_proto;
+			}
+			layer = eth_proto_to_layer(proto);
+			break;
+		}
+		case HDR_IPV4: {
+			struct iphdr iph;
+
+			if (!read_header(&iph, sizeof(iph), data, offset,
+					 pkt_len) || iph.ihl < 5)
+				return offset;
+
+			offset += iph.ihl * 4;
+			if (iph.frag_off & bpf_htons(IP_FRAG_OFFSET_MASK))
+				layer = HDR_DONE;
+			else
+				layer = ip_proto_to_layer(iph.protocol);
+			break;
+		}
+		case HDR_IPV6: {
+			struct ipv6hdr ip6h;
+
+			if (!read_header(&ip6h, sizeof(ip6h), data, offset,
+					 pkt_len))
+				return offset;
+
+			offset += sizeof(ip6h);
+			layer = ip_proto_to_layer(ip6h.nexthdr);
+			break;
+		}
+		case HDR_IPV6_OPT: {
+			struct ipv6_opt_hdr opth;
+
+			if (!read_header(&opth, sizeof(opth), data, offset,
+					 pkt_len))
+				return offset;
+
+			offset += (opth.hdrlen + 1) * 8;
+			layer = ip_proto_to_layer(opth.nexthdr);
+			break;
+		}
+		case HDR_IPV6_FRAG: {
+			struct ipv6_frag_hdr fragh;
+
+			if (!read_header(&fragh, sizeof(fragh), data, offset,
+					 pkt_len))
+				return offset;
+
+			offset += sizeof(fragh);
+			if (fragh.frag_off & bpf_htons(0xfff8))
+				layer = HDR_DONE;
+			else
+				layer = ip_proto_to_layer(fragh.nexthdr);
+			break;
+		}
+		case HDR_GRE: {
+			struct gre_base_hdr greh;
+
+			if (!read_header(&greh, sizeof(greh), data, offset,
+					 pkt_len))
+				return offset;
+
+			offset += sizeof(greh);
+			if (greh.flags & GRE_FLAG_CSUM)
+				offset += 4;
+			if (greh.flags & GRE_FLAG_KEY)
+				offset += 4;
+			if (greh.flags & GRE_FLAG_SEQ)
+				offset += 4;
+			layer = eth_proto_to_layer(greh.protocol);
+			break;
+		}
+		case HDR_UDP: {
+			struct udphdr udph;
+
+			if (!read_header(&udph, sizeof(udph), data, offset,
+					 pkt_len))
+				return offset;
+
+			offset += sizeof(udph);
+			if (udph.dest == bpf_htons(VXLAN_UDP_PORT))
+				layer = HDR_VXLAN;
+			else
+				layer = HDR_DONE;
+			break;
+		}
+		case HDR_VXLAN:
+			offset += 8;
+			layer = HDR_ETH;
+			break;
+		case HDR_TCP: {
+			struct tcphdr tcph;
+
+			if (!read_header(&tcph, sizeof(tcph), data, offset,
+					 pkt_len))
+				return offset;
+
+			offset += tcph.doff * 4;
+			layer = HDR_DONE;
+			break;
+		}
+		case HDR_SCTP:
+			offset += 12;
+			layer = HDR_DONE;
+			break;
+		case HDR_ICMP:
+			offset += 8;
+			layer = HDR_DONE;
+			break;
+		default:
+			layer = HDR_DONE;
+			break;
+		}
+	}
+
+	return offset;
+}
+
+/*****************************************************************************
+ * sample_packet()
+ *
+ * Decide if a packet that passed the filter should be captured based on the
+ * configured 1-in-N sample rate and per-CPU rate limit. The rate limit is a
+ * token bucket holding at most one second worth of packets. The number of
+ * packets skipped since the last captured one is returned in sampled_out.
+ *****************************************************************************/
+static __always_inline bool sample_packet(__u32 slot, bool fexit,
+					  __u32 *sampled_out)
+{
+	const struct trace_configuration *cfg = &trace_cfg[slot];
+	struct trace_sample_state        *state;
+	bool                              capture = true;
+	__u64                             now;
+
+	*sampled_out = 0;
+
+	if (!cfg->capture_sample_rate && !cfg->capture_rate_interval)
+		return true;
+
+	state = bpf_map_lookup_elem(&xdpdump_sample_state, &slot);
+	if (!state)
+		return true;
+
+	if (fexit && (cfg->capture_sample_flags & TRACE_SAMPLE_FOLLOW_ENTRY))
+		return state->entry_captured;
+
+	if (cfg->capture_sample_rate > 1) {
+		if (++state->sample_count < cfg->capture_sample_rate)
+			capture = false;
+		else
+			state->sample_count = 0;
+	}
+
+	if (capture && cfg->capture_rate_interval) {
+		now = bpf_ktime_get_ns();
+
+		if (now > NSEC_PER_SEC &&
+		    state->next_capture_ns < now - NSEC_PER_SEC)
+			state->next_capture_ns = now - NSEC_PER_SEC;
+
+		if (state->next_capture_ns > now)
+			capture = false;
+		else
+			state->next_capture_ns += cfg->capture_rate_interval;
+	}
+
+	if (capture) {
+		*sampled_out = state->sampled_out;
+		state->sampled_out = 0;
+	} else {
+		state->sampled_out++;
+	}
+
+	if (!fexit)
+		state->entry_captured = capture;
+
+	return capture;
+}
+
+/*****************************************************************************
+ * capture_ifindex_match()
+ *
+ * Devmap programs run for packets leaving through the devmap entry's device,
+ * so these are also matched on the transmit interface.
+ *****************************************************************************/
+static __always_inline bool
+capture_ifindex_match(const struct trace_configuration *cfg,
+		      struct xdp_buff *xdp)
+{
+	if (cfg->capture_if_ifindex == xdp->rxq->dev->ifindex)
+		return true;
+
+	return (cfg->capture_flags & TRACE_CAPTURE_MAP_PROG) &&
+		bpf_core_field_exists(xdp->txq) && xdp->txq &&
+		cfg->capture_if_ifindex == xdp->txq->dev->ifindex;
+}
+
+/*****************************************************************************
+ * set_redirect_pending()
+ *
+ * Remember if the packet being processed on this CPU was captured, so a
+ * following redirect tracepoint only reports on captured packets.
+ *****************************************************************************/
+static __always_inline void set_redirect_pending(__u32 slot, bool captured)
+{
+	struct trace_sample_state *state;
+
+	if (!(trace_cfg[slot].capture_flags & TRACE_CAPTURE_REDIRECT))
 		return;
 
-	metadata.prog_index = trace_cfg.capture_prog_index;
-	metadata.ifindex = xdp->rxq->dev->ifindex;
-	metadata.rx_queue = xdp->rxq->queue_index;
-	metadata.pkt_len = (__u16)(data_end - data);
-	metadata.cap_len = min(metadata.pkt_len, trace_cfg.capture_snaplen);
-	metadata.action = action;
-	metadata.flags = 0;
+	state = bpf_map_lookup_elem(&xdpdump_sample_state, &slot);
+	if (state)
+		state->redirect_pending = captured;
+}
+
+/*****************************************************************************
+ * dedup_hash()
+ *
+ * Hash the captured bytes, 64 bytes at a time, as these are copied out using
+ * bpf_probe_read_kernel(). This is FNV-1a on 64-bit words, which is cheap and
+ * good enough to notice a rewrite.
+ *****************************************************************************/
+#define DEDUP_CHUNK_LEN 64
+
+static __always_inline __u64 dedup_hash(struct xdp_buff *xdp, __u32 len)
+{
+	unsigned char *data = xdp->data;
+	__u64          hash = 0xcbf29ce484222325ULL;
+	__u32          offset = 0;
+
+	for (int i = 0; i < TRACE_DEDUP_MAX_LEN / DEDUP_CHUNK_LEN; i++) {
+		__u64 chunk[DEDUP_CHUNK_LEN / sizeof(__u64)] = {};
+		__u32 chunk_len;
+
+		if (offset >= len)
+			break;
+
+		chunk_len = len - offset;
+		if (chunk_len > DEDUP_CHUNK_LEN)
+			chunk_len = DEDUP_CHUNK_LEN;
+
+		if (bpf_probe_read_kernel(chunk, chunk_len, data + offset))
+			break;
+
+		for (int j = 0; j < DEDUP_CHUNK_LEN / sizeof(__u64); j++)
+			hash = (hash ^ chunk[j]) * 0x100000001b3ULL;
+
+		offset += DEDUP_CHUNK_LEN;
+	}
+
+	return hash;
+}
+
+/*****************************************************************************
+ * dedup_exit()
+ *
+ * Remember what the packet captured by the fentry program looked like. For
+ * fexit, return true if it is unchanged, so only the verdict needs to be
+ * reported. A packet not captured on entry is never unchanged, and neither is
+ * one with more captured bytes than the hash covers.
+ *****************************************************************************/
+static __always_inline bool dedup_exit(struct xdp_buff *xdp, __u32 slot,
+				       bool fexit, bool captured,
+				       __u32 pkt_len, __u32 cap_len)
+{
+	struct trace_sample_state *state;
+	bool                       unchanged;
+	__u64                      hash;
+
+	if (!(trace_cfg[slot].capture_flags & TRACE_CAPTURE_DEDUP_EXIT))
+		return false;
+
+	state = bpf_map_lookup_elem(&xdpdump_sample_state, &slot);
+	if (!state)
+		return false;
+
+	if (!captured || cap_len > TRACE_DEDUP_MAX_LEN) {
+		state->dedup_valid = 0;
+		return false;
+	}
+
+	hash = dedup_hash(xdp, cap_len);
+
+	if (!fexit) {
+		state->dedup_hash = hash;
+		state->dedup_data = (__u64)(long)xdp->data;
+		state->dedup_len = pkt_len;
+		state->dedup_valid = 1;
+		return false;
+	}
+
+	unchanged = state->dedup_valid &&
+		state->dedup_data == (__u64)(long)xdp->data &&
+		state->dedup_len == pkt_len && state->dedup_hash == hash;
+	state->dedup_valid = 0;
+	return unchanged;
+}
+
+/*****************************************************************************
+ * fill_trace_metadata()
+ *****************************************************************************/
+static inline bool fill_trace_metadata(struct xdp_buff *xdp, __u32 slot,
+				       bool fexit, int action,
+				       struct pkt_trace_metadata *metadata)
+{
+	const struct trace_configuration *cfg = &trace_cfg[slot];
+	void                             *data_end = (void *)(long)xdp->data_end;
+	void                             *data = (void *)(long)xdp->data;
+
+	if (data >= data_end ||
+	    !capture_ifindex_match(cfg, xdp) ||
+	    !filter_match(cfg, xdp, data_end - data) ||
+	    !sample_packet(slot, fexit, &metadata->sampled_out)) {
+		dedup_exit(xdp, slot, fexit, false, 0, 0);
+		return false;
+	}
+
+	metadata->prog_index = cfg->capture_prog_index;
+	metadata->ifindex = xdp->rxq->dev->ifindex;
+	metadata->rx_queue = xdp->rxq->queue_index;
+	metadata->pkt_len = (__u16)(data_end - data);
+	metadata->cap_len = min(metadata->pkt_len, cfg->capture_snaplen);
+
+	if (cfg->capture_flags & TRACE_CAPTURE_HEADERS_ONLY) {
+		__u32 len = get_headers_len(xdp, metadata->pkt_len) +
+			cfg->capture_payload_len;
+
+		metadata->cap_len = min(metadata->cap_len, len);
+	}
+
+	metadata->action = action;
+	metadata->flags = 0;
 
 	if (fexit)
-		metadata.flags |= MDF_DIRECTION_FEXIT;
+		metadata->flags |= MDF_DIRECTION_FEXIT;
+
+	if (dedup_exit(xdp, slot, fexit, true, metadata->pkt_len,
+		       metadata->cap_len)) {
+		metadata->flags |= MDF_UNCHANGED;
+		metadata->cap_len = 0;
+	}
+
+	return true;
+}
+
+/*****************************************************************************
+ * trace_to_perf_buffer()
+ *****************************************************************************/
+static inline void trace_to_perf_buffer(struct xdp_buff *xdp, __u32 slot,
+					bool fexit, int action)
+{
+	struct pkt_trace_metadata metadata;
+	bool                      captured;
+
+	captured = fill_trace_metadata(xdp, slot, fexit, action, &metadata);
+	set_redirect_pending(slot, captured);
+	if (!captured)
+		return;
 
 	bpf_xdp_output(xdp, &xdpdump_perf_map,
 		       ((__u64) metadata.cap_len << 32) |
@@ -89,25 +744,361 @@ static inline void trace_to_perf_buffer(struct xdp_buff *xdp, bool fexit,
 }
 
 /*****************************************************************************
- * trace_on_entry()
+ * fill_redirect_metadata()
+ *
+ * The redirect tracepoints fire right after the program returned XDP_REDIRECT,
+ * on the same CPU, so user space can tie them to the last packet captured on
+ * that CPU. The tracepoints are shared by all slots, so the one reporting
+ * redirects for the device is looked up.
  *****************************************************************************/
-SEC("fentry/func")
-int BPF_PROG(trace_on_entry, struct xdp_buff *xdp)
+static __always_inline bool fill_redirect_metadata(const struct net_device *dev,
+						   const void *tgt, int err,
+						   int map_type, __u32 map_id,
+						   __u32 index,
+						   struct pkt_trace_metadata *metadata)
 {
-	trace_to_perf_buffer(xdp, false, 0);
-	return 0;
+	struct trace_sample_state *state;
+	__u32                      ifindex = dev->ifindex;
+	__u32                      slot;
+
+	for (slot = 0; slot < TRACE_MAX_SLOTS; slot++) {
+		if ((trace_cfg[slot].capture_flags & TRACE_CAPTURE_REDIRECT) &&
+		    trace_cfg[slot].capture_if_ifindex == ifindex)
+			break;
+	}
+	if (slot >= TRACE_MAX_SLOTS)
+		return false;
+
+	state = bpf_map_lookup_elem(&xdpdump_sample_state, &slot);
+	if (!state || !state->redirect_pending)
+		return false;
+
+	state->redirect_pending = 0;
+
+	__builtin_memset(metadata, 0, sizeof(*metadata));
+	metadata->ifindex = ifindex;
+	metadata->prog_index = trace_cfg[slot].capture_prog_index;
+	metadata->flags = MDF_REDIRECT;
+	metadata->redirect_map_type = map_type;
+	metadata->redirect_err = err;
+	metadata->redirect_index = index;
+
+	if (map_type == BPF_MAP_TYPE_UNSPEC)
+		return true;
+
+	metadata->redirect_map_id = map_id;
+
+	/* For devmaps the index is the map key, report the device instead.
+	 * Broadcast redirects have no single target.
+	 */
+	if (map_type == BPF_MAP_TYPE_DEVMAP ||
+	    map_type == BPF_MAP_TYPE_DEVMAP_HASH)
+		metadata->redirect_index = tgt ?
+			BPF_CORE_READ((struct bpf_dtab_netdev *)tgt,
+				      dev, ifindex) : 0;
+
+	return true;
 }
 
 /*****************************************************************************
- * trace_on_exit()
+ * redirect_to_perf_buffer()
  *****************************************************************************/
-SEC("fexit/func")
-int BPF_PROG(trace_on_exit, struct xdp_buff *xdp, int ret)
+static __always_inline void redirect_to_perf_buffer(void *ctx,
+						    const struct net_device *dev,
+						    const void *tgt, int err,
+						    int map_type, __u32 map_id,
+						    __u32 index)
 {
-	trace_to_perf_buffer(xdp, true, ret);
-	return 0;
+	struct pkt_trace_metadata metadata;
+
+	if (!fill_redirect_metadata(dev, tgt, err, map_type, map_id, index,
+				    &metadata))
+		return;
+
+	bpf_perf_event_output(ctx, &xdpdump_perf_map, BPF_F_CURRENT_CPU,
+			      &metadata, sizeof(metadata));
+}
+
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+/*****************************************************************************
+ * count_ringbuf_lost()
+ *****************************************************************************/
+static __always_inline void count_ringbuf_lost(void)
+{
+	__u32  key = 0;
+	__u64 *lost;
+
+	lost = bpf_map_lookup_elem(&xdpdump_ringbuf_lost, &key);
+	if (lost)
+		*lost += 1;
 }
 
+/*****************************************************************************
+ * redirect_to_ring_buffer()
+ *****************************************************************************/
+static __always_inline void redirect_to_ring_buffer(void *ctx,
+						    const struct net_device *dev,
+						    const void *tgt, int err,
+						    int map_type, __u32 map_id,
+						    __u32 index)
+{
+	struct ringbuf_sample_event *e;
+	struct pkt_trace_metadata    metadata;
+
+	if (!fill_redirect_metadata(dev, tgt, err, map_type, map_id, index,
+				    &metadata))
+		return;
+
+	e = bpf_ringbuf_reserve(&xdpdump_ringbuf, sizeof(*e), 0);
+	if (!e) {
+		count_ringbuf_lost();
+		return;
+	}
+
+	e->time = bpf_ktime_get_ns();
+	e->cpu = bpf_get_smp_processor_id();
+	e->metadata = metadata;
+
+	bpf_ringbuf_submit(e, 0);
+}
+
+/*****************************************************************************
+ * ringbuf_output_slot()
+ *
+ * The size passed to bpf_ringbuf_reserve() needs to be a constant, so the
+ * sample is stored in the smallest of a few fixed sized slots that fits the
+ * captured length. The packet data is copied straight into the reserved
+ * space, so no intermediate buffer is needed.
+ *
+ * Only the linear part of the packet is copied: the fragments of a multi-buffer
+ * packet could only be read with bpf_xdp_load_bytes(), which is not available
+ * to tracing programs. The captured length never exceeds the linear part
+ * anyway, see fill_trace_metadata().
+ *****************************************************************************/
+static __always_inline void ringbuf_output_slot(struct xdp_buff *xdp,
+						struct pkt_trace_metadata *md,
+						__u32 slot_size)
+{
+	struct ringbuf_sample_event *e;
+	__u32 cap_len = md->cap_len;
+
+	e = bpf_ringbuf_reserve(&xdpdump_ringbuf, sizeof(*e) + slot_size, 0);
+	if (!e) {
+		count_ringbuf_lost();
+		return;
+	}
+
+	if (cap_len > slot_size)
+		cap_len = slot_size;
+
+	if (bpf_probe_read_kernel(e->packet, cap_len, xdp->data))
+		cap_len = 0;
+
+	e->time = bpf_ktime_get_ns();
+	e->cpu = bpf_get_smp_processor_id();
+	e->metadata = *md;
+	e->metadata.cap_len = cap_len;
+
+	bpf_ringbuf_submit(e, 0);
+}
+
+/*****************************************************************************
+ * trace_to_ring_buffer()
+ *****************************************************************************/
+static inline void trace_to_ring_buffer(struct xdp_buff *xdp, __u32 slot,
+					bool fexit, int action)
+{
+	struct pkt_trace_metadata metadata;
+	bool                      captured;
+
+	captured = fill_trace_metadata(xdp, slot, fexit, action, &metadata);
+	set_redirect_pending(slot, captured);
+	if (!captured)
+		return;
+
+	if (metadata.cap_len <= 128)
+		ringbuf_output_slot(xdp, &metadata, 128);
+	else if (metadata.cap_len <= 512)
+		ringbuf_output_slot(xdp, &metadata, 512);
+	else if (metadata.cap_len <= 2048)
+		ringbuf_output_slot(xdp, &metadata, 2048);
+	else if (metadata.cap_len <= 4096)
+		ringbuf_output_slot(xdp, &metadata, 4096);
+	else
+		ringbuf_output_slot(xdp, &metadata, RINGBUF_MAX_CAP_LEN);
+}
+#endif
+
+/*****************************************************************************
+ * stats_get_protos()
+ *
+ * Find the L3 and L4 protocol of the packet, skipping VLAN tags like the
+ * capture filter. IPv6 extension headers are not walked.
+ *****************************************************************************/
+static __always_inline void stats_get_protos(struct xdp_buff *xdp,
+					     __u32 pkt_len,
+					     struct trace_stats_key *key)
+{
+	unsigned char *data = xdp->data;
+	__u16          eth_proto;
+	__u32          offset;
+	struct ethhdr  eth;
+
+	if (!read_header(&eth, sizeof(eth), data, 0, pkt_len))
+		return;
+
+	eth_proto = eth.h_proto;
+	offset = sizeof(eth);
+
+	for (int i = 0; i < FILTER_VLAN_DEPTH; i++) {
+		struct vlan_hdr vlh;
+
+		if (!proto_is_vlan(eth_proto))
+			break;
+
+		if (!read_header(&vlh, sizeof(vlh), data, offset, pkt_len))
+			return;
+
+		eth_proto = vlh.h_vlan_encapsulated_proto;
+		offset += sizeof(vlh);
+	}
+	key->l3_proto = eth_proto;
+
+	if (eth_proto == bpf_htons(ETH_P_IP)) {
+		struct iphdr iph;
+
+		if (read_header(&iph, sizeof(iph), data, offset, pkt_len))
+			key->l4_proto = iph.protocol;
+	} else if (eth_proto == bpf_htons(ETH_P_IPV6)) {
+		struct ipv6hdr ip6h;
+
+		if (read_header(&ip6h, sizeof(ip6h), data, offset, pkt_len))
+			key->l4_proto = ip6h.nexthdr;
+	}
+}
+
+/*****************************************************************************
+ * trace_to_stats()
+ *
+ * Count the packet instead of capturing it. The filter still applies, but
+ * sampling does not, as every packet is cheap to count.
+ *****************************************************************************/
+static inline void trace_to_stats(struct xdp_buff *xdp, __u32 slot,
+				  bool fexit, int action)
+{
+	const struct trace_configuration *cfg = &trace_cfg[slot];
+	void                             *data_end = (void *)(long)xdp->data_end;
+	void                             *data = (void *)(long)xdp->data;
+	struct trace_stats_key            key = {};
+	struct trace_stats_value         *value, init = {};
+	__u32                             pkt_len;
+
+	if (data >= data_end || !capture_ifindex_match(cfg, xdp))
+		return;
+
+	pkt_len = data_end - data;
+	if (!filter_match(cfg, xdp, pkt_len))
+		return;
+
+	key.prog_index = cfg->capture_prog_index;
+	key.rx_queue = xdp->rxq->queue_index;
+	key.action = fexit ? action : 0;
+	key.fexit = fexit;
+	stats_get_protos(xdp, pkt_len, &key);
+
+	value = bpf_map_lookup_elem(&xdpdump_stats, &key);
+	if (!value) {
+		bpf_map_update_elem(&xdpdump_stats, &key, &init, BPF_NOEXIST);
+		value = bpf_map_lookup_elem(&xdpdump_stats, &key);
+		if (!value)
+			return;
+	}
+	value->packets++;
+	value->bytes += pkt_len;
+}
+
+/*****************************************************************************
+ * Trace programs, one fentry and fexit pair per slot and capture transport.
+ * User space points each slot at one of the traced functions, and only loads
+ * the programs of the slots and directions in use.
+ *****************************************************************************/
+#define DEFINE_TRACE_PROGS(slot, suffix, output)				\
+SEC("fentry/func")							\
+int BPF_PROG(trace_on_entry##suffix##_##slot, struct xdp_buff *xdp)	\
+{									\
+	output(xdp, slot, false, 0);					\
+	return 0;							\
+}									\
+									\
+SEC("fexit/func")							\
+int BPF_PROG(trace_on_exit##suffix##_##slot, struct xdp_buff *xdp,	\
+	     int ret)							\
+{									\
+	output(xdp, slot, true, ret);					\
+	return 0;							\
+}
+
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+#define DEFINE_TRACE_PROGS_RB(slot)					\
+	DEFINE_TRACE_PROGS(slot, _rb, trace_to_ring_buffer)
+#else
+#define DEFINE_TRACE_PROGS_RB(slot)
+#endif
+
+#define DEFINE_TRACE_SLOT(slot)						\
+	DEFINE_TRACE_PROGS(slot, , trace_to_perf_buffer)			\
+	DEFINE_TRACE_PROGS_RB(slot)					\
+	DEFINE_TRACE_PROGS(slot, _stats, trace_to_stats)
+
+/* Keep in line with TRACE_MAX_SLOTS */
+DEFINE_TRACE_SLOT(0)
+DEFINE_TRACE_SLOT(1)
+DEFINE_TRACE_SLOT(2)
+DEFINE_TRACE_SLOT(3)
+DEFINE_TRACE_SLOT(4)
+DEFINE_TRACE_SLOT(5)
+DEFINE_TRACE_SLOT(6)
+DEFINE_TRACE_SLOT(7)
+DEFINE_TRACE_SLOT(8)
+DEFINE_TRACE_SLOT(9)
+DEFINE_TRACE_SLOT(10)
+
+_Static_assert(TRACE_MAX_SLOTS == 11,
+	       "DEFINE_TRACE_SLOT() needs updating for TRACE_MAX_SLOTS");
+
+/*****************************************************************************
+ * Redirect tracepoints, only loaded with --redirect-targets. These use the
+ * layout reporting the map type and id, older kernels passed a map pointer.
+ *****************************************************************************/
+#define DEFINE_REDIRECT_TRACE(name, tp, output)				\
+SEC("tp_btf/" #tp)							\
+int BPF_PROG(name, const struct net_device *dev,			\
+	     const struct bpf_prog *xdp, const void *tgt, int err,	\
+	     int map_type, __u32 map_id, __u32 index)			\
+{									\
+	output(ctx, dev, tgt, err, map_type, map_id, index);		\
+	return 0;							\
+}
+
+DEFINE_REDIRECT_TRACE(trace_redirect, xdp_redirect, redirect_to_perf_buffer)
+DEFINE_REDIRECT_TRACE(trace_redirect_err, xdp_redirect_err,
+		      redirect_to_perf_buffer)
+DEFINE_REDIRECT_TRACE(trace_redirect_map, xdp_redirect_map,
+		      redirect_to_perf_buffer)
+DEFINE_REDIRECT_TRACE(trace_redirect_map_err, xdp_redirect_map_err,
+		      redirect_to_perf_buffer)
+
+#ifdef XDPDUMP_RINGBUF_SUPPORT
+DEFINE_REDIRECT_TRACE(trace_redirect_rb, xdp_redirect,
+		      redirect_to_ring_buffer)
+DEFINE_REDIRECT_TRACE(trace_redirect_err_rb, xdp_redirect_err,
+		      redirect_to_ring_buffer)
+DEFINE_REDIRECT_TRACE(trace_redirect_map_rb, xdp_redirect_map,
+		      redirect_to_ring_buffer)
+DEFINE_REDIRECT_TRACE(trace_redirect_map_err_rb, xdp_redirect_map_err,
+		      redirect_to_ring_buffer)
+#endif
+
 /*****************************************************************************
  * License
  *****************************************************************************/
@@ -53,6 +53,7 @@ int xdpdump(struct xdp_md *xdp)
 	metadata.cap_len = min(metadata.pkt_len, trace_cfg.capture_snaplen);
 	metadata.action = 0;
 	metadata.flags = 0;
+	metadata.sampled_out = 0;
 
 	bpf_perf_event_output(xdp, &xdpdump_perf_map,
 			      ((__u64) metadata.cap_len << 32) |
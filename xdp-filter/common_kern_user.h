@@ -9,6 +9,11 @@
 #define FEAT_ALL	(FEAT_TCP|FEAT_UDP|FEAT_IPV6|FEAT_IPV4|FEAT_ETHERNET)
 #define FEAT_ALLOW	(1<<5)
 #define FEAT_DENY	(1<<6)
+#define FEAT_FLOW	(1<<7)
+#define FEAT_CONNTRACK	(1<<8)
+#define FEAT_RATELIMIT	(1<<9)
+#define FEAT_TUNNEL	(1<<10)
+#define FEAT_BLOOM	(1<<11)
 
 #define MAP_FLAG_SRC (1<<0)
 #define MAP_FLAG_DST (1<<1)
@@ -16,12 +21,140 @@
 #define MAP_FLAG_UDP (1<<3)
 #define MAP_FLAGS (MAP_FLAG_SRC|MAP_FLAG_DST|MAP_FLAG_TCP|MAP_FLAG_UDP)
 
-#define COUNTER_SHIFT 6
-
+/* The port and ethernet maps only hold the rule flags, and are only written
+ * by userspace. Hit counters are kept in separate per-CPU maps using the same
+ * keys, so the datapath never writes to the cache lines it looks rules up in.
+ */
 #define MAP_NAME_PORTS filter_ports
+#define MAP_NAME_PORT_COUNTERS filter_port_counters
 #define MAP_NAME_IPV4 filter_ipv4
 #define MAP_NAME_IPV6 filter_ipv6
 #define MAP_NAME_ETHERNET filter_ethernet
+#define MAP_NAME_ETHERNET_COUNTERS filter_eth_counters
+#define MAP_NAME_IP_COUNTERS filter_ip_counters
+#define MAP_NAME_FLOWS filter_flows
+#define MAP_NAME_FLOW_COUNTERS filter_flow_counters
+#define MAP_NAME_FLOW_MASKS filter_flow_masks
+#define MAP_NAME_CONNTRACK filter_conntrack
+#define MAP_NAME_RATELIMIT filter_ratelimit
+#define MAP_NAME_RATELIMIT_CFG filter_ratelimit_cfg
+
+#define ETHERNET_MAP_MAX_ENTRIES 10000
+
+/* The maps of the prefilter offloaded to the NIC (see xdpfilt_hw.c), which
+ * hold copies of the port and ethernet rules. Device memory is scarce, so
+ * they only hold a limited number of rules, as a hash for both.
+ */
+#define MAP_NAME_HW_PORTS filter_hw_ports
+#define MAP_NAME_HW_ETHERNET filter_hw_ether
+#define HW_MAP_MAX_ENTRIES 4096
+
+/* The IP address maps are LPM tries, so they can hold prefixes. The key
+ * starts with the match mode (MAP_FLAG_SRC or MAP_FLAG_DST), and the prefix
+ * length always covers it, so source and destination rules for overlapping
+ * prefixes don't shadow each other. The hit counters live in a separate
+ * per-CPU map, indexed by the counter id stored in the trie.
+ */
+#define IP_MAP_MAX_ENTRIES (1 << 18)
+#define IP_COUNTER_MAX_ENTRIES (2 * IP_MAP_MAX_ENTRIES)
+#define LPM_MODE_BITS 32
+
+struct ipv4_lpm_key {
+	__u32 prefixlen;
+	__u32 mode;
+	__u32 addr;
+};
+
+struct ipv6_lpm_key {
+	__u32 prefixlen;
+	__u32 mode;
+	struct in6_addr addr;
+};
+
+struct ip_lpm_val {
+	__u32 counter_id;
+	__u32 prefixlen;
+};
+
+/* With the bloom feature, each rule trie has a bloom filter in front of it,
+ * holding the mode and the address of every rule cut down to a fixed prefix
+ * length. A packet address whose cut-down form is not in the filter can't
+ * match any rule at least that long, so the trie lookup is skipped. Rules
+ * shorter than that can't be represented; while the rule set has any, or
+ * while userspace rebuilds the filter, the slot of the filter in its
+ * (single-entry) map-in-map stays empty and every packet does the full
+ * lookup.
+ */
+#define MAP_NAME_IPV4_BLOOM filter_ipv4_bloom
+#define MAP_NAME_IPV6_BLOOM filter_ipv6_bloom
+#define BLOOM_PREFIXLEN_V4 24
+#define BLOOM_PREFIXLEN_V6 48
+
+struct ipv4_bloom_key {
+	__u32 mode;
+	__u32 addr;
+};
+
+struct ipv6_bloom_key {
+	__u32 mode;
+	struct in6_addr addr;
+};
+
+/* Flow rules match a combination of addresses and ports. Fields that are not
+ * part of a rule are zero in its key, and the rule's value holds the protocol
+ * flags (MAP_FLAG_TCP and MAP_FLAG_UDP). Since the map is an exact-match hash,
+ * the datapath does one lookup for each combination of fields that is in use;
+ * userspace keeps a bitmap of those (indexed by the fields value) in the
+ * masks map. IPv4 addresses are stored as IPv4-mapped IPv6 addresses.
+ *
+ * The connection tracking table uses the same key with all fields set and
+ * the IP protocol filled in, and stores the time a connection was last seen.
+ */
+#define FLOW_FIELD_SADDR (1<<0)
+#define FLOW_FIELD_DADDR (1<<1)
+#define FLOW_FIELD_SPORT (1<<2)
+#define FLOW_FIELD_DPORT (1<<3)
+#define FLOW_FIELDS_ALL (FLOW_FIELD_SADDR|FLOW_FIELD_DADDR|FLOW_FIELD_SPORT|FLOW_FIELD_DPORT)
+#define FLOW_MAX_MASKS (FLOW_FIELDS_ALL + 1)
+#define FLOW_MAP_MAX_ENTRIES (1 << 16)
+
+#define CT_MAP_MAX_ENTRIES (1 << 16)
+#define CT_TIMEOUT_NS (300ULL * 1000000000ULL)
+#define CT_REFRESH_NS 1000000000ULL
+
+struct flow_key {
+	__u8 fields;
+	__u8 proto;
+	__u16 pad;
+	__u16 sport;
+	__u16 dport;
+	struct in6_addr saddr;
+	struct in6_addr daddr;
+};
+
+/* The rate limiter keeps a per-CPU bucket for each source address (using the
+ * same IPv4-mapped format as the flow rules), and implements the token bucket
+ * as a GCRA: each bucket holds the theoretical arrival time of the next
+ * packet, which every packet pushes forward by its cost. Packets arriving
+ * more than burst_ns before that time are dropped. Userspace fills in the
+ * costs from the configured rates; a zero cost disables that limit.
+ */
+#define RL_MAP_MAX_ENTRIES (1 << 16)
+#define RL_DEFAULT_BURST_NS (100ULL * 1000000ULL)
+
+struct ratelimit_cfg {
+	__u64 pps;
+	__u64 bps;
+	__u64 pkt_cost_ns;
+	__u64 byte_cost_ps;
+	__u64 burst_ns;
+};
+
+struct ratelimit_bucket {
+	__u64 pkt_tat;
+	__u64 byte_tat;
+	__u64 dropped;
+};
 
 #include "xdp/xdp_stats_kern_user.h"
 
@@ -1,6 +1,6 @@
 XDP_LOADER=${XDP_LOADER:-./xdp-loader}
 XDP_FILTER=${XDP_FILTER:-./xdp-filter}
-ALL_TESTS="test_load test_print test_output_remove test_ports_allow test_ports_deny test_ipv6_allow test_ipv6_deny test_ipv4_allow test_ipv4_deny test_ether_allow test_ether_deny test_python_basic test_python_slow"
+ALL_TESTS="test_load test_load_replace test_load_hw_prefilter test_load_map_sizes test_load_own_rules test_print test_output_remove test_import_export test_import_replace test_ports_allow test_ports_parse_ctx test_ports_deny test_ipv6_allow test_ipv6_deny test_ipv4_allow test_ipv4_deny test_ipv4_tunnel test_ip_prefix test_ip_bloom test_flow test_conntrack test_ratelimit test_ether_allow test_ether_deny test_python_basic test_python_slow"
 
 try_feat()
 {
@@ -22,28 +22,35 @@ try_feat()
         echo "Couldn't find '$regex' in output for feat $feat" >&2
         return 1
     fi
+    if [[ "$feat" != "all" ]]; then
+        output=$($XDP_FILTER status)
+        regex="mode\) +$feat,(allow|deny)"
+        if ! [[ $output =~ $regex ]]; then
+            echo "$output"
+            echo "Couldn't find '$regex' in status for feat $feat" >&2
+            return 1
+        fi
+    fi
     check_run $XDP_FILTER unload $NS -v
 }
 
 test_load()
 {
 
-    declare -a FEATS=(tcp udp ipv4 ipv6 ethernet all)
-    declare -a PROGS_D=(xdpfilt_dny_tcp.o xdpfilt_dny_udp.o xdpfilt_dny_ip.o xdpfilt_dny_ip.o xdpfilt_dny_eth.o xdpfilt_dny_all.o)
-    declare -a PROGS_A=(xdpfilt_alw_tcp.o xdpfilt_alw_udp.o xdpfilt_alw_ip.o xdpfilt_alw_ip.o xdpfilt_alw_eth.o xdpfilt_alw_all.o)
-    local len=${#FEATS[@]}
+    declare -a FEATS=(tcp udp ipv4 ipv6 ethernet flow ratelimit tunnel all)
+    local feat
 
-    for (( i=0; i<$len; i++ )); do
-        if ! try_feat ${FEATS[$i]} ${PROGS_A[$i]}; then
+    for feat in ${FEATS[@]}; do
+        if ! try_feat $feat xdpfilt_alw.o; then
             return 1
         fi
-        if ! try_feat ${FEATS[$i]} ${PROGS_A[$i]} --mode skb; then
+        if ! try_feat $feat xdpfilt_alw.o --mode skb; then
             return 1
         fi
-        if ! try_feat ${FEATS[$i]} ${PROGS_D[$i]} --policy deny; then
+        if ! try_feat $feat xdpfilt_dny.o --policy deny; then
             return 1
         fi
-        if ! try_feat ${FEATS[$i]} ${PROGS_D[$i]} --policy deny --mode skb; then
+        if ! try_feat $feat xdpfilt_dny.o --policy deny --mode skb; then
             return 1
         fi
     done
@@ -53,6 +60,96 @@ test_load()
     fi
 }
 
+test_load_replace()
+{
+    local TEST_PORT=10000
+
+    check_run $XDP_FILTER load -f tcp $NS -v
+    check_run $XDP_FILTER port $TEST_PORT -p tcp -v
+    check_port tcp $TEST_PORT FAIL
+    if $XDP_FILTER load -f tcp,udp $NS -v; then
+        die "Loading twice without --replace succeeded"
+    fi
+
+    check_run $XDP_FILTER load --replace -f tcp,udp $NS -v
+    check_status "tcp,udp,allow"
+    check_status "^[[:space:]]*$TEST_PORT[[:space:]]"
+    check_port tcp $TEST_PORT FAIL
+    check_port udp $TEST_PORT OK
+    check_run $XDP_FILTER port $TEST_PORT -p udp -v
+    check_port udp $TEST_PORT FAIL
+
+    check_run $XDP_FILTER load --replace -f ipv4 $NS -v
+    check_status_no_match "Filtered.ports"
+    check_port tcp $TEST_PORT OK
+    check_run $XDP_FILTER unload $NS -v
+}
+
+test_load_hw_prefilter()
+{
+    if $XDP_FILTER load --hw-prefilter --policy deny $NS -v; then
+        die "Loading the offloaded prefilter in deny mode succeeded"
+    fi
+
+    # veth devices can't offload programs, so this must fail cleanly
+    if $XDP_FILTER load --hw-prefilter -f tcp $NS -v; then
+        die "Offloading the prefilter to a veth device succeeded"
+    fi
+    if [ -d /sys/fs/bpf/xdp-filter ]; then
+        die "/sys/fs/bpf/xdp-filter still exists!"
+    fi
+}
+
+test_load_map_sizes()
+{
+    check_run $XDP_FILTER load --max-ips 2 --max-macs 2 --no-prealloc -f ipv4,ethernet $NS -v
+    check_run $XDP_FILTER ip 10.0.0.1 -v
+    check_run $XDP_FILTER ip 10.0.0.2 -v
+    if $XDP_FILTER ip 10.0.0.3 -v; then
+        die "Adding more IP rules than --max-ips succeeded"
+    fi
+    check_run $XDP_FILTER ether aa:bb:cc:dd:ee:01 -v
+    check_run $XDP_FILTER ether aa:bb:cc:dd:ee:02 -v
+    if $XDP_FILTER ether aa:bb:cc:dd:ee:03 -v; then
+        die "Adding more ethernet rules than --max-macs succeeded"
+    fi
+
+    if $XDP_FILTER load --replace --max-macs 4 -f ipv4,ethernet $NS -v; then
+        die "Resizing maps that are in use succeeded"
+    fi
+    check_run $XDP_FILTER load --replace -f ipv4,ethernet,tcp $NS -v
+    check_status "aa:bb:cc:dd:ee:02"
+    check_run $XDP_FILTER unload $NS -v
+}
+
+test_load_own_rules()
+{
+    local TEST_PORT=10000
+
+    check_run $XDP_FILTER load --own-rules -f tcp $NS -v
+    if $XDP_FILTER port $TEST_PORT -v; then
+        die "Adding a shared rule without a shared rule set succeeded"
+    fi
+    check_run $XDP_FILTER port --iface $NS $TEST_PORT -v
+    check_port tcp $TEST_PORT FAIL
+    check_status "own.rules"
+    check_status "tcp,allow"
+    check_status "^[[:space:]]*$TEST_PORT[[:space:]]" --iface $NS
+
+    if $XDP_FILTER load -f tcp $NS -v; then
+        die "Loading with the shared rules over own rules succeeded"
+    fi
+    check_run $XDP_FILTER load --own-rules --replace -f tcp,udp $NS -v
+    check_status "tcp,udp,allow"
+    check_port tcp $TEST_PORT FAIL
+
+    check_run $XDP_FILTER unload $NS -v
+    check_port tcp $TEST_PORT OK
+    if [ -d /sys/fs/bpf/xdp-filter ]; then
+        die "/sys/fs/bpf/xdp-filter still exists!"
+    fi
+}
+
 check_packet()
 {
     local filter="$1"
@@ -112,6 +209,26 @@ test_ports_allow()
     check_run $XDP_FILTER unload $NS -v
 }
 
+test_ports_parse_ctx()
+{
+    local TEST_PORT=10000
+
+    skip_if_legacy_fallback
+
+    # the dispatcher only runs with more than one program
+    export LIBXDP_DISPATCHER_PARSE=1
+    check_run $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_pass.o -vv
+    check_run $XDP_FILTER load -f udp,tcp $NS -v
+    check_run $XDP_FILTER port $TEST_PORT -v
+    check_port tcp $TEST_PORT FAIL
+    check_port tcp $[TEST_PORT+1] OK
+    check_port udp $TEST_PORT FAIL
+    check_port udp $[TEST_PORT+1] OK
+    check_run $XDP_FILTER unload $NS -v
+    check_run $XDP_LOADER unload $NS --all -vv
+    unset LIBXDP_DISPATCHER_PARSE
+}
+
 test_ports_deny()
 {
     local TEST_PORT=10000
@@ -185,6 +302,94 @@ test_ipv4_allow()
     check_run $XDP_FILTER unload $NS -v
 }
 
+# Tunnels from the test namespace to the outside address, each with an inner
+# peer address the rules match and an extra route the rules don't match:
+# <name> <outer tcpdump filter> <inner peer> <unmatched inner address>
+TUNNELS=("xf-ipip|ip proto 4|192.0.2.2|198.51.100.1"
+         "xf-gre|ip proto 47|192.0.2.6|198.51.100.2"
+         "xf-vxlan|udp dst port 4789|192.0.2.10|198.51.100.3")
+
+setup_tunnel()
+{
+    local name=$1
+
+    case $name in
+        xf-ipip)
+            ip -n $NS link add $name type ipip local $INSIDE_IP4 remote $OUTSIDE_IP4 || return 1
+            ip -n $NS addr add 192.0.2.1 peer 192.0.2.2 dev $name
+            ip -n $NS link set $name up
+            ip -n $NS route add 198.51.100.1 dev $name
+            ;;
+        xf-gre)
+            ip -n $NS link add $name type gre local $INSIDE_IP4 remote $OUTSIDE_IP4 || return 1
+            ip -n $NS addr add 192.0.2.5 peer 192.0.2.6 dev $name
+            ip -n $NS link set $name up
+            ip -n $NS route add 198.51.100.2 dev $name
+            ;;
+        xf-vxlan)
+            ip -n $NS link add $name type vxlan id 42 local $INSIDE_IP4 remote $OUTSIDE_IP4 dstport 4789 || return 1
+            ip -n $NS addr add 192.0.2.9/30 dev $name
+            ip -n $NS link set $name up
+            # The inner packets must be IP rather than ARP
+            ip -n $NS neigh add 192.0.2.10 lladdr 02:00:00:00:00:0a dev $name nud permanent
+            ip -n $NS route add 198.51.100.3 via 192.0.2.10 dev $name
+            ;;
+    esac
+}
+
+check_tunnel_ping()
+{
+    local filter="$1"
+    local dst="$2"
+    local expect="$3"
+
+    check_packet "$filter" "ping -c 1 -W 1 $dst" $expect
+}
+
+test_ipv4_tunnel()
+{
+    local tunnel name filter matched unmatched
+    local -a created=()
+
+    check_run $XDP_FILTER load -f ipv4,tunnel $NS -v
+    check_status "ipv4,tunnel,allow"
+    # packets that are not encapsulated are filtered on their own headers
+    check_run $XDP_FILTER ip $OUTSIDE_IP4
+    check_ping4 FAIL
+    check_run $XDP_FILTER ip -r $OUTSIDE_IP4
+    check_ping4 OK
+
+    for tunnel in "${TUNNELS[@]}"; do
+        IFS="|" read -r name filter matched unmatched <<< "$tunnel"
+        if setup_tunnel $name; then
+            created+=("$tunnel")
+        else
+            echo "Couldn't create $name, not testing it"
+        fi
+    done
+    if [ "${#created[@]}" -eq 0 ]; then
+        check_run $XDP_FILTER unload $NS -v
+        return "$SKIPPED_TEST"
+    fi
+
+    for tunnel in "${created[@]}"; do
+        IFS="|" read -r name filter matched unmatched <<< "$tunnel"
+        check_run $XDP_FILTER ip $matched
+        check_tunnel_ping "$filter" $matched FAIL
+        check_tunnel_ping "$filter" $unmatched OK
+        # encapsulated packets are only filtered on their inner headers
+        check_run $XDP_FILTER ip $OUTSIDE_IP4
+        check_ping4 FAIL
+        check_tunnel_ping "$filter" $unmatched OK
+        check_run $XDP_FILTER ip -r $OUTSIDE_IP4
+        check_run $XDP_FILTER ip -r $matched
+        check_tunnel_ping "$filter" $matched OK
+        ip -n $NS link del $name
+    done
+
+    check_run $XDP_FILTER unload $NS -v
+}
+
 test_ipv4_deny()
 {
     check_ping4 OK
@@ -200,6 +405,52 @@ test_ipv4_deny()
     check_run $XDP_FILTER unload $NS -v
 }
 
+test_ip_prefix()
+{
+    check_ping4 OK
+    check_ping6 OK
+    check_run $XDP_FILTER load -f ipv4,ipv6 $NS -v
+    check_run $XDP_FILTER ip ${IP4_PREFIX}0/24
+    check_ping4 FAIL
+    check_run $XDP_FILTER ip $OUTSIDE_IP4
+    check_run $XDP_FILTER ip -r ${IP4_PREFIX}0/24
+    check_ping4 FAIL
+    check_run $XDP_FILTER ip -r $OUTSIDE_IP4
+    check_ping4 OK
+    check_run $XDP_FILTER ip ${IP6_PREFIX}/64
+    check_ping6 FAIL
+    check_run $XDP_FILTER ip -r ${IP6_PREFIX}1/64
+    check_ping6 OK
+    check_run $XDP_FILTER ip -m src ${IP4_PREFIX}255/24
+    check_ping4 FAIL
+    check_status "${IP4_PREFIX}0/24"
+    check_run $XDP_FILTER ip -m src -r ${IP4_PREFIX}0/24
+    check_ping4 OK
+    check_run $XDP_FILTER unload $NS -v
+}
+
+test_ip_bloom()
+{
+    check_ping4 OK
+    check_ping6 OK
+    check_run $XDP_FILTER load -f ipv4,ipv6,bloom $NS -v
+    check_status "ipv6,ipv4,bloom,allow"
+    check_run $XDP_FILTER ip $OUTSIDE_IP4
+    check_ping4 FAIL
+    check_run $XDP_FILTER ip ${IP6_PREFIX}/64
+    check_ping6 FAIL
+    # prefixes shorter than the filter's turn it off, and back on once gone
+    check_run $XDP_FILTER ip ${IP4_PREFIX}0/16
+    check_ping4 FAIL
+    check_run $XDP_FILTER ip -r ${IP4_PREFIX}0/16
+    check_ping4 FAIL
+    check_run $XDP_FILTER ip -r $OUTSIDE_IP4
+    check_ping4 OK
+    check_run $XDP_FILTER ip -r ${IP6_PREFIX}/64
+    check_ping6 OK
+    check_run $XDP_FILTER unload $NS -v
+}
+
 test_ether_allow()
 {
     check_ping6 OK
@@ -235,7 +486,8 @@ check_status()
     local match
     local output
     match="$1"
-    output=$($XDP_FILTER status)
+    shift
+    output=$($XDP_FILTER status "$@")
 
     if echo "$output" | grep -q $match; then
         echo "Output check for $match SUCCESS"
@@ -252,7 +504,8 @@ check_status_no_match()
     local match
     local output
     match="$1"
-    output=$($XDP_FILTER status)
+    shift
+    output=$($XDP_FILTER status "$@")
 
     if echo "$output" | grep -q $match; then
         echo "Output check for no $match FAILURE"
@@ -322,6 +575,129 @@ test_output_remove()
     check_run $XDP_FILTER unload $NS -v
 }
 
+test_import_export()
+{
+    local exported
+
+    check_run $XDP_FILTER load $NS -v
+    check_ping4 OK
+    check_run $XDP_FILTER import <(printf "# comment\nport 100 src,tcp\nport 200\nip ${IP4_PREFIX}0/24\nether $INSIDE_MAC src\n") -v
+    check_ping4 FAIL
+    check_status "100.*src,tcp"
+    check_status "200.*dst,tcp,udp"
+    check_status "${IP4_PREFIX}0/24"
+
+    exported=$($XDP_FILTER export)
+    echo "$exported"
+    if ! echo "$exported" | grep -q "^ip ${IP4_PREFIX}0/24 dst$"; then
+        echo "Missing IP rule in exported rules"
+        exit 1
+    fi
+
+    # Re-importing the exported rules should not change anything
+    check_run $XDP_FILTER import <(echo "$exported") -v
+    if [[ "$($XDP_FILTER export)" != "$exported" ]]; then
+        echo "Rules changed after re-import"
+        exit 1
+    fi
+
+    check_run $XDP_FILTER ip -r ${IP4_PREFIX}0/24
+    check_run $XDP_FILTER ether -m src -r $INSIDE_MAC
+    check_ping4 OK
+
+    if $XDP_FILTER import <(echo "bogus rule") 2>/dev/null; then
+        echo "Importing an invalid rule file succeeded"
+        exit 1
+    fi
+    check_run $XDP_FILTER unload $NS -v
+}
+
+test_import_replace()
+{
+    check_run $XDP_FILTER load $NS -v
+    check_run $XDP_FILTER port 100
+    check_run $XDP_FILTER ip $OUTSIDE_IP4
+    check_run $XDP_FILTER ip $OUTSIDE_IP6
+    check_ping4 FAIL
+    check_ping6 FAIL
+
+    check_run $XDP_FILTER import --replace <(printf "port 200\nip ${IP4_PREFIX}0/24\n") -v
+    check_status_no_match "100.*dst,tcp,udp"
+    check_status_no_match "$OUTSIDE_IP6"
+    check_status "200.*dst,tcp,udp"
+    check_status "${IP4_PREFIX}0/24"
+    check_ping4 FAIL
+    check_ping6 OK
+
+    check_run $XDP_FILTER import -r <(echo "# empty") -v
+    check_status_no_match "${IP4_PREFIX}0/24"
+    check_ping4 OK
+    check_run $XDP_FILTER unload $NS -v
+}
+
+test_flow()
+{
+    local TEST_PORT=10000
+
+    check_run $XDP_FILTER load -f flow $NS -v
+    check_port tcp $TEST_PORT OK
+    check_run $XDP_FILTER flow --dport $TEST_PORT --proto tcp -v
+    check_port tcp $TEST_PORT FAIL
+    check_port udp $TEST_PORT OK
+    check_port tcp $[TEST_PORT+1] OK
+
+    check_run $XDP_FILTER flow --src $INSIDE_IP6 --dport $[TEST_PORT+1] -v
+    check_port tcp $[TEST_PORT+1] FAIL
+    check_port udp $[TEST_PORT+1] FAIL
+    check_status "src=$INSIDE_IP6,dport=$[TEST_PORT+1]"
+
+    check_run $XDP_FILTER flow --dst $INSIDE_IP6 --dport $[TEST_PORT+2] -v
+    check_port tcp $[TEST_PORT+2] OK
+
+    check_run $XDP_FILTER flow -r --dport $TEST_PORT -v
+    check_port tcp $TEST_PORT OK
+    check_status_no_match "dport=$TEST_PORT[^0-9]"
+    check_run $XDP_FILTER unload $NS -v
+}
+
+check_udp_sport()
+{
+    local sport=$1
+    local port=$2
+    local expect=$3
+
+    check_packet "udp dst port $port" "echo test | nc -w 1 -u -p $sport $OUTSIDE_IP6 $port" $expect
+}
+
+test_conntrack()
+{
+    local TEST_PORT=10000
+
+    check_run $XDP_FILTER load -f conntrack $NS -v
+    check_udp_sport 5000 $TEST_PORT OK
+
+    # The connection from port 5000 is established, so only new ones are hit
+    check_run $XDP_FILTER flow --src $INSIDE_IP6 --dport $TEST_PORT -v
+    check_udp_sport 5000 $TEST_PORT OK
+    check_udp_sport 5001 $TEST_PORT FAIL
+    check_status "Established"
+    check_run $XDP_FILTER unload $NS -v
+}
+
+test_ratelimit()
+{
+    check_run $XDP_FILTER load -f ratelimit $NS -v
+    check_ping4 OK
+    check_run $XDP_FILTER ratelimit --pps 1 --burst 0 -v
+    ns_exec ping -c 5 -i 0.2 $OUTSIDE_IP4 || true
+    check_status "$INSIDE_IP4"
+
+    # No arguments turns the rate limit off again
+    check_run $XDP_FILTER ratelimit -v
+    check_ping4 OK
+    check_run $XDP_FILTER unload $NS -v
+}
+
 get_python()
 {
     if [[ -z "${PYTHON:-}" ]]; then
@@ -388,4 +764,7 @@ cleanup_tests()
 {
     $XDP_FILTER unload $NS >/dev/null 2>&1
     $XDP_LOADER unload $NS --all >/dev/null 2>&1
+    for tunnel in xf-ipip xf-gre xf-vxlan; do
+        ip -n $NS link del $tunnel >/dev/null 2>&1
+    done
 }
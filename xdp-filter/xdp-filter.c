@@ -8,6 +8,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
@@ -15,6 +18,7 @@
 #include <arpa/inet.h>
 
 #include <linux/if_ether.h>
+#include <linux/err.h>
 
 #include "params.h"
 #include "logging.h"
@@ -25,6 +29,16 @@
 
 #define NEED_RLIMIT (20 * 1024 * 1024) /* 10 Mbyte */
 #define PROG_NAME "xdp-filter"
+#define MAP_BATCH_SIZE 1024
+#define RODATA_MAP_NAME "xdpfilt_.rodata"
+#define HW_PREFILTER_FILE "xdpfilt_hw.o"
+#define HW_PREFILTER_NAME "xdpfilt_hw"
+#define HW_PREFILTER_DIR "hw"
+#define OWN_RULES_DIR "iface"
+
+#ifndef ENOTSUPP
+#define ENOTSUPP         524 /* Operation is not supported */
+#endif
 
 struct flag_val map_flags_all[] = {
 	{"src", MAP_FLAG_SRC},
@@ -71,13 +85,12 @@ static __u32 find_features(const char *progname)
 	return 0;
 }
 
-static int map_get_counter_flags(int fd, void *key, __u64 *counter, __u8 *flags)
+static int map_get_counter(int counter_fd, const void *key, __u64 *counter)
 {
 	/* For percpu maps, userspace gets a value per possible CPU */
 	int nr_cpus = libbpf_num_possible_cpus();
-	__u64 sum_ctr = 0;
+	__u64 sum_ctr = 0, *values;
 	int i, err = 0;
-	__u64 *values;
 
 	if (nr_cpus < 0)
 		return nr_cpus;
@@ -86,22 +99,14 @@ static int map_get_counter_flags(int fd, void *key, __u64 *counter, __u8 *flags)
 	if (!values)
 		return -ENOMEM;
 
-	if ((bpf_map_lookup_elem(fd, key, values)) != 0) {
-		err = -ENOENT;
+	if (bpf_map_lookup_elem(counter_fd, key, values)) {
+		err = -errno;
 		goto out;
 	}
 
 	/* Sum values from each CPU */
-	for (i = 0; i < nr_cpus; i++) {
-		__u8 flg = values[i] & MAP_FLAGS;
-
-		if (!flg) {
-			err = -ENOENT; /* not set */
-			goto out;
-		}
-		*flags = flg;
-		sum_ctr += values[i] >> COUNTER_SHIFT;
-	}
+	for (i = 0; i < nr_cpus; i++)
+		sum_ctr += values[i];
 	*counter = sum_ctr;
 
 out:
@@ -109,12 +114,11 @@ out:
 	return err;
 }
 
-static int map_set_flags(int fd, void *key, __u8 flags, bool delete_empty)
+static int map_reset_counter(int counter_fd, const void *key)
 {
-	/* For percpu maps, userspace gets a value per possible CPU */
 	int nr_cpus = libbpf_num_possible_cpus();
 	__u64 *values;
-	int i, err;
+	int err = 0;
 
 	if (nr_cpus < 0)
 		return nr_cpus;
@@ -123,27 +127,64 @@ static int map_set_flags(int fd, void *key, __u8 flags, bool delete_empty)
 	if (!values)
 		return -ENOMEM;
 
-	if (bpf_map_lookup_elem(fd, key, values) != 0) {
-		memset(values, 0, sizeof(*values) * nr_cpus);
-	} else if (!flags && delete_empty) {
+	if (bpf_map_update_elem(counter_fd, key, values, 0)) {
+		err = -errno;
+		pr_warn("Unable to reset hit counter: %s\n", strerror(-err));
+	}
+
+	free(values);
+	return err;
+}
+
+static int map_get_counter_flags(int fd, int counter_fd, void *key,
+				 __u64 *counter, __u8 *flags)
+{
+	__u8 flg = 0;
+
+	if (bpf_map_lookup_elem(fd, key, &flg) || !(flg & MAP_FLAGS))
+		return -ENOENT; /* not set */
+
+	*flags = flg;
+	*counter = 0;
+	if (counter_fd >= 0)
+		map_get_counter(counter_fd, key, counter);
+
+	return 0;
+}
+
+static int map_set_flags(int fd, int counter_fd, void *key, __u8 flags,
+			 bool delete_empty)
+{
+	__u8 old_flags = 0;
+	int err;
+
+	bpf_map_lookup_elem(fd, key, &old_flags);
+
+	if (!flags && delete_empty) {
 		pr_debug("Deleting empty map value from flags %u\n", flags);
 
 		err = bpf_map_delete_elem(fd, key);
-		if (err) {
+		if (err && errno != ENOENT) {
 			err = -errno;
 			pr_warn("Couldn't delete value from state map: %s\n",
 				strerror(-err));
+			return err;
 		}
-		goto out;
+		if (counter_fd >= 0)
+			bpf_map_delete_elem(counter_fd, key);
+		return 0;
 	}
 
-	for (i = 0; i < nr_cpus; i++)
-		values[i]  = flags ? (values[i] & ~MAP_FLAGS) | (flags & MAP_FLAGS) : 0;
+	/* New (and cleared) rules start out with a zero hit counter */
+	if (counter_fd >= 0 && (!flags || !(old_flags & MAP_FLAGS))) {
+		err = map_reset_counter(counter_fd, key);
+		if (err)
+			return err;
+	}
 
-	pr_debug("Setting new map value %" PRIu64 " from flags %u\n",
-		 (uint64_t)values[0], flags);
+	pr_debug("Setting new map value from flags %u\n", flags);
 
-	err = bpf_map_update_elem(fd, key, values, 0);
+	err = bpf_map_update_elem(fd, key, &flags, 0);
 	if (err) {
 		err = -errno;
 		if (err == -E2BIG)
@@ -152,18 +193,190 @@ static int map_set_flags(int fd, void *key, __u8 flags, bool delete_empty)
 			pr_warn("Unable to update state map: %s\n", strerror(-err));
 	}
 
+	return err;
+}
+
+/* The maps used by each feature, so the maps of features that are not
+ * loaded are neither created nor left behind pinned.
+ */
+static const struct feature_map {
+	__u32 features;
+	__u32 requires;
+	const char *name;
+	bool inner;
+} feature_maps[] = {
+	{ .features = FEAT_TCP | FEAT_UDP,
+	  .name = textify(MAP_NAME_PORTS) },
+	{ .features = FEAT_TCP | FEAT_UDP,
+	  .name = textify(MAP_NAME_PORT_COUNTERS) },
+	{ .features = FEAT_IPV4,
+	  .name = textify(MAP_NAME_IPV4) },
+	{ .features = FEAT_IPV4,
+	  .name = "filter_ipv4_rules",
+	  .inner = true },
+	{ .features = FEAT_IPV6,
+	  .name = textify(MAP_NAME_IPV6) },
+	{ .features = FEAT_IPV6,
+	  .name = "filter_ipv6_rules",
+	  .inner = true },
+	{ .features = FEAT_IPV4,
+	  .requires = FEAT_BLOOM,
+	  .name = textify(MAP_NAME_IPV4_BLOOM) },
+	{ .features = FEAT_IPV6,
+	  .requires = FEAT_BLOOM,
+	  .name = textify(MAP_NAME_IPV6_BLOOM) },
+	{ .features = FEAT_IPV4 | FEAT_IPV6,
+	  .name = textify(MAP_NAME_IP_COUNTERS) },
+	{ .features = FEAT_ETHERNET,
+	  .name = textify(MAP_NAME_ETHERNET) },
+	{ .features = FEAT_ETHERNET,
+	  .name = textify(MAP_NAME_ETHERNET_COUNTERS) },
+	{ .features = FEAT_FLOW,
+	  .name = textify(MAP_NAME_FLOWS) },
+	{ .features = FEAT_FLOW,
+	  .name = textify(MAP_NAME_FLOW_COUNTERS) },
+	{ .features = FEAT_FLOW,
+	  .name = textify(MAP_NAME_FLOW_MASKS) },
+	{ .features = FEAT_CONNTRACK,
+	  .name = textify(MAP_NAME_CONNTRACK) },
+	{ .features = FEAT_RATELIMIT,
+	  .name = textify(MAP_NAME_RATELIMIT) },
+	{ .features = FEAT_RATELIMIT,
+	  .name = textify(MAP_NAME_RATELIMIT_CFG) },
+	{}
+};
+
+/* A map is used by any of its features, as long as all the features it
+ * requires are there as well.
+ */
+static bool feature_map_used(const struct feature_map *fmap, __u32 features)
+{
+	return (features & fmap->features) &&
+	       (features & fmap->requires) == fmap->requires;
+}
+
+/* The object files contain every feature; the ones to use are set in the
+ * filt_features variable in the read-only data section before loading, and
+ * the verifier removes the code of all the others.
+ */
+static int prog_set_features(struct xdp_program *prog, __u32 features)
+{
+	struct bpf_object *obj = xdp_program__bpf_obj(prog);
+	const struct feature_map *fmap;
+	struct bpf_map *map;
+
+	features &= ~(FEAT_ALLOW | FEAT_DENY);
+
+	map = bpf_object__find_map_by_name(obj, RODATA_MAP_NAME);
+	if (!map || bpf_map__value_size(map) != sizeof(features)) {
+		pr_warn("Couldn't find the feature set in the BPF program\n");
+		return -ENOENT;
+	}
+
+	if (bpf_map__set_initial_value(map, &features, sizeof(features))) {
+		pr_warn("Couldn't set the feature set of the BPF program\n");
+		return -EINVAL;
+	}
+
+	for (fmap = feature_maps; fmap->name; fmap++) {
+		if (feature_map_used(fmap, features))
+			continue;
+
+		map = bpf_object__find_map_by_name(obj, fmap->name);
+		if (!map)
+			continue;
+#ifdef HAVE_LIBBPF_BPF_MAP__SET_AUTOCREATE
+		bpf_map__set_autocreate(map, false);
+#else
+		pr_debug("Libbpf is missing bpf_map__set_autocreate(), "
+			 "creating unused map %s\n", fmap->name);
+#endif
+	}
+
+	return 0;
+}
+
+/* Read back the feature set a program was loaded with from its read-only
+ * data section.
+ */
+static int prog_get_loaded_features(struct xdp_program *prog, __u32 *features)
+{
+	__u32 i, *map_ids, num_maps, prog_len = sizeof(struct bpf_prog_info);
+	__u32 map_len = sizeof(struct bpf_map_info), key = 0;
+	struct bpf_prog_info prog_info = {};
+	struct bpf_map_info map_info;
+	int fd, err, prog_fd;
+
+	prog_fd = xdp_program__fd(prog);
+	if (prog_fd < 0)
+		return -ENOENT;
+
+	if (bpf_obj_get_info_by_fd(prog_fd, &prog_info, &prog_len))
+		return -errno;
+
+	num_maps = prog_info.nr_map_ids;
+	map_ids = calloc(num_maps, sizeof(*map_ids));
+	if (!map_ids)
+		return -ENOMEM;
+
+	memset(&prog_info, 0, prog_len);
+	prog_info.nr_map_ids = num_maps;
+	prog_info.map_ids = (__u64)(unsigned long)map_ids;
+
+	if (bpf_obj_get_info_by_fd(prog_fd, &prog_info, &prog_len)) {
+		err = -errno;
+		goto out;
+	}
+
+	err = -ENOENT;
+	for (i = 0; i < prog_info.nr_map_ids && i < num_maps; i++) {
+		fd = bpf_map_get_fd_by_id(map_ids[i]);
+		if (fd < 0)
+			continue;
+
+		memset(&map_info, 0, map_len);
+		if (bpf_obj_get_info_by_fd(fd, &map_info, &map_len) ||
+		    strncmp(map_info.name, RODATA_MAP_NAME,
+			    sizeof(map_info.name)) ||
+		    map_info.value_size != sizeof(*features)) {
+			close(fd);
+			continue;
+		}
+
+		err = bpf_map_lookup_elem(fd, &key, features) ? -errno : 0;
+		close(fd);
+		break;
+	}
+
 out:
-	free(values);
+	free(map_ids);
 	return err;
 }
 
+static __u32 get_prog_features(struct xdp_program *prog)
+{
+	__u32 feats, loaded;
+
+	feats = find_features(xdp_program__name(prog));
+	if (!feats)
+		return 0;
+
+	/* If the feature set can't be read, assume everything compiled into
+	 * the program is in use, so none of its maps are removed.
+	 */
+	if (!prog_get_loaded_features(prog, &loaded))
+		feats &= loaded | FEAT_ALLOW | FEAT_DENY;
+
+	return feats;
+}
+
 static int get_iface_features(__unused const struct iface *iface,
 			      struct xdp_program *prog,
 			      __unused enum xdp_attach_mode mode, void *arg)
 {
 	__u32 *all_feats = arg;
 
-	*all_feats |= find_features(xdp_program__name(prog));
+	*all_feats |= get_prog_features(prog);
 	return 0;
 }
 
@@ -181,12 +394,120 @@ static int get_used_features(const char *pin_root_path, __u32 *feats)
 	return 0;
 }
 
+/* Interfaces loaded with --own-rules keep their maps, program pins and
+ * prefilter state in a pinning directory of their own, beneath iface/<ifname>
+ * in the shared one. All the commands then work on it as on the shared rule
+ * set, so its rules and features don't affect any other interface.
+ */
+static int own_rules_path(char *buf, size_t buf_len, const char *pin_root_path,
+			  const char *ifname)
+{
+	return try_snprintf(buf, buf_len, "%s/%s/%s", pin_root_path,
+			    OWN_RULES_DIR, ifname);
+}
+
+/* Remove the directories of a rule set of its own, and the ones above it,
+ * as far as they are empty.
+ */
+static void remove_own_rules_dirs(const char *rules_path)
+{
+	char path[PATH_MAX], *p;
+	int i;
+
+	if (try_snprintf(path, sizeof(path), "%s/programs", rules_path))
+		return;
+
+	for (i = 0; i < 4 && (p = strrchr(path, '/')); i++) {
+		if (rmdir(path) && errno != ENOENT)
+			break;
+		*p = '\0';
+	}
+}
+
+/* Select the rule set of the interface given with --iface, or the shared one */
+static int select_rules(char *buf, size_t buf_len, const char *pin_root_path,
+			const struct iface *iface)
+{
+	int err;
+
+	if (!iface->ifname)
+		return try_snprintf(buf, buf_len, "%s", pin_root_path);
+
+	err = own_rules_path(buf, buf_len, pin_root_path, iface->ifname);
+	if (err)
+		return err;
+
+	if (access(buf, F_OK)) {
+		pr_warn("xdp-filter is not loaded on %s with its own rules\n",
+			iface->ifname);
+		return -ENOENT;
+	}
+	return 0;
+}
+
+typedef int (*rules_callback)(const char *ifname, const char *rules_path,
+			      void *arg);
+
+static int iterate_own_rules(const char *pin_root_path, rules_callback cb,
+			     void *arg)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	int err = 0;
+	DIR *dr;
+
+	err = try_snprintf(path, sizeof(path), "%s/%s", pin_root_path,
+			   OWN_RULES_DIR);
+	if (err)
+		return err;
+
+	dr = opendir(path);
+	if (!dr)
+		return errno == ENOENT ? 0 : -errno;
+
+	while ((de = readdir(dr)) != NULL) {
+		if (de->d_type != DT_DIR || de->d_name[0] == '.')
+			continue;
+
+		err = own_rules_path(path, sizeof(path), pin_root_path,
+				     de->d_name);
+		if (err)
+			break;
+
+		err = cb(de->d_name, path, arg);
+		if (err)
+			break;
+	}
+
+	closedir(dr);
+	return err;
+}
+
+static bool loaded_with_rules(const struct iface *iface,
+			      const char *rules_path)
+{
+	struct xdp_program *prog;
+	enum xdp_attach_mode mode;
+
+	if (get_pinned_program(iface, rules_path, &mode, &prog))
+		return false;
+
+	xdp_program__close(prog);
+	return true;
+}
+
 static const struct loadopt {
 	bool help;
 	struct iface iface;
 	unsigned int features;
 	enum xdp_attach_mode mode;
 	unsigned int policy_mode;
+	bool replace;
+	bool hw_prefilter;
+	bool no_prealloc;
+	bool own_rules;
+	__u32 max_ips;
+	__u32 max_macs;
 } defaults_load = {
 	.features = FEAT_ALL,
 	.mode = XDP_MODE_NATIVE,
@@ -199,6 +520,11 @@ struct flag_val load_features[] = {
 	{"ipv6", FEAT_IPV6},
 	{"ipv4", FEAT_IPV4},
 	{"ethernet", FEAT_ETHERNET},
+	{"flow", FEAT_FLOW},
+	{"conntrack", FEAT_CONNTRACK},
+	{"ratelimit", FEAT_RATELIMIT},
+	{"tunnel", FEAT_TUNNEL},
+	{"bloom", FEAT_BLOOM},
 	{"all", FEAT_ALL},
 	{}
 };
@@ -209,6 +535,11 @@ struct flag_val print_features[] = {
 	{"ipv6", FEAT_IPV6},
 	{"ipv4", FEAT_IPV4},
 	{"ethernet", FEAT_ETHERNET},
+	{"flow", FEAT_FLOW},
+	{"conntrack", FEAT_CONNTRACK},
+	{"ratelimit", FEAT_RATELIMIT},
+	{"tunnel", FEAT_TUNNEL},
+	{"bloom", FEAT_BLOOM},
 	{"allow", FEAT_ALLOW},
 	{"deny", FEAT_DENY},
 	{}
@@ -248,109 +579,36 @@ static struct prog_option load_options[] = {
 		      .metavar = "<feats>",
 		      .typearg = load_features,
 		      .help = "Features to enable; default all"),
+	DEFINE_OPTION("replace", OPT_BOOL, struct loadopt, replace,
+		      .short_opt = 'r',
+		      .help = "Replace an already loaded xdp-filter in place"),
+	DEFINE_OPTION("hw-prefilter", OPT_BOOL, struct loadopt, hw_prefilter,
+		      .help = "Also offload port and ethernet rules to the NIC"),
+	DEFINE_OPTION("max-ips", OPT_U32, struct loadopt, max_ips,
+		      .metavar = "<num>",
+		      .help = "Make room for <num> IPv4 and <num> IPv6 rules; default 262144"),
+	DEFINE_OPTION("max-macs", OPT_U32, struct loadopt, max_macs,
+		      .metavar = "<num>",
+		      .help = "Make room for <num> ethernet rules; default 10000"),
+	DEFINE_OPTION("no-prealloc", OPT_BOOL, struct loadopt, no_prealloc,
+		      .help = "Allocate ethernet rules as they are added, not up front"),
+	DEFINE_OPTION("own-rules", OPT_BOOL, struct loadopt, own_rules,
+		      .help = "Give the interface rules and features of its own"),
 	END_OPTIONS
 };
 
-int do_load(const void *cfg, const char *pin_root_path)
-{
-	char errmsg[STRERR_BUFSIZE], featbuf[100];
-	const struct loadopt *opt = cfg;
-	struct xdp_program *p = NULL;
-	int err = EXIT_SUCCESS;
-	unsigned int features;
-	__u32 used_feats;
-	char *filename;
-	DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts,
-			    .pin_root_path = pin_root_path);
-	DECLARE_LIBXDP_OPTS(xdp_program_opts, xdp_opts, 0);
-
-	if (opt->mode == XDP_MODE_HW) {
-		pr_warn("xdp-filter does not support offloading.\n");
-		return EXIT_FAILURE;
-	}
-
-	err = get_used_features(pin_root_path, &used_feats);
-	if (err) {
-		pr_warn("Error getting list of loaded programs: %s\n",
-			strerror(-err));
-		return err;
-	}
-
-	features = opt->features;
-	if (opt->policy_mode == FEAT_DENY && used_feats & FEAT_ALLOW) {
-		pr_warn("xdp-filter is already loaded in allow policy mode. "
-			"Unload before loading in deny mode.\n");
-		return EXIT_FAILURE;
-	} else if (opt->policy_mode == FEAT_ALLOW && used_feats & FEAT_DENY) {
-		pr_warn("xdp-filter is already loaded in deny policy mode. "
-			"Unload before loading in allow mode.\n");
-		return EXIT_FAILURE;
-	}
-	features |= opt->policy_mode;
-
-	err = get_pinned_program(&opt->iface, pin_root_path, NULL, &p);
-	if (!err) {
-		pr_warn("xdp-filter is already loaded on %s\n", opt->iface.ifname);
-		xdp_program__close(p);
-		return EXIT_FAILURE;
-	}
-
-	print_flags(featbuf, sizeof(featbuf), print_features, features);
-	pr_debug("Looking for eBPF program with features %s\n", featbuf);
-
-	filename = find_prog_file(features);
-	if (!filename) {
-		pr_warn("Couldn't find an eBPF program with the requested feature set!\n");
-		return EXIT_FAILURE;
-	}
-
-	pr_debug("Found prog '%s' matching feature set to be loaded on interface '%s'.\n",
-		 filename, opt->iface.ifname);
-
-	/* libbpf spits out a lot of unhelpful error messages while loading.
-	 * Silence the logging so we can provide our own messages instead; this
-	 * is a noop if verbose logging is enabled.
-	 */
-	silence_libbpf_logging();
-
-retry:
-	xdp_opts.find_filename = filename;
-	xdp_opts.opts = &opts;
-	/* prog_name is NULL, so choose the first program in object */
-	p = xdp_program__create(&xdp_opts);
-	err = libxdp_get_error(p);
-	if (err) {
-		if (err == -EPERM && !double_rlimit())
-			goto retry;
-
-		libxdp_strerror(err, errmsg, sizeof(errmsg));
-		pr_warn("Couldn't load BPF program: %s(%d)\n", errmsg, err);
-		p = NULL;
-		goto out;
-	}
-
-	err = attach_xdp_program(p, &opt->iface, opt->mode, pin_root_path);
-	if (err) {
-		if (err == -EPERM && !double_rlimit()) {
-			xdp_program__close(p);
-			goto retry;
-		}
-
-		libxdp_strerror(err, errmsg, sizeof(errmsg));
-		pr_warn("Couldn't attach XDP program on iface '%s': %s(%d)\n",
-			opt->iface.ifname, errmsg, err);
-		goto out;
-	}
-
-out:
-	if (p)
-		xdp_program__close(p);
-	free(filename);
-	return err;
-}
+static bool hw_prefilter_loaded(const char *pin_root_path, const char *ifname);
+static int hw_prefilter_attach(const struct iface *iface,
+			       const char *pin_root_path);
+static int hw_prefilter_detach(const struct iface *iface,
+			       const char *pin_root_path);
+static int hw_prefilter_sync(const char *pin_root_path);
+static int open_ip_rules(const char *pin_root_path, const char *map_name);
+static int ip_bloom_sync(const char *pin_root_path, int af);
 
 static int remove_unused_maps(const char *pin_root_path, __u32 features)
 {
+	const struct feature_map *fmap;
 	int dir_fd, err = 0;
 
 	dir_fd = open(pin_root_path, O_DIRECTORY);
@@ -363,26 +621,11 @@ static int remove_unused_maps(const char *pin_root_path, __u32 features)
 		goto out;
 	}
 
-	if (!(features & (FEAT_TCP | FEAT_UDP))) {
-		err = unlink_pinned_map(dir_fd, textify(MAP_NAME_PORTS));
-		if (err)
-			goto out;
-	}
-
-	if (!(features & FEAT_IPV4)) {
-		err = unlink_pinned_map(dir_fd, textify(MAP_NAME_IPV4));
-		if (err)
-			goto out;
-	}
-
-	if (!(features & FEAT_IPV6)) {
-		err = unlink_pinned_map(dir_fd, textify(MAP_NAME_IPV6));
-		if (err)
-			goto out;
-	}
+	for (fmap = feature_maps; fmap->name; fmap++) {
+		if (feature_map_used(fmap, features) || fmap->inner)
+			continue;
 
-	if (!(features & FEAT_ETHERNET)) {
-		err = unlink_pinned_map(dir_fd, textify(MAP_NAME_ETHERNET));
+		err = unlink_pinned_map(dir_fd, fmap->name);
 		if (err)
 			goto out;
 	}
@@ -403,15 +646,18 @@ static int remove_unused_maps(const char *pin_root_path, __u32 features)
 
 		pr_debug("Removing program directory %s\n", buf);
 		err = rmdir(buf);
-		if (err) {
+		if (err && errno != ENOENT) {
 			err = -errno;
 			pr_warn("Unable to rmdir: %s\n", strerror(-err));
 			goto out;
 		}
 
+		/* Interfaces with rules of their own may still be below it */
 		pr_debug("Removing pinning directory %s\n", pin_root_path);
 		err = rmdir(pin_root_path);
-		if (err) {
+		if (err && errno == ENOTEMPTY) {
+			err = 0;
+		} else if (err) {
 			err = -errno;
 			pr_warn("Unable to rmdir: %s\n", strerror(-err));
 			goto out;
@@ -425,20 +671,363 @@ out:
 	return err;
 }
 
-static int remove_iface_program(const struct iface *iface,
-				struct xdp_program *prog,
-				enum xdp_attach_mode mode, void *arg)
+/* Every IP rule takes up to two hit counters */
+#define IP_COUNTER_MAX_IPS (UINT32_MAX / 2)
+
+/* If map_name is pinned, libbpf will reuse it, which needs the definition in
+ * the object to match. So take the size and flags from the pinned map, and
+ * refuse to load when they differ from what was asked for.
+ */
+static int pinned_map_def(const char *pin_root_path, const char *map_name,
+			  bool ip_rules, __u32 want_size, __u32 *size,
+			  __u32 *flags)
 {
-	char errmsg[STRERR_BUFSIZE], buf[100];
-	char *pin_root_path = arg;
-	__u32 feats;
-	int err;
+	struct bpf_map_info info = {};
+	__u32 len = sizeof(info);
+	int fd, err = 0;
 
-	feats = find_features(xdp_program__name(prog));
-	if (!feats) {
-		pr_warn("Unrecognised XDP program on interface %s. Not removing.\n",
-			iface->ifname);
-		return -ENOENT;
+	if (ip_rules)
+		fd = open_ip_rules(pin_root_path, map_name);
+	else
+		fd = get_pinned_map_fd(pin_root_path, map_name, NULL);
+	if (fd < 0)
+		return 0;
+
+	if (bpf_obj_get_info_by_fd(fd, &info, &len)) {
+		err = -errno;
+		goto out;
+	}
+
+	if ((want_size && info.max_entries != want_size) ||
+	    (flags && (*flags & ~info.map_flags))) {
+		pr_warn("Map %s already exists with %u entries%s; unload "
+			"xdp-filter from all interfaces to change it\n",
+			map_name, info.max_entries,
+			info.map_flags & BPF_F_NO_PREALLOC ? "" : ", preallocated");
+		err = -EEXIST;
+		goto out;
+	}
+
+	*size = info.max_entries;
+	if (flags)
+		*flags = info.map_flags;
+out:
+	close(fd);
+	return err;
+}
+
+static int set_map_def(struct bpf_object *obj, const char *map_name,
+		       __u32 size, const __u32 *flags)
+{
+	struct bpf_map *map;
+
+	map = bpf_object__find_map_by_name(obj, map_name);
+	if (!map)
+		return 0;
+
+	if (bpf_map__set_max_entries(map, size) ||
+	    (flags && bpf_map__set_map_flags(map, *flags))) {
+		pr_warn("Couldn't resize map %s\n", map_name);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* The IP rule tries are created from the template of the outer map as well
+ * as from their own definition, and the kernel wants both to agree.
+ */
+static int set_ip_rules_size(struct bpf_object *obj, const char *outer_name,
+			     const char *map_name, __u32 size)
+{
+	struct bpf_map *outer;
+
+	outer = bpf_object__find_map_by_name(obj, outer_name);
+	if (!outer)
+		return 0;
+
+#ifdef HAVE_LIBBPF_BPF_MAP__INNER_MAP
+	if (bpf_map__set_max_entries(bpf_map__inner_map(outer), size)) {
+		pr_warn("Couldn't resize map %s\n", outer_name);
+		return -EINVAL;
+	}
+#else
+	if (size != IP_MAP_MAX_ENTRIES) {
+		pr_warn("Libbpf is missing bpf_map__inner_map(), "
+			"can't resize the IP rule maps\n");
+		return -EOPNOTSUPP;
+	}
+#endif
+	return set_map_def(obj, map_name, size, NULL);
+}
+
+/* Size the rule maps and their counters for --max-ips and --max-macs, so
+ * large blocklists fit on big machines while small ones use little memory.
+ * The hash maps of the ethernet rules are preallocated by default, which
+ * makes adding rules cheap; --no-prealloc allocates them as rules are added.
+ */
+static int prog_set_map_sizes(struct xdp_program *prog,
+			      const struct loadopt *opt,
+			      const char *pin_root_path)
+{
+	struct bpf_object *obj = xdp_program__bpf_obj(prog);
+	__u32 ip_counters, ips, macs, mac_counters;
+	__u32 mac_flags, mac_counter_flags;
+	int err;
+
+	if (opt->max_ips > IP_COUNTER_MAX_IPS) {
+		pr_warn("At most %u IP rules are supported\n",
+			IP_COUNTER_MAX_IPS);
+		return -EINVAL;
+	}
+
+	ips = opt->max_ips ?: IP_MAP_MAX_ENTRIES;
+	ip_counters = 2 * ips;
+	macs = mac_counters = opt->max_macs ?: ETHERNET_MAP_MAX_ENTRIES;
+	mac_flags = mac_counter_flags = opt->no_prealloc ? BPF_F_NO_PREALLOC : 0;
+
+	err = pinned_map_def(pin_root_path, textify(MAP_NAME_IPV4), true,
+			     opt->max_ips, &ips, NULL);
+	err = err ?: pinned_map_def(pin_root_path, textify(MAP_NAME_IP_COUNTERS),
+				    false, opt->max_ips ? ip_counters : 0,
+				    &ip_counters, NULL);
+	err = err ?: pinned_map_def(pin_root_path, textify(MAP_NAME_ETHERNET),
+				    false, opt->max_macs, &macs, &mac_flags);
+	err = err ?: pinned_map_def(pin_root_path,
+				    textify(MAP_NAME_ETHERNET_COUNTERS), false,
+				    opt->max_macs, &mac_counters,
+				    &mac_counter_flags);
+	if (err)
+		return err;
+
+	err = set_ip_rules_size(obj, textify(MAP_NAME_IPV4), "filter_ipv4_rules",
+				ips);
+	err = err ?: set_ip_rules_size(obj, textify(MAP_NAME_IPV6),
+				       "filter_ipv6_rules", ips);
+	err = err ?: set_map_def(obj, textify(MAP_NAME_IP_COUNTERS),
+				 ip_counters, NULL);
+	err = err ?: set_map_def(obj, textify(MAP_NAME_ETHERNET), macs,
+				 &mac_flags);
+	err = err ?: set_map_def(obj, textify(MAP_NAME_ETHERNET_COUNTERS),
+				 mac_counters, &mac_counter_flags);
+	return err;
+}
+
+int do_load(const void *cfg, const char *pin_root_path)
+{
+	char own_path[PATH_MAX], own_parent[PATH_MAX];
+	char errmsg[STRERR_BUFSIZE], featbuf[100];
+	struct xdp_program *p = NULL, *old_prog = NULL;
+	const struct loadopt *opt = cfg;
+	enum xdp_attach_mode mode = opt->mode;
+	int err = EXIT_SUCCESS;
+	unsigned int features;
+	__u32 used_feats;
+	char *filename;
+	DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts,
+			    .pin_root_path = pin_root_path);
+	DECLARE_LIBXDP_OPTS(xdp_program_opts, xdp_opts, 0);
+
+	if (opt->mode == XDP_MODE_HW) {
+		pr_warn("xdp-filter does not support offloading.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* In deny mode, the rules select the packets to let through, which
+	 * the prefilter can't do on its own
+	 */
+	if (opt->hw_prefilter && opt->policy_mode != FEAT_ALLOW) {
+		pr_warn("The offloaded prefilter needs the allow policy.\n");
+		return EXIT_FAILURE;
+	}
+
+	err = own_rules_path(own_path, sizeof(own_path), pin_root_path,
+			     opt->iface.ifname);
+	if (err)
+		return err;
+
+	/* An interface runs only one xdp-filter, so it uses one rule set */
+	if (loaded_with_rules(&opt->iface,
+			      opt->own_rules ? pin_root_path : own_path)) {
+		pr_warn("xdp-filter is already loaded on %s with %s rules; "
+			"unload it before switching\n", opt->iface.ifname,
+			opt->own_rules ? "the shared" : "its own");
+		return EXIT_FAILURE;
+	}
+
+	if (opt->own_rules) {
+		err = try_snprintf(own_parent, sizeof(own_parent), "%s/%s",
+				   pin_root_path, OWN_RULES_DIR);
+		if (err)
+			return err;
+		pin_root_path = own_path;
+		opts.pin_root_path = pin_root_path;
+	}
+
+	err = get_used_features(pin_root_path, &used_feats);
+	if (err) {
+		pr_warn("Error getting list of loaded programs: %s\n",
+			strerror(-err));
+		return err;
+	}
+
+	features = opt->features;
+	if (features & FEAT_CONNTRACK)
+		features |= FEAT_FLOW;
+	if (opt->policy_mode == FEAT_DENY && used_feats & FEAT_ALLOW) {
+		pr_warn("xdp-filter is already loaded in allow policy mode. "
+			"Unload before loading in deny mode.\n");
+		return EXIT_FAILURE;
+	} else if (opt->policy_mode == FEAT_ALLOW && used_feats & FEAT_DENY) {
+		pr_warn("xdp-filter is already loaded in deny policy mode. "
+			"Unload before loading in allow mode.\n");
+		return EXIT_FAILURE;
+	}
+	features |= opt->policy_mode;
+
+	/* The prefilter matches the rules against the outer headers */
+	if ((features & FEAT_TUNNEL) &&
+	    (opt->hw_prefilter ||
+	     hw_prefilter_loaded(pin_root_path, opt->iface.ifname))) {
+		pr_warn("The offloaded prefilter can't be combined with the "
+			"tunnel feature.\n");
+		return EXIT_FAILURE;
+	}
+
+	err = get_pinned_program(&opt->iface, pin_root_path, &mode, &old_prog);
+	if (!err && !opt->replace) {
+		pr_warn("xdp-filter is already loaded on %s; "
+			"use --replace to change its features\n",
+			opt->iface.ifname);
+		xdp_program__close(old_prog);
+		return EXIT_FAILURE;
+	} else if (err) {
+		/* Nothing to replace, so just load the program */
+		old_prog = NULL;
+		mode = opt->mode;
+	}
+
+	print_flags(featbuf, sizeof(featbuf), print_features, features);
+	pr_debug("Looking for eBPF program with features %s\n", featbuf);
+
+	filename = find_prog_file(features);
+	if (!filename) {
+		pr_warn("Couldn't find an eBPF program with the requested feature set!\n");
+		return EXIT_FAILURE;
+	}
+
+	pr_debug("Found prog '%s' matching feature set to be loaded on interface '%s'.\n",
+		 filename, opt->iface.ifname);
+
+	if (opt->own_rules) {
+		err = make_dir_subdir(own_parent, opt->iface.ifname);
+		if (err) {
+			pr_warn("Unable to create pin directory: %s\n",
+				strerror(-err));
+			goto out;
+		}
+	}
+
+	/* libbpf spits out a lot of unhelpful error messages while loading.
+	 * Silence the logging so we can provide our own messages instead; this
+	 * is a noop if verbose logging is enabled.
+	 */
+	silence_libbpf_logging();
+
+retry:
+	xdp_opts.find_filename = filename;
+	xdp_opts.opts = &opts;
+	/* prog_name is NULL, so choose the first program in object */
+	p = xdp_program__create(&xdp_opts);
+	err = libxdp_get_error(p);
+	if (err) {
+		if (err == -EPERM && !double_rlimit())
+			goto retry;
+
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		pr_warn("Couldn't load BPF program: %s(%d)\n", errmsg, err);
+		p = NULL;
+		goto out;
+	}
+
+	err = prog_set_features(p, features);
+	if (err)
+		goto out;
+
+	err = prog_set_map_sizes(p, opt, pin_root_path);
+	if (err)
+		goto out;
+
+	/* Replacing keeps the pinned maps, and with them all the rules and
+	 * counters, and never leaves the interface without a filter.
+	 */
+	if (old_prog)
+		err = replace_xdp_program(old_prog, p, &opt->iface, mode,
+					  pin_root_path);
+	else
+		err = attach_xdp_program(p, &opt->iface, mode, pin_root_path);
+	if (err) {
+		if (err == -EPERM && !double_rlimit()) {
+			xdp_program__close(p);
+			goto retry;
+		}
+
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		pr_warn("Couldn't %s XDP program on iface '%s': %s(%d)\n",
+			old_prog ? "replace" : "attach",
+			opt->iface.ifname, errmsg, err);
+		goto out;
+	}
+
+	if (opt->hw_prefilter &&
+	    !hw_prefilter_loaded(pin_root_path, opt->iface.ifname)) {
+		err = hw_prefilter_attach(&opt->iface, pin_root_path);
+		/* Don't leave a fresh load behind without what was asked for */
+		if (err && !old_prog) {
+			detach_xdp_program(p, &opt->iface, mode, pin_root_path);
+			if (!get_used_features(pin_root_path, &used_feats))
+				remove_unused_maps(pin_root_path, used_feats);
+			goto out;
+		}
+	}
+
+	if (!err && old_prog) {
+		err = get_used_features(pin_root_path, &used_feats);
+		if (!err)
+			err = remove_unused_maps(pin_root_path, used_feats);
+	}
+
+	/* The filters start out empty, which only costs full lookups */
+	if (!err && (features & FEAT_BLOOM)) {
+		if (ip_bloom_sync(pin_root_path, AF_INET) ||
+		    ip_bloom_sync(pin_root_path, AF_INET6))
+			pr_warn("Continuing without the bloom filters\n");
+	}
+
+out:
+	if (err && opt->own_rules && !old_prog)
+		remove_own_rules_dirs(pin_root_path);
+	if (p)
+		xdp_program__close(p);
+	if (old_prog)
+		xdp_program__close(old_prog);
+	free(filename);
+	return err;
+}
+
+static int remove_iface_program(const struct iface *iface,
+				struct xdp_program *prog,
+				enum xdp_attach_mode mode, void *arg)
+{
+	char errmsg[STRERR_BUFSIZE], buf[100];
+	char *pin_root_path = arg;
+	__u32 feats;
+	int err;
+
+	feats = get_prog_features(prog);
+	if (!feats) {
+		pr_warn("Unrecognised XDP program on interface %s. Not removing.\n",
+			iface->ifname);
+		return -ENOENT;
 	}
 
 	print_flags(buf, sizeof(buf), print_features, feats);
@@ -450,9 +1039,10 @@ static int remove_iface_program(const struct iface *iface,
 		libxdp_strerror(err, errmsg, sizeof(errmsg));
 		pr_warn("Removing XDP program on iface %s failed (%d): %s\n",
 			iface->ifname, -err, errmsg);
+		return err;
 	}
 
-	return err;
+	return hw_prefilter_detach(iface, pin_root_path);
 }
 
 
@@ -476,19 +1066,62 @@ static struct prog_option unload_options[] = {
 	END_OPTIONS
 };
 
+static int clean_rules(const char *pin_root_path, bool keep)
+{
+	char buf[100];
+	__u32 feats;
+	int err;
+
+	if (keep) {
+		pr_debug("Not removing pinned maps because of --keep-maps option\n");
+		return 0;
+	}
+
+	pr_debug("Checking map usage and removing unused maps\n");
+	err = get_used_features(pin_root_path, &feats);
+	if (err)
+		return err;
+
+	print_flags(buf, sizeof(buf), print_features, feats);
+	pr_debug("Features still being used: %s\n", feats ? buf : "none");
+
+	return remove_unused_maps(pin_root_path, feats);
+}
+
+static int unload_own_rules(const char *ifname, const char *rules_path,
+			    void *arg)
+{
+	const struct unloadopt *opt = arg;
+	int err;
+
+	pr_debug("Removing xdp-filter with its own rules from %s\n", ifname);
+	err = iterate_pinned_programs(rules_path, remove_iface_program,
+				      (void *)rules_path);
+	if (err && err != -ENOENT)
+		return err;
+
+	err = clean_rules(rules_path, opt->keep);
+	if (!err && !opt->keep)
+		remove_own_rules_dirs(rules_path);
+	return err;
+}
+
 int do_unload(const void *cfg, const char *pin_root_path)
 {
 	const struct unloadopt *opt = cfg;
+	bool own_rules = false;
+	char own_path[PATH_MAX];
 	enum xdp_attach_mode mode;
 	struct xdp_program *prog;
 	int err = EXIT_SUCCESS;
-	char buf[100];
-	__u32 feats;
-	DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts,
-			    .pin_root_path = pin_root_path);
 
 	if (opt->all) {
 		pr_debug("Removing xdp-filter from all interfaces\n");
+		err = iterate_own_rules(pin_root_path, unload_own_rules,
+					(void *)opt);
+		if (err)
+			goto out;
+
 		err = iterate_pinned_programs(pin_root_path,
 					      remove_iface_program,
 					      (void *)pin_root_path);
@@ -503,6 +1136,16 @@ int do_unload(const void *cfg, const char *pin_root_path)
 		goto out;
 	}
 
+	err = own_rules_path(own_path, sizeof(own_path), pin_root_path,
+			     opt->iface.ifname);
+	if (err)
+		goto out;
+
+	if (loaded_with_rules(&opt->iface, own_path)) {
+		pin_root_path = own_path;
+		own_rules = true;
+	}
+
 	err = get_pinned_program(&opt->iface, pin_root_path, &mode, &prog);
 	if (err) {
 		pr_warn("xdp-filter is not loaded on %s\n", opt->iface.ifname);
@@ -516,28 +1159,15 @@ int do_unload(const void *cfg, const char *pin_root_path)
 		goto out;
 
 clean_maps:
-	if (opt->keep) {
-		pr_debug("Not removing pinned maps because of --keep-maps option\n");
-		goto out;
-	}
-
-	pr_debug("Checking map usage and removing unused maps\n");
-	err = get_used_features(pin_root_path, &feats);
-	if (err)
-		goto out;
-
-	print_flags(buf, sizeof(buf), print_features, feats);
-	pr_debug("Features still being used: %s\n", feats ? buf : "none");
-
-	err = remove_unused_maps(pin_root_path, feats);
-	if (err)
-		goto out;
+	err = clean_rules(pin_root_path, opt->keep);
+	if (!err && own_rules && !opt->keep)
+		remove_own_rules_dirs(pin_root_path);
 
 out:
 	return err;
 }
 
-int print_ports(int map_fd)
+int print_ports(int map_fd, int counter_fd)
 {
 	__u32 map_key = -1, prev_key = 0;
 	int err;
@@ -549,7 +1179,8 @@ int print_ports(int map_fd)
 		__u64 counter;
 		__u8 flags = 0;
 
-		err = map_get_counter_flags(map_fd, &map_key, &counter, &flags);
+		err = map_get_counter_flags(map_fd, counter_fd, &map_key,
+					    &counter, &flags);
 		if (err == -ENOENT)
 			continue;
 		else if (err)
@@ -568,6 +1199,7 @@ static const struct portopt {
 	__u16 port;
 	bool print_status;
 	bool remove;
+	struct iface rules_iface;
 } defaults_port = {};
 
 static struct prog_option port_options[] = {
@@ -592,13 +1224,17 @@ static struct prog_option port_options[] = {
 	DEFINE_OPTION("status", OPT_BOOL, struct portopt, print_status,
 		      .short_opt = 's',
 		      .help = "Print status of filtered ports after changing"),
+	DEFINE_OPTION("iface", OPT_IFNAME, struct portopt, rules_iface,
+		      .metavar = "<ifname>",
+		      .help = "Use the separate rules of <ifname> (see load --own-rules)"),
 	END_OPTIONS
 };
 
 
 int do_port(const void *cfg, const char *pin_root_path)
 {
-	int map_fd = -1, err = EXIT_SUCCESS;
+	char rules_path[PATH_MAX];
+	int map_fd = -1, counter_fd = -1, err = EXIT_SUCCESS;
 	char modestr[100], protostr[100];
 	const struct portopt *opt = cfg;
 	unsigned int proto = opt->proto;
@@ -608,6 +1244,11 @@ int do_port(const void *cfg, const char *pin_root_path)
 	__u64 counter;
 	__u32 map_key;
 
+	if (select_rules(rules_path, sizeof(rules_path), pin_root_path,
+			 &opt->rules_iface))
+		return EXIT_FAILURE;
+	pin_root_path = rules_path;
+
 	map_fd = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_PORTS), &info);
 	if (map_fd < 0) {
 		pr_warn("Couldn't find port filter map; is xdp-filter loaded "
@@ -617,9 +1258,12 @@ int do_port(const void *cfg, const char *pin_root_path)
 	}
 	pr_debug("Found map with fd %d for map id %d\n", map_fd, info.id);
 
+	counter_fd = get_pinned_map_fd(pin_root_path,
+				       textify(MAP_NAME_PORT_COUNTERS), NULL);
 	map_key = htons(opt->port);
 
-	err = map_get_counter_flags(map_fd, &map_key, &counter, &flags);
+	err = map_get_counter_flags(map_fd, counter_fd, &map_key, &counter,
+				    &flags);
 	if (err && err != -ENOENT)
 		goto out;
 
@@ -648,12 +1292,16 @@ int do_port(const void *cfg, const char *pin_root_path)
 	    !(flags & (MAP_FLAG_TCP | MAP_FLAG_UDP)))
 		flags = 0;
 
-	err = map_set_flags(map_fd, &map_key, flags, false);
+	err = map_set_flags(map_fd, counter_fd, &map_key, flags, false);
+	if (err)
+		goto out;
+
+	err = hw_prefilter_sync(pin_root_path);
 	if (err)
 		goto out;
 
 	if (opt->print_status) {
-		err = print_ports(map_fd);
+		err = print_ports(map_fd, counter_fd);
 		if (err)
 			goto out;
 	}
@@ -661,262 +1309,2740 @@ int do_port(const void *cfg, const char *pin_root_path)
 out:
 	if (map_fd >= 0)
 		close(map_fd);
+	if (counter_fd >= 0)
+		close(counter_fd);
 	return err;
 }
 
-int __print_ips(int map_fd, int af)
+static bool batch_unsupported(int err)
+{
+	/* Kernels before 5.6 don't know about the batch commands at all, and
+	 * some map types (such as LPM tries) don't implement them.
+	 */
+	return err == -EINVAL || err == -ENOTSUPP || err == -EOPNOTSUPP;
+}
+
+static int map_update_batch(int fd, void *keys, void *values, __u32 count,
+			    size_t key_size, size_t value_size, __u64 elem_flags)
 {
-	struct ip_addr map_key = { .af = af }, prev_key = {};
+	DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts, .elem_flags = elem_flags);
+	__u32 i, done = count;
 	int err;
 
-	FOR_EACH_MAP_KEY (err, map_fd, map_key.addr, prev_key.addr) {
-		char flagbuf[100], addrbuf[100];
-		__u8 flags = 0;
-		__u64 counter;
+	err = bpf_map_update_batch(fd, keys, values, &done, &opts);
+	if (!err)
+		return 0;
 
-		err = map_get_counter_flags(map_fd, &map_key.addr, &counter, &flags);
-		if (err == -ENOENT)
-			continue;
-		else if (err)
-			return err;
+	err = -errno;
+	if (!batch_unsupported(err))
+		return err;
 
-		print_flags(flagbuf, sizeof(flagbuf), map_flags_srcdst, flags);
-		print_addr(addrbuf, sizeof(addrbuf), &map_key);
-		printf("  %-40s %-15s  %" PRIu64 "\n", addrbuf, flagbuf,
-		       (uint64_t)counter);
+	for (i = 0; i < count; i++) {
+		if (bpf_map_update_elem(fd, keys + i * key_size,
+					values + i * value_size, elem_flags))
+			return -errno;
 	}
+	return 0;
+}
+
+typedef int (*map_entry_cb)(const void *key, const void *value, void *arg);
+
+static int map_for_each_slow(int fd, size_t key_size, void *key, void *value,
+			     map_entry_cb cb, void *arg)
+{
+	void *prev_key;
+	int err;
+
+	prev_key = calloc(1, key_size);
+	if (!prev_key)
+		return -ENOMEM;
+
+	for (err = bpf_map_get_next_key(fd, NULL, key); !err;
+	     err = bpf_map_get_next_key(fd, prev_key, key)) {
+		memcpy(prev_key, key, key_size);
+
+		if (bpf_map_lookup_elem(fd, key, value))
+			continue;
+
+		err = cb(key, value, arg);
+		if (err)
+			goto out;
+	}
+	err = 0;
+
+out:
+	free(prev_key);
+	return err;
+}
+
+/* Call cb for every entry in a map, reading the map MAP_BATCH_SIZE entries at
+ * a time where the kernel supports it. For per-CPU maps, value_size must cover
+ * the values for all possible CPUs.
+ */
+static int map_for_each(int fd, size_t key_size, size_t value_size,
+			map_entry_cb cb, void *arg)
+{
+	void *keys = NULL, *values = NULL;
+	__u32 batch, count, i;
+	bool first = true;
+	int err = 0, ret;
+
+	keys = calloc(MAP_BATCH_SIZE, key_size);
+	values = calloc(MAP_BATCH_SIZE, value_size);
+	if (!keys || !values) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (;;) {
+		count = MAP_BATCH_SIZE;
+		ret = bpf_map_lookup_batch(fd, first ? NULL : &batch, &batch,
+					   keys, values, &count, NULL);
+		if (ret) {
+			ret = -errno;
+			if (first && batch_unsupported(ret)) {
+				err = map_for_each_slow(fd, key_size, keys,
+							values, cb, arg);
+				goto out;
+			}
+			/* ENOENT means this was the last batch */
+			if (ret != -ENOENT) {
+				err = ret;
+				goto out;
+			}
+		}
+
+		for (i = 0; i < count; i++) {
+			err = cb(keys + i * key_size, values + i * value_size,
+				 arg);
+			if (err)
+				goto out;
+		}
+
+		if (ret)
+			break;
+		first = false;
+	}
+
+out:
+	free(values);
+	free(keys);
+	return err;
+}
+
+/* The prefilter offloaded to the NIC of an interface is kept apart from the
+ * programs directory, which only holds one program per interface: its maps
+ * are pinned beneath hw/<ifname>, and hold copies of the port and ethernet
+ * rules, which the commands changing those rules keep in sync.
+ */
+static int hw_prefilter_path(char *buf, size_t buf_len,
+			     const char *pin_root_path, const char *ifname,
+			     const char *name)
+{
+	if (name)
+		return try_snprintf(buf, buf_len, "%s/%s/%s/%s", pin_root_path,
+				    HW_PREFILTER_DIR, ifname, name);
+	return try_snprintf(buf, buf_len, "%s/%s/%s", pin_root_path,
+			    HW_PREFILTER_DIR, ifname);
+}
+
+static bool hw_prefilter_loaded(const char *pin_root_path, const char *ifname)
+{
+	char path[PATH_MAX];
+
+	return !hw_prefilter_path(path, sizeof(path), pin_root_path, ifname,
+				  NULL) && !access(path, F_OK);
+}
+
+static const struct hw_map {
+	const char *host_name;
+	const char *hw_name;
+	const char *what;
+	size_t key_size;
+} hw_maps[] = {
+	{ textify(MAP_NAME_PORTS), textify(MAP_NAME_HW_PORTS), "port",
+	  sizeof(__u32) },
+	{ textify(MAP_NAME_ETHERNET), textify(MAP_NAME_HW_ETHERNET), "ethernet",
+	  sizeof(struct mac_addr) },
+	{}
+};
+
+struct hw_sync_ctx {
+	int host_fd;
+	int hw_fd;
+	size_t key_size;
+	void *stale;
+	size_t num_stale;
+	unsigned int full;
+};
+
+static int hw_sync_find_stale(const void *key, __unused const void *value,
+			      void *arg)
+{
+	struct hw_sync_ctx *ctx = arg;
+	__u8 flags = 0;
+	void *stale;
+
+	if (ctx->host_fd >= 0 &&
+	    !bpf_map_lookup_elem(ctx->host_fd, key, &flags) &&
+	    (flags & MAP_FLAGS))
+		return 0;
+
+	stale = realloc(ctx->stale, (ctx->num_stale + 1) * ctx->key_size);
+	if (!stale)
+		return -ENOMEM;
+	ctx->stale = stale;
+	memcpy(stale + ctx->num_stale++ * ctx->key_size, key, ctx->key_size);
+	return 0;
+}
+
+static int hw_sync_add(const void *key, const void *value, void *arg)
+{
+	__u8 flags = *(const __u8 *)value & MAP_FLAGS, old = 0;
+	struct hw_sync_ctx *ctx = arg;
+
+	if (!flags)
+		return 0;
+	if (!bpf_map_lookup_elem(ctx->hw_fd, key, &old) && old == flags)
+		return 0;
+
+	if (bpf_map_update_elem(ctx->hw_fd, key, &flags, 0)) {
+		if (errno != E2BIG && errno != ENOSPC)
+			return -errno;
+		ctx->full++;
+	}
+	return 0;
+}
+
+/* Bring the rules in an offloaded map in line with the host map. Reading the
+ * offloaded map goes through the device, so only the rules in use are
+ * touched there, never the whole port range.
+ */
+static int hw_sync_map(const struct hw_map *map, int host_fd, int hw_fd,
+		       const char *ifname)
+{
+	struct hw_sync_ctx ctx = {
+		.host_fd = host_fd,
+		.hw_fd = hw_fd,
+		.key_size = map->key_size,
+	};
+	size_t i;
+	int err;
+
+	/* Deleting while walking the map could restart the walk */
+	err = map_for_each(hw_fd, map->key_size, sizeof(__u8),
+			   hw_sync_find_stale, &ctx);
+	for (i = 0; !err && i < ctx.num_stale; i++) {
+		if (bpf_map_delete_elem(hw_fd, ctx.stale + i * map->key_size) &&
+		    errno != ENOENT)
+			err = -errno;
+	}
+
+	if (!err && host_fd >= 0)
+		err = map_for_each(host_fd, map->key_size, sizeof(__u8),
+				   hw_sync_add, &ctx);
+
+	if (err)
+		pr_warn("Couldn't update offloaded %s rules on %s: %s\n",
+			map->what, ifname, strerror(-err));
+	else if (ctx.full)
+		pr_warn("Offloaded %s rules on %s are full; %u rules are only "
+			"enforced on the host\n", map->what, ifname, ctx.full);
+
+	free(ctx.stale);
+	return err;
+}
+
+static int hw_prefilter_sync_iface(const char *pin_root_path,
+				   const char *ifname)
+{
+	const struct hw_map *map;
+	int host_fd, hw_fd, err = 0;
+	char path[PATH_MAX];
+
+	for (map = hw_maps; map->host_name && !err; map++) {
+		err = hw_prefilter_path(path, sizeof(path), pin_root_path,
+					ifname, map->hw_name);
+		if (err)
+			break;
+
+		hw_fd = bpf_obj_get(path);
+		if (hw_fd < 0) {
+			err = -errno;
+			pr_warn("Couldn't open offloaded map %s: %s\n", path,
+				strerror(-err));
+			break;
+		}
+
+		/* Without the feature, there are no rules to offload */
+		host_fd = get_pinned_map_fd(pin_root_path, map->host_name, NULL);
+		err = hw_sync_map(map, host_fd, hw_fd, ifname);
+
+		if (host_fd >= 0)
+			close(host_fd);
+		close(hw_fd);
+	}
+
+	return err;
+}
+
+static int hw_prefilter_sync(const char *pin_root_path)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	int err;
+	DIR *dr;
+
+	err = try_snprintf(path, sizeof(path), "%s/%s", pin_root_path,
+			   HW_PREFILTER_DIR);
+	if (err)
+		return err;
+
+	dr = opendir(path);
+	if (!dr)
+		return errno == ENOENT ? 0 : -errno;
+
+	while ((de = readdir(dr)) != NULL) {
+		if (!strcmp(".", de->d_name) || !strcmp("..", de->d_name))
+			continue;
+
+		pr_debug("Syncing offloaded rules on %s\n", de->d_name);
+		err = hw_prefilter_sync_iface(pin_root_path, de->d_name);
+		if (err)
+			break;
+	}
+
+	closedir(dr);
+	return err;
+}
+
+static void hw_prefilter_unpin(const char *pin_root_path, const char *ifname)
+{
+	const struct hw_map *map;
+	char path[PATH_MAX];
+
+	for (map = hw_maps; map->host_name; map++) {
+		if (!hw_prefilter_path(path, sizeof(path), pin_root_path,
+				       ifname, map->hw_name))
+			unlink(path);
+	}
+
+	if (!hw_prefilter_path(path, sizeof(path), pin_root_path, ifname, NULL))
+		rmdir(path);
+	if (!try_snprintf(path, sizeof(path), "%s/%s", pin_root_path,
+			  HW_PREFILTER_DIR))
+		rmdir(path); /* only removed once empty */
+}
+
+static int hw_prefilter_detach(const struct iface *iface,
+			       const char *pin_root_path)
+{
+	char errmsg[STRERR_BUFSIZE];
+	struct xdp_program *hw_prog;
+	struct xdp_multiprog *mp;
+	int err = 0;
+
+	if (!hw_prefilter_loaded(pin_root_path, iface->ifname))
+		return 0;
+
+	mp = iface->ifindex ? xdp_multiprog__get_from_ifindex(iface->ifindex) :
+			      NULL;
+	hw_prog = IS_ERR_OR_NULL(mp) ? NULL : xdp_multiprog__hw_prog(mp);
+	if (hw_prog && !strcmp(xdp_program__name(hw_prog), HW_PREFILTER_NAME)) {
+		err = xdp_program__detach(hw_prog, iface->ifindex, XDP_MODE_HW, 0);
+		if (err) {
+			libxdp_strerror(err, errmsg, sizeof(errmsg));
+			pr_warn("Couldn't remove offloaded prefilter from %s: %s\n",
+				iface->ifname, errmsg);
+		}
+	}
+	if (!IS_ERR_OR_NULL(mp))
+		xdp_multiprog__close(mp);
+
+	if (!err) {
+		pr_debug("Removed offloaded prefilter from %s\n", iface->ifname);
+		hw_prefilter_unpin(pin_root_path, iface->ifname);
+	}
+	return err;
+}
+
+static int hw_prefilter_attach(const struct iface *iface,
+			       const char *pin_root_path)
+{
+	DECLARE_LIBXDP_OPTS(xdp_program_opts, xdp_opts,
+			    .find_filename = HW_PREFILTER_FILE);
+	char errmsg[STRERR_BUFSIZE], path[PATH_MAX];
+	const struct hw_map *map;
+	struct xdp_program *p;
+	struct bpf_map *bmap;
+	int err;
+
+	p = xdp_program__create(&xdp_opts);
+	err = libxdp_get_error(p);
+	if (err) {
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		pr_warn("Couldn't open offloaded prefilter: %s\n", errmsg);
+		return err;
+	}
+
+	/* libxdp binds the program and its maps to the device */
+	err = xdp_program__attach(p, iface->ifindex, XDP_MODE_HW, 0);
+	if (err) {
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		pr_warn("Couldn't offload prefilter to %s: %s(%d)\n",
+			iface->ifname, errmsg, err);
+		goto out;
+	}
+
+	err = make_dir_subdir(pin_root_path, HW_PREFILTER_DIR);
+	if (!err)
+		err = hw_prefilter_path(path, sizeof(path), pin_root_path,
+					iface->ifname, NULL);
+	if (!err && mkdir(path, S_IRWXU) && errno != EEXIST)
+		err = -errno;
+	if (err) {
+		pr_warn("Unable to create pin directory: %s\n", strerror(-err));
+		goto err_detach;
+	}
+
+	for (map = hw_maps; map->host_name; map++) {
+		bmap = bpf_object__find_map_by_name(xdp_program__bpf_obj(p),
+						    map->hw_name);
+		err = bmap ? hw_prefilter_path(path, sizeof(path),
+					       pin_root_path, iface->ifname,
+					       map->hw_name) : -ENOENT;
+		if (!err)
+			err = bpf_map__pin(bmap, path);
+		if (err) {
+			pr_warn("Unable to pin offloaded map %s: %s\n",
+				map->hw_name, strerror(-err));
+			goto err_detach;
+		}
+	}
+
+	err = hw_prefilter_sync_iface(pin_root_path, iface->ifname);
+	if (err)
+		goto err_detach;
+
+	pr_debug("Offloaded prefilter to %s\n", iface->ifname);
+out:
+	xdp_program__close(p);
+	return err;
+
+err_detach:
+	xdp_program__detach(p, iface->ifindex, XDP_MODE_HW, 0);
+	hw_prefilter_unpin(pin_root_path, iface->ifname);
+	goto out;
+}
+
+/* Allocator for the ids of the hit counters shared by the IP maps */
+struct counter_ids {
+	unsigned char *used;
+	__u32 next;
+	__u32 max;
+};
+
+static int counter_ids_mark_used(const void *key, __unused const void *value,
+				 void *arg)
+{
+	struct counter_ids *ids = arg;
+	__u32 id = *(const __u32 *)key;
+
+	if (id < ids->max)
+		ids->used[id / 8] |= 1 << (id % 8);
+	return 0;
+}
+
+static int counter_ids_init(struct counter_ids *ids, int counter_fd)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct bpf_map_info info = {};
+	__u32 len = sizeof(info);
+
+	if (nr_cpus < 0)
+		return nr_cpus;
+
+	/* The counter map is sized at load time, see prog_set_map_sizes() */
+	if (bpf_obj_get_info_by_fd(counter_fd, &info, &len))
+		return -errno;
+
+	ids->next = 0;
+	ids->max = info.max_entries;
+	ids->used = calloc(ids->max / 8 + 1, 1);
+	if (!ids->used)
+		return -ENOMEM;
+
+	return map_for_each(counter_fd, sizeof(__u32), nr_cpus * sizeof(__u64),
+			    counter_ids_mark_used, ids);
+}
+
+static int counter_ids_alloc(struct counter_ids *ids, __u32 *id)
+{
+	__u32 i;
+
+	for (i = ids->next; i < ids->max; i++) {
+		if (!(ids->used[i / 8] & (1 << (i % 8)))) {
+			ids->used[i / 8] |= 1 << (i % 8);
+			ids->next = i + 1;
+			*id = i;
+			return 0;
+		}
+	}
+
+	pr_warn("Couldn't add entry: no free hit counters\n");
+	return -E2BIG;
+}
+
+static void counter_ids_release(struct counter_ids *ids, __u32 id)
+{
+	ids->used[id / 8] &= ~(1 << (id % 8));
+	if (id < ids->next)
+		ids->next = id;
+}
+
+static void counter_ids_free(struct counter_ids *ids)
+{
+	free(ids->used);
+	ids->used = NULL;
+}
+
+union ip_lpm_key {
+	struct ipv4_lpm_key v4;
+	struct ipv6_lpm_key v6;
+};
+
+static void lpm_key_from_prefix(union ip_lpm_key *key,
+				const struct ip_prefix *prefix, __u32 mode)
+{
+	memset(key, 0, sizeof(*key));
+
+	/* prefixlen and mode are at the same offsets for both key types */
+	key->v4.prefixlen = LPM_MODE_BITS + prefix->prefixlen;
+	key->v4.mode = mode;
+
+	if (prefix->addr.af == AF_INET6)
+		key->v6.addr = prefix->addr.addr.addr6;
+	else
+		key->v4.addr = prefix->addr.addr.addr4.s_addr;
+}
+
+static void lpm_key_to_prefix(const union ip_lpm_key *key, int af,
+			      struct ip_prefix *prefix)
+{
+	memset(prefix, 0, sizeof(*prefix));
+	prefix->addr.af = af;
+	prefix->prefixlen = key->v4.prefixlen - LPM_MODE_BITS;
+
+	if (af == AF_INET6)
+		prefix->addr.addr.addr6 = key->v6.addr;
+	else
+		prefix->addr.addr.addr4.s_addr = key->v4.addr;
+}
+
+/* The IP rule tries are reached through a single-entry map-in-map, so that a
+ * complete new rule set can be switched in atomically.
+ */
+static int ip_rules_get_fd(int outer_fd)
+{
+	__u32 key = 0, map_id;
+	int fd;
+
+	if (bpf_map_lookup_elem(outer_fd, &key, &map_id))
+		return -errno;
+
+	fd = bpf_map_get_fd_by_id(map_id);
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+}
+
+static int open_ip_rules(const char *pin_root_path, const char *map_name)
+{
+	int outer_fd, fd;
+
+	outer_fd = get_pinned_map_fd(pin_root_path, map_name, NULL);
+	if (outer_fd < 0)
+		return outer_fd;
+
+	fd = ip_rules_get_fd(outer_fd);
+	if (fd < 0)
+		pr_warn("Couldn't get rule set from map %s: %s\n", map_name,
+			strerror(-fd));
+
+	close(outer_fd);
+	return fd;
+}
+
+static int create_map_like(int map_fd)
+{
+	struct bpf_map_info info = {};
+	__u32 len = sizeof(info);
+#ifdef HAVE_LIBBPF_BPF_MAP_CREATE
+	DECLARE_LIBBPF_OPTS(bpf_map_create_opts, opts);
+#else
+	struct bpf_create_map_attr map_attr = {};
+#endif
+	int fd;
+
+	if (bpf_obj_get_info_by_fd(map_fd, &info, &len))
+		return -errno;
+
+#ifdef HAVE_LIBBPF_BPF_MAP_CREATE
+	opts.map_flags = info.map_flags;
+	fd = bpf_map_create(info.type, info.name, info.key_size,
+			    info.value_size, info.max_entries, &opts);
+#else
+	map_attr.name = info.name;
+	map_attr.map_type = info.type;
+	map_attr.map_flags = info.map_flags;
+	map_attr.key_size = info.key_size;
+	map_attr.value_size = info.value_size;
+	map_attr.max_entries = info.max_entries;
+	fd = bpf_create_map_xattr(&map_attr);
+#endif
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+}
+
+static int ip_counter_create(int counter_fd, __u32 *id)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct counter_ids ids = {};
+	__u64 *values = NULL;
+	int err;
+
+	if (nr_cpus < 0)
+		return nr_cpus;
+
+	values = calloc(nr_cpus, sizeof(*values));
+	if (!values)
+		return -ENOMEM;
+
+	err = counter_ids_init(&ids, counter_fd);
+	if (err)
+		goto out;
+
+	err = counter_ids_alloc(&ids, id);
+	if (err)
+		goto out;
+
+	err = bpf_map_update_elem(counter_fd, id, values, BPF_NOEXIST);
+	if (err) {
+		err = -errno;
+		pr_warn("Unable to create hit counter: %s\n", strerror(-err));
+		goto out;
+	}
+
+out:
+	counter_ids_free(&ids);
+	free(values);
+	return err;
+}
+
+/* A lookup in an LPM trie returns the longest matching prefix, so check that
+ * the entry found is actually the one for this prefix.
+ */
+static int lpm_get_exact(int map_fd, union ip_lpm_key *key,
+			 struct ip_lpm_val *value)
+{
+	if (bpf_map_lookup_elem(map_fd, key, value))
+		return -ENOENT;
+
+	if (value->prefixlen != key->v4.prefixlen - LPM_MODE_BITS)
+		return -ENOENT;
+
+	return 0;
+}
+
+static int lpm_add_prefix(int map_fd, int counter_fd, union ip_lpm_key *key)
+{
+	struct ip_lpm_val value = {
+		.prefixlen = key->v4.prefixlen - LPM_MODE_BITS,
+	};
+	int err;
+
+	if (!lpm_get_exact(map_fd, key, &value))
+		return 0;
+
+	err = ip_counter_create(counter_fd, &value.counter_id);
+	if (err)
+		return err;
+
+	err = bpf_map_update_elem(map_fd, key, &value, BPF_NOEXIST);
+	if (err) {
+		err = -errno;
+		bpf_map_delete_elem(counter_fd, &value.counter_id);
+
+		if (err == -ENOSPC || err == -E2BIG)
+			pr_warn("Couldn't add entry: state map is full\n");
+		else
+			pr_warn("Unable to update state map: %s\n",
+				strerror(-err));
+	}
+
+	return err;
+}
+
+static int lpm_del_prefix(int map_fd, int counter_fd, union ip_lpm_key *key)
+{
+	struct ip_lpm_val value;
+	int err;
+
+	if (lpm_get_exact(map_fd, key, &value)) {
+		pr_debug("Prefix not in state map, nothing to remove\n");
+		return 0;
+	}
+
+	err = bpf_map_delete_elem(map_fd, key);
+	if (err) {
+		err = -errno;
+		pr_warn("Couldn't delete value from state map: %s\n",
+			strerror(-err));
+		return err;
+	}
+
+	bpf_map_delete_elem(counter_fd, &value.counter_id);
+	return 0;
+}
+
+union ip_bloom_key {
+	struct ipv4_bloom_key v4;
+	struct ipv6_bloom_key v6;
+};
+
+/* Cut a rule down to the prefix length of the bloom filter, which rules
+ * shorter than that can't be put in.
+ */
+static int ip_bloom_key_from_lpm(union ip_bloom_key *bkey,
+				 const union ip_lpm_key *key, int af)
+{
+	unsigned int plen, len, i;
+	__u8 *addr;
+
+	memset(bkey, 0, sizeof(*bkey));
+	bkey->v4.mode = key->v4.mode;
+	if (af == AF_INET6) {
+		plen = BLOOM_PREFIXLEN_V6;
+		bkey->v6.addr = key->v6.addr;
+		addr = bkey->v6.addr.s6_addr;
+		len = sizeof(bkey->v6.addr);
+	} else {
+		plen = BLOOM_PREFIXLEN_V4;
+		bkey->v4.addr = key->v4.addr;
+		addr = (__u8 *)&bkey->v4.addr;
+		len = sizeof(bkey->v4.addr);
+	}
+
+	if (key->v4.prefixlen - LPM_MODE_BITS < plen)
+		return -ERANGE;
+
+	for (i = 0; i < len; i++) {
+		if (i * 8 >= plen)
+			addr[i] = 0;
+		else if (plen - i * 8 < 8)
+			addr[i] &= 0xff << (8 - (plen - i * 8));
+	}
+	return 0;
+}
+
+static const char *ip_bloom_map_name(int af)
+{
+	return af == AF_INET6 ? textify(MAP_NAME_IPV6_BLOOM) :
+				textify(MAP_NAME_IPV4_BLOOM);
+}
+
+static int ip_bloom_create(int af, __u32 max_entries)
+{
+	__u32 value_size = af == AF_INET6 ? sizeof(struct ipv6_bloom_key) :
+					    sizeof(struct ipv4_bloom_key);
+#ifndef HAVE_LIBBPF_BPF_MAP_CREATE
+	struct bpf_create_map_attr map_attr = {};
+#endif
+	int fd;
+
+#ifdef HAVE_LIBBPF_BPF_MAP_CREATE
+	fd = bpf_map_create(BPF_MAP_TYPE_BLOOM_FILTER, "filter_ip_bloom", 0,
+			    value_size, max_entries, NULL);
+#else
+	map_attr.name = "filter_ip_bloom";
+	map_attr.map_type = BPF_MAP_TYPE_BLOOM_FILTER;
+	map_attr.value_size = value_size;
+	map_attr.max_entries = max_entries;
+	fd = bpf_create_map_xattr(&map_attr);
+#endif
+	if (fd < 0)
+		return -errno;
+
+	return fd;
+}
+
+/* Empty the slot of the filter, so the datapath does full lookups */
+static int ip_bloom_disable(int outer_fd)
+{
+	__u32 key = 0;
+
+	if (bpf_map_delete_elem(outer_fd, &key) && errno != ENOENT)
+		return -errno;
+	return 0;
+}
+
+/* Entries can't be removed from a bloom filter, and a rule missing from it
+ * would be skipped by the datapath. So rules are put in before they go into
+ * the trie, and the filter is rebuilt from scratch after rules go away or a
+ * whole rule set is swapped in.
+ */
+static int ip_bloom_add(const char *pin_root_path, int af,
+			const union ip_lpm_key *key)
+{
+	union ip_bloom_key bkey;
+	int outer_fd, fd, err = 0;
+
+	outer_fd = get_pinned_map_fd(pin_root_path, ip_bloom_map_name(af),
+				     NULL);
+	if (outer_fd < 0)
+		return 0;
+
+	if (ip_bloom_key_from_lpm(&bkey, key, af)) {
+		pr_debug("Prefix is too short for the bloom filter, "
+			 "disabling it\n");
+		err = ip_bloom_disable(outer_fd);
+		goto out;
+	}
+
+	/* Nothing to do if the filter is not in use */
+	fd = ip_rules_get_fd(outer_fd);
+	if (fd < 0)
+		goto out;
+
+	if (bpf_map_update_elem(fd, NULL, &bkey, BPF_ANY))
+		err = -errno;
+	close(fd);
+
+out:
+	if (err)
+		pr_warn("Couldn't update bloom filter: %s\n", strerror(-err));
+	close(outer_fd);
+	return err;
+}
+
+struct ip_bloom_fill {
+	int fd;
+	int af;
+	bool too_short;
+};
+
+static int ip_bloom_fill_rule(const void *key, __unused const void *value,
+			      void *arg)
+{
+	struct ip_bloom_fill *fill = arg;
+	union ip_bloom_key bkey;
+
+	if (ip_bloom_key_from_lpm(&bkey, key, fill->af)) {
+		fill->too_short = true;
+		return -ERANGE;
+	}
+
+	if (bpf_map_update_elem(fill->fd, NULL, &bkey, BPF_ANY))
+		return -errno;
+	return 0;
+}
+
+static int ip_bloom_sync(const char *pin_root_path, int af)
+{
+	struct ip_bloom_fill fill = { .fd = -1, .af = af };
+	int outer_fd, rules_fd = -1, err;
+	struct bpf_map_info info = {};
+	__u32 len = sizeof(info);
+	__u32 key = 0;
+
+	outer_fd = get_pinned_map_fd(pin_root_path, ip_bloom_map_name(af),
+				     NULL);
+	if (outer_fd < 0)
+		return 0;
+
+	rules_fd = open_ip_rules(pin_root_path,
+				 af == AF_INET6 ? textify(MAP_NAME_IPV6) :
+						  textify(MAP_NAME_IPV4));
+	if (rules_fd < 0) {
+		err = rules_fd;
+		goto out;
+	}
+
+	if (bpf_obj_get_info_by_fd(rules_fd, &info, &len)) {
+		err = -errno;
+		goto out;
+	}
+
+	fill.fd = ip_bloom_create(af, info.max_entries);
+	if (fill.fd < 0) {
+		err = fill.fd;
+		goto out;
+	}
+
+	err = map_for_each(rules_fd, info.key_size, info.value_size,
+			   ip_bloom_fill_rule, &fill);
+	if (fill.too_short) {
+		pr_debug("Rule set has prefixes shorter than /%u, not using "
+			 "the bloom filter\n",
+			 af == AF_INET6 ? BLOOM_PREFIXLEN_V6 : BLOOM_PREFIXLEN_V4);
+		err = ip_bloom_disable(outer_fd);
+		goto out;
+	}
+
+	if (!err && bpf_map_update_elem(outer_fd, &key, &fill.fd, 0))
+		err = -errno;
+
+out:
+	if (err)
+		pr_warn("Couldn't rebuild bloom filter: %s\n", strerror(-err));
+	if (fill.fd >= 0)
+		close(fill.fd);
+	if (rules_fd >= 0)
+		close(rules_fd);
+	close(outer_fd);
+	return err;
+}
+
+int __print_ips(int map_fd, int counter_fd, int af)
+{
+	union ip_lpm_key map_key = {}, prev_key = {};
+	int err;
+
+	FOR_EACH_MAP_KEY (err, map_fd, map_key, prev_key) {
+		char flagbuf[100], addrbuf[100];
+		struct ip_lpm_val value;
+		struct ip_prefix prefix;
+		__u64 counter = 0;
+
+		if (lpm_get_exact(map_fd, &map_key, &value))
+			continue;
+
+		err = map_get_counter(counter_fd, &value.counter_id, &counter);
+		if (err && err != -ENOENT)
+			return err;
+
+		lpm_key_to_prefix(&map_key, af, &prefix);
+		print_flags(flagbuf, sizeof(flagbuf), map_flags_srcdst,
+			    map_key.v4.mode);
+		print_prefix(addrbuf, sizeof(addrbuf), &prefix);
+		printf("  %-40s %-15s  %" PRIu64 "\n", addrbuf, flagbuf,
+		       (uint64_t)counter);
+	}
+
+	return 0;
+}
+
+int print_ips()
+{
+	int map_fd4 = -1, map_fd6 = -1, counter_fd = -1;
+	char pin_root_path[PATH_MAX];
+	int err = 0;
+
+	err = get_bpf_root_dir(pin_root_path, sizeof(pin_root_path), PROG_NAME,
+			       true);
+	if (err)
+		goto out;
+
+	map_fd6 = open_ip_rules(pin_root_path, textify(MAP_NAME_IPV6));
+	map_fd4 = open_ip_rules(pin_root_path, textify(MAP_NAME_IPV4));
+	if (map_fd4 < 0 && map_fd6 < 0) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	counter_fd = get_pinned_map_fd(pin_root_path,
+				       textify(MAP_NAME_IP_COUNTERS), NULL);
+	if (counter_fd < 0) {
+		err = counter_fd;
+		goto out;
+	}
+
+	printf("Filtered IP addresses:\n");
+	printf("  %-40s Mode             Hit counter\n", "");
+
+	if (map_fd6 >= 0) {
+		err = __print_ips(map_fd6, counter_fd, AF_INET6);
+		if (err)
+			goto out;
+	}
+
+	if (map_fd4 >= 0)
+		err = __print_ips(map_fd4, counter_fd, AF_INET);
+
+out:
+	if (map_fd4 >= 0)
+		close(map_fd4);
+	if (map_fd6 >= 0)
+		close(map_fd6);
+	if (counter_fd >= 0)
+		close(counter_fd);
+	return err;
+}
+
+
+static int __do_address(const char *pin_root_path,
+			const char *map_name, const char *feat_name,
+			int counter_fd, void *map_key, bool remove, int mode)
+{
+	int map_fd = -1, err = 0;
+	__u8 flags = 0;
+	__u64 counter;
+
+	map_fd = get_pinned_map_fd(pin_root_path, map_name, NULL);
+	if (map_fd < 0) {
+		pr_warn("Couldn't find filter map; is xdp-filter loaded "
+			"with the %s feature?\n", feat_name);
+		err = -ENOENT;
+		goto out;
+	}
+
+	err = map_get_counter_flags(map_fd, counter_fd, map_key, &counter,
+				    &flags);
+	if (err && err != -ENOENT)
+		goto out;
+
+	if (remove)
+		flags &= ~mode;
+	else
+		flags |= mode;
+
+	err = map_set_flags(map_fd, counter_fd, map_key, flags, true);
+	if (err)
+		goto out;
+
+out:
+	return err ?: map_fd;
+}
+
+static const struct ipopt {
+	unsigned int mode;
+	struct ip_prefix addr;
+	bool print_status;
+	bool remove;
+	struct iface rules_iface;
+} defaults_ip = {
+	.mode = MAP_FLAG_DST,
+};
+
+static struct prog_option ip_options[] = {
+	DEFINE_OPTION("addr", OPT_IPPREFIX, struct ipopt, addr,
+		      .positional = true,
+		      .metavar = "<addr>",
+		      .required = true,
+		      .help = "Address or prefix to add or remove"),
+	DEFINE_OPTION("remove", OPT_BOOL, struct ipopt, remove,
+		      .short_opt = 'r',
+		      .help = "Remove address instead of adding"),
+	DEFINE_OPTION("mode", OPT_FLAGS, struct ipopt, mode,
+		      .short_opt = 'm',
+		      .metavar = "<mode>",
+		      .typearg = map_flags_srcdst,
+		      .help = "Filter mode; default dst"),
+	DEFINE_OPTION("status", OPT_BOOL, struct ipopt, print_status,
+		      .short_opt = 's',
+		      .help = "Print status of filtered addresses after changing"),
+	DEFINE_OPTION("iface", OPT_IFNAME, struct ipopt, rules_iface,
+		      .metavar = "<ifname>",
+		      .help = "Use the separate rules of <ifname> (see load --own-rules)"),
+	END_OPTIONS
+};
+
+static int do_ip(const void *cfg, const char *pin_root_path)
+{
+	char rules_path[PATH_MAX];
+	int map_fd = -1, counter_fd = -1, err = EXIT_SUCCESS;
+	char modestr[100], addrstr[100];
+	const struct ipopt *opt = cfg;
+	const struct flag_val *mode;
+	bool v6;
+
+	if (select_rules(rules_path, sizeof(rules_path), pin_root_path,
+			 &opt->rules_iface))
+		return EXIT_FAILURE;
+	pin_root_path = rules_path;
+
+	print_flags(modestr, sizeof(modestr), map_flags_srcdst, opt->mode);
+	print_prefix(addrstr, sizeof(addrstr), &opt->addr);
+	pr_debug("%s addr %s mode %s\n", opt->remove ? "Removing" : "Adding",
+		 addrstr, modestr);
+
+	v6 = (opt->addr.addr.af == AF_INET6);
+
+	map_fd = open_ip_rules(pin_root_path,
+			       v6 ? textify(MAP_NAME_IPV6) : textify(MAP_NAME_IPV4));
+	counter_fd = get_pinned_map_fd(pin_root_path,
+				       textify(MAP_NAME_IP_COUNTERS), NULL);
+	if (map_fd < 0 || counter_fd < 0) {
+		pr_warn("Couldn't find filter map; is xdp-filter loaded "
+			"with the %s feature?\n", v6 ? "ipv6" : "ipv4");
+		err = -ENOENT;
+		goto out;
+	}
+
+	/* Source and destination rules are separate entries in the trie */
+	for (mode = map_flags_srcdst; mode->flagstring; mode++) {
+		union ip_lpm_key key;
+
+		if (!(opt->mode & mode->flagval))
+			continue;
+
+		lpm_key_from_prefix(&key, &opt->addr, mode->flagval);
+		if (opt->remove) {
+			err = lpm_del_prefix(map_fd, counter_fd, &key);
+		} else {
+			err = ip_bloom_add(pin_root_path, opt->addr.addr.af,
+					   &key);
+			err = err ?: lpm_add_prefix(map_fd, counter_fd, &key);
+		}
+		if (err)
+			goto out;
+	}
+
+	if (opt->remove) {
+		err = ip_bloom_sync(pin_root_path, opt->addr.addr.af);
+		if (err)
+			goto out;
+	}
+
+	if (opt->print_status) {
+		err = print_ips();
+		if (err)
+			goto out;
+	}
+
+out:
+	if (map_fd >= 0)
+		close(map_fd);
+	if (counter_fd >= 0)
+		close(counter_fd);
+	return err;
+}
+
+int print_ethers(int map_fd, int counter_fd)
+{
+	struct mac_addr map_key = {}, prev_key = {};
+	int err;
+
+	printf("Filtered MAC addresses:\n");
+	printf("  %-40s Mode             Hit counter\n", "");
+	FOR_EACH_MAP_KEY (err, map_fd, map_key, prev_key) {
+		char modebuf[100], addrbuf[100];
+		__u8 flags = 0;
+		__u64 counter;
+
+		err = map_get_counter_flags(map_fd, counter_fd, &map_key,
+					    &counter, &flags);
+		if (err == -ENOENT)
+			continue;
+		else if (err)
+			return err;
+
+		print_flags(modebuf, sizeof(modebuf), map_flags_srcdst, flags);
+		print_macaddr(addrbuf, sizeof(addrbuf), &map_key);
+		printf("  %-40s %-15s  %" PRIu64 "\n", addrbuf, modebuf,
+		       (uint64_t)counter);
+	}
+	return 0;
+}
+
+static const struct etheropt {
+	unsigned int mode;
+	struct mac_addr addr;
+	bool print_status;
+	bool remove;
+	struct iface rules_iface;
+} defaults_ether = {
+	.mode = MAP_FLAG_DST,
+};
+
+static struct prog_option ether_options[] = {
+	DEFINE_OPTION("addr", OPT_MACADDR, struct etheropt, addr,
+		      .positional = true,
+		      .metavar = "<addr>",
+		      .required = true,
+		      .help = "Address to add or remove"),
+	DEFINE_OPTION("remove", OPT_BOOL, struct etheropt, remove,
+		      .short_opt = 'r',
+		      .help = "Remove address instead of adding"),
+	DEFINE_OPTION("mode", OPT_FLAGS, struct etheropt, mode,
+		      .short_opt = 'm',
+		      .metavar = "<mode>",
+		      .typearg = map_flags_srcdst,
+		      .help = "Filter mode; default dst"),
+	DEFINE_OPTION("status", OPT_BOOL, struct etheropt, print_status,
+		      .short_opt = 's',
+		      .help = "Print status of filtered addresses after changing"),
+	DEFINE_OPTION("iface", OPT_IFNAME, struct etheropt, rules_iface,
+		      .metavar = "<ifname>",
+		      .help = "Use the separate rules of <ifname> (see load --own-rules)"),
+	END_OPTIONS
+};
+
+static int do_ether(const void *cfg, const char *pin_root_path)
+{
+	char rules_path[PATH_MAX];
+	int err = EXIT_SUCCESS, map_fd = -1, counter_fd;
+	const struct etheropt *opt = cfg;
+	struct mac_addr addr = opt->addr;
+	char modestr[100], addrstr[100];
+
+	if (select_rules(rules_path, sizeof(rules_path), pin_root_path,
+			 &opt->rules_iface))
+		return EXIT_FAILURE;
+	pin_root_path = rules_path;
+
+	print_flags(modestr, sizeof(modestr), map_flags_srcdst, opt->mode);
+	print_macaddr(addrstr, sizeof(addrstr), &opt->addr);
+	pr_debug("%s addr %s mode %s\n", opt->remove ? "Removing" : "Adding",
+		 addrstr, modestr);
+
+	counter_fd = get_pinned_map_fd(pin_root_path,
+				       textify(MAP_NAME_ETHERNET_COUNTERS), NULL);
+	map_fd = __do_address(pin_root_path, textify(MAP_NAME_ETHERNET),
+			      "ethernet", counter_fd, &addr.addr, opt->remove,
+			      opt->mode);
+	if (map_fd < 0) {
+		err = map_fd;
+		goto out;
+	}
+
+	err = hw_prefilter_sync(pin_root_path);
+	if (err)
+		goto out;
+
+	if (opt->print_status) {
+		err = print_ethers(map_fd, counter_fd);
+		if (err)
+			goto out;
+	}
+
+out:
+	if (map_fd >= 0)
+		close(map_fd);
+	if (counter_fd >= 0)
+		close(counter_fd);
+	return err;
+}
+
+static void flow_addr_from_ip(struct in6_addr *addr, const struct ip_addr *ip)
+{
+	if (ip->af == AF_INET6) {
+		*addr = ip->addr.addr6;
+		return;
+	}
+
+	/* IPv4 addresses are stored as IPv4-mapped IPv6 addresses */
+	memset(addr, 0, sizeof(*addr));
+	addr->s6_addr[10] = 0xff;
+	addr->s6_addr[11] = 0xff;
+	memcpy(&addr->s6_addr[12], &ip->addr.addr4, sizeof(ip->addr.addr4));
+}
+
+static void flow_addr_to_ip(struct ip_addr *ip, const struct in6_addr *addr)
+{
+	if (IN6_IS_ADDR_V4MAPPED(addr)) {
+		ip->af = AF_INET;
+		memcpy(&ip->addr.addr4, &addr->s6_addr[12],
+		       sizeof(ip->addr.addr4));
+	} else {
+		ip->af = AF_INET6;
+		ip->addr.addr6 = *addr;
+	}
+}
+
+static int flow_key_init(struct flow_key *key, const struct ip_addr *src,
+			 const struct ip_addr *dst, __u16 sport, __u16 dport)
+{
+	memset(key, 0, sizeof(*key));
+
+	if (src->af && dst->af && src->af != dst->af) {
+		pr_warn("Source and destination addresses must be of the same "
+			"address family\n");
+		return -EINVAL;
+	}
+
+	if (src->af) {
+		key->fields |= FLOW_FIELD_SADDR;
+		flow_addr_from_ip(&key->saddr, src);
+	}
+	if (dst->af) {
+		key->fields |= FLOW_FIELD_DADDR;
+		flow_addr_from_ip(&key->daddr, dst);
+	}
+	if (sport) {
+		key->fields |= FLOW_FIELD_SPORT;
+		key->sport = htons(sport);
+	}
+	if (dport) {
+		key->fields |= FLOW_FIELD_DPORT;
+		key->dport = htons(dport);
+	}
+
+	if (!key->fields) {
+		pr_warn("A flow rule needs at least one address or port\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Flows are written as a comma-separated list of fields, e.g.
+ * src=10.0.0.1,dport=22; this is used both for output and in rule files.
+ */
+static int parse_flow(char *spec, struct flow_key *key)
+{
+	struct ip_addr src = {}, dst = {};
+	char *saveptr = NULL, *field;
+	__u16 sport = 0, dport = 0;
+	int err;
+
+	for (field = strtok_r(spec, ",", &saveptr); field;
+	     field = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(field, '=');
+
+		if (!value)
+			return -EINVAL;
+		*value++ = '\0';
+
+		if (!strcmp(field, "src"))
+			err = parse_option_value(OPT_IPADDR, value, &src, NULL);
+		else if (!strcmp(field, "dst"))
+			err = parse_option_value(OPT_IPADDR, value, &dst, NULL);
+		else if (!strcmp(field, "sport"))
+			err = parse_option_value(OPT_U16, value, &sport, NULL);
+		else if (!strcmp(field, "dport"))
+			err = parse_option_value(OPT_U16, value, &dport, NULL);
+		else
+			err = -EINVAL;
+		if (err)
+			return err;
+	}
+
+	return flow_key_init(key, &src, &dst, sport, dport);
+}
+
+static void print_flow(char *buf, size_t buf_len, const struct flow_key *key)
+{
+	char addrbuf[INET6_ADDRSTRLEN];
+	struct ip_addr addr;
+	size_t len = 0;
+
+	buf[0] = '\0';
+	if (key->fields & FLOW_FIELD_SADDR) {
+		flow_addr_to_ip(&addr, &key->saddr);
+		print_addr(addrbuf, sizeof(addrbuf), &addr);
+		len += snprintf(buf + len, buf_len - len, "src=%s,", addrbuf);
+	}
+	if (key->fields & FLOW_FIELD_DADDR && len < buf_len) {
+		flow_addr_to_ip(&addr, &key->daddr);
+		print_addr(addrbuf, sizeof(addrbuf), &addr);
+		len += snprintf(buf + len, buf_len - len, "dst=%s,", addrbuf);
+	}
+	if (key->fields & FLOW_FIELD_SPORT && len < buf_len)
+		len += snprintf(buf + len, buf_len - len, "sport=%u,",
+				ntohs(key->sport));
+	if (key->fields & FLOW_FIELD_DPORT && len < buf_len)
+		len += snprintf(buf + len, buf_len - len, "dport=%u,",
+				ntohs(key->dport));
+
+	/* Strip the trailing comma */
+	if (len && len <= buf_len)
+		buf[len - 1] = '\0';
+}
+
+static int update_flow_masks(const char *pin_root_path)
+{
+	struct flow_key map_key = {}, prev_key = {};
+	int map_fd, masks_fd, err = 0;
+	__u32 masks = 0, zero = 0;
+
+	map_fd = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_FLOWS), NULL);
+	if (map_fd < 0)
+		return 0;
+
+	masks_fd = get_pinned_map_fd(pin_root_path,
+				     textify(MAP_NAME_FLOW_MASKS), NULL);
+	if (masks_fd < 0) {
+		err = masks_fd;
+		goto out;
+	}
+
+	/* The datapath only looks up the field combinations marked here */
+	FOR_EACH_MAP_KEY (err, map_fd, map_key, prev_key)
+		masks |= 1U << (map_key.fields & FLOW_FIELDS_ALL);
+
+	err = 0;
+	if (bpf_map_update_elem(masks_fd, &zero, &masks, 0)) {
+		err = -errno;
+		pr_warn("Unable to update flow masks: %s\n", strerror(-err));
+	}
+
+	close(masks_fd);
+out:
+	close(map_fd);
+	return err;
+}
+
+int print_flows(int map_fd, int counter_fd)
+{
+	struct flow_key map_key = {}, prev_key = {};
+	int err;
+
+	printf("Filtered flows:\n");
+	printf("  %-40s Mode             Hit counter\n", "");
+	FOR_EACH_MAP_KEY (err, map_fd, map_key, prev_key) {
+		char flowbuf[200], protobuf[100];
+		__u8 flags = 0;
+		__u64 counter;
+
+		err = map_get_counter_flags(map_fd, counter_fd, &map_key,
+					    &counter, &flags);
+		if (err == -ENOENT)
+			continue;
+		else if (err)
+			return err;
+
+		print_flags(protobuf, sizeof(protobuf), map_flags_tcpudp, flags);
+		print_flow(flowbuf, sizeof(flowbuf), &map_key);
+		printf("  %-40s %-15s  %" PRIu64 "\n", flowbuf, protobuf,
+		       (uint64_t)counter);
+	}
+	return 0;
+}
+
+int print_conntrack(int map_fd)
+{
+	struct flow_key map_key = {}, prev_key = {};
+	size_t active = 0, total = 0;
+	struct timespec ts;
+	__u64 now;
+	int err;
+
+	/* The datapath timestamps come from bpf_ktime_get_ns() */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	FOR_EACH_MAP_KEY (err, map_fd, map_key, prev_key) {
+		__u64 last_seen;
+
+		if (bpf_map_lookup_elem(map_fd, &map_key, &last_seen))
+			continue;
+
+		total++;
+		if (now - last_seen <= CT_TIMEOUT_NS)
+			active++;
+	}
+
+	printf("Connection tracking:\n");
+	printf("  %-40s %zu\n", "Established connections", active);
+	printf("  %-40s %zu\n", "Expired entries", total - active);
+	return 0;
+}
+
+static const struct flowopt {
+	struct ip_addr src;
+	struct ip_addr dst;
+	__u16 sport;
+	__u16 dport;
+	unsigned int proto;
+	bool print_status;
+	bool remove;
+	struct iface rules_iface;
+} defaults_flow = {};
+
+static struct prog_option flow_options[] = {
+	DEFINE_OPTION("src", OPT_IPADDR, struct flowopt, src,
+		      .metavar = "<addr>",
+		      .help = "Source address to match"),
+	DEFINE_OPTION("dst", OPT_IPADDR, struct flowopt, dst,
+		      .metavar = "<addr>",
+		      .help = "Destination address to match"),
+	DEFINE_OPTION("sport", OPT_U16, struct flowopt, sport,
+		      .metavar = "<port>",
+		      .help = "Source port to match"),
+	DEFINE_OPTION("dport", OPT_U16, struct flowopt, dport,
+		      .metavar = "<port>",
+		      .help = "Destination port to match"),
+	DEFINE_OPTION("proto", OPT_FLAGS, struct flowopt, proto,
+		      .short_opt = 'p',
+		      .metavar = "<proto>",
+		      .typearg = map_flags_tcpudp,
+		      .help = "Protocol to filter; default tcp,udp"),
+	DEFINE_OPTION("remove", OPT_BOOL, struct flowopt, remove,
+		      .short_opt = 'r',
+		      .help = "Remove flow instead of adding"),
+	DEFINE_OPTION("status", OPT_BOOL, struct flowopt, print_status,
+		      .short_opt = 's',
+		      .help = "Print status of filtered flows after changing"),
+	DEFINE_OPTION("iface", OPT_IFNAME, struct flowopt, rules_iface,
+		      .metavar = "<ifname>",
+		      .help = "Use the separate rules of <ifname> (see load --own-rules)"),
+	END_OPTIONS
+};
+
+static int do_flow(const void *cfg, const char *pin_root_path)
+{
+	char rules_path[PATH_MAX];
+	int map_fd = -1, counter_fd = -1, err = EXIT_SUCCESS;
+	char flowstr[200], protostr[100];
+	const struct flowopt *opt = cfg;
+	unsigned int proto = opt->proto;
+	struct flow_key key;
+	__u8 flags = 0;
+	__u64 counter;
+
+	if (select_rules(rules_path, sizeof(rules_path), pin_root_path,
+			 &opt->rules_iface))
+		return EXIT_FAILURE;
+	pin_root_path = rules_path;
+
+	err = flow_key_init(&key, &opt->src, &opt->dst, opt->sport, opt->dport);
+	if (err)
+		goto out;
+
+	map_fd = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_FLOWS), NULL);
+	if (map_fd < 0) {
+		pr_warn("Couldn't find flow filter map; is xdp-filter loaded "
+			"with the flow feature?\n");
+		err = EXIT_FAILURE;
+		goto out;
+	}
+
+	counter_fd = get_pinned_map_fd(pin_root_path,
+				       textify(MAP_NAME_FLOW_COUNTERS), NULL);
+
+	if (proto == 0)
+		proto = MAP_FLAG_TCP | MAP_FLAG_UDP;
+
+	print_flow(flowstr, sizeof(flowstr), &key);
+	print_flags(protostr, sizeof(protostr), map_flags_tcpudp, proto);
+	pr_debug("%s %s flow %s\n", opt->remove ? "Removing" : "Adding",
+		 protostr, flowstr);
+
+	err = map_get_counter_flags(map_fd, counter_fd, &key, &counter, &flags);
+	if (err && err != -ENOENT)
+		goto out;
+
+	if (opt->remove)
+		flags &= ~proto;
+	else
+		flags |= proto;
+
+	err = map_set_flags(map_fd, counter_fd, &key, flags, true);
+	if (err)
+		goto out;
+
+	err = update_flow_masks(pin_root_path);
+	if (err)
+		goto out;
+
+	if (opt->print_status) {
+		err = print_flows(map_fd, counter_fd);
+		if (err)
+			goto out;
+	}
+
+out:
+	if (map_fd >= 0)
+		close(map_fd);
+	if (counter_fd >= 0)
+		close(counter_fd);
+	return err;
+}
+
+#define RL_TOP_SOURCES 10
+
+struct rl_source {
+	struct in6_addr addr;
+	__u64 dropped;
+};
+
+int print_ratelimit(int cfg_fd, int map_fd)
+{
+	struct in6_addr map_key = {}, prev_key = {};
+	struct rl_source top[RL_TOP_SOURCES] = {};
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct ratelimit_bucket *buckets;
+	struct ratelimit_cfg cfg = {};
+	size_t i, num = 0;
+	__u32 zero = 0;
+	int err;
+
+	if (nr_cpus < 0)
+		return nr_cpus;
+
+	if (bpf_map_lookup_elem(cfg_fd, &zero, &cfg))
+		return -errno;
+
+	printf("Rate limit per source and CPU:\n");
+	if (cfg.pps)
+		printf("  %-40s %" PRIu64 "\n", "Packets per second",
+		       (uint64_t)cfg.pps);
+	else
+		printf("  %-40s %s\n", "Packets per second", "unlimited");
+	if (cfg.bps)
+		printf("  %-40s %" PRIu64 "\n", "Bits per second",
+		       (uint64_t)cfg.bps);
+	else
+		printf("  %-40s %s\n", "Bits per second", "unlimited");
+	printf("  %-40s %" PRIu64 " ms\n", "Burst",
+	       (uint64_t)cfg.burst_ns / 1000000);
+
+	buckets = calloc(nr_cpus, sizeof(*buckets));
+	if (!buckets)
+		return -ENOMEM;
+
+	/* Keep the sources with the most drops, sorted in descending order */
+	FOR_EACH_MAP_KEY (err, map_fd, map_key, prev_key) {
+		struct rl_source src = { .addr = map_key };
+		int cpu;
+
+		if (bpf_map_lookup_elem(map_fd, &map_key, buckets))
+			continue;
+
+		for (cpu = 0; cpu < nr_cpus; cpu++)
+			src.dropped += buckets[cpu].dropped;
+		if (!src.dropped)
+			continue;
+
+		for (i = num; i > 0 && top[i - 1].dropped < src.dropped; i--)
+			if (i < RL_TOP_SOURCES)
+				top[i] = top[i - 1];
+		if (i < RL_TOP_SOURCES) {
+			top[i] = src;
+			if (num < RL_TOP_SOURCES)
+				num++;
+		}
+	}
+	free(buckets);
+
+	printf("\nTop rate limited sources:\n");
+	printf("  %-40s Dropped packets\n", "");
+	for (i = 0; i < num; i++) {
+		char addrbuf[INET6_ADDRSTRLEN];
+		struct ip_addr addr;
+
+		flow_addr_to_ip(&addr, &top[i].addr);
+		print_addr(addrbuf, sizeof(addrbuf), &addr);
+		printf("  %-40s %" PRIu64 "\n", addrbuf,
+		       (uint64_t)top[i].dropped);
+	}
+	return 0;
+}
+
+static const struct ratelimitopt {
+	__u64 pps;
+	__u64 bps;
+	__u32 burst;
+	bool print_status;
+	struct iface rules_iface;
+} defaults_ratelimit = {
+	.burst = RL_DEFAULT_BURST_NS / 1000000,
+};
+
+static struct prog_option ratelimit_options[] = {
+	DEFINE_OPTION("pps", OPT_U64, struct ratelimitopt, pps,
+		      .metavar = "<rate>",
+		      .help = "Packets per second allowed from each source; default unlimited"),
+	DEFINE_OPTION("bps", OPT_U64, struct ratelimitopt, bps,
+		      .metavar = "<rate>",
+		      .help = "Bits per second allowed from each source; default unlimited"),
+	DEFINE_OPTION("burst", OPT_U32, struct ratelimitopt, burst,
+		      .short_opt = 'b',
+		      .metavar = "<msecs>",
+		      .help = "Burst allowance in milliseconds; default 100"),
+	DEFINE_OPTION("status", OPT_BOOL, struct ratelimitopt, print_status,
+		      .short_opt = 's',
+		      .help = "Print rate limit status after changing"),
+	DEFINE_OPTION("iface", OPT_IFNAME, struct ratelimitopt, rules_iface,
+		      .metavar = "<ifname>",
+		      .help = "Use the separate rules of <ifname> (see load --own-rules)"),
+	END_OPTIONS
+};
+
+static int do_ratelimit(const void *cfg, const char *pin_root_path)
+{
+	char rules_path[PATH_MAX];
+	int cfg_fd = -1, map_fd = -1, err = EXIT_SUCCESS;
+	const struct ratelimitopt *opt = cfg;
+	struct ratelimit_cfg rl = {
+		.pps = opt->pps,
+		.bps = opt->bps,
+		.burst_ns = opt->burst * 1000000ULL,
+	};
+	__u32 zero = 0;
+
+	if (select_rules(rules_path, sizeof(rules_path), pin_root_path,
+			 &opt->rules_iface))
+		return EXIT_FAILURE;
+	pin_root_path = rules_path;
+
+	cfg_fd = get_pinned_map_fd(pin_root_path,
+				   textify(MAP_NAME_RATELIMIT_CFG), NULL);
+	if (cfg_fd < 0) {
+		pr_warn("Couldn't find rate limit map; is xdp-filter loaded "
+			"with the ratelimit feature?\n");
+		err = EXIT_FAILURE;
+		goto out;
+	}
+
+	/* Do the divisions here, so the datapath only has to multiply */
+	if (rl.pps)
+		rl.pkt_cost_ns = 1000000000ULL / rl.pps ?: 1;
+	if (rl.bps)
+		rl.byte_cost_ps = 8000000000000ULL / rl.bps ?: 1;
+
+	pr_debug("Setting rate limit to %" PRIu64 " pps, %" PRIu64
+		 " bps, burst %u ms\n", (uint64_t)rl.pps, (uint64_t)rl.bps,
+		 opt->burst);
+
+	if (bpf_map_update_elem(cfg_fd, &zero, &rl, 0)) {
+		err = -errno;
+		pr_warn("Unable to update rate limit: %s\n", strerror(-err));
+		goto out;
+	}
+
+	if (opt->print_status) {
+		map_fd = get_pinned_map_fd(pin_root_path,
+					   textify(MAP_NAME_RATELIMIT), NULL);
+		if (map_fd < 0) {
+			err = map_fd;
+			goto out;
+		}
+
+		err = print_ratelimit(cfg_fd, map_fd);
+		if (err)
+			goto out;
+	}
+
+out:
+	if (map_fd >= 0)
+		close(map_fd);
+	if (cfg_fd >= 0)
+		close(cfg_fd);
+	return err;
+}
+
+struct flag_rule {
+	__u8 key[sizeof(struct flow_key)];
+	__u8 flags;
+	bool exists;
+};
+
+struct rule_list {
+	void *elems;
+	size_t elem_size;
+	size_t num;
+	size_t cap;
+};
+
+struct rule_set {
+	struct rule_list ports;  /* struct flag_rule */
+	struct rule_list ethers; /* struct flag_rule */
+	struct rule_list flows;  /* struct flag_rule */
+	struct rule_list ipv4;   /* union ip_lpm_key */
+	struct rule_list ipv6;   /* union ip_lpm_key */
+};
+
+static int rule_list_add(struct rule_list *list, const void *elem)
+{
+	void *ptr;
+
+	if (list->num == list->cap) {
+		size_t cap = list->cap ? list->cap * 2 : 64;
+
+		ptr = realloc(list->elems, cap * list->elem_size);
+		if (!ptr)
+			return -ENOMEM;
+		list->elems = ptr;
+		list->cap = cap;
+	}
+
+	memcpy(list->elems + list->num++ * list->elem_size, elem,
+	       list->elem_size);
+	return 0;
+}
+
+static void rule_set_free(struct rule_set *rules)
+{
+	free(rules->ports.elems);
+	free(rules->ethers.elems);
+	free(rules->flows.elems);
+	free(rules->ipv4.elems);
+	free(rules->ipv6.elems);
+}
+
+/* Parse one line of a rule file. The format is the same as the one written by
+ * the export command:
+ *
+ * port <port> [src|dst][,tcp|udp]
+ * ip <addr>[/<len>] [src|dst]
+ * ether <addr> [src|dst]
+ * flow <field>=<value>[,<field>=<value>...] [tcp|udp]
+ */
+static int parse_rule(char *line, struct rule_set *rules)
+{
+	char *saveptr = NULL, *type, *value, *flagstr, *extra;
+	const struct flag_val *mode;
+	struct flag_rule rule = {};
+	unsigned int flags = 0;
+	int err;
+
+	type = strtok_r(line, " \t\r\n", &saveptr);
+	if (!type || *type == '#')
+		return 0;
+
+	value = strtok_r(NULL, " \t\r\n", &saveptr);
+	flagstr = strtok_r(NULL, " \t\r\n", &saveptr);
+	extra = strtok_r(NULL, " \t\r\n", &saveptr);
+	if (flagstr && *flagstr == '#')
+		flagstr = extra = NULL;
+	if (!value || (extra && *extra != '#'))
+		return -EINVAL;
+
+	if (flagstr) {
+		err = parse_option_value(OPT_FLAGS, flagstr, &flags,
+					 map_flags_all);
+		if (err)
+			return err;
+	}
+
+	if (!strcmp(type, "port")) {
+		__u16 port;
+		__u32 key;
+
+		err = parse_option_value(OPT_U16, value, &port, NULL);
+		if (err)
+			return err;
+
+		if (!(flags & (MAP_FLAG_SRC | MAP_FLAG_DST)))
+			flags |= MAP_FLAG_DST;
+		if (!(flags & (MAP_FLAG_TCP | MAP_FLAG_UDP)))
+			flags |= MAP_FLAG_TCP | MAP_FLAG_UDP;
+
+		key = htons(port);
+		memcpy(rule.key, &key, sizeof(key));
+		rule.flags = flags;
+		return rule_list_add(&rules->ports, &rule);
+	}
+
+	if (!strcmp(type, "flow")) {
+		struct flow_key key;
+
+		if (flags & ~(MAP_FLAG_TCP | MAP_FLAG_UDP))
+			return -EINVAL;
+		if (!flags)
+			flags = MAP_FLAG_TCP | MAP_FLAG_UDP;
+
+		err = parse_flow(value, &key);
+		if (err)
+			return err;
+
+		memcpy(rule.key, &key, sizeof(key));
+		rule.flags = flags;
+		return rule_list_add(&rules->flows, &rule);
+	}
+
+	if (flags & ~(MAP_FLAG_SRC | MAP_FLAG_DST))
+		return -EINVAL;
+	if (!flags)
+		flags = MAP_FLAG_DST;
+
+	if (!strcmp(type, "ether")) {
+		struct mac_addr addr;
+
+		err = parse_option_value(OPT_MACADDR, value, &addr, NULL);
+		if (err)
+			return err;
+
+		memcpy(rule.key, addr.addr, sizeof(addr.addr));
+		rule.flags = flags;
+		return rule_list_add(&rules->ethers, &rule);
+	}
+
+	if (!strcmp(type, "ip")) {
+		struct ip_prefix prefix;
+
+		err = parse_option_value(OPT_IPPREFIX, value, &prefix, NULL);
+		if (err)
+			return err;
+
+		for (mode = map_flags_srcdst; mode->flagstring; mode++) {
+			union ip_lpm_key key;
+
+			if (!(flags & mode->flagval))
+				continue;
+
+			lpm_key_from_prefix(&key, &prefix, mode->flagval);
+			err = rule_list_add(prefix.addr.af == AF_INET6 ?
+					    &rules->ipv6 : &rules->ipv4, &key);
+			if (err)
+				return err;
+		}
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+static int cmp_flag_rule(const void *a, const void *b)
+{
+	const struct flag_rule *ra = a, *rb = b;
+
+	return memcmp(ra->key, rb->key, sizeof(ra->key));
+}
+
+struct flag_merge {
+	struct flag_rule *rules;
+	size_t num_rules;
+	size_t key_size;
+	bool replace;
+	struct rule_list stale;
+};
+
+static int merge_flag_rule(const void *key, const void *value, void *arg)
+{
+	__u8 flags = *(const __u8 *)value & MAP_FLAGS;
+	struct flag_merge *merge = arg;
+	struct flag_rule *rule, tmp = {};
+
+	if (!flags)
+		return 0;
+
+	memcpy(tmp.key, key, merge->key_size);
+	rule = bsearch(&tmp, merge->rules, merge->num_rules, sizeof(*rule),
+		       cmp_flag_rule);
+	if (!rule)
+		return merge->replace ? rule_list_add(&merge->stale, &tmp) : 0;
+
+	/* Existing rules keep their hit counter, and unless we're replacing
+	 * the whole rule set, also their flags.
+	 */
+	rule->exists = true;
+	if (!merge->replace)
+		rule->flags |= flags;
+	return 0;
+}
+
+static int map_delete_batch(int fd, void *keys, __u32 count, size_t key_size)
+{
+	DECLARE_LIBBPF_OPTS(bpf_map_batch_opts, opts);
+	__u32 i, done = count;
+	int err;
+
+	err = bpf_map_delete_batch(fd, keys, &done, &opts);
+	if (!err)
+		return 0;
+
+	/* A missing key aborts the batch, so redo it one key at a time */
+	err = -errno;
+	if (!batch_unsupported(err) && err != -ENOENT)
+		return err;
+
+	for (i = 0; i < count; i++) {
+		if (bpf_map_delete_elem(fd, keys + i * key_size) &&
+		    errno != ENOENT)
+			return -errno;
+	}
+	return 0;
+}
+
+static int import_flag_rules(int map_fd, int counter_fd, struct rule_list *list,
+			     size_t key_size, bool replace, bool is_array)
+{
+	struct flag_merge merge = {
+		.key_size = key_size,
+		.replace = replace,
+		.stale = { .elem_size = sizeof(struct flag_rule) },
+	};
+	int nr_cpus = libbpf_num_possible_cpus();
+	size_t i, num = 0, batch = 0;
+	struct flag_rule *rules;
+	__u64 *zeroes = NULL;
+	__u8 *values = NULL;
+	void *keys = NULL;
+	int err;
+
+	if (nr_cpus < 0)
+		return nr_cpus;
+	if (!list->num && !replace)
+		return 0;
+
+	/* Sort the rules and merge duplicate keys */
+	rules = list->elems;
+	qsort(rules, list->num, sizeof(*rules), cmp_flag_rule);
+	for (i = 1; i < list->num; i++) {
+		if (!cmp_flag_rule(&rules[num], &rules[i]))
+			rules[num].flags |= rules[i].flags;
+		else
+			rules[++num] = rules[i];
+	}
+	if (list->num)
+		list->num = num + 1;
+
+	merge.rules = rules;
+	merge.num_rules = list->num;
+	err = map_for_each(map_fd, key_size, sizeof(*values), merge_flag_rule,
+			   &merge);
+	if (err)
+		goto out;
+
+	keys = calloc(MAP_BATCH_SIZE, key_size);
+	values = calloc(MAP_BATCH_SIZE, sizeof(*values));
+	zeroes = calloc(MAP_BATCH_SIZE * nr_cpus, sizeof(*zeroes));
+	if (!keys || !values || !zeroes) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (merge.stale.num && !is_array) {
+		struct flag_rule *stale = merge.stale.elems;
+
+		for (i = 0; i < merge.stale.num; i++) {
+			memcpy(keys + batch * key_size, stale[i].key, key_size);
+			if (++batch < MAP_BATCH_SIZE && i < merge.stale.num - 1)
+				continue;
+
+			err = map_delete_batch(map_fd, keys, batch, key_size);
+			if (err) {
+				pr_warn("Couldn't delete value from state map: %s\n",
+					strerror(-err));
+				goto out;
+			}
+			if (counter_fd >= 0)
+				map_delete_batch(counter_fd, keys, batch,
+						 key_size);
+			batch = 0;
+		}
+	} else if (merge.stale.num) {
+		/* Array entries can't be deleted; clearing all flags is the
+		 * same thing, so just add them as empty rules.
+		 */
+		num = list->num;
+		for (i = 0; i < merge.stale.num; i++) {
+			err = rule_list_add(list, merge.stale.elems +
+					    i * merge.stale.elem_size);
+			if (err)
+				goto out;
+		}
+		rules = list->elems;
+	}
+
+	/* New (and cleared) rules start out with a zero hit counter */
+	for (i = 0; counter_fd >= 0 && i < list->num; i++) {
+		if (!rules[i].exists)
+			memcpy(keys + batch++ * key_size, rules[i].key, key_size);
+
+		if (!batch || (batch < MAP_BATCH_SIZE && i < list->num - 1))
+			continue;
+
+		err = map_update_batch(counter_fd, keys, zeroes, batch, key_size,
+				       nr_cpus * sizeof(*zeroes), 0);
+		if (err) {
+			pr_warn("Unable to reset hit counters: %s\n",
+				strerror(-err));
+			goto out;
+		}
+		batch = 0;
+	}
+
+	for (i = 0; i < list->num; i++) {
+		memcpy(keys + batch * key_size, rules[i].key, key_size);
+		values[batch] = rules[i].flags;
+
+		if (++batch < MAP_BATCH_SIZE && i < list->num - 1)
+			continue;
+
+		err = map_update_batch(map_fd, keys, values, batch, key_size,
+				       sizeof(*values), 0);
+		if (err) {
+			if (err == -E2BIG)
+				pr_warn("Couldn't add entry: state map is full\n");
+			else
+				pr_warn("Unable to update state map: %s\n",
+					strerror(-err));
+			goto out;
+		}
+		batch = 0;
+	}
+
+	if (merge.stale.num && is_array)
+		list->num = num;
+
+out:
+	free(merge.stale.elems);
+	free(zeroes);
+	free(values);
+	free(keys);
+	return err;
+}
+
+struct lpm_entry {
+	union ip_lpm_key key;
+	struct ip_lpm_val value;
+	bool reused;
+};
+
+static int cmp_lpm_entry(const void *a, const void *b)
+{
+	const struct lpm_entry *ea = a, *eb = b;
+
+	return memcmp(&ea->key, &eb->key, sizeof(ea->key));
+}
+
+/* Entries of a rule set that is being replaced, sorted by key so the hit
+ * counters of rules that are kept can be carried over.
+ */
+struct lpm_entries {
+	struct lpm_entry *entries;
+	size_t num;
+};
+
+static struct lpm_entry *lpm_entries_find(struct lpm_entries *old,
+					  const union ip_lpm_key *key)
+{
+	struct lpm_entry tmp = { .key = *key };
+
+	if (!old || !old->num)
+		return NULL;
+
+	return bsearch(&tmp, old->entries, old->num, sizeof(tmp),
+		       cmp_lpm_entry);
+}
+
+static int lpm_entries_read(int map_fd, struct lpm_entries *old)
+{
+	struct rule_list list = { .elem_size = sizeof(struct lpm_entry) };
+	struct lpm_entry entry = {};
+	union ip_lpm_key prev_key;
+	int err;
+
+	FOR_EACH_MAP_KEY (err, map_fd, entry.key, prev_key) {
+		if (bpf_map_lookup_elem(map_fd, &entry.key, &entry.value))
+			continue;
 
+		err = rule_list_add(&list, &entry);
+		if (err) {
+			free(list.elems);
+			return err;
+		}
+	}
+
+	qsort(list.elems, list.num, sizeof(entry), cmp_lpm_entry);
+	old->entries = list.elems;
+	old->num = list.num;
 	return 0;
 }
 
-int print_ips()
+static int import_ip_rules(int map_fd, int counter_fd, struct rule_list *list,
+			   struct counter_ids *ids, struct lpm_entries *old,
+			   size_t *num_existing)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	union ip_lpm_key *keys = list->elems;
+	__u32 *id_batch = NULL, *new_ids = NULL;
+	size_t i, j, n, num_new;
+	struct lpm_entry *entry;
+	bool *reused = NULL;
+	__u64 *zeroes = NULL;
+	int err = 0;
+
+	if (nr_cpus < 0)
+		return nr_cpus;
+
+	id_batch = calloc(MAP_BATCH_SIZE, sizeof(*id_batch));
+	new_ids = calloc(MAP_BATCH_SIZE, sizeof(*new_ids));
+	reused = calloc(MAP_BATCH_SIZE, sizeof(*reused));
+	zeroes = calloc(MAP_BATCH_SIZE * nr_cpus, sizeof(*zeroes));
+	if (!id_batch || !new_ids || !reused || !zeroes) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < list->num; i += n) {
+		n = min(list->num - i, (size_t)MAP_BATCH_SIZE);
+
+		for (j = 0, num_new = 0; j < n; j++) {
+			entry = lpm_entries_find(old, &keys[i + j]);
+			reused[j] = !!entry;
+			if (entry) {
+				entry->reused = true;
+				id_batch[j] = entry->value.counter_id;
+				continue;
+			}
+
+			err = counter_ids_alloc(ids, &id_batch[j]);
+			if (err)
+				goto out;
+			new_ids[num_new++] = id_batch[j];
+		}
+
+		if (num_new) {
+			err = map_update_batch(counter_fd, new_ids, zeroes,
+					       num_new, sizeof(*new_ids),
+					       nr_cpus * sizeof(*zeroes),
+					       BPF_NOEXIST);
+			if (err) {
+				pr_warn("Unable to create hit counters: %s\n",
+					strerror(-err));
+				goto out;
+			}
+		}
+
+		/* LPM tries don't implement the batch operations, so the trie
+		 * entries themselves have to be added one at a time.
+		 */
+		for (j = 0; j < n; j++) {
+			struct ip_lpm_val value = {
+				.counter_id = id_batch[j],
+				.prefixlen = keys[i + j].v4.prefixlen - LPM_MODE_BITS,
+			};
+
+			if (!bpf_map_update_elem(map_fd, &keys[i + j], &value,
+						 BPF_NOEXIST))
+				continue;
+
+			err = -errno;
+			if (!reused[j]) {
+				bpf_map_delete_elem(counter_fd, &id_batch[j]);
+				counter_ids_release(ids, id_batch[j]);
+			}
+			if (err == -EEXIST) {
+				(*num_existing)++;
+				err = 0;
+				continue;
+			}
+
+			if (err == -ENOSPC || err == -E2BIG)
+				pr_warn("Couldn't add entry: state map is full\n");
+			else
+				pr_warn("Unable to update state map: %s\n",
+					strerror(-err));
+
+			while (++j < n) {
+				if (reused[j])
+					continue;
+				bpf_map_delete_elem(counter_fd, &id_batch[j]);
+				counter_ids_release(ids, id_batch[j]);
+			}
+			goto out;
+		}
+	}
+
+out:
+	free(zeroes);
+	free(reused);
+	free(new_ids);
+	free(id_batch);
+	return err;
+}
+
+/* Delete the hit counters of the entries in a rule trie, skipping the ones
+ * that were carried over to a new rule set.
+ */
+static void lpm_delete_counters(int map_fd, int counter_fd,
+				struct lpm_entries *keep)
+{
+	union ip_lpm_key key = {}, prev_key;
+	struct ip_lpm_val value;
+	int err;
+
+	FOR_EACH_MAP_KEY (err, map_fd, key, prev_key) {
+		struct lpm_entry *entry = lpm_entries_find(keep, &key);
+
+		if (entry && entry->reused)
+			continue;
+		if (!bpf_map_lookup_elem(map_fd, &key, &value))
+			bpf_map_delete_elem(counter_fd, &value.counter_id);
+	}
+}
+
+/* Build a new rule trie off to the side and switch the datapath over to it
+ * with a single map update, so it never sees a partially applied rule set.
+ */
+static int replace_ip_rules(int outer_fd, int counter_fd, struct rule_list *list,
+			    struct counter_ids *ids, size_t *num_existing)
+{
+	int old_fd = -1, new_fd = -1, err;
+	struct lpm_entries old = {};
+	__u32 key = 0;
+	size_t i;
+
+	old_fd = ip_rules_get_fd(outer_fd);
+	if (old_fd < 0) {
+		err = old_fd;
+		pr_warn("Couldn't get current rule set: %s\n", strerror(-err));
+		goto out;
+	}
+
+	new_fd = create_map_like(old_fd);
+	if (new_fd < 0) {
+		err = new_fd;
+		pr_warn("Couldn't create new rule set: %s\n", strerror(-err));
+		goto out;
+	}
+
+	err = lpm_entries_read(old_fd, &old);
+	if (err)
+		goto out;
+
+	err = import_ip_rules(new_fd, counter_fd, list, ids, &old, num_existing);
+	if (!err && bpf_map_update_elem(outer_fd, &key, &new_fd, 0)) {
+		err = -errno;
+		pr_warn("Couldn't switch to new rule set: %s\n", strerror(-err));
+	}
+
+	if (err) {
+		/* Only drop the counters that were created for the new set */
+		for (i = 0; i < old.num; i++)
+			old.entries[i].reused = true;
+		lpm_delete_counters(new_fd, counter_fd, &old);
+		goto out;
+	}
+
+	/* The old trie goes away once its last reference is dropped */
+	lpm_delete_counters(old_fd, counter_fd, &old);
+
+out:
+	free(old.entries);
+	if (new_fd >= 0)
+		close(new_fd);
+	if (old_fd >= 0)
+		close(old_fd);
+	return err;
+}
+
+static const struct importopt {
+	char *filename;
+	bool replace;
+	struct iface rules_iface;
+} defaults_import = {};
+
+static struct prog_option import_options[] = {
+	DEFINE_OPTION("file", OPT_STRING, struct importopt, filename,
+		      .positional = true,
+		      .metavar = "<file>",
+		      .required = true,
+		      .help = "File to read rules from ('-' for stdin)"),
+	DEFINE_OPTION("replace", OPT_BOOL, struct importopt, replace,
+		      .short_opt = 'r',
+		      .help = "Replace all existing rules instead of adding to them"),
+	DEFINE_OPTION("iface", OPT_IFNAME, struct importopt, rules_iface,
+		      .metavar = "<ifname>",
+		      .help = "Use the separate rules of <ifname> (see load --own-rules)"),
+	END_OPTIONS
+};
+
+static int read_rules(const char *filename, struct rule_set *rules)
+{
+	unsigned int lineno = 0;
+	size_t len = 0;
+	char *line = NULL;
+	int err = 0;
+	FILE *f;
+
+	if (!strcmp(filename, "-")) {
+		f = stdin;
+	} else {
+		f = fopen(filename, "r");
+		if (!f) {
+			err = -errno;
+			pr_warn("Couldn't open file '%s': %s\n", filename,
+				strerror(-err));
+			return err;
+		}
+	}
+
+	while (getline(&line, &len, f) > 0) {
+		lineno++;
+		err = parse_rule(line, rules);
+		if (err) {
+			pr_warn("%s:%u: Invalid rule\n", filename, lineno);
+			goto out;
+		}
+	}
+
+	if (ferror(f)) {
+		err = -EIO;
+		pr_warn("Couldn't read file '%s'\n", filename);
+	}
+
+out:
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return err;
+}
+
+static int open_rule_map(const char *pin_root_path, const char *map_name,
+			 const char *feat_name, bool required)
+{
+	int map_fd;
+
+	map_fd = get_pinned_map_fd(pin_root_path, map_name, NULL);
+	if (map_fd < 0 && required)
+		pr_warn("Couldn't find filter map; is xdp-filter loaded "
+			"with the %s feature?\n", feat_name);
+	return map_fd;
+}
+
+static int import_flag_map(const char *pin_root_path, const char *map_name,
+			   const char *counter_name, const char *feat_name,
+			   struct rule_list *list, size_t key_size,
+			   bool replace, bool is_array)
+{
+	int map_fd, counter_fd, err;
+
+	if (!list->num && !replace)
+		return 0;
+
+	map_fd = open_rule_map(pin_root_path, map_name, feat_name, list->num);
+	if (map_fd < 0)
+		return list->num ? map_fd : 0;
+
+	counter_fd = get_pinned_map_fd(pin_root_path, counter_name, NULL);
+	err = import_flag_rules(map_fd, counter_fd, list, key_size, replace,
+				is_array);
+	if (counter_fd >= 0)
+		close(counter_fd);
+	close(map_fd);
+	return err;
+}
+
+static int import_ip_map(const char *pin_root_path, const char *map_name,
+			 const char *feat_name, int af, int counter_fd,
+			 struct rule_list *list, struct counter_ids *ids,
+			 bool replace, size_t *num_existing)
+{
+	int outer_fd, bloom_fd, map_fd, err;
+	bool bloom = false;
+
+	if ((!list->num && !replace) || counter_fd < 0)
+		return 0;
+
+	outer_fd = open_rule_map(pin_root_path, map_name, feat_name, list->num);
+	if (outer_fd < 0)
+		return list->num ? outer_fd : 0;
+
+	/* The bloom filter is rebuilt afterwards, instead of being kept in
+	 * step with every rule
+	 */
+	bloom_fd = get_pinned_map_fd(pin_root_path, ip_bloom_map_name(af),
+				     NULL);
+	if (bloom_fd >= 0) {
+		bloom = true;
+		err = ip_bloom_disable(bloom_fd);
+		close(bloom_fd);
+		if (err) {
+			pr_warn("Couldn't disable bloom filter: %s\n",
+				strerror(-err));
+			goto out;
+		}
+	}
+
+	if (replace) {
+		err = replace_ip_rules(outer_fd, counter_fd, list, ids,
+				       num_existing);
+		goto out;
+	}
+
+	map_fd = ip_rules_get_fd(outer_fd);
+	if (map_fd < 0) {
+		err = map_fd;
+		pr_warn("Couldn't get rule set from map %s: %s\n", map_name,
+			strerror(-err));
+		goto out;
+	}
+
+	err = import_ip_rules(map_fd, counter_fd, list, ids, NULL,
+			      num_existing);
+	close(map_fd);
+
+out:
+	if (bloom)
+		err = ip_bloom_sync(pin_root_path, af) ?: err;
+	close(outer_fd);
+	return err;
+}
+
+static int do_import(const void *cfg, const char *pin_root_path)
 {
-	int map_fd4 = -1, map_fd6 = -1;
-	char pin_root_path[PATH_MAX];
-	int err = 0;
+	char rules_path[PATH_MAX];
+	int counter_fd = -1, err = EXIT_SUCCESS;
+	const struct importopt *opt = cfg;
+	struct counter_ids ids = {};
+	size_t num_existing = 0;
+	bool need_ip;
+	struct rule_set rules = {
+		.ports = { .elem_size = sizeof(struct flag_rule) },
+		.ethers = { .elem_size = sizeof(struct flag_rule) },
+		.flows = { .elem_size = sizeof(struct flag_rule) },
+		.ipv4 = { .elem_size = sizeof(union ip_lpm_key) },
+		.ipv6 = { .elem_size = sizeof(union ip_lpm_key) },
+	};
+
+	if (select_rules(rules_path, sizeof(rules_path), pin_root_path,
+			 &opt->rules_iface))
+		return EXIT_FAILURE;
+	pin_root_path = rules_path;
 
-	err = get_bpf_root_dir(pin_root_path, sizeof(pin_root_path), PROG_NAME,
-			       true);
+	/* Parse the whole file before touching any of the maps */
+	err = read_rules(opt->filename, &rules);
 	if (err)
 		goto out;
 
-	map_fd6 = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_IPV6), NULL);
-	map_fd4 = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_IPV4), NULL);
-	if (map_fd4 < 0 && map_fd6 < 0) {
-		err = -ENOENT;
+	/* When replacing, every rule map that exists is rewritten, even if
+	 * the file doesn't contain any rules for it.
+	 */
+	err = import_flag_map(pin_root_path, textify(MAP_NAME_PORTS),
+			      textify(MAP_NAME_PORT_COUNTERS), "udp or tcp",
+			      &rules.ports, sizeof(__u32), opt->replace, true);
+	if (err)
 		goto out;
-	}
 
-	printf("Filtered IP addresses:\n");
-	printf("  %-40s Mode             Hit counter\n", "");
+	need_ip = rules.ipv4.num || rules.ipv6.num;
+	if (need_ip || opt->replace) {
+		counter_fd = open_rule_map(pin_root_path,
+					   textify(MAP_NAME_IP_COUNTERS),
+					   rules.ipv6.num ? "ipv6" : "ipv4",
+					   need_ip);
+		if (counter_fd < 0 && need_ip) {
+			err = counter_fd;
+			goto out;
+		}
+	}
 
-	if (map_fd6 >= 0) {
-		err = __print_ips(map_fd6, AF_INET6);
+	if (counter_fd >= 0) {
+		err = counter_ids_init(&ids, counter_fd);
 		if (err)
 			goto out;
 	}
 
-	if (map_fd4 >= 0)
-		err = __print_ips(map_fd4, AF_INET);
-
-out:
-	if (map_fd4 >= 0)
-		close(map_fd4);
-	if (map_fd6 >= 0)
-		close(map_fd6);
-	return err;
-}
-
+	err = import_ip_map(pin_root_path, textify(MAP_NAME_IPV4), "ipv4",
+			    AF_INET, counter_fd, &rules.ipv4, &ids,
+			    opt->replace, &num_existing);
+	if (err)
+		goto out;
 
-static int __do_address(const char *pin_root_path,
-			const char *map_name, const char *feat_name,
-			void *map_key, bool remove, int mode)
-{
-	int map_fd = -1, err = 0;
-	__u8 flags = 0;
-	__u64 counter;
+	err = import_ip_map(pin_root_path, textify(MAP_NAME_IPV6), "ipv6",
+			    AF_INET6, counter_fd, &rules.ipv6, &ids,
+			    opt->replace, &num_existing);
+	if (err)
+		goto out;
 
-	map_fd = get_pinned_map_fd(pin_root_path, map_name, NULL);
-	if (map_fd < 0) {
-		pr_warn("Couldn't find filter map; is xdp-filter loaded "
-			"with the %s feature?\n", feat_name);
-		err = -ENOENT;
+	err = import_flag_map(pin_root_path, textify(MAP_NAME_ETHERNET),
+			      textify(MAP_NAME_ETHERNET_COUNTERS), "ethernet",
+			      &rules.ethers, sizeof(struct mac_addr),
+			      opt->replace, false);
+	if (err)
 		goto out;
-	}
 
-	err = map_get_counter_flags(map_fd, map_key, &counter, &flags);
-	if (err && err != -ENOENT)
+	err = import_flag_map(pin_root_path, textify(MAP_NAME_FLOWS),
+			      textify(MAP_NAME_FLOW_COUNTERS), "flow",
+			      &rules.flows, sizeof(struct flow_key),
+			      opt->replace, false);
+	if (err)
 		goto out;
 
-	if (remove)
-		flags &= ~mode;
-	else
-		flags |= mode;
+	if (rules.flows.num || opt->replace) {
+		err = update_flow_masks(pin_root_path);
+		if (err)
+			goto out;
+	}
 
-	err = map_set_flags(map_fd, map_key, flags, true);
+	err = hw_prefilter_sync(pin_root_path);
 	if (err)
 		goto out;
 
+	pr_debug("Imported %zu port, %zu IP, %zu MAC address and %zu flow "
+		 "rules (%zu IP rules already present)\n",
+		 rules.ports.num, rules.ipv4.num + rules.ipv6.num,
+		 rules.ethers.num, rules.flows.num, num_existing);
+
 out:
-	return err ?: map_fd;
+	if (counter_fd >= 0)
+		close(counter_fd);
+	counter_ids_free(&ids);
+	rule_set_free(&rules);
+	return err;
 }
 
-static const struct ipopt {
-	unsigned int mode;
-	struct ip_addr addr;
-	bool print_status;
-	bool remove;
-} defaults_ip = {
-	.mode = MAP_FLAG_DST,
-};
+static int export_port(const void *key, const void *value, void *arg)
+{
+	__u8 flags = *(const __u8 *)value & MAP_FLAGS;
+	char flagbuf[100];
+	FILE *f = arg;
 
-static struct prog_option ip_options[] = {
-	DEFINE_OPTION("addr", OPT_IPADDR, struct ipopt, addr,
-		      .positional = true,
-		      .metavar = "<addr>",
-		      .required = true,
-		      .help = "Address to add or remove"),
-	DEFINE_OPTION("remove", OPT_BOOL, struct ipopt, remove,
-		      .short_opt = 'r',
-		      .help = "Remove address instead of adding"),
-	DEFINE_OPTION("mode", OPT_FLAGS, struct ipopt, mode,
-		      .short_opt = 'm',
-		      .metavar = "<mode>",
-		      .typearg = map_flags_srcdst,
-		      .help = "Filter mode; default dst"),
-	DEFINE_OPTION("status", OPT_BOOL, struct ipopt, print_status,
-		      .short_opt = 's',
-		      .help = "Print status of filtered addresses after changing"),
-	END_OPTIONS
-};
+	if (!flags)
+		return 0;
 
-static int do_ip(const void *cfg, const char *pin_root_path)
+	print_flags(flagbuf, sizeof(flagbuf), map_flags_all, flags);
+	fprintf(f, "port %u %s\n", ntohs(*(const __u32 *)key), flagbuf);
+	return 0;
+}
+
+static int export_ether(const void *key, const void *value, void *arg)
 {
-	int map_fd = -1, err = EXIT_SUCCESS;
-	char modestr[100], addrstr[100];
-	const struct ipopt *opt = cfg;
-	struct ip_addr addr = opt->addr;
-	bool v6;
+	__u8 flags = *(const __u8 *)value & MAP_FLAGS;
+	char flagbuf[100], addrbuf[100];
+	struct mac_addr addr;
+	FILE *f = arg;
 
-	print_flags(modestr, sizeof(modestr), map_flags_srcdst, opt->mode);
-	print_addr(addrstr, sizeof(addrstr), &opt->addr);
-	pr_debug("%s addr %s mode %s\n", opt->remove ? "Removing" : "Adding",
-		 addrstr, modestr);
+	if (!flags)
+		return 0;
 
-	v6 = (opt->addr.af == AF_INET6);
+	memcpy(addr.addr, key, sizeof(addr.addr));
+	print_flags(flagbuf, sizeof(flagbuf), map_flags_srcdst, flags);
+	print_macaddr(addrbuf, sizeof(addrbuf), &addr);
+	fprintf(f, "ether %s %s\n", addrbuf, flagbuf);
+	return 0;
+}
 
-	map_fd = __do_address(pin_root_path,
-			      v6 ? textify(MAP_NAME_IPV6) : textify(MAP_NAME_IPV4),
-			      v6 ? "ipv6" : "ipv4",
-			      &addr.addr, opt->remove, opt->mode);
-	if (map_fd < 0) {
-		err = map_fd;
-		goto out;
-	}
+static int export_flow(const void *key, const void *value, void *arg)
+{
+	__u8 flags = *(const __u8 *)value & MAP_FLAGS;
+	char flagbuf[100], flowbuf[200];
+	FILE *f = arg;
 
-	if (opt->print_status) {
-		err = print_ips();
-		if (err)
-			goto out;
-	}
+	if (!flags)
+		return 0;
 
-out:
-	if (map_fd >= 0)
-		close(map_fd);
-	return err;
+	print_flags(flagbuf, sizeof(flagbuf), map_flags_tcpudp, flags);
+	print_flow(flowbuf, sizeof(flowbuf), key);
+	fprintf(f, "flow %s %s\n", flowbuf, flagbuf);
+	return 0;
 }
 
-int print_ethers(int map_fd)
+static int export_ips(int map_fd, int af, FILE *f)
 {
-	struct mac_addr map_key = {}, prev_key = {};
+	union ip_lpm_key map_key = {}, prev_key = {};
 	int err;
 
-	printf("Filtered MAC addresses:\n");
-	printf("  %-40s Mode             Hit counter\n", "");
+	/* LPM tries don't support batch lookups, but iterating the keys only
+	 * returns real entries, so there's no need to look up the values.
+	 */
 	FOR_EACH_MAP_KEY (err, map_fd, map_key, prev_key) {
-		char modebuf[100], addrbuf[100];
-		__u8 flags = 0;
-		__u64 counter;
-
-		err = map_get_counter_flags(map_fd, &map_key, &counter, &flags);
-		if (err == -ENOENT)
-			continue;
-		else if (err)
-			return err;
+		char flagbuf[100], addrbuf[100];
+		struct ip_prefix prefix;
 
-		print_flags(modebuf, sizeof(modebuf), map_flags_srcdst, flags);
-		print_macaddr(addrbuf, sizeof(addrbuf), &map_key);
-		printf("  %-40s %-15s  %" PRIu64 "\n", addrbuf, modebuf,
-		       (uint64_t)counter);
+		lpm_key_to_prefix(&map_key, af, &prefix);
+		print_flags(flagbuf, sizeof(flagbuf), map_flags_srcdst,
+			    map_key.v4.mode);
+		print_prefix(addrbuf, sizeof(addrbuf), &prefix);
+		fprintf(f, "ip %s %s\n", addrbuf, flagbuf);
 	}
+
 	return 0;
 }
 
-static const struct etheropt {
-	unsigned int mode;
-	struct mac_addr addr;
-	bool print_status;
-	bool remove;
-} defaults_ether = {
-	.mode = MAP_FLAG_DST,
-};
+static const struct exportopt {
+	char *filename;
+	struct iface rules_iface;
+} defaults_export = {};
 
-static struct prog_option ether_options[] = {
-	DEFINE_OPTION("addr", OPT_MACADDR, struct etheropt, addr,
+static struct prog_option export_options[] = {
+	DEFINE_OPTION("file", OPT_STRING, struct exportopt, filename,
 		      .positional = true,
-		      .metavar = "<addr>",
-		      .required = true,
-		      .help = "Address to add or remove"),
-	DEFINE_OPTION("remove", OPT_BOOL, struct etheropt, remove,
-		      .short_opt = 'r',
-		      .help = "Remove address instead of adding"),
-	DEFINE_OPTION("mode", OPT_FLAGS, struct etheropt, mode,
-		      .short_opt = 'm',
-		      .metavar = "<mode>",
-		      .typearg = map_flags_srcdst,
-		      .help = "Filter mode; default dst"),
-	DEFINE_OPTION("status", OPT_BOOL, struct etheropt, print_status,
-		      .short_opt = 's',
-		      .help = "Print status of filtered addresses after changing"),
+		      .metavar = "<file>",
+		      .help = "File to write rules to (default stdout)"),
+	DEFINE_OPTION("iface", OPT_IFNAME, struct exportopt, rules_iface,
+		      .metavar = "<ifname>",
+		      .help = "Use the separate rules of <ifname> (see load --own-rules)"),
 	END_OPTIONS
 };
 
-static int do_ether(const void *cfg, const char *pin_root_path)
+static int do_export(const void *cfg, const char *pin_root_path)
 {
-	int err = EXIT_SUCCESS, map_fd = -1;
-	const struct etheropt *opt = cfg;
-	struct mac_addr addr = opt->addr;
-	char modestr[100], addrstr[100];
+	char rules_path[PATH_MAX];
+	const struct exportopt *opt = cfg;
+	int map_fd = -1, err = 0;
+	FILE *f = stdout;
 
-	print_flags(modestr, sizeof(modestr), map_flags_srcdst, opt->mode);
-	print_macaddr(addrstr, sizeof(addrstr), &opt->addr);
-	pr_debug("%s addr %s mode %s\n", opt->remove ? "Removing" : "Adding",
-		 addrstr, modestr);
+	if (select_rules(rules_path, sizeof(rules_path), pin_root_path,
+			 &opt->rules_iface))
+		return EXIT_FAILURE;
+	pin_root_path = rules_path;
 
-	map_fd = __do_address(pin_root_path, textify(MAP_NAME_ETHERNET),
-			      "ethernet", &addr.addr, opt->remove, opt->mode);
-	if (map_fd < 0) {
-		err = map_fd;
-		goto out;
+	if (opt->filename && strcmp(opt->filename, "-")) {
+		f = fopen(opt->filename, "w");
+		if (!f) {
+			err = -errno;
+			pr_warn("Couldn't open file '%s': %s\n", opt->filename,
+				strerror(-err));
+			return err;
+		}
 	}
 
-	if (opt->print_status) {
-		err = print_ethers(map_fd);
+	map_fd = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_PORTS), NULL);
+	if (map_fd >= 0) {
+		err = map_for_each(map_fd, sizeof(__u32), sizeof(__u8),
+				   export_port, f);
+		close(map_fd);
 		if (err)
 			goto out;
 	}
 
-out:
-	if (map_fd >= 0)
+	map_fd = open_ip_rules(pin_root_path, textify(MAP_NAME_IPV4));
+	if (map_fd >= 0) {
+		err = export_ips(map_fd, AF_INET, f);
+		close(map_fd);
+		if (err)
+			goto out;
+	}
+
+	map_fd = open_ip_rules(pin_root_path, textify(MAP_NAME_IPV6));
+	if (map_fd >= 0) {
+		err = export_ips(map_fd, AF_INET6, f);
+		close(map_fd);
+		if (err)
+			goto out;
+	}
+
+	map_fd = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_ETHERNET), NULL);
+	if (map_fd >= 0) {
+		err = map_for_each(map_fd, sizeof(struct mac_addr),
+				   sizeof(__u8), export_ether, f);
+		close(map_fd);
+		if (err)
+			goto out;
+	}
+
+	map_fd = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_FLOWS), NULL);
+	if (map_fd >= 0) {
+		err = map_for_each(map_fd, sizeof(struct flow_key),
+				   sizeof(__u8), export_flow, f);
 		close(map_fd);
+		if (err)
+			goto out;
+	}
+
+out:
+	if (f != stdout && fclose(f) && !err) {
+		err = -errno;
+		pr_warn("Couldn't write file '%s': %s\n", opt->filename,
+			strerror(-err));
+	}
 	return err;
 }
 
-static struct prog_option status_options[] = { END_OPTIONS };
+static const struct statusopt {
+	struct iface rules_iface;
+} defaults_status = {};
+
+static struct prog_option status_options[] = {
+	DEFINE_OPTION("iface", OPT_IFNAME, struct statusopt, rules_iface,
+		      .metavar = "<ifname>",
+		      .help = "Use the separate rules of <ifname> (see load --own-rules)"),
+	END_OPTIONS
+};
 
 int print_iface_status(const struct iface *iface, struct xdp_program *prog,
-		       enum xdp_attach_mode mode, __unused void *arg)
+		       enum xdp_attach_mode mode, void *arg)
 {
+	const char *pin_root_path = arg;
 	__u32 feat = 0;
 	int err;
 	printf("%s\n", xdp_program__name(prog));
@@ -930,21 +4056,55 @@ int print_iface_status(const struct iface *iface, struct xdp_program *prog,
 		char namebuf[100];
 
 		print_flags(featbuf, sizeof(featbuf), print_features, feat);
-		snprintf(namebuf, sizeof(namebuf), "%s (%s mode)", iface->ifname,
-			 get_enum_name(xdp_modes, mode));
+		snprintf(namebuf, sizeof(namebuf), "%s (%s mode%s)",
+			 iface->ifname, get_enum_name(xdp_modes, mode),
+			 hw_prefilter_loaded(pin_root_path, iface->ifname) ?
+			 ", hw prefilter" : "");
 		printf("  %-40s %s\n", namebuf, featbuf);
 	}
 	return 0;
 }
 
-int do_status(__unused const void *cfg, const char *pin_root_path)
+static int print_own_rules(const char *ifname, const char *rules_path,
+			   void *arg)
+{
+	unsigned int *count = arg;
+	int err;
+
+	if (!(*count)++) {
+		printf("Loaded with their own rules (see --iface):\n");
+		printf("  %-40s Enabled features\n", "");
+	}
+
+	pr_debug("Listing the programs using the rules of %s\n", ifname);
+	err = iterate_pinned_programs(rules_path, print_iface_status,
+				      (void *)rules_path);
+	return err == -ENOENT ? 0 : err;
+}
+
+int do_status(const void *cfg, const char *pin_root_path)
 {
-	int err = EXIT_SUCCESS, map_fd = -1;
+	int err = EXIT_SUCCESS, map_fd = -1, counter_fd = -1, cfg_fd = -1;
+	const struct statusopt *opt = cfg;
 	struct bpf_map_info info = {};
 	struct stats_record rec = {};
+	char rules_path[PATH_MAX];
+	unsigned int own = 0;
+
+	if (select_rules(rules_path, sizeof(rules_path), pin_root_path,
+			 &opt->rules_iface))
+		return EXIT_FAILURE;
+	pin_root_path = rules_path;
 
 	map_fd = get_pinned_map_fd(pin_root_path, textify(XDP_STATS_MAP_NAME), &info);
 	if (map_fd < 0) {
+		/* The shared rules may be unused while others are not */
+		if (!opt->rules_iface.ifname &&
+		    !iterate_own_rules(pin_root_path, print_own_rules, &own) &&
+		    own) {
+			err = EXIT_SUCCESS;
+			goto out;
+		}
 		err = map_fd;
 		pr_warn("Couldn't find stats map. Maybe xdp-filter is not loaded?\n");
 		goto out;
@@ -968,20 +4128,34 @@ int do_status(__unused const void *cfg, const char *pin_root_path)
 	printf("  %-40s Enabled features\n", "");
 
 	err = iterate_pinned_programs(pin_root_path, print_iface_status,
-				      NULL);
+				      (void *)pin_root_path);
 	if (err)
 		goto out;
 	printf("\n");
 
+	if (!opt->rules_iface.ifname) {
+		err = iterate_own_rules(pin_root_path, print_own_rules, &own);
+		if (err)
+			goto out;
+		if (own)
+			printf("\n");
+	}
+
 	map_fd = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_PORTS), NULL);
+	counter_fd = get_pinned_map_fd(pin_root_path,
+				       textify(MAP_NAME_PORT_COUNTERS), NULL);
 	if (map_fd >= 0) {
-		err = print_ports(map_fd);
+		err = print_ports(map_fd, counter_fd);
 		if (err)
 			goto out;
 		printf("\n");
 		close(map_fd);
 		map_fd = -1;
 	}
+	if (counter_fd >= 0) {
+		close(counter_fd);
+		counter_fd = -1;
+	}
 
 	err = print_ips();
 	if (err && err != -ENOENT)
@@ -990,22 +4164,71 @@ int do_status(__unused const void *cfg, const char *pin_root_path)
 	printf("\n");
 
 	map_fd = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_ETHERNET), NULL);
+	counter_fd = get_pinned_map_fd(pin_root_path,
+				       textify(MAP_NAME_ETHERNET_COUNTERS), NULL);
 	if (map_fd >= 0) {
-		err = print_ethers(map_fd);
+		err = print_ethers(map_fd, counter_fd);
 		if (err)
 			goto out;
+		close(map_fd);
+		map_fd = -1;
+	}
+	if (counter_fd >= 0) {
+		close(counter_fd);
+		counter_fd = -1;
 	}
 
 	printf("\n");
 
+	map_fd = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_FLOWS), NULL);
+	counter_fd = get_pinned_map_fd(pin_root_path,
+				       textify(MAP_NAME_FLOW_COUNTERS), NULL);
+	if (map_fd >= 0) {
+		err = print_flows(map_fd, counter_fd);
+		if (err)
+			goto out;
+		printf("\n");
+		close(map_fd);
+		map_fd = -1;
+	}
+	if (counter_fd >= 0) {
+		close(counter_fd);
+		counter_fd = -1;
+	}
+
+	map_fd = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_CONNTRACK), NULL);
+	if (map_fd >= 0) {
+		err = print_conntrack(map_fd);
+		if (err)
+			goto out;
+		printf("\n");
+		close(map_fd);
+		map_fd = -1;
+	}
+
+	map_fd = get_pinned_map_fd(pin_root_path, textify(MAP_NAME_RATELIMIT), NULL);
+	cfg_fd = get_pinned_map_fd(pin_root_path,
+				   textify(MAP_NAME_RATELIMIT_CFG), NULL);
+	if (map_fd >= 0 && cfg_fd >= 0) {
+		err = print_ratelimit(cfg_fd, map_fd);
+		if (err)
+			goto out;
+		printf("\n");
+	}
+
 out:
 	if (map_fd >= 0)
 		close(map_fd);
+	if (counter_fd >= 0)
+		close(counter_fd);
+	if (cfg_fd >= 0)
+		close(cfg_fd);
 	return err;
 }
 
 static const struct pollopt {
 	__u32 interval;
+	struct iface rules_iface;
 } defaults_poll = { .interval = 1000 };
 
 static struct prog_option poll_options[] = {
@@ -1013,14 +4236,23 @@ static struct prog_option poll_options[] = {
 		      .short_opt = 'i',
 		      .metavar = "<interval>",
 		      .help = "Polling interval in milliseconds (default 1000)"),
+	DEFINE_OPTION("iface", OPT_IFNAME, struct pollopt, rules_iface,
+		      .metavar = "<ifname>",
+		      .help = "Use the separate rules of <ifname> (see load --own-rules)"),
 	END_OPTIONS
 };
 
 int do_poll(const void *cfg, const char *pin_root_path)
 {
+	char rules_path[PATH_MAX];
 	int err = 0, map_fd = -1;
 	const struct pollopt *opt = cfg;
 
+	if (select_rules(rules_path, sizeof(rules_path), pin_root_path,
+			 &opt->rules_iface))
+		return EXIT_FAILURE;
+	pin_root_path = rules_path;
+
 	if (!opt->interval) {
 		err = -EINVAL;
 		pr_warn("Can't use a polling interval of 0\n");
@@ -1057,6 +4289,10 @@ int do_help(__unused const void *cfg, __unused const char *pin_root_path)
 		"       port        - add a port to the filter list\n"
 		"       ip          - add an IP address to the filter list\n"
 		"       ether       - add an Ethernet MAC address to the filter list\n"
+		"       flow        - add an address and port combination to the filter list\n"
+		"       ratelimit   - set the per-source rate limit\n"
+		"       import      - add rules from a file to the filter lists\n"
+		"       export      - write the current filter lists to a file\n"
 		"       status      - show current xdp-filter status\n"
 		"       poll        - poll statistics output\n"
 		"       help        - show this help message\n"
@@ -1071,8 +4307,12 @@ static const struct prog_command cmds[] = {
 	DEFINE_COMMAND(port, "Add or remove ports from xdp-filter"),
 	DEFINE_COMMAND(ip, "Add or remove IP addresses from xdp-filter"),
 	DEFINE_COMMAND(ether, "Add or remove MAC addresses from xdp-filter"),
+	DEFINE_COMMAND(flow, "Add or remove flows from xdp-filter"),
+	DEFINE_COMMAND(ratelimit, "Set the per-source rate limit of xdp-filter"),
+	DEFINE_COMMAND(import, "Add rules from a file to xdp-filter"),
+	DEFINE_COMMAND(export, "Write the xdp-filter rules to a file"),
 	DEFINE_COMMAND(poll, "Poll xdp-filter statistics"),
-	DEFINE_COMMAND_NODEF(status, "Show xdp-filter status"),
+	DEFINE_COMMAND(status, "Show xdp-filter status"),
 	{ .name = "help", .func = do_help, .no_cfg = true },
 	END_COMMANDS
 };
@@ -1083,6 +4323,11 @@ union all_opts {
 	struct portopt port;
 	struct ipopt ip;
 	struct etheropt ether;
+	struct flowopt flow;
+	struct ratelimitopt ratelimit;
+	struct importopt import;
+	struct exportopt export;
+	struct statusopt status;
 	struct pollopt poll;
 };
 
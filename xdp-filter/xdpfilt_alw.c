@@ -0,0 +1,5 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#define FILT_MODE_ALLOW
+#define FUNCNAME xdpfilt_alw
+#include "xdpfilt_prog.h"
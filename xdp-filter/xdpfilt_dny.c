@@ -0,0 +1,5 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#define FILT_MODE_DENY
+#define FUNCNAME xdpfilt_dny
+#include "xdpfilt_prog.h"
@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Prefilter offloaded to the NIC next to xdp-filter in allow mode. It drops
+ * packets matching the port and ethernet rules, so they never take up host
+ * CPU time, and passes everything else on to the full filter on the host,
+ * which checks the same rules (and all the others) again.
+ *
+ * Offloaded programs can only use maps on the device, so userspace mirrors
+ * the rules from the host maps into the maps here. They are smaller, and
+ * there are no hit counters, since offloaded maps are not per-CPU.
+ */
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+
+#include "common_kern_user.h"
+#include "xdp/parsing_helpers.h"
+
+struct ethaddr {
+	__u8 addr[ETH_ALEN];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, HW_MAP_MAX_ENTRIES);
+	__type(key, __u32);
+	__type(value, __u8);
+} MAP_NAME_HW_PORTS SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, HW_MAP_MAX_ENTRIES);
+	__type(key, struct ethaddr);
+	__type(value, __u8);
+} MAP_NAME_HW_ETHERNET SEC(".maps");
+
+static int __always_inline rule_match(void *map, void *key, __u8 mask)
+{
+	__u8 *value;
+
+	value = bpf_map_lookup_elem(map, key);
+	return value && (*value & mask) == mask;
+}
+
+static int __always_inline port_match(__u16 sport, __u16 dport, __u8 proto)
+{
+	__u32 key;
+
+	key = dport;
+	if (rule_match(&MAP_NAME_HW_PORTS, &key, MAP_FLAG_DST | proto))
+		return 1;
+	key = sport;
+	return rule_match(&MAP_NAME_HW_PORTS, &key, MAP_FLAG_SRC | proto);
+}
+
+SEC("xdp")
+int xdpfilt_hw(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct ethaddr addr = {};
+	struct ipv6hdr *ipv6hdr;
+	struct hdr_cursor nh;
+	struct udphdr *udphdr;
+	struct tcphdr *tcphdr;
+	struct iphdr *iphdr;
+	struct ethhdr *eth;
+	int eth_type, ip_type;
+
+	nh.pos = data;
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type < 0)
+		return XDP_PASS;
+
+	__builtin_memcpy(&addr, eth->h_dest, sizeof(addr));
+	if (rule_match(&MAP_NAME_HW_ETHERNET, &addr, MAP_FLAG_DST))
+		return XDP_DROP;
+	__builtin_memcpy(&addr, eth->h_source, sizeof(addr));
+	if (rule_match(&MAP_NAME_HW_ETHERNET, &addr, MAP_FLAG_SRC))
+		return XDP_DROP;
+
+	if (eth_type == bpf_htons(ETH_P_IP))
+		ip_type = parse_iphdr(&nh, data_end, &iphdr);
+	else if (eth_type == bpf_htons(ETH_P_IPV6))
+		ip_type = parse_ip6hdr(&nh, data_end, &ipv6hdr);
+	else
+		return XDP_PASS;
+
+	if (ip_type == IPPROTO_TCP) {
+		if (parse_tcphdr(&nh, data_end, &tcphdr) >= 0 &&
+		    port_match(tcphdr->source, tcphdr->dest, MAP_FLAG_TCP))
+			return XDP_DROP;
+	} else if (ip_type == IPPROTO_UDP) {
+		if (parse_udphdr(&nh, data_end, &udphdr) >= 0 &&
+		    port_match(udphdr->source, udphdr->dest, MAP_FLAG_UDP))
+			return XDP_DROP;
+	}
+
+	return XDP_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
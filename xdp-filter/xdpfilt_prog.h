@@ -1,9 +1,10 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 
 /* XDP filter program fragment. This header file contains the full-featured
- * program, split up with ifdefs. The actual program files xdpfilt_*.c
- * include this file with different #defines to create the
- * different eBPF program sections that include only the needed features.
+ * program. The actual program files xdpfilt_*.c include this file with
+ * different #defines to create one program for each policy mode. The
+ * features to use are selected when loading the program, through the
+ * filt_features variable below.
  */
 
 #ifndef __XDPFILT_PROG_H
@@ -11,6 +12,7 @@
 
 #include <linux/bpf.h>
 #include <linux/in.h>
+#include <linux/in6.h>
 #include <bpf/bpf_helpers.h>
 #include <xdp/xdp_helpers.h>
 
@@ -18,6 +20,8 @@
 
 /* Defines xdp_stats_map */
 #include "xdp/xdp_stats_kern.h"
+/* Defines xdp_parse_ctx, for running in the parsing dispatcher */
+#define XDP_USE_PARSE_CTX
 #include "xdp/parsing_helpers.h"
 
 #ifdef FILT_MODE_DENY
@@ -30,6 +34,14 @@
 #define FEATURE_OPMODE FEAT_ALLOW
 #endif
 
+/* Set by userspace before loading. This lives in the read-only data section,
+ * so the verifier knows its value and removes the lookups of all disabled
+ * features from the program before it is JIT'ed.
+ */
+volatile const __u32 filt_features = FEAT_ALL;
+
+#define FEATURE_ENABLED(feat) (filt_features & (feat))
+
 #define CHECK_RET(ret)                        \
 	do {                                  \
 		if ((ret) < 0) {              \
@@ -44,146 +56,516 @@
 			goto out;                                            \
 	} while (0)
 
-#define CHECK_MAP(map, key, mask)                               \
-	do {                                                    \
-		__u64 *value;                                   \
-		value = bpf_map_lookup_elem(map, key);          \
-		if ((value) && (*(value) & (mask)) == (mask)) { \
-			*value += (1 << COUNTER_SHIFT);         \
-			return VERDICT_HIT;                     \
-		}                                               \
+#define CHECK_MAP(map, counters, key, mask)                           \
+	do {                                                          \
+		__u64 *counter;                                       \
+		__u8 *value;                                          \
+		value = bpf_map_lookup_elem(map, key);                \
+		if ((value) && (*(value) & (mask)) == (mask)) {       \
+			counter = bpf_map_lookup_elem(counters, key); \
+			if (counter)                                  \
+				*counter += 1;                        \
+			return VERDICT_HIT;                           \
+		}                                                     \
 	} while (0)
 
-#if defined(FILT_MODE_TCP) || defined(FILT_MODE_UDP)
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 65536);
+	__type(key, __u32);
+	__type(value, __u8);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} MAP_NAME_PORTS SEC(".maps");
+
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__uint(max_entries, 65536);
 	__type(key, __u32);
 	__type(value, __u64);
 	__uint(pinning, LIBBPF_PIN_BY_NAME);
-} MAP_NAME_PORTS SEC(".maps");
+} MAP_NAME_PORT_COUNTERS SEC(".maps");
 
-#ifdef FILT_MODE_TCP
 static int __always_inline lookup_verdict_tcp(struct tcphdr *tcphdr)
 {
 	__u32 key;
 
 	key = tcphdr->dest;
-	CHECK_MAP(&filter_ports, &key, MAP_FLAG_DST | MAP_FLAG_TCP);
+	CHECK_MAP(&filter_ports, &filter_port_counters, &key,
+		  MAP_FLAG_DST | MAP_FLAG_TCP);
 	key = tcphdr->source;
-	CHECK_MAP(&filter_ports, &key, MAP_FLAG_SRC | MAP_FLAG_TCP);
+	CHECK_MAP(&filter_ports, &filter_port_counters, &key,
+		  MAP_FLAG_SRC | MAP_FLAG_TCP);
 	return VERDICT_MISS;
 }
-#define FEATURE_TCP FEAT_TCP
-#else
-#define FEATURE_TCP 0
-#endif
 
-#ifdef FILT_MODE_UDP
 static int __always_inline lookup_verdict_udp(struct udphdr *udphdr)
 {
 	__u32 key;
 
 	key = udphdr->dest;
-	CHECK_MAP(&filter_ports, &key, MAP_FLAG_DST | MAP_FLAG_UDP);
+	CHECK_MAP(&filter_ports, &filter_port_counters, &key,
+		  MAP_FLAG_DST | MAP_FLAG_UDP);
 	key = udphdr->source;
-	CHECK_MAP(&filter_ports, &key, MAP_FLAG_SRC | MAP_FLAG_UDP);
+	CHECK_MAP(&filter_ports, &filter_port_counters, &key,
+		  MAP_FLAG_SRC | MAP_FLAG_UDP);
 	return VERDICT_MISS;
 }
-#define FEATURE_UDP FEAT_UDP
-#else
-#define FEATURE_UDP 0
-#endif
 
-#else
-#define FEATURE_UDP 0
-#define FEATURE_TCP 0
-#endif /* TCP || UDP */
-
-#ifdef FILT_MODE_IPV4
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
-	__uint(max_entries, 10000);
+	__uint(max_entries, IP_COUNTER_MAX_ENTRIES);
 	__type(key, __u32);
 	__type(value, __u64);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} MAP_NAME_IP_COUNTERS SEC(".maps");
+
+#define CHECK_LPM_MAP(map, key)                                         \
+	do {                                                            \
+		struct ip_lpm_val *value;                               \
+		__u64 *counter;                                         \
+		value = bpf_map_lookup_elem(map, key);                  \
+		if (value) {                                            \
+			counter = bpf_map_lookup_elem(&filter_ip_counters, \
+						      &value->counter_id); \
+			if (counter)                                    \
+				*counter += 1;                          \
+			return VERDICT_HIT;                             \
+		}                                                       \
+	} while (0)
+
+struct ipv4_rules {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, IP_MAP_MAX_ENTRIES);
+	__type(key, struct ipv4_lpm_key);
+	__type(value, struct ip_lpm_val);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} filter_ipv4_rules SEC(".maps");
+
+/* The rule trie is only referenced through this map, so userspace can swap in
+ * a whole new rule set with a single update.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(max_entries, 1);
+	__type(key, __u32);
 	__uint(pinning, LIBBPF_PIN_BY_NAME);
-} MAP_NAME_IPV4 SEC(".maps");
+	__array(values, struct ipv4_rules);
+} MAP_NAME_IPV4 SEC(".maps") = {
+	.values = { &filter_ipv4_rules },
+};
+
+struct ipv4_bloom {
+	__uint(type, BPF_MAP_TYPE_BLOOM_FILTER);
+	__uint(max_entries, IP_MAP_MAX_ENTRIES);
+	__type(value, struct ipv4_bloom_key);
+};
+
+/* No initial filter: the datapath does full lookups until userspace has
+ * filled one in from the rules.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+	__array(values, struct ipv4_bloom);
+} MAP_NAME_IPV4_BLOOM SEC(".maps");
+
+static void *__always_inline bloom_get(void *outer)
+{
+	__u32 zero = 0;
+
+	if (!FEATURE_ENABLED(FEAT_BLOOM))
+		return NULL;
+	return bpf_map_lookup_elem(outer, &zero);
+}
+
+static int __always_inline bloom_miss_ipv4(void *bloom, __u32 mode,
+					   __u32 addr)
+{
+	__u32 mask = bpf_htonl(0xffffffffU << (32 - BLOOM_PREFIXLEN_V4));
+	struct ipv4_bloom_key key = {
+		.mode = mode,
+		.addr = addr & mask,
+	};
+
+	return bloom && bpf_map_peek_elem(bloom, &key);
+}
 
 static int __always_inline lookup_verdict_ipv4(struct iphdr *iphdr)
 {
-	__u32 addr;
-	addr = iphdr->daddr;
-	CHECK_MAP(&filter_ipv4, &addr, MAP_FLAG_DST);
-	addr = iphdr->saddr;
-	CHECK_MAP(&filter_ipv4, &addr, MAP_FLAG_SRC);
+	struct ipv4_lpm_key key = {
+		.prefixlen = LPM_MODE_BITS + 32,
+		.mode = MAP_FLAG_DST,
+		.addr = iphdr->daddr,
+	};
+	void *rules, *bloom;
+	__u32 zero = 0;
+
+	rules = bpf_map_lookup_elem(&filter_ipv4, &zero);
+	if (!rules)
+		return VERDICT_MISS;
+	bloom = bloom_get(&filter_ipv4_bloom);
+
+	if (!bloom_miss_ipv4(bloom, MAP_FLAG_DST, iphdr->daddr))
+		CHECK_LPM_MAP(rules, &key);
+	key.mode = MAP_FLAG_SRC;
+	key.addr = iphdr->saddr;
+	if (!bloom_miss_ipv4(bloom, MAP_FLAG_SRC, iphdr->saddr))
+		CHECK_LPM_MAP(rules, &key);
 	return VERDICT_MISS;
 }
 
-#define CHECK_VERDICT_IPV4(param) CHECK_VERDICT(ipv4, param)
-#define FEATURE_IPV4 FEAT_IPV4
-#else
-#define FEATURE_IPV4 0
-#define CHECK_VERDICT_IPV4(param)
-#endif /* FILT_MODE_IPV4 */
+struct ipv6_rules {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__uint(max_entries, IP_MAP_MAX_ENTRIES);
+	__type(key, struct ipv6_lpm_key);
+	__type(value, struct ip_lpm_val);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+} filter_ipv6_rules SEC(".maps");
 
-#ifdef FILT_MODE_IPV6
 struct {
-	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
-	__uint(max_entries, 10000);
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+	__array(values, struct ipv6_rules);
+} MAP_NAME_IPV6 SEC(".maps") = {
+	.values = { &filter_ipv6_rules },
+};
+
+struct ipv6_bloom {
+	__uint(type, BPF_MAP_TYPE_BLOOM_FILTER);
+	__uint(max_entries, IP_MAP_MAX_ENTRIES);
+	__type(value, struct ipv6_bloom_key);
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+	__array(values, struct ipv6_bloom);
+} MAP_NAME_IPV6_BLOOM SEC(".maps");
+
+static int __always_inline bloom_miss_ipv6(void *bloom, __u32 mode,
+					   struct in6_addr *addr)
+{
+	struct ipv6_bloom_key key = { .mode = mode };
+	int i, bits;
+
+	if (!bloom)
+		return 0;
+
+	/* Unrolled, with the masks known at compile time */
+	for (i = 0; i < 4; i++) {
+		bits = BLOOM_PREFIXLEN_V6 - i * 32;
+		if (bits >= 32)
+			key.addr.in6_u.u6_addr32[i] = addr->in6_u.u6_addr32[i];
+		else if (bits > 0)
+			key.addr.in6_u.u6_addr32[i] = addr->in6_u.u6_addr32[i] &
+				bpf_htonl(0xffffffffU << (32 - bits));
+	}
+
+	return bpf_map_peek_elem(bloom, &key);
+}
+
+static int __always_inline lookup_verdict_ipv6(struct ipv6hdr *ipv6hdr)
+{
+	struct ipv6_lpm_key key = {
+		.prefixlen = LPM_MODE_BITS + 128,
+		.mode = MAP_FLAG_DST,
+	};
+	void *rules, *bloom;
+	__u32 zero = 0;
+
+	rules = bpf_map_lookup_elem(&filter_ipv6, &zero);
+	if (!rules)
+		return VERDICT_MISS;
+	bloom = bloom_get(&filter_ipv6_bloom);
+
+	key.addr = ipv6hdr->daddr;
+	if (!bloom_miss_ipv6(bloom, MAP_FLAG_DST, &key.addr))
+		CHECK_LPM_MAP(rules, &key);
+	key.mode = MAP_FLAG_SRC;
+	key.addr = ipv6hdr->saddr;
+	if (!bloom_miss_ipv6(bloom, MAP_FLAG_SRC, &key.addr))
+		CHECK_LPM_MAP(rules, &key);
+	return VERDICT_MISS;
+}
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct ratelimit_cfg);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} MAP_NAME_RATELIMIT_CFG SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__uint(max_entries, RL_MAP_MAX_ENTRIES);
 	__type(key, struct in6_addr);
+	__type(value, struct ratelimit_bucket);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} MAP_NAME_RATELIMIT SEC(".maps");
+
+static struct in6_addr *__always_inline rl_addr_ipv4(struct in6_addr *buf,
+						     struct iphdr *iphdr)
+{
+	buf->in6_u.u6_addr32[2] = bpf_htonl(0xffff);
+	buf->in6_u.u6_addr32[3] = iphdr->saddr;
+	return buf;
+}
+
+/* The header is bounds checked already, so the source address is used as the
+ * key right where it is in the packet.
+ */
+static struct in6_addr *__always_inline rl_addr_ipv6(struct in6_addr *buf,
+						     struct ipv6hdr *ipv6hdr)
+{
+	return &ipv6hdr->saddr;
+}
+
+static int __always_inline ratelimit_exceeded(struct in6_addr *addr,
+					      __u64 len)
+{
+	struct ratelimit_bucket *bucket, new = {};
+	struct ratelimit_cfg *cfg;
+	__u64 now, pkt_tat, byte_tat;
+	__u32 zero = 0;
+
+	cfg = bpf_map_lookup_elem(&filter_ratelimit_cfg, &zero);
+	if (!cfg || (!cfg->pkt_cost_ns && !cfg->byte_cost_ps))
+		return 0;
+
+	now = bpf_ktime_get_ns();
+	bucket = bpf_map_lookup_elem(&filter_ratelimit, addr);
+	if (!bucket) {
+		new.pkt_tat = now;
+		new.byte_tat = now;
+		bpf_map_update_elem(&filter_ratelimit, addr, &new, BPF_NOEXIST);
+		bucket = bpf_map_lookup_elem(&filter_ratelimit, addr);
+		if (!bucket)
+			return 0;
+	}
+
+	/* The buckets are per-CPU, so there's no need for atomics */
+	pkt_tat = bucket->pkt_tat > now ? bucket->pkt_tat : now;
+	byte_tat = bucket->byte_tat > now ? bucket->byte_tat : now;
+	if ((cfg->pkt_cost_ns && pkt_tat - now > cfg->burst_ns) ||
+	    (cfg->byte_cost_ps && byte_tat - now > cfg->burst_ns)) {
+		bucket->dropped++;
+		return 1;
+	}
+
+	bucket->pkt_tat = pkt_tat + cfg->pkt_cost_ns;
+	bucket->byte_tat = byte_tat + len * cfg->byte_cost_ps / 1000;
+	return 0;
+}
+
+#define CHECK_RATELIMIT(type, hdr)                                    \
+	do {                                                          \
+		struct in6_addr rl_buf = {};                          \
+		if (ratelimit_exceeded(rl_addr_##type(&rl_buf, hdr),  \
+				       data_end - data)) {            \
+			action = XDP_DROP;                            \
+			goto out;                                     \
+		}                                                     \
+	} while (0)
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, FLOW_MAP_MAX_ENTRIES);
+	__type(key, struct flow_key);
+	__type(value, __u8);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} MAP_NAME_FLOWS SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(max_entries, FLOW_MAP_MAX_ENTRIES);
+	__type(key, struct flow_key);
 	__type(value, __u64);
 	__uint(pinning, LIBBPF_PIN_BY_NAME);
-} MAP_NAME_IPV6 SEC(".maps");
+} MAP_NAME_FLOW_COUNTERS SEC(".maps");
 
-static int __always_inline lookup_verdict_ipv6(struct ipv6hdr *ipv6hdr)
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, __u32);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} MAP_NAME_FLOW_MASKS SEC(".maps");
+
+/* TCP and UDP headers both start with the port numbers */
+struct l4ports {
+	__be16 source;
+	__be16 dest;
+};
+
+static void __always_inline flow_key_ipv4(struct flow_key *key,
+					  struct iphdr *iphdr)
+{
+	key->saddr.in6_u.u6_addr32[2] = bpf_htonl(0xffff);
+	key->saddr.in6_u.u6_addr32[3] = iphdr->saddr;
+	key->daddr.in6_u.u6_addr32[2] = bpf_htonl(0xffff);
+	key->daddr.in6_u.u6_addr32[3] = iphdr->daddr;
+}
+
+static void __always_inline flow_key_ipv6(struct flow_key *key,
+					  struct ipv6hdr *ipv6hdr)
 {
-	struct in6_addr addr;
+	key->saddr = ipv6hdr->saddr;
+	key->daddr = ipv6hdr->daddr;
+}
+
+/* Only TCP and UDP packets get a complete key; for everything else, fields
+ * stays zero and the flow rules and connection tracking don't apply.
+ */
+static int __always_inline flow_key_ports(struct flow_key *key,
+					  struct hdr_cursor *nh,
+					  void *data_end, int ip_type)
+{
+	struct l4ports *ports = nh->pos;
+
+	if (ip_type != IPPROTO_TCP && ip_type != IPPROTO_UDP)
+		return 0;
 
-	addr = ipv6hdr->daddr;
-	CHECK_MAP(&filter_ipv6, &addr, MAP_FLAG_DST);
-	addr = ipv6hdr->saddr;
-	CHECK_MAP(&filter_ipv6, &addr, MAP_FLAG_SRC);
+	if (ports + 1 > data_end)
+		return -1;
+
+	key->fields = FLOW_FIELDS_ALL;
+	key->proto = ip_type;
+	key->sport = ports->source;
+	key->dport = ports->dest;
+	return 0;
+}
+
+static int __always_inline lookup_verdict_flow(struct flow_key *pkt)
+{
+	__u32 zero = 0, *masks, used, i;
+	struct flow_key key;
+	__u8 proto;
+
+	if (!pkt->fields)
+		return VERDICT_MISS;
+
+	masks = bpf_map_lookup_elem(&filter_flow_masks, &zero);
+	if (!masks || !*masks)
+		return VERDICT_MISS;
+
+	used = *masks;
+	proto = pkt->proto == IPPROTO_TCP ? MAP_FLAG_TCP : MAP_FLAG_UDP;
+
+	/* One exact-match lookup for each combination of fields that the
+	 * rules use, with the other fields masked out.
+	 */
+	for (i = 0; i < FLOW_MAX_MASKS; i++) {
+		if (!(used & (1U << i)))
+			continue;
+
+		__builtin_memset(&key, 0, sizeof(key));
+		key.fields = i;
+		if (i & FLOW_FIELD_SADDR)
+			key.saddr = pkt->saddr;
+		if (i & FLOW_FIELD_DADDR)
+			key.daddr = pkt->daddr;
+		if (i & FLOW_FIELD_SPORT)
+			key.sport = pkt->sport;
+		if (i & FLOW_FIELD_DPORT)
+			key.dport = pkt->dport;
+		CHECK_MAP(&filter_flows, &filter_flow_counters, &key, proto);
+	}
 	return VERDICT_MISS;
 }
 
-#define CHECK_VERDICT_IPV6(param) CHECK_VERDICT(ipv6, param)
-#define FEATURE_IPV6 FEAT_IPV6
-#else
-#define FEATURE_IPV6 0
-#define CHECK_VERDICT_IPV6(param)
-#endif /* FILT_MODE_IPV6 */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, CT_MAP_MAX_ENTRIES);
+	__type(key, struct flow_key);
+	__type(value, __u64);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} MAP_NAME_CONNTRACK SEC(".maps");
+
+/* A connection is established if any of its packets passed the filter within
+ * the timeout. The timestamp is only refreshed once in a while, so packets of
+ * busy connections on different CPUs don't keep dirtying the entry.
+ */
+static int __always_inline ct_established(struct flow_key *key, __u64 now)
+{
+	__u64 *last_seen;
+
+	if (!key->fields)
+		return 0;
+
+	last_seen = bpf_map_lookup_elem(&filter_conntrack, key);
+	if (!last_seen || now - *last_seen > CT_TIMEOUT_NS)
+		return 0;
+
+	if (now - *last_seen > CT_REFRESH_NS)
+		*last_seen = now;
+	return 1;
+}
+
+static void __always_inline ct_record(struct flow_key *key, __u64 now)
+{
+	if (key->fields)
+		bpf_map_update_elem(&filter_conntrack, key, &now, BPF_ANY);
+}
+
+#define CHECK_CONNTRACK(key)                       \
+	do {                                       \
+		now = bpf_ktime_get_ns();          \
+		if (ct_established(key, now)) {    \
+			tracked = 1;               \
+			action = XDP_PASS;         \
+			goto out;                  \
+		}                                  \
+	} while (0)
+
+/* Userspace always enables flow together with conntrack, which needs the key */
+#define FLOW_KEY(type, hdr)                                                 \
+	do {                                                                \
+		flow_key_##type(&flow, hdr);                                \
+		CHECK_RET(flow_key_ports(&flow, &nh, data_end, ip_type));   \
+		if (FEATURE_ENABLED(FEAT_CONNTRACK))                        \
+			CHECK_CONNTRACK(&flow);                             \
+	} while (0)
 
-#ifdef FILT_MODE_ETHERNET
 struct ethaddr {
 	__u8 addr[ETH_ALEN];
 };
 
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, ETHERNET_MAP_MAX_ENTRIES);
+	__type(key, struct ethaddr);
+	__type(value, __u8);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} MAP_NAME_ETHERNET SEC(".maps");
+
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
-	__uint(max_entries, 10000);
+	__uint(max_entries, ETHERNET_MAP_MAX_ENTRIES);
 	__type(key, struct ethaddr);
 	__type(value, __u64);
 	__uint(pinning, LIBBPF_PIN_BY_NAME);
-} MAP_NAME_ETHERNET SEC(".maps");
+} MAP_NAME_ETHERNET_COUNTERS SEC(".maps");
 
+/* The ethernet header has been bounds checked by the parser, and both
+ * addresses have the layout of the map key, so they are looked up in place.
+ */
 static int __always_inline lookup_verdict_ethernet(struct ethhdr *eth)
 {
-	struct ethaddr addr = {};
-
-	__builtin_memcpy(&addr, eth->h_dest, sizeof(addr));
-	CHECK_MAP(&filter_ethernet, &addr, MAP_FLAG_DST);
-	__builtin_memcpy(&addr, eth->h_source, sizeof(addr));
-	CHECK_MAP(&filter_ethernet, &addr, MAP_FLAG_SRC);
+	CHECK_MAP(&filter_ethernet, &filter_eth_counters, eth->h_dest,
+		  MAP_FLAG_DST);
+	CHECK_MAP(&filter_ethernet, &filter_eth_counters, eth->h_source,
+		  MAP_FLAG_SRC);
 	return VERDICT_MISS;
 }
 
-#define CHECK_VERDICT_ETHERNET(param) CHECK_VERDICT(ethernet, param)
-#define FEATURE_ETHERNET FEAT_ETHERNET
-#else
-#define FEATURE_ETHERNET 0
-#define CHECK_VERDICT_ETHERNET(param)
-#endif /* FILT_MODE_ETHERNET */
-
 #ifndef FUNCNAME
 #define FUNCNAME xdp_filt_unknown
 #endif
@@ -199,57 +581,90 @@ int FUNCNAME(struct xdp_md *ctx)
 	void *data_end = (void *)(long)ctx->data_end;
 	void *data = (void *)(long)ctx->data;
 	__u32 action = VERDICT_MISS; /* Default action */
+	struct xdp_parse_ctx *pctx;
+	struct flow_key flow = {};
+	struct ipv6hdr *ipv6hdr;
 	struct hdr_cursor nh;
+	struct udphdr *udphdr;
+	struct tcphdr *tcphdr;
+	struct iphdr *iphdr;
 	struct ethhdr *eth;
-	int eth_type;
+	int eth_type, ip_type, inner_type;
+	int tracked = 0;
+	__u64 now = 0;
 
 	nh.pos = data;
-	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	pctx = parse_ctx_get(ctx);
+	if (pctx)
+		eth_type = parse_ctx_ethhdr(pctx, &nh, data_end, &eth);
+	else
+		eth_type = parse_ethhdr(&nh, data_end, &eth);
 	CHECK_RET(eth_type);
-	CHECK_VERDICT_ETHERNET(eth);
+	if (FEATURE_ENABLED(FEAT_ETHERNET))
+		CHECK_VERDICT(ethernet, eth);
+
+	if (!FEATURE_ENABLED(FEAT_IPV4 | FEAT_IPV6 | FEAT_TCP | FEAT_UDP |
+			     FEAT_FLOW | FEAT_RATELIMIT))
+		goto out;
+
+	/* All the rules past the ethernet ones match the inner headers of
+	 * encapsulated packets
+	 */
+	if (FEATURE_ENABLED(FEAT_TUNNEL)) {
+		inner_type = skip_tunnel(&nh, data_end, eth_type);
+		if (inner_type) {
+			eth_type = inner_type;
+			pctx = NULL; /* only covers the outer headers */
+		}
+	}
 
-#if defined(FILT_MODE_IPV4) || defined(FILT_MODE_IPV6) || \
-	defined(FILT_MODE_TCP) || defined(FILT_MODE_UDP)
-	struct iphdr *iphdr;
-	struct ipv6hdr *ipv6hdr;
-	int ip_type;
 	if (eth_type == bpf_htons(ETH_P_IP)) {
-		ip_type = parse_iphdr(&nh, data_end, &iphdr);
+		ip_type = pctx ? parse_ctx_iphdr(pctx, &nh, data_end, &iphdr) :
+			       parse_iphdr(&nh, data_end, &iphdr);
 		CHECK_RET(ip_type);
 
-		CHECK_VERDICT_IPV4(iphdr);
+		if (FEATURE_ENABLED(FEAT_RATELIMIT))
+			CHECK_RATELIMIT(ipv4, iphdr);
+		if (FEATURE_ENABLED(FEAT_FLOW))
+			FLOW_KEY(ipv4, iphdr);
+		if (FEATURE_ENABLED(FEAT_IPV4))
+			CHECK_VERDICT(ipv4, iphdr);
 	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
-		ip_type = parse_ip6hdr(&nh, data_end, &ipv6hdr);
+		ip_type = pctx ? parse_ctx_ip6hdr(pctx, &nh, data_end, &ipv6hdr) :
+			       parse_ip6hdr(&nh, data_end, &ipv6hdr);
 		CHECK_RET(ip_type);
 
-		CHECK_VERDICT_IPV6(ipv6hdr);
+		if (FEATURE_ENABLED(FEAT_RATELIMIT))
+			CHECK_RATELIMIT(ipv6, ipv6hdr);
+		if (FEATURE_ENABLED(FEAT_FLOW))
+			FLOW_KEY(ipv6, ipv6hdr);
+		if (FEATURE_ENABLED(FEAT_IPV6))
+			CHECK_VERDICT(ipv6, ipv6hdr);
 	} else {
 		goto out;
 	}
 
-#ifdef FILT_MODE_UDP
-	struct udphdr *udphdr;
-	if (ip_type == IPPROTO_UDP) {
+	if (FEATURE_ENABLED(FEAT_UDP) && ip_type == IPPROTO_UDP) {
 		CHECK_RET(parse_udphdr(&nh, data_end, &udphdr));
 		CHECK_VERDICT(udp, udphdr);
 	}
-#endif /* FILT_MODE_UDP */
 
-#ifdef FILT_MODE_TCP
-	struct tcphdr *tcphdr;
-	if (ip_type == IPPROTO_TCP) {
+	if (FEATURE_ENABLED(FEAT_TCP) && ip_type == IPPROTO_TCP) {
 		CHECK_RET(parse_tcphdr(&nh, data_end, &tcphdr));
 		CHECK_VERDICT(tcp, tcphdr);
 	}
-#endif /* FILT_MODE_TCP*/
-#endif /* FILT_MODE_{IPV4,IPV6,TCP,UDP} */
+
+	if (FEATURE_ENABLED(FEAT_FLOW))
+		CHECK_VERDICT(flow, &flow);
 out:
+	if (FEATURE_ENABLED(FEAT_CONNTRACK) && action == XDP_PASS && !tracked)
+		ct_record(&flow, now);
 	return xdp_stats_record_action(ctx, action);
 }
 
 char _license[] SEC("license") = "GPL";
-__u32 _features SEC("features") = (FEATURE_ETHERNET | FEATURE_IPV4 |
-				   FEATURE_IPV6 | FEATURE_UDP | FEATURE_TCP |
+__u32 _features SEC("features") = (FEAT_ALL | FEAT_FLOW | FEAT_CONNTRACK |
+				   FEAT_RATELIMIT | FEAT_TUNNEL | FEAT_BLOOM |
 				   FEATURE_OPMODE);
 
 #else
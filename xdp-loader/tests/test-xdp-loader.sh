@@ -1,5 +1,5 @@
 XDP_LOADER=${XDP_LOADER:-./xdp-loader}
-ALL_TESTS="test_load test_section test_prog_name test_load_multi test_load_incremental"
+ALL_TESTS="test_load test_section test_prog_name test_load_multi test_load_incremental test_load_extra_dev test_status_stats test_load_link test_incremental_update test_load_tail_call test_load_frags test_apply"
 
 test_load()
 {
@@ -73,7 +73,252 @@ test_load_incremental()
     return $ret
 }
 
+test_load_extra_dev()
+{
+    skip_if_legacy_fallback
+
+    local dispatcher
+
+    check_run ip link add dev btest0 type veth peer name btest1
+    check_run $XDP_LOADER load $NS -d btest0 -d btest1 $TEST_PROG_DIR/xdp_drop.o $TEST_PROG_DIR/xdp_pass.o -vv
+    check_progs_loaded $NS 2
+
+    # interfaces without programs share the dispatcher of the first one
+    dispatcher=$($XDP_LOADER status $NS | grep xdp_dispatcher | awk '{print $4}')
+    for iface in btest0 btest1; do
+        if [ "$($XDP_LOADER status $iface | grep xdp_dispatcher | awk '{print $4}')" != "$dispatcher" ]; then
+            echo "Expected $iface to share the dispatcher of $NS"
+            exit 1
+        fi
+    done
+
+    for iface in btest0 btest1; do
+        if [ "$($XDP_LOADER status $iface | grep -c '=>')" -ne "2" ]; then
+            echo "Expected 2 programs loaded on $iface"
+            exit 1
+        fi
+        check_run $XDP_LOADER unload $iface --all -vv
+    done
+    check_run $XDP_LOADER unload $NS --all -vv
+    ip link del dev btest0
+}
+
+test_status_stats()
+{
+    skip_if_legacy_fallback
+
+    check_run env LIBXDP_DISPATCHER_STATS=1 $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_drop.o $TEST_PROG_DIR/xdp_pass.o -vv
+    check_progs_loaded $NS 2
+    if [ "$($XDP_LOADER status $NS --stats | grep -c 'pkts,')" -ne "2" ]; then
+        echo "Expected stats for 2 programs"
+        exit 1
+    fi
+    check_run $XDP_LOADER unload $NS --all -vv
+}
+
+test_load_link()
+{
+    skip_if_legacy_fallback
+
+    export LIBXDP_ATTACH_LINK=1
+    check_run $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_drop.o -vv
+    check_progs_loaded $NS 1
+    check_run $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_pass.o -vv
+    check_progs_loaded $NS 2
+
+    # netlink can't touch an interface with an XDP link attached
+    if ip link set dev $NS xdp off 2>/dev/null; then
+        echo "Dispatcher not attached through a bpf_link"
+        exit 1
+    fi
+
+    check_run $XDP_LOADER unload $NS --all -vv
+    check_progs_loaded $NS 0
+    unset LIBXDP_ATTACH_LINK
+}
+
+test_incremental_update()
+{
+    skip_if_legacy_fallback
+
+    local dispatcher
+    local id
+
+    export LIBXDP_INCREMENTAL_UPDATE=1
+    check_run $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_drop.o $TEST_PROG_DIR/xdp_pass.o -vv
+    check_progs_loaded $NS 2
+    dispatcher=$($XDP_LOADER status $NS | grep xdp_dispatcher | awk '{print $4}')
+
+    id=$($XDP_LOADER status $NS | grep xdp_pass | awk '{print $4}')
+    check_run $XDP_LOADER unload $NS --id $id -vv
+    check_progs_loaded $NS 1
+
+    # the same program goes back into the slot it left
+    check_run $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_pass.o -vv
+    check_progs_loaded $NS 2
+
+    if [ "$($XDP_LOADER status $NS | grep xdp_dispatcher | awk '{print $4}')" != "$dispatcher" ]; then
+        echo "Dispatcher was replaced by an incremental update"
+        exit 1
+    fi
+
+    check_run $XDP_LOADER unload $NS --all -vv
+    check_progs_loaded $NS 0
+    unset LIBXDP_INCREMENTAL_UPDATE
+}
+
+check_ping()
+{
+    if ns_exec $PING6 -c 1 -W 1 $OUTSIDE_IP6; then
+        [ "$1" == "OK" ] && return 0
+        echo "Ping went through, but should have been dropped"
+    else
+        [ "$1" == "FAIL" ] && return 0
+        echo "Ping was dropped, but should have gone through"
+    fi
+    exit 1
+}
+
+test_load_tail_call()
+{
+    skip_if_legacy_fallback
+
+    local dispatcher
+    local id
+
+    # xdp_tailcall_pass runs first and chain calls on XDP_PASS, so the ping
+    # only gets dropped if the tail call to xdp_tailcall_drop works
+    export LIBXDP_DISPATCHER_TAILCALL=1
+    export LIBXDP_INCREMENTAL_UPDATE=1
+    check_run $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_tailcall_pass.o $TEST_PROG_DIR/xdp_tailcall_drop.o -vv
+    check_progs_loaded $NS 2
+    check_ping FAIL
+    dispatcher=$($XDP_LOADER status $NS | grep xdp_dispatcher | awk '{print $4}')
+
+    # the program array only stays filled while it is pinned
+    if ! ls /sys/fs/bpf/xdp/dispatch-*-$dispatcher/xdp_disp_progs >/dev/null 2>&1; then
+        echo "Program array of the tail call dispatcher is not pinned"
+        exit 1
+    fi
+
+    # emptying and refilling a slot is a program array update
+    id=$($XDP_LOADER status $NS | grep xdp_tailcall_drop | awk '{print $4}')
+    check_run $XDP_LOADER unload $NS --id $id -vv
+    check_progs_loaded $NS 1
+    check_ping OK
+    check_run $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_tailcall_drop.o -vv
+    check_progs_loaded $NS 2
+    check_ping FAIL
+
+    if [ "$($XDP_LOADER status $NS | grep xdp_dispatcher | awk '{print $4}')" != "$dispatcher" ]; then
+        echo "Dispatcher was replaced by an incremental update"
+        exit 1
+    fi
+
+    # a program that doesn't chain call can only run last
+    if $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_pass.o -P 5 -vv; then
+        echo "Loaded a program that doesn't chain call before others"
+        exit 1
+    fi
+    check_progs_loaded $NS 2
+
+    # the interface keeps the tail call dispatcher once it has one, and the
+    # programs already on it keep chain calling in the new one
+    unset LIBXDP_DISPATCHER_TAILCALL
+    unset LIBXDP_INCREMENTAL_UPDATE
+    check_run $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_pass.o -P 50 -vv
+    check_progs_loaded $NS 3
+    check_ping FAIL
+    id=$($XDP_LOADER status $NS | grep xdp_tailcall_drop | awk '{print $4}')
+    check_run $XDP_LOADER unload $NS --id $id -vv
+    check_progs_loaded $NS 2
+    check_ping OK
+
+    check_run $XDP_LOADER unload $NS --all -vv
+    check_progs_loaded $NS 0
+}
+
+dispatcher_has_frags()
+{
+    $XDP_LOADER status $NS | grep xdp_dispatcher | grep -q xdp.frags
+}
+
+test_load_frags()
+{
+    skip_if_legacy_fallback
+
+    # kernels before 5.18 can't load programs with BPF_F_XDP_HAS_FRAGS
+    if ! $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_pass_frags.o -vv; then
+        exit "$SKIPPED_TEST"
+    fi
+    check_progs_loaded $NS 1
+    if ! dispatcher_has_frags; then
+        echo "Dispatcher wasn't loaded with frags support"
+        exit 1
+    fi
+
+    # the running dispatcher's config has to say it supports frags, or the
+    # programs on it are taken as non-frags when adding another one
+    check_run $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_drop_frags.o -vv
+    check_progs_loaded $NS 2
+    if ! dispatcher_has_frags; then
+        echo "Dispatcher lost frags support when adding a frags program"
+        exit 1
+    fi
+
+    check_run $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_pass.o -vv
+    check_progs_loaded $NS 3
+    if dispatcher_has_frags; then
+        echo "Dispatcher supports frags with a program that doesn't"
+        exit 1
+    fi
+
+    check_run $XDP_LOADER unload $NS --all -vv
+    check_progs_loaded $NS 0
+}
+
+test_apply()
+{
+    skip_if_legacy_fallback
+
+    local config="${STATEDIR}/xdp-loader-apply.conf"
+    local output
+
+    echo "$NS $TEST_PROG_DIR/xdp_drop.o" > "$config"
+    echo "$NS $TEST_PROG_DIR/xdp_pass.o prio=60" >> "$config"
+    check_run $XDP_LOADER apply "$config" -vv
+    check_progs_loaded $NS 2
+
+    output=$($XDP_LOADER apply "$config" 2>&1)
+    if ! echo "$output" | grep -q "unchanged"; then
+        echo "Re-applying the same config should not change anything"
+        exit 1
+    fi
+
+    echo "$NS $TEST_PROG_DIR/xdp_pass.o prio=60" > "$config"
+    output=$($XDP_LOADER apply "$config" --dry-run 2>&1)
+    check_progs_loaded $NS 2
+    if ! echo "$output" | grep -q "removing xdp_drop"; then
+        echo "Dry run should plan to remove xdp_drop"
+        exit 1
+    fi
+
+    check_run $XDP_LOADER apply "$config" -vv
+    check_progs_loaded $NS 1
+    if ! $XDP_LOADER status $NS | grep -q xdp_pass; then
+        echo "Expected xdp_pass to stay loaded"
+        exit 1
+    fi
+
+    echo "$NS" > "$config"
+    check_run $XDP_LOADER apply "$config" -vv
+    check_progs_loaded $NS 0
+    rm -f "$config"
+}
+
 cleanup_tests()
 {
+    ip link del dev btest0 >/dev/null 2>&1
+    rm -f "${STATEDIR}/xdp-loader-apply.conf"
     $XDP_LOADER unload $NS --all >/dev/null 2>&1
 }
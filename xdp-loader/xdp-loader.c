@@ -7,10 +7,12 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <net/if.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 #include <xdp/libxdp.h>
+#include <xdp/prog_dispatcher.h>
 #include <linux/err.h>
 
 #include "params.h"
@@ -22,6 +24,7 @@
 static const struct loadopt {
 	bool help;
 	struct iface iface;
+	struct iface *extra_ifaces;
 	struct multistring filenames;
 	char *pin_path;
 	char *section_name;
@@ -72,6 +75,10 @@ static struct prog_option load_options[] = {
 		      .metavar = "<ifname>",
 		      .required = true,
 		      .help = "Load on device <ifname>"),
+	DEFINE_OPTION("extra-dev", OPT_IFNAME_MULTI, struct loadopt, extra_ifaces,
+		      .short_opt = 'd',
+		      .metavar = "<ifname>",
+		      .help = "Also load on device <ifname>; can be repeated"),
 	DEFINE_OPTION("filenames", OPT_MULTISTRING, struct loadopt, filenames,
 		      .positional = true,
 		      .metavar = "<filenames>",
@@ -93,8 +100,10 @@ int do_load(const void *cfg, __unused const char *pin_root_path)
 	const struct loadopt *opt = cfg;
 	struct xdp_program **progs, *p;
 	char errmsg[STRERR_BUFSIZE];
+	size_t num_progs, num_ifaces, i;
 	int err = EXIT_SUCCESS;
-	size_t num_progs, i;
+	int *ifindexes = NULL;
+	struct iface *iface;
 	DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts,
 			    .pin_root_path = opt->pin_path);
 
@@ -112,14 +121,30 @@ int do_load(const void *cfg, __unused const char *pin_root_path)
 		return EXIT_FAILURE;
 	}
 
+	num_ifaces = 1;
+	for (iface = opt->extra_ifaces; iface; iface = iface->next)
+		num_ifaces++;
+
+	if (num_ifaces > 1 && opt->mode == XDP_MODE_HW) {
+		pr_warn("Cannot attach to multiple interfaces in HW mode\n");
+		return EXIT_FAILURE;
+	}
+
 	progs = calloc(num_progs, sizeof(*progs));
-	if (!progs) {
+	ifindexes = calloc(num_ifaces, sizeof(*ifindexes));
+	if (!progs || !ifindexes) {
 		pr_warn("Couldn't allocate memory\n");
-		return EXIT_FAILURE;
+		err = EXIT_FAILURE;
+		goto out_free;
 	}
 
-	pr_debug("Loading %zu files on interface '%s'.\n",
-		 num_progs, opt->iface.ifname);
+	ifindexes[0] = opt->iface.ifindex;
+	for (i = 1, iface = opt->extra_ifaces; iface; iface = iface->next)
+		ifindexes[i++] = iface->ifindex;
+
+	pr_debug("Loading %zu files on interface '%s'%s.\n",
+		 num_progs, opt->iface.ifname,
+		 num_ifaces > 1 ? " and others" : "");
 
 	/* libbpf spits out a lot of unhelpful error messages while loading.
 	 * Silence the logging so we can provide our own messages instead; this
@@ -197,21 +222,27 @@ retry:
 		progs[i] = p;
 	}
 
-	err = xdp_program__attach_multi(progs, num_progs,
-					opt->iface.ifindex, opt->mode, 0);
+	if (num_ifaces > 1)
+		err = xdp_program__attach_ifaces(progs, num_progs, ifindexes,
+						 num_ifaces, opt->mode, 0);
+	else
+		err = xdp_program__attach_multi(progs, num_progs,
+						opt->iface.ifindex, opt->mode, 0);
 	if (err) {
 		if (err == -EPERM && !double_rlimit())
 			goto retry;
 
 		if (err == -EOPNOTSUPP &&
 		    (opt->mode == XDP_MODE_NATIVE || opt->mode == XDP_MODE_HW)) {
-			pr_warn("Attaching XDP program in %s mode not supported - try %s mode.\n",
+			pr_warn("Attaching XDP program in %s mode not supported - try %s mode, "
+				"or 'unspecified' to use the best one the device supports.\n",
 				opt->mode == XDP_MODE_NATIVE ? "native" : "HW",
 				opt->mode == XDP_MODE_NATIVE ? "SKB" : "native or SKB");
 		} else {
 			libbpf_strerror(err, errmsg, sizeof(errmsg));
-			pr_warn("Couldn't attach XDP program on iface '%s': %s(%d)\n",
-				opt->iface.ifname, errmsg, err);
+			pr_warn("Couldn't attach XDP program on iface '%s'%s: %s(%d)\n",
+				opt->iface.ifname,
+				num_ifaces > 1 ? " and others" : "", errmsg, err);
 		}
 		goto out;
 	}
@@ -220,6 +251,8 @@ out:
 	for (i = 0; i < num_progs; i++)
 		if (progs[i])
 			xdp_program__close(progs[i]);
+out_free:
+	free(ifindexes);
 	free(progs);
 	return err;
 }
@@ -323,7 +356,521 @@ out:
 	return err ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
+static const struct applyopt {
+	bool dry_run;
+	char *config;
+	char *pin_path;
+	enum xdp_attach_mode mode;
+} defaults_apply = {
+	.mode = XDP_MODE_NATIVE
+};
+
+static struct prog_option apply_options[] = {
+	DEFINE_OPTION("mode", OPT_ENUM, struct applyopt, mode,
+		      .short_opt = 'm',
+		      .typearg = xdp_modes,
+		      .metavar = "<mode>",
+		      .help = "Load XDP programs in <mode>; default native"),
+	DEFINE_OPTION("pin-path", OPT_STRING, struct applyopt, pin_path,
+		      .short_opt = 'p',
+		      .help = "Path to pin maps under (must be in bpffs)."),
+	DEFINE_OPTION("dry-run", OPT_BOOL, struct applyopt, dry_run,
+		      .help = "Only show the changes that would be made"),
+	DEFINE_OPTION("config", OPT_STRING, struct applyopt, config,
+		      .positional = true,
+		      .metavar = "<config>",
+		      .required = true,
+		      .help = "Apply the desired state in <config>"),
+	END_OPTIONS
+};
+
+struct apply_prog {
+	char *filename;
+	char *section_name;
+	char *prog_name;
+	__u32 prio;
+	__u32 actions;
+	int line;
+	struct xdp_program *prog;
+	bool loaded;	/* already on the interface */
+};
+
+struct apply_iface {
+	char ifname[IF_NAMESIZE];
+	int ifindex;
+	struct apply_prog progs[MAX_DISPATCHER_ACTIONS];
+	size_t num_progs;
+	struct xdp_multiprog *mp;
+	/* The plan: which programs to remove, and whether to start over */
+	struct xdp_program *remove[MAX_DISPATCHER_ACTIONS];
+	size_t num_remove;
+	size_t num_add;
+	bool replace;
+};
+
+struct apply_state {
+	struct apply_iface *ifaces;
+	size_t num_ifaces;
+};
+
+static int parse_apply_prio(const char *str, __u32 *prio)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(str, &end, 0);
+	if (errno || !*str || *end || val > UINT32_MAX)
+		return -EINVAL;
+
+	*prio = val;
+	return 0;
+}
+
+static int parse_apply_actions(const char *str, __u32 *actions)
+{
+	char *copy, *tok, *saveptr = NULL;
+	int err = 0;
+	size_t i;
+
+	copy = strdup(str);
+	if (!copy)
+		return -ENOMEM;
+
+	*actions = 0;
+	for (tok = strtok_r(copy, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		for (i = 0; load_actions[i].flagstring; i++) {
+			if (!strcmp(tok, load_actions[i].flagstring))
+				break;
+		}
+		if (!load_actions[i].flagstring) {
+			err = -EINVAL;
+			break;
+		}
+		*actions |= load_actions[i].flagval;
+	}
+
+	free(copy);
+	return err;
+}
+
+static struct apply_iface *apply_get_iface(struct apply_state *state,
+					   const char *ifname)
+{
+	struct apply_iface *iface, *ifaces;
+	int ifindex;
+	size_t i;
+
+	for (i = 0; i < state->num_ifaces; i++)
+		if (!strcmp(state->ifaces[i].ifname, ifname))
+			return &state->ifaces[i];
+
+	ifindex = if_nametoindex(ifname);
+	if (!ifindex || strlen(ifname) >= IF_NAMESIZE)
+		return NULL;
+
+	ifaces = realloc(state->ifaces,
+			 (state->num_ifaces + 1) * sizeof(*ifaces));
+	if (!ifaces)
+		return NULL;
+	state->ifaces = ifaces;
+
+	iface = &ifaces[state->num_ifaces++];
+	memset(iface, 0, sizeof(*iface));
+	strcpy(iface->ifname, ifname);
+	iface->ifindex = ifindex;
+	return iface;
+}
+
+/* Each line of the config holds an interface name, optionally followed by a
+ * program file and its settings, like:
+ *
+ *   eth0 xdp_filter.o prio=10 actions=XDP_PASS,XDP_DROP
+ *
+ * An interface can be listed several times to load several programs, and
+ * listing it without a file means it should have no programs.
+ */
+static int parse_apply_config(const char *filename, struct apply_state *state)
+{
+	char *line = NULL, *tok, *saveptr;
+	struct apply_iface *iface;
+	struct apply_prog *prog;
+	int err = 0, lineno = 0;
+	size_t len = 0;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		err = -errno;
+		pr_warn("Couldn't open config file '%s': %s\n", filename,
+			strerror(-err));
+		return err;
+	}
+
+	while (getline(&line, &len, f) >= 0) {
+		lineno++;
+		if ((tok = strchr(line, '#')))
+			*tok = '\0';
+
+		saveptr = NULL;
+		tok = strtok_r(line, " \t\n", &saveptr);
+		if (!tok)
+			continue;
+
+		iface = apply_get_iface(state, tok);
+		if (!iface) {
+			pr_warn("%s:%d: Unknown interface '%s'\n", filename,
+				lineno, tok);
+			err = -ENODEV;
+			goto out;
+		}
+
+		tok = strtok_r(NULL, " \t\n", &saveptr);
+		if (!tok)
+			continue;
+
+		if (iface->num_progs >= MAX_DISPATCHER_ACTIONS) {
+			pr_warn("%s:%d: At most %d programs per interface\n",
+				filename, lineno, MAX_DISPATCHER_ACTIONS);
+			err = -E2BIG;
+			goto out;
+		}
+
+		prog = &iface->progs[iface->num_progs++];
+		prog->line = lineno;
+		prog->filename = strdup(tok);
+		if (!prog->filename) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		while ((tok = strtok_r(NULL, " \t\n", &saveptr))) {
+			char *val = strchr(tok, '=');
+			char **str = NULL;
+
+			if (!val) {
+				err = -EINVAL;
+			} else {
+				*val++ = '\0';
+				if (!strcmp(tok, "prio"))
+					err = parse_apply_prio(val, &prog->prio);
+				else if (!strcmp(tok, "actions"))
+					err = parse_apply_actions(val,
+								  &prog->actions);
+				else if (!strcmp(tok, "section"))
+					str = &prog->section_name;
+				else if (!strcmp(tok, "prog-name"))
+					str = &prog->prog_name;
+				else
+					err = -EINVAL;
+			}
+
+			if (str) {
+				free(*str);
+				*str = strdup(val);
+				if (!*str)
+					err = -ENOMEM;
+			}
+
+			if (err) {
+				pr_warn("%s:%d: Invalid program setting '%s'\n",
+					filename, lineno, tok);
+				goto out;
+			}
+		}
+
+		if (prog->section_name && prog->prog_name) {
+			pr_warn("%s:%d: Only one of section or prog-name can be set\n",
+				filename, lineno);
+			err = -EINVAL;
+			goto out;
+		}
+	}
+
+out:
+	free(line);
+	fclose(f);
+	return err;
+}
+
+static int apply_open_prog(const struct applyopt *opt, struct apply_prog *ap)
+{
+	DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts,
+			    .pin_root_path = opt->pin_path);
+	char errmsg[STRERR_BUFSIZE];
+	struct xdp_program *p;
+	int err;
+
+	if (ap->prog_name) {
+		DECLARE_LIBXDP_OPTS(xdp_program_opts, xdp_opts,
+				    .open_filename = ap->filename,
+				    .prog_name = ap->prog_name,
+				    .opts = &opts);
+
+		p = xdp_program__create(&xdp_opts);
+	} else {
+		p = xdp_program__open_file(ap->filename, ap->section_name,
+					   &opts);
+	}
+
+	err = libxdp_get_error(p);
+	if (err) {
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		pr_warn("Couldn't open file '%s': %s\n", ap->filename, errmsg);
+		return err;
+	}
+	ap->prog = p;
+
+	if (ap->prio) {
+		err = xdp_program__set_run_prio(p, ap->prio);
+		if (err) {
+			pr_warn("Error setting run priority: %u\n", ap->prio);
+			return err;
+		}
+	}
+
+	if (ap->actions) {
+		__u32 a;
+
+		for (a = XDP_ABORTED; a <= XDP_REDIRECT; a++) {
+			err = xdp_program__set_chain_call_enabled(p, a, ap->actions & (1U << a));
+			if (err) {
+				pr_warn("Error setting chain call action: %u\n", a);
+				return err;
+			}
+		}
+	}
+
+	if (!opt->pin_path) {
+		struct bpf_map *map;
+
+		bpf_object__for_each_map(map, xdp_program__bpf_obj(p)) {
+			err = bpf_map__set_pin_path(map, NULL);
+			if (err) {
+				pr_warn("Error clearing map pin path: %s\n",
+					strerror(-err));
+				return err;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Programs are the same if they have the same name, run priority and chain
+ * call actions. The code can't be compared before the new one is loaded, so
+ * to pick up a rebuilt program, unload it first.
+ */
+static bool apply_prog_matches(const struct xdp_program *a,
+			       const struct xdp_program *b)
+{
+	__u32 act;
+
+	if (strcmp(xdp_program__name(a), xdp_program__name(b)) ||
+	    xdp_program__run_prio(a) != xdp_program__run_prio(b))
+		return false;
+
+	for (act = XDP_ABORTED; act <= XDP_REDIRECT; act++)
+		if (xdp_program__chain_call_enabled(a, act) !=
+		    xdp_program__chain_call_enabled(b, act))
+			return false;
+
+	return true;
+}
+
+/* Work out the least disruptive way to get from the programs loaded on the
+ * interface to the ones in the config. At most one regeneration of the
+ * dispatcher is needed to remove programs, and one to add them.
+ */
+static void apply_plan_iface(const struct applyopt *opt,
+			     struct apply_iface *iface)
+{
+	struct xdp_program *p = NULL;
+	bool found;
+	size_t i;
+
+	iface->num_add = iface->num_progs;
+	if (!iface->mp)
+		return;
+
+	if (xdp_multiprog__is_legacy(iface->mp) ||
+	    (opt->mode != XDP_MODE_UNSPEC &&
+	     xdp_multiprog__attach_mode(iface->mp) != opt->mode)) {
+		iface->replace = true;
+		return;
+	}
+
+	while ((p = xdp_multiprog__next_prog(p, iface->mp))) {
+		found = false;
+		for (i = 0; i < iface->num_progs; i++) {
+			struct apply_prog *ap = &iface->progs[i];
+
+			if (!ap->loaded && apply_prog_matches(ap->prog, p)) {
+				ap->loaded = true;
+				iface->num_add--;
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			iface->remove[iface->num_remove++] = p;
+	}
+
+	if (iface->num_remove &&
+	    iface->num_remove == (size_t)xdp_multiprog__program_count(iface->mp))
+		iface->replace = true;
+}
+
+static void apply_print_plan(const struct apply_iface *iface)
+{
+	size_t i;
+
+	if (!iface->replace && !iface->num_remove && !iface->num_add) {
+		printf("%s: unchanged\n", iface->ifname);
+		return;
+	}
+
+	if (iface->replace)
+		printf("%s: removing all XDP programs\n", iface->ifname);
+	else
+		for (i = 0; i < iface->num_remove; i++)
+			printf("%s: removing %s (id %u)\n", iface->ifname,
+			       xdp_program__name(iface->remove[i]),
+			       xdp_program__id(iface->remove[i]));
+
+	for (i = 0; i < iface->num_progs; i++)
+		if (iface->replace || !iface->progs[i].loaded)
+			printf("%s: adding %s from %s (prio %d)\n",
+			       iface->ifname,
+			       xdp_program__name(iface->progs[i].prog),
+			       iface->progs[i].filename,
+			       xdp_program__run_prio(iface->progs[i].prog));
+}
+
+static int apply_iface(const struct applyopt *opt, struct apply_iface *iface)
+{
+	struct xdp_program *add[MAX_DISPATCHER_ACTIONS];
+	char errmsg[STRERR_BUFSIZE];
+	size_t i, num_add = 0;
+	int err = 0;
+
+	if (iface->replace) {
+		err = xdp_multiprog__detach(iface->mp);
+	} else if (iface->num_remove) {
+		err = xdp_program__detach_multi(iface->remove,
+						iface->num_remove,
+						iface->ifindex,
+						xdp_multiprog__attach_mode(iface->mp),
+						0);
+	}
+	if (err) {
+		pr_warn("Unable to detach XDP programs from %s: %s\n",
+			iface->ifname, strerror(-err));
+		return err;
+	}
+
+	for (i = 0; i < iface->num_progs; i++)
+		if (iface->replace || !iface->progs[i].loaded)
+			add[num_add++] = iface->progs[i].prog;
+	if (!num_add)
+		return 0;
+
+	err = xdp_program__attach_multi(add, num_add, iface->ifindex,
+					opt->mode, 0);
+	if (err) {
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		pr_warn("Couldn't attach XDP programs on iface '%s': %s(%d)\n",
+			iface->ifname, errmsg, err);
+	}
+	return err;
+}
+
+int do_apply(const void *cfg, __unused const char *pin_root_path)
+{
+	const struct applyopt *opt = cfg;
+	struct apply_state state = {};
+	int err = 0;
+	size_t i, j;
+
+	if (opt->mode == XDP_MODE_HW) {
+		pr_warn("The apply command does not support HW mode\n");
+		return EXIT_FAILURE;
+	}
+
+	err = parse_apply_config(opt->config, &state);
+	if (err)
+		goto out;
+
+	silence_libbpf_logging();
+
+	/* Open all programs, and look at all interfaces, before touching any
+	 * of them, so a broken config doesn't leave things half done.
+	 */
+	for (i = 0; i < state.num_ifaces; i++) {
+		struct apply_iface *iface = &state.ifaces[i];
+
+		for (j = 0; j < iface->num_progs; j++) {
+			err = apply_open_prog(opt, &iface->progs[j]);
+			if (err)
+				goto out;
+		}
+
+		iface->mp = xdp_multiprog__get_from_ifindex(iface->ifindex);
+		if (IS_ERR_OR_NULL(iface->mp)) {
+			err = PTR_ERR(iface->mp);
+			iface->mp = NULL;
+			if (err && err != -ENOENT) {
+				pr_warn("Couldn't get XDP status of %s: %s\n",
+					iface->ifname, strerror(-err));
+				goto out;
+			}
+			err = 0;
+		}
+
+		apply_plan_iface(opt, iface);
+		apply_print_plan(iface);
+	}
+
+	if (opt->dry_run)
+		goto out;
+
+	/* Programs that were detached can't be put back as they were, so a
+	 * failure leaves the interfaces before it changed; say which.
+	 */
+	for (i = 0; i < state.num_ifaces; i++) {
+		err = apply_iface(opt, &state.ifaces[i]);
+		if (err) {
+			for (j = 0; j < i; j++)
+				if (state.ifaces[j].replace ||
+				    state.ifaces[j].num_remove ||
+				    state.ifaces[j].num_add)
+					pr_warn("%s was already changed\n",
+						state.ifaces[j].ifname);
+			pr_warn("Stopped at %s; re-run to apply the rest\n",
+				state.ifaces[i].ifname);
+			goto out;
+		}
+	}
+
+out:
+	for (i = 0; i < state.num_ifaces; i++) {
+		struct apply_iface *iface = &state.ifaces[i];
+
+		for (j = 0; j < iface->num_progs; j++) {
+			xdp_program__close(iface->progs[j].prog);
+			free(iface->progs[j].filename);
+			free(iface->progs[j].section_name);
+			free(iface->progs[j].prog_name);
+		}
+		xdp_multiprog__close(iface->mp);
+	}
+	free(state.ifaces);
+	return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 static const struct statusopt {
+	bool stats;
 	struct iface iface;
 } defaults_status = {};
 
@@ -331,6 +878,9 @@ static struct prog_option status_options[] = {
 	DEFINE_OPTION("dev", OPT_IFNAME, struct statusopt, iface,
 		      .positional = true, .metavar = "[ifname]",
 		      .help = "Show status for device [ifname] (default all interfaces)"),
+	DEFINE_OPTION("stats", OPT_BOOL, struct statusopt, stats,
+		      .short_opt = 's',
+		      .help = "Show per-program stats from the dispatcher"),
 	END_OPTIONS
 };
 
@@ -339,7 +889,8 @@ int do_status(const void *cfg, __unused const char *pin_root_path)
 	const struct statusopt *opt = cfg;
 
 	printf("CURRENT XDP PROGRAM STATUS:\n\n");
-	return iface_print_status(opt->iface.ifindex ? &opt->iface : NULL);
+	return iface_print_status(opt->iface.ifindex ? &opt->iface : NULL,
+				  opt->stats);
 }
 
 static const struct cleanopt {
@@ -370,6 +921,7 @@ int do_help(__unused const void *cfg, __unused const char *pin_root_path)
 		"COMMAND can be one of:\n"
 		"       load        - load an XDP program on an interface\n"
 		"       unload      - unload an XDP program from an interface\n"
+		"       apply       - bring XDP programs in line with a config file\n"
 		"       status      - show current XDP program status\n"
 		"       clean       - clean up detached program links in XDP bpffs directory\n"
 		"       help        - show this help message\n"
@@ -381,6 +933,7 @@ int do_help(__unused const void *cfg, __unused const char *pin_root_path)
 static const struct prog_command cmds[] = {
 	DEFINE_COMMAND(load, "Load an XDP program on an interface"),
 	DEFINE_COMMAND(unload, "Unload an XDP program from an interface"),
+	DEFINE_COMMAND(apply, "Bring XDP programs in line with a config file"),
 	DEFINE_COMMAND(clean, "Clean up detached program links in XDP bpffs directory"),
 	DEFINE_COMMAND(status, "Show XDP program status"),
 	{ .name = "help", .func = do_help, .no_cfg = true },
@@ -390,6 +943,7 @@ static const struct prog_command cmds[] = {
 union all_opts {
 	struct loadopt load;
 	struct unloadopt unload;
+	struct applyopt apply;
 	struct statusopt status;
 };
 
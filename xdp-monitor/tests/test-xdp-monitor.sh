@@ -1,6 +1,6 @@
 XDP_LOADER=${XDP_LOADER:-./xdp-loader}
 XDP_MONITOR=${XDP_MONITOR:-./xdp-monitor}
-ALL_TESTS="test_monitor"
+ALL_TESTS="test_monitor test_monitor_top test_monitor_nic_stats test_monitor_serve"
 
 test_monitor()
 {
@@ -8,4 +8,53 @@ test_monitor()
     check_run $XDP_MONITOR -vv
     check_run $XDP_MONITOR -s -vv
     check_run $XDP_MONITOR -e -vv
+    check_run $XDP_MONITOR -F json -vv
+    check_run $XDP_MONITOR -F csv -vv
+    check_run $XDP_MONITOR -p -vv
+    check_run $XDP_MONITOR -p -F json -vv
+}
+
+test_monitor_top()
+{
+    skip_if_missing_trace_attach
+
+    export XDP_SAMPLE_IMMEDIATE_EXIT=1
+    check_run $XDP_LOADER load $NS $TEST_PROG_DIR/xdp_pass.o -vv
+    check_run $XDP_MONITOR -t 10 -d $NS -vv
+    check_run $XDP_MONITOR -t 10 -d $NS -r 100 -F json -vv
+    check_run $XDP_MONITOR -p -d $NS -vv
+    check_run $XDP_LOADER unload $NS --all -vv
+}
+
+test_monitor_nic_stats()
+{
+    export XDP_SAMPLE_IMMEDIATE_EXIT=1
+    $XDP_MONITOR -n -vv && return 1
+    $XDP_MONITOR -n -d $NS --serve 127.0.0.1:0 -vv && return 1
+
+    # Only newer kernels have queue stats for veth, so just see that the
+    # output works where they do
+    $XDP_MONITOR -n -d $NS -vv || return 0
+    check_run $XDP_MONITOR -n -e -d $NS -vv
+    check_run $XDP_MONITOR -n -d $NS -F csv -vv
+}
+
+test_monitor_serve()
+{
+    local PID OUTPUT
+
+    XDP_SAMPLE_IMMEDIATE_EXIT=1 check_run $XDP_MONITOR --serve 127.0.0.1:0 -vv
+    $XDP_MONITOR --serve 127.0.0.1 -vv && return 1
+
+    command -v curl >/dev/null || return 0
+    PID=$(start_background "$XDP_MONITOR --serve 127.0.0.1:9464")
+    OUTPUT=$(curl -s http://127.0.0.1:9464/metrics)
+    stop_background $PID
+    echo "$OUTPUT"
+    [[ "$OUTPUT" == *"xdp_exceptions_total"*"# EOF"* ]] || return 1
+}
+
+cleanup_tests()
+{
+    $XDP_LOADER unload $NS --all >/dev/null 2>&1
 }
@@ -29,6 +29,9 @@ static const char *__doc_err_only__=
 
 #include <xdp_sample.h>
 #include "xdp_monitor.skel.h"
+#include "xdp_flows.h"
+#include "xdp_exceptions.h"
+#include "xdp_metrics.h"
 #include "params.h"
 #include "util.h"
 #include "logging.h"
@@ -39,23 +42,69 @@ static int mask = SAMPLE_REDIRECT_ERR_CNT | SAMPLE_CPUMAP_ENQUEUE_CNT |
 
 DEFINE_SAMPLE_INIT(xdp_monitor);
 
+#define MAX_TOP_FLOWS 1000
+
+static struct enum_val output_formats[] = {
+       {"text", SAMPLE_OUTPUT_TEXT},
+       {"json", SAMPLE_OUTPUT_JSON},
+       {"csv", SAMPLE_OUTPUT_CSV},
+       {NULL, 0}
+};
+
 static const struct monitoropt {
 	bool stats;
 	bool extended;
+	bool programs;
+	bool nic_stats;
 	__u32 interval;
-} defaults_monitoropt = { .stats = false, .interval = 2 };
+	__u32 interval_ms;
+	__u32 top;
+	__u32 sample_every;
+	enum sample_output_format format;
+	struct iface iface;
+	char *serve;
+} defaults_monitoropt = { .stats = false, .interval = 2, .sample_every = 1 };
 
 static struct prog_option xdpmonitor_options[] = {
 	DEFINE_OPTION("interval", OPT_U32, struct monitoropt, interval,
 		      .short_opt = 'i',
 		      .metavar = "<seconds>",
 		      .help = "Polling interval (default 2)"),
+	DEFINE_OPTION("interval-ms", OPT_U32, struct monitoropt, interval_ms,
+		      .metavar = "<msecs>",
+		      .help = "Polling interval in milliseconds, instead of --interval"),
 	DEFINE_OPTION("stats", OPT_BOOL, struct monitoropt, stats,
 		      .short_opt = 's',
 		      .help = "Enable statistics for transmitted packets (not just errors)"),
 	DEFINE_OPTION("extended", OPT_BOOL, struct monitoropt, extended,
 		      .short_opt = 'e',
 		      .help = "Start running in extended output mode (C^\\ to toggle)"),
+	DEFINE_OPTION("programs", OPT_BOOL, struct monitoropt, programs,
+		      .short_opt = 'p',
+		      .help = "Break down exceptions per program (and per slot on --dev)"),
+	DEFINE_OPTION("nic-stats", OPT_BOOL, struct monitoropt, nic_stats,
+		      .short_opt = 'n',
+		      .help = "Show the per-queue receive counters of the NIC on --dev"),
+	DEFINE_OPTION("format", OPT_ENUM, struct monitoropt, format,
+		      .short_opt = 'F',
+		      .metavar = "<format>",
+		      .typearg = output_formats,
+		      .help = "Print statistics as <format> (text, json or csv); default text"),
+	DEFINE_OPTION("serve", OPT_STRING, struct monitoropt, serve,
+		      .metavar = "<[addr:]port>",
+		      .help = "Serve the counters as OpenMetrics instead of printing them"),
+	DEFINE_OPTION("top", OPT_U32, struct monitoropt, top,
+		      .short_opt = 't',
+		      .metavar = "<flows>",
+		      .help = "Show the <flows> flows with the most packets on --dev"),
+	DEFINE_OPTION("dev", OPT_IFNAME, struct monitoropt, iface,
+		      .short_opt = 'd',
+		      .metavar = "<ifname>",
+		      .help = "Sample flows or dispatcher slots of the XDP program on <ifname>"),
+	DEFINE_OPTION("sample-rate", OPT_U32, struct monitoropt, sample_every,
+		      .short_opt = 'r',
+		      .metavar = "<n>",
+		      .help = "Only sample 1 in <n> packets for --top (default 1)"),
 	END_OPTIONS
 };
 
@@ -70,6 +119,25 @@ int main(int argc, char **argv)
 			       &defaults_monitoropt) != 0)
 		return ret;
 
+	if (((cfg.top || cfg.nic_stats) && !cfg.iface.ifindex) ||
+	    (cfg.iface.ifindex && !cfg.top && !cfg.programs && !cfg.nic_stats)) {
+		pr_warn("--top and --nic-stats need --dev, and --dev needs --top, "
+			"--programs or --nic-stats\n");
+		return ret;
+	}
+
+	if (cfg.top > MAX_TOP_FLOWS || !cfg.sample_every) {
+		pr_warn("--top must be at most %d and --sample-rate at least 1\n",
+			MAX_TOP_FLOWS);
+		return ret;
+	}
+
+	if (cfg.serve && (cfg.top || cfg.programs || cfg.nic_stats)) {
+		pr_warn("--serve can't be combined with --top, --programs or "
+			"--nic-stats\n");
+		return ret;
+	}
+
 	/* If all the options are parsed ok, make sure we are root! */
 	if (check_bpf_environ())
 		return ret;
@@ -97,11 +165,24 @@ int main(int argc, char **argv)
 
 	if (cfg.stats)
 		mask |= SAMPLE_REDIRECT_CNT;
-	else
+	else if (cfg.format == SAMPLE_OUTPUT_TEXT && !cfg.serve)
 		printf("%s", __doc_err_only__);
 
+	if (cfg.nic_stats) {
+		ret = sample_nic_stats_init(cfg.iface.ifindex);
+		if (ret < 0) {
+			pr_warn("Couldn't get the queue stats of %s (needs Linux 6.9 "
+				"and driver support): %s\n", cfg.iface.ifname,
+				strerror(-ret));
+			ret = EXIT_FAIL;
+			goto end_destroy;
+		}
+		mask |= SAMPLE_NIC_QUEUE_CNT;
+	}
+
 	if (cfg.extended)
 		sample_switch_mode();
+	sample_set_output_format(cfg.format);
 
 	ret = sample_init(skel, mask, 0, 0);
 	if (ret < 0) {
@@ -110,7 +191,26 @@ int main(int argc, char **argv)
 		goto end_destroy;
 	}
 
-	ret = sample_run(cfg.interval, NULL, NULL);
+	if (cfg.top) {
+		ret = flows_attach(cfg.iface.ifindex, cfg.top, cfg.sample_every);
+		if (ret < 0) {
+			ret = EXIT_FAIL_BPF;
+			goto end_destroy;
+		}
+	}
+
+	if (cfg.programs) {
+		ret = exceptions_attach(cfg.iface.ifindex);
+		if (ret < 0) {
+			ret = EXIT_FAIL_BPF;
+			goto end_destroy;
+		}
+	}
+
+	if (cfg.serve)
+		ret = sample_serve(cfg.serve, metrics_print_pinned, NULL);
+	else
+		ret = sample_run(cfg.interval_ms ?: cfg.interval * 1000, NULL, NULL);
 	if (ret < 0) {
 		pr_warn("Failed during sample run: %s\n", strerror(-ret));
 		ret = EXIT_FAIL;
@@ -119,6 +219,8 @@ int main(int argc, char **argv)
 	ret = EXIT_OK;
 
 end_destroy:
+	exceptions_detach();
+	flows_detach();
 	xdp_monitor__destroy(skel);
 	sample_teardown();
 	return ret;
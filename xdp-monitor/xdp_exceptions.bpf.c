@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Count xdp_exception events per program, interface and action. The
+ * tracepoint only knows the program the driver ran, which for a libxdp
+ * multiprog setup is the dispatcher. To find the component that ended the
+ * chain, userspace can load one more copy of this object per dispatcher slot,
+ * whose fentry probe notes on the CPU which slot ran last; the tracepoint
+ * fires after the dispatcher returns, on the same CPU, and picks that up.
+ */
+#include <bpf/vmlinux.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_helpers.h>
+
+#include "xdp_exceptions.h"
+
+/* Set for each copy of the slot probe */
+const volatile __u32 dispatcher_id = 0;
+const volatile __u32 slot = EXC_SLOT_NONE;
+const volatile __u32 slot_prog_id = 0;
+
+struct exc_slot {
+	__u32 dispatcher_id;
+	__u32 slot;
+	__u32 prog_id;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(max_entries, EXC_MAP_SIZE);
+	__type(key, struct exc_key);
+	__type(value, __u64);
+} exc_cnt SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct exc_slot);
+} last_slot SEC(".maps");
+
+SEC("fentry/func")
+int BPF_PROG(xdp_exc_slot, struct xdp_buff *xdp)
+{
+	struct exc_slot *last;
+	__u32 zero = 0;
+
+	last = bpf_map_lookup_elem(&last_slot, &zero);
+	if (!last)
+		return 0;
+
+	last->dispatcher_id = dispatcher_id;
+	last->slot = slot;
+	last->prog_id = slot_prog_id;
+	return 0;
+}
+
+SEC("tp_btf/xdp_exception")
+int BPF_PROG(xdp_exc_trace, const struct net_device *dev,
+	     const struct bpf_prog *xdp, __u32 act)
+{
+	struct exc_key key = { .slot = EXC_SLOT_NONE };
+	struct exc_slot *last;
+	__u64 *cnt, init = 0;
+	__u32 zero = 0;
+
+	key.ifindex = dev->ifindex;
+	key.prog_id = xdp->aux->id;
+	key.action = act > XDP_REDIRECT ? XDP_REDIRECT + 1 : act;
+
+	/* The first slot runs for every packet, so a match is never stale */
+	last = bpf_map_lookup_elem(&last_slot, &zero);
+	if (last && last->dispatcher_id == key.prog_id) {
+		key.prog_id = last->prog_id;
+		key.slot = last->slot;
+	}
+
+	cnt = bpf_map_lookup_elem(&exc_cnt, &key);
+	if (!cnt) {
+		bpf_map_update_elem(&exc_cnt, &key, &init, BPF_NOEXIST);
+		cnt = bpf_map_lookup_elem(&exc_cnt, &key);
+		if (!cnt)
+			return 0;
+	}
+	(*cnt)++;
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,275 @@
+// SPDX-License-Identifier: GPL-2.0
+/* xdp_exception events broken down per program, printed next to the
+ * tracepoint counters.
+ *
+ * The BPF side counts events in a per-CPU hash keyed by program, interface
+ * and action, which is drained on every interval. If an interface runs a
+ * libxdp dispatcher, a probe on each of its component programs lets the
+ * events be put down to the slot that returned the failing verdict.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <xdp/libxdp.h>
+
+#include <xdp_sample.h>
+#include "xdp_exceptions.h"
+#include "xdp_exceptions.skel.h"
+#include "logging.h"
+#include "util.h"
+
+struct exc_entry {
+	struct exc_key key;
+	__u64 cnt;
+};
+
+static const char *exc_action_names[] = {
+	[XDP_ABORTED] = "XDP_ABORTED",
+	[XDP_DROP] = "XDP_DROP",
+	[XDP_PASS] = "XDP_PASS",
+	[XDP_TX] = "XDP_TX",
+	[XDP_REDIRECT] = "XDP_REDIRECT",
+	[XDP_REDIRECT + 1] = "XDP_UNKNOWN",
+};
+
+static struct {
+	struct xdp_exceptions *skel;
+	struct xdp_exceptions **slots;
+	struct xdp_multiprog *mp;
+	struct exc_entry *entries;
+	__u64 *percpu;
+	int num_slots;
+	int nr_cpus;
+	struct timespec prev_ts;
+} exc;
+
+/* Move the counts out of the BPF map. Events counted between the lookup and
+ * the delete of an entry are lost, which is fine for rare events.
+ */
+static __u32 exc_drain(void)
+{
+	int fd = bpf_map__fd(exc.skel->maps.exc_cnt);
+	struct exc_key keys[EXC_MAP_SIZE];
+	__u32 num = 0, n = 0, i;
+	int cpu;
+
+	while (num < EXC_MAP_SIZE &&
+	       !bpf_map_get_next_key(fd, num ? &keys[num - 1] : NULL, &keys[num]))
+		num++;
+
+	for (i = 0; i < num; i++) {
+		if (bpf_map_lookup_elem(fd, &keys[i], exc.percpu))
+			continue;
+		bpf_map_delete_elem(fd, &keys[i]);
+
+		exc.entries[n].key = keys[i];
+		exc.entries[n].cnt = 0;
+		for (cpu = 0; cpu < exc.nr_cpus; cpu++)
+			exc.entries[n].cnt += exc.percpu[cpu];
+		if (exc.entries[n].cnt)
+			n++;
+	}
+	return n;
+}
+
+static int cmp_entries(const void *a, const void *b)
+{
+	const struct exc_entry *x = a, *y = b;
+
+	if (x->cnt != y->cnt)
+		return x->cnt < y->cnt ? 1 : -1;
+	return 0;
+}
+
+static void format_prog(char *buf, size_t len, const struct exc_key *key)
+{
+	struct bpf_prog_info info = {};
+	__u32 info_len = sizeof(info);
+	const char *name = "?";
+	int fd;
+
+	fd = bpf_prog_get_fd_by_id(key->prog_id);
+	if (fd >= 0) {
+		if (!bpf_obj_get_info_by_fd(fd, &info, &info_len) && info.name[0])
+			name = info.name;
+		close(fd);
+	}
+
+	if (key->slot == EXC_SLOT_NONE)
+		snprintf(buf, len, "%s(%u)", name, key->prog_id);
+	else
+		snprintf(buf, len, "%s(%u)/%u", name, key->prog_id, key->slot);
+}
+
+static void exc_print(__unused void *ctx)
+{
+	char ifname[IF_NAMESIZE], prog[64], str[128];
+	struct datarec rates = {};
+	struct timespec now;
+	const char *dev;
+	__u32 i, num;
+	double period;
+	__u64 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	period = (now.tv_sec - exc.prev_ts.tv_sec) +
+		 (now.tv_nsec - exc.prev_ts.tv_nsec) / 1e9;
+	exc.prev_ts = now;
+
+	num = exc_drain();
+	if (!num || period <= 0)
+		return;
+	qsort(exc.entries, num, sizeof(*exc.entries), cmp_entries);
+
+	ts = (__u64)now.tv_sec * 1000000000 + now.tv_nsec;
+	if (sample_output_is_text())
+		printf("Exceptions by program\n");
+
+	for (i = 0; i < num; i++) {
+		struct exc_entry *e = &exc.entries[i];
+
+		dev = if_indextoname(e->key.ifindex, ifname) ?: "?";
+		format_prog(prog, sizeof(prog), &e->key);
+		if (sample_output_is_text()) {
+			snprintf(str, sizeof(str), "%s %s", dev, prog);
+			printf("  %-40s %-13s %'12.0f hits/s\n", str,
+			       exc_action_names[e->key.action], e->cnt / period);
+		} else {
+			snprintf(str, sizeof(str), "%s:%s:%s", dev, prog,
+				 exc_action_names[e->key.action]);
+			rates.dropped = e->cnt / period;
+			sample_print_row("exception_prog", str, -1, ts, &rates);
+		}
+	}
+
+	if (!sample_output_is_text())
+		fflush(stdout);
+}
+
+/* Load one more copy of the object for every component of the dispatcher on
+ * the interface, sharing the maps of the main one.
+ */
+static int exc_attach_slots(void)
+{
+	struct xdp_program *dispatcher, *prog = NULL;
+	struct xdp_exceptions *skel;
+	int ret, i = 0;
+
+	dispatcher = xdp_multiprog__main_prog(exc.mp);
+	exc.slots = calloc(xdp_multiprog__program_count(exc.mp),
+			   sizeof(*exc.slots));
+	if (!exc.slots)
+		return -ENOMEM;
+
+	while ((prog = xdp_multiprog__next_prog(prog, exc.mp))) {
+		skel = xdp_exceptions__open();
+		if (!skel)
+			return -errno;
+		exc.slots[exc.num_slots++] = skel;
+
+		skel->rodata->dispatcher_id = xdp_program__id(dispatcher);
+		skel->rodata->slot = i++;
+		skel->rodata->slot_prog_id = xdp_program__id(prog);
+		bpf_program__set_autoload(skel->progs.xdp_exc_trace, false);
+
+		ret = bpf_map__reuse_fd(skel->maps.exc_cnt,
+					bpf_map__fd(exc.skel->maps.exc_cnt));
+		if (!ret)
+			ret = bpf_map__reuse_fd(skel->maps.last_slot,
+						bpf_map__fd(exc.skel->maps.last_slot));
+		if (!ret)
+			ret = bpf_program__set_attach_target(skel->progs.xdp_exc_slot,
+							     xdp_program__fd(prog),
+							     xdp_program__name(prog));
+		if (!ret)
+			ret = xdp_exceptions__load(skel);
+		if (!ret)
+			ret = xdp_exceptions__attach(skel);
+		if (ret < 0) {
+			pr_warn("Failed to attach exception probe to %s: %s\n",
+				xdp_program__name(prog), strerror(-ret));
+			return ret;
+		}
+	}
+	return 0;
+}
+
+int exceptions_attach(int ifindex)
+{
+	struct xdp_exceptions *skel;
+	int ret;
+
+	skel = xdp_exceptions__open();
+	if (!skel) {
+		ret = -errno;
+		pr_warn("Failed to xdp_exceptions__open: %s\n", strerror(-ret));
+		return ret;
+	}
+	exc.skel = skel;
+	bpf_program__set_autoload(skel->progs.xdp_exc_slot, false);
+
+	ret = xdp_exceptions__load(skel);
+	if (ret < 0) {
+		pr_warn("Failed to load exception tracing: %s\n", strerror(-ret));
+		goto err;
+	}
+
+	ret = xdp_exceptions__attach(skel);
+	if (ret < 0) {
+		pr_warn("Failed to attach exception tracing: %s\n", strerror(-ret));
+		goto err;
+	}
+
+	if (ifindex) {
+		exc.mp = xdp_multiprog__get_from_ifindex(ifindex);
+		if (IS_ERR_OR_NULL(exc.mp)) {
+			pr_warn("No XDP program loaded on ifindex %d\n", ifindex);
+			exc.mp = NULL;
+			ret = -ENOENT;
+			goto err;
+		}
+		if (!xdp_multiprog__is_legacy(exc.mp)) {
+			ret = exc_attach_slots();
+			if (ret < 0)
+				goto err;
+		}
+	}
+
+	exc.nr_cpus = libbpf_num_possible_cpus();
+	exc.entries = calloc(EXC_MAP_SIZE, sizeof(*exc.entries));
+	exc.percpu = calloc(exc.nr_cpus, sizeof(*exc.percpu));
+	if (!exc.entries || !exc.percpu) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &exc.prev_ts);
+
+	ret = sample_add_print_cb(exc_print, NULL);
+	if (ret < 0)
+		goto err;
+	return 0;
+
+err:
+	exceptions_detach();
+	return ret;
+}
+
+void exceptions_detach(void)
+{
+	int i;
+
+	for (i = 0; i < exc.num_slots; i++)
+		xdp_exceptions__destroy(exc.slots[i]);
+	free(exc.slots);
+	free(exc.entries);
+	free(exc.percpu);
+	xdp_exceptions__destroy(exc.skel);
+	xdp_multiprog__close(exc.mp);
+	memset(&exc, 0, sizeof(exc));
+}
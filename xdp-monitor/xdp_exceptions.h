@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef _XDP_EXCEPTIONS_H
+#define _XDP_EXCEPTIONS_H
+
+/* Shared between the exception tracing BPF program and userspace, which each
+ * get the __u types from their own headers.
+ */
+
+#define EXC_MAP_SIZE 1024
+#define EXC_SLOT_NONE ((__u32)-1)
+
+struct exc_key {
+	__u32 prog_id;		/* the component program if slot is set */
+	__u32 ifindex;
+	__u32 action;		/* above XDP_REDIRECT means unknown */
+	__u32 slot;		/* dispatcher slot, or EXC_SLOT_NONE */
+};
+
+int exceptions_attach(int ifindex);
+void exceptions_detach(void);
+
+#endif
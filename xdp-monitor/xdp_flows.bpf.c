@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Per-flow packet, byte and drop counters, taken by an fexit probe on the XDP
+ * program (or dispatcher) attached to an interface, so the verdict is known.
+ * Userspace sets the attach target before loading, and drains the map on
+ * every interval into a bounded top-N summary.
+ */
+#include <bpf/vmlinux.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_helpers.h>
+
+#include "xdp_flows.h"
+
+#define ETH_P_IP 0x0800
+#define ETH_P_IPV6 0x86DD
+#define ETH_P_8021Q 0x8100
+#define ETH_P_8021AD 0x88A8
+#define IP_OFFSET 0x1FFF
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define bpf_htons(x)		__builtin_bswap16(x)
+#define bpf_htonl(x)		__builtin_bswap32(x)
+#else
+#define bpf_htons(x)		(x)
+#define bpf_htonl(x)		(x)
+#endif
+
+/* Only sample one in this many packets */
+const volatile __u32 sample_every = 1;
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__uint(max_entries, FLOWS_MAP_SIZE);
+	__type(key, struct flow_key);
+	__type(value, struct flow_val);
+} flows SEC(".maps");
+
+struct vlan_tag {
+	__be16 tci;
+	__be16 proto;
+};
+
+/* The packet is only reachable as kernel memory from here, so the headers are
+ * copied out one by one.
+ */
+static __always_inline int parse_flow(void *data, void *data_end,
+				      struct flow_key *key)
+{
+	__u32 off = sizeof(struct ethhdr);
+	struct vlan_tag vlan;
+	struct ipv6hdr ip6h;
+	struct ethhdr eth;
+	struct iphdr iph;
+	__u16 ports[2];
+	__u16 proto;
+
+	if (data + off > data_end ||
+	    bpf_probe_read_kernel(&eth, sizeof(eth), data))
+		return -1;
+	proto = eth.h_proto;
+
+	if (proto == bpf_htons(ETH_P_8021Q) || proto == bpf_htons(ETH_P_8021AD)) {
+		if (data + off + sizeof(vlan) > data_end ||
+		    bpf_probe_read_kernel(&vlan, sizeof(vlan), data + off))
+			return -1;
+		proto = vlan.proto;
+		off += sizeof(vlan);
+	}
+	key->l3_proto = proto;
+
+	if (proto == bpf_htons(ETH_P_IP)) {
+		if (data + off + sizeof(iph) > data_end ||
+		    bpf_probe_read_kernel(&iph, sizeof(iph), data + off))
+			return 0;
+		key->saddr[2] = key->daddr[2] = bpf_htonl(0xffff);
+		key->saddr[3] = iph.saddr;
+		key->daddr[3] = iph.daddr;
+		key->l4_proto = iph.protocol;
+		/* Later fragments have no ports */
+		if (iph.frag_off & bpf_htons(IP_OFFSET))
+			return 0;
+		off += iph.ihl * 4;
+	} else if (proto == bpf_htons(ETH_P_IPV6)) {
+		if (data + off + sizeof(ip6h) > data_end ||
+		    bpf_probe_read_kernel(&ip6h, sizeof(ip6h), data + off))
+			return 0;
+		__builtin_memcpy(key->saddr, &ip6h.saddr, sizeof(key->saddr));
+		__builtin_memcpy(key->daddr, &ip6h.daddr, sizeof(key->daddr));
+		key->l4_proto = ip6h.nexthdr;
+		off += sizeof(ip6h);
+	} else {
+		return 0;
+	}
+
+	if (key->l4_proto != IPPROTO_TCP && key->l4_proto != IPPROTO_UDP &&
+	    key->l4_proto != IPPROTO_SCTP)
+		return 0;
+
+	if (data + off + sizeof(ports) > data_end ||
+	    bpf_probe_read_kernel(ports, sizeof(ports), data + off))
+		return 0;
+	key->sport = ports[0];
+	key->dport = ports[1];
+	return 0;
+}
+
+SEC("fexit/func")
+int BPF_PROG(xdp_flows_exit, struct xdp_buff *xdp, int ret)
+{
+	struct flow_val *val, init = {};
+	struct flow_key key = {};
+	void *data, *data_end;
+
+	if (sample_every > 1 && bpf_get_prandom_u32() % sample_every)
+		return 0;
+
+	data = xdp->data;
+	data_end = xdp->data_end;
+	if (parse_flow(data, data_end, &key))
+		return 0;
+
+	val = bpf_map_lookup_elem(&flows, &key);
+	if (!val) {
+		bpf_map_update_elem(&flows, &key, &init, BPF_NOEXIST);
+		val = bpf_map_lookup_elem(&flows, &key);
+		if (!val)
+			return 0;
+	}
+
+	val->pkts++;
+	val->bytes += data_end - data;
+	if (ret == XDP_DROP || ret == XDP_ABORTED)
+		val->drops++;
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,301 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Top talkers of an interface, printed next to the tracepoint counters.
+ *
+ * The BPF side counts packets per flow in an LRU hash, which is drained on
+ * every interval. The flows seen are folded into a Space-Saving summary with
+ * a fixed number of slots: a new flow takes over the slot of the smallest
+ * one and inherits its count, so a flow can overstate but never understate
+ * its total. This keeps memory bounded no matter how many flows there are,
+ * while a heavy hitter is never evicted.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <linux/if_ether.h>
+#include <xdp/libxdp.h>
+
+#include <xdp_sample.h>
+#include "xdp_flows.h"
+#include "xdp_flows.skel.h"
+#include "logging.h"
+#include "util.h"
+
+/* Summary slots per flow shown */
+#define FLOWS_SLOTS_PER_TOP 8
+
+struct flow_slot {
+	struct flow_key key;
+	struct flow_val total;
+	struct flow_val cur;	/* this interval */
+	bool used;
+};
+
+static struct {
+	struct xdp_flows *skel;
+	struct xdp_multiprog *mp;
+	struct flow_slot *slots;
+	struct flow_slot **sorted;
+	struct flow_key *keys;
+	struct flow_val *percpu;
+	__u32 num_slots;
+	__u32 top;
+	__u32 sample_every;
+	int nr_cpus;
+	struct timespec prev_ts;
+} flows;
+
+static void flows_account(const struct flow_key *key, const struct flow_val *v)
+{
+	struct flow_slot *s, *min = NULL, *free_slot = NULL;
+	__u32 i;
+
+	for (i = 0; i < flows.num_slots; i++) {
+		s = &flows.slots[i];
+		if (!s->used) {
+			if (!free_slot)
+				free_slot = s;
+			continue;
+		}
+		if (!memcmp(&s->key, key, sizeof(*key)))
+			goto add;
+		if (!min || s->total.pkts < min->total.pkts)
+			min = s;
+	}
+
+	if (free_slot) {
+		s = free_slot;
+		memset(s, 0, sizeof(*s));
+		s->used = true;
+	} else {
+		s = min;
+		memset(&s->cur, 0, sizeof(s->cur));
+	}
+	s->key = *key;
+
+add:
+	s->total.pkts += v->pkts;
+	s->total.bytes += v->bytes;
+	s->total.drops += v->drops;
+	s->cur.pkts += v->pkts;
+	s->cur.bytes += v->bytes;
+	s->cur.drops += v->drops;
+}
+
+/* Move the counts out of the BPF map. Packets counted between the lookup and
+ * the delete of a flow are lost, which is fine for a sampler.
+ */
+static void flows_drain(void)
+{
+	int fd = bpf_map__fd(flows.skel->maps.flows);
+	__u32 num = 0, i;
+	struct flow_val v;
+	int cpu;
+
+	while (num < FLOWS_MAP_SIZE &&
+	       !bpf_map_get_next_key(fd, num ? &flows.keys[num - 1] : NULL,
+				     &flows.keys[num]))
+		num++;
+
+	for (i = 0; i < num; i++) {
+		if (bpf_map_lookup_elem(fd, &flows.keys[i], flows.percpu))
+			continue;
+		bpf_map_delete_elem(fd, &flows.keys[i]);
+
+		memset(&v, 0, sizeof(v));
+		for (cpu = 0; cpu < flows.nr_cpus; cpu++) {
+			v.pkts += flows.percpu[cpu].pkts * flows.sample_every;
+			v.bytes += flows.percpu[cpu].bytes * flows.sample_every;
+			v.drops += flows.percpu[cpu].drops * flows.sample_every;
+		}
+		flows_account(&flows.keys[i], &v);
+	}
+}
+
+static int cmp_slots(const void *a, const void *b)
+{
+	const struct flow_slot *x = *(const struct flow_slot **)a;
+	const struct flow_slot *y = *(const struct flow_slot **)b;
+
+	if (x->cur.pkts != y->cur.pkts)
+		return x->cur.pkts < y->cur.pkts ? 1 : -1;
+	return 0;
+}
+
+static void format_addr(char *buf, size_t len, const __u32 *addr)
+{
+	if (!addr[0] && !addr[1] && addr[2] == htonl(0xffff))
+		inet_ntop(AF_INET, &addr[3], buf, len);
+	else
+		inet_ntop(AF_INET6, addr, buf, len);
+}
+
+static void format_flow(char *buf, size_t len, const struct flow_key *key)
+{
+	char saddr[INET6_ADDRSTRLEN], daddr[INET6_ADDRSTRLEN];
+	const char *proto;
+
+	if (key->l3_proto != htons(ETH_P_IP) && key->l3_proto != htons(ETH_P_IPV6)) {
+		snprintf(buf, len, "ethertype 0x%04x", ntohs(key->l3_proto));
+		return;
+	}
+
+	format_addr(saddr, sizeof(saddr), key->saddr);
+	format_addr(daddr, sizeof(daddr), key->daddr);
+
+	switch (key->l4_proto) {
+	case IPPROTO_TCP:
+		proto = "tcp";
+		break;
+	case IPPROTO_UDP:
+		proto = "udp";
+		break;
+	case IPPROTO_SCTP:
+		proto = "sctp";
+		break;
+	default:
+		snprintf(buf, len, "proto %u %s->%s", key->l4_proto, saddr, daddr);
+		return;
+	}
+
+	snprintf(buf, len, "%s %s:%u->%s:%u", proto, saddr, ntohs(key->sport),
+		 daddr, ntohs(key->dport));
+}
+
+static void flows_print(__unused void *ctx)
+{
+	struct datarec rates = {};
+	struct timespec now;
+	char flow[128];
+	__u32 i, num = 0;
+	double period;
+	__u64 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	period = (now.tv_sec - flows.prev_ts.tv_sec) +
+		 (now.tv_nsec - flows.prev_ts.tv_nsec) / 1e9;
+	flows.prev_ts = now;
+
+	flows_drain();
+
+	for (i = 0; i < flows.num_slots; i++)
+		if (flows.slots[i].used && flows.slots[i].cur.pkts)
+			flows.sorted[num++] = &flows.slots[i];
+	qsort(flows.sorted, num, sizeof(*flows.sorted), cmp_slots);
+	num = min(num, flows.top);
+
+	ts = (__u64)now.tv_sec * 1000000000 + now.tv_nsec;
+	if (sample_output_is_text() && num) {
+		if (flows.sample_every > 1)
+			printf("Top flows (sampling 1 in %u packets)\n",
+			       flows.sample_every);
+		else
+			printf("Top flows\n");
+	}
+
+	for (i = 0; period > 0 && i < num; i++) {
+		struct flow_slot *s = flows.sorted[i];
+
+		format_flow(flow, sizeof(flow), &s->key);
+		if (sample_output_is_text()) {
+			printf("  %-48s %'12.0f pkt/s %'10.1f Mbit/s %'12.0f drop/s\n",
+			       flow, s->cur.pkts / period,
+			       s->cur.bytes * 8 / period / 1000000,
+			       s->cur.drops / period);
+		} else {
+			rates.processed = s->cur.pkts / period;
+			rates.dropped = s->cur.drops / period;
+			rates.info = s->cur.bytes / period;
+			sample_print_row("flow", flow, -1, ts, &rates);
+		}
+	}
+
+	for (i = 0; i < flows.num_slots; i++)
+		memset(&flows.slots[i].cur, 0, sizeof(flows.slots[i].cur));
+
+	if (!sample_output_is_text())
+		fflush(stdout);
+}
+
+int flows_attach(int ifindex, __u32 top, __u32 sample_every)
+{
+	struct xdp_program *prog;
+	struct xdp_flows *skel;
+	int ret;
+
+	flows.mp = xdp_multiprog__get_from_ifindex(ifindex);
+	if (IS_ERR_OR_NULL(flows.mp)) {
+		pr_warn("No XDP program loaded on ifindex %d\n", ifindex);
+		flows.mp = NULL;
+		return -ENOENT;
+	}
+	prog = xdp_multiprog__main_prog(flows.mp);
+
+	skel = xdp_flows__open();
+	if (!skel) {
+		ret = -errno;
+		pr_warn("Failed to xdp_flows__open: %s\n", strerror(-ret));
+		goto err;
+	}
+	flows.skel = skel;
+	skel->rodata->sample_every = sample_every;
+
+	ret = bpf_program__set_attach_target(skel->progs.xdp_flows_exit,
+					     xdp_program__fd(prog),
+					     xdp_program__name(prog));
+	if (ret < 0) {
+		pr_warn("Failed to set flow sampler target: %s\n", strerror(-ret));
+		goto err;
+	}
+
+	ret = xdp_flows__load(skel);
+	if (ret < 0) {
+		pr_warn("Failed to load flow sampler: %s\n", strerror(-ret));
+		goto err;
+	}
+
+	ret = xdp_flows__attach(skel);
+	if (ret < 0) {
+		pr_warn("Failed to attach flow sampler: %s\n", strerror(-ret));
+		goto err;
+	}
+
+	flows.top = top;
+	flows.sample_every = sample_every;
+	flows.num_slots = top * FLOWS_SLOTS_PER_TOP;
+	flows.nr_cpus = libbpf_num_possible_cpus();
+	flows.slots = calloc(flows.num_slots, sizeof(*flows.slots));
+	flows.sorted = calloc(flows.num_slots, sizeof(*flows.sorted));
+	flows.keys = calloc(FLOWS_MAP_SIZE, sizeof(*flows.keys));
+	flows.percpu = calloc(flows.nr_cpus, sizeof(*flows.percpu));
+	if (!flows.slots || !flows.sorted || !flows.keys || !flows.percpu) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &flows.prev_ts);
+
+	ret = sample_add_print_cb(flows_print, NULL);
+	if (ret < 0)
+		goto err;
+	return 0;
+
+err:
+	flows_detach();
+	return ret;
+}
+
+void flows_detach(void)
+{
+	free(flows.slots);
+	free(flows.sorted);
+	free(flows.keys);
+	free(flows.percpu);
+	xdp_flows__destroy(flows.skel);
+	xdp_multiprog__close(flows.mp);
+	memset(&flows, 0, sizeof(flows));
+}
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef _XDP_FLOWS_H
+#define _XDP_FLOWS_H
+
+/* Shared between the flow sampler BPF program and userspace, which each get
+ * the __u types from their own headers.
+ */
+
+#define FLOWS_MAP_SIZE 16384
+
+struct flow_key {
+	__u32 saddr[4];		/* IPv4 addresses are stored as ::ffff:a.b.c.d */
+	__u32 daddr[4];
+	__u16 sport;		/* network byte order, like the addresses */
+	__u16 dport;
+	__u16 l3_proto;		/* Ethertype, network byte order */
+	__u8 l4_proto;
+	__u8 pad;
+};
+
+struct flow_val {
+	__u64 pkts;
+	__u64 bytes;
+	__u64 drops;		/* XDP_DROP and XDP_ABORTED verdicts */
+};
+
+int flows_attach(int ifindex, __u32 top, __u32 sample_every);
+void flows_detach(void);
+
+#endif
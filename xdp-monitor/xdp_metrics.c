@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0
+/* Metrics of other tools' pinned stats maps, added to the OpenMetrics output
+ * of --serve. This lives apart from xdp-monitor.c, as the stats map layout
+ * clashes with the xdp_sample definitions.
+ */
+#include <limits.h>
+#include <unistd.h>
+
+#include "xdp_metrics.h"
+#include "stats.h"
+#include "util.h"
+#include "logging.h"
+
+static const char *pinned_stats_progs[] = { "xdp-filter" };
+
+/* The map is opened on every scrape, as reloading the tool replaces it */
+void metrics_print_pinned(FILE *f, __unused void *ctx)
+{
+	char pin_root[PATH_MAX];
+	size_t i;
+	int fd;
+
+	for (i = 0; i < ARRAY_SIZE(pinned_stats_progs); i++) {
+		if (get_bpf_root_dir(pin_root, sizeof(pin_root),
+				     pinned_stats_progs[i], false))
+			continue;
+
+		fd = get_pinned_map_fd(pin_root, textify(XDP_STATS_MAP_NAME), NULL);
+		if (fd < 0)
+			continue;
+
+		if (stats_print_openmetrics(f, fd, pinned_stats_progs[i]))
+			pr_debug("Couldn't read the stats of %s\n",
+				 pinned_stats_progs[i]);
+		close(fd);
+	}
+}
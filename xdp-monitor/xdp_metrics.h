@@ -0,0 +1,9 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef _XDP_METRICS_H
+#define _XDP_METRICS_H
+
+#include <stdio.h>
+
+void metrics_print_pinned(FILE *f, void *ctx);
+
+#endif